@@ -0,0 +1,384 @@
+// Compile latency and cache efficiency of the JIT of the gradient search:
+// random comparison ASTs of a few sizes are JIT'ed one function each, and
+// so are the constraints of the tasks the mutator saved with
+// SYMSAN_CAPTURE_TASKS (see task_file.h), if any are given.
+//
+//   $ jit-bench [-n count] [-s 4,8,16,32,64,128] [-t fast|default|optimized]
+//               [-S seed] [-o out.json] [tasks.bin...]
+//
+// It reports, per AST size (in nodes), the functions compiled, the mean,
+// p50 and p99 latency of addFunction (emitting the IR and handing the
+// module to ORC) and the mean of performJit (the lookup, which
+// materializes the module), the bytes of code per function, and the cost
+// of the cache's key: AstShapes::intern, which the JIT cache is keyed by,
+// and the isEqualAst walk it replaced. For the captured tasks, it also
+// reports the hit rate the cache would see with no budget, as only the
+// first constraint of each shape is compiled.
+
+#include "dfsan/dfsan.h"
+
+#include "ast.h"
+#include "task.h"
+#include "solver.h"
+#include "task_file.h"
+#include "jigsaw/jit.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace __dfsan;
+
+// the ASTs are self-contained, there's no union table to look labels up in
+dfsan_label_info* __dfsan::get_label_info(dfsan_label label) {
+  throw std::out_of_range("no union table, label " + std::to_string(label));
+}
+
+dfsan_label_operands* __dfsan::get_label_operands(dfsan_label label) {
+  throw std::out_of_range("no union table, label " + std::to_string(label));
+}
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static size_t count_nodes(const rgd::AstNode &node) {
+  size_t n = 1;
+  for (uint32_t i = 0; i < node.children_size(); i++) {
+    n += count_nodes(node.children(i));
+  }
+  return n;
+}
+
+// random ASTs hashed and with their arguments mapped as the RGD parser
+// would (see map_arg), over the first kInputBytes bytes of an input
+static const uint32_t kInputBytes = 64;
+
+struct ast_gen_t {
+  std::mt19937_64 rng;
+  rgd::Constraint *c;
+
+  uint32_t pick(uint32_t n) { return (uint32_t)(rng() % n); }
+
+  void leaf(rgd::AstNode *node, uint16_t bits) {
+    node->set_bits(bits);
+    if (pick(2)) {
+      uint32_t slot = (uint32_t)c->input_args.size();
+      c->input_args.push_back(std::make_pair(false, rng()));
+      c->const_num += 1;
+      node->set_kind(rgd::Constant);
+      node->set_index(slot);
+      node->set_hash(rgd::xxhash(bits, rgd::Constant, slot));
+      return;
+    }
+    uint32_t length = bits / 8;
+    uint32_t offset = pick(kInputBytes - length + 1);
+    uint32_t first = 0;
+    for (uint32_t i = 0; i < length; i++) {
+      uint32_t slot;
+      auto itr = c->local_map.find(offset + i);
+      if (itr == c->local_map.end()) {
+        slot = (uint32_t)c->input_args.size();
+        c->local_map[offset + i] = slot;
+        c->inputs.insert({offset + i, 0});
+        c->input_args.push_back(std::make_pair(true, 0));
+      } else {
+        slot = itr->second;
+      }
+      if (i == 0) first = slot;
+    }
+    node->set_kind(rgd::Read);
+    node->set_index(offset);
+    node->set_hash(rgd::xxhash(bits, rgd::Read, first));
+  }
+
+  // about budget nodes of bits wide under node
+  void expr(rgd::AstNode *node, uint32_t budget, uint16_t bits) {
+    static const uint16_t ops[] = {
+      rgd::Add, rgd::Sub, rgd::Mul, rgd::And, rgd::Or, rgd::Xor,
+      rgd::Shl, rgd::LShr,
+    };
+    if (budget < 3) {
+      leaf(node, bits);
+      return;
+    }
+    if (bits > 8 && pick(8) == 0) {
+      node->set_kind(rgd::ZExt);
+      node->set_bits(bits);
+      rgd::AstNode *child = node->add_children();
+      expr(child, budget - 1, bits / 2);
+      node->set_hash(rgd::xxhash(bits, rgd::ZExt, child->hash()));
+      return;
+    }
+    uint16_t kind = ops[pick(sizeof(ops) / sizeof(ops[0]))];
+    uint32_t left = 1 + pick(budget - 2);
+    node->set_kind(kind);
+    node->set_bits(bits);
+    rgd::AstNode *l = node->add_children();
+    rgd::AstNode *r = node->add_children();
+    expr(l, left, bits);
+    expr(r, budget - 1 - left, bits);
+    node->set_hash(rgd::xxhash(l->hash(), (kind << 16) | bits, r->hash()));
+  }
+
+  std::shared_ptr<rgd::Constraint> comparison(uint32_t budget) {
+    static const uint16_t widths[] = {8, 16, 32, 64};
+    // room for the ZExts and the leaves past the budget
+    auto cons = std::make_shared<rgd::Constraint>(2 * budget + 4);
+    c = cons.get();
+    rgd::AstNode *root = cons->ast.get();
+    uint16_t kind = rgd::Equal + pick(rgd::Sge - rgd::Equal + 1);
+    uint16_t bits = widths[pick(4)];
+    root->set_kind(kind);
+    root->set_bits(1);
+    rgd::AstNode *l = root->add_children();
+    rgd::AstNode *r = root->add_children();
+    uint32_t left = budget > 2 ? 1 + pick(budget - 2) : 1;
+    expr(l, left, bits);
+    expr(r, budget > left + 1 ? budget - 1 - left : 1, bits);
+    root->set_hash(rgd::xxhash(l->hash(), (rgd::Bool << 16) | 1, r->hash()));
+    return cons;
+  }
+};
+
+struct bucket_t {
+  size_t max_nodes;
+  std::vector<uint64_t> compile_ns;
+  uint64_t lookup_ns = 0;
+  uint64_t code_bytes = 0;
+  uint64_t intern_ns = 0;
+  uint64_t equal_ns = 0;
+  uint64_t failed = 0;
+
+  size_t count() const { return compile_ns.size(); }
+
+  uint64_t quantile(double q) const {
+    if (compile_ns.empty()) return 0;
+    return compile_ns[(size_t)(q * (compile_ns.size() - 1))];
+  }
+
+  double mean(uint64_t sum) const {
+    return compile_ns.empty() ? 0 : (double)sum / compile_ns.size();
+  }
+};
+
+struct bench_t {
+  rgd::jit_tier_t tier = rgd::JIT_TIER_DEFAULT;
+  uint64_t next_id = 1;
+  // by their largest size, the ones with more nodes than the last one go
+  // to the last one; the random ASTs and the captured ones apart
+  std::vector<bucket_t> generated;
+  std::vector<bucket_t> captured;
+  // the code is kept until the end, as the solver's cache would
+  std::vector<rgd::jit_code_t> code;
+  // of the captured constraints
+  std::unordered_set<uint32_t> shapes;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+
+  static bucket_t& bucket(std::vector<bucket_t> &buckets, size_t nodes) {
+    for (auto &b : buckets) {
+      if (nodes <= b.max_nodes) return b;
+    }
+    return buckets.back();
+  }
+
+  // compiles the constraint on its own, as the JIT solver does on a miss
+  void compile(rgd::Constraint const& c, std::vector<bucket_t> &buckets) {
+    const rgd::AstNode *root = c.get_root();
+    bucket_t &b = bucket(buckets, count_nodes(*root));
+
+    uint64_t start = now_ns();
+    uint32_t shape = rgd::AstShapes::global().intern(*root);
+    b.intern_ns += now_ns() - start;
+    (void)shape;
+    start = now_ns();
+    bool equal = rgd::isEqualAst(*root, *root);
+    b.equal_ns += now_ns() - start;
+    (void)equal;
+
+    size_t before = rgd::jitCodeSize();
+    rgd::jit_code_t module;
+    bool batched = false;
+    uint64_t id = next_id++;
+    start = now_ns();
+    if (rgd::addFunction(root, c.local_map, id, &batched, &module, tier) != 0) {
+      b.failed++;
+      return;
+    }
+    uint64_t added = now_ns();
+    rgd::test_fn_type fn = rgd::performJit(id);
+    uint64_t done = now_ns();
+    if (!fn) {
+      b.failed++;
+      return;
+    }
+    b.compile_ns.push_back(added - start);
+    b.lookup_ns += done - added;
+    size_t after = rgd::jitCodeSize();
+    b.code_bytes += after > before ? after - before : 0;
+    code.push_back(std::move(module));
+  }
+
+  void finish() {
+    for (auto *buckets : {&generated, &captured}) {
+      for (auto &b : *buckets) {
+        std::sort(b.compile_ns.begin(), b.compile_ns.end());
+      }
+    }
+    code.clear();
+  }
+};
+
+static void report_buckets(FILE *f, const char *name,
+                           std::vector<bucket_t> const& buckets, bool json) {
+  if (!json) {
+    fprintf(f, "%-10s %8s %8s %10s %10s %10s %10s %10s %10s %10s\n",
+            name, "fns", "failed", "add(us)", "p50(us)", "p99(us)",
+            "lookup(us)", "bytes/fn", "intern(ns)", "equal(ns)");
+  } else {
+    fprintf(f, "  \"%s\": [\n", name);
+  }
+  for (size_t i = 0; i < buckets.size(); i++) {
+    auto const& b = buckets[i];
+    uint64_t sum = std::accumulate(b.compile_ns.begin(), b.compile_ns.end(),
+                                   (uint64_t)0);
+    if (!json) {
+      fprintf(f, "<=%-8zu %8zu %8lu %10.1f %10.1f %10.1f %10.1f %10.0f %10.0f %10.0f\n",
+              b.max_nodes, b.count(), b.failed, b.mean(sum) / 1000,
+              b.quantile(0.5) / 1000.0, b.quantile(0.99) / 1000.0,
+              b.mean(b.lookup_ns) / 1000, b.mean(b.code_bytes),
+              b.mean(b.intern_ns), b.mean(b.equal_ns));
+      continue;
+    }
+    fprintf(f, "    {\"max_nodes\": %zu, \"functions\": %zu, \"failed\": %lu, "
+            "\"add_mean_us\": %.1f, \"add_p50_us\": %.1f, \"add_p99_us\": %.1f, "
+            "\"lookup_mean_us\": %.1f, \"bytes_per_fn\": %.0f, "
+            "\"intern_ns\": %.0f, \"equal_ns\": %.0f}%s\n",
+            b.max_nodes, b.count(), b.failed, b.mean(sum) / 1000,
+            b.quantile(0.5) / 1000.0, b.quantile(0.99) / 1000.0,
+            b.mean(b.lookup_ns) / 1000, b.mean(b.code_bytes),
+            b.mean(b.intern_ns), b.mean(b.equal_ns),
+            i + 1 < buckets.size() ? "," : "");
+  }
+  if (json) fprintf(f, "  ],\n");
+}
+
+static void report(FILE *f, bench_t const& bench, const char *tier, bool json) {
+  uint64_t lookups = bench.hits + bench.misses;
+  if (json) fprintf(f, "{\n  \"tier\": \"%s\",\n", tier);
+  report_buckets(f, "generated", bench.generated, json);
+  if (lookups) report_buckets(f, "captured", bench.captured, json);
+  if (json) {
+    fprintf(f, "  \"hits\": %lu,\n  \"misses\": %lu\n}\n",
+            bench.hits, bench.misses);
+  } else if (lookups) {
+    fprintf(f, "captured constraints %lu, cache hits %lu (%.1f%%), misses %lu\n",
+            lookups, bench.hits, 100.0 * bench.hits / lookups, bench.misses);
+  }
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-n count] [-s sizes] [-t fast|default|optimized] [-S seed] "
+          "[-o out.json] [task_file...]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  bench_t bench;
+  size_t count = 100;
+  std::string size_list = "4,8,16,32,64,128";
+  const char *tier = "default";
+  uint64_t seed = 0;
+  const char *json_out = nullptr;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:t:S:o:")) != -1) {
+    switch (opt) {
+      case 'n': count = strtoul(optarg, nullptr, 0); break;
+      case 's': size_list = optarg; break;
+      case 't': tier = optarg; break;
+      case 'S': seed = strtoull(optarg, nullptr, 0); break;
+      case 'o': json_out = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (!strcmp(tier, "fast")) bench.tier = rgd::JIT_TIER_FAST;
+  else if (!strcmp(tier, "optimized")) bench.tier = rgd::JIT_TIER_OPTIMIZED;
+  else if (strcmp(tier, "default")) usage(argv[0]);
+
+  size_t pos = 0;
+  while (pos <= size_list.size()) {
+    size_t comma = size_list.find(',', pos);
+    if (comma == std::string::npos) comma = size_list.size();
+    std::string size = size_list.substr(pos, comma - pos);
+    pos = comma + 1;
+    if (size.empty()) continue;
+    bench.generated.emplace_back();
+    bench.generated.back().max_nodes = strtoul(size.c_str(), nullptr, 0);
+  }
+  if (bench.generated.empty()) usage(argv[0]);
+  std::sort(bench.generated.begin(), bench.generated.end(),
+            [](bucket_t const& a, bucket_t const& b) {
+              return a.max_nodes < b.max_nodes;
+            });
+  bench.captured = bench.generated;
+
+  // sets up the JIT
+  rgd::JITSolver solver;
+
+  ast_gen_t gen{std::mt19937_64(seed), nullptr};
+  for (auto &b : bench.generated) {
+    // as many nodes as the bucket takes, the generator may add a few
+    uint32_t budget = std::max<size_t>(b.max_nodes, 3) - 2;
+    for (size_t i = 0; i < count; i++) {
+      auto c = gen.comparison(budget);
+      bench.compile(*c, bench.generated);
+    }
+  }
+
+  std::shared_ptr<rgd::SearchTask> task;
+  std::vector<uint8_t> input;
+  for (int i = optind; i < argc; i++) {
+    rgd::TaskFile::Reader file;
+    if (!file.open(argv[i])) {
+      fprintf(stderr, "Failed to open %s: %s\n", argv[i], strerror(errno));
+      return 1;
+    }
+    while (file.next(task, input)) {
+      for (auto const& c : task->constraints) {
+        uint32_t shape = rgd::AstShapes::global().intern(*c->get_root());
+        if (!bench.shapes.insert(shape).second) {
+          bench.hits++;
+          continue;
+        }
+        bench.misses++;
+        bench.compile(*c, bench.captured);
+      }
+    }
+  }
+  bench.finish();
+
+  report(stdout, bench, tier, false);
+  if (json_out) {
+    FILE *f = fopen(json_out, "w");
+    if (f) {
+      report(f, bench, tier, true);
+      fclose(f);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,189 @@
+// Microbenchmarks of the taint runtime hot paths, built with ko-clang so the
+// loads, stores and libc calls below go through the instrumentation:
+//
+//   $ env KO_USE_FASTGEN=1 ko-clang -O2 -o microbench microbench.c
+//   $ ./microbench [filter] > bench.json
+//
+// Each benchmark reports the wall time per operation, in a JSON layout close
+// to Google Benchmark's, so existing comparison scripts can read it. Without
+// an event pipe, the fastgen runtime drops the branch and memcmp events, so
+// only the taint propagation itself is measured.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+typedef uint32_t dfsan_label;
+
+// the runtime's interface, uninstrumented per the ABI list
+dfsan_label dfsan_union(dfsan_label l1, dfsan_label l2, uint16_t op,
+                        uint16_t size, uint64_t op1, uint64_t op2);
+dfsan_label dfsan_create_label(off_t offset);
+void dfsan_set_label(dfsan_label label, void *addr, size_t size);
+dfsan_label dfsan_read_label(const void *addr, size_t size);
+
+// llvm::Instruction::Add
+#define OP_ADD 13
+
+static volatile uint32_t sink;
+static const char *filter;
+static int first = 1;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int selected(const char *name) {
+  return !filter || strstr(name, filter);
+}
+
+static void report(const char *name, uint64_t iterations, uint64_t ns) {
+  printf("%s    {\"name\": \"%s\", \"iterations\": %llu, "
+         "\"real_time\": %.3f, \"time_unit\": \"ns\"}",
+         first ? "" : ",\n", name, (unsigned long long)iterations,
+         (double)ns / iterations);
+  first = 0;
+}
+
+static dfsan_label *input_labels(size_t n) {
+  dfsan_label *labels = malloc(n * sizeof(dfsan_label));
+  for (size_t i = 0; i < n; i++)
+    labels[i] = dfsan_create_label(i);
+  return labels;
+}
+
+// a new union node per call
+static void bm_union_new(uint64_t iters) {
+  if (!selected("union/new")) return;
+  dfsan_label *in = input_labels(1024);
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < iters; i++)
+    sink = dfsan_union(in[i & 1023], in[(i >> 10) & 1023], OP_ADD, 8, 0, i);
+  report("union/new", iters, now_ns() - start);
+  free(in);
+}
+
+// the union hashtable lookups of nodes already created, with the table
+// holding the given number of nodes
+static void bm_union_lookup(uint64_t fill, uint64_t iters) {
+  char name[64];
+  snprintf(name, sizeof(name), "union/lookup/%llu", (unsigned long long)fill);
+  if (!selected(name)) return;
+  dfsan_label *in = input_labels(1024);
+  for (uint64_t i = 0; i < fill; i++)
+    dfsan_union(in[i & 1023], in[(i >> 10) & 1023], OP_ADD, 8, 0, i + 1);
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < iters; i++) {
+    uint64_t k = i % fill;
+    sink = dfsan_union(in[k & 1023], in[(k >> 10) & 1023], OP_ADD, 8, 0, k + 1);
+  }
+  report(name, iters, now_ns() - start);
+  free(in);
+}
+
+// 4-byte loads of memory whose bytes share a label, or don't
+static void bm_load(int uniform, uint64_t iters) {
+  const char *name = uniform ? "union_load/fast" : "union_load/slow";
+  if (!selected(name)) return;
+  size_t n = 4096;
+  uint32_t *buf = calloc(n, sizeof(uint32_t));
+  dfsan_label *in = input_labels(n * 4);
+  if (uniform) {
+    for (size_t i = 0; i < n; i++)
+      dfsan_set_label(in[i], &buf[i], sizeof(uint32_t));
+  } else {
+    for (size_t i = 0; i < n * 4; i++)
+      dfsan_set_label(in[i], (uint8_t *)buf + i, 1);
+  }
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < iters; i++)
+    sink = buf[i & (n - 1)];
+  report(name, iters, now_ns() - start);
+  free(in);
+  free(buf);
+}
+
+// 4-byte stores of a labeled value
+static void bm_store(uint64_t iters) {
+  if (!selected("union_store")) return;
+  size_t n = 4096;
+  uint32_t *buf = calloc(n, sizeof(uint32_t));
+  uint32_t v = 0x41414141;
+  dfsan_set_label(dfsan_create_label(0), &v, sizeof(v));
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < iters; i++)
+    ((volatile uint32_t *)buf)[i & (n - 1)] = v;
+  report("union_store", iters, now_ns() - start);
+  sink = dfsan_read_label(buf, sizeof(uint32_t));
+  free(buf);
+}
+
+// labeling a large buffer, per byte
+static void bm_set_label(size_t size, int iters) {
+  if (!selected("set_label")) return;
+  uint8_t *buf = malloc(size);
+  dfsan_label l = dfsan_create_label(0);
+  uint64_t ns = 0;
+  for (int i = 0; i < iters; i++) {
+    // alternate labels, so every byte's shadow is written
+    uint64_t start = now_ns();
+    dfsan_set_label(i & 1 ? 0 : l, buf, size);
+    ns += now_ns() - start;
+  }
+  report("set_label/64M", (uint64_t)size * iters, ns);
+  free(buf);
+}
+
+// the memcpy and memcmp wrappers over labeled buffers
+static void bm_libc(size_t size, uint64_t iters) {
+  uint8_t *src = malloc(size), *dst = malloc(size);
+  memset(src, 'A', size);
+  dfsan_label *in = input_labels(size);
+  for (size_t i = 0; i < size; i++)
+    dfsan_set_label(in[i], src + i, 1);
+
+  if (selected("memcpy/4K")) {
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iters; i++) {
+      memcpy(dst, src, size);
+      sink = dst[i & (size - 1)];
+    }
+    report("memcpy/4K", iters, now_ns() - start);
+  }
+
+  if (selected("memcmp/4K")) {
+    memset(dst, 'A', size);
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iters; i++)
+      sink = memcmp(src, dst, size);
+    report("memcmp/4K", iters, now_ns() - start);
+  }
+
+  free(in);
+  free(src);
+  free(dst);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    filter = argv[1];
+
+  printf("{\n  \"context\": {\"executable\": \"%s\"},\n  \"benchmarks\": [\n", argv[0]);
+  bm_union_new(1 << 20);
+  bm_union_lookup(1 << 12, 1 << 22);
+  bm_union_lookup(1 << 16, 1 << 22);
+  bm_union_lookup(1 << 20, 1 << 22);
+  bm_load(1, 1 << 24);
+  bm_load(0, 1 << 22);
+  bm_store(1 << 24);
+  bm_set_label(64 << 20, 8);
+  bm_libc(4096, 1 << 14);
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,1015 @@
+// End-to-end throughput of the tracing and solving pipeline of the AFL++
+// mutator, without AFL++: every seed of a corpus is traced, its branches
+// are parsed into tasks, and every task goes to the solvers in the
+// mutator's order, I2S, JIT, then Z3 with -z.
+//
+//   $ env KO_USE_FASTGEN=1 ko-clang -o target.fg target.c
+//   $ symsan-bench [-r rounds] [-z] [-Z] [-o out.json] [-w trace_dir] target.fg corpus_dir
+//   $ symsan-bench -t [-r rounds] [-z] [-Z] [-o out.json] trace_dir
+//
+// It reports seeds traced, tasks parsed and tasks solved per second, and
+// the time spent per stage: spawn, trace (reading the events), scan (of
+// the union table), parse (the rest of parse_cond/parse_switch), JIT, the
+// gradient search (gd_entry), and Z3, with a latency histogram for each
+// stage timed per call.
+//
+// With -w, the run of each seed is also recorded to a trace file (see
+// trace_file.h); with -t, the traces of a directory are replayed instead of
+// running a target, so the parser and the solvers can be profiled on their
+// own. -Z uses the Z3 parser of fgtest instead of the RGD one.
+//
+// With -n, the corpus is run at each layer of the pipeline instead, to
+// size the cost of each one, with the same target built natively:
+//
+//   $ symsan-bench -n target.native [-r rounds] [-z] [-o out.json] target.fg corpus_dir
+//
+// native runs target.native, untraced runs target.fg with no taint source,
+// traced reads its events without parsing them, and solved is the whole
+// pipeline. Each layer runs in a process of its own, which reports the
+// runs per second, the slowdown against native, the peak RSS of the
+// targets and the peak of the union table resident after a run.
+//
+// With -N, the corpus is traced by n instances at once, each with a session
+// of its own, for each n of the list, to see where tracing on one host
+// stops scaling (the shm of each session, the spawns, the memory bandwidth):
+//
+//   $ symsan-bench -N 1,8,32,64 [-F] [-H] [-A] [-r rounds] [-o out.json] target.fg corpus_dir
+//
+// Each instance reads the events without parsing them, as the traced layer
+// of -n does, and they all start at once. It reports the traces per second
+// of all the instances and of one, against n times the rate of the first
+// n, the page faults per second of the instances and their targets, and
+// the peak RSS of an instance, of its targets and of its union table. -F
+// runs the targets from a forkserver, -H maps the union tables on huge
+// pages, and -A pins instance i to CPU i.
+
+#include "dfsan/dfsan.h"
+
+#include "ast.h"
+#include "task.h"
+#include "solver.h"
+#include "trace_file.h"
+
+extern "C" {
+#include "launch.h"
+}
+
+#include "parse-rgd.h"
+#include "parse-z3.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+
+using namespace __dfsan;
+
+static dfsan_label_info *__dfsan_label_info;
+static dfsan_label_operands *__dfsan_label_operands;
+static const size_t MAX_LABEL = uniontable_size /
+    (sizeof(dfsan_label_info) + sizeof(dfsan_label_operands));
+
+dfsan_label_info* __dfsan::get_label_info(dfsan_label label) {
+  if (label >= MAX_LABEL) {
+    throw std::out_of_range("label too large " + std::to_string(label));
+  }
+  return &__dfsan_label_info[label];
+}
+
+dfsan_label_operands* __dfsan::get_label_operands(dfsan_label label) {
+  if (label >= MAX_LABEL) {
+    throw std::out_of_range("label too large " + std::to_string(label));
+  }
+  return &__dfsan_label_operands[label];
+}
+
+static uint64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// total time and a log2 histogram of the latencies, in us
+struct stage_t {
+  static const int kBuckets = 32;
+  const char *name;
+  uint64_t count = 0;
+  uint64_t total_us = 0;
+  uint64_t hist[kBuckets] = {};
+
+  explicit stage_t(const char *name) : name(name) {}
+
+  void add(uint64_t us) {
+    count++;
+    total_us += us;
+    int b = 0;
+    while (us > 1 && b < kBuckets - 1) { us >>= 1; b++; }
+    hist[b]++;
+  }
+
+  // the latency under which a fraction q of the calls finished, as the
+  // upper bound of its bucket
+  uint64_t quantile(double q) const {
+    uint64_t n = 0;
+    for (int b = 0; b < kBuckets; b++) {
+      n += hist[b];
+      if (n >= q * count) return 1ULL << b;
+    }
+    return 1ULL << (kBuckets - 1);
+  }
+};
+
+enum {
+  SPAWN, TRACE, SCAN, PARSE, I2S, JIT, Z3, NUM_STAGES
+};
+
+static stage_t stages[NUM_STAGES] = {
+  stage_t("spawn"), stage_t("trace"), stage_t("scan"), stage_t("parse"),
+  stage_t("i2s"), stage_t("jit"), stage_t("z3"),
+};
+
+static uint64_t num_seeds = 0;
+static uint64_t num_tasks = 0;
+static uint64_t num_solved = 0;
+
+struct bench_t {
+  symsan_session_t *session = nullptr;
+  // one of the two parsers is used
+  std::unique_ptr<rgd::RGDAstParser> parser;
+  std::unique_ptr<symsan::Z3ParserSolver> z3parser;
+  z3::context context;
+  std::vector<std::shared_ptr<rgd::Solver>> solvers;
+  rgd::JITSolver *jit = nullptr;
+  std::vector<uint8_t> out_buf;
+  // the events of the trace being replayed, without a session
+  const uint8_t *replay_pos = nullptr;
+  const uint8_t *replay_end = nullptr;
+  // the events of the run and the largest label they refer to, when recording
+  bool recording = false;
+  std::vector<uint8_t> events;
+  dfsan_label max_label = 0;
+  // false to only read the events, for the traced layer of -n
+  bool parse = true;
+  std::vector<uint8_t> skipped;
+};
+
+// calls f on the parser in use
+template <typename F>
+static auto with_parser(bench_t &b, F &&f) -> decltype(f(*b.parser)) {
+  if (b.z3parser) return f(*b.z3parser);
+  return f(*b.parser);
+}
+
+static ssize_t read_event(bench_t &b, void *buf, size_t size) {
+  if (!b.session) {
+    size_t n = std::min<size_t>(size, b.replay_end - b.replay_pos);
+    memcpy(buf, b.replay_pos, n);
+    b.replay_pos += n;
+    return n;
+  }
+  ssize_t n = symsan_session_read_event(b.session, buf, size, 0);
+  if (n > 0 && b.recording) {
+    b.events.insert(b.events.end(), (uint8_t*)buf, (uint8_t*)buf + n);
+  }
+  return n;
+}
+
+static void use_label(bench_t &b, dfsan_label label) {
+  if (label < MAX_LABEL && label > b.max_label) b.max_label = label;
+}
+
+static void solve_tasks(bench_t &b, const std::vector<uint64_t> &ids,
+                        const std::vector<uint8_t> &seed) {
+  for (auto id : ids) {
+    if (b.z3parser) {
+      num_tasks++;
+      symsan::Z3ParserSolver::solution_t solutions;
+      uint64_t start = now_us();
+      b.z3parser->solve_task(id, 5000U, solutions);
+      stages[Z3].add(now_us() - start);
+      if (!solutions.empty()) num_solved++;
+      continue;
+    }
+    auto task = b.parser->retrieve_task(id);
+    if (!task) continue;
+    num_tasks++;
+    for (size_t i = 0; i < b.solvers.size(); i++) {
+      size_t out_size = 0;
+      uint64_t start = now_us();
+      auto ret = b.solvers[i]->solve(task, seed.data(), seed.size(),
+                                     b.out_buf.data(), out_size);
+      stages[I2S + i].add(now_us() - start);
+      if (ret == rgd::SOLVER_SAT) {
+        num_solved++;
+        break;
+      }
+    }
+  }
+}
+
+// times parse, taking the union table scans it did out of it
+template <typename F>
+static void timed_parse(bench_t &b, F &&parse) {
+  uint64_t scan = b.parser ? b.parser->scan_time() : 0;
+  uint64_t start = now_us();
+  parse();
+  uint64_t scan_us = b.parser ? b.parser->scan_time() - scan : 0;
+  if (b.parser) stages[SCAN].add(scan_us);
+  stages[PARSE].add(now_us() - start - scan_us);
+}
+
+// parses and solves the events of a run, live or replayed, on seed
+static void handle_events(bench_t &b, const std::vector<uint8_t> &seed) {
+  std::vector<symsan::input_t> inputs;
+  inputs.push_back({seed.data(), seed.size()});
+  if (b.parse) with_parser(b, [&](auto &p) { return p.restart(inputs); });
+  b.out_buf.resize(std::max<size_t>(seed.size(), 1) * 2);
+  num_seeds++;
+
+  pipe_msg msg;
+  switch_msg smsg;
+  gep_msg gmsg;
+  memcmp_msg mmsg;
+  memcmp_blob_msg bmsg;
+  std::vector<uint64_t> cases;
+  uint64_t busy_us = 0;
+  uint64_t start = now_us();
+  while (read_event(b, &msg, sizeof(msg)) == sizeof(msg)) {
+    uint64_t handle_start = now_us();
+    std::vector<uint64_t> ids;
+    std::vector<std::pair<uint32_t, uint64_t>> case_ids;
+    switch (msg.msg_type) {
+      case cond_type:
+        if (!b.parse) break;
+        use_label(b, msg.label);
+        timed_parse(b, [&] {
+          with_parser(b, [&](auto &p) {
+            return p.parse_cond(msg.label, msg.result, msg.flags & F_ADD_CONS, ids);
+          });
+        });
+        solve_tasks(b, ids, seed);
+        break;
+      case gep_type:
+        if (read_event(b, &gmsg, sizeof(gmsg)) != sizeof(gmsg))
+          break;
+        use_label(b, gmsg.ptr_label);
+        use_label(b, gmsg.index_label);
+        if (!b.parse || msg.label == 0 || msg.label == kInitializingLabel)
+          break;
+        timed_parse(b, [&] {
+          with_parser(b, [&](auto &p) {
+            return p.parse_gep(gmsg.ptr_label, gmsg.ptr, gmsg.index_label,
+                               gmsg.index, gmsg.num_elems, gmsg.elem_size,
+                               gmsg.current_offset, false, ids);
+          });
+        });
+        solve_tasks(b, ids, seed);
+        break;
+      case switch_type: {
+        if (read_event(b, &smsg, sizeof(smsg)) != sizeof(smsg))
+          break;
+        cases.resize(smsg.num_cases);
+        ssize_t size = smsg.num_cases * sizeof(uint64_t);
+        if (read_event(b, cases.data(), size) != size || !b.parse)
+          break;
+        use_label(b, smsg.label);
+        use_label(b, smsg.taken_label);
+        std::vector<uint32_t> targets;
+        for (uint32_t i = 0; i < cases.size(); i++) {
+          if (cases[i] != msg.result) targets.push_back(i);
+        }
+        if (smsg.taken_label) targets.push_back(cases.size());
+        timed_parse(b, [&] {
+          with_parser(b, [&](auto &p) {
+            return p.parse_switch(msg.label, msg.result, cases, targets,
+                                  smsg.taken_label, case_ids);
+          });
+        });
+        for (auto const& c : case_ids) ids.push_back(c.second);
+        solve_tasks(b, ids, seed);
+        break;
+      }
+      case memcmp_type: {
+        if (msg.label == 0 || msg.label >= MAX_LABEL)
+          break;
+        use_label(b, msg.label);
+        // no content if both operands are symbolic
+        dfsan_label_info *info = get_label_info(msg.label);
+        if (info->l1 != CONST_LABEL && info->l2 != CONST_LABEL)
+          break;
+        if (msg.flags & F_MEMCMP_BLOB) {
+          if (read_event(b, &bmsg, sizeof(bmsg)) != sizeof(bmsg) || !b.parse)
+            break;
+          const void *blob = symsan_session_get_blob(b.session, bmsg.offset, msg.result);
+          if (blob) {
+            with_parser(b, [&](auto &p) {
+              return p.record_memcmp_ref(msg.label, (const uint8_t*)blob);
+            });
+          }
+          break;
+        }
+        if (read_event(b, &mmsg, sizeof(mmsg)) != sizeof(mmsg))
+          break;
+        if (!b.parse) {
+          b.skipped.resize(msg.result);
+          read_event(b, b.skipped.data(), msg.result);
+          break;
+        }
+        uint8_t *content = with_parser(b, [&](auto &p) {
+          return p.memcmp_buffer(msg.result);
+        });
+        if (read_event(b, content, msg.result) == (ssize_t)msg.result) {
+          with_parser(b, [&](auto &p) {
+            return p.record_memcmp_ref(msg.label, content);
+          });
+        }
+        break;
+      }
+      default:
+        break;
+    }
+    busy_us += now_us() - handle_start;
+  }
+  // the time left is spent waiting on and reading the events
+  stages[TRACE].add(now_us() - start - busy_us);
+}
+
+static bool write_all(int fd, const void *buf, size_t size, off_t offset) {
+  const uint8_t *p = (const uint8_t*)buf;
+  while (size) {
+    ssize_t n = pwrite(fd, p, size, offset);
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+static uint64_t table_half(uint32_t num_labels) {
+  return trace_table_half(num_labels,
+      std::max(sizeof(dfsan_label_info), sizeof(dfsan_label_operands)));
+}
+
+// the labels up to the largest one the events refer to are enough, as the
+// operands of a label are always older than it
+static bool write_trace(bench_t &b, const char *path,
+                        const std::vector<uint8_t> &seed) {
+  trace_header h = {};
+  h.magic = TRACE_MAGIC;
+  h.version = TRACE_VERSION;
+  h.num_labels = b.max_label + 1;
+  uint64_t half = table_half(h.num_labels);
+  h.table_size = half * 2;
+  h.input_offset = TRACE_TABLE_OFFSET + h.table_size;
+  h.input_size = seed.size();
+  h.events_offset = h.input_offset + h.input_size;
+  h.events_size = b.events.size();
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) return false;
+  bool ok = write_all(fd, &h, sizeof(h), 0) &&
+      write_all(fd, __dfsan_label_info,
+                h.num_labels * sizeof(dfsan_label_info), TRACE_TABLE_OFFSET) &&
+      write_all(fd, __dfsan_label_operands,
+                h.num_labels * sizeof(dfsan_label_operands),
+                TRACE_TABLE_OFFSET + half) &&
+      write_all(fd, seed.data(), seed.size(), h.input_offset) &&
+      write_all(fd, b.events.data(), b.events.size(), h.events_offset) &&
+      ftruncate(fd, h.events_offset + h.events_size) == 0;
+  close(fd);
+  return ok;
+}
+
+static bool run_seed(bench_t &b, const std::vector<uint8_t> &seed, int input_fd) {
+  uint64_t start = now_us();
+  int ret = symsan_session_run(b.session, input_fd);
+  stages[SPAWN].add(now_us() - start);
+  if (ret != 0) {
+    fprintf(stderr, "Failed to launch target: %d\n", ret);
+    return false;
+  }
+  b.events.clear();
+  b.max_label = 0;
+  handle_events(b, seed);
+  return true;
+}
+
+// maps the table of the trace over the union table, where the parsers and
+// get_label_info look for it, and replays its events
+static bool replay_trace(bench_t &b, const char *path, void *table,
+                         std::vector<uint8_t> &seed) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0 || (size_t)st.st_size < TRACE_TABLE_OFFSET) {
+    if (fd != -1) close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void *file = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (file == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  auto h = (const trace_header*)file;
+  uint64_t half = h->table_size / 2;
+  bool valid = h->magic == TRACE_MAGIC && h->version == TRACE_VERSION &&
+      half == table_half(h->num_labels) && half <= uniontable_size / 2 &&
+      TRACE_TABLE_OFFSET + h->table_size <= size &&
+      h->input_offset <= size && h->input_size <= size - h->input_offset &&
+      h->events_offset <= size && h->events_size <= size - h->events_offset;
+  if (valid) {
+    void *info = mmap(table, half, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_FIXED, fd, TRACE_TABLE_OFFSET);
+    void *ops = mmap((char*)table + uniontable_size / 2, half,
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                     TRACE_TABLE_OFFSET + half);
+    valid = info != MAP_FAILED && ops != MAP_FAILED;
+  }
+  close(fd);
+  if (valid) {
+    const uint8_t *base = (const uint8_t*)file;
+    seed.assign(base + h->input_offset, base + h->input_offset + h->input_size);
+    b.replay_pos = base + h->events_offset;
+    b.replay_end = b.replay_pos + h->events_size;
+    handle_events(b, seed);
+  }
+  munmap(file, size);
+  return valid;
+}
+
+static void report(FILE *f, bench_t &b, uint64_t wall_us, bool json) {
+  double secs = (double)wall_us / 1000000;
+  if (!json) {
+    fprintf(f, "seeds: %lu (%.1f/s), tasks parsed: %lu (%.1f/s), solved: %lu (%.1f/s)\n",
+            num_seeds, num_seeds / secs, num_tasks, num_tasks / secs,
+            num_solved, num_solved / secs);
+    fprintf(f, "%-8s %10s %12s %10s %10s %10s\n",
+            "stage", "count", "total(ms)", "p50(us)", "p90(us)", "p99(us)");
+    for (auto const& st : stages) {
+      fprintf(f, "%-8s %10lu %12.1f %10lu %10lu %10lu\n", st.name, st.count,
+              st.total_us / 1000.0, st.quantile(0.5), st.quantile(0.9),
+              st.quantile(0.99));
+    }
+    if (b.jit) {
+      fprintf(f, "jit: %.1f ms compiling, %.1f ms in gd_entry\n",
+              b.jit->jit_us() / 1000.0, b.jit->search_us() / 1000.0);
+    }
+    return;
+  }
+  fprintf(f, "{\n  \"wall_us\": %lu, \"seeds\": %lu, \"tasks\": %lu, \"solved\": %lu,\n",
+          wall_us, num_seeds, num_tasks, num_solved);
+  if (b.jit) {
+    fprintf(f, "  \"jit_us\": %lu, \"gd_entry_us\": %lu,\n",
+            b.jit->jit_us(), b.jit->search_us());
+  }
+  fprintf(f, "  \"stages\": [\n");
+  for (int i = 0; i < NUM_STAGES; i++) {
+    auto const& st = stages[i];
+    fprintf(f, "    {\"name\": \"%s\", \"count\": %lu, \"total_us\": %lu, \"hist_log2_us\": [",
+            st.name, st.count, st.total_us);
+    for (int h = 0; h < stage_t::kBuckets; h++)
+      fprintf(f, "%s%lu", h ? ", " : "", st.hist[h]);
+    fprintf(f, "]}%s\n", i + 1 < NUM_STAGES ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+// regular files of a directory, sorted so runs are comparable
+static bool list_files(const char *path, std::vector<std::string> &files) {
+  DIR *dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  while (struct dirent *e = readdir(dir)) {
+    std::string file = std::string(path) + "/" + e->d_name;
+    struct stat st;
+    if (e->d_name[0] != '.' && stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      files.push_back(file);
+  }
+  closedir(dir);
+  std::sort(files.begin(), files.end());
+  return true;
+}
+
+// a session of target reading input; the memcmp contents are in the blob
+// area with blob, else inline
+static bool setup_session(bench_t &b, char *target, char *input, bool blob) {
+  b.session = symsan_session_new(target, uniontable_size);
+  if (!b.session) {
+    fprintf(stderr, "Failed to map shm: %s\n", strerror(errno));
+    return false;
+  }
+  char *args[3] = {target, input, nullptr};
+  symsan_session_set_input(b.session, input);
+  symsan_session_set_args(b.session, 2, args);
+  symsan_session_set_memcmp_blob(b.session, blob);
+  return true;
+}
+
+static void setup_parser(bench_t &b, void *table, bool z3_parser, bool use_z3) {
+  __dfsan_label_info = (dfsan_label_info *)table;
+  __dfsan_label_operands = get_label_operands_base(table, uniontable_size);
+  if (z3_parser) {
+    b.z3parser.reset(new symsan::Z3ParserSolver(table, uniontable_size, b.context));
+  } else {
+    b.parser.reset(new rgd::RGDAstParser(__dfsan_label_info, uniontable_size));
+    b.parser->set_profile(true);
+    auto jit = std::make_shared<rgd::JITSolver>();
+    b.jit = jit.get();
+    b.solvers.emplace_back(std::make_shared<rgd::I2SSolver>());
+    b.solvers.emplace_back(jit);
+    if (use_z3) b.solvers.emplace_back(std::make_shared<rgd::Z3Solver>());
+  }
+}
+
+// reads the seed at path and copies it to the input file of the target
+static bool load_seed(const std::string &path, std::vector<uint8_t> &seed,
+                      int input_fd) {
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    if (fd != -1) close(fd);
+    return false;
+  }
+  seed.resize(st.st_size);
+  ssize_t n = st.st_size ? read(fd, seed.data(), st.st_size) : 0;
+  close(fd);
+  if (n != st.st_size) return false;
+  if (ftruncate(input_fd, 0) != 0 ||
+      pwrite(input_fd, seed.data(), seed.size(), 0) != (ssize_t)seed.size()) {
+    fprintf(stderr, "Failed to write the input: %s\n", strerror(errno));
+    return false;
+  }
+  lseek(input_fd, 0, SEEK_SET);
+  return true;
+}
+
+// the layers of -n
+enum { NATIVE, UNTRACED, TRACED, SOLVED, NUM_LAYERS };
+
+static const char *layer_names[NUM_LAYERS] = {
+  "native", "untraced", "traced", "solved",
+};
+
+struct layer_t {
+  uint64_t wall_us = 0;
+  uint64_t runs = 0;
+  uint64_t max_rss_kb = 0;
+  uint64_t max_shm_kb = 0;
+};
+
+// the KB of the union table that are resident
+static uint64_t resident_kb(void *table) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  std::vector<unsigned char> vec((uniontable_size + page - 1) / page);
+  if (mincore(table, uniontable_size, vec.data()) != 0) return 0;
+  uint64_t pages = 0;
+  for (unsigned char v : vec) pages += v & 1;
+  return pages * page / 1024;
+}
+
+// how an instance of -N sets up its session, and the pipes it tells it's
+// ready on and waits on to start
+struct instance_t {
+  bool forkserver = false;
+  bool huge_pages = false;
+  int cpu = -1;
+  int ready_fd = -1;
+  int go_fd = -1;
+};
+
+// runs the corpus rounds times at one layer, in the calling process, which
+// is a child of the benchmark so the peak RSS of its children is the one of
+// the layer's targets
+static layer_t run_layer(int layer, char *native, char *target,
+                         std::vector<std::string> const& files, int rounds,
+                         bool use_z3, char *input, int input_fd,
+                         instance_t const *inst = nullptr) {
+  layer_t l;
+  bench_t b;
+  if (layer != NATIVE) {
+    // with no taint source, the target never sees a label
+    std::string untainted = std::string(input) + ".untainted";
+    if (!setup_session(b, target, input, true)) exit(1);
+    if (layer == UNTRACED) symsan_session_set_input(b.session, untainted.c_str());
+    if (inst) {
+      symsan_session_set_forkserver(b.session, inst->forkserver);
+      symsan_session_set_huge_pages(b.session, inst->huge_pages);
+      if (inst->cpu >= 0) symsan_session_set_affinity(b.session, inst->cpu);
+    }
+    void *table = symsan_session_union_table(b.session);
+    // the traced layer still looks at the labels of memcmps
+    __dfsan_label_info = (dfsan_label_info *)table;
+    __dfsan_label_operands = get_label_operands_base(table, uniontable_size);
+    if (layer == SOLVED) setup_parser(b, table, false, use_z3);
+    b.parse = layer == SOLVED;
+  }
+  if (inst) {
+    char c = 1;
+    if (write(inst->ready_fd, &c, 1) != 1) exit(1);
+    // the write end is closed once all the instances are ready
+    while (read(inst->go_fd, &c, 1) > 0) {}
+  }
+
+  std::vector<uint8_t> seed;
+  uint64_t excluded_us = 0;
+  uint64_t start = now_us();
+  for (int r = 0; r < rounds; r++) {
+    for (auto const& path : files) {
+      if (!load_seed(path, seed, input_fd)) continue;
+      if (layer == NATIVE) {
+        pid_t pid = fork();
+        if (pid == 0) {
+          dup2(input_fd, STDIN_FILENO);
+          int null_fd = open("/dev/null", O_WRONLY);
+          if (null_fd != -1) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+          }
+          char *args[3] = {native, input, nullptr};
+          execv(native, args);
+          _exit(127);
+        }
+        if (pid < 0 || waitpid(pid, nullptr, 0) != pid) continue;
+      } else {
+        if (!run_seed(b, seed, input_fd)) continue;
+        // the scan of the table isn't part of the layer
+        uint64_t scan = now_us();
+        l.max_shm_kb = std::max(l.max_shm_kb,
+            resident_kb(symsan_session_union_table(b.session)));
+        excluded_us += now_us() - scan;
+      }
+      l.runs++;
+    }
+  }
+  l.wall_us = now_us() - start - excluded_us;
+
+  struct rusage ru;
+  if (getrusage(RUSAGE_CHILDREN, &ru) == 0) l.max_rss_kb = ru.ru_maxrss;
+  b.parser.reset();
+  if (b.session) symsan_session_destroy(b.session);
+  return l;
+}
+
+static void report_layers(FILE *f, const layer_t *layers, bool json) {
+  double native = layers[NATIVE].runs && layers[NATIVE].wall_us ?
+      (double)layers[NATIVE].runs / layers[NATIVE].wall_us : 0;
+  if (!json) {
+    fprintf(f, "%-9s %10s %10s %10s %12s %12s\n",
+            "layer", "runs", "runs/s", "slowdown", "rss(KB)", "shm(KB)");
+  } else {
+    fprintf(f, "{\n  \"layers\": [\n");
+  }
+  for (int i = 0; i < NUM_LAYERS; i++) {
+    auto const& l = layers[i];
+    double rate = l.wall_us ? (double)l.runs / l.wall_us : 0;
+    double slowdown = rate ? native / rate : 0;
+    if (!json) {
+      fprintf(f, "%-9s %10lu %10.1f %9.2fx %12lu %12lu\n", layer_names[i],
+              l.runs, rate * 1000000, slowdown, l.max_rss_kb, l.max_shm_kb);
+    } else {
+      fprintf(f, "    {\"name\": \"%s\", \"runs\": %lu, \"wall_us\": %lu, "
+              "\"slowdown\": %.3f, \"max_rss_kb\": %lu, \"max_shm_kb\": %lu}%s\n",
+              layer_names[i], l.runs, l.wall_us, slowdown, l.max_rss_kb,
+              l.max_shm_kb, i + 1 < NUM_LAYERS ? "," : "");
+    }
+  }
+  if (json) fprintf(f, "  ]\n}\n");
+}
+
+// runs each layer in a child process, which sends back its layer_t
+static int run_overhead(char *native, char *target,
+                        std::vector<std::string> const& files, int rounds,
+                        bool use_z3, const char *json_out) {
+  char input[] = "/tmp/symsan-bench-XXXXXX";
+  int input_fd = mkstemp(input);
+  if (input_fd == -1) {
+    fprintf(stderr, "Failed to create input file: %s\n", strerror(errno));
+    return 1;
+  }
+
+  layer_t layers[NUM_LAYERS];
+  int ret = 0;
+  for (int i = 0; i < NUM_LAYERS && !ret; i++) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      ret = 1;
+      break;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      layer_t l = run_layer(i, native, target, files, rounds, use_z3, input,
+                            input_fd);
+      _exit(write(fds[1], &l, sizeof(l)) == sizeof(l) ? 0 : 1);
+    }
+    close(fds[1]);
+    if (pid < 0 || read(fds[0], &layers[i], sizeof(layer_t)) != sizeof(layer_t)) {
+      fprintf(stderr, "The %s layer failed\n", layer_names[i]);
+      ret = 1;
+    }
+    close(fds[0]);
+    if (pid > 0) waitpid(pid, nullptr, 0);
+  }
+  close(input_fd);
+  unlink(input);
+  if (ret) return ret;
+
+  report_layers(stdout, layers, false);
+  if (json_out) {
+    FILE *f = fopen(json_out, "w");
+    if (f) {
+      report_layers(f, layers, true);
+      fclose(f);
+    }
+  }
+  return 0;
+}
+
+// what an instance of -N sends back
+struct scale_result_t {
+  layer_t layer;
+  uint64_t minflt = 0;
+  uint64_t majflt = 0;
+  uint64_t self_rss_kb = 0;
+};
+
+// the totals of the instances of one n
+struct scale_t {
+  unsigned instances = 0;
+  uint64_t wall_us = 0;
+  uint64_t runs = 0;
+  uint64_t minflt = 0;
+  uint64_t majflt = 0;
+  uint64_t max_self_rss_kb = 0;
+  uint64_t max_rss_kb = 0;
+  uint64_t max_shm_kb = 0;
+};
+
+static bool run_instances(unsigned n, char *target,
+                          std::vector<std::string> const& files, int rounds,
+                          instance_t opts, scale_t &sc) {
+  int ready[2], go[2], results[2];
+  if (pipe(ready) != 0 || pipe(go) != 0 || pipe(results) != 0) return false;
+  std::vector<pid_t> pids;
+  for (unsigned i = 0; i < n; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(ready[0]);
+      close(go[1]);
+      close(results[0]);
+      char input[] = "/tmp/symsan-bench-XXXXXX";
+      int input_fd = mkstemp(input);
+      if (input_fd == -1) _exit(1);
+      instance_t inst = opts;
+      if (opts.cpu >= 0) inst.cpu = i;
+      inst.ready_fd = ready[1];
+      inst.go_fd = go[0];
+      scale_result_t res;
+      res.layer = run_layer(TRACED, nullptr, target, files, rounds, false,
+                            input, input_fd, &inst);
+      struct rusage self, children;
+      if (getrusage(RUSAGE_SELF, &self) == 0 &&
+          getrusage(RUSAGE_CHILDREN, &children) == 0) {
+        res.minflt = self.ru_minflt + children.ru_minflt;
+        res.majflt = self.ru_majflt + children.ru_majflt;
+        res.self_rss_kb = self.ru_maxrss;
+      }
+      close(input_fd);
+      unlink(input);
+      // small enough for the write to be atomic
+      _exit(write(results[1], &res, sizeof(res)) == sizeof(res) ? 0 : 1);
+    }
+    if (pid > 0) pids.push_back(pid);
+  }
+  close(ready[1]);
+  close(go[0]);
+  close(results[1]);
+
+  // all the instances start at once, the ones that failed to set up never
+  // say they're ready
+  char c;
+  unsigned started = 0;
+  while (started < pids.size() && read(ready[0], &c, 1) == 1) started++;
+  uint64_t start = now_us();
+  close(go[1]);
+  sc = scale_t();
+  sc.instances = n;
+  scale_result_t res;
+  while (read(results[0], &res, sizeof(res)) == sizeof(res)) {
+    sc.runs += res.layer.runs;
+    sc.minflt += res.minflt;
+    sc.majflt += res.majflt;
+    sc.max_self_rss_kb = std::max(sc.max_self_rss_kb, res.self_rss_kb);
+    sc.max_rss_kb = std::max(sc.max_rss_kb, res.layer.max_rss_kb);
+    sc.max_shm_kb = std::max(sc.max_shm_kb, res.layer.max_shm_kb);
+  }
+  // the slowest instance sets the time
+  sc.wall_us = now_us() - start;
+  for (auto pid : pids) waitpid(pid, nullptr, 0);
+  close(ready[0]);
+  close(results[0]);
+  return started == n;
+}
+
+static void report_scaling(FILE *f, std::vector<scale_t> const& scales, bool json) {
+  double base = 0;
+  if (!json) {
+    fprintf(f, "%-9s %10s %10s %10s %9s %12s %10s %12s %12s %12s\n",
+            "instances", "traces", "traces/s", "per inst", "scaling",
+            "minflt/s", "majflt/s", "rss(KB)", "target(KB)", "shm(KB)");
+  } else {
+    fprintf(f, "{\n  \"instances\": [\n");
+  }
+  for (size_t i = 0; i < scales.size(); i++) {
+    auto const& sc = scales[i];
+    double secs = sc.wall_us ? (double)sc.wall_us / 1000000 : 0;
+    double rate = secs ? sc.runs / secs : 0;
+    if (i == 0 && sc.instances) base = rate / sc.instances;
+    double scaling = base ? rate / (base * sc.instances) : 0;
+    if (!json) {
+      fprintf(f, "%-9u %10lu %10.1f %10.1f %8.2fx %12.0f %10.1f %12lu %12lu %12lu\n",
+              sc.instances, sc.runs, rate, rate / sc.instances, scaling,
+              secs ? sc.minflt / secs : 0, secs ? sc.majflt / secs : 0,
+              sc.max_self_rss_kb, sc.max_rss_kb, sc.max_shm_kb);
+    } else {
+      fprintf(f, "    {\"instances\": %u, \"traces\": %lu, \"wall_us\": %lu, "
+              "\"scaling\": %.3f, \"minflt\": %lu, \"majflt\": %lu, "
+              "\"max_rss_kb\": %lu, \"max_target_rss_kb\": %lu, "
+              "\"max_shm_kb\": %lu}%s\n",
+              sc.instances, sc.runs, sc.wall_us, scaling, sc.minflt, sc.majflt,
+              sc.max_self_rss_kb, sc.max_rss_kb, sc.max_shm_kb,
+              i + 1 < scales.size() ? "," : "");
+    }
+  }
+  if (json) fprintf(f, "  ]\n}\n");
+}
+
+static int run_scaling(char *target, std::vector<std::string> const& files,
+                       int rounds, const char *counts, instance_t opts,
+                       const char *json_out) {
+  std::vector<scale_t> scales;
+  const char *p = counts;
+  while (*p) {
+    char *end;
+    unsigned n = strtoul(p, &end, 0);
+    if (end == p || n == 0) {
+      fprintf(stderr, "Invalid instance counts %s\n", counts);
+      return 1;
+    }
+    p = *end == ',' ? end + 1 : end;
+    scales.emplace_back();
+    if (!run_instances(n, target, files, rounds, opts, scales.back())) {
+      fprintf(stderr, "Some of the %u instances failed\n", n);
+      return 1;
+    }
+  }
+
+  report_scaling(stdout, scales, false);
+  if (json_out) {
+    FILE *f = fopen(json_out, "w");
+    if (f) {
+      report_scaling(f, scales, true);
+      fclose(f);
+    }
+  }
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-r rounds] [-z] [-Z] [-o out.json] [-w trace_dir] target corpus_dir\n"
+          "       %s -t [-r rounds] [-z] [-Z] [-o out.json] trace_dir\n"
+          "       %s -n native_target [-r rounds] [-z] [-o out.json] target corpus_dir\n"
+          "       %s -N n,... [-F] [-H] [-A] [-r rounds] [-o out.json] target corpus_dir\n",
+          prog, prog, prog, prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int rounds = 1;
+  bool use_z3 = false;
+  bool z3_parser = false;
+  bool replay = false;
+  const char *json_out = nullptr;
+  const char *record_dir = nullptr;
+  char *native = nullptr;
+  const char *scaling = nullptr;
+  instance_t inst;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:zZo:w:tn:N:FHA")) != -1) {
+    switch (opt) {
+      case 'r': rounds = atoi(optarg); break;
+      case 'z': use_z3 = true; break;
+      case 'Z': z3_parser = true; break;
+      case 'o': json_out = optarg; break;
+      case 'w': record_dir = optarg; break;
+      case 't': replay = true; break;
+      case 'n': native = optarg; break;
+      case 'N': scaling = optarg; break;
+      case 'F': inst.forkserver = true; break;
+      case 'H': inst.huge_pages = true; break;
+      case 'A': inst.cpu = 0; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (argc - optind != (replay ? 1 : 2) || (replay && record_dir) ||
+      (native && (replay || record_dir || z3_parser)) ||
+      (scaling && (native || replay || record_dir || z3_parser || use_z3))) {
+    usage(argv[0]);
+  }
+
+  std::vector<std::string> files;
+  if (!list_files(argv[argc - 1], files)) return 1;
+
+  if (native) {
+    return run_overhead(native, argv[optind], files, rounds, use_z3, json_out);
+  }
+  if (scaling) {
+    return run_scaling(argv[optind], files, rounds, scaling, inst, json_out);
+  }
+
+  bench_t b;
+  void *table;
+  char input[] = "/tmp/symsan-bench-XXXXXX";
+  int input_fd = -1;
+  if (replay) {
+    // the tables of the traces are mapped into it one at a time
+    table = mmap(nullptr, uniontable_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED) {
+      fprintf(stderr, "Failed to map the union table: %s\n", strerror(errno));
+      return 1;
+    }
+  } else {
+    // the seeds are copied to the one input file the target reads
+    input_fd = mkstemp(input);
+    if (input_fd == -1) {
+      fprintf(stderr, "Failed to create input file: %s\n", strerror(errno));
+      return 1;
+    }
+    // a trace keeps the memcmp contents inline, the blob area isn't in it
+    if (!setup_session(b, argv[optind], input, !record_dir)) return 1;
+    b.recording = record_dir != nullptr;
+    table = symsan_session_union_table(b.session);
+  }
+
+  setup_parser(b, table, z3_parser, use_z3);
+
+  std::vector<uint8_t> seed;
+  uint64_t traced = 0;
+  uint64_t start = now_us();
+  for (int r = 0; r < rounds; r++) {
+    for (auto const& path : files) {
+      if (replay) {
+        if (!replay_trace(b, path.c_str(), table, seed))
+          fprintf(stderr, "Invalid trace %s\n", path.c_str());
+        continue;
+      }
+      if (!load_seed(path, seed, input_fd)) continue;
+      if (!run_seed(b, seed, input_fd)) continue;
+      // only the first round is recorded
+      if (b.recording && r == 0) {
+        char trace[PATH_MAX];
+        snprintf(trace, sizeof(trace), "%s/trace-%06lu", record_dir, traced++);
+        if (!write_trace(b, trace, seed))
+          fprintf(stderr, "Failed to write %s: %s\n", trace, strerror(errno));
+      }
+    }
+  }
+  uint64_t wall_us = now_us() - start;
+
+  report(stdout, b, wall_us, false);
+  if (json_out) {
+    FILE *f = fopen(json_out, "w");
+    if (f) {
+      report(f, b, wall_us, true);
+      fclose(f);
+    }
+  }
+
+  b.parser.reset();
+  b.z3parser.reset();
+  if (replay) {
+    munmap(table, uniontable_size);
+  } else {
+    symsan_session_destroy(b.session);
+    close(input_fd);
+    unlink(input);
+  }
+  return 0;
+}
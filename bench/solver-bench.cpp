@@ -0,0 +1,258 @@
+// Regression benchmark of the solvers on the tasks of real campaigns: the
+// mutator saves every task it hands to the solvers, with the seed it's
+// solved on, when SYMSAN_CAPTURE_TASKS is set (see task_file.h), and each
+// solver picked here solves every task of the files on its own.
+//
+//   $ SYMSAN_CAPTURE_TASKS=tasks.bin afl-fuzz ...
+//   $ solver-bench [-s i2s,jit,z3] [-r rounds] [-o out.json] tasks.bin...
+//
+// It reports, per solver, the tasks solved, unsat and timed out, the mean,
+// p50 and p99 latency of a solve, the mean number of evaluations of the
+// gradient search (the attempts of the task), and the solver's own
+// counters, e.g., the hits and misses of the JIT cache. Each solve gets a
+// fresh copy of the task, read again from the file, so the rounds after
+// the first one only measure the caches kept across tasks.
+//
+// There's no union table to look labels up in, so the I2S solver can't
+// guess the encodings of memcmps from the samples it would keep.
+
+#include "dfsan/dfsan.h"
+
+#include "ast.h"
+#include "task.h"
+#include "solver.h"
+#include "task_file.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+using namespace __dfsan;
+
+// all zero, the tasks don't come with the table they were parsed from
+static dfsan_label_info *__dfsan_label_info;
+static dfsan_label_operands *__dfsan_label_operands;
+static const size_t MAX_LABEL = uniontable_size /
+    (sizeof(dfsan_label_info) + sizeof(dfsan_label_operands));
+
+dfsan_label_info* __dfsan::get_label_info(dfsan_label label) {
+  if (label >= MAX_LABEL) {
+    throw std::out_of_range("label too large " + std::to_string(label));
+  }
+  return &__dfsan_label_info[label];
+}
+
+dfsan_label_operands* __dfsan::get_label_operands(dfsan_label label) {
+  if (label >= MAX_LABEL) {
+    throw std::out_of_range("label too large " + std::to_string(label));
+  }
+  return &__dfsan_label_operands[label];
+}
+
+static uint64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the solvers by the names of the mutator's python list
+static std::shared_ptr<rgd::Solver> make_solver(std::string const& name) {
+  if (name == "i2s") return std::make_shared<rgd::I2SSolver>();
+  if (name == "memcmp") return std::make_shared<rgd::MemcmpSolver>();
+  if (name == "inverse") return std::make_shared<rgd::InverseSolver>();
+  if (name == "linear") return std::make_shared<rgd::LinearSolver>();
+  if (name == "jit") return std::make_shared<rgd::JITSolver>();
+  if (name == "z3") return std::make_shared<rgd::Z3Solver>();
+  return nullptr;
+}
+
+struct result_t {
+  std::string name;
+  uint64_t sat = 0;
+  uint64_t unsat = 0;
+  uint64_t timeout = 0;
+  uint64_t error = 0;
+  uint64_t evals = 0;
+  std::vector<uint64_t> latencies;
+  // the "key : value" lines of write_stats
+  std::vector<std::pair<std::string, std::string>> stats;
+
+  uint64_t total() const { return sat + unsat + timeout + error; }
+
+  uint64_t quantile(double q) const {
+    if (latencies.empty()) return 0;
+    size_t i = (size_t)(q * (latencies.size() - 1));
+    return latencies[i];
+  }
+
+  double mean_us() const {
+    if (latencies.empty()) return 0;
+    uint64_t sum = 0;
+    for (auto us : latencies) sum += us;
+    return (double)sum / latencies.size();
+  }
+};
+
+static void read_stats(rgd::Solver &solver, result_t &r) {
+  FILE *f = tmpfile();
+  if (!f) return;
+  solver.write_stats(fileno(f));
+  rewind(f);
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    char *sep = strstr(line, " : ");
+    if (!sep) continue;
+    char *end = sep;
+    while (end > line && end[-1] == ' ') end--;
+    std::string key(line, end);
+    std::string value(sep + 3);
+    while (!value.empty() && (value.back() == '\n' || value.back() == ' '))
+      value.pop_back();
+    r.stats.emplace_back(key, value);
+  }
+  fclose(f);
+}
+
+static bool run_solver(std::string const& name,
+                       std::vector<std::unique_ptr<rgd::TaskFile::Reader>> &files,
+                       int rounds, result_t &r) {
+  auto solver = make_solver(name);
+  if (!solver) return false;
+  r.name = name;
+  std::shared_ptr<rgd::SearchTask> task;
+  std::vector<uint8_t> input;
+  rgd::patch_t patch;
+  for (int round = 0; round < rounds; round++) {
+    for (auto &file : files) {
+      file->rewind();
+      while (file->next(task, input)) {
+        patch.clear();
+        uint64_t start = now_us();
+        auto ret = solver->solve(task, input.data(), input.size(), patch);
+        r.latencies.push_back(now_us() - start);
+        r.evals += task->attempts;
+        switch (ret) {
+          case rgd::SOLVER_SAT: r.sat++; break;
+          case rgd::SOLVER_UNSAT: r.unsat++; break;
+          case rgd::SOLVER_TIMEOUT: r.timeout++; break;
+          default: r.error++; break;
+        }
+      }
+    }
+  }
+  std::sort(r.latencies.begin(), r.latencies.end());
+  read_stats(*solver, r);
+  return true;
+}
+
+static void report(FILE *f, std::vector<result_t> const& results, bool json) {
+  if (!json) {
+    fprintf(f, "%-8s %8s %8s %8s %8s %8s %10s %10s %10s %10s\n",
+            "solver", "tasks", "sat", "unsat", "timeout", "rate",
+            "mean(us)", "p50(us)", "p99(us)", "evals");
+    for (auto const& r : results) {
+      uint64_t n = r.total();
+      fprintf(f, "%-8s %8lu %8lu %8lu %8lu %7.1f%% %10.1f %10lu %10lu %10.1f\n",
+              r.name.c_str(), n, r.sat, r.unsat, r.timeout,
+              n ? 100.0 * r.sat / n : 0.0, r.mean_us(), r.quantile(0.5),
+              r.quantile(0.99), n ? (double)r.evals / n : 0.0);
+    }
+    for (auto const& r : results) {
+      for (auto const& [key, value] : r.stats) {
+        fprintf(f, "%-24s: %s\n", key.c_str(), value.c_str());
+      }
+    }
+    return;
+  }
+  fprintf(f, "{\n  \"solvers\": [\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    auto const& r = results[i];
+    fprintf(f, "    {\"name\": \"%s\", \"tasks\": %lu, \"sat\": %lu, \"unsat\": %lu, "
+            "\"timeout\": %lu, \"error\": %lu, \"mean_us\": %.1f, \"p50_us\": %lu, "
+            "\"p99_us\": %lu, \"evals\": %lu, \"stats\": {",
+            r.name.c_str(), r.total(), r.sat, r.unsat, r.timeout, r.error,
+            r.mean_us(), r.quantile(0.5), r.quantile(0.99), r.evals);
+    for (size_t k = 0; k < r.stats.size(); k++) {
+      fprintf(f, "%s\"%s\": \"%s\"", k ? ", " : "", r.stats[k].first.c_str(),
+              r.stats[k].second.c_str());
+    }
+    fprintf(f, "}}%s\n", i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-s i2s,memcmp,inverse,linear,jit,z3] [-r rounds] [-o out.json] task_file...\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int rounds = 1;
+  std::string solver_list = "i2s,jit";
+  const char *json_out = nullptr;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:r:o:")) != -1) {
+    switch (opt) {
+      case 's': solver_list = optarg; break;
+      case 'r': rounds = atoi(optarg); break;
+      case 'o': json_out = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind >= argc || rounds < 1) usage(argv[0]);
+
+  void *table = mmap(nullptr, uniontable_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (table == MAP_FAILED) {
+    fprintf(stderr, "Failed to map the union table: %s\n", strerror(errno));
+    return 1;
+  }
+  __dfsan_label_info = (dfsan_label_info *)table;
+  __dfsan_label_operands = get_label_operands_base(table, uniontable_size);
+
+  std::vector<std::unique_ptr<rgd::TaskFile::Reader>> files;
+  for (int i = optind; i < argc; i++) {
+    files.emplace_back(new rgd::TaskFile::Reader());
+    if (!files.back()->open(argv[i])) {
+      fprintf(stderr, "Failed to open %s: %s\n", argv[i], strerror(errno));
+      return 1;
+    }
+  }
+
+  std::vector<result_t> results;
+  size_t pos = 0;
+  while (pos <= solver_list.size()) {
+    size_t comma = solver_list.find(',', pos);
+    if (comma == std::string::npos) comma = solver_list.size();
+    std::string name = solver_list.substr(pos, comma - pos);
+    pos = comma + 1;
+    if (name.empty()) continue;
+    results.emplace_back();
+    if (!run_solver(name, files, rounds, results.back())) {
+      fprintf(stderr, "Unknown solver %s\n", name.c_str());
+      return 1;
+    }
+  }
+
+  report(stdout, results, false);
+  if (json_out) {
+    FILE *f = fopen(json_out, "w");
+    if (f) {
+      report(f, results, true);
+      fclose(f);
+    }
+  }
+  munmap(table, uniontable_size);
+  return 0;
+}
@@ -23,10 +23,13 @@
 #include "debug.h"
 #include "version.h"
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -37,7 +40,11 @@ static char **cc_params;     /* Parameters passed to the real CC  */
 static u32 cc_par_cnt = 1;   /* Param count, including argv0      */
 static u8 is_cxx = 0;
 static u8 use_native_cxx = 0;
+static u8 use_lite_cxx = 0;  /* Link the taint-lite libc++           */
 static u8 use_native_zlib = 1; /* Use system zlib by default */
+static u8 use_lto = 0;       /* Instrument at link time           */
+static char *cache_dir;      /* KO_CACHE_DIR, the build cache     */
+static char *cache_out;      /* Object of a cacheable compile     */
 
 /* Try to find the executable from PATH */
 static char *find_executable_in_path(const char *filename) {
@@ -141,6 +148,40 @@ static u8 check_if_assembler(u32 argc, char **argv) {
   return 0;
 }
 
+/* Whether the compile can be cached, and where its object goes. Compiles
+   that also write dependency files, or read stdin, aren't. */
+static u8 check_if_cacheable(u32 argc, char **argv) {
+  u8 compile = 0;
+  u32 sources = 0;
+  char *out = NULL;
+
+  while (--argc) {
+    const char *cur = *(++argv);
+    if (!strcmp(cur, "-c")) {
+      compile = 1;
+    } else if (!strcmp(cur, "-o") && argc > 1) {
+      if (out) return 0;
+      out = *(++argv);
+      argc--;
+    } else if (!strcmp(cur, "-E") || !strcmp(cur, "-S") || !strcmp(cur, "-") ||
+               !strncmp(cur, "-M", 2) || !strncmp(cur, "-Wp,", 4) ||
+               (!strncmp(cur, "-o", 2) && cur[2])) {
+      return 0;
+    } else if (cur[0] != '-') {
+      const char *ext = strrchr(cur, '.');
+      if (ext && (!strcmp(ext, ".c") || !strcmp(ext, ".cc") ||
+                  !strcmp(ext, ".cpp") || !strcmp(ext, ".cxx") ||
+                  !strcmp(ext, ".C") || !strcmp(ext, ".c++"))) {
+        sources++;
+      }
+    }
+  }
+
+  if (!compile || !out || sources != 1) return 0;
+  cache_out = out;
+  return 1;
+}
+
 static void add_runtime() {
   if (getenv("KO_LIBRARY_PATH")) {
     cc_params[cc_par_cnt++] = alloc_printf("-L%s", getenv("KO_LIBRARY_PATH"));
@@ -155,10 +196,11 @@ static void add_runtime() {
   cc_params[cc_par_cnt++] = alloc_printf("-Wl,-T%s/../lib/symsan/taint.ld", obj_path);
 
   if (is_cxx && !use_native_cxx) {
+    const char *cxx_dir = use_lite_cxx ? "symsan/lite" : "symsan";
     // cc_params[cc_par_cnt++] = "-Wl,--whole-archive";
-    cc_params[cc_par_cnt++] = alloc_printf("%s/../lib/symsan/libc++.a", obj_path);
-    cc_params[cc_par_cnt++] = alloc_printf("%s/../lib/symsan/libc++abi.a", obj_path);
-    cc_params[cc_par_cnt++] = alloc_printf("%s/../lib/symsan/libunwind.a", obj_path);
+    cc_params[cc_par_cnt++] = alloc_printf("%s/../lib/%s/libc++.a", obj_path, cxx_dir);
+    cc_params[cc_par_cnt++] = alloc_printf("%s/../lib/%s/libc++abi.a", obj_path, cxx_dir);
+    cc_params[cc_par_cnt++] = alloc_printf("%s/../lib/%s/libunwind.a", obj_path, cxx_dir);
     // cc_params[cc_par_cnt++] = "-Wl,--no-whole-archive";
   } else {
     cc_params[cc_par_cnt++] = "-lc++";
@@ -191,42 +233,99 @@ static void add_runtime() {
   }
 }
 
+/* In LTO mode the pass runs in the linker, on the merged module */
+static void add_pass_option(char *opt) {
+  if (use_lto) {
+    cc_params[cc_par_cnt++] = alloc_printf("-Wl,-mllvm=%s", opt);
+  } else {
+    cc_params[cc_par_cnt++] = "-mllvm";
+    cc_params[cc_par_cnt++] = opt;
+  }
+}
+
 static void add_taint_pass() {
-  cc_params[cc_par_cnt++] = "-Xclang";
-  cc_params[cc_par_cnt++] = "-load";
-  cc_params[cc_par_cnt++] = "-Xclang";
-  cc_params[cc_par_cnt++] = alloc_printf("%s/../lib/symsan/libTaintPass.so", obj_path);
-  cc_params[cc_par_cnt++] = "-mllvm";
-  cc_params[cc_par_cnt++] =
-      alloc_printf("-taint-abilist=%s/../lib/symsan/dfsan_abilist.txt", obj_path);
+  if (use_lto) {
+    cc_params[cc_par_cnt++] = "-fuse-ld=lld";
+    cc_params[cc_par_cnt++] =
+        alloc_printf("-Wl,-mllvm=-load=%s/../lib/symsan/libTaintPass.so", obj_path);
+    add_pass_option("-taint-lto");
+    // -fno-vectorize only applies to the compile step
+    add_pass_option("-vectorize-loops=false");
+    add_pass_option("-vectorize-slp=false");
+  } else {
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = "-load";
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = alloc_printf("%s/../lib/symsan/libTaintPass.so", obj_path);
+  }
+  add_pass_option(
+      alloc_printf("-taint-abilist=%s/../lib/symsan/dfsan_abilist.txt", obj_path));
 
   if (use_native_zlib) {
-    cc_params[cc_par_cnt++] = "-mllvm";
-    cc_params[cc_par_cnt++] =
-        alloc_printf("-taint-abilist=%s/../lib/symsan/zlib_abilist.txt", obj_path);
+    add_pass_option(
+        alloc_printf("-taint-abilist=%s/../lib/symsan/zlib_abilist.txt", obj_path));
   }
 
   if (getenv("KO_TRACE_FP")) {
-    cc_params[cc_par_cnt++] = "-mllvm";
-    cc_params[cc_par_cnt++] = "-taint-trace-float-pointer";
+    add_pass_option("-taint-trace-float-pointer");
+  }
+
+  if (getenv("KO_TRACE_FP_LAZY")) {
+    add_pass_option("-taint-trace-fp-lazy");
+  }
+
+#ifdef SYMSAN_SPARSE_SHADOW
+  // must match the runtime
+  add_pass_option("-taint-sparse-shadow");
+#endif
+
+  if (getenv("KO_PRUNE_UNTAINTED")) {
+    add_pass_option("-taint-prune-untainted");
+  }
+
+  if (getenv("KO_TRACE_BUDGET")) {
+    add_pass_option(alloc_printf("-taint-trace-budget=%s", getenv("KO_TRACE_BUDGET")));
+  }
+
+  if (getenv("KO_INSTRUMENT_ALLOWLIST")) {
+    add_pass_option(
+        alloc_printf("-taint-allowlist=%s", getenv("KO_INSTRUMENT_ALLOWLIST")));
+  }
+
+  if (getenv("KO_INSTRUMENT_DENYLIST")) {
+    add_pass_option(
+        alloc_printf("-taint-denylist=%s", getenv("KO_INSTRUMENT_DENYLIST")));
+  }
+
+  if (getenv("KO_PGO_PROFILE")) {
+    add_pass_option(
+        alloc_printf("-taint-profile=%s", getenv("KO_PGO_PROFILE")));
+  }
+
+  if (getenv("KO_CONTEXT_DEPTH") && strcmp(getenv("KO_CONTEXT_DEPTH"), "full")) {
+    add_pass_option(
+        alloc_printf("-taint-context-depth=%s", getenv("KO_CONTEXT_DEPTH")));
+  }
+
+  if (getenv("KO_INSTRUMENT_REPORT")) {
+    add_pass_option(
+        alloc_printf("-taint-report=%s", getenv("KO_INSTRUMENT_REPORT")));
   }
 
   if (getenv("KO_NO_TRACE_BOUND")) {
-    cc_params[cc_par_cnt++] = "-mllvm";
-    cc_params[cc_par_cnt++] = "-taint-trace-bound=false";
+    add_pass_option("-taint-trace-bound=false");
   }
 
   if (is_cxx && use_native_cxx) {
-    cc_params[cc_par_cnt++] = "-mllvm";
-    cc_params[cc_par_cnt++] =
-        alloc_printf("-taint-abilist=%s/../lib/symsan/libc++_abilist.txt", obj_path);
+    add_pass_option(
+        alloc_printf("-taint-abilist=%s/../lib/symsan/libc++_abilist.txt", obj_path));
   }
 }
 
 static void edit_params(u32 argc, char **argv) {
 
   u8 fortify_set = 0, asan_set = 0, x_set = 0, maybe_linking = 1, bit_mode = 0;
-  u8 maybe_assembler = 0;
+  u8 maybe_assembler = 0, compile_only = 0;
   char *name;
 
   cc_params = ck_alloc((argc + 128) * sizeof(char *));
@@ -250,8 +349,19 @@ static void edit_params(u32 argc, char **argv) {
 
   use_native_cxx = getenv("KO_USE_NATIVE_LIBCXX") ? 1 : 0;
 
+  use_lite_cxx = getenv("KO_USE_LITE_LIBCXX") ? 1 : 0;
+
   use_native_zlib = getenv("KO_NO_NATIVE_ZLIB") ? 0 : 1;
 
+  use_lto = getenv("KO_LTO") ? 1 : 0;
+
+  // objects of LTO builds are only instrumented at link time
+  cache_dir = getenv("KO_CACHE_DIR");
+  if (cache_dir && (use_lto || maybe_assembler || getenv("KO_CONFIG") ||
+                    !check_if_cacheable(argc, argv))) {
+    cache_dir = NULL;
+  }
+
   /* Detect stray -v calls from ./configure scripts. */
   if (argc == 1 && !strcmp(argv[1], "-v"))
     maybe_linking = 0;
@@ -270,8 +380,10 @@ static void edit_params(u32 argc, char **argv) {
     if (!strcmp(cur, "-x"))
       x_set = 1;
 
-    if (!strcmp(cur, "-c") || !strcmp(cur, "-S") || !strcmp(cur, "-E"))
+    if (!strcmp(cur, "-c") || !strcmp(cur, "-S") || !strcmp(cur, "-E")) {
       maybe_linking = 0;
+      compile_only = 1;
+    }
 
     if (!strncmp(cur, "-fsanitize=", strlen("-fsanitize="))) {
       continue; // doesn't work together
@@ -325,7 +437,15 @@ static void edit_params(u32 argc, char **argv) {
   }
 
   if (!maybe_assembler) {
-    add_taint_pass();
+    if (use_lto) {
+      // objects carry bitcode, the pass runs when they are linked, also into
+      // shared libraries
+      cc_params[cc_par_cnt++] = "-flto";
+      if (!compile_only)
+        add_taint_pass();
+    } else {
+      add_taint_pass();
+    }
   }
 
   cc_params[cc_par_cnt++] = "-pie";
@@ -395,6 +515,177 @@ static void edit_params(u32 argc, char **argv) {
   cc_params[cc_par_cnt] = NULL;
 }
 
+/* The build cache: objects of compiles (-c of a single source to -o) keyed
+   by the preprocessed source, the final parameters, the working directory
+   (in the debug info), the compiler, the pass and the files the pass
+   options name, e.g., the ABI lists. The key is two 64-bit hashes. */
+
+typedef struct { u64 h[2]; } cache_key_t;
+
+static void key_update(cache_key_t *k, const u8 *buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    k->h[0] = (k->h[0] ^ buf[i]) * 0x100000001b3ULL; // FNV-1a
+    k->h[1] = (k->h[1] + buf[i] + 1) * 0x9e3779b97f4a7c15ULL;
+    k->h[1] ^= k->h[1] >> 29;
+  }
+}
+
+static void key_string(cache_key_t *k, const char *str) {
+  // with the terminator, so the strings can't run into each other
+  key_update(k, (const u8 *)str, strlen(str) + 1);
+}
+
+static u8 key_fd(cache_key_t *k, int fd) {
+  u8 buf[1 << 16];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) key_update(k, buf, n);
+  return n == 0;
+}
+
+static u8 key_file(cache_key_t *k, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+  u8 ret = key_fd(k, fd);
+  close(fd);
+  return ret;
+}
+
+/* Hashes the output of the compiler's preprocessor on the final parameters */
+static u8 key_preprocessed(cache_key_t *k) {
+  char **pp_params = ck_alloc((cc_par_cnt + 4) * sizeof(char *));
+  u32 n = 0;
+  for (u32 i = 0; i < cc_par_cnt; i++) {
+    if (!strcmp(cc_params[i], "-c")) continue;
+    if (!strcmp(cc_params[i], "-o")) {
+      i++;
+      continue;
+    }
+    pp_params[n++] = cc_params[i];
+  }
+  pp_params[n++] = "-E";
+  pp_params[n++] = "-o";
+  pp_params[n++] = "-";
+  pp_params[n] = NULL;
+
+  int fds[2];
+  if (pipe(fds)) {
+    ck_free(pp_params);
+    return 0;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(fds[1], STDOUT_FILENO);
+    if (null_fd >= 0) dup2(null_fd, STDERR_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    execvp(pp_params[0], pp_params);
+    _exit(127);
+  }
+  close(fds[1]);
+  u8 ret = pid > 0 && key_fd(k, fds[0]);
+  close(fds[0]);
+  int status = 0;
+  if (pid > 0 && (waitpid(pid, &status, 0) != pid ||
+                  !WIFEXITED(status) || WEXITSTATUS(status))) {
+    ret = 0;
+  }
+  ck_free(pp_params);
+  return ret;
+}
+
+/* The cache entry of the compile, NULL if it can't be keyed */
+static char *cache_entry() {
+  cache_key_t k = {{0xcbf29ce484222325ULL, 0}};
+  char cwd[PATH_MAX];
+
+  if (!getcwd(cwd, sizeof(cwd))) return NULL;
+  key_string(&k, cwd);
+
+  for (u32 i = 0; i < cc_par_cnt; i++) {
+    const char *cur = cc_params[i];
+    // the output name doesn't matter, the object is copied there
+    if (!strcmp(cur, "-o")) {
+      i++;
+      continue;
+    }
+    key_string(&k, cur);
+    // the ABI lists, allow and deny lists and profiles, not the report the
+    // pass writes
+    const char *eq = strchr(cur, '=');
+    if (!strncmp(cur, "-taint-", 7) && strncmp(cur, "-taint-report=", 14) &&
+        eq && !access(eq + 1, R_OK) && !key_file(&k, eq + 1)) {
+      return NULL;
+    }
+  }
+
+  // the pass and the compiler it's loaded in
+  char *pass = alloc_printf("%s/../lib/symsan/libTaintPass.so", obj_path);
+  u8 ok = key_file(&k, pass);
+  ck_free(pass);
+  if (!ok) return NULL;
+
+  char *cc = strchr(cc_params[0], '/') ? ck_strdup(cc_params[0])
+                                        : find_executable_in_path(cc_params[0]);
+  struct stat st;
+  if (!cc || stat(cc, &st)) {
+    if (cc) ck_free(cc);
+    return NULL;
+  }
+  ck_free(cc);
+  key_update(&k, (const u8 *)&st.st_size, sizeof(st.st_size));
+  key_update(&k, (const u8 *)&st.st_mtime, sizeof(st.st_mtime));
+
+  if (!key_preprocessed(&k)) return NULL;
+
+  return alloc_printf("%s/%016llx%016llx.o", cache_dir,
+                      (unsigned long long)k.h[0], (unsigned long long)k.h[1]);
+}
+
+/* Copies src to dst through a temporary file next to dst */
+static u8 copy_file(const char *src, const char *dst) {
+  int in = open(src, O_RDONLY);
+  if (in < 0) return 0;
+  char *tmp = alloc_printf("%s.ko-tmp.%d", dst, (int)getpid());
+  int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  u8 ok = out >= 0;
+  u8 buf[1 << 16];
+  ssize_t n;
+  while (ok && (n = read(in, buf, sizeof(buf))) != 0) {
+    ok = n > 0 && write(out, buf, n) == n;
+  }
+  close(in);
+  if (out >= 0) close(out);
+  if (ok) ok = !rename(tmp, dst);
+  if (!ok) unlink(tmp);
+  ck_free(tmp);
+  return ok;
+}
+
+/* Compiles through the cache: a hit copies the object out, a miss compiles
+   and adds the object. Doesn't return. */
+static void compile_cached() {
+  mkdir(cache_dir, 0755);
+  char *entry = cache_entry();
+  if (entry && copy_file(entry, cache_out)) {
+    exit(0);
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) PFATAL("fork() failed");
+  if (pid == 0) {
+    execvp(cc_params[0], (char **)cc_params);
+    FATAL("Oops, failed to execute '%s' - check your PATH", cc_params[0]);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) != pid) PFATAL("waitpid() failed");
+  if (!WIFEXITED(status)) exit(1);
+  if (WEXITSTATUS(status) == 0 && entry) {
+    copy_file(cache_out, entry);
+  }
+  exit(WEXITSTATUS(status));
+}
+
 /* Main entry point */
 
 int main(int argc, char **argv) {
@@ -429,6 +720,11 @@ int main(int argc, char **argv) {
     printf("%s ", cc_params[i]);
   }
   printf("\n");
+  if (cache_dir) {
+    // flush, so the child doesn't print the parameters again
+    fflush(stdout);
+    compile_cached();
+  }
   execvp(cc_params[0], (char **)cc_params);
 
   FATAL("Oops, failed to execute '%s' - check your PATH", cc_params[0]);
@@ -11,6 +11,14 @@
 #include "solver.h"
 #include "cov.h"
 #include "task_mgr.h"
+#include "task_store.h"
+#include "unsat_cores.h"
+#include "solver_sched.h"
+#include "seed_sched.h"
+#include "task_file.h"
+#include "mem_limits.h"
+#include "trace_blob.h"
+#include "trace_archive.h"
 
 extern "C" {
 #include "afl-fuzz.h"
@@ -19,13 +27,22 @@ extern "C" {
 
 #include "parse-rgd.h"
 
+#include "wheels/concurrentqueue/queue.h"
+
+#include <array>
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 #include <queue>
 #include <memory>
+#include <numeric>
 
 #include <stdlib.h>
 #include <string.h>
@@ -63,6 +80,54 @@ using namespace __dfsan;
 static bool NestedSolving = false;
 static int TraceBounds = 0;
 static int ForceStdin = 0;
+static int UseForkServer = 0;
+static int UsePersistent = 0;
+static int PersistentGC = 0;
+static int UseEventRing = 0;
+static int LazyMmapTaint = 0;
+static int SummarizeSums = 0;
+static int MemcmpBlob = 0;
+static int BranchFilter = 0;
+static const char *SiteProfile = nullptr;
+static const char *TaintRanges = nullptr;
+static const char *TaintInputs = nullptr;
+static int RuntimeAstCap = 0;
+static size_t ScanThreads = 0;
+static size_t MaxDnfClauses = rgd::RGDAstParser::kDefaultDnfClauses;
+static size_t MaxDnfLiterals = rgd::RGDAstParser::kDefaultDnfLiterals;
+static size_t ParserWindow = 0;
+static size_t ParserExprs = rgd::RGDAstParser::kDefaultStreamingExprs;
+static size_t NestedWindow = 0;
+static bool NestedSlice = false;
+static bool SplitTasks = false;
+static size_t SolveThreads = 0;
+static size_t ValidateBatch = 0;
+static size_t MaxSolutions = 1;
+static uint64_t SeedSolveBudgetUs = 0;
+static u8 ByteMapProb = 0;
+static size_t TrimSeeds = 0;
+static int HugePages = 0;
+static size_t PrefaultMB = 0;
+// where the target runs: a cpu, a numa node, or next to AFL++ when auto
+static int AffinityCpu = -1;
+static int AffinityNode = -1;
+static bool AffinityAuto = false;
+static u32 SnapshotMs = 0;
+// branches marked for snapshots, at most one per trace
+static const u32 kMaxSnapshotSites = 16;
+static bool DiffTrace = false;
+static bool Checkpoint = false;
+// the tasks handed to the solvers, saved with their seeds for solver-bench
+static rgd::TaskFile *TaskCapture = nullptr;
+// branches in the signature of a trace, the rest is never skipped
+static const size_t kMaxBranchSig = 1 << 14;
+
+// solved mutations waiting for AFL++, the workers wait when there are more
+static const size_t kMaxReadyMutations = 256;
+// default budget of the code of the JIT'ed constraints, in MB
+static const size_t kJitCacheMB = 256;
+// seeds of the traces shipped to the workers kept for their solutions
+static const size_t kMaxRemoteSeeds = 4096;
 
 #undef alloc_printf
 #define alloc_printf(_str...) ({ \
@@ -75,7 +140,84 @@ static int ForceStdin = 0;
   })
 
 using solver_t = std::shared_ptr<rgd::Solver>;
-using branch_ctx_t = std::shared_ptr<rgd::BranchContext>;
+using branch_ctx_t = const rgd::BranchContext*;
+
+// skips the branch directions AFL++ has covered already, e.g., by havoc,
+// looking them up in its virgin map; the branch ids of the tracing binary
+// and the edge ids of the fuzzing binary are assigned by different passes,
+// so the mapping between them comes from a file with a line of
+// "<branch id> <edge of the true direction> <edge of the false direction>"
+// per branch, in any base strtoul takes; unmapped branches fall back to
+// the branch coverage of the ids
+class AflCovManager : public rgd::HybridCovManager {
+public:
+  AflCovManager(const u8 *virgin_bits, size_t map_size)
+    : virgin_bits(virgin_bits), map_size(map_size) {}
+
+  bool load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+      char *p = line, *end;
+      uint32_t id = strtoul(p, &end, 0);
+      if (end == p) continue;
+      p = end;
+      uint32_t t = strtoul(p, &end, 0);
+      if (end == p) continue;
+      p = end;
+      uint32_t f_edge = strtoul(p, &end, 0);
+      if (end == p) continue;
+      if (t < map_size && f_edge < map_size) edges[id] = {f_edge, t};
+    }
+    fclose(f);
+    return true;
+  }
+
+  bool is_branch_interesting(const rgd::BranchContext *context) override {
+    auto &ctx = dynamic_cast<const rgd::HybridBranchContext&>(*context);
+    auto itr = edges.find(ctx.id);
+    // a virgin byte is cleared once AFL++ has seen the edge
+    if (itr != edges.end() &&
+        virgin_bits[itr->second[ctx.direction]] != 0xff) {
+      return false;
+    }
+    return rgd::HybridCovManager::is_branch_interesting(context);
+  }
+
+  bool is_covered(const rgd::BranchContext *context) override {
+    if (!context->seen) return false;
+    auto &ctx = dynamic_cast<const rgd::HybridBranchContext&>(*context);
+    auto itr = edges.find(ctx.id);
+    if (itr != edges.end() &&
+        virgin_bits[itr->second[ctx.direction]] != 0xff) {
+      return true;
+    }
+    return rgd::HybridCovManager::is_covered(context);
+  }
+
+  // tells the runtime's branch filter about the directions AFL++ has
+  // covered since the last call, their flips are then not even sent
+  void sync_filter() {
+    for (auto const& e : edges) {
+      uint8_t &marked = filtered[e.first];
+      for (int d = 0; d < 2; d++) {
+        if (!(marked & (1 << d)) && virgin_bits[e.second[d]] != 0xff &&
+            symsan_mark_covered(e.first, d) == 0) {
+          marked |= 1 << d;
+        }
+      }
+    }
+  }
+
+private:
+  const u8 *virgin_bits;
+  size_t map_size;
+  // the edges of the false and true directions of each branch id
+  std::unordered_map<uint32_t, std::array<uint32_t, 2>> edges;
+  // the directions marked in the branch filter
+  std::unordered_map<uint32_t, uint8_t> filtered;
+};
 
 enum mutation_state_t {
   MUTATION_INVALID,
@@ -83,16 +225,74 @@ enum mutation_state_t {
   MUTATION_VALIDATED,
 };
 
+// a traced seed, kept alive by the tasks made from it
+using seed_t = std::vector<uint8_t>;
+
+// a solution the workers found, for afl_custom_fuzz to hand out, as the
+// patch to the seed it was solved on
+struct mutation_t {
+  rgd::task_t task;
+  uint64_t task_fp;
+  std::shared_ptr<const seed_t> seed;
+  rgd::patch_t patch;
+};
+
+struct my_mutator_t;
+
+// solver threads that pull tasks from the task manager and queue their
+// solutions, so afl_custom_fuzz never waits on a solver
+struct solve_pipeline_t {
+  my_mutator_t *data;
+  std::vector<std::thread> workers;
+  // guards the task manager and task_seeds, workers sleep on has_tasks
+  std::mutex task_lock;
+  std::condition_variable has_tasks;
+  std::unordered_map<const rgd::SearchTask*, std::shared_ptr<const seed_t>> task_seeds;
+  moodycamel::ConcurrentQueue<mutation_t> ready;
+  bool stop;
+
+  solve_pipeline_t(my_mutator_t *data) : data(data), stop(false) {}
+  void start(size_t num_threads);
+  void add_tasks(std::vector<branch_ctx_t> const& ctxs,
+                 std::vector<rgd::task_t> const& tasks,
+                 std::shared_ptr<const seed_t> const& seed);
+  size_t num_pending();
+  void shutdown();
+  void work();
+};
+
+// with remote workers, the trace being recorded for them, and the seeds
+// of the traces shipped, until their solutions come back
+struct remote_t {
+  rgd::TraceSpool spool;
+  // of the names of the traces of this instance, unique across hosts
+  std::string prefix;
+  uint64_t next_id = 0;
+  rgd::TraceBlob trace;
+  std::vector<uint8_t> blob;
+  std::map<uint64_t, std::shared_ptr<const seed_t>> seeds;
+  std::deque<mutation_t> ready;
+};
+
+// with a trace archive, the trace of every seed, with all its branches,
+// interesting or not, to be parsed and solved again offline
+struct archive_t {
+  rgd::TraceArchive file;
+  rgd::TraceBlob trace;
+  std::vector<uint8_t> blob;
+};
+
 struct my_mutator_t {
   my_mutator_t() = delete;
   my_mutator_t(const afl_state_t *afl, rgd::TaskManager* tmgr, rgd::CovManager* cmgr) :
     afl(afl), out_dir(NULL), out_file(NULL), symsan_bin(NULL),
-    argv(NULL), out_fd(-1), cur_queue_entry(NULL),
+    argv(NULL), out_fd(-1), out_size(0), cur_queue_entry(NULL),
     cur_mutation_state(MUTATION_INVALID), output_buf(NULL),
     cur_task(nullptr), cur_solver_index(-1),
     task_mgr(tmgr), cov_mgr(cmgr) {}
 
   ~my_mutator_t() {
+    if (pipeline) pipeline->shutdown();
     if (out_fd >= 0) close(out_fd);
     ck_free(out_dir);
     ck_free(out_file);
@@ -108,9 +308,40 @@ struct my_mutator_t {
   char *symsan_bin;
   char **argv;
   int out_fd;
+  size_t out_size; // of the input in out_file
   u8* cur_queue_entry;
   int cur_mutation_state;
+  // the input handed to AFL++: a copy of the seed with the patch of the
+  // last solution applied, which is undone before the next one, so the
+  // seed is only copied again when it changes or a patch moved its bytes
   u8* output_buf;
+  const void *patched_seed = nullptr;
+  size_t patched_size = 0;
+  std::shared_ptr<const seed_t> patched_pin; // keeps patched_seed alive
+  std::vector<std::pair<size_t, uint8_t>> patch_undo;
+  // time spent solving since AFL++ moved on to the current seed, in us
+  uint64_t seed_solve_us = 0;
+  // the input bytes read by the branch conditions of each traced seed, by
+  // queue id, where the havoc mutations go; and those of the current trace
+  std::unordered_map<u32, std::vector<u32>> byte_maps;
+  std::vector<uint8_t> trace_bytes;
+  // the branch signatures of the traced seeds, by queue id, the seed each
+  // seed was found from, and the signature of the current trace; the
+  // branches still in the prefix it shares with its parent's aren't parsed
+  std::unordered_map<u32, std::vector<u32>> branch_sigs;
+  std::unordered_map<u32, u32> seed_parents;
+  std::vector<u32> trace_sig;
+  const std::vector<u32> *parent_sig = nullptr;
+  uint64_t rng = 1;
+  // the input of the latest snapshot, the first snapshot_consumed bytes of
+  // which a seed must share to be traced from it, and the branches marked
+  std::vector<u8> snapshot_seed;
+  uint64_t snapshot_consumed = 0;
+  u32 snapshot_sites = 0;
+  rgd::patch_t patch;
+  // the other solutions of the last task solved against the current seed,
+  // handed out before solving on
+  std::vector<rgd::patch_t> more_patches;
   int log_fd;
 
   std::unordered_set<u32> fuzzed_inputs;
@@ -119,14 +350,50 @@ struct my_mutator_t {
   rgd::RGDAstParser* parser;
   std::vector<solver_t> solvers;
 
+  // tasks queued from the current trace, handed to the solvers at once
+  std::vector<rgd::task_t> new_tasks;
+  std::vector<branch_ctx_t> new_task_ctx;
+  // the dummy contexts of the array indices, one per site
+  std::unordered_map<uptr, rgd::BranchContext> gep_ctx;
   // XXX: well, we have to keep track of solving states
   rgd::task_t cur_task;
+  uint64_t cur_task_fp = 0;
+  // outcomes shared with other sessions and instances, if any
+  rgd::TaskStore task_store;
+  rgd::TaskStore seed_store;
+  bool claim_tasks = false;
+  // cores of the unsat tasks, if kept
+  std::shared_ptr<rgd::UnsatCoreCache> unsat_cores;
+  // constants the comparisons test input against, if harvested, and how
+  // many of them have been handed to AFL++
+  std::shared_ptr<rgd::ConstDict> const_dict;
+  size_t dict_exported = 0;
+  // the memory of the subsystems and their soft limits, if accounted
+  std::unique_ptr<rgd::MemLimits> mem;
+  // the manager spilling the queued tasks, wrapped by task_mgr, if any
+  rgd::SpillTaskManager *spill = nullptr;
+  // the solvers to try on cur_task, in order, and the one being tried
+  std::vector<size_t> cur_order;
   size_t cur_solver_index;
+  // orders the solvers per task if set, the configured order otherwise
+  std::unique_ptr<rgd::SolverScheduler> scheduler;
+  // holds back the seeds not worth tracing yet, if set
+  std::unique_ptr<rgd::SeedScheduler> seed_sched;
+  // with solver threads, the mutation being validated by AFL++
+  std::unique_ptr<solve_pipeline_t> pipeline;
+  mutation_t cur_mutation;
+  // with remote workers, which parse and solve the traces instead
+  std::unique_ptr<remote_t> remote;
+  // the traces archived, if set
+  std::unique_ptr<archive_t> archive;
 };
 
 // FIXME: find another way to make the union table hash work
 static dfsan_label_info *__dfsan_label_info;
-static const size_t MAX_LABEL = uniontable_size / sizeof(dfsan_label_info);
+static dfsan_label_operands *__dfsan_label_operands;
+static size_t UnionTableSize = uniontable_size;
+static size_t MAX_LABEL = uniontable_size /
+    (sizeof(dfsan_label_info) + sizeof(dfsan_label_operands));
 
 dfsan_label_info* __dfsan::get_label_info(dfsan_label label) {
   if (unlikely(label >= MAX_LABEL)) {
@@ -135,22 +402,632 @@ dfsan_label_info* __dfsan::get_label_info(dfsan_label label) {
   return &__dfsan_label_info[label];
 }
 
+dfsan_label_operands* __dfsan::get_label_operands(dfsan_label label) {
+  if (unlikely(label >= MAX_LABEL)) {
+    throw std::out_of_range("label too large " + std::to_string(label));
+  }
+  return &__dfsan_label_operands[label];
+}
+
 // FIXME: local filter?
-static std::unordered_map<uint32_t, uint8_t> local_counter;
+static std::unordered_map<uint32_t, uint16_t> local_counter;
 static std::unordered_set<uint32_t> local_index_filter;
 // staticstics
 static uint64_t total_branches = 0;
 static uint64_t branches_to_solve = 0;
 static uint64_t total_tasks = 0;
 static std::map<uint64_t, uint64_t> task_size_dist;
-static uint64_t solved_tasks = 0;
+static std::atomic<uint64_t> solved_tasks(0);
 static uint64_t solved_branches = 0;
+static std::atomic<uint64_t> stored_tasks(0);
+static std::atomic<uint64_t> claimed_tasks(0);
+static uint64_t traced_elsewhere = 0;
+static uint64_t traced_seeds = 0;
+static uint64_t validated_execs = 0;
+static uint64_t rejected_solutions = 0;
+static uint64_t seed_budget_stops = 0;
+static uint64_t byte_map_mutations = 0;
+static uint64_t deferred_seeds = 0;
+static uint64_t trimmed_seeds = 0;
+static uint64_t resumed_seeds = 0;
+static uint64_t no_branch_seeds = 0;
+static uint64_t skipped_seeds = 0;
+static uint64_t diff_skipped_branches = 0;
+static std::atomic<uint64_t> more_solutions(0);
+static std::atomic<uint64_t> core_rejected_tasks(0);
+static uint64_t remote_traces = 0;
+static uint64_t remote_bytes = 0;
+static uint64_t remote_labels = 0;
+static uint64_t remote_solutions = 0;
+static uint64_t remote_stale = 0;
+static uint64_t archive_traces = 0;
+
+// always-on latencies of the driver stages and the solvers, written along
+// with the counters above to symsan_stats (like AFL++'s fuzzer_stats) and
+// symsan_plot_data (like its plot_data) in the output directory
+struct latency_t {
+  static constexpr int kBuckets = 24; // log2 of us, the last one is open
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> total_us{0};
+  std::atomic<uint64_t> hist[kBuckets] = {};
+
+  void add(uint64_t us) {
+    int b = us ? std::min(63 - __builtin_clzll(us), kBuckets - 1) : 0;
+    count.fetch_add(1, std::memory_order_relaxed);
+    total_us.fetch_add(us, std::memory_order_relaxed);
+    hist[b].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // upper bound of the bucket a fraction q of the samples fall under
+  uint64_t quantile(double q) const {
+    uint64_t total = count.load(std::memory_order_relaxed);
+    uint64_t n = 0;
+    for (int b = 0; b < kBuckets; b++) {
+      n += hist[b].load(std::memory_order_relaxed);
+      if (n >= q * total) return 2ULL << b;
+    }
+    return 2ULL << (kBuckets - 1);
+  }
+};
+
+struct solver_stats_t {
+  latency_t latency;
+  std::atomic<uint64_t> results[rgd::SOLVER_TIMEOUT + 1] = {};
+};
+
+static constexpr uint64_t kStatsIntervalUs = 5 * 1000000;
+static latency_t trace_latency;
+static latency_t parse_latency;
+static std::unique_ptr<solver_stats_t[]> solver_stats;
+static uint64_t stats_start_us = 0;
+static uint64_t stats_last_us = 0;
+static int plot_fd = -1;
+
+// with SYMSAN_SITE_PROFILE, the parse and solve cost per branch site (by
+// address), written to that file at exit, see write_site_profile()
+static constexpr size_t kMaxSolvers = 3;
+struct site_profile_t {
+  uint32_t id = 0;
+  uint64_t events = 0;    // conditions parsed
+  uint64_t ast_nodes = 0;
+  uint64_t tasks = 0;
+  uint64_t parse_us = 0;
+  uint64_t solve_us[kMaxSolvers] = {};
+  uint64_t results[kMaxSolvers][rgd::SOLVER_TIMEOUT + 1] = {};
+
+  uint64_t total_us() const {
+    uint64_t us = parse_us;
+    for (auto s : solve_us) us += s;
+    return us;
+  }
+};
+static std::mutex site_profile_lock;
+static std::unordered_map<uint64_t, site_profile_t> site_profiles;
+
+static void profile_parse(uint64_t addr, uint32_t id, uint32_t ast_nodes,
+                          size_t tasks, uint64_t us) {
+  std::lock_guard<std::mutex> lock(site_profile_lock);
+  auto &site = site_profiles[addr];
+  site.id = id;
+  site.events += 1;
+  site.ast_nodes += ast_nodes;
+  site.tasks += tasks;
+  site.parse_us += us;
+}
+
+static void record_solve(size_t solver_index, rgd::task_t const& task,
+                         rgd::solver_result_t ret, uint64_t us) {
+  auto &stats = solver_stats[solver_index];
+  stats.latency.add(us);
+  stats.results[ret].fetch_add(1, std::memory_order_relaxed);
+  if (unlikely(SiteProfile) && task->site) {
+    std::lock_guard<std::mutex> lock(site_profile_lock);
+    auto &site = site_profiles[task->site];
+    site.solve_us[solver_index] += us;
+    site.results[solver_index][ret] += 1;
+  }
+}
+
+static void write_latency(int fd, const char *name, latency_t const& l) {
+  dprintf(fd, "%s_count%*s: %lu\n", name, (int)(12 - strlen(name)), "",
+          l.count.load(std::memory_order_relaxed));
+  dprintf(fd, "%s_total_us%*s: %lu\n", name, (int)(9 - strlen(name)), "",
+          l.total_us.load(std::memory_order_relaxed));
+  dprintf(fd, "%s_p50_us%*s: %lu\n", name, (int)(11 - strlen(name)), "",
+          l.quantile(0.5));
+  dprintf(fd, "%s_p99_us%*s: %lu\n", name, (int)(11 - strlen(name)), "",
+          l.quantile(0.99));
+}
+
+static void open_stats(my_mutator_t *data) {
+  solver_stats.reset(new solver_stats_t[data->solvers.size()]);
+  stats_start_us = stats_last_us = get_cur_time_us();
+  char *path = alloc_printf("%s/symsan_plot_data", data->out_dir);
+  plot_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (plot_fd < 0) {
+    WARNF("Failed to create %s: %s\n", path, strerror(errno));
+  } else {
+    dprintf(plot_fd, "# relative_time, seeds_traced, total_branches, total_tasks, "
+            "solved_tasks, trace_p50_us, parse_p50_us");
+    for (auto &solver : data->solvers) {
+      dprintf(plot_fd, ", %s_calls, %s_sat, %s_p50_us",
+              solver->name(), solver->name(), solver->name());
+    }
+    dprintf(plot_fd, "\n");
+  }
+  ck_free(path);
+}
+
+// rewrites symsan_stats and adds a line to symsan_plot_data
+static void write_stats(my_mutator_t *data, uint64_t now) {
+  stats_last_us = now;
+  char *path = alloc_printf("%s/symsan_stats", data->out_dir);
+  char *tmp = alloc_printf("%s.tmp", path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    dprintf(fd, "start_time        : %lu\n", stats_start_us / 1000000);
+    dprintf(fd, "last_update       : %lu\n", now / 1000000);
+    dprintf(fd, "run_time          : %lu\n", (now - stats_start_us) / 1000000);
+    dprintf(fd, "seeds_traced      : %lu\n", traced_seeds);
+    dprintf(fd, "seeds_elsewhere   : %lu\n", traced_elsewhere);
+    dprintf(fd, "total_branches    : %lu\n", total_branches);
+    dprintf(fd, "solved_branches   : %lu\n", solved_branches);
+    dprintf(fd, "total_tasks       : %lu\n", total_tasks);
+    dprintf(fd, "solved_tasks      : %lu\n", solved_tasks.load());
+    dprintf(fd, "stored_tasks      : %lu\n", stored_tasks.load());
+    dprintf(fd, "claimed_tasks     : %lu\n", claimed_tasks.load());
+    dprintf(fd, "stale_tasks       : %lu\n", data->task_mgr->get_num_stale());
+    dprintf(fd, "validated_execs   : %lu\n", validated_execs);
+    dprintf(fd, "rejected_solutions: %lu\n", rejected_solutions);
+    dprintf(fd, "core_unsat_tasks  : %lu\n", core_rejected_tasks.load());
+    dprintf(fd, "seed_budget_stops : %lu\n", seed_budget_stops);
+    if (TrimSeeds) {
+      dprintf(fd, "trimmed_seeds     : %lu\n", trimmed_seeds);
+      dprintf(fd, "no_branch_seeds   : %lu\n", no_branch_seeds);
+    }
+    if (SnapshotMs) {
+      dprintf(fd, "resumed_seeds     : %lu\n", resumed_seeds);
+    }
+    if (data->seed_sched) {
+      dprintf(fd, "deferred_seeds    : %lu\n", deferred_seeds);
+      dprintf(fd, "skipped_seeds     : %lu\n", skipped_seeds);
+    }
+    if (DiffTrace) {
+      dprintf(fd, "diff_skipped      : %lu\n", diff_skipped_branches);
+    }
+    if (MaxSolutions > 1) {
+      dprintf(fd, "more_solutions    : %lu\n", more_solutions.load());
+    }
+    if (data->const_dict) {
+      dprintf(fd, "dict_tokens       : %lu\n", data->const_dict->size());
+    }
+    if (data->remote) {
+      dprintf(fd, "remote_traces     : %lu\n", remote_traces);
+      dprintf(fd, "remote_bytes      : %lu\n", remote_bytes);
+      dprintf(fd, "remote_labels     : %lu\n", remote_labels);
+      dprintf(fd, "remote_pending    : %lu\n", data->remote->seeds.size());
+      dprintf(fd, "remote_solutions  : %lu\n", remote_solutions);
+      dprintf(fd, "remote_stale      : %lu\n", remote_stale);
+    }
+    if (data->archive) {
+      dprintf(fd, "archive_traces    : %lu\n", archive_traces);
+      dprintf(fd, "archive_bytes     : %lu\n", data->archive->file.blob_bytes());
+      dprintf(fd, "archive_written   : %lu\n", data->archive->file.archived_bytes());
+    }
+    if (ByteMapProb) {
+      dprintf(fd, "byte_map_seeds    : %lu\n", data->byte_maps.size());
+      dprintf(fd, "byte_map_mutations: %lu\n", byte_map_mutations);
+    }
+    write_latency(fd, "trace", trace_latency);
+    write_latency(fd, "parse", parse_latency);
+    if (data->mem) {
+      data->mem->write_stats(fd);
+    }
+    for (size_t i = 0; i < data->solvers.size(); i++) {
+      const char *name = data->solvers[i]->name();
+      auto &stats = solver_stats[i];
+      write_latency(fd, name, stats.latency);
+      dprintf(fd, "%s_sat%*s: %lu\n", name, (int)(14 - strlen(name)), "",
+              stats.results[rgd::SOLVER_SAT].load(std::memory_order_relaxed));
+      dprintf(fd, "%s_unsat%*s: %lu\n", name, (int)(12 - strlen(name)), "",
+              stats.results[rgd::SOLVER_UNSAT].load(std::memory_order_relaxed));
+      dprintf(fd, "%s_timeout%*s: %lu\n", name, (int)(10 - strlen(name)), "",
+              stats.results[rgd::SOLVER_TIMEOUT].load(std::memory_order_relaxed));
+      dprintf(fd, "%s_error%*s: %lu\n", name, (int)(12 - strlen(name)), "",
+              stats.results[rgd::SOLVER_ERROR].load(std::memory_order_relaxed));
+      data->solvers[i]->write_stats(fd);
+    }
+    close(fd);
+    if (rename(tmp, path)) {
+      WARNF("Failed to update %s: %s\n", path, strerror(errno));
+    }
+  }
+  ck_free(tmp);
+  ck_free(path);
+
+  if (plot_fd < 0) return;
+  dprintf(plot_fd, "%lu, %lu, %lu, %lu, %lu, %lu, %lu",
+          (now - stats_start_us) / 1000000, traced_seeds, total_branches,
+          total_tasks, solved_tasks.load(), trace_latency.quantile(0.5),
+          parse_latency.quantile(0.5));
+  for (size_t i = 0; i < data->solvers.size(); i++) {
+    auto &stats = solver_stats[i];
+    dprintf(plot_fd, ", %lu, %lu, %lu",
+            stats.latency.count.load(std::memory_order_relaxed),
+            stats.results[rgd::SOLVER_SAT].load(std::memory_order_relaxed),
+            stats.latency.quantile(0.5));
+  }
+  dprintf(plot_fd, "\n");
+}
+
+// appends the tokens harvested since the last call to symsan_dict, as an
+// AFL++ dictionary, and hands them to AFL++ as auto extras
+static void export_dict(my_mutator_t *data) {
+  size_t n = data->const_dict->size();
+  if (data->dict_exported >= n) return;
+  char *path = alloc_printf("%s/symsan_dict", data->out_dir);
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) WARNF("Failed to open %s: %s\n", path, strerror(errno));
+  ck_free(path);
+  for (; data->dict_exported < n; data->dict_exported++) {
+    const uint8_t *buf;
+    size_t len;
+    // one still being added, pick it up next time
+    if (!data->const_dict->get(data->dict_exported, buf, len)) break;
+    if (fd >= 0) {
+      dprintf(fd, "symsan_%zu=\"", data->dict_exported);
+      for (size_t i = 0; i < len; i++) dprintf(fd, "\\x%02x", buf[i]);
+      dprintf(fd, "\"\n");
+    }
+    maybe_add_auto(const_cast<afl_state_t*>(data->afl), (u8*)buf, (u32)len);
+  }
+  if (fd >= 0) close(fd);
+}
+
+// what the campaign has traced, so a restarted one (e.g., AFL++ resumed
+// with -i-) doesn't trace its seeds and flip its branches again: the
+// queue ids of the seeds traced, and the covered branch directions; only
+// loaded on the same target binary and branch context
+static constexpr uint64_t kCheckpointIntervalUs = 60 * 1000000;
+static const uint64_t kCheckpointMagic = 0x4b434e41534d5953ULL; // SYMSANCK
+static uint64_t checkpoint_last_us = 0;
+
+struct checkpoint_header_t {
+  uint64_t magic;
+  uint64_t target_size;
+  uint64_t target_mtime;
+  char cov_context[16];
+  uint64_t num_inputs;
+  uint64_t num_branches;
+};
+
+static bool checkpoint_header(my_mutator_t *data, checkpoint_header_t &h) {
+  struct stat st;
+  if (stat(data->symsan_bin, &st)) return false;
+  memset(&h, 0, sizeof(h));
+  h.magic = kCheckpointMagic;
+  h.target_size = st.st_size;
+  h.target_mtime = st.st_mtime;
+  const char *cov_ctx = getenv("SYMSAN_COV_CONTEXT");
+  strncpy(h.cov_context, cov_ctx ? cov_ctx : "edge", sizeof(h.cov_context) - 1);
+  return true;
+}
+
+// the header, then the queue ids, then the keys of the branch contexts
+// and a byte of their covered directions each
+static void write_checkpoint(my_mutator_t *data, uint64_t now) {
+  checkpoint_last_us = now;
+  checkpoint_header_t h;
+  if (!checkpoint_header(data, h)) return;
+  std::vector<std::pair<uint64_t, uint8_t>> covered;
+  data->cov_mgr->covered(covered);
+  h.num_inputs = data->fuzzed_inputs.size();
+  h.num_branches = covered.size();
+  std::vector<u8> buf(sizeof(h) + h.num_inputs * sizeof(u32) +
+                      h.num_branches * (sizeof(uint64_t) + 1));
+  u8 *p = buf.data();
+  memcpy(p, &h, sizeof(h));
+  p += sizeof(h);
+  for (u32 id : data->fuzzed_inputs) {
+    memcpy(p, &id, sizeof(id));
+    p += sizeof(id);
+  }
+  for (auto const& [key, dirs] : covered) {
+    memcpy(p, &key, sizeof(key));
+    p += sizeof(key);
+    *p++ = dirs;
+  }
+
+  char *path = alloc_printf("%s/symsan_checkpoint", data->out_dir);
+  char *tmp = alloc_printf("%s.tmp", path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || write(fd, buf.data(), buf.size()) != (ssize_t)buf.size() ||
+      rename(tmp, path)) {
+    WARNF("Failed to write %s: %s\n", path, strerror(errno));
+  }
+  if (fd >= 0) close(fd);
+  ck_free(tmp);
+  ck_free(path);
+}
+
+static void load_checkpoint(my_mutator_t *data) {
+  char *path = alloc_printf("%s/symsan_checkpoint", data->out_dir);
+  int fd = open(path, O_RDONLY);
+  ck_free(path);
+  if (fd < 0) return;
+  struct stat st;
+  std::vector<u8> buf;
+  if (!fstat(fd, &st) && st.st_size >= (off_t)sizeof(checkpoint_header_t)) {
+    buf.resize(st.st_size);
+    if (read(fd, buf.data(), buf.size()) != (ssize_t)buf.size()) buf.clear();
+  }
+  close(fd);
+  checkpoint_header_t h, cur;
+  if (buf.empty() || !checkpoint_header(data, cur)) return;
+  memcpy(&h, buf.data(), sizeof(h));
+  if (h.magic != cur.magic || h.target_size != cur.target_size ||
+      h.target_mtime != cur.target_mtime ||
+      memcmp(h.cov_context, cur.cov_context, sizeof(h.cov_context))) {
+    WARNF("Not loading the checkpoint of another target or branch context\n");
+    return;
+  }
+  if (buf.size() != sizeof(h) + h.num_inputs * sizeof(u32) +
+                    h.num_branches * (sizeof(uint64_t) + 1)) {
+    WARNF("Not loading a truncated checkpoint\n");
+    return;
+  }
+  const u8 *p = buf.data() + sizeof(h);
+  for (uint64_t i = 0; i < h.num_inputs; i++, p += sizeof(u32)) {
+    u32 id;
+    memcpy(&id, p, sizeof(id));
+    data->fuzzed_inputs.insert(id);
+  }
+  for (uint64_t i = 0; i < h.num_branches; i++, p += sizeof(uint64_t) + 1) {
+    uint64_t key;
+    memcpy(&key, p, sizeof(key));
+    data->cov_mgr->restore(key, p[sizeof(key)]);
+  }
+  OKF("Loaded a checkpoint of %lu seeds and %lu branches\n",
+      h.num_inputs, h.num_branches);
+}
+
+// updates the memory of the subsystems, and trims those over their limits:
+// the parser caches are dropped at the next restart, the Z3 caches are
+// dropped on every thread, and the JIT cache and the task spilling keep to
+// their budgets on their own; the union table is checked while tracing
+static void check_memory(my_mutator_t *data) {
+  auto &mem = *data->mem;
+  mem.update(rgd::MemLimits::UnionTable, symsan_shm_bytes());
+  if (mem.update(rgd::MemLimits::Parser, data->parser->cache_bytes())) {
+    data->parser->drop_caches();
+    mem.trimmed(rgd::MemLimits::Parser);
+  }
+  if (data->spill) {
+    static size_t spilled = 0;
+    size_t resident, total_spilled;
+    {
+      // the solver threads take tasks under the lock
+      std::unique_lock<std::mutex> lock;
+      if (data->pipeline) {
+        lock = std::unique_lock<std::mutex>(data->pipeline->task_lock);
+      }
+      resident = data->spill->get_resident();
+      total_spilled = data->spill->get_total_spilled();
+    }
+    mem.update(rgd::MemLimits::Tasks, resident);
+    mem.trimmed(rgd::MemLimits::Tasks, total_spilled - spilled);
+    spilled = total_spilled;
+  }
+  if (mem.update(rgd::MemLimits::Jit, rgd::JITSolver::code_bytes())) {
+    mem.trimmed(rgd::MemLimits::Jit);
+  }
+  if (mem.update(rgd::MemLimits::Z3, rgd::Z3Solver::allocated_bytes())) {
+    // the threads of the pipeline drop theirs when they see the trim
+    for (auto &solver : data->solvers) solver->drop_caches();
+    mem.trimmed(rgd::MemLimits::Z3);
+  }
+}
+
+static inline void maybe_write_stats(my_mutator_t *data) {
+  uint64_t now = get_cur_time_us();
+  if (unlikely(now - stats_last_us >= kStatsIntervalUs)) {
+    write_stats(data, now);
+    if (data->const_dict) export_dict(data);
+    if (Checkpoint && now - checkpoint_last_us >= kCheckpointIntervalUs) {
+      write_checkpoint(data, now);
+    }
+  }
+}
+
+// has the runtime symbolize the pcs listed in a file to <file>.sym, in a run
+// of its own at the same load address as the traced ones
+static bool symbolize_sites(my_mutator_t *data, const char *pcs) {
+  if (!data->argv) return false; // nothing was traced
+  symsan_session_t *s = symsan_session_new(data->symsan_bin, UnionTableSize);
+  if (!s) return false;
+  int argc = 0;
+  while (data->argv[argc]) argc++;
+  bool ok =
+      symsan_session_set_input(s, data->afl->fsrv.use_stdin ? "stdin" : data->out_file) == 0 &&
+      symsan_session_set_args(s, argc, data->argv) == 0 &&
+      symsan_session_set_no_aslr(s, 1) == 0 &&
+      symsan_session_set_symbolize_pcs(s, pcs) == 0 &&
+      symsan_session_run(s, data->out_fd) == 0;
+  if (ok) {
+    // done once the runtime exits and closes the pipe
+    char c;
+    while (symsan_session_read_event(s, &c, sizeof(c), 0) > 0) {}
+  }
+  symsan_session_destroy(s);
+  return ok;
+}
+
+// writes the sites by total parse and solve time, with their locations
+static void write_site_profile(my_mutator_t *data) {
+  std::vector<std::pair<uint64_t, const site_profile_t*>> sites;
+  for (auto const& kv : site_profiles) {
+    sites.emplace_back(kv.first, &kv.second);
+  }
+  std::sort(sites.begin(), sites.end(), [](auto const& a, auto const& b) {
+    return a.second->total_us() > b.second->total_us();
+  });
+
+  std::unordered_map<uint64_t, std::string> locations;
+  char *pcs = alloc_printf("%s.pcs", SiteProfile);
+  char *syms = alloc_printf("%s.sym", pcs);
+  FILE *f = fopen(pcs, "w");
+  if (f) {
+    for (auto const& site : sites) fprintf(f, "%lx\n", site.first);
+    fclose(f);
+    if (symbolize_sites(data, pcs) && (f = fopen(syms, "r"))) {
+      char line[4096];
+      while (fgets(line, sizeof(line), f)) {
+        char *loc = nullptr;
+        uint64_t pc = strtoull(line, &loc, 16);
+        line[strcspn(line, "\n")] = 0;
+        if (*loc == ' ') locations[pc] = loc + 1;
+      }
+      fclose(f);
+    }
+    unlink(pcs);
+    unlink(syms);
+  }
+  ck_free(syms);
+  ck_free(pcs);
+
+  f = fopen(SiteProfile, "w");
+  if (!f) {
+    WARNF("Failed to create %s: %s\n", SiteProfile, strerror(errno));
+    return;
+  }
+  fprintf(f, "# addr id events ast_nodes tasks total_us parse_us");
+  for (auto &solver : data->solvers) {
+    const char *n = solver->name();
+    fprintf(f, " %s_us %s_sat %s_unsat %s_timeout", n, n, n, n);
+  }
+  fprintf(f, " location\n");
+  for (auto const& site : sites) {
+    auto const& p = *site.second;
+    fprintf(f, "0x%lx %u %lu %lu %lu %lu %lu", site.first, p.id, p.events,
+            p.ast_nodes, p.tasks, p.total_us(), p.parse_us);
+    for (size_t i = 0; i < data->solvers.size() && i < kMaxSolvers; i++) {
+      fprintf(f, " %lu %lu %lu %lu", p.solve_us[i],
+              p.results[i][rgd::SOLVER_SAT], p.results[i][rgd::SOLVER_UNSAT],
+              p.results[i][rgd::SOLVER_TIMEOUT]);
+    }
+    auto loc = locations.find(site.first);
+    fprintf(f, " %s\n", loc != locations.end() ? loc->second.c_str() : "??");
+  }
+  fclose(f);
+}
+
+// with SYMSAN_ADAPTIVE_BUDGET, how much of a seed's trace is worth reading:
+// the trace is cut once the tasks it yields per ms, over the last window
+// of events, fall well below the recent seeds' average, and the per-site
+// branch limit follows how the traces end
+struct trace_budget_t {
+  static constexpr uint32_t kMinSiteLimit = 16;
+  static constexpr uint32_t kMaxSiteLimit = 1024;
+  static constexpr u32 kWindow = 4096;   // events between checks
+  static constexpr uint64_t kMinUs = 5000; // never cut a trace before that
+  static constexpr uint32_t kFalloff = 8;
+
+  bool enabled = false;
+  uint32_t site_limit = MAX_LOCAL_BRANCH_COUNTER;
+  double avg_rate = 0; // tasks per ms of the recent seeds
+  // the current trace
+  uint64_t start_us = 0, window_us = 0;
+  uint64_t start_tasks = 0, window_tasks = 0;
+  uint32_t sites_at_limit = 0;
+
+  void start() {
+    start_us = window_us = get_cur_time_us();
+    start_tasks = window_tasks = total_tasks;
+    sites_at_limit = 0;
+  }
+
+  // called every kWindow events, false if the trace isn't worth reading on
+  bool check() {
+    uint64_t now = get_cur_time_us();
+    double rate = (double)(total_tasks - window_tasks) * 1000 /
+                  (now - window_us + 1);
+    window_us = now;
+    window_tasks = total_tasks;
+    return now - start_us < kMinUs || avg_rate == 0 ||
+           rate * kFalloff >= avg_rate;
+  }
+
+  void finish(bool cut) {
+    uint64_t us = get_cur_time_us() - start_us;
+    double rate = (double)(total_tasks - start_tasks) * 1000 / (us + 1);
+    avg_rate = avg_rate == 0 ? rate : avg_rate * 0.875 + rate * 0.125;
+    // a cut trace spent too long on repeated sites, a productive one hitting
+    // the limit on many sites could use more of them
+    if (cut) {
+      site_limit = std::max(site_limit / 2, kMinSiteLimit);
+    } else if (sites_at_limit > 0 && rate >= avg_rate) {
+      site_limit = std::min(site_limit * 2, kMaxSiteLimit);
+    }
+  }
+};
+
+static trace_budget_t budget;
+
+static inline uint32_t site_limit() {
+  return budget.enabled ? budget.site_limit : MAX_LOCAL_BRANCH_COUNTER;
+}
 
 static void reset_global_caches(size_t buf_size) {
   local_counter.clear();
   local_index_filter.clear();
 }
 
+// with solver threads, the tasks go to the task manager once the trace is
+// done, so the workers don't take them before the solvers are prepared
+static inline void queue_task(my_mutator_t *my_mutator, branch_ctx_t const& ctx,
+                              rgd::task_t const& task) {
+  if (unlikely(SiteProfile)) task->site = (uint64_t)ctx->addr;
+  if (!my_mutator->pipeline) {
+    my_mutator->task_mgr->add_task(ctx, task);
+  } else {
+    my_mutator->new_task_ctx.push_back(ctx);
+  }
+  my_mutator->new_tasks.push_back(task);
+  if (ByteMapProb) {
+    auto &bytes = my_mutator->trace_bytes;
+    for (auto const& c : task->constraints) {
+      for (auto const& [offset, value] : c->inputs) {
+        if (offset < bytes.size()) bytes[offset] = 1;
+      }
+    }
+  }
+}
+
+// keeps the bytes the branches of the trace read, for the havoc mutations
+static void save_byte_map(my_mutator_t *data, u32 input_id) {
+  std::vector<u32> offsets;
+  for (size_t i = 0; i < data->trace_bytes.size(); i++) {
+    if (data->trace_bytes[i]) offsets.push_back(i);
+  }
+  if (!offsets.empty()) data->byte_maps[input_id] = std::move(offsets);
+  data->trace_bytes.clear();
+}
+
+// appends the branch, as its site, direction and the hash of its condition,
+// to the signature of the trace; whether the trace still shares it with the
+// parent seed, whose tasks for it were queued then
+static bool shared_with_parent(my_mutator_t *data, pipe_msg const& msg) {
+  u32 sig = (((msg.id * 0x9E3779B1u) ^ get_label_info(msg.label)->hash) << 1) |
+            (msg.result != 0);
+  size_t i = data->trace_sig.size();
+  if (i < kMaxBranchSig) data->trace_sig.push_back(sig);
+  if (!data->parent_sig) return false;
+  if (i < data->parent_sig->size() && (*data->parent_sig)[i] == sig) return true;
+  // diverged, the rest is parsed
+  data->parent_sig = nullptr;
+  return false;
+}
+
 static void handle_cond(pipe_msg &msg, my_mutator_t *my_mutator) {
   if (unlikely(msg.label == 0)) {
     return;
@@ -160,26 +1037,48 @@ static void handle_cond(pipe_msg &msg, my_mutator_t *my_mutator) {
   }
 
   total_branches += 1;
+  bool shared = DiffTrace && shared_with_parent(my_mutator, msg);
 
   // apply a local (per input) branch filter
   auto &lc = local_counter[msg.id];
-  if (lc > MAX_LOCAL_BRANCH_COUNTER) {
+  if (lc > site_limit()) {
     return;
-  } else {
-    lc += 1;
+  } else if (++lc > site_limit()) {
+    budget.sites_at_limit += 1;
+  }
+
+  if (my_mutator->archive) {
+    my_mutator->archive->trace.add_cond(msg.label, msg.result != 0,
+                                        msg.flags & F_ADD_CONS);
   }
 
-  const branch_ctx_t ctx = my_mutator->cov_mgr->add_branch((void*)msg.addr,
+  branch_ctx_t ctx = my_mutator->cov_mgr->add_branch((void*)msg.addr,
       msg.id, msg.result != 0, msg.context, false, false);
 
-  branch_ctx_t neg_ctx = std::make_shared<rgd::BranchContext>();
-  *neg_ctx = *ctx;
-  neg_ctx->direction = !ctx->direction;
+  branch_ctx_t neg_ctx = my_mutator->cov_mgr->flip(ctx, !ctx->direction);
 
-  if (my_mutator->cov_mgr->is_branch_interesting(neg_ctx)) {
+  if (shared && my_mutator->cov_mgr->is_branch_interesting(neg_ctx)) {
+    diff_skipped_branches += 1;
+  } else if (my_mutator->remote) {
+    if (my_mutator->cov_mgr->is_branch_interesting(neg_ctx)) {
+      // parsed by the workers
+      my_mutator->remote->trace.add_cond(msg.label, ctx->direction,
+                                         msg.flags & F_ADD_CONS);
+      branches_to_solve += 1;
+    }
+  } else if (my_mutator->cov_mgr->is_branch_interesting(neg_ctx)) {
     // parse the uniont table AST to solving tasks
     std::vector<uint64_t> tasks;
-    if (my_mutator->parser->parse_cond(msg.label, ctx->direction, msg.flags & F_ADD_CONS, tasks) != 0) {
+    uint64_t parse_start = get_cur_time_us();
+    int ret = my_mutator->parser->parse_cond(msg.label, ctx->direction,
+                                             msg.flags & F_ADD_CONS, tasks);
+    uint64_t parse_us = get_cur_time_us() - parse_start;
+    parse_latency.add(parse_us);
+    if (unlikely(SiteProfile)) {
+      profile_parse(msg.addr, msg.id, my_mutator->parser->ast_size(msg.label),
+                    tasks.size(), parse_us);
+    }
+    if (ret != 0) {
       WARNF("Failed to parse the condition %u, from input %s\n", msg.label, my_mutator->cur_queue_entry);
       // symsan_terminate();
       return;
@@ -188,7 +1087,7 @@ static void handle_cond(pipe_msg &msg, my_mutator_t *my_mutator) {
     // add the tasks to the task manager
     for (auto const& task_id : tasks) {
       auto task = my_mutator->parser->retrieve_task(task_id);
-      my_mutator->task_mgr->add_task(neg_ctx, task);
+      queue_task(my_mutator, neg_ctx, task);
 #if PRINT_STATS
       task_size_dist[task->constraints.size()] += 1;
 #endif
@@ -199,6 +1098,103 @@ static void handle_cond(pipe_msg &msg, my_mutator_t *my_mutator) {
   }
 }
 
+// each case of a switch is tracked as a branch of its own, keyed by the
+// address of the switch plus the case index above the user space addresses
+static inline void *switch_case_addr(uptr addr, uint32_t target) {
+  return (void*)(addr + ((uptr)(target + 1) << 47));
+}
+
+static void handle_switch(pipe_msg &msg, switch_msg &smsg,
+                          const std::vector<uint64_t> &cases, my_mutator_t *my_mutator) {
+  if (unlikely(msg.label == 0)) {
+    return;
+  } else if (unlikely(msg.label == kInitializingLabel)) {
+    WARNF("UBI switch cond @%p\n", (void*)msg.addr);
+    return;
+  }
+
+  total_branches += 1;
+
+  // apply a local (per input) branch filter
+  auto &lc = local_counter[msg.id];
+  if (lc > site_limit()) {
+    return;
+  } else if (++lc > site_limit()) {
+    budget.sites_at_limit += 1;
+  }
+
+  // the default is the target past the last case
+  uint32_t num_cases = cases.size();
+  uint32_t taken = num_cases;
+  for (uint32_t i = 0; i < num_cases; i++) {
+    if (cases[i] == msg.result) {
+      taken = i;
+      break;
+    }
+  }
+
+  std::vector<uint32_t> targets;
+  if (my_mutator->archive) {
+    // all the other targets
+    for (uint32_t t = 0; t <= num_cases; t++) {
+      if (t != taken) targets.push_back(t);
+    }
+    my_mutator->archive->trace.add_switch(msg.label, msg.result, cases,
+                                          targets, smsg.taken_label);
+    targets.clear();
+  }
+  std::vector<branch_ctx_t> target_ctx(num_cases + 1);
+  for (uint32_t t = 0; t <= num_cases; t++) {
+    branch_ctx_t ctx = my_mutator->cov_mgr->add_branch(
+        switch_case_addr(msg.addr, t), msg.id, t == taken, msg.context, false, false);
+    if (t == taken)
+      continue;
+    branch_ctx_t neg_ctx = my_mutator->cov_mgr->flip(ctx, true);
+    if (my_mutator->cov_mgr->is_branch_interesting(neg_ctx)) {
+      targets.push_back(t);
+      target_ctx[t] = neg_ctx;
+    }
+  }
+
+  if (targets.empty())
+    return;
+
+  if (my_mutator->remote) {
+    my_mutator->remote->trace.add_switch(msg.label, msg.result, cases, targets,
+                                         smsg.taken_label);
+    branches_to_solve += 1;
+    return;
+  }
+
+  // parse the union table AST to solving tasks, for all the targets at once
+  std::vector<std::pair<uint32_t, uint64_t>> tasks;
+  uint64_t parse_start = get_cur_time_us();
+  int ret = my_mutator->parser->parse_switch(msg.label, msg.result, cases,
+                                             targets, smsg.taken_label, tasks);
+  uint64_t parse_us = get_cur_time_us() - parse_start;
+  parse_latency.add(parse_us);
+  if (unlikely(SiteProfile)) {
+    profile_parse(msg.addr, msg.id, my_mutator->parser->ast_size(msg.label),
+                  tasks.size(), parse_us);
+  }
+  if (ret != 0) {
+    WARNF("Failed to parse the switch %u, from input %s\n", msg.label, my_mutator->cur_queue_entry);
+    return;
+  }
+
+  // add the tasks to the task manager
+  for (auto const& t : tasks) {
+    auto task = my_mutator->parser->retrieve_task(t.second);
+    queue_task(my_mutator, target_ctx[t.first], task);
+#if PRINT_STATS
+    task_size_dist[task->constraints.size()] += 1;
+#endif
+  }
+
+  total_tasks += tasks.size();
+  branches_to_solve += 1;
+}
+
 static void handle_gep(gep_msg &gmsg, pipe_msg &msg, my_mutator_t *my_mutator) {
   // msg.label === gmsg.index_label
   if (unlikely(msg.label == 0)) {
@@ -213,22 +1209,42 @@ static void handle_gep(gep_msg &gmsg, pipe_msg &msg, my_mutator_t *my_mutator) {
     return;
   }
 
+  if (my_mutator->archive) {
+    my_mutator->archive->trace.add_gep(gmsg.ptr_label, gmsg.ptr, gmsg.index_label,
+        gmsg.index, gmsg.num_elems, gmsg.elem_size, gmsg.current_offset);
+  }
+
+  if (my_mutator->remote) {
+    my_mutator->remote->trace.add_gep(gmsg.ptr_label, gmsg.ptr, gmsg.index_label,
+        gmsg.index, gmsg.num_elems, gmsg.elem_size, gmsg.current_offset);
+    return;
+  }
+
   // parse the uniont table AST to solving tasks
   std::vector<uint64_t> tasks;
-  if (my_mutator->parser->parse_gep(gmsg.ptr_label, gmsg.ptr, gmsg.index_label, gmsg.index,
-        gmsg.num_elems, gmsg.elem_size, gmsg.current_offset, false, tasks) != 0) {
+  uint64_t parse_start = get_cur_time_us();
+  int ret = my_mutator->parser->parse_gep(gmsg.ptr_label, gmsg.ptr, gmsg.index_label,
+      gmsg.index, gmsg.num_elems, gmsg.elem_size, gmsg.current_offset, false, tasks);
+  uint64_t parse_us = get_cur_time_us() - parse_start;
+  parse_latency.add(parse_us);
+  if (unlikely(SiteProfile)) {
+    profile_parse(msg.addr, msg.id, my_mutator->parser->ast_size(gmsg.index_label),
+                  tasks.size(), parse_us);
+  }
+  if (ret != 0) {
     WARNF("Failed to parse symbolic index %u, from input %s\n", gmsg.index_label, my_mutator->cur_queue_entry);
     // symsan_terminate();
     return;
   }
 
   // add the tasks to the task manager, with a dummy context
-  branch_ctx_t ctx = std::make_shared<rgd::BranchContext>();
-  ctx->addr = (void*)msg.addr;
-  ctx->direction = true;
+  auto &gep_ctx = my_mutator->gep_ctx[msg.addr];
+  gep_ctx.addr = (void*)msg.addr;
+  gep_ctx.direction = true;
+  branch_ctx_t ctx = &gep_ctx;
   for (auto const& task_id : tasks) {
     auto task = my_mutator->parser->retrieve_task(task_id);
-    my_mutator->task_mgr->add_task(ctx, task);
+    queue_task(my_mutator, ctx, task);
 #if PRINT_STATS
     task_size_dist[task->constraints.size()] += 1;
 #endif
@@ -248,26 +1264,220 @@ extern "C" void afl_custom_splice_optout(my_mutator_t *data) {
 /// @return custom mutator state
 extern "C" my_mutator_t *afl_custom_init(afl_state *afl, unsigned int seed) {
 
-  (void)(seed);
-
   struct stat st;
-  rgd::TaskManager *tmgr = new rgd::FIFOTaskManager();
-  rgd::CovManager *cmgr = new rgd::EdgeCovManager();
+  // solve the rare, cheap and deep branches first, or in trace order
+  rgd::TaskManager *tmgr;
+  if (getenv("SYMSAN_TASK_PRIORITY")) {
+    tmgr = new rgd::PriorityTaskManager();
+  } else {
+    tmgr = new rgd::FIFOTaskManager();
+  }
+  // don't queue the same flip again for every seed reaching the branch
+  if (getenv("SYMSAN_DEDUP_TASKS")) {
+    tmgr = new rgd::DedupTaskManager(tmgr);
+  }
+  // the context a branch is told apart in, just its address by default
+  rgd::CovManager *cmgr;
+  const char *cov_ctx = getenv("SYMSAN_COV_CONTEXT");
+  if (!cov_ctx || !strcmp(cov_ctx, "edge")) {
+    cmgr = new rgd::EdgeCovManager();
+  } else if (!strcmp(cov_ctx, "hybrid")) {
+    cmgr = new rgd::HybridCovManager();
+  } else if (!strcmp(cov_ctx, "context")) {
+    cmgr = new rgd::ContextAwareCovManager();
+  } else if (!strcmp(cov_ctx, "loop")) {
+    cmgr = new rgd::LoopAwareCovManager();
+  } else if (!strcmp(cov_ctx, "history")) {
+    cmgr = new rgd::HistoryAwareCovManager();
+  } else if (!strcmp(cov_ctx, "full")) {
+    cmgr = new rgd::FullCovManager();
+  } else if (!strcmp(cov_ctx, "afl")) {
+    auto afl_cov = new AflCovManager(afl->virgin_bits, afl->fsrv.map_size);
+    const char *edge_map = getenv("SYMSAN_EDGE_MAP");
+    if (!edge_map || !afl_cov->load(edge_map)) {
+      FATAL("SYMSAN_COV_CONTEXT=afl needs a readable SYMSAN_EDGE_MAP");
+    }
+    cmgr = afl_cov;
+  } else {
+    FATAL("Unknown SYMSAN_COV_CONTEXT %s", cov_ctx);
+  }
   my_mutator_t *data = new my_mutator_t(afl, tmgr, cmgr);
   if (!data) {
     FATAL("afl_custom_init alloc");
     return NULL;
   }
+  data->rng = ((uint64_t)seed << 1) | 1;
+  // account for the memory of each subsystem, with soft limits in MB
+  if (char *mem_limits = getenv("SYMSAN_MEM_LIMITS")) {
+    data->mem.reset(new rgd::MemLimits());
+    if (!data->mem->parse(mem_limits)) {
+      FATAL("Invalid SYMSAN_MEM_LIMITS %s", mem_limits);
+    }
+  }
+  // magic strings first, straight from the recorded memcmp buffers
+  if (getenv("SYMSAN_USE_MEMCMP")) {
+    data->solvers.emplace_back(std::make_shared<rgd::MemcmpSolver>());
+  }
   // always use the simpler i2s solver
   data->solvers.emplace_back(std::make_shared<rgd::I2SSolver>());
-  if (getenv("SYMSAN_USE_JIGSAW"))
-    data->solvers.emplace_back(std::make_shared<rgd::JITSolver>());
+  // then the equalities over invertible operations
+  if (getenv("SYMSAN_USE_INVERSE")) {
+    data->solvers.emplace_back(std::make_shared<rgd::InverseSolver>());
+  }
+  // and the constraints linear in the input, in closed form
+  if (getenv("SYMSAN_USE_LINEAR")) {
+    data->solvers.emplace_back(std::make_shared<rgd::LinearSolver>());
+  }
+  // JIT off the fuzzing thread, interpreting constraints in the meantime,
+  // and search each task from a few start points at once
+  if (getenv("SYMSAN_USE_JIGSAW")) {
+    char *gd_threads = getenv("SYMSAN_GD_THREADS");
+    char *jit_cache = getenv("SYMSAN_JIT_CACHE_MB");
+    size_t jit_bytes = (jit_cache ? strtoul(jit_cache, NULL, 0) : kJitCacheMB) << 20;
+    if (data->mem && data->mem->limit(rgd::MemLimits::Jit)) {
+      jit_bytes = data->mem->limit(rgd::MemLimits::Jit);
+    }
+    data->solvers.emplace_back(std::make_shared<rgd::JITSolver>(
+        getenv("SYMSAN_ASYNC_JIT") != nullptr,
+        gd_threads ? strtoul(gd_threads, NULL, 0) : 1, jit_bytes));
+    if (char *task_ms = getenv("SYMSAN_GD_TASK_MS")) {
+      std::static_pointer_cast<rgd::JITSolver>(data->solvers.back())
+          ->set_task_budget(strtoull(task_ms, NULL, 0) * 1000);
+    }
+    if (char *hot = getenv("SYMSAN_JIT_HOT_EVALS")) {
+      std::static_pointer_cast<rgd::JITSolver>(data->solvers.back())
+          ->set_hot_threshold(strtoull(hot, NULL, 0));
+    }
+    if (char *fuse = getenv("SYMSAN_JIT_FUSE_TASKS")) {
+      std::static_pointer_cast<rgd::JITSolver>(data->solvers.back())
+          ->set_fusion_threshold(strtoul(fuse, NULL, 0));
+    }
+  }
   if (getenv("SYMSAN_USE_Z3"))
-    data->solvers.emplace_back(std::make_shared<rgd::Z3Solver>());
+    data->solvers.emplace_back(
+        std::make_shared<rgd::Z3Solver>(getenv("SYMSAN_Z3_TACTICS")));
+  if (getenv("SYMSAN_USE_BTOR")) {
+#if SYMSAN_HAS_BOOLECTOR
+    data->solvers.emplace_back(std::make_shared<rgd::BtorSolver>());
+#else
+    WARNF("SYMSAN_USE_BTOR set, but built without boolector\n");
+#endif
+  }
   // make nested solving optional too
   if (getenv("SYMSAN_USE_NESTED")) {
     NestedSolving = true;
   }
+  // only the recent related branches go into a nested task
+  char *nested_window = getenv("SYMSAN_NESTED_WINDOW");
+  if (nested_window) {
+    NestedWindow = strtoul(nested_window, NULL, 0);
+  }
+  if (getenv("SYMSAN_NESTED_SLICE")) {
+    NestedSlice = true;
+  }
+  // solve the parts of a task over disjoint input bytes one at a time
+  if (getenv("SYMSAN_SPLIT_TASKS")) {
+    SplitTasks = true;
+  }
+  // remember the cores of unsat tasks, and reject the tasks containing one
+  if (getenv("SYMSAN_UNSAT_CORES")) {
+    data->unsat_cores = std::make_shared<rgd::UnsatCoreCache>();
+    for (auto &solver : data->solvers) {
+      solver->set_unsat_cores(data->unsat_cores);
+    }
+  }
+  // harvest the constants compared against, to plant into the restarts of
+  // the searches and to hand to AFL++ as a dictionary
+  if (getenv("SYMSAN_DICT")) {
+    data->const_dict = std::make_shared<rgd::ConstDict>();
+    for (auto &solver : data->solvers) {
+      if (auto *jit = dynamic_cast<rgd::JITSolver*>(solver.get())) {
+        jit->set_const_dict(data->const_dict);
+      }
+    }
+  }
+  // order the solvers per task, by how they did on similar ones
+  if (getenv("SYMSAN_SCHEDULE_SOLVERS")) {
+    data->scheduler = std::make_unique<rgd::SolverScheduler>(data->solvers.size());
+  }
+  // trace the seeds by how many tasks similar ones made
+  if (getenv("SYMSAN_SCHEDULE_SEEDS")) {
+    data->seed_sched = std::make_unique<rgd::SeedScheduler>();
+  }
+  // cut traces that stop yielding tasks, and adapt the per-site limit
+  if (getenv("SYMSAN_ADAPTIVE_BUDGET")) {
+    budget.enabled = true;
+  }
+  // solve on a few threads instead of in afl_custom_fuzz
+  char *solve_threads = getenv("SYMSAN_SOLVE_THREADS");
+  if (solve_threads) {
+    SolveThreads = strtoul(solve_threads, NULL, 0);
+  }
+  // run the solutions ourselves and only hand out the ones AFL++ would keep
+  char *validate_batch = getenv("SYMSAN_VALIDATE_BATCH");
+  if (validate_batch) {
+    ValidateBatch = strtoul(validate_batch, NULL, 0);
+  }
+  // hand out up to this many different solutions of each task
+  char *solutions = getenv("SYMSAN_SOLUTIONS");
+  if (solutions) {
+    MaxSolutions = std::max(strtoul(solutions, NULL, 0), 1UL);
+  }
+  // stop solving for a seed after this long, the rest waits for the next
+  char *seed_solve_ms = getenv("SYMSAN_SEED_SOLVE_MS");
+  if (seed_solve_ms) {
+    SeedSolveBudgetUs = strtoull(seed_solve_ms, NULL, 0) * 1000;
+  }
+  // save the tasks that get solved, and their seeds
+  char *capture_tasks = getenv("SYMSAN_CAPTURE_TASKS");
+  if (capture_tasks) {
+    TaskCapture = new rgd::TaskFile();
+    if (!TaskCapture->open(capture_tasks)) {
+      FATAL("failed to open %s for the captured tasks", capture_tasks);
+    }
+  }
+  // huge pages for the union table, with its first MB faulted in
+  char *huge_pages = getenv("SYMSAN_HUGE_PAGES");
+  if (huge_pages) {
+    HugePages = 1;
+    PrefaultMB = strtoul(huge_pages, NULL, 0);
+  }
+  // pin the target, and bind the union table, near the parser
+  char *affinity = getenv("SYMSAN_AFFINITY");
+  if (affinity) {
+    if (!strcmp(affinity, "auto")) {
+      AffinityAuto = true;
+    } else if (!strncmp(affinity, "node", 4)) {
+      AffinityNode = atoi(affinity + 4);
+    } else {
+      AffinityCpu = atoi(affinity);
+    }
+  }
+  // only label the bytes the branches of a large seed read
+  char *trim_seeds = getenv("SYMSAN_TRIM_SEEDS");
+  if (trim_seeds) {
+    TrimSeeds = strtoul(trim_seeds, NULL, 0);
+  }
+  // trace the seeds from a snapshot of the target past the first
+  // milliseconds of a trace, when they share the input read by then
+  char *snapshot_ms = getenv("SYMSAN_SNAPSHOT_MS");
+  if (snapshot_ms) {
+    SnapshotMs = strtoul(snapshot_ms, NULL, 0);
+  }
+  // point AFL++'s havoc at the bytes the branches read
+  char *byte_map = getenv("SYMSAN_BYTE_MAP");
+  if (byte_map) {
+    ByteMapProb = (u8)std::min<unsigned long>(strtoul(byte_map, NULL, 0), 100);
+  }
+  // only parse the branches past the prefix a seed shares with the seed it
+  // was found from; the nested tasks need every branch parsed
+  if (getenv("SYMSAN_DIFF_TRACE")) {
+    if (NestedSolving) {
+      WARNF("SYMSAN_DIFF_TRACE ignored with SYMSAN_USE_NESTED\n");
+    } else {
+      DiffTrace = true;
+    }
+  }
   // enable trace bounds?
   if (getenv("SYMSAN_TRACE_BOUNDS")) {
     TraceBounds = 1;
@@ -276,6 +1486,76 @@ extern "C" my_mutator_t *afl_custom_init(afl_state *afl, unsigned int seed) {
   if (getenv("SYMSAN_FORCE_STDIN")) {
     ForceStdin = 1;
   }
+  // a smaller table for small targets, or a larger one for long traces
+  char *ut_size = getenv("SYMSAN_UNION_TABLE_SIZE");
+  if (ut_size) {
+    UnionTableSize = strtoull(ut_size, NULL, 0);
+    MAX_LABEL = UnionTableSize /
+        (sizeof(dfsan_label_info) + sizeof(dfsan_label_operands));
+  }
+  // avoid exec'ing the target for every seed
+  if (getenv("SYMSAN_USE_FORKSERVER")) {
+    UseForkServer = 1;
+  }
+  // the target loops over inputs with __symsan_loop
+  if (getenv("SYMSAN_USE_PERSISTENT")) {
+    UsePersistent = 1;
+  }
+  if (getenv("SYMSAN_PERSISTENT_GC")) {
+    PersistentGC = 1;
+  }
+  // receive events through the shm ring instead of the pipe
+  if (getenv("SYMSAN_USE_EVENT_RING")) {
+    UseEventRing = 1;
+  }
+  // only label the pages of mmapped inputs the target touches
+  if (getenv("SYMSAN_LAZY_MMAP_TAINT")) {
+    LazyMmapTaint = 1;
+  }
+  // checksum-like loops over the input are one label, not one per byte
+  if (getenv("SYMSAN_SUMMARIZE_SUMS")) {
+    SummarizeSums = 1;
+  }
+  // memcmp content stays in the shm instead of being copied per event
+  if (getenv("SYMSAN_MEMCMP_BLOB")) {
+    MemcmpBlob = 1;
+  }
+  // conds the site limit or AFL++'s coverage would drop aren't sent
+  if (getenv("SYMSAN_BRANCH_FILTER")) {
+    BranchFilter = 1;
+  }
+  // where the parse and solve time goes, per branch site
+  SiteProfile = getenv("SYMSAN_SITE_PROFILE");
+  // only the selected bytes of the input are symbolic
+  TaintRanges = getenv("SYMSAN_TAINT_RANGES");
+  TaintInputs = getenv("SYMSAN_TAINT_INPUTS");
+  // the expressions the parser would reject aren't built in the first place
+  if (getenv("SYMSAN_RUNTIME_AST_CAP")) {
+    RuntimeAstCap = 1;
+  }
+  // scan long traces with a few threads
+  char *scan_threads = getenv("SYMSAN_SCAN_THREADS");
+  if (scan_threads) {
+    ScanThreads = strtoul(scan_threads, NULL, 0);
+  }
+  // bound the tasks made from one branch condition
+  char *max_dnf = getenv("SYMSAN_MAX_DNF_CLAUSES");
+  if (max_dnf) {
+    MaxDnfClauses = strtoul(max_dnf, NULL, 0);
+  }
+  max_dnf = getenv("SYMSAN_MAX_DNF_LITERALS");
+  if (max_dnf) {
+    MaxDnfLiterals = strtoul(max_dnf, NULL, 0);
+  }
+  // bound the parser caches for very long traces
+  char *parser_window = getenv("SYMSAN_PARSER_WINDOW");
+  if (parser_window) {
+    ParserWindow = strtoul(parser_window, NULL, 0);
+  }
+  char *parser_exprs = getenv("SYMSAN_PARSER_EXPRS");
+  if (parser_exprs) {
+    ParserExprs = strtoul(parser_exprs, NULL, 0);
+  }
 
   if (!(data->symsan_bin = getenv("SYMSAN_TARGET"))) {
     FATAL(
@@ -291,6 +1571,33 @@ extern "C" my_mutator_t *afl_custom_init(afl_state *afl, unsigned int seed) {
     PFATAL("Could not create the output directory %s", data->out_dir);
   }
 
+  // pick up where the last session on this output directory stopped
+  if (getenv("SYMSAN_CHECKPOINT")) {
+    Checkpoint = true;
+    load_checkpoint(data);
+    checkpoint_last_us = get_cur_time_us();
+  }
+
+  // keep the queued tasks within a memory budget, spilling the rest
+  const char *task_mem = getenv("SYMSAN_TASK_MEM_MB");
+  size_t task_budget = task_mem ? strtoull(task_mem, NULL, 0) << 20 : 0;
+  if (data->mem && data->mem->limit(rgd::MemLimits::Tasks)) {
+    task_budget = data->mem->limit(rgd::MemLimits::Tasks);
+  }
+  if (task_budget) {
+    auto spill = new rgd::SpillTaskManager(data->task_mgr, task_budget);
+    char *path = alloc_printf("%s/.task_spill", data->out_dir);
+    if (!spill->open(path)) {
+      WARNF("Failed to create %s: %s\n", path, strerror(errno));
+    }
+    ck_free(path);
+    data->task_mgr = data->spill = spill;
+  } else if (data->mem) {
+    // no file to spill to, it only counts the bytes
+    data->task_mgr = data->spill =
+        new rgd::SpillTaskManager(data->task_mgr, SIZE_MAX);
+  }
+
   // setup output file
   char *out_file;
   if (afl->file_extension) {
@@ -314,16 +1621,61 @@ extern "C" my_mutator_t *afl_custom_init(afl_state *afl, unsigned int seed) {
   }
 
   // setup symsan launcher
-  __dfsan_label_info = (dfsan_label_info *)symsan_init(data->symsan_bin, uniontable_size);
+  __dfsan_label_info = (dfsan_label_info *)symsan_init(data->symsan_bin, UnionTableSize);
   if (__dfsan_label_info == (void *)-1) {
     FATAL("Failed to init symsan launcher: %s\n", strerror(errno));
   }
+  __dfsan_label_operands = get_label_operands_base(__dfsan_label_info, UnionTableSize);
 
   // setup the parser
-  data->parser = new rgd::RGDAstParser(__dfsan_label_info, uniontable_size, NestedSolving, MAX_AST_SIZE);
+  data->parser = new rgd::RGDAstParser(__dfsan_label_info, UnionTableSize, NestedSolving, MAX_AST_SIZE,
+                                       ScanThreads);
   if (!data->parser) {
     FATAL("Failed to create parser\n");
   }
+  data->parser->set_dnf_budget(MaxDnfClauses, MaxDnfLiterals);
+  data->parser->set_nested_window(NestedWindow, NestedSlice);
+  data->parser->set_split_tasks(SplitTasks);
+  data->parser->set_streaming(ParserWindow, ParserExprs);
+  data->parser->set_const_dict(data->const_dict);
+
+  // share task outcomes across sessions and instances
+  char *task_store = getenv("SYMSAN_TASK_STORE");
+  if (task_store && !data->task_store.open(task_store)) {
+    WARNF("Failed to open task store %s, not using it\n", task_store);
+  } else if (task_store && getenv("SYMSAN_CLAIM_TASKS")) {
+    data->claim_tasks = true;
+  }
+  char *seed_store = getenv("SYMSAN_SEED_STORE");
+  if (seed_store && !data->seed_store.open(seed_store)) {
+    WARNF("Failed to open seed store %s, not using it\n", seed_store);
+  }
+  // ship the traces to symsan-worker processes, which may run on other
+  // hosts, instead of parsing and solving them here
+  char *remote_dir = getenv("SYMSAN_REMOTE_DIR");
+  if (remote_dir) {
+    data->remote = std::make_unique<remote_t>();
+    if (!data->remote->spool.open(remote_dir)) {
+      FATAL("Failed to open the remote spool %s: %s\n", remote_dir, strerror(errno));
+    }
+    char host[256];
+    if (gethostname(host, sizeof(host)) != 0) strcpy(host, "localhost");
+    host[sizeof(host) - 1] = 0;
+    data->remote->prefix = std::string(host) + "." + std::to_string(getpid()) + "-";
+    if (SolveThreads > 0) {
+      WARNF("The workers solve the traces, not using the solver threads\n");
+      SolveThreads = 0;
+    }
+  }
+
+  // keep the traces of all the seeds, to parse and solve them again offline
+  char *archive_path = getenv("SYMSAN_TRACE_ARCHIVE");
+  if (archive_path) {
+    data->archive = std::make_unique<archive_t>();
+    if (!data->archive->file.open(archive_path)) {
+      FATAL("Failed to open the trace archive %s: %s\n", archive_path, strerror(errno));
+    }
+  }
 
   // allocate output buffer
   data->output_buf = (u8 *)malloc(MAX_FILE+1);
@@ -331,6 +1683,24 @@ extern "C" my_mutator_t *afl_custom_init(afl_state *afl, unsigned int seed) {
     FATAL("Failed to alloc output buffer\n");
   }
 
+  open_stats(data);
+
+  if (SolveThreads > 0) {
+    data->pipeline = std::make_unique<solve_pipeline_t>(data);
+  }
+  // don't solve the tasks of branch directions covered while they waited
+  if (getenv("SYMSAN_DROP_STALE_TASKS")) {
+    // workers take the tasks with task_lock held
+    auto pipeline = data->pipeline.get();
+    data->task_mgr->set_cov_manager(data->cov_mgr,
+        [pipeline](const rgd::SearchTask *task) {
+          if (pipeline) pipeline->task_seeds.erase(task);
+        });
+  }
+  if (data->pipeline) {
+    data->pipeline->start(SolveThreads);
+  }
+
 #if PRINT_STATS
   char *log_f = getenv("SYMSAN_LOG_FILE");
   if (log_f) {
@@ -347,10 +1717,224 @@ extern "C" my_mutator_t *afl_custom_init(afl_state *afl, unsigned int seed) {
 }
 
 extern "C" void afl_custom_deinit(my_mutator_t *data) {
+  write_stats(data, get_cur_time_us());
+  if (Checkpoint) write_checkpoint(data, get_cur_time_us());
+  if (SiteProfile) write_site_profile(data);
+  if (plot_fd >= 0) close(plot_fd);
   symsan_destroy();
   delete data;
 }
 
+// the other hardware thread of cpu's core, so the target and AFL++ share
+// its caches without taking each other's cycles; cpu itself if there's
+// none, -1 if cpu is
+static int smt_sibling(int cpu) {
+  if (cpu < 0) return -1;
+  char path[96], buf[256];
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return cpu;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) return cpu;
+  buf[n] = 0;
+  // e.g., "3,35" or "2-3"
+  for (char *p = buf; *p >= '0' && *p <= '9';) {
+    long lo = strtol(p, &p, 10), hi = lo;
+    if (*p == '-') hi = strtol(p + 1, &p, 10);
+    for (long c = lo; c <= hi; c++) {
+      if (c != cpu) return (int)c;
+    }
+    if (*p == ',') p++;
+  }
+  return cpu;
+}
+
+// a first trace of a large seed that only scans the labels of the branch
+// events for the input bytes they read, into the ranges for the runtime
+// to label in the actual trace; false if it failed or the ranges wouldn't
+// leave out at least half the seed, an empty ranges if no branch reads any
+static bool find_branch_bytes(my_mutator_t *data, const u8 *buf, size_t buf_size,
+                              u32 timeout, std::string &ranges) {
+  symsan_set_taint_ranges("");
+  if (symsan_run(data->out_fd) != 0) {
+    return false;
+  }
+  std::vector<symsan::input_t> inputs;
+  inputs.push_back({buf, buf_size});
+  data->parser->restart(inputs);
+
+  std::vector<uint8_t> used(buf_size, 0);
+  auto mark = [&](dfsan_label label) {
+    if (auto *deps = data->parser->input_deps(label)) {
+      deps->for_each([&](size_t i) { if (i < buf_size) used[i] = 1; });
+    }
+  };
+  pipe_msg msg;
+  gep_msg gmsg;
+  switch_msg smsg;
+  memcmp_msg mmsg;
+  memcmp_blob_msg bmsg;
+  std::vector<uint64_t> cases;
+  size_t msg_size;
+  size_t num_msgs = 0;
+  bool ok = true;
+  uint64_t start = get_cur_time_us();
+  // the payloads of the other events are read too, to stay in step
+  while (ok && symsan_read_event(&msg, sizeof(msg), timeout) == sizeof(msg)) {
+    switch (msg.msg_type) {
+      case cond_type:
+        mark(msg.label);
+        break;
+      case gep_type:
+        ok = symsan_read_event(&gmsg, sizeof(gmsg), 0) == sizeof(gmsg);
+        if (ok) mark(gmsg.index_label);
+        break;
+      case switch_type:
+        ok = symsan_read_event(&smsg, sizeof(smsg), 0) == sizeof(smsg);
+        if (!ok) break;
+        cases.resize(smsg.num_cases);
+        msg_size = smsg.num_cases * sizeof(uint64_t);
+        ok = symsan_read_event(cases.data(), msg_size, 0) == msg_size;
+        mark(msg.label);
+        break;
+      case memcmp_type: {
+        if (msg.label == 0 || msg.label >= MAX_LABEL) break;
+        mark(msg.label);
+        dfsan_label_info *info = get_label_info(msg.label);
+        if (info->l1 != CONST_LABEL && info->l2 != CONST_LABEL) break;
+        if (msg.flags & F_MEMCMP_BLOB) {
+          ok = symsan_read_event(&bmsg, sizeof(bmsg), 0) == sizeof(bmsg);
+          break;
+        }
+        ok = symsan_read_event(&mmsg, sizeof(mmsg), 0) == sizeof(mmsg) &&
+             symsan_read_event(data->parser->memcmp_buffer(msg.result),
+                               msg.result, 0) == msg.result;
+        break;
+      }
+      default:
+        break;
+    }
+    num_msgs += 1;
+    if (unlikely((num_msgs % trace_budget_t::kWindow) == 0) &&
+        (get_cur_time_us() - start) / 1000 > (uint64_t)timeout * 100) {
+      ok = false; // the same 100x slowdown as the trace allows
+    }
+  }
+  if (!ok) {
+    symsan_terminate();
+    return false;
+  }
+
+  // the runtime takes a few ranges, so close gaps until they fit
+  const size_t kMaxRanges = 64;
+  std::vector<std::pair<size_t, size_t>> runs;
+  for (size_t gap = 0; ; gap = gap ? gap * 2 : 8) {
+    runs.clear();
+    for (size_t i = 0; i < buf_size; i++) {
+      if (!used[i]) continue;
+      if (!runs.empty() && i <= runs.back().second + gap) {
+        runs.back().second = i + 1;
+      } else {
+        runs.push_back({i, i + 1});
+      }
+    }
+    if (runs.size() <= kMaxRanges) break;
+  }
+  size_t labeled = 0;
+  for (auto const& [beg, end] : runs) labeled += end - beg;
+  if (labeled * 2 > buf_size) {
+    return false;
+  }
+  ranges.clear();
+  for (auto const& [beg, end] : runs) {
+    if (!ranges.empty()) ranges += ',';
+    ranges += std::to_string(beg) + '-' + std::to_string(end - 1);
+  }
+  return true;
+}
+
+// the solutions the workers sent back for the traces shipped, up to as
+// many as the solver threads would keep ready
+static void poll_remote(my_mutator_t *data) {
+  auto &remote = *data->remote;
+  std::vector<uint8_t> bytes;
+  std::vector<rgd::patch_t> patches;
+  for (auto const& name : remote.spool.list("patches", remote.prefix)) {
+    if (remote.ready.size() >= kMaxReadyMutations) break;
+    uint64_t id = strtoull(name.c_str() + remote.prefix.size(), nullptr, 10);
+    auto itr = remote.seeds.find(id);
+    patches.clear();
+    if (itr == remote.seeds.end()) {
+      // the seed was dropped while the trace waited
+      remote_stale += 1;
+    } else if (remote.spool.read("patches", name, bytes) &&
+               rgd::TraceBlob::decode_patches(bytes.data(), bytes.size(),
+                                              itr->second->size(), patches)) {
+      for (auto &patch : patches) {
+        remote.ready.push_back(mutation_t{nullptr, 0, itr->second, std::move(patch)});
+      }
+      remote_solutions += patches.size();
+    } else {
+      WARNF("Invalid patches %s\n", name.c_str());
+    }
+    if (itr != remote.seeds.end()) remote.seeds.erase(itr);
+    remote.spool.remove("patches", name);
+  }
+}
+
+// ships the trace of the seed to the workers, with the labels its events
+// reach, if it has any branch to flip
+static void ship_trace(my_mutator_t *data, const u8 *buf, size_t buf_size) {
+  auto &remote = *data->remote;
+  if (!remote.trace.num_branches()) return;
+  size_t num_labels = 0;
+  if (!remote.trace.encode(remote.blob, __dfsan_label_info, __dfsan_label_operands,
+                           MAX_LABEL, &num_labels)) {
+    WARNF("Invalid labels in the trace of %s\n", data->cur_queue_entry);
+    return;
+  }
+  uint64_t id = remote.next_id++;
+  if (!remote.spool.publish("traces", remote.prefix + std::to_string(id),
+                            remote.blob)) {
+    WARNF("Failed to ship the trace of %s: %s\n", data->cur_queue_entry,
+          strerror(errno));
+    return;
+  }
+  remote.seeds.emplace(id, std::make_shared<seed_t>(buf, buf + buf_size));
+  // the workers may have gone away, the oldest traces are given up on
+  if (remote.seeds.size() > kMaxRemoteSeeds) {
+    remote.seeds.erase(remote.seeds.begin());
+  }
+  remote_traces += 1;
+  remote_bytes += remote.blob.size();
+  remote_labels += num_labels;
+}
+
+// appends the trace of the seed to the archive, under its name
+static void archive_trace(my_mutator_t *data) {
+  auto &archive = *data->archive;
+  if (!archive.trace.num_branches()) return;
+  if (!archive.trace.encode(archive.blob, __dfsan_label_info,
+                            __dfsan_label_operands, MAX_LABEL)) {
+    WARNF("Invalid labels in the trace of %s\n", data->cur_queue_entry);
+    return;
+  }
+  if (!archive.file.append((const char*)data->cur_queue_entry, archive.blob)) {
+    WARNF("Failed to archive the trace of %s: %s\n", data->cur_queue_entry,
+          strerror(errno));
+    return;
+  }
+  archive_traces += 1;
+}
+
+// the solutions ready to hand out without solving
+static u32 ready_mutations(my_mutator_t *data) {
+  if (data->remote) return (u32)data->remote->ready.size();
+  return data->pipeline ? (u32)data->pipeline->ready.size_approx() : 0;
+}
+
 /// @brief the trace stage for symsan
 /// @param data the custom mutator state
 /// @param buf input buffer
@@ -359,13 +1943,50 @@ extern "C" void afl_custom_deinit(my_mutator_t *data) {
 extern "C" u32 afl_custom_fuzz_count(my_mutator_t *data, const u8 *buf,
                                      size_t buf_size) {
 
+  maybe_write_stats(data);
+  if (data->mem) check_memory(data);
+  if (data->remote) poll_remote(data);
+
+  // AFL++ may hand the next seed in at the same address
+  data->patched_seed = nullptr;
+  data->more_patches.clear();
+  data->seed_solve_us = 0;
+
   // check the input id to see if it's been run before
   // we don't use the afl_custom_queue_new_entry() because we may not
   // want to solve all the tasks
   u32 input_id = data->afl->queue_cur->id;
   u32 timeout = std::min(MIN_TIMEOUT, data->afl->fsrv.exec_tmout);
   if (data->fuzzed_inputs.find(input_id) != data->fuzzed_inputs.end()) {
-    return 0;
+    // still hand out what the solver threads have found meanwhile
+    return ready_mutations(data);
+  }
+  // a seed held back is looked at again the next time AFL++ gets to it
+  rgd::SeedScheduler::seed_info_t seed_info = {input_id, buf_size,
+      data->afl->queue_cur->depth, (bool)data->afl->queue_cur->favored};
+  if (data->seed_sched) {
+    auto decision = data->seed_sched->decide(seed_info);
+    if (decision == rgd::SeedScheduler::SKIP) {
+      data->fuzzed_inputs.insert(input_id);
+      skipped_seeds += 1;
+      return ready_mutations(data);
+    } else if (decision == rgd::SeedScheduler::DEFER) {
+      deferred_seeds += 1;
+      return ready_mutations(data);
+    }
+  }
+  // the synced seeds are traced by whichever instance gets to them first
+  uint64_t seed_fp = 0;
+  if (data->seed_store.is_open()) {
+    seed_fp = rgd::TaskStore::fingerprint(buf, buf_size);
+    if (data->seed_store.lookup(seed_fp) == rgd::TaskStore::TRACED) {
+      data->fuzzed_inputs.insert(input_id);
+      traced_elsewhere += 1;
+      return ready_mutations(data);
+    } else if (!data->seed_store.claim(seed_fp)) {
+      // being traced by another instance, look again if it doesn't finish
+      return ready_mutations(data);
+    }
   }
   data->fuzzed_inputs.insert(input_id);
 
@@ -374,14 +1995,18 @@ extern "C" u32 afl_custom_fuzz_count(my_mutator_t *data, const u8 *buf,
   DEBUGF("Fuzzing %s\n", data->cur_queue_entry);
 
   // FIXME: should we use the afl->queue_cur->fname instead?
-  // write the buf to the file
+  // write the buf to the file; the child reads it through the page cache,
+  // so there's no need to sync it, and only a shorter input needs the file
+  // truncated
   lseek(data->out_fd, 0, SEEK_SET);
   ck_write(data->out_fd, buf, buf_size, data->out_file);
-  fsync(data->out_fd);
-  if (ftruncate(data->out_fd, buf_size)) {
+  if (buf_size < data->out_size && ftruncate(data->out_fd, buf_size)) {
     WARNF("Failed to truncate output file: %s\n", strerror(errno));
+    data->out_size = (size_t)-1; // unknown, truncate next time
+    data->seed_store.release(seed_fp);
     return 0;
   }
+  data->out_size = buf_size;
 
   // setup argv in case of initialized
   if (unlikely(!data->argv)) {
@@ -406,40 +2031,129 @@ extern "C" u32 afl_custom_fuzz_count(my_mutator_t *data, const u8 *buf,
     symsan_set_debug(DEBUG);
     symsan_set_bounds_check(TraceBounds);
     symsan_set_force_stdin(ForceStdin);
+    symsan_set_forkserver(UseForkServer);
+    symsan_set_persistent(UsePersistent);
+    symsan_set_persistent_gc(PersistentGC);
+    symsan_set_event_ring(UseEventRing);
+    symsan_set_lazy_mmap_taint(LazyMmapTaint);
+    symsan_set_summarize_sums(SummarizeSums);
+    symsan_set_memcmp_blob(MemcmpBlob);
+    symsan_set_branch_filter(BranchFilter);
+    symsan_set_snapshots(SnapshotMs != 0);
+    symsan_set_huge_pages(HugePages);
+    // before the prefault, so the pages are faulted in on the right node
+#ifdef HAVE_AFFINITY
+    if (AffinityAuto) AffinityCpu = smt_sibling(data->afl->cpu_aff);
+#endif
+    symsan_set_numa_node(AffinityNode);
+    symsan_set_affinity(AffinityCpu);
+    symsan_set_prefault(PrefaultMB);
+    // the site addresses are symbolized by another run at the end
+    symsan_set_no_aslr(SiteProfile != nullptr);
+    if (TaintRanges) symsan_set_taint_ranges(TaintRanges);
+    if (TaintInputs) symsan_set_taint_inputs(TaintInputs);
+    if (RuntimeAstCap) symsan_set_max_ast_size(MAX_AST_SIZE);
   }
 
-  // launch the symsan child process
-  int ret = symsan_run(data->out_fd);
+  if (BranchFilter) {
+    // the local filter keeps one past the limit per id, and the runtime's
+    // limit is per id, context and direction, so it never drops more
+    symsan_set_site_limit(site_limit() + 1);
+    if (auto afl_cov = dynamic_cast<AflCovManager*>(data->cov_mgr))
+      afl_cov->sync_filter();
+  }
+
+  // a large seed is traced with only the bytes its branches read labeled,
+  // at the same offsets, so the solutions need no mapping back
+  if (TrimSeeds && !TaintRanges) {
+    std::string ranges;
+    bool trim = buf_size >= TrimSeeds &&
+                find_branch_bytes(data, buf, buf_size, timeout, ranges);
+    if (trim && ranges.empty()) {
+      no_branch_seeds += 1;
+      data->seed_store.record(seed_fp, rgd::TaskStore::TRACED);
+      return ready_mutations(data);
+    }
+    symsan_set_taint_ranges(trim ? ranges.c_str() : "");
+    trimmed_seeds += trim;
+  }
+
+  // launch the symsan child process, or resume the latest snapshot if the
+  // seed only differs from its input past the bytes read before it
+  uint64_t trace_start = get_cur_time_us();
+  bool resumed = SnapshotMs && buf_size == data->snapshot_seed.size() &&
+                 !memcmp(buf, data->snapshot_seed.data(), data->snapshot_consumed) &&
+                 symsan_resume(data->out_fd) == 0;
+  int ret = resumed ? 0 : symsan_run(data->out_fd);
   if (ret < 0) {
     WARNF("Failed to start symsan bin: %s\n", strerror(errno));
+    data->seed_store.release(seed_fp);
     return 0;
   } else if (ret > 0) {
     WARNF("symsan_run failed %d\n", ret);
+    data->seed_store.release(seed_fp);
     return 0;
   }
 
   pipe_msg msg;
   gep_msg gmsg;
-  memcmp_msg *mmsg;
+  switch_msg smsg;
+  std::vector<uint64_t> cases;
+  memcmp_msg mmsg;
+  uint8_t *content;
+  memcmp_blob_msg bmsg;
+  const void *blob;
   dfsan_label_info *info;
   size_t msg_size;
   u32 num_tasks = 0;
   u32 num_msgs = 0;
   bool timedout = false;
+  bool cut = false;
+  bool over_mem = false;
+  bool mark_snapshot = false;
+  bool site_marked = resumed || data->snapshot_sites >= kMaxSnapshotSites;
   struct timeval start, end;
   gettimeofday(&start, NULL);
+  if (budget.enabled) budget.start();
 
   // clear all caches
   std::vector<symsan::input_t> inputs;
   inputs.push_back({buf, buf_size});
   data->parser->restart(inputs);
   reset_global_caches(buf_size);
+  if (data->remote) {
+    data->remote->trace.start(buf, buf_size,
+                              NestedSolving ? rgd::TraceBlob::kNested : 0);
+  }
+  if (data->archive) {
+    data->archive->trace.start(buf, buf_size,
+                               NestedSolving ? rgd::TraceBlob::kNested : 0);
+  }
+  if (ByteMapProb) data->trace_bytes.assign(buf_size, 0);
+  if (DiffTrace) {
+    // a resumed trace starts past the branches of the prefix
+    data->trace_sig.clear();
+    data->parent_sig = nullptr;
+    auto parent = data->seed_parents.find(input_id);
+    if (parent != data->seed_parents.end()) {
+      auto sig = data->branch_sigs.find(parent->second);
+      if (!resumed && sig != data->branch_sigs.end()) data->parent_sig = &sig->second;
+      data->seed_parents.erase(parent);
+    }
+  }
+  data->cov_mgr->start_trace();
+  if (!data->pipeline) data->task_mgr->start_trace();
 
   while (symsan_read_event(&msg, sizeof(msg), timeout) == sizeof(msg)) {
     // create solving tasks
     switch (msg.msg_type) {
       // conditional branch
       case cond_type:
+        if (unlikely(mark_snapshot)) {
+          // the first branch past the time, for the next runs to stop at
+          mark_snapshot = false;
+          if (symsan_mark_snapshot(msg.id) == 0) data->snapshot_sites++;
+        }
         handle_cond(msg, data);
         break;
       case gep_type:
@@ -454,6 +2168,24 @@ extern "C" u32 afl_custom_fuzz_count(my_mutator_t *data, const u8 *buf,
         }
         handle_gep(gmsg, msg, data);
         break;
+      case switch_type:
+        if (symsan_read_event(&smsg, sizeof(smsg), 0) != sizeof(smsg)) {
+          WARNF("Failed to receive switch msg: %s\n", strerror(errno));
+          break;
+        }
+        cases.resize(smsg.num_cases);
+        msg_size = smsg.num_cases * sizeof(uint64_t);
+        if (symsan_read_event(cases.data(), msg_size, 0) != msg_size) {
+          WARNF("Failed to receive switch cases: %s\n", strerror(errno));
+          break;
+        }
+        // double check
+        if (msg.label != smsg.label) {
+          WARNF("Incorrect switch msg: %d vs %d\n", msg.label, smsg.label);
+          break;
+        }
+        handle_switch(msg, smsg, cases, data);
+        break;
       case memcmp_type:
         if (msg.label == 0 || msg.label >= MAX_LABEL) {
           WARNF("Invalid memcmp label: %d\n", msg.label);
@@ -466,22 +2198,52 @@ extern "C" u32 afl_custom_fuzz_count(my_mutator_t *data, const u8 *buf,
         // flags = 0 means both operands are symbolic thus no content to read
         // if (!msg.flags)
         //  break;
-        msg_size = sizeof(memcmp_msg) + msg.result;
-        mmsg = (memcmp_msg*)malloc(msg_size);
-        if (symsan_read_event(mmsg, msg_size, 0) != msg_size) {
+        if (msg.flags & F_MEMCMP_BLOB) {
+          // the content stays in the shm until the next run
+          if (symsan_read_event(&bmsg, sizeof(bmsg), 0) != sizeof(bmsg)) {
+            WARNF("Failed to receive memcmp blob msg: %s\n", strerror(errno));
+            break;
+          }
+          blob = symsan_get_blob(bmsg.offset, msg.result);
+          if (msg.label != bmsg.label || !blob) {
+            WARNF("Incorrect memcmp blob msg: %d vs %d\n", msg.label, bmsg.label);
+            break;
+          }
+          data->parser->record_memcmp_ref(msg.label, (const uint8_t*)blob);
+          if (data->remote) {
+            data->remote->trace.add_memcmp(msg.label, (const uint8_t*)blob,
+                                           msg.result);
+          }
+          if (data->archive) {
+            data->archive->trace.add_memcmp(msg.label, (const uint8_t*)blob,
+                                            msg.result);
+          }
+          break;
+        }
+        // read the content straight into the parser's buffer, which is
+        // reused across traces
+        if (symsan_read_event(&mmsg, sizeof(mmsg), 0) != sizeof(mmsg)) {
           WARNF("Failed to receive memcmp msg: %s\n", strerror(errno));
-          free(mmsg);
+          break;
+        }
+        content = data->parser->memcmp_buffer(msg.result);
+        if (symsan_read_event(content, msg.result, 0) != msg.result) {
+          WARNF("Failed to receive memcmp content: %s\n", strerror(errno));
           break;
         }
         // double check
-        if (msg.label != mmsg->label) {
-          WARNF("Incorrect memcmp msg: %d vs %d\n", msg.label, mmsg->label);
-          free(mmsg);
+        if (msg.label != mmsg.label) {
+          WARNF("Incorrect memcmp msg: %d vs %d\n", msg.label, mmsg.label);
           break;
         }
         // save the content
-        data->parser->record_memcmp(msg.label, mmsg->content, msg.result);
-        free(mmsg);
+        data->parser->record_memcmp_ref(msg.label, content);
+        if (data->remote) {
+          data->remote->trace.add_memcmp(msg.label, content, msg.result);
+        }
+        if (data->archive) {
+          data->archive->trace.add_memcmp(msg.label, content, msg.result);
+        }
         break;
       case fsize_type:
         break;
@@ -491,9 +2253,10 @@ extern "C" u32 afl_custom_fuzz_count(my_mutator_t *data, const u8 *buf,
       default:
         break;
     }
-    // naive deadloop detection
+    // naive deadloop detection, and the yield of the trace, every few
+    // thousand events
     num_msgs += 1;
-    if (unlikely((num_msgs & 0xffffe000) != 0)) {
+    if (unlikely((num_msgs % trace_budget_t::kWindow) == 0)) {
       gettimeofday(&end, NULL);
       if ((end.tv_sec - start.tv_sec) * 10 > timeout) {
         // allow 100x slowdown, sec * 1000 > ms * 100
@@ -501,13 +2264,85 @@ extern "C" u32 afl_custom_fuzz_count(my_mutator_t *data, const u8 *buf,
         timedout = true;
         break;
       }
+      if (budget.enabled && !budget.check()) {
+        DEBUGF("Few tasks from the rest of the trace, break\n");
+        cut = true;
+        break;
+      }
+      // the rest of the trace would only add labels
+      if (data->mem && data->mem->limit(rgd::MemLimits::UnionTable) &&
+          data->mem->update(rgd::MemLimits::UnionTable, symsan_shm_bytes())) {
+        DEBUGF("Union table over its limit, break\n");
+        data->mem->trimmed(rgd::MemLimits::UnionTable);
+        over_mem = true;
+        break;
+      }
+      if (SnapshotMs && !site_marked &&
+          get_cur_time_us() - trace_start >= (uint64_t)SnapshotMs * 1000) {
+        mark_snapshot = site_marked = true;
+      }
     }
   }
 
-  if (timedout) {
+  if (timedout || cut || over_mem) {
     // kill the symsan process
     symsan_terminate();
   }
+  if (budget.enabled) budget.finish(timedout || cut);
+  data->seed_store.record(seed_fp, rgd::TaskStore::TRACED);
+  trace_latency.add(get_cur_time_us() - trace_start);
+  traced_seeds += 1;
+  if (resumed) {
+    resumed_seeds += 1;
+  } else if (SnapshotMs) {
+    uint64_t consumed, size;
+    if (symsan_get_snapshot(nullptr, &consumed, &size) == 1) {
+      if (size == buf_size && consumed < buf_size) {
+        data->snapshot_seed.assign(buf, buf + buf_size);
+        data->snapshot_consumed = consumed;
+      } else {
+        symsan_drop_snapshot();
+        data->snapshot_seed.clear();
+      }
+    }
+  }
+  if (data->seed_sched) {
+    data->seed_sched->record(seed_info, get_cur_time_us() - trace_start,
+                             data->new_tasks.size());
+  }
+  if (ByteMapProb) save_byte_map(data, input_id);
+  if (DiffTrace && !resumed) {
+    data->branch_sigs[input_id] = std::move(data->trace_sig);
+    data->trace_sig.clear();
+  }
+  data->parent_sig = nullptr;
+  if (data->archive) archive_trace(data);
+
+  if (data->remote) {
+    // the solutions come back while AFL++ fuzzes other seeds
+    ship_trace(data, buf, buf_size);
+    return ready_mutations(data);
+  }
+
+  if (data->pipeline) {
+    // prepare the solvers while the workers solve, then hand over the
+    // tasks along with the seed they're solved against
+    for (auto &solver : data->solvers) {
+      solver->prepare(data->new_tasks);
+    }
+    auto seed = std::make_shared<seed_t>(buf, buf + buf_size);
+    data->pipeline->add_tasks(data->new_task_ctx, data->new_tasks, seed);
+    data->new_tasks.clear();
+    data->new_task_ctx.clear();
+    // the solutions ready now and the ones that may come while fuzzing
+    return (u32)(data->pipeline->ready.size_approx() + data->pipeline->num_pending());
+  }
+
+  // let the solvers batch their setup for the new tasks
+  for (auto &solver : data->solvers) {
+    solver->prepare(data->new_tasks);
+  }
+  data->new_tasks.clear();
 
   // reinit solving state
   data->cur_task = nullptr;
@@ -523,8 +2358,12 @@ static void print_stats(my_mutator_t *data) {
     "Total branches: %zu,\n"\
     "Total tasks: %zu,\n"\
     "Solved tasks: %zu,\n"\
-    "Solved branches: %zu\n",
-    total_branches, total_tasks, solved_tasks, solved_branches);
+    "Solved branches: %zu,\n"\
+    "Tasks skipped by the store: %zu\n"\
+    "Tasks claimed by other instances: %zu\n"\
+    "Seeds traced by other instances: %zu\n",
+    total_branches, total_tasks, solved_tasks.load(), solved_branches,
+    stored_tasks.load(), claimed_tasks.load(), traced_elsewhere);
   dprintf(data->log_fd, "Task size distribution:\n");
   for (auto const& kv : task_size_dist) {
     dprintf(data->log_fd, "\t %zu: %zu\n", kv.first, kv.second);
@@ -534,6 +2373,325 @@ static void print_stats(my_mutator_t *data) {
   }
 }
 
+// whether the task store knows the outcome of the task already
+static bool stored_outcome(my_mutator_t *data, rgd::task_t const& task,
+                           uint64_t &task_fp) {
+  if (!data->task_store.is_open()) {
+    return false;
+  }
+  task_fp = rgd::TaskStore::fingerprint(*task);
+  auto outcome = data->task_store.lookup(task_fp);
+  if (outcome == rgd::TaskStore::UNSAT || outcome == rgd::TaskStore::SOLVED) {
+    // unsolvable, or the solution is already in some corpus, either way the
+    // tasks based on it don't need solving either
+    task->skip_next = true;
+    stored_tasks += 1;
+    return true;
+  }
+  if (data->claim_tasks && !data->task_store.claim(task_fp)) {
+    // another instance is solving it
+    claimed_tasks += 1;
+    return true;
+  }
+  return false;
+}
+
+// whether the task has all the constraints of a known unsat core
+static bool has_unsat_core(my_mutator_t *data, rgd::task_t const& task,
+                           uint64_t task_fp) {
+  if (!data->unsat_cores || !data->unsat_cores->size()) {
+    return false;
+  }
+  rgd::UnsatCoreCache::fp_set_t fps;
+  fps.reserve(task->constraints.size());
+  for (size_t i = 0; i < task->constraints.size(); i++) {
+    fps.push_back(rgd::TaskStore::fingerprint(*task->constraints[i],
+                                              task->comparisons[i]));
+  }
+  std::sort(fps.begin(), fps.end());
+  if (!data->unsat_cores->covers(fps)) {
+    return false;
+  }
+  task->skip_next = true;
+  data->task_store.record(task_fp, rgd::TaskStore::UNSAT);
+  core_rejected_tasks += 1;
+  return true;
+}
+
+// lets other instances have a go at a task this one couldn't solve
+static void release_task(my_mutator_t *data, uint64_t task_fp) {
+  if (data->claim_tasks) {
+    data->task_store.release(task_fp);
+  }
+}
+
+// the next task whose outcome the task store doesn't know yet
+static rgd::task_t next_task(my_mutator_t *data, uint64_t &task_fp) {
+  while (true) {
+    auto task = data->task_mgr->get_next_task();
+    if (!task || (!stored_outcome(data, task, task_fp) &&
+                  !has_unsat_core(data, task, task_fp))) {
+      return task;
+    }
+  }
+}
+
+void solve_pipeline_t::start(size_t num_threads) {
+  for (size_t i = 0; i < num_threads; i++) {
+    workers.emplace_back(&solve_pipeline_t::work, this);
+  }
+}
+
+void solve_pipeline_t::add_tasks(std::vector<branch_ctx_t> const& ctxs,
+                                 std::vector<rgd::task_t> const& tasks,
+                                 std::shared_ptr<const seed_t> const& seed) {
+  {
+    std::lock_guard<std::mutex> lock(task_lock);
+    data->task_mgr->start_trace();
+    for (size_t i = 0; i < tasks.size(); i++) {
+      if (data->task_mgr->add_task(ctxs[i], tasks[i])) {
+        task_seeds[tasks[i].get()] = seed;
+      }
+    }
+  }
+  has_tasks.notify_all();
+}
+
+size_t solve_pipeline_t::num_pending() {
+  std::lock_guard<std::mutex> lock(task_lock);
+  return data->task_mgr->get_num_tasks();
+}
+
+void solve_pipeline_t::shutdown() {
+  {
+    std::lock_guard<std::mutex> lock(task_lock);
+    stop = true;
+  }
+  has_tasks.notify_all();
+  for (auto &w : workers) {
+    w.join();
+  }
+  workers.clear();
+}
+
+void solve_pipeline_t::work() {
+  // the other solvers are shared, but the SMT ones need one for each thread
+  std::vector<solver_t> solvers;
+  for (auto &solver : data->solvers) {
+    if (auto z3 = dynamic_cast<rgd::Z3Solver*>(solver.get())) {
+      solvers.emplace_back(std::make_shared<rgd::Z3Solver>(z3->tactics()));
+      solvers.back()->set_unsat_cores(data->unsat_cores);
+#if SYMSAN_HAS_BOOLECTOR
+    } else if (dynamic_cast<rgd::BtorSolver*>(solver.get())) {
+      solvers.emplace_back(std::make_shared<rgd::BtorSolver>());
+#endif
+    } else {
+      solvers.push_back(solver);
+    }
+  }
+  uint64_t z3_trims = data->mem ? data->mem->trims(rgd::MemLimits::Z3) : 0;
+  while (true) {
+    // the caches of the SMT solvers of this thread, once over the limit
+    if (data->mem && data->mem->trims(rgd::MemLimits::Z3) != z3_trims) {
+      z3_trims = data->mem->trims(rgd::MemLimits::Z3);
+      for (auto &solver : solvers) solver->drop_caches();
+    }
+    // don't run too far ahead of AFL++
+    while (!stop && ready.size_approx() >= kMaxReadyMutations) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    rgd::task_t task;
+    uint64_t task_fp = 0;
+    std::shared_ptr<const seed_t> seed;
+    {
+      std::unique_lock<std::mutex> lock(task_lock);
+      has_tasks.wait(lock, [this] {
+        return stop || data->task_mgr->get_num_tasks() > 0;
+      });
+      if (stop) return;
+      task = data->task_mgr->get_next_task();
+      auto itr = task_seeds.find(task.get());
+      seed = std::move(itr->second);
+      task_seeds.erase(itr);
+      if (stored_outcome(data, task, task_fp) ||
+          has_unsat_core(data, task, task_fp)) {
+        continue;
+      }
+    }
+
+    // the solvers in order, a later one only runs if an earlier one times out,
+    // as there's no waiting for AFL++ to tell if a solution is good
+    std::vector<size_t> order(solvers.size());
+    if (data->scheduler) {
+      order = data->scheduler->order(task);
+    } else {
+      std::iota(order.begin(), order.end(), 0);
+    }
+    bool settled = false;
+    rgd::patch_t patch;
+    if (TaskCapture) TaskCapture->append(*task, seed->data(), seed->size());
+    for (size_t i : order) {
+      patch.clear();
+      uint64_t start = get_cur_time_us();
+      auto ret = solvers[i]->solve(task, seed->data(), seed->size(), patch);
+      uint64_t us = get_cur_time_us() - start;
+      record_solve(i, task, ret, us);
+      if (data->scheduler) {
+        data->scheduler->record(task, i, ret, us);
+      }
+      if (likely(ret == rgd::SOLVER_SAT)) {
+        DEBUGF("task solved\n");
+        solved_tasks += 1;
+        std::vector<rgd::patch_t> more;
+        if (MaxSolutions > 1 && !task->skip_next) {
+          more_solutions += solvers[i]->solve_more(task, seed->data(), seed->size(),
+                                                   MaxSolutions - 1, more);
+        }
+        ready.enqueue(mutation_t{task, task_fp, seed, std::move(patch)});
+        for (auto &p : more) {
+          ready.enqueue(mutation_t{task, task_fp, seed, std::move(p)});
+        }
+        settled = true;
+        break;
+      } else if (ret == rgd::SOLVER_UNSAT) {
+        DEBUGF("task not solvable\n");
+        task->skip_next = true;
+        data->task_store.record(task_fp, rgd::TaskStore::UNSAT);
+        settled = true;
+        break;
+      } else if (ret != rgd::SOLVER_TIMEOUT) {
+        WARNF("Unknown solver return value %d\n", ret);
+        break;
+      }
+    }
+    if (!settled) release_task(data, task_fp);
+  }
+}
+
+// the solvers for the new cur_task
+static void set_solver_order(my_mutator_t *data) {
+  data->cur_solver_index = 0;
+  if (data->scheduler) {
+    data->cur_order = data->scheduler->order(data->cur_task);
+  } else if (data->cur_order.size() != data->solvers.size()) {
+    data->cur_order.resize(data->solvers.size());
+    std::iota(data->cur_order.begin(), data->cur_order.end(), 0);
+  }
+}
+
+// puts the seed (size bytes at buf) with patch applied into output_buf
+static size_t write_patched(my_mutator_t *data, const void *seed,
+                            const uint8_t *buf, size_t size,
+                            rgd::patch_t const& patch) {
+  rgd::patch_t::revert(data->output_buf, data->patch_undo);
+  if (data->patched_seed != seed || data->patched_size != size) {
+    memcpy(data->output_buf, buf, size);
+    data->patched_seed = seed;
+    data->patched_size = size;
+  }
+  if (patch.apply(data->output_buf, data->patch_undo)) {
+    return size;
+  }
+  // a splice moves the tail, the copy has to be redone next time
+  data->patched_seed = nullptr;
+  return patch.write(buf, size, data->output_buf);
+}
+
+// AFL++'s hit count buckets
+static inline u8 count_class(u8 hits) {
+  if (hits <= 2) return hits;
+  if (hits == 3) return 4;
+  if (hits < 8) return 8;
+  if (hits < 16) return 16;
+  if (hits < 32) return 32;
+  if (hits < 128) return 64;
+  return 128;
+}
+
+// runs a solution on AFL++'s forkserver and tells if AFL++ would keep it,
+// i.e., if it crashes or reaches an edge or hit count bucket not seen yet;
+// the virgin bits are left alone, AFL++ runs the winners again to save them
+static bool keeps_solution(my_mutator_t *data, u8 *buf, size_t size) {
+  afl_state_t *afl = const_cast<afl_state_t*>(data->afl);
+  write_to_testcase(afl, (void**)&buf, size, 0);
+  fsrv_run_result_t fault = fuzz_run_target(afl, &afl->fsrv,
+                                            afl->fsrv.exec_tmout);
+  validated_execs += 1;
+  if (fault == FSRV_RUN_CRASH) return true;
+  if (fault != FSRV_RUN_OK) return false;
+  const u8 *trace = afl->fsrv.trace_bits;
+  const u8 *virgin = afl->virgin_bits;
+  for (u32 i = 0; i < afl->fsrv.map_size; i++) {
+    if (unlikely(trace[i]) && (count_class(trace[i]) & virgin[i])) {
+      return true;
+    }
+  }
+  rejected_solutions += 1;
+  return false;
+}
+
+// with solver threads, hand out the next ready solution, if any
+static size_t fuzz_pipelined(my_mutator_t *data, uint8_t *buf, u8 **out_buf) {
+  *out_buf = buf;
+  // the last solution didn't make it into the queue
+  if (data->cur_mutation_state == MUTATION_IN_VALIDATION) {
+    release_task(data, data->cur_mutation.task_fp);
+  }
+  // with ValidateBatch, skip up to that many solutions AFL++ wouldn't keep
+  for (size_t tries = 0; ; tries++) {
+    if (!data->pipeline->ready.try_dequeue(data->cur_mutation)) {
+      DEBUGF("No solution ready\n");
+      data->cur_mutation_state = MUTATION_INVALID;
+#if PRINT_STATS
+      print_stats(data);
+#endif
+      return 0;
+    }
+    auto const &seed = data->cur_mutation.seed;
+    data->patched_pin = seed;
+    size_t size = write_patched(data, seed.get(), seed->data(), seed->size(),
+                                data->cur_mutation.patch);
+    if (!ValidateBatch || keeps_solution(data, data->output_buf, size)) {
+      data->cur_mutation_state = MUTATION_IN_VALIDATION;
+      *out_buf = data->output_buf;
+      return size;
+    }
+    release_task(data, data->cur_mutation.task_fp);
+    if (tries + 1 >= ValidateBatch) {
+      data->cur_mutation_state = MUTATION_INVALID;
+      return 0;
+    }
+  }
+}
+
+// with remote workers, hand out the next solution they sent back, if any
+static size_t fuzz_remote(my_mutator_t *data, uint8_t *buf, u8 **out_buf) {
+  *out_buf = buf;
+  auto &ready = data->remote->ready;
+  for (size_t tries = 0; ; tries++) {
+    if (ready.empty()) {
+      data->cur_mutation_state = MUTATION_INVALID;
+      return 0;
+    }
+    data->cur_mutation = std::move(ready.front());
+    ready.pop_front();
+    auto const &seed = data->cur_mutation.seed;
+    data->patched_pin = seed;
+    size_t size = write_patched(data, seed.get(), seed->data(), seed->size(),
+                                data->cur_mutation.patch);
+    if (!ValidateBatch || keeps_solution(data, data->output_buf, size)) {
+      data->cur_mutation_state = MUTATION_IN_VALIDATION;
+      *out_buf = data->output_buf;
+      return size;
+    }
+    if (tries + 1 >= ValidateBatch) {
+      data->cur_mutation_state = MUTATION_INVALID;
+      return 0;
+    }
+  }
+}
+
 extern "C"
 size_t afl_custom_fuzz(my_mutator_t *data, uint8_t *buf, size_t buf_size,
                        u8 **out_buf, uint8_t *add_buf, size_t add_buf_size,
@@ -541,36 +2699,35 @@ size_t afl_custom_fuzz(my_mutator_t *data, uint8_t *buf, size_t buf_size,
   (void)(add_buf);
   (void)(add_buf_size);
   (void)(max_size);
+  maybe_write_stats(data);
   if (buf_size > MAX_FILE) {
     *out_buf = buf;
     return 0;
   }
 
-  // try to get a task if we don't already have one
-  // or if we've find a valid solution from the previous mutation
-  if (!data->cur_task || data->cur_mutation_state == MUTATION_VALIDATED) {
-    data->cur_task = data->task_mgr->get_next_task();
-    if (!data->cur_task) {
-      DEBUGF("No more tasks to solve\n");
-      data->cur_mutation_state = MUTATION_INVALID;
-      *out_buf = buf;
-#if PRINT_STATS
-      print_stats(data);
-#endif
-      return 0;
-    }
-    // reset the solver and state
-    data->cur_solver_index = 0;
-    data->cur_mutation_state = MUTATION_INVALID;
+  if (data->pipeline) {
+    return fuzz_pipelined(data, buf, out_buf);
+  }
+  if (data->remote) {
+    return fuzz_remote(data, buf, out_buf);
   }
 
-  // check the previous mutation state
-  if (data->cur_mutation_state == MUTATION_IN_VALIDATION) {
-    // oops, not solve, move on to next solver
-    data->cur_solver_index++;
-    if (data->cur_solver_index >= data->solvers.size()) {
-      // if reached the max solver, move on to the next task
-      data->cur_task = data->task_mgr->get_next_task();
+  // the other solutions of the last task solved, whichever way the first
+  // one went
+  if (!data->more_patches.empty()) {
+    size_t size = write_patched(data, buf, buf, buf_size, data->more_patches.back());
+    data->more_patches.pop_back();
+    *out_buf = data->output_buf;
+    return size;
+  }
+
+  // with ValidateBatch, a solution AFL++ wouldn't keep moves on to the next
+  // solver or task right away, for up to that many solves per call
+  for (size_t tries = 0; ; tries++) {
+    // try to get a task if we don't already have one
+    // or if we've find a valid solution from the previous mutation
+    if (!data->cur_task || data->cur_mutation_state == MUTATION_VALIDATED) {
+      data->cur_task = next_task(data, data->cur_task_fp);
       if (!data->cur_task) {
         DEBUGF("No more tasks to solve\n");
         data->cur_mutation_state = MUTATION_INVALID;
@@ -580,36 +2737,87 @@ size_t afl_custom_fuzz(my_mutator_t *data, uint8_t *buf, size_t buf_size,
 #endif
         return 0;
       }
-      data->cur_solver_index = 0; // reset solver index
+      // reset the solver and state
+      set_solver_order(data);
+      data->cur_mutation_state = MUTATION_INVALID;
     }
-  }
 
-  // default return values
-  size_t new_buf_size = 0;
-  *out_buf = buf;
-  auto &solver = data->solvers[data->cur_solver_index];
-  auto ret = solver->solve(data->cur_task, buf, buf_size,
-      data->output_buf, new_buf_size);
-  if (likely(ret == rgd::SOLVER_SAT)) {
-    DEBUGF("task solved\n");
-    data->cur_mutation_state = MUTATION_IN_VALIDATION;
-    *out_buf = data->output_buf;
-    solved_tasks += 1;
-  } else if (ret == rgd::SOLVER_TIMEOUT) {
-    // if not solved, move on to next stage
-    data->cur_mutation_state = MUTATION_IN_VALIDATION;
-  } else if (ret == rgd::SOLVER_UNSAT) {
-    // at any stage if the task is deemed unsolvable, just skip it
-    DEBUGF("task not solvable\n");
-    data->cur_task->skip_next = true;
-    data->cur_task = nullptr;
-  } else {
-    WARNF("Unknown solver return value %d\n", ret);
-    *out_buf = NULL;
-    new_buf_size = 0;
-  }
+    // check the previous mutation state
+    if (data->cur_mutation_state == MUTATION_IN_VALIDATION) {
+      // oops, not solve, move on to next solver
+      data->cur_solver_index++;
+      if (data->cur_solver_index >= data->cur_order.size()) {
+        // if reached the max solver, move on to the next task
+        release_task(data, data->cur_task_fp);
+        data->cur_task = next_task(data, data->cur_task_fp);
+        if (!data->cur_task) {
+          DEBUGF("No more tasks to solve\n");
+          data->cur_mutation_state = MUTATION_INVALID;
+          *out_buf = buf;
+#if PRINT_STATS
+          print_stats(data);
+#endif
+          return 0;
+        }
+        set_solver_order(data); // reset solver index
+      }
+    }
 
-  return new_buf_size;
+    // default return values
+    *out_buf = buf;
+    if (SeedSolveBudgetUs && data->seed_solve_us >= SeedSolveBudgetUs) {
+      // the task and the solver stay current, they're picked up with the
+      // next seed
+      data->cur_mutation_state = MUTATION_INVALID;
+      seed_budget_stops += 1;
+      return 0;
+    }
+    size_t solver_index = data->cur_order[data->cur_solver_index];
+    auto &solver = data->solvers[solver_index];
+    if (TaskCapture && data->cur_solver_index == 0) {
+      TaskCapture->append(*data->cur_task, buf, buf_size);
+    }
+    uint64_t start = get_cur_time_us();
+    data->patch.clear();
+    auto ret = solver->solve(data->cur_task, buf, buf_size, data->patch);
+    uint64_t us = get_cur_time_us() - start;
+    data->seed_solve_us += us;
+    record_solve(solver_index, data->cur_task, ret, us);
+    if (data->scheduler) {
+      data->scheduler->record(data->cur_task, solver_index, ret, us);
+    }
+    if (likely(ret == rgd::SOLVER_SAT)) {
+      DEBUGF("task solved\n");
+      data->cur_mutation_state = MUTATION_IN_VALIDATION;
+      size_t new_buf_size = write_patched(data, buf, buf, buf_size, data->patch);
+      solved_tasks += 1;
+      if (MaxSolutions > 1 && !data->cur_task->skip_next) {
+        more_solutions += solver->solve_more(data->cur_task, buf, buf_size,
+                                             MaxSolutions - 1, data->more_patches);
+      }
+      if (!ValidateBatch ||
+          keeps_solution(data, data->output_buf, new_buf_size)) {
+        *out_buf = data->output_buf;
+        return new_buf_size;
+      }
+    } else if (ret == rgd::SOLVER_TIMEOUT) {
+      // if not solved, move on to next stage
+      data->cur_mutation_state = MUTATION_IN_VALIDATION;
+    } else if (ret == rgd::SOLVER_UNSAT) {
+      // at any stage if the task is deemed unsolvable, just skip it
+      DEBUGF("task not solvable\n");
+      data->cur_task->skip_next = true;
+      data->task_store.record(data->cur_task_fp, rgd::TaskStore::UNSAT);
+      data->cur_task = nullptr;
+    } else {
+      WARNF("Unknown solver return value %d\n", ret);
+      *out_buf = NULL;
+      return 0;
+    }
+    if (tries + 1 >= ValidateBatch) {
+      return 0;
+    }
+  }
 }
 
 
@@ -621,13 +2829,80 @@ uint8_t afl_custom_queue_new_entry(my_mutator_t * data,
   // if we're in validation state and the current queue entry is the same as
   // mark the constraints as solved
   DEBUGF("new queue entry: %s\n", filename_new_queue);
+  // the new entry is the last one in the queue
+  if (DiffTrace && filename_orig_queue && data->afl->queue_cur &&
+      data->afl->queue_cur->fname == filename_orig_queue) {
+    data->seed_parents[data->afl->queued_items - 1] = data->afl->queue_cur->id;
+  }
+  if (data->remote) {
+    // the workers don't hear back, the solution is only counted
+    if (data->afl->queue_cur->fname == filename_orig_queue &&
+        data->cur_mutation_state == MUTATION_IN_VALIDATION) {
+      data->cur_mutation_state = MUTATION_VALIDATED;
+      solved_branches += 1;
+    }
+    return 0;
+  }
+  if (data->pipeline) {
+    // the solution may come from an earlier seed, but it was run as a
+    // mutation of the current one
+    if (data->afl->queue_cur->fname == filename_orig_queue &&
+        data->cur_mutation_state == MUTATION_IN_VALIDATION) {
+      data->cur_mutation_state = MUTATION_VALIDATED;
+      data->cur_mutation.task->skip_next = true;
+      data->task_store.record(data->cur_mutation.task_fp, rgd::TaskStore::SOLVED);
+      solved_branches += 1;
+    }
+    return 0;
+  }
   if (data->cur_queue_entry == filename_orig_queue &&
       data->cur_mutation_state == MUTATION_IN_VALIDATION) {
     data->cur_mutation_state = MUTATION_VALIDATED;
     if (data->cur_task) {
       data->cur_task->skip_next = true;
+      data->task_store.record(data->cur_task_fp, rgd::TaskStore::SOLVED);
       solved_branches += 1;
     }
   }
   return 0;
 }
+
+/// @brief how often AFL++'s havoc stacks afl_custom_havoc_mutation, in %
+extern "C" uint8_t afl_custom_havoc_mutation_probability(my_mutator_t *data) {
+  (void)(data);
+  return ByteMapProb;
+}
+
+/// @brief a havoc mutation of one of the bytes the branches of the seed
+/// read, as found when it was traced
+extern "C"
+size_t afl_custom_havoc_mutation(my_mutator_t *data, u8 *buf, size_t buf_size,
+                                 u8 **out_buf, size_t max_size) {
+  (void)(max_size);
+  *out_buf = buf;
+  auto itr = data->byte_maps.find(data->afl->queue_cur->id);
+  if (itr == data->byte_maps.end()) {
+    return buf_size;
+  }
+  // xorshift64
+  uint64_t r = data->rng;
+  r ^= r << 13;
+  r ^= r >> 7;
+  r ^= r << 17;
+  data->rng = r;
+  auto const& offsets = itr->second;
+  u32 offset = offsets[(r >> 8) % offsets.size()];
+  if (offset >= buf_size) {
+    // earlier havoc mutations may have cut it short
+    return buf_size;
+  }
+  static const u8 interesting[] = {0x00, 0x01, 0x7f, 0x80, 0xff};
+  switch (r & 3) {
+    case 0: buf[offset] ^= 1 << ((r >> 2) & 7); break;
+    case 1: buf[offset] = (u8)(r >> 40); break;
+    case 2: buf[offset] += (u8)((r >> 2) % 35) - 17; break;
+    default: buf[offset] = interesting[(r >> 2) % sizeof(interesting)]; break;
+  }
+  byte_map_mutations += 1;
+  return buf_size;
+}
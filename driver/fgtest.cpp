@@ -10,12 +10,20 @@ extern "C" {
 
 #include "parse-z3.h"
 
+#include "wheels/concurrentqueue/queue.h"
+
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,62 +44,110 @@ using namespace __dfsan;
     printf(__VA_ARGS__);                                \
   } while(false)
 
-// for input
-static char *input_buf;
-static size_t input_size;
-
 // for output
 static const char* __output_dir = ".";
 static uint32_t __instance_id = 0;
-static uint32_t __session_id = 0;
-static uint32_t __current_index = 0;
-static z3::context __z3_context;
+// in-bounds values to generate for a symbolic index
+static const size_t kGepIndexSolutions = 8;
+// z3 worker threads of each tracer, branch tasks are solved inline with 0
+static unsigned __solver_workers = 0;
+
+// with dedup_outputs=1 in TAINT_OPTIONS, and always in batch mode, outputs
+// identical to an earlier one (of any seed) are skipped
+static bool __dedup_outputs = false;
+static std::mutex __outputs_lock;
+static std::unordered_set<uint64_t> __outputs;
+
+// the state of tracing one seed at a time: a launcher session, and a z3
+// parser over its union table; batch mode has one per worker thread
+struct tracer_t {
+  symsan_session_t *session = nullptr;
+  z3::context context;
+  std::unique_ptr<symsan::Z3ParserSolver> parser;
+
+  // the current seed
+  const char *input_buf = nullptr;
+  size_t input_size = 0;
+  uint32_t session_id = 0;
+  uint32_t current_index = 0;
+};
+
+static uint64_t hash_output(const std::vector<uint8_t> &buf) {
+  // FNV-1a
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (uint8_t b : buf) {
+    h = (h ^ b) * 0x100000001b3ULL;
+  }
+  return h;
+}
 
-// z3parser
-symsan::Z3ParserSolver *__z3_parser = nullptr;
+static void generate_input(tracer_t &t, symsan::Z3ParserSolver::solution_t &solutions) {
+  std::vector<uint8_t> buf(t.input_buf, t.input_buf + t.input_size);
+  for (auto const& sol : solutions) {
+    if (sol.offset >= buf.size()) buf.resize(sol.offset + 1);
+    buf[sol.offset] = sol.val;
+  }
+  if (__dedup_outputs) {
+    std::lock_guard<std::mutex> lock(__outputs_lock);
+    if (!__outputs.insert(hash_output(buf)).second) {
+      AOUT("duplicate output, skipped\n");
+      return;
+    }
+  }
 
-static void generate_input(symsan::Z3ParserSolver::solution_t &solutions) {
   char path[PATH_MAX];
   snprintf(path, PATH_MAX, "%s/id-%d-%d-%d", __output_dir,
-           __instance_id, __session_id, __current_index++);
+           __instance_id, t.session_id, t.current_index++);
   int fd = open(path, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
   if (fd == -1) {
     AOUT("failed to open new input file for write");
     return;
   }
-
-  if (write(fd, input_buf, input_size) == -1) {
-    AOUT("failed to copy original input\n");
-    close(fd);
-    return;
-  }
-  AOUT("generate #%d output\n", __current_index - 1);
+  AOUT("generate #%d output\n", t.current_index - 1);
 
   for (auto const& sol : solutions) {
-    uint8_t value = sol.val;
-    AOUT("offset %d = %x\n", sol.offset, value);
-    lseek(fd, sol.offset, SEEK_SET);
-    write(fd, &value, sizeof(value));
+    AOUT("offset %d = %x\n", sol.offset, sol.val);
+  }
+  if (write(fd, buf.data(), buf.size()) == -1) {
+    AOUT("failed to write new input\n");
   }
 
   close(fd);
 }
 
-static void __solve_cond(dfsan_label label, uint8_t r, bool add_nested, void *addr) {
+// writes the outputs of the tasks the z3 workers are done with, or with
+// wait, of all the pending ones
+static void collect_results(tracer_t &t, bool wait) {
+  uint64_t id;
+  symsan::Z3ParserSolver::solving_status status;
+  symsan::Z3ParserSolver::solution_t solutions;
+  while (t.parser->poll_result(id, status, solutions, wait)) {
+    if (solutions.size() != 0) {
+      AOUT("task %lu solved\n", id);
+      generate_input(t, solutions);
+    } else {
+      AOUT("task %lu not solvable\n", id);
+    }
+    solutions.clear();
+  }
+}
+
+static void __solve_cond(tracer_t &t, dfsan_label label, uint8_t r, bool add_nested, void *addr) {
 
   std::vector<uint64_t> tasks;
-  if (__z3_parser->parse_cond(label, r, add_nested, tasks)) {
+  if (t.parser->parse_cond(label, r, add_nested, tasks)) {
     AOUT("WARNING: failed to parse condition %d @%p\n", label, addr);
     return;
   }
 
   for (auto id : tasks) {
+    if (t.parser->submit_task(id, 5000U)) continue;
     // solve
     symsan::Z3ParserSolver::solution_t solutions;
-    auto status = __z3_parser->solve_task(id, 5000U, solutions);
+    t.parser->solve_task(id, 5000U, solutions);
     if (solutions.size() != 0) {
       AOUT("branch solved\n");
-      generate_input(solutions);
+      generate_input(t, solutions);
     } else {
       AOUT("branch not solvable @%p\n", addr);
     }
@@ -100,7 +156,39 @@ static void __solve_cond(dfsan_label label, uint8_t r, bool add_nested, void *ad
 
 }
 
-static void __handle_gep(dfsan_label ptr_label, uptr ptr,
+static void __solve_switch(tracer_t &t, dfsan_label label, uint64_t result,
+                           const std::vector<uint64_t> &cases,
+                           dfsan_label taken_label, void *addr) {
+
+  // every case but the taken one, and the default unless it's taken
+  std::vector<uint32_t> targets;
+  for (uint32_t i = 0; i < cases.size(); i++) {
+    if (cases[i] != result)
+      targets.push_back(i);
+  }
+  if (taken_label)
+    targets.push_back(cases.size());
+
+  std::vector<std::pair<uint32_t, uint64_t>> tasks;
+  if (t.parser->parse_switch(label, result, cases, targets, taken_label, tasks)) {
+    AOUT("WARNING: failed to parse switch %d @%p\n", label, addr);
+    return;
+  }
+
+  for (auto const& task : tasks) {
+    if (t.parser->submit_task(task.second, 5000U)) continue;
+    symsan::Z3ParserSolver::solution_t solutions;
+    t.parser->solve_task(task.second, 5000U, solutions);
+    if (solutions.size() != 0) {
+      AOUT("switch case %u solved\n", task.first);
+      generate_input(t, solutions);
+    } else {
+      AOUT("switch case %u not solvable @%p\n", task.first, addr);
+    }
+  }
+}
+
+static void __handle_gep(tracer_t &t, dfsan_label ptr_label, uptr ptr,
                          dfsan_label index_label, int64_t index,
                          uint64_t num_elems, uint64_t elem_size,
                          int64_t current_offset, void* addr) {
@@ -109,34 +197,319 @@ static void __handle_gep(dfsan_label ptr_label, uptr ptr,
       index, index_label, num_elems, elem_size, current_offset);
 
   std::vector<uint64_t> tasks;
-  if (__z3_parser->parse_gep(ptr_label, ptr, index_label, index, num_elems,
-                             elem_size, current_offset, true, tasks)) {
+  if (t.parser->parse_gep(ptr_label, ptr, index_label, index, num_elems,
+                          elem_size, current_offset, true, tasks)) {
     AOUT("WARNING: failed to parse gep %d @%p\n", index_label, addr);
     return;
   }
 
   for (auto id : tasks) {
-    symsan::Z3ParserSolver::solution_t solutions;
-    auto status = __z3_parser->solve_task(id, 5000U, solutions);
+    std::vector<symsan::Z3ParserSolver::solution_t> solutions;
+    t.parser->solve_index_task(id, 5000U, kGepIndexSolutions, solutions);
     if (solutions.size() != 0) {
-      AOUT("gep solved\n");
-      generate_input(solutions);
+      AOUT("gep solved, %zu values\n", solutions.size());
+      for (auto & solution : solutions)
+        generate_input(t, solution);
     } else {
       AOUT("gep not solvable @%p\n", addr);
     }
-    solutions.clear();
   }
 }
 
+// sets up a session tracing program on input, which is also its only
+// argument
+static bool setup_tracer(tracer_t &t, char *program, char *input, bool is_stdin) {
+  t.session = symsan_session_new(program, uniontable_size);
+  if (!t.session) {
+    fprintf(stderr, "Failed to map shm: %s\n", strerror(errno));
+    return false;
+  }
+
+  if (symsan_session_set_input(t.session, is_stdin ? "stdin" : input) != 0) {
+    fprintf(stderr, "Failed to set input\n");
+    return false;
+  }
+
+  char* args[3];
+  args[0] = program;
+  args[1] = input;
+  args[2] = NULL;
+  if (symsan_session_set_args(t.session, 2, args) != 0) {
+    fprintf(stderr, "Failed to set args\n");
+    return false;
+  }
+
+  symsan_session_set_debug(t.session, 1);
+  symsan_session_set_bounds_check(t.session, 1);
+  symsan_session_set_memcmp_blob(t.session, 1);
+
+  t.parser.reset(new symsan::Z3ParserSolver(
+      symsan_session_union_table(t.session), uniontable_size, t.context));
+  t.parser->set_workers(__solver_workers);
+  return true;
+}
+
+// an event read off the pipe with its payload, handed from the reader
+// thread to the one parsing and solving
+struct event_t {
+  pipe_msg msg;
+  gep_msg gmsg;
+  switch_msg smsg;
+  std::vector<uint64_t> cases;
+  std::vector<uint8_t> content;
+  const void *blob = nullptr;
+};
+
+// drains the events of the running target into q, so the target isn't
+// blocked on a full pipe while a task is being solved; a null event marks
+// the end of the trace
+static void read_events(symsan_session_t *s,
+                        moodycamel::ConcurrentQueue<std::unique_ptr<event_t>> &q) {
+  std::unique_ptr<event_t> e(new event_t);
+  memcmp_msg mmsg;
+  memcmp_blob_msg bmsg;
+  size_t msg_size;
+
+  while (symsan_session_read_event(s, &e->msg, sizeof(e->msg), 0) > 0) {
+    pipe_msg &msg = e->msg;
+    switch (msg.msg_type) {
+      case cond_type:
+        break;
+      case gep_type:
+        if (symsan_session_read_event(s, &e->gmsg, sizeof(e->gmsg), 0) != sizeof(e->gmsg)) {
+          fprintf(stderr, "Failed to receive gep msg: %s\n", strerror(errno));
+          continue;
+        }
+        // double check
+        if (msg.label != e->gmsg.index_label) {
+          fprintf(stderr, "Incorrect gep msg: %d vs %d\n", msg.label, e->gmsg.index_label);
+          continue;
+        }
+        break;
+      case switch_type:
+        if (symsan_session_read_event(s, &e->smsg, sizeof(e->smsg), 0) != sizeof(e->smsg)) {
+          fprintf(stderr, "Failed to receive switch msg: %s\n", strerror(errno));
+          continue;
+        }
+        e->cases.resize(e->smsg.num_cases);
+        msg_size = e->smsg.num_cases * sizeof(uint64_t);
+        if (symsan_session_read_event(s, e->cases.data(), msg_size, 0) != msg_size) {
+          fprintf(stderr, "Failed to receive switch cases: %s\n", strerror(errno));
+          continue;
+        }
+        // double check
+        if (msg.label != e->smsg.label) {
+          fprintf(stderr, "Incorrect switch msg: %d vs %d\n", msg.label, e->smsg.label);
+          continue;
+        }
+        break;
+      case memcmp_type:
+        // flags = 0 means both operands are symbolic thus no content to read
+        if (!msg.flags)
+          continue;
+        if (msg.flags & F_MEMCMP_BLOB) {
+          if (symsan_session_read_event(s, &bmsg, sizeof(bmsg), 0) != sizeof(bmsg)) {
+            fprintf(stderr, "Failed to receive memcmp blob msg: %s\n", strerror(errno));
+            continue;
+          }
+          e->blob = symsan_session_get_blob(s, bmsg.offset, msg.result);
+          if (msg.label != bmsg.label || !e->blob) {
+            fprintf(stderr, "Incorrect memcmp blob msg: %d vs %d\n", msg.label, bmsg.label);
+            continue;
+          }
+          break;
+        }
+        if (symsan_session_read_event(s, &mmsg, sizeof(mmsg), 0) != sizeof(mmsg)) {
+          fprintf(stderr, "Failed to receive memcmp msg: %s\n", strerror(errno));
+          continue;
+        }
+        e->content.resize(msg.result);
+        if (symsan_session_read_event(s, e->content.data(), msg.result, 0) != msg.result) {
+          fprintf(stderr, "Failed to receive memcmp content: %s\n", strerror(errno));
+          continue;
+        }
+        // double check
+        if (msg.label != mmsg.label) {
+          fprintf(stderr, "Incorrect memcmp msg: %d vs %d\n", msg.label, mmsg.label);
+          continue;
+        }
+        break;
+      default:
+        continue;
+    }
+    q.enqueue(std::move(e));
+    e.reset(new event_t);
+  }
+  q.enqueue(nullptr);
+}
+
+// traces the current seed of t, read from input_fd, and solves along;
+// the events are read on a separate thread, as the z3 context of t has to
+// stay on this one
+static bool trace_input(tracer_t &t, int input_fd) {
+  // launch the target
+  int ret = symsan_session_run(t.session, input_fd);
+  if (ret < 0) {
+    fprintf(stderr, "Failed to launch target: %s\n", strerror(errno));
+    return false;
+  } else if (ret > 0) {
+    fprintf(stderr, "SymSan launch error %d\n", ret);
+    return false;
+  }
+
+  // reset the z3 parser
+  std::vector<symsan::input_t> inputs;
+  inputs.push_back({(uint8_t*)t.input_buf, t.input_size});
+  if (t.parser->restart(inputs) != 0) {
+    fprintf(stderr, "Failed to restart parser\n");
+    symsan_session_terminate(t.session);
+    return false;
+  }
+  t.current_index = 0;
+
+  moodycamel::ConcurrentQueue<std::unique_ptr<event_t>> events;
+  std::thread reader(read_events, t.session, std::ref(events));
+
+  std::unique_ptr<event_t> e;
+  while (true) {
+    collect_results(t, false);
+    if (!events.try_dequeue(e)) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+      continue;
+    }
+    if (!e) break;
+    pipe_msg &msg = e->msg;
+    // solve constraints
+    switch (msg.msg_type) {
+      case cond_type:
+        __solve_cond(t, msg.label, msg.result, msg.flags & F_ADD_CONS, (void*)msg.addr);
+        break;
+      case gep_type:
+        __handle_gep(t, e->gmsg.ptr_label, e->gmsg.ptr, e->gmsg.index_label, e->gmsg.index,
+                     e->gmsg.num_elems, e->gmsg.elem_size, e->gmsg.current_offset,
+                     (void*)msg.addr);
+        break;
+      case switch_type:
+        __solve_switch(t, msg.label, msg.result, e->cases, e->smsg.taken_label, (void*)msg.addr);
+        break;
+      case memcmp_type:
+        // save the content
+        if (e->blob)
+          t.parser->record_memcmp_ref(msg.label, (const uint8_t*)e->blob);
+        else
+          t.parser->record_memcmp(msg.label, e->content.data(), e->content.size());
+        break;
+      default:
+        break;
+    }
+  }
+  reader.join();
+  // the outputs are based on the current seed
+  collect_results(t, true);
+  return true;
+}
+
+// traces the seeds of a directory on num_jobs threads, each with its own
+// session and parser; a seed is copied to a file of its worker, which is
+// the input of the target, and its outputs are named after its index
+static int run_batch(char *program, const char *seed_dir, unsigned num_jobs,
+                     bool is_stdin) {
+  std::vector<std::string> seeds;
+  DIR *dir = opendir(seed_dir);
+  if (!dir) {
+    fprintf(stderr, "Failed to open seed directory: %s\n", strerror(errno));
+    return 1;
+  }
+  while (struct dirent *e = readdir(dir)) {
+    std::string path = std::string(seed_dir) + "/" + e->d_name;
+    struct stat st;
+    if (e->d_name[0] != '.' && stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      seeds.push_back(path);
+  }
+  closedir(dir);
+
+  __dedup_outputs = true;
+  std::atomic<size_t> next_seed(0);
+  std::atomic<int> failures(0);
+  auto work = [&](unsigned id) {
+    tracer_t t;
+    std::string cur_input = std::string(__output_dir) + "/.cur_input." + std::to_string(id);
+    if (!setup_tracer(t, program, const_cast<char*>(cur_input.c_str()), is_stdin)) {
+      failures += 1;
+      return;
+    }
+    std::vector<char> buf;
+    for (size_t i = next_seed++; i < seeds.size(); i = next_seed++) {
+      int seed_fd = open(seeds[i].c_str(), O_RDONLY);
+      struct stat st;
+      if (seed_fd == -1 || fstat(seed_fd, &st) != 0) {
+        fprintf(stderr, "Failed to open seed %s: %s\n", seeds[i].c_str(), strerror(errno));
+        if (seed_fd != -1) close(seed_fd);
+        continue;
+      }
+      buf.resize(st.st_size);
+      ssize_t n = st.st_size ? read(seed_fd, buf.data(), st.st_size) : 0;
+      close(seed_fd);
+      if (n != st.st_size) continue;
+
+      int input_fd = open(cur_input.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+      if (input_fd == -1 || write(input_fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+        fprintf(stderr, "Failed to write %s: %s\n", cur_input.c_str(), strerror(errno));
+        if (input_fd != -1) close(input_fd);
+        continue;
+      }
+      t.input_buf = buf.data();
+      t.input_size = buf.size();
+      t.session_id = i;
+      if (!trace_input(t, input_fd)) failures += 1;
+      close(input_fd);
+    }
+    t.parser.reset();
+    symsan_session_destroy(t.session);
+    unlink(cur_input.c_str());
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < num_jobs; i++) {
+    workers.emplace_back(work, i);
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  return failures ? 1 : 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-s solvers] target input\n", prog);
+  fprintf(stderr, "       %s --batch seed_dir [-j jobs] [-s solvers] target\n", prog);
+  exit(1);
+}
+
 int main(int argc, char* const argv[]) {
 
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s target input\n", argv[0]);
-    exit(1);
+  const char *seed_dir = nullptr;
+  unsigned num_jobs = 1;
+  int argi = 1;
+  while (argi < argc && argv[argi][0] == '-') {
+    if (!strcmp(argv[argi], "--batch") && argi + 1 < argc) {
+      seed_dir = argv[argi + 1];
+      argi += 2;
+    } else if (!strcmp(argv[argi], "-j") && argi + 1 < argc) {
+      num_jobs = atoi(argv[argi + 1]);
+      if (num_jobs == 0) usage(argv[0]);
+      argi += 2;
+    } else if (!strcmp(argv[argi], "-s") && argi + 1 < argc) {
+      __solver_workers = atoi(argv[argi + 1]);
+      argi += 2;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (argc - argi != (seed_dir ? 1 : 2)) {
+    usage(argv[0]);
   }
 
-  char *program = argv[1];
-  char *input = argv[2];
+  char *program = argv[argi];
 
   int is_stdin = 0;
   char *options = getenv("TAINT_OPTIONS");
@@ -161,8 +534,20 @@ int main(int argc, char* const argv[]) {
       if (n == 5 && !strncmp(taint_file, "stdin", 5))
         is_stdin = 1;
     }
+
+    char *dedup = strstr(options, "dedup_outputs=");
+    if (dedup) {
+      dedup += strlen("dedup_outputs=");
+      __dedup_outputs = *dedup == '1' || *dedup == 't';
+    }
   }
 
+  if (seed_dir) {
+    exit(run_batch(program, seed_dir, num_jobs, is_stdin));
+  }
+
+  char *input = argv[argi + 1];
+
   // load input file
   struct stat st;
   int input_fd = open(input, O_RDONLY);
@@ -171,110 +556,25 @@ int main(int argc, char* const argv[]) {
     exit(1);
   }
   fstat(input_fd, &st);
-  input_size = st.st_size;
-  input_buf = (char *)mmap(NULL, input_size, PROT_READ, MAP_PRIVATE, input_fd, 0);
-  if (input_buf == (void *)-1) {
+  tracer_t t;
+  t.input_size = st.st_size;
+  t.input_buf = (char *)mmap(NULL, t.input_size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+  if (t.input_buf == (void *)-1) {
     fprintf(stderr, "Failed to map input file: %s\n", strerror(errno));
     exit(1);
   }
 
-  // setup launcher
-  void *shm_base = symsan_init(program, uniontable_size);
-  if (shm_base == (void *)-1) {
-    fprintf(stderr, "Failed to map shm: %s\n", strerror(errno));
-    exit(1);
-  }
-
-  if (symsan_set_input(is_stdin ? "stdin" : input) != 0) {
-    fprintf(stderr, "Failed to set input\n");
-    exit(1);
-  }
-
-  char* args[3];
-  args[0] = program;
-  args[1] = input;
-  args[2] = NULL;
-  if (symsan_set_args(2, args) != 0) {
-    fprintf(stderr, "Failed to set args\n");
+  // setup launcher and z3 parser
+  if (!setup_tracer(t, program, input, is_stdin)) {
     exit(1);
   }
 
-  symsan_set_debug(1);
-  symsan_set_bounds_check(1);
-
-  // launch the target
-  int ret = symsan_run(input_fd);
-  if (ret < 0) {
-    fprintf(stderr, "Failed to launch target: %s\n", strerror(errno));
-    exit(1);
-  } else if (ret > 0) {
-    fprintf(stderr, "SymSan launch error %d\n", ret);
+  if (!trace_input(t, input_fd)) {
     exit(1);
   }
   close(input_fd);
 
-  // setup z3 parser
-  __z3_parser = new symsan::Z3ParserSolver(shm_base, uniontable_size, __z3_context);
-  std::vector<symsan::input_t> inputs;
-  inputs.push_back({(uint8_t*)input_buf, input_size});
-  if (__z3_parser->restart(inputs) != 0) {
-    fprintf(stderr, "Failed to restart parser\n");
-    exit(1);
-  }
-
-  pipe_msg msg;
-  gep_msg gmsg;
-  size_t msg_size;
-  memcmp_msg *mmsg = nullptr;
-
-  while (symsan_read_event(&msg, sizeof(msg), 0) > 0) {
-    // solve constraints
-    switch (msg.msg_type) {
-      case cond_type:
-        __solve_cond(msg.label, msg.result, msg.flags & F_ADD_CONS, (void*)msg.addr);
-        break;
-      case gep_type:
-        if (symsan_read_event(&gmsg, sizeof(gmsg), 0) != sizeof(gmsg)) {
-          fprintf(stderr, "Failed to receive gep msg: %s\n", strerror(errno));
-          break;
-        }
-        // double check
-        if (msg.label != gmsg.index_label) {
-          fprintf(stderr, "Incorrect gep msg: %d vs %d\n", msg.label, gmsg.index_label);
-          break;
-        }
-        __handle_gep(gmsg.ptr_label, gmsg.ptr, gmsg.index_label, gmsg.index,
-                     gmsg.num_elems, gmsg.elem_size, gmsg.current_offset, (void*)msg.addr);
-        break;
-      case memcmp_type:
-        // flags = 0 means both operands are symbolic thus no content to read
-        if (!msg.flags)
-          break;
-        msg_size = sizeof(memcmp_msg) + msg.result;
-        mmsg = (memcmp_msg*)malloc(msg_size); // not freed until terminate
-        if (symsan_read_event(mmsg, msg_size, 0) != msg_size) {
-          fprintf(stderr, "Failed to receive memcmp msg: %s\n", strerror(errno));
-          free(mmsg);
-          break;
-        }
-        // double check
-        if (msg.label != mmsg->label) {
-          fprintf(stderr, "Incorrect memcmp msg: %d vs %d\n", msg.label, mmsg->label);
-          free(mmsg);
-          break;
-        }
-        // save the content
-        __z3_parser->record_memcmp(msg.label, mmsg->content, msg.result);
-        free(mmsg);
-        break;
-      case fsize_type:
-        break;
-      default:
-        break;
-    }
-  }
-
-  symsan_destroy();
+  t.parser.reset();
+  symsan_session_destroy(t.session);
   exit(0);
 }
-
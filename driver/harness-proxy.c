@@ -20,35 +20,43 @@
 #include <fcntl.h>
 
 extern int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+extern int __symsan_loop(unsigned max_cnt);
+
+// number of inputs to process before restarting in persistent mode
+#define PERSISTENT_LOOP_COUNT 1000
 
 int main(int argc, char* argv[]) {
-    // open file
-    int fd = open(argv[1], O_RDONLY);
-    if (fd < 0) {
-        perror("open");
-        return 1;
-    }
-    // get file size
-    struct stat st;
-    if (fstat(fd, &st) < 0) {
-        perror("fstat");
-        close(fd);
-        return 1;
-    }
-    size_t fsize = st.st_size;
+    int retval = 0;
+    // only loops when launched in persistent mode
+    while (__symsan_loop(PERSISTENT_LOOP_COUNT)) {
+        // open file
+        int fd = open(argv[1], O_RDONLY);
+        if (fd < 0) {
+            perror("open");
+            return 1;
+        }
+        // get file size
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            perror("fstat");
+            close(fd);
+            return 1;
+        }
+        size_t fsize = st.st_size;
 
-    // read file contents
-    char *string = (char*)malloc(fsize);
-    if (read(fd, string, fsize) != fsize) {
-        perror("read");
+        // read file contents
+        char *string = (char*)malloc(fsize);
+        if (read(fd, string, fsize) != fsize) {
+            perror("read");
+            close(fd);
+            return 1;
+        }
         close(fd);
-        return 1;
-    }
-    close(fd);
 
-    // Now call into the harness
-    int retval = LLVMFuzzerTestOneInput((const uint8_t *)string, fsize);
+        // Now call into the harness
+        retval = LLVMFuzzerTestOneInput((const uint8_t *)string, fsize);
 
-    free(string);
+        free(string);
+    }
     return retval;
 }
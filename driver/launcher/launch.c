@@ -1,8 +1,19 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // fallocate
+#endif
 #include "defs.h"
 #include "debug.h"
 #include "version.h"
 #include "launch.h"
+#include "event_ring.h"
+#include "blob_area.h"
+#include "branch_filter.h"
+#include "snapshot.h"
+#include "probes.h"
 
+#include <dirent.h>
+#include <sched.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,15 +21,20 @@
 
 #include <sys/ipc.h>
 #include <sys/mman.h>
+#include <sys/personality.h>
 #include <sys/select.h>
 #include <sys/shm.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 
+extern char **environ;
+
 #undef alloc_printf
 #define alloc_printf(_str...) ({ \
     char* _tmp; \
@@ -29,13 +45,29 @@
     _tmp; \
   })
 
+// the layout of the union table, see dfsan.h: 16-byte label records in the
+// lower half, 16-byte operands in the upper half, and labels taken by the
+// runtime in blocks, whose first label is always used
+#define LABEL_RECORD_SIZE 16
+#define LABEL_BLOCK_SIZE 4096
+// the labels below this stay resident across runs, most runs use them
+#define RECLAIM_KEEP_LABELS (1UL << 20)
+
+// fixed fds used inside the forkserver, similar to AFL's FORKSRV_FD
+#define FORKSRV_CTL_FD 198
+#define FORKSRV_PIPE_FD 199
+
 struct symsan_config {
   char *symsan_bin;
   char *input_file;
+  char *taint_ranges;
+  char *taint_inputs;
+  char *symbolize_pcs;
   char **argv;
   char *shm_name;
   int shm_fd;
   void *label_info;
+  size_t uniontable_size;
   int pipefds[2];
   char *symsan_env;
   int symsan_pid;
@@ -48,107 +80,214 @@ struct symsan_config {
   int exit_on_memerror;
   int trace_file_size;
   int force_stdin;
+  int use_forkserver;
+  int persistent;
+  int persistent_gc;
+  int use_event_ring;
+  int lazy_mmap_taint;
+  int summarize_sums;
+  int memcmp_blob;
+  int branch_filter;
+  int no_aslr;
+  int taint_argv;
+  int taint_env;
+  size_t max_ast_size;
+  int huge_pages;
+  size_t prefault_mb;
+  // the cpu and the numa node the children run on, -1 for any
+  int cpu;
+  int numa_node;
+  int ring_eof;
+  struct event_ring *event_ring;
+  struct blob_area *blob_area;
+  struct branch_filter *filter;
+
+  // the launcher's and the target's ends of the snapshot socket, the
+  // control socket of the latest snapshot, and whether the child is
+  // resumed from it
+  int snapshot_fds[2];
+  int snapshot_ctl;
+  struct snapshot_msg snapshot;
+  int from_snapshot;
 
   int dev_null_fd;
+  int forkserver_fd;
+  int forkserver_pid;
 
   int exit_status;
   int is_killed;
 };
 
-static struct symsan_config g_config;
+static int symsan_session_setup(symsan_session_t *s);
+
+// the session behind the symsan_* calls without one
+static symsan_session_t *g_default = NULL;
+static unsigned g_num_sessions = 0;
 
 __attribute__((visibility("default")))
-void* symsan_init(const char *symsan_bin, const size_t uniontable_size) {
+symsan_session_t* symsan_session_new(const char *symsan_bin,
+                                     const size_t uniontable_size) {
 
   if (!symsan_bin) {
-    return (void *)-1;
+    return NULL;
   }
 
-  g_config.symsan_bin = strdup(symsan_bin);
-  g_config.input_file = NULL;
-  g_config.argv = NULL;
-  g_config.shm_name = NULL;
-  g_config.shm_fd = -1;
-  g_config.label_info = NULL;
-  g_config.pipefds[0] = -1;
-  g_config.pipefds[1] = -1;
-  g_config.symsan_env = NULL;
-  g_config.symsan_pid = -1;
-  g_config.is_input_file = 0;
-  g_config.is_input_sdtin = 0;
-  g_config.is_input_network = 0;
-  g_config.enable_debug = 0;
-  g_config.enable_bounds_check = 0;
-  g_config.exit_on_memerror = 1;
-  g_config.trace_file_size = 0;
-  g_config.force_stdin = 0;
-  g_config.dev_null_fd = -1;
-  g_config.exit_status = 0;
-  g_config.is_killed = 0;
+  symsan_session_t *s = (symsan_session_t *)malloc(sizeof(symsan_session_t));
+  if (!s) {
+    return NULL;
+  }
+
+  s->symsan_bin = strdup(symsan_bin);
+  s->input_file = NULL;
+  s->taint_ranges = NULL;
+  s->taint_inputs = NULL;
+  s->symbolize_pcs = NULL;
+  s->argv = NULL;
+  s->shm_name = NULL;
+  s->shm_fd = -1;
+  s->label_info = NULL;
+  // the runtime rounds the table up to a page (InitializeUnionTableSize),
+  // the ring, blob area and filter past it must be where it expects them
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  s->uniontable_size = (uniontable_size + page_size - 1) & ~(page_size - 1);
+  s->pipefds[0] = -1;
+  s->pipefds[1] = -1;
+  s->symsan_env = NULL;
+  s->symsan_pid = -1;
+  s->is_input_file = 0;
+  s->is_input_sdtin = 0;
+  s->is_input_network = 0;
+  s->enable_debug = 0;
+  s->enable_bounds_check = 0;
+  s->exit_on_memerror = 1;
+  s->trace_file_size = 0;
+  s->force_stdin = 0;
+  s->use_forkserver = 0;
+  s->persistent = 0;
+  s->persistent_gc = 0;
+  s->use_event_ring = 0;
+  s->lazy_mmap_taint = 0;
+  s->summarize_sums = 0;
+  s->memcmp_blob = 0;
+  s->branch_filter = 0;
+  s->no_aslr = 0;
+  s->taint_argv = 0;
+  s->taint_env = 0;
+  s->max_ast_size = 0;
+  s->huge_pages = 0;
+  s->prefault_mb = 0;
+  s->cpu = -1;
+  s->numa_node = -1;
+  s->ring_eof = 0;
+  s->event_ring = NULL;
+  s->blob_area = NULL;
+  s->filter = NULL;
+  s->snapshot_fds[0] = -1;
+  s->snapshot_fds[1] = -1;
+  s->snapshot_ctl = -1;
+  s->from_snapshot = 0;
+  s->dev_null_fd = -1;
+  s->forkserver_fd = -1;
+  s->forkserver_pid = -1;
+  s->exit_status = 0;
+  s->is_killed = 0;
+
+  if (!s->symsan_bin || symsan_session_setup(s) != 0) {
+    symsan_session_destroy(s);
+    return NULL;
+  }
+  return s;
+}
 
+// opens /dev/null and maps the shm of a new session
+static int symsan_session_setup(symsan_session_t *s) {
   // open /dev/null
-  g_config.dev_null_fd = open("/dev/null", O_RDWR);
-  if (g_config.dev_null_fd == -1) {
-    return (void *)-1;
+  s->dev_null_fd = open("/dev/null", O_RDWR);
+  if (s->dev_null_fd == -1) {
+    return -1;
   }
 
-  // create a new shm name
-  g_config.shm_name = alloc_printf("/symsan-union-table-%d", getpid());
-  if (!g_config.shm_name) {
-    return (void *)-1;
+  // create a new shm name, one per session
+  s->shm_name = alloc_printf("/symsan-union-table-%d-%u", getpid(),
+                             __atomic_fetch_add(&g_num_sessions, 1, __ATOMIC_RELAXED));
+  if (!s->shm_name) {
+    return -1;
   }
   // create shm
-  g_config.shm_fd = shm_open(g_config.shm_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-  if (g_config.shm_fd == -1) {
-    return (void *)-1;
+  s->shm_fd = shm_open(s->shm_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (s->shm_fd == -1) {
+    return -1;
   }
-  // set the size of the shm
-  if (ftruncate(g_config.shm_fd, uniontable_size) == -1) {
-    return (void *)-1;
+  // set the size of the shm, the event ring follows the union table, then
+  // the blob area and the branch filter
+  if (ftruncate(s->shm_fd, s->uniontable_size + EVENT_RING_SIZE +
+                BLOB_AREA_SIZE + BRANCH_FILTER_SIZE) == -1) {
+    return -1;
   }
   // clear O_CLOEXEC flag
-  fcntl(g_config.shm_fd, F_SETFD, fcntl(g_config.shm_fd, F_GETFD) & ~FD_CLOEXEC);
+  fcntl(s->shm_fd, F_SETFD, fcntl(s->shm_fd, F_GETFD) & ~FD_CLOEXEC);
   // mmap the shm
-  g_config.label_info = mmap(NULL, uniontable_size, PROT_READ, MAP_SHARED,
-      g_config.shm_fd, 0);
+  s->label_info = mmap(NULL, s->uniontable_size, PROT_READ, MAP_SHARED,
+      s->shm_fd, 0);
+  if (s->label_info == MAP_FAILED) {
+    s->label_info = NULL;
+    return -1;
+  }
+  void *ring = mmap(NULL, EVENT_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+      s->shm_fd, s->uniontable_size);
+  if (ring != MAP_FAILED) {
+    s->event_ring = (struct event_ring *)ring;
+    s->event_ring->size = EVENT_RING_DATA_SIZE;
+  }
+  void *blob = mmap(NULL, BLOB_AREA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+      s->shm_fd, s->uniontable_size + EVENT_RING_SIZE);
+  if (blob != MAP_FAILED) {
+    s->blob_area = (struct blob_area *)blob;
+    s->blob_area->size = BLOB_AREA_DATA_SIZE;
+  }
+  void *filter = mmap(NULL, BRANCH_FILTER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+      s->shm_fd, s->uniontable_size + EVENT_RING_SIZE + BLOB_AREA_SIZE);
+  if (filter != MAP_FAILED) {
+    s->filter = (struct branch_filter *)filter;
+  }
 
-  return g_config.label_info;
+  return 0;
 }
 
 __attribute__((visibility("default")))
-int symsan_set_input(const char *input) {
+int symsan_session_set_input(symsan_session_t *s, const char *input) {
   if (!input) {
     return SYMSAN_INVALID_ARGS;
   }
 
-  g_config.input_file = strdup(input);
-  if (!g_config.input_file) {
+  s->input_file = strdup(input);
+  if (!s->input_file) {
     return SYMSAN_NO_MEMORY;
   }
 
   if (strcmp(input, "stdin") == 0) {
-    g_config.is_input_sdtin = 1;
+    s->is_input_sdtin = 1;
   } else if (strstr(input, "tcp@") == input) {
-    g_config.is_input_network = 1;
+    s->is_input_network = 1;
   } else if (strstr(input, "udp@") == input) {
-    g_config.is_input_network = 1;
+    s->is_input_network = 1;
   } else if (strstr(input, "unix@") == input) {
-    g_config.is_input_network = 1;
+    s->is_input_network = 1;
   } else {
-    g_config.is_input_file = 1;
+    s->is_input_file = 1;
   }
 
   return 0;
 }
 
 __attribute__((visibility("default")))
-int symsan_set_args(const int argc, char* const argv[]) {
+int symsan_session_set_args(symsan_session_t *s, const int argc, char* const argv[]) {
   if (argc < 1 || !argv) {
     return SYMSAN_INVALID_ARGS;
   }
 
-  g_config.argv = (char **)malloc(sizeof(char *) * (argc + 1));
-  if (!g_config.argv) {
+  s->argv = (char **)malloc(sizeof(char *) * (argc + 1));
+  if (!s->argv) {
     return SYMSAN_NO_MEMORY;
   }
 
@@ -159,141 +298,803 @@ int symsan_set_args(const int argc, char* const argv[]) {
       goto error;
     }
 
-    g_config.argv[i] = strdup(argv[i]);
-    if (!g_config.argv[i]) {
+    s->argv[i] = strdup(argv[i]);
+    if (!s->argv[i]) {
       err = SYMSAN_NO_MEMORY;
       goto error;
     }
   }
-  g_config.argv[argc] = NULL;
+  s->argv[argc] = NULL;
 
   return 0;
 
 error:
   for (int j = 0; j < i; j++) {
-    free(g_config.argv[j]);
+    free(s->argv[j]);
   }
-  free(g_config.argv);
-  g_config.argv = NULL;
+  free(s->argv);
+  s->argv = NULL;
   return err;
 }
 
 __attribute__((visibility("default")))
-int symsan_set_debug(int enable) {
-  g_config.enable_debug = !!enable;
+int symsan_session_set_debug(symsan_session_t *s, int enable) {
+  s->enable_debug = !!enable;
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_bounds_check(symsan_session_t *s, int enable) {
+  s->enable_bounds_check = !!enable;
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_exit_on_memerror(symsan_session_t *s, int enable) {
+  s->exit_on_memerror = !!enable;
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_trace_file_size(symsan_session_t *s, int enable) {
+  s->trace_file_size = !!enable;
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_force_stdin(symsan_session_t *s, int enable) {
+  s->force_stdin = !!enable;
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_event_ring(symsan_session_t *s, int enable) {
+  if (enable && !s->event_ring) {
+    return SYMSAN_MISSING_SHM;
+  }
+  s->use_event_ring = !!enable;
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_memcmp_blob(symsan_session_t *s, int enable) {
+  if (enable && !s->blob_area) {
+    return SYMSAN_MISSING_SHM;
+  }
+  s->memcmp_blob = !!enable;
+  return 0;
+}
+
+__attribute__((visibility("default")))
+const void* symsan_session_get_blob(symsan_session_t *s, uint64_t offset, size_t size) {
+  if (!s->blob_area) {
+    return NULL;
+  }
+  uint64_t used = __atomic_load_n(&s->blob_area->used, __ATOMIC_ACQUIRE);
+  if (offset > used || size > used - offset) {
+    return NULL;
+  }
+  return &s->blob_area->data[offset];
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_branch_filter(symsan_session_t *s, int enable) {
+  if (enable && !s->filter) {
+    return SYMSAN_MISSING_SHM;
+  }
+  s->branch_filter = !!enable;
+  return 0;
+}
+
+__attribute__((visibility("default")))
+void symsan_session_set_site_limit(symsan_session_t *s, uint32_t limit) {
+  if (s->filter) {
+    __atomic_store_n(&s->filter->site_limit, limit, __ATOMIC_RELAXED);
+  }
+}
+
+// sets the bit on the slot of id, adding it if needed
+static int mark_branch(struct branch_filter *f, uint32_t id, uint32_t bit) {
+  uint32_t mask = BRANCH_FILTER_SLOTS - 1;
+  for (uint32_t i = branch_filter_hash(id), n = 0; n <= mask; i = (i + 1) & mask, n++) {
+    struct branch_filter_slot *slot = &f->slots[i];
+    if (slot->id == id) {
+      __atomic_fetch_or(&slot->covered, bit, __ATOMIC_RELAXED);
+      return 0;
+    }
+    if (slot->id == 0) {
+      // keep a quarter of the slots free, so the runtime's probes stay short
+      if (f->num_ids + 1 > BRANCH_FILTER_SLOTS / 4 * 3) {
+        return SYMSAN_NO_MEMORY;
+      }
+      slot->covered = bit;
+      __atomic_store_n(&slot->id, id, __ATOMIC_RELEASE);
+      f->num_ids++;
+      return 0;
+    }
+  }
+  return SYMSAN_NO_MEMORY;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_mark_covered(symsan_session_t *s, uint32_t id, int direction) {
+  if (!s->filter || !id) {
+    return SYMSAN_INVALID_ARGS;
+  }
+  return mark_branch(s->filter, id,
+                     direction ? BRANCH_COVERED_TRUE : BRANCH_COVERED_FALSE);
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_forkserver(symsan_session_t *s, int enable) {
+  s->use_forkserver = !!enable;
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_persistent(symsan_session_t *s, int enable) {
+  s->persistent = !!enable;
+  // persistent mode uses the same control protocol as the forkserver
+  if (enable) s->use_forkserver = 1;
   return 0;
 }
 
 __attribute__((visibility("default")))
-int symsan_set_bounds_check(int enable) {
-  g_config.enable_bounds_check = !!enable;
+int symsan_session_set_persistent_gc(symsan_session_t *s, int enable) {
+  s->persistent_gc = !!enable;
   return 0;
 }
 
 __attribute__((visibility("default")))
-int symsan_set_exit_on_memerror(int enable) {
-  g_config.exit_on_memerror = !!enable;
+int symsan_session_set_lazy_mmap_taint(symsan_session_t *s, int enable) {
+  s->lazy_mmap_taint = !!enable;
   return 0;
 }
 
 __attribute__((visibility("default")))
-int symsan_set_trace_file_size(int enable) {
-  g_config.trace_file_size = !!enable;
+int symsan_session_set_summarize_sums(symsan_session_t *s, int enable) {
+  s->summarize_sums = !!enable;
   return 0;
 }
 
+static void stop_forkserver(struct symsan_config *s);
+static void drop_snapshot(struct symsan_config *s);
+
+// the ranges are in the options the runtime is started with, so a change
+// rebuilds them and restarts the forkserver on the next run
 __attribute__((visibility("default")))
-int symsan_set_force_stdin(int enable) {
-  g_config.force_stdin = !!enable;
+int symsan_session_set_taint_ranges(symsan_session_t *s, const char *ranges) {
+  if (!ranges) {
+    return SYMSAN_INVALID_ARGS;
+  }
+  if (s->taint_ranges && !strcmp(s->taint_ranges, ranges)) {
+    return 0;
+  }
+  free(s->taint_ranges);
+  s->taint_ranges = strdup(ranges);
+  if (!s->taint_ranges) {
+    return SYMSAN_NO_MEMORY;
+  }
+  // a snapshot has the labels of the old ranges
+  drop_snapshot(s);
+  if (s->symsan_env) {
+    free(s->symsan_env);
+    s->symsan_env = NULL;
+    stop_forkserver(s);
+  }
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_taint_inputs(symsan_session_t *s, const char *files) {
+  if (!files) {
+    return SYMSAN_INVALID_ARGS;
+  }
+  if (s->taint_inputs && !strcmp(s->taint_inputs, files)) {
+    return 0;
+  }
+  free(s->taint_inputs);
+  s->taint_inputs = strdup(files);
+  if (!s->taint_inputs) {
+    return SYMSAN_NO_MEMORY;
+  }
+  // the inputs are baked into the forkserver's environment
+  drop_snapshot(s);
+  if (s->symsan_env) {
+    free(s->symsan_env);
+    s->symsan_env = NULL;
+    stop_forkserver(s);
+  }
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_taint_argv(symsan_session_t *s, int enable) {
+  s->taint_argv = !!enable;
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_taint_env(symsan_session_t *s, int enable) {
+  s->taint_env = !!enable;
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_max_ast_size(symsan_session_t *s, size_t size) {
+  s->max_ast_size = size;
+  return 0;
+}
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+__attribute__((visibility("default")))
+int symsan_session_set_huge_pages(symsan_session_t *s, int enable) {
+  s->huge_pages = !!enable;
+  // the parser's walks over the label records go through this mapping
+  if (enable && s->label_info) {
+    madvise(s->label_info, s->uniontable_size, MADV_HUGEPAGE);
+  }
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_prefault(symsan_session_t *s, size_t mb) {
+  s->prefault_mb = mb;
+  if (!mb || !s->label_info) {
+    return 0;
+  }
+  // both halves of the table, the runtime fills them in on its side; past
+  // RECLAIM_KEEP_LABELS they're given back after each run anyway
+  size_t half = s->uniontable_size / 2;
+  size_t n = MIN(mb << 20, half);
+  madvise(s->label_info, n, MADV_POPULATE_READ);
+  madvise((char *)s->label_info + half, n, MADV_POPULATE_READ);
+  return 0;
+}
+
+// reads a sysfs cpu list, e.g., "0-15,32-47", into set
+static int read_cpulist(const char *path, cpu_set_t *set) {
+  char buf[1024];
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) {
+    return -1;
+  }
+  buf[n] = 0;
+  CPU_ZERO(set);
+  char *p = buf;
+  while (*p >= '0' && *p <= '9') {
+    long lo = strtol(p, &p, 10), hi = lo;
+    if (*p == '-') {
+      hi = strtol(p + 1, &p, 10);
+    }
+    for (long c = lo; c <= hi && c < CPU_SETSIZE; c++) {
+      CPU_SET(c, set);
+    }
+    if (*p == ',') p++;
+  }
+  return 0;
+}
+
+// the numa node of cpu, -1 without numa
+static int cpu_node(int cpu) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (!dir) {
+    return -1;
+  }
+  int node = -1;
+  struct dirent *e;
+  while ((e = readdir(dir)) != NULL) {
+    if (!strncmp(e->d_name, "node", 4) && e->d_name[4] >= '0' &&
+        e->d_name[4] <= '9') {
+      node = atoi(e->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+#define MPOL_BIND_ 2
+#define MPOL_MF_MOVE_ (1 << 1)
+
+// binds the pages of the shm (union table, event ring, blob area and branch
+// filter) to node; it's a shared policy of the tmpfs object, so it holds
+// for the pages the runtime faults in as well
+static void bind_shm(struct symsan_config *s, int node) {
+  unsigned long mask[4] = {0};
+  if (node < 0 || node >= (int)(sizeof(mask) * 8)) {
+    return;
+  }
+  mask[node / (sizeof(long) * 8)] = 1UL << (node % (sizeof(long) * 8));
+  struct { void *addr; size_t size; } regions[] = {
+    {s->label_info, s->uniontable_size},
+    {s->event_ring, EVENT_RING_SIZE},
+    {s->blob_area, BLOB_AREA_SIZE},
+    {s->filter, BRANCH_FILTER_SIZE},
+  };
+  for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+    if (regions[i].addr) {
+      syscall(SYS_mbind, regions[i].addr, regions[i].size, MPOL_BIND_, mask,
+              sizeof(mask) * 8, MPOL_MF_MOVE_);
+    }
+  }
+}
+
+// pins a new child to the cpu or the node of the session, the children
+// of a forkserver inherit it
+static void pin_child(struct symsan_config *s, pid_t pid) {
+  cpu_set_t set;
+  if (s->cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(s->cpu, &set);
+  } else if (s->numa_node >= 0) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             s->numa_node);
+    if (read_cpulist(path, &set) != 0) {
+      return;
+    }
+  } else {
+    return;
+  }
+  sched_setaffinity(pid, sizeof(set), &set);
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_affinity(symsan_session_t *s, int cpu) {
+  if (cpu >= CPU_SETSIZE) {
+    return -1;
+  }
+  s->cpu = cpu;
+  // the union table lives where the child writes it, unless told otherwise
+  if (cpu >= 0 && s->numa_node < 0) {
+    bind_shm(s, cpu_node(cpu));
+  }
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_numa_node(symsan_session_t *s, int node) {
+  s->numa_node = node;
+  bind_shm(s, node);
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_no_aslr(symsan_session_t *s, int enable) {
+  s->no_aslr = !!enable;
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_set_symbolize_pcs(symsan_session_t *s, const char *path) {
+  free(s->symbolize_pcs);
+  s->symbolize_pcs = NULL;
+  if (path) {
+    s->symbolize_pcs = strdup(path);
+    if (!s->symbolize_pcs) {
+      return SYMSAN_NO_MEMORY;
+    }
+  }
+  return 0;
+}
+
+static char* build_env(struct symsan_config *s, int pipe_fd, int forkserver_fd) {
+  return alloc_printf(
+      "taint_file=\"%s\":shm_fd=%d:union_table_size=%zu:pipe_fd=%d:debug=%d:trace_bounds=%d:exit_on_memerror=%d:trace_fsize=%d:force_stdin=%d:forkserver_fd=%d:persistent=%d:persistent_gc=%d:event_ring=%d:lazy_mmap_taint=%d:summarize_sums=%d:memcmp_blob=%d:branch_filter=%d:taint_ranges=\"%s\":taint_inputs=\"%s\":taint_argv=%d:taint_env=%d:max_ast_size=%zu:symbolize_pcs=\"%s\":snapshot_fd=%d:huge_pages=%d:prefault_mb=%zu",
+      s->input_file, s->shm_fd, s->uniontable_size, pipe_fd,
+      s->enable_debug, s->enable_bounds_check,
+      s->exit_on_memerror, s->trace_file_size,
+      s->force_stdin, forkserver_fd, s->persistent,
+      s->persistent_gc, s->use_event_ring,
+      s->lazy_mmap_taint, s->summarize_sums, s->memcmp_blob, s->branch_filter,
+      s->taint_ranges ? s->taint_ranges : "",
+      s->taint_inputs ? s->taint_inputs : "",
+      s->taint_argv, s->taint_env, s->max_ast_size,
+      s->symbolize_pcs ? s->symbolize_pcs : "",
+      s->snapshot_fds[1] != -1 ? SNAPSHOT_FD : -1,
+      s->huge_pages, s->prefault_mb);
+}
+
+// common setup for the exec'ed child, only returns on error
+static int exec_child(struct symsan_config *s, int fd) {
+  // clear signal handlers and masks
+  sigset_t set;
+  sigemptyset(&set);
+  sigprocmask(SIG_SETMASK, &set, NULL);
+
+  // disable core dump as shadow mem is toooooo large
+  struct rlimit limit;
+  limit.rlim_cur = limit.rlim_max = 0;
+  setrlimit(RLIMIT_CORE, &limit);
+
+  // stable code addresses across runs, e.g., to symbolize them later
+  if (s->no_aslr) {
+    personality(ADDR_NO_RANDOMIZE);
+  }
+
+  setenv("TAINT_OPTIONS", (char*)s->symsan_env, 1);
+  unsetenv("LD_PRELOAD"); // don't preload anything
+  if (s->snapshot_fds[1] != -1) {
+    dup2(s->snapshot_fds[1], SNAPSHOT_FD);
+  }
+  if (s->is_input_sdtin && fd >= 0) {
+    close(0);
+    lseek(fd, 0, SEEK_SET);
+    dup2(fd, 0);
+  }
+  if (!s->enable_debug) {
+    close(1);
+    close(2);
+    dup2(s->dev_null_fd, 1);
+    dup2(s->dev_null_fd, 2);
+  }
+  return execv(s->symsan_bin, s->argv);
+}
+
+// starts the target as exec_child does, but with posix_spawn, which glibc
+// runs with clone(CLONE_VM | CLONE_VFORK), so the page tables of a large
+// launcher (e.g., AFL++ with the union table mapped) aren't copied as by a
+// fork; ctl_fd goes to FORKSRV_CTL_FD and close_fd is closed if not -1.
+// Returns the pid, or < 0 on error.
+static int spawn_child(struct symsan_config *s, int fd, int ctl_fd, int close_fd) {
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_t actions;
+  sigset_t set;
+  int ret = -1;
+  pid_t pid = -1;
+
+  // the environment with TAINT_OPTIONS replaced and no LD_PRELOAD
+  size_t n = 0;
+  while (environ[n]) n++;
+  char **envp = (char **)malloc(sizeof(char *) * (n + 2));
+  char *options = alloc_printf("TAINT_OPTIONS=%s", s->symsan_env);
+  if (!envp || !options) {
+    free(envp);
+    free(options);
+    return -1;
+  }
+  size_t k = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (strncmp(environ[i], "TAINT_OPTIONS=", 14) &&
+        strncmp(environ[i], "LD_PRELOAD=", 11)) {
+      envp[k++] = environ[i];
+    }
+  }
+  envp[k++] = options;
+  envp[k] = NULL;
+
+  posix_spawnattr_init(&attr);
+  posix_spawn_file_actions_init(&actions);
+  // clear signal masks and handlers
+  sigemptyset(&set);
+  posix_spawnattr_setsigmask(&attr, &set);
+  sigfillset(&set);
+  sigdelset(&set, SIGKILL);
+  sigdelset(&set, SIGSTOP);
+  posix_spawnattr_setsigdefault(&attr, &set);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  if (close_fd != -1) {
+    posix_spawn_file_actions_addclose(&actions, close_fd);
+  }
+  if (ctl_fd != -1) {
+    posix_spawn_file_actions_adddup2(&actions, ctl_fd, FORKSRV_CTL_FD);
+  }
+  if (s->snapshot_fds[1] != -1) {
+    posix_spawn_file_actions_adddup2(&actions, s->snapshot_fds[1], SNAPSHOT_FD);
+  }
+  if (s->is_input_sdtin && fd >= 0) {
+    // the offset is shared with the child
+    lseek(fd, 0, SEEK_SET);
+    posix_spawn_file_actions_adddup2(&actions, fd, 0);
+  }
+  if (!s->enable_debug) {
+    posix_spawn_file_actions_adddup2(&actions, s->dev_null_fd, 1);
+    posix_spawn_file_actions_adddup2(&actions, s->dev_null_fd, 2);
+  }
+
+  ret = posix_spawn(&pid, s->symsan_bin, &actions, &attr, s->argv, envp);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  free(options);
+  free(envp);
+  if (ret != 0) {
+    errno = ret;
+    return -1;
+  }
+
+  // no core dump, the shadow mem is toooooo large; a crash before this
+  // is as unlikely as it's harmless
+  struct rlimit limit;
+  limit.rlim_cur = limit.rlim_max = 0;
+  prlimit(pid, RLIMIT_CORE, &limit, NULL);
+  return pid;
+}
+
+static void stop_forkserver(struct symsan_config *s) {
+  if (s->forkserver_fd != -1) {
+    close(s->forkserver_fd); // the forkserver exits on EOF
+    s->forkserver_fd = -1;
+  }
+  if (s->forkserver_pid > 0) {
+    kill(s->forkserver_pid, SIGKILL);
+    waitpid(s->forkserver_pid, NULL, 0);
+    s->forkserver_pid = -1;
+  }
+}
+
+static int start_forkserver(struct symsan_config *s) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+    return -1;
+  }
+
+  if (!s->symsan_env) {
+    s->symsan_env = build_env(s, FORKSRV_PIPE_FD, FORKSRV_CTL_FD);
+    if (!s->symsan_env) {
+      close(sv[0]);
+      close(sv[1]);
+      return SYMSAN_NO_MEMORY;
+    }
+  }
+
+  // stdin is passed along with each request; personality() has no spawn
+  // attribute, so without ASLR it's a fork
+  if (!s->no_aslr) {
+    s->forkserver_pid = spawn_child(s, -1, sv[1], -1);
+  } else if ((s->forkserver_pid = fork()) == 0) {
+    close(sv[0]);
+    dup2(sv[1], FORKSRV_CTL_FD);
+    close(sv[1]);
+    exec_child(s, -1);
+    _exit(1);
+  }
+  if (s->forkserver_pid > 0) {
+    pin_child(s, s->forkserver_pid);
+  }
+  if (s->forkserver_pid < 0) {
+    close(sv[0]);
+    close(sv[1]);
+    return s->forkserver_pid;
+  }
+
+  close(sv[1]);
+  s->forkserver_fd = sv[0];
+
+  // wait for the hello message
+  uint32_t hello;
+  if (read(s->forkserver_fd, &hello, sizeof(hello)) != sizeof(hello)) {
+    stop_forkserver(s);
+    return -1;
+  }
+
   return 0;
 }
 
+// sends a run request to the forkserver or a snapshot on ctl_fd, with the
+// event pipe and, with nfds of 2, the input fd attached; -1 if it's gone
+static int fork_request(struct symsan_config *s, int ctl_fd, int fd, int nfds) {
+  int ret = pipe(s->pipefds);
+  if (ret != 0) {
+    return SYMSAN_NO_MEMORY;
+  }
+
+  int fds[2] = { s->pipefds[1], fd };
+  uint32_t cmd = 0;
+  struct iovec iov = { &cmd, sizeof(cmd) };
+  char cbuf[CMSG_SPACE(sizeof(fds))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+  memcpy(CMSG_DATA(c), fds, sizeof(int) * nfds);
+
+  int pid = -1;
+  if (sendmsg(ctl_fd, &msg, MSG_NOSIGNAL) != sizeof(cmd) ||
+      read(ctl_fd, &pid, sizeof(pid)) != sizeof(pid)) {
+    close(s->pipefds[0]);
+    close(s->pipefds[1]);
+    return -1;
+  }
+
+  close(s->pipefds[1]); // close the write fd
+  s->symsan_pid = pid;
+  s->is_killed = 0; // reset kill flag
+
+  return 0;
+}
+
+static int forkserver_request(struct symsan_config *s, int fd) {
+  if (s->forkserver_pid <= 0) {
+    int ret = start_forkserver(s);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  int ret = fork_request(s, s->forkserver_fd, fd, s->is_input_sdtin ? 2 : 1);
+  if (ret == -1) {
+    // forkserver is dead, restart it on next run
+    stop_forkserver(s);
+  }
+  return ret;
+}
+
+static int forkserver_run(struct symsan_config *s, int fd) {
+  int ret = forkserver_request(s, fd);
+  if (ret == -1) {
+    // the forkserver (or the persistent target, after its last iteration)
+    // may have exited, try again with a fresh one
+    ret = forkserver_request(s, fd);
+  }
+  return ret;
+}
+
+static void drop_snapshot(struct symsan_config *s) {
+  if (s->snapshot_ctl != -1) {
+    close(s->snapshot_ctl); // the dormant copy exits on EOF
+    s->snapshot_ctl = -1;
+  }
+}
+
+static void wait_child(struct symsan_config *s) {
+  if (s->from_snapshot) {
+    // reaped by the dormant copy, like by the forkserver
+    s->from_snapshot = 0;
+    if (read(s->snapshot_ctl, &s->exit_status,
+             sizeof(s->exit_status)) != sizeof(s->exit_status)) {
+      drop_snapshot(s);
+    }
+  } else if (s->use_forkserver) {
+    // the child is reaped by the forkserver, which reports the status
+    if (read(s->forkserver_fd, &s->exit_status,
+             sizeof(s->exit_status)) != sizeof(s->exit_status)) {
+      // the server is gone, for persistent mode this is the target's status
+      close(s->forkserver_fd);
+      s->forkserver_fd = -1;
+      if (s->forkserver_pid > 0) {
+        kill(s->forkserver_pid, SIGKILL);
+        waitpid(s->forkserver_pid, &s->exit_status, 0);
+        s->forkserver_pid = -1;
+      }
+    }
+  } else {
+    waitpid(s->symsan_pid, &s->exit_status, 0);
+  }
+  SYMSAN_PROBE2(run_exit, s->symsan_pid, s->exit_status);
+}
+
+// gives the pages of the union table the last run used beyond the first
+// RECLAIM_KEEP_LABELS labels back to the kernel, so they don't stay resident
+// across runs; the labels in use are found from the first record of each
+// block, read with pread so the holes aren't faulted in
+static void reclaim_union_table(symsan_session_t *s) {
+  // persistent targets keep their labels across runs
+  if (s->persistent || s->shm_fd == -1) {
+    return;
+  }
+  size_t half = s->uniontable_size / 2;
+  size_t num_labels = half / LABEL_RECORD_SIZE;
+  size_t first = RECLAIM_KEEP_LABELS;
+  size_t end = first;
+  while (end + 1 < num_labels) {
+    uint64_t rec[2] = {0, 0};
+    if (pread(s->shm_fd, rec, sizeof(rec), (end + 1) * LABEL_RECORD_SIZE) != sizeof(rec) ||
+        (rec[0] == 0 && rec[1] == 0)) {
+      break;
+    }
+    end += LABEL_BLOCK_SIZE;
+  }
+  if (end == first) {
+    return;
+  }
+  if (end > num_labels) {
+    end = num_labels;
+  }
+  // both the records and the operands, the block boundary is page aligned
+  off_t len = (end - first) * LABEL_RECORD_SIZE;
+  fallocate(s->shm_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            first * LABEL_RECORD_SIZE, len);
+  fallocate(s->shm_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            half + first * LABEL_RECORD_SIZE, len);
+}
+
 __attribute__((visibility("default")))
-int symsan_run(int fd) {
+int symsan_session_run(symsan_session_t *s, int fd) {
+  int ret;
   if (fd < 0) {
     return SYMSAN_INVALID_ARGS;
   }
-  if (!g_config.symsan_bin) {
+  if (!s->symsan_bin) {
     return SYMSAN_MISSING_BIN;
   }
-  if (!g_config.label_info) {
+  if (!s->label_info) {
     return SYMSAN_MISSING_SHM;
   }
-  if (!g_config.input_file) {
+  if (!s->input_file) {
     return SYMSAN_MISSING_INPUT;
   }
-  if (!g_config.argv) {
+  if (!s->argv) {
     return SYMSAN_MISSING_ARGS;
   }
 
-  if (g_config.is_input_network && !g_config.input_file) {
+  if (s->is_input_network && !s->input_file) {
     return SYMSAN_MISSING_INPUT;
   }
 
-  int ret = pipe(g_config.pipefds);
+  if (s->use_event_ring) {
+    s->event_ring->head = 0;
+    s->event_ring->tail = 0;
+    s->event_ring->waiting = 0;
+    s->ring_eof = 0;
+  }
+
+  if (s->memcmp_blob) {
+    s->blob_area->used = 0;
+  }
+
+  reclaim_union_table(s);
+  s->from_snapshot = 0;
+
+  SYMSAN_PROBE1(run_spawn_begin, fd);
+  if (s->use_forkserver) {
+    ret = forkserver_run(s, fd);
+    SYMSAN_PROBE2(run_spawn_end, s->symsan_pid, ret);
+    return ret;
+  }
+
+  ret = pipe(s->pipefds);
   if (ret != 0) {
     return SYMSAN_NO_MEMORY;
   }
 
-  if (!g_config.symsan_env) {
-    g_config.symsan_env = alloc_printf(
-        "taint_file=\"%s\":shm_fd=%d:pipe_fd=%d:debug=%d:trace_bounds=%d:exit_on_memerror=%d:trace_fsize=%d:force_stdin=%d",
-        g_config.input_file, g_config.shm_fd, g_config.pipefds[1],
-        g_config.enable_debug, g_config.enable_bounds_check,
-        g_config.exit_on_memerror, g_config.trace_file_size,
-        g_config.force_stdin);
-    if (!g_config.symsan_env) {
+  if (!s->symsan_env) {
+    s->symsan_env = build_env(s, s->pipefds[1], -1);
+    if (!s->symsan_env) {
       return SYMSAN_NO_MEMORY;
     }
   }
 
-  g_config.symsan_pid = fork();
-  if (g_config.symsan_pid == 0) {
-    // clear signal handlers and masks
-    sigset_t set;
-    sigemptyset(&set);
-    sigprocmask(SIG_SETMASK, &set, NULL);
-
-    // disable core dump as shadow mem is toooooo large
-    struct rlimit limit;
-    limit.rlim_cur = limit.rlim_max = 0;
-    setrlimit(RLIMIT_CORE, &limit);
-
-    close(g_config.pipefds[0]); // close the read fd
-    setenv("TAINT_OPTIONS", (char*)g_config.symsan_env, 1);
-    unsetenv("LD_PRELOAD"); // don't preload anything
-    if (g_config.is_input_sdtin) {
-      close(0);
-      lseek(fd, 0, SEEK_SET);
-      dup2(fd, 0);
-    }
-    if (!g_config.enable_debug) {
-      close(1);
-      close(2);
-      int dev_null_fd = open("/dev/null", O_RDWR);
-      dup2(g_config.dev_null_fd, 1);
-      dup2(g_config.dev_null_fd, 2);
-    }
-    ret = execv(g_config.symsan_bin, g_config.argv);
+  // as for the forkserver
+  if (!s->no_aslr) {
+    s->symsan_pid = spawn_child(s, fd, -1, s->pipefds[0]);
+  } else if ((s->symsan_pid = fork()) == 0) {
+    close(s->pipefds[0]); // close the read fd
+    ret = exec_child(s, fd);
     return ret;
-  } else if (g_config.symsan_pid < 0) {
-    close(g_config.pipefds[0]);
-    close(g_config.pipefds[1]);
-    return g_config.symsan_pid;
   }
+  if (s->symsan_pid < 0) {
+    close(s->pipefds[0]);
+    close(s->pipefds[1]);
+    return s->symsan_pid;
+  }
+  pin_child(s, s->symsan_pid);
 
-  close(g_config.pipefds[1]); // close the write fd
-  g_config.is_killed = 0; // reset kill flag
+  close(s->pipefds[1]); // close the write fd
+  s->is_killed = 0; // reset kill flag
 
+  SYMSAN_PROBE2(run_spawn_end, s->symsan_pid, 0);
   return 0;
 }
 
-__attribute__((visibility("default")))
-ssize_t symsan_read_event(void *buf, size_t size, unsigned int timeout) {
-  if (size == 0) {
-    return 0;
-  }
-
+static int wait_pipe(struct symsan_config *s, unsigned int timeout) {
   int ret = 1;
 
   if (timeout) {
@@ -301,44 +1102,106 @@ ssize_t symsan_read_event(void *buf, size_t size, unsigned int timeout) {
     struct timeval tv;
 
     FD_ZERO(&rfds);
-    FD_SET(g_config.pipefds[0], &rfds);
+    FD_SET(s->pipefds[0], &rfds);
 
     tv.tv_sec = (timeout / 1000);
     tv.tv_usec = (timeout % 1000) * 1000;
 
-    ret = select(g_config.pipefds[0] + 1, &rfds, NULL, NULL, &tv);
+    ret = select(s->pipefds[0] + 1, &rfds, NULL, NULL, &tv);
+  }
+
+  return ret;
+}
+
+// copy from the shm ring, only sleep on the pipe when the ring is empty
+static ssize_t ring_read(struct symsan_config *s, void *buf, size_t size, unsigned int timeout) {
+  struct event_ring *ring = s->event_ring;
+  uint8_t *dst = (uint8_t *)buf;
+  uint64_t mask = ring->size - 1;
+  size_t copied = 0;
+
+  while (copied < size) {
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head != tail) {
+      size_t n = MIN(head - tail, size - copied);
+      size_t off = tail & mask;
+      size_t first = MIN(n, ring->size - off);
+      memcpy(dst + copied, &ring->data[off], first);
+      memcpy(dst + copied + first, &ring->data[0], n - first);
+      __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+      copied += n;
+      continue;
+    }
+
+    if (s->ring_eof) {
+      break;
+    }
+
+    // announce we're going to sleep, then double check
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != tail) {
+      __atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+      continue;
+    }
+
+    if (wait_pipe(s, timeout) <= 0) {
+      // time out or error on select
+      kill(s->symsan_pid, SIGKILL);
+      s->is_killed = 1;
+      return -1;
+    }
+
+    // drain the wakeup bytes, EOF means the target has exited
+    char wakeup[64];
+    if (read(s->pipefds[0], wakeup, sizeof(wakeup)) <= 0) {
+      s->ring_eof = 1;
+    }
+  }
+
+  return copied;
+}
+
+__attribute__((visibility("default")))
+ssize_t symsan_session_read_event(symsan_session_t *s, void *buf, size_t size, unsigned int timeout) {
+  if (size == 0) {
+    return 0;
   }
 
   ssize_t n = -1;
-  if (ret > 0) { // no timeout or select okay
-    n = read(g_config.pipefds[0], buf, size);
+  SYMSAN_PROBE2(read_event_begin, size, timeout);
+  if (s->use_event_ring) {
+    n = ring_read(s, buf, size, timeout);
+  } else if (wait_pipe(s, timeout) > 0) { // no timeout or select okay
+    n = read(s->pipefds[0], buf, size);
   } else {
     // time out or error on select
-    kill(g_config.symsan_pid, SIGKILL);
-    g_config.is_killed = 1;
+    kill(s->symsan_pid, SIGKILL);
+    s->is_killed = 1;
   }
+  SYMSAN_PROBE2(read_event_end, size, n);
 
   if (n != size) {
     // error or EOF
-    waitpid(g_config.symsan_pid, &g_config.exit_status, 0);
-    g_config.symsan_pid = -1;
-    close(g_config.pipefds[0]); // close the read fd
+    wait_child(s);
+    s->symsan_pid = -1;
+    close(s->pipefds[0]); // close the read fd
   }
 
   return n;
 }
 
 __attribute__((visibility("default")))
-int symsan_terminate() {
-  if (g_config.symsan_pid == -1) {
+int symsan_session_terminate(symsan_session_t *s) {
+  if (s->symsan_pid == -1) {
     // already terminated
     return 0;
-  } else if (g_config.symsan_pid > 0) {
-    kill(g_config.symsan_pid, SIGKILL);
-    g_config.is_killed = 1;
-    waitpid(g_config.symsan_pid, &g_config.exit_status, 0);
-    g_config.symsan_pid = -1;
-    close(g_config.pipefds[0]);
+  } else if (s->symsan_pid > 0) {
+    kill(s->symsan_pid, SIGKILL);
+    s->is_killed = 1;
+    wait_child(s);
+    s->symsan_pid = -1;
+    close(s->pipefds[0]);
     return 0;
   } else {
     return -1;
@@ -346,48 +1209,286 @@ int symsan_terminate() {
 }
 
 __attribute__((visibility("default")))
-int symsan_get_exit_status(int *status) {
+int symsan_session_get_exit_status(symsan_session_t *s, int *status) {
   if (!status) {
     return -1;
   }
 
-  *status = g_config.exit_status;
-  return g_config.is_killed;
+  *status = s->exit_status;
+  return s->is_killed;
 }
 
 __attribute__((visibility("default")))
-void symsan_destroy() {
-  symsan_terminate();
+int symsan_session_set_snapshots(symsan_session_t *s, int enable) {
+  if (enable && !s->filter) {
+    return SYMSAN_MISSING_SHM;
+  }
+  if (!!enable == (s->snapshot_fds[0] != -1)) {
+    return 0;
+  }
+  if (enable) {
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s->snapshot_fds) != 0) {
+      s->snapshot_fds[0] = s->snapshot_fds[1] = -1;
+      return SYMSAN_NO_MEMORY;
+    }
+    fcntl(s->snapshot_fds[0], F_SETFL, O_NONBLOCK);
+  } else {
+    drop_snapshot(s);
+    close(s->snapshot_fds[0]);
+    close(s->snapshot_fds[1]);
+    s->snapshot_fds[0] = s->snapshot_fds[1] = -1;
+  }
+  // the socket is in the options the runtime is started with
+  if (s->symsan_env) {
+    free(s->symsan_env);
+    s->symsan_env = NULL;
+    stop_forkserver(s);
+  }
+  return 0;
+}
+
+__attribute__((visibility("default")))
+int symsan_session_mark_snapshot(symsan_session_t *s, uint32_t id) {
+  if (!s->filter || !id) {
+    return SYMSAN_INVALID_ARGS;
+  }
+  return mark_branch(s->filter, id, BRANCH_SNAPSHOT);
+}
+
+__attribute__((visibility("default")))
+int symsan_session_get_snapshot(symsan_session_t *s, uint32_t *id,
+                                uint64_t *consumed, uint64_t *size) {
+  if (s->snapshot_fds[0] == -1) {
+    return -1;
+  }
+  // the latest of the snapshots taken since the last call
+  int fresh = 0;
+  while (1) {
+    struct snapshot_msg hello;
+    struct iovec iov = { &hello, sizeof(hello) };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(s->snapshot_fds[0], &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) !=
+        sizeof(hello)) {
+      break;
+    }
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (!c || c->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    drop_snapshot(s);
+    memcpy(&s->snapshot_ctl, CMSG_DATA(c), sizeof(int));
+    s->snapshot = hello;
+    fresh = 1;
+  }
+  if (s->snapshot_ctl == -1) {
+    return -1;
+  }
+  if (id) *id = s->snapshot.id;
+  if (consumed) *consumed = s->snapshot.consumed;
+  if (size) *size = s->snapshot.size;
+  return fresh;
+}
 
-  if (g_config.dev_null_fd != -1) {
-    close(g_config.dev_null_fd);
+__attribute__((visibility("default")))
+int symsan_session_resume(symsan_session_t *s, int fd) {
+  if (fd < 0) {
+    return SYMSAN_INVALID_ARGS;
+  }
+  if (s->snapshot_ctl == -1) {
+    return -1;
   }
 
-  if (g_config.shm_fd != -1) {
-    close(g_config.shm_fd);
+  if (s->use_event_ring) {
+    s->event_ring->head = 0;
+    s->event_ring->tail = 0;
+    s->event_ring->waiting = 0;
+    s->ring_eof = 0;
   }
 
-  if (g_config.shm_name) {
-    shm_unlink(g_config.shm_name);
-    free(g_config.shm_name);
+  if (s->memcmp_blob) {
+    s->blob_area->used = 0;
   }
 
-  if (g_config.input_file) {
-    free(g_config.input_file);
+  // the labels of the snapshot are put back by the resumed child, so the
+  // union table isn't reclaimed
+  int ret = fork_request(s, s->snapshot_ctl, fd, 2);
+  if (ret == -1) {
+    drop_snapshot(s);
+    return ret;
+  }
+  s->from_snapshot = ret == 0;
+  return ret;
+}
+
+__attribute__((visibility("default")))
+void symsan_session_drop_snapshot(symsan_session_t *s) {
+  drop_snapshot(s);
+}
+
+__attribute__((visibility("default")))
+void symsan_session_destroy(symsan_session_t *s) {
+  symsan_session_terminate(s);
+  stop_forkserver(s);
+  symsan_session_set_snapshots(s, 0);
+
+  if (s->dev_null_fd != -1) {
+    close(s->dev_null_fd);
   }
 
-  if (g_config.argv) {
-    for (int i = 0; g_config.argv[i]; i++) {
-      free(g_config.argv[i]);
+  if (s->label_info) {
+    munmap(s->label_info, s->uniontable_size);
+  }
+
+  if (s->event_ring) {
+    munmap(s->event_ring, EVENT_RING_SIZE);
+  }
+
+  if (s->blob_area) {
+    munmap(s->blob_area, BLOB_AREA_SIZE);
+  }
+
+  if (s->filter) {
+    munmap(s->filter, BRANCH_FILTER_SIZE);
+  }
+
+  if (s->shm_fd != -1) {
+    close(s->shm_fd);
+  }
+
+  if (s->shm_name) {
+    shm_unlink(s->shm_name);
+    free(s->shm_name);
+  }
+
+  if (s->input_file) {
+    free(s->input_file);
+  }
+
+  if (s->taint_ranges) {
+    free(s->taint_ranges);
+  }
+
+  if (s->taint_inputs) {
+    free(s->taint_inputs);
+  }
+
+  if (s->symbolize_pcs) {
+    free(s->symbolize_pcs);
+  }
+
+  if (s->argv) {
+    for (int i = 0; s->argv[i]; i++) {
+      free(s->argv[i]);
     }
-    free(g_config.argv);
+    free(s->argv);
+  }
+
+  if (s->symsan_env) {
+    free(s->symsan_env);
   }
 
-  if (g_config.symsan_env) {
-    free(g_config.symsan_env);
+  if (s->symsan_bin) {
+    free(s->symsan_bin);
   }
 
-  if (g_config.symsan_bin) {
-    free(g_config.symsan_bin);
+  free(s);
+}
+
+__attribute__((visibility("default")))
+void* symsan_session_union_table(symsan_session_t *s) {
+  return s->label_info;
+}
+
+__attribute__((visibility("default")))
+size_t symsan_session_shm_bytes(symsan_session_t *s) {
+  struct stat st;
+  // the pages of a shm object are charged as they're touched, on any side
+  if (s->shm_fd == -1 || fstat(s->shm_fd, &st) != 0) {
+    return 0;
+  }
+  return (size_t)st.st_blocks * 512;
+}
+
+// the single session API, on g_default
+
+__attribute__((visibility("default")))
+void* symsan_init(const char *symsan_bin, const size_t uniontable_size) {
+  if (g_default) {
+    symsan_session_destroy(g_default);
+  }
+  g_default = symsan_session_new(symsan_bin, uniontable_size);
+  if (!g_default) {
+    return (void *)-1;
+  }
+  return g_default->label_info;
+}
+
+#define DEFAULT_SESSION(ret, name, params, args, err) \
+  __attribute__((visibility("default"))) \
+  ret symsan_##name params { \
+    if (!g_default) return err; \
+    return symsan_session_##name args; \
+  }
+
+DEFAULT_SESSION(int, set_input, (const char *input), (g_default, input), 1)
+DEFAULT_SESSION(int, set_args, (const int argc, char* const argv[]), (g_default, argc, argv), 1)
+DEFAULT_SESSION(int, set_debug, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_bounds_check, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_exit_on_memerror, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_trace_file_size, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_force_stdin, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_event_ring, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_memcmp_blob, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(const void*, get_blob, (uint64_t offset, size_t size), (g_default, offset, size), NULL)
+DEFAULT_SESSION(int, set_branch_filter, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, mark_covered, (uint32_t id, int direction), (g_default, id, direction), 1)
+DEFAULT_SESSION(int, set_snapshots, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, mark_snapshot, (uint32_t id), (g_default, id), 1)
+DEFAULT_SESSION(int, get_snapshot, (uint32_t *id, uint64_t *consumed, uint64_t *size), (g_default, id, consumed, size), -1)
+DEFAULT_SESSION(int, resume, (int fd), (g_default, fd), 3)
+DEFAULT_SESSION(int, set_forkserver, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_persistent, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_persistent_gc, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_lazy_mmap_taint, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_summarize_sums, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_taint_ranges, (const char *ranges), (g_default, ranges), 1)
+DEFAULT_SESSION(int, set_taint_inputs, (const char *files), (g_default, files), 1)
+DEFAULT_SESSION(int, set_taint_argv, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_taint_env, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_max_ast_size, (size_t size), (g_default, size), 1)
+DEFAULT_SESSION(int, set_no_aslr, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_huge_pages, (int enable), (g_default, enable), 1)
+DEFAULT_SESSION(int, set_prefault, (size_t mb), (g_default, mb), 1)
+DEFAULT_SESSION(int, set_affinity, (int cpu), (g_default, cpu), 1)
+DEFAULT_SESSION(int, set_numa_node, (int node), (g_default, node), 1)
+DEFAULT_SESSION(int, run, (int fd), (g_default, fd), 3)
+DEFAULT_SESSION(ssize_t, read_event, (void *buf, size_t size, unsigned int timeout), (g_default, buf, size, timeout), -1)
+DEFAULT_SESSION(int, terminate, (), (g_default), -1)
+DEFAULT_SESSION(int, get_exit_status, (int *status), (g_default, status), -1)
+DEFAULT_SESSION(size_t, shm_bytes, (), (g_default), 0)
+
+#undef DEFAULT_SESSION
+
+__attribute__((visibility("default")))
+void symsan_set_site_limit(uint32_t limit) {
+  if (g_default) symsan_session_set_site_limit(g_default, limit);
+}
+
+__attribute__((visibility("default")))
+void symsan_drop_snapshot() {
+  if (g_default) symsan_session_drop_snapshot(g_default);
+}
+
+__attribute__((visibility("default")))
+void symsan_destroy() {
+  if (g_default) {
+    symsan_session_destroy(g_default);
+    g_default = NULL;
   }
 }
@@ -0,0 +1,329 @@
+// A worker that parses and solves the traces the AFL++ mutators ship to a
+// spool directory with SYMSAN_REMOTE_DIR, on any host that sees the
+// directory, e.g., over NFS; as many of them as there are cores to spare,
+// each claims the traces one at a time (see trace_blob.h):
+//
+//   $ symsan-worker [-s i2s,jit,z3] [-m solutions] [-u table_size] [-1] dir
+//
+// Each trace is parsed as the mutator would have, with the labels shipped
+// put back at their ids, and its tasks are handed to the solvers in order
+// until one finds a solution or says there's none, as the mutator's solver
+// threads do. The solutions go back as patches of the trace's input, the
+// mutator applies them to its copy of the seed. With -1 it exits once
+// there are no traces left, instead of waiting for more.
+//
+// With -a, it solves the traces of an archive the mutators kept with
+// SYMSAN_TRACE_ARCHIVE instead, once each, in the order they were kept
+// (see trace_archive.h), writing the solutions to the directory given, as
+// the seeds' names with the number of the solution:
+//
+//   $ symsan-worker -a traces.arc [-s i2s,jit,z3] out_dir
+
+#include "dfsan/dfsan.h"
+
+#include "ast.h"
+#include "task.h"
+#include "solver.h"
+#include "parse-rgd.h"
+#include "trace_blob.h"
+#include "trace_archive.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+using namespace __dfsan;
+
+static dfsan_label_info *__dfsan_label_info;
+static dfsan_label_operands *__dfsan_label_operands;
+static size_t UnionTableSize = uniontable_size;
+static size_t MAX_LABEL = uniontable_size /
+    (sizeof(dfsan_label_info) + sizeof(dfsan_label_operands));
+
+dfsan_label_info* __dfsan::get_label_info(dfsan_label label) {
+  if (label >= MAX_LABEL) {
+    throw std::out_of_range("label too large " + std::to_string(label));
+  }
+  return &__dfsan_label_info[label];
+}
+
+dfsan_label_operands* __dfsan::get_label_operands(dfsan_label label) {
+  if (label >= MAX_LABEL) {
+    throw std::out_of_range("label too large " + std::to_string(label));
+  }
+  return &__dfsan_label_operands[label];
+}
+
+// the solvers by the names of the mutator's python list
+static std::shared_ptr<rgd::Solver> make_solver(std::string const& name) {
+  if (name == "i2s") return std::make_shared<rgd::I2SSolver>();
+  if (name == "memcmp") return std::make_shared<rgd::MemcmpSolver>();
+  if (name == "inverse") return std::make_shared<rgd::InverseSolver>();
+  if (name == "linear") return std::make_shared<rgd::LinearSolver>();
+  if (name == "jit") return std::make_shared<rgd::JITSolver>();
+  if (name == "z3") return std::make_shared<rgd::Z3Solver>();
+  return nullptr;
+}
+
+struct worker_t {
+  rgd::TraceSpool spool;
+  std::vector<std::shared_ptr<rgd::Solver>> solvers;
+  // one parser for each of the mutators' nested solving settings
+  std::unique_ptr<rgd::RGDAstParser> parsers[2];
+  size_t max_solutions = 1;
+  bool verbose = false;
+  uint64_t traces = 0;
+  uint64_t tasks = 0;
+  uint64_t solutions = 0;
+};
+
+// the tasks of the events of the trace, as the mutator would have queued
+static void parse_trace(rgd::RGDAstParser &parser, rgd::TraceBlob const& blob,
+                        std::vector<std::shared_ptr<rgd::SearchTask>> &tasks) {
+  std::vector<symsan::input_t> inputs;
+  inputs.push_back({blob.input().data(), blob.input().size()});
+  parser.restart(inputs);
+  rgd::TraceBlob::event_t ev;
+  std::vector<uint64_t> ids;
+  std::vector<std::pair<uint32_t, uint64_t>> targets;
+  size_t pos = 0;
+  while (blob.next_event(pos, ev)) {
+    ids.clear();
+    targets.clear();
+    int ret = 0;
+    switch (ev.kind) {
+      case rgd::TraceBlob::Cond:
+        ret = parser.parse_cond(ev.label, ev.result, ev.add_nested, ids);
+        break;
+      case rgd::TraceBlob::Switch:
+        ret = parser.parse_switch(ev.label, ev.value, ev.cases, ev.targets,
+                                  ev.taken_label, targets);
+        for (auto const& t : targets) ids.push_back(t.second);
+        break;
+      case rgd::TraceBlob::Gep:
+        ret = parser.parse_gep(ev.ptr_label, ev.ptr, ev.label, (int64_t)ev.value,
+                               ev.num_elems, ev.elem_size, ev.current_offset,
+                               false, ids);
+        break;
+      case rgd::TraceBlob::Memcmp:
+        // the content lives in the blob, which outlives the parse
+        parser.record_memcmp_ref(ev.label, ev.content);
+        break;
+    }
+    if (ret != 0) {
+      fprintf(stderr, "Failed to parse label %u\n", ev.label);
+      continue;
+    }
+    for (auto id : ids) {
+      if (auto task = parser.retrieve_task(id)) tasks.push_back(task);
+    }
+  }
+}
+
+// the patches of the input of the trace in bytes, which blob decodes into
+static void solve_blob(worker_t &w, std::string const& name,
+                       std::vector<uint8_t> const& bytes, rgd::TraceBlob &blob,
+                       std::vector<rgd::patch_t> &patches) {
+  std::vector<dfsan_label> written;
+  if (!blob.decode(bytes.data(), bytes.size(), __dfsan_label_info,
+                   __dfsan_label_operands, MAX_LABEL, written)) {
+    fprintf(stderr, "Invalid trace %s\n", name.c_str());
+  } else if (!blob.input().empty()) {
+    bool nested = blob.flags() & rgd::TraceBlob::kNested;
+    auto &parser = w.parsers[nested];
+    if (!parser) {
+      parser.reset(new rgd::RGDAstParser(__dfsan_label_info, UnionTableSize,
+                                         nested));
+    }
+    std::vector<std::shared_ptr<rgd::SearchTask>> tasks;
+    parse_trace(*parser, blob, tasks);
+    for (auto &solver : w.solvers) {
+      solver->prepare(tasks);
+    }
+    const uint8_t *in_buf = blob.input().data();
+    size_t in_size = blob.input().size();
+    rgd::patch_t patch;
+    for (auto &task : tasks) {
+      for (auto &solver : w.solvers) {
+        patch.clear();
+        auto ret = solver->solve(task, in_buf, in_size, patch);
+        if (ret == rgd::SOLVER_SAT) {
+          patches.push_back(std::move(patch));
+          if (w.max_solutions > 1 && !task->skip_next) {
+            solver->solve_more(task, in_buf, in_size, w.max_solutions - 1,
+                               patches);
+          }
+          break;
+        } else if (ret == rgd::SOLVER_UNSAT) {
+          task->skip_next = true;
+          break;
+        }
+      }
+    }
+    w.tasks += tasks.size();
+    if (w.verbose) {
+      fprintf(stderr, "%s: %zu labels, %zu tasks, %zu solutions\n",
+              name.c_str(), written.size(), tasks.size(), patches.size());
+    }
+  }
+  // the labels of the next trace go into a clean table
+  for (auto l : written) {
+    memset(&__dfsan_label_info[l], 0, sizeof(dfsan_label_info));
+    memset(&__dfsan_label_operands[l], 0, sizeof(dfsan_label_operands));
+  }
+  w.traces += 1;
+  w.solutions += patches.size();
+}
+
+static void solve_trace(worker_t &w, std::string const& name) {
+  std::vector<uint8_t> bytes;
+  std::vector<rgd::patch_t> patches;
+  rgd::TraceBlob blob;
+  if (w.spool.read("claimed", name, bytes)) {
+    solve_blob(w, name, bytes, blob, patches);
+  } else {
+    fprintf(stderr, "Invalid trace %s\n", name.c_str());
+  }
+  // an empty answer too, so the mutator lets go of the seed
+  rgd::TraceBlob::encode_patches(bytes, patches);
+  if (!w.spool.publish("patches", name, bytes)) {
+    fprintf(stderr, "Failed to write the patches of %s: %s\n", name.c_str(),
+            strerror(errno));
+  }
+  w.spool.remove("claimed", name);
+}
+
+// the traces of the archive at path, with their solutions written to
+// out_dir; false if it can't be read
+static bool solve_archive(worker_t &w, const char *path, const char *out_dir) {
+  rgd::TraceArchive::Reader reader;
+  if (!reader.open(path)) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  std::string name;
+  std::vector<uint8_t> bytes, out;
+  std::vector<rgd::patch_t> patches;
+  rgd::TraceBlob blob;
+  size_t num_read = 0;
+  while (reader.next(name, bytes)) {
+    num_read += 1;
+    patches.clear();
+    solve_blob(w, name, bytes, blob, patches);
+    // the seeds are named by their paths in the queue
+    size_t slash = name.rfind('/');
+    std::string base = slash == std::string::npos ? name : name.substr(slash + 1);
+    auto const& input = blob.input();
+    for (size_t i = 0; i < patches.size(); i++) {
+      out.resize(patches[i].size(input.size()));
+      patches[i].write(input.data(), input.size(), out.data());
+      std::string out_path = std::string(out_dir) + "/" + base + "-" +
+                             std::to_string(i);
+      int fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0 || write(fd, out.data(), out.size()) != (ssize_t)out.size()) {
+        fprintf(stderr, "Failed to write %s: %s\n", out_path.c_str(),
+                strerror(errno));
+      }
+      if (fd >= 0) close(fd);
+    }
+  }
+  if (reader.size() > num_read) {
+    fprintf(stderr, "%zu traces of %s didn't decode\n",
+            reader.size() - num_read, path);
+  }
+  return true;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-s i2s,memcmp,inverse,linear,jit,z3] [-m solutions] "
+          "[-u table_size] [-p poll_ms] [-1] [-v] [-a archive] dir\n", prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  worker_t w;
+  std::string solver_list = "i2s,jit";
+  unsigned poll_ms = 100;
+  bool once = false;
+  const char *archive = nullptr;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:m:u:p:1va:")) != -1) {
+    switch (opt) {
+      case 's': solver_list = optarg; break;
+      case 'm': w.max_solutions = strtoul(optarg, nullptr, 0); break;
+      case 'u': UnionTableSize = strtoull(optarg, nullptr, 0); break;
+      case 'p': poll_ms = strtoul(optarg, nullptr, 0); break;
+      case '1': once = true; break;
+      case 'v': w.verbose = true; break;
+      case 'a': archive = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind + 1 != argc || w.max_solutions < 1) usage(argv[0]);
+
+  size_t pos = 0;
+  while (pos <= solver_list.size()) {
+    size_t comma = solver_list.find(',', pos);
+    if (comma == std::string::npos) comma = solver_list.size();
+    std::string name = solver_list.substr(pos, comma - pos);
+    pos = comma + 1;
+    if (name.empty()) continue;
+    auto solver = make_solver(name);
+    if (!solver) {
+      fprintf(stderr, "Unknown solver %s\n", name.c_str());
+      return 1;
+    }
+    w.solvers.push_back(solver);
+  }
+
+  if (!archive && !w.spool.open(argv[optind])) {
+    fprintf(stderr, "Failed to open %s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+  // as large as the mutators' union table, the labels keep their ids
+  void *table = mmap(nullptr, UnionTableSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (table == MAP_FAILED) {
+    fprintf(stderr, "Failed to map the union table: %s\n", strerror(errno));
+    return 1;
+  }
+  MAX_LABEL = UnionTableSize /
+      (sizeof(dfsan_label_info) + sizeof(dfsan_label_operands));
+  __dfsan_label_info = (dfsan_label_info *)table;
+  __dfsan_label_operands = get_label_operands_base(table, UnionTableSize);
+
+  while (!archive) {
+    auto names = w.spool.list("traces", "");
+    if (names.empty()) {
+      if (once) break;
+      usleep(poll_ms * 1000);
+      continue;
+    }
+    for (auto const& name : names) {
+      // another worker may have got it first
+      if (w.spool.claim(name)) solve_trace(w, name);
+    }
+  }
+
+  if (archive && !solve_archive(w, archive, argv[optind])) return 1;
+
+  printf("traces %lu, tasks %lu, solutions %lu\n", w.traces, w.tasks,
+         w.solutions);
+  fflush(stdout);
+  for (auto &solver : w.solvers) {
+    solver->write_stats(fileno(stdout));
+  }
+  munmap(table, UnionTableSize);
+  return 0;
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+namespace rgd {
+
+// bump allocator for the ASTs and constraints built from one seed, memory
+// is never handed back individually but all at once when the arena goes
+// away, which is after the last container allocated from it is gone (see
+// ArenaAllocator), so tasks queued from an old seed stay valid
+class AstArena {
+public:
+  AstArena() : chunk_size_(kMinChunkSize), cur_(nullptr), left_(0), bytes_(0) {}
+  AstArena(const AstArena&) = delete;
+  AstArena& operator=(const AstArena&) = delete;
+
+  void* allocate(size_t bytes, size_t align) {
+    size_t pad = (-(uintptr_t)cur_) & (align - 1);
+    if (pad + bytes > left_) {
+      refill(bytes + align);
+      pad = (-(uintptr_t)cur_) & (align - 1);
+    }
+    char *p = cur_ + pad;
+    cur_ = p + bytes;
+    left_ -= pad + bytes;
+    return p;
+  }
+
+  // the bytes of the chunks allocated so far
+  size_t bytes() const { return bytes_; }
+
+private:
+  static const size_t kMinChunkSize = 64 << 10;
+  static const size_t kMaxChunkSize = 4 << 20;
+
+  void refill(size_t min_size) {
+    size_t size = std::max(chunk_size_, min_size);
+    chunks_.emplace_back(new char[size]);
+    bytes_ += size;
+    cur_ = chunks_.back().get();
+    left_ = size;
+    // seeds with long traces get fewer, larger chunks
+    if (chunk_size_ < kMaxChunkSize) chunk_size_ *= 2;
+  }
+
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  size_t chunk_size_;
+  char *cur_;
+  size_t left_;
+  size_t bytes_;
+};
+
+// std allocator over an AstArena, each copy keeps the arena alive; without
+// an arena it falls back to the heap
+template <class T>
+class ArenaAllocator {
+public:
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  ArenaAllocator() noexcept = default;
+  ArenaAllocator(std::shared_ptr<AstArena> arena) noexcept : arena_(std::move(arena)) {}
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U> &other) noexcept : arena_(other.arena()) {}
+
+  T* allocate(size_t n) {
+    if (!arena_) return std::allocator<T>().allocate(n);
+    return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *p, size_t n) noexcept {
+    if (!arena_) std::allocator<T>().deallocate(p, n);
+  }
+
+  const std::shared_ptr<AstArena>& arena() const { return arena_; }
+
+  template <class U>
+  bool operator==(const ArenaAllocator<U> &other) const { return arena_ == other.arena(); }
+  template <class U>
+  bool operator!=(const ArenaAllocator<U> &other) const { return arena_ != other.arena(); }
+
+private:
+  std::shared_ptr<AstArena> arena_;
+};
+
+// map over a sorted vector, for the small per-constraint tables, which are
+// mostly filled in key order and then only looked up or walked in order
+template <class K, class V, class Alloc = std::allocator<std::pair<K, V>>>
+class flat_map {
+public:
+  using value_type = std::pair<K, V>;
+  using storage_t = std::vector<value_type, Alloc>;
+  using iterator = typename storage_t::iterator;
+  using const_iterator = typename storage_t::const_iterator;
+
+  flat_map() = default;
+  explicit flat_map(const Alloc &alloc) : data_(alloc) {}
+
+  iterator begin() { return data_.begin(); }
+  iterator end() { return data_.end(); }
+  const_iterator begin() const { return data_.begin(); }
+  const_iterator end() const { return data_.end(); }
+  size_t size() const { return data_.size(); }
+  bool empty() const { return data_.empty(); }
+  void clear() { data_.clear(); }
+
+  iterator find(const K &key) {
+    auto itr = lower_bound(key);
+    return (itr != data_.end() && itr->first == key) ? itr : data_.end();
+  }
+  const_iterator find(const K &key) const {
+    auto itr = lower_bound(key);
+    return (itr != data_.end() && itr->first == key) ? itr : data_.end();
+  }
+  size_t count(const K &key) const { return find(key) != end(); }
+  bool operator==(const flat_map &other) const { return data_ == other.data_; }
+  Alloc get_allocator() const { return data_.get_allocator(); }
+
+  V& at(const K &key) {
+    auto itr = find(key);
+    if (itr == data_.end()) throw std::out_of_range("flat_map::at");
+    return itr->second;
+  }
+  const V& at(const K &key) const {
+    auto itr = find(key);
+    if (itr == data_.end()) throw std::out_of_range("flat_map::at");
+    return itr->second;
+  }
+
+  std::pair<iterator, bool> insert(const value_type &kv) {
+    auto itr = lower_bound(kv.first);
+    if (itr != data_.end() && itr->first == kv.first) return {itr, false};
+    return {data_.insert(itr, kv), true};
+  }
+  V& operator[](const K &key) {
+    return insert(value_type(key, V())).first->second;
+  }
+
+private:
+  iterator lower_bound(const K &key) {
+    // appending in key order is the common case
+    if (data_.empty() || data_.back().first < key) return data_.end();
+    return std::lower_bound(data_.begin(), data_.end(), key,
+        [](const value_type &kv, const K &k) { return kv.first < k; });
+  }
+  const_iterator lower_bound(const K &key) const {
+    if (data_.empty() || data_.back().first < key) return data_.end();
+    return std::lower_bound(data_.begin(), data_.end(), key,
+        [](const value_type &kv, const K &k) { return kv.first < k; });
+  }
+
+  storage_t data_;
+};
+
+}
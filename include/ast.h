@@ -1,10 +1,15 @@
 #pragma once
 
 #include <stdint.h>
+#include <mutex>
+#include <new>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "arena.h"
+
 namespace rgd {
   enum AstKind {
     Bool, // 0
@@ -142,17 +147,30 @@ namespace rgd {
   }
 
   class AstNode {
+    using node_alloc_t = ArenaAllocator<AstNode>;
+    using nodes_t = std::vector<AstNode, node_alloc_t>;
+    using nodes_alloc_t = ArenaAllocator<nodes_t>;
   public:
-    AstNode(size_t size=32) : child0_(0), child1_(0), kind_(0), bits_(0), index_(0),
+    // the nodes of a root come from arena if given, the heap otherwise
+    AstNode(size_t size=32, const std::shared_ptr<AstArena> &arena=nullptr)
+      : child0_(0), child1_(0), kind_(0), bits_(0), index_(0),
       boolvalue_(0), is_root_(1), label_(0), hash_(0) {
-      root_ = new std::vector<AstNode>(); // only allocate if is root
+      nodes_alloc_t alloc(arena);
+      root_ = alloc.allocate(1); // only allocate if is root
+      new (root_) nodes_t(node_alloc_t(arena));
       root_->reserve(size + 1); // default capacity, +1 for dummy root
       root_->emplace_back(AstNode(root_)); // add a dummy root
     }
-    AstNode(std::vector<AstNode> *r) : root_(r), child0_(0), child1_(0),
+    AstNode(nodes_t *r) : root_(r), child0_(0), child1_(0),
       kind_(0), bits_(0), index_(0), boolvalue_(0), is_root_(0), label_(0),
       hash_(0) {} // don't allocate if not root
-    ~AstNode() { if (is_root_) delete root_; }
+    ~AstNode() {
+      if (is_root_) {
+        nodes_alloc_t alloc(root_->get_allocator());
+        root_->~nodes_t();
+        alloc.deallocate(root_, 1);
+      }
+    }
 
     inline void CopyFrom(const AstNode& other) {
       if (this->root_ == other.root_) {
@@ -215,7 +233,7 @@ namespace rgd {
     inline uint32_t hash() const { return hash_; }
     inline void set_hash(uint32_t hash) { hash_ = hash; }
   private:
-    std::vector<AstNode> *root_; // root of the AST
+    nodes_t *root_; // root of the AST
     uint32_t child0_;
     uint32_t child1_;
     uint16_t kind_;
@@ -288,6 +306,13 @@ namespace rgd {
     return isEqualAstRecursive(lhs, rhs);
   }
 
+  // a root whose control block and nodes all live in arena (or the heap
+  // if there is none), the arena is kept alive as long as the root is
+  static inline std::shared_ptr<AstNode> make_ast(const std::shared_ptr<AstArena> &arena,
+                                                  size_t size = 32) {
+    return std::allocate_shared<AstNode>(ArenaAllocator<AstNode>(arena), size, arena);
+  }
+
   static inline uint32_t xxhash(uint32_t h1, uint32_t h2, uint32_t h3) {
     const uint32_t PRIME32_1 = 2654435761U;
     const uint32_t PRIME32_2 = 2246822519U;
@@ -314,6 +339,55 @@ namespace rgd {
     return h32;
   }
 
+  // hash-consing of AST shapes: subtrees that isEqualAst considers equal
+  // get the same id, so two ASTs can be matched (e.g., in the JIT cache)
+  // by comparing one integer instead of walking both trees, and nothing
+  // has to keep the trees alive; 0 is never handed out
+  class AstShapes {
+  public:
+    static AstShapes& global() {
+      static AstShapes shapes;
+      return shapes;
+    }
+
+    uint32_t intern(const AstNode &node) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return intern_locked(node);
+    }
+
+  private:
+    struct shape_t {
+      uint32_t kind_bits;
+      uint32_t hash;
+      uint32_t child0;
+      uint32_t child1;
+      bool operator==(const shape_t &other) const {
+        return kind_bits == other.kind_bits && hash == other.hash &&
+               child0 == other.child0 && child1 == other.child1;
+      }
+    };
+    struct shape_hash {
+      size_t operator()(const shape_t &s) const {
+        return ((uint64_t)xxhash(s.kind_bits, s.hash, s.child0) << 32) | s.child1;
+      }
+    };
+
+    uint32_t intern_locked(const AstNode &node) {
+      shape_t shape;
+      // same as isEqualAst, relational operators don't tell shapes apart
+      uint32_t kind = isRelationalKind(node.kind()) ? Bool : node.kind();
+      shape.kind_bits = (kind << 16) | node.bits();
+      shape.hash = node.hash();
+      shape.child0 = node.children_size() > 0 ? intern_locked(node.children(0)) : 0;
+      shape.child1 = node.children_size() > 1 ? intern_locked(node.children(1)) : 0;
+      auto itr = ids_.emplace(shape, ids_.size() + 1);
+      return itr.first->second;
+    }
+
+    std::mutex mutex_;
+    std::unordered_map<shape_t, uint32_t, shape_hash> ids_;
+  };
+
   static inline void buf_to_hex_string(const uint8_t *buf, unsigned length,
                                        std::string &str) {
     const char hex_table[16] = {
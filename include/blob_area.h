@@ -0,0 +1,23 @@
+#ifndef SYMSAN_BLOB_AREA_H
+#define SYMSAN_BLOB_AREA_H
+
+#include <stdint.h>
+
+/// Append-only area for concrete buffers referenced by events (e.g., the
+/// constant operand of a memcmp), so they are not copied through the event
+/// stream. It lives in the union table shm, right after the event ring.
+/// The producer stores each distinct content once and refers to it by its
+/// offset into data, the consumer resets it before each run.
+
+#define BLOB_AREA_DATA_SIZE (1UL << 24)
+
+struct blob_area {
+  uint64_t used;      // bytes allocated, updated by the producer
+  uint64_t size;      // size of data
+  char pad[48];
+  uint8_t data[];
+};
+
+#define BLOB_AREA_SIZE (sizeof(struct blob_area) + BLOB_AREA_DATA_SIZE)
+
+#endif /* !SYMSAN_BLOB_AREA_H */
@@ -0,0 +1,44 @@
+#ifndef SYMSAN_BRANCH_FILTER_H
+#define SYMSAN_BRANCH_FILTER_H
+
+#include <stdint.h>
+
+/// Filter applied by the runtime before sending a cond event, so the events
+/// the consumer would throw away anyway don't go through the event stream.
+/// It lives in the union table shm, right after the blob area, and is only
+/// written by the consumer:
+/// - site_limit bounds the events sent per (branch id, context, direction)
+///   in a run, the consumer's own per-id limit keeps working on top of it;
+/// - the covered table holds the branch ids with directions the consumer
+///   has covered already, a cond whose other direction is covered is not
+///   sent. Ids are only added, with linear probing over the slots, an id
+///   of 0 marks an empty slot;
+/// - a slot of the table may also be marked BRANCH_SNAPSHOT, the runtime
+///   then takes a snapshot at the first cond on that id, see snapshot.h.
+
+#define BRANCH_FILTER_SLOTS (1UL << 18)
+
+#define BRANCH_COVERED_FALSE 1
+#define BRANCH_COVERED_TRUE 2
+#define BRANCH_SNAPSHOT 4
+
+struct branch_filter_slot {
+  uint32_t id;        // written last, with release
+  uint32_t covered;   // BRANCH_COVERED_* and BRANCH_SNAPSHOT bits, only
+                      // ever set
+};
+
+struct branch_filter {
+  uint32_t site_limit;  // 0 for no limit
+  uint32_t num_ids;     // slots in use
+  char pad[56];
+  struct branch_filter_slot slots[BRANCH_FILTER_SLOTS];
+};
+
+#define BRANCH_FILTER_SIZE (sizeof(struct branch_filter))
+
+static inline uint32_t branch_filter_hash(uint32_t id) {
+  return (id * 0x9e3779b1U) >> (32 - 18);
+}
+
+#endif /* !SYMSAN_BRANCH_FILTER_H */
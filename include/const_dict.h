@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <memory>
+
+namespace rgd {
+
+// The constants the branches of a campaign compare input against: the
+// constant operands of the comparisons, as little-endian bytes of their
+// width, and the memcmp targets. A fixed size open addressing set that the
+// parser adds to and the searches read from other threads without a lock;
+// once full, new tokens are dropped. Tokens are never removed, and are
+// also kept in the order they came in, so they can be picked at random or
+// exported from where the last export stopped.
+class ConstDict {
+public:
+  static const size_t kMaxLen = 32; // AFL++'s MAX_AUTO_EXTRA
+  static const size_t kDefaultCapacity = 1 << 16;
+
+  explicit ConstDict(size_t capacity = kDefaultCapacity) {
+    capacity_ = 1;
+    while (capacity_ < capacity * 2) capacity_ <<= 1;
+    slots_.reset(new slot_t[capacity_]);
+    order_.reset(new std::atomic<uint32_t>[capacity]);
+    for (size_t i = 0; i < capacity; i++) order_[i].store(0, std::memory_order_relaxed);
+    max_tokens_ = capacity;
+  }
+
+  // whether the token is new; an all zero one says little and is skipped
+  bool add(const uint8_t *buf, size_t len) {
+    if (len == 0 || len > kMaxLen) return false;
+    bool zero = true;
+    for (size_t i = 0; i < len && zero; i++) zero = buf[i] == 0;
+    if (zero) return false;
+    uint64_t tag = hash(buf, len);
+    size_t mask = capacity_ - 1;
+    for (size_t i = tag & mask, n = 0; n < capacity_; i = (i + 1) & mask, n++) {
+      slot_t &s = slots_[i];
+      uint64_t cur = s.tag.load(std::memory_order_acquire);
+      if (cur == kEmpty) {
+        if (size_.load(std::memory_order_relaxed) >= max_tokens_) return false;
+        if (s.tag.compare_exchange_strong(cur, kBusy, std::memory_order_acquire)) {
+          memcpy(s.bytes, buf, len);
+          s.len = (uint8_t)len;
+          s.tag.store(tag, std::memory_order_release);
+          size_t idx = size_.fetch_add(1, std::memory_order_relaxed);
+          if (idx < max_tokens_) order_[idx].store(i + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      while (cur == kBusy) cur = s.tag.load(std::memory_order_acquire);
+      if (cur == tag && s.len == len && !memcmp(s.bytes, buf, len)) return false;
+    }
+    return false;
+  }
+
+  // an integer constant of width bytes
+  bool add_value(uint64_t value, size_t width) {
+    uint8_t buf[8];
+    if (width == 0 || width > 8) return false;
+    for (size_t i = 0; i < width; i++) buf[i] = (uint8_t)(value >> (8 * i));
+    return add(buf, width);
+  }
+
+  size_t size() const {
+    size_t n = size_.load(std::memory_order_relaxed);
+    return n < max_tokens_ ? n : max_tokens_;
+  }
+
+  // the token added as the i-th one, false if it isn't all there yet
+  bool get(size_t i, const uint8_t *&buf, size_t &len) const {
+    if (i >= size()) return false;
+    uint32_t slot = order_[i].load(std::memory_order_acquire);
+    if (slot == 0) return false;
+    const slot_t &s = slots_[slot - 1];
+    buf = s.bytes;
+    len = s.len;
+    return true;
+  }
+
+private:
+  static const uint64_t kEmpty = 0;
+  static const uint64_t kBusy = 1;
+
+  static uint64_t hash(const uint8_t *buf, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ len; // FNV-1a
+    for (size_t i = 0; i < len; i++) h = (h ^ buf[i]) * 0x100000001b3ULL;
+    return h > kBusy ? h : h + 2;
+  }
+
+  struct slot_t {
+    std::atomic<uint64_t> tag{kEmpty};
+    uint8_t len = 0;
+    uint8_t bytes[kMaxLen];
+  };
+
+  size_t capacity_;
+  size_t max_tokens_;
+  std::unique_ptr<slot_t[]> slots_;
+  std::unique_ptr<std::atomic<uint32_t>[]> order_;
+  std::atomic<size_t> size_{0};
+};
+
+};  // namespace rgd
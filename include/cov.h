@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <algorithm>
+#include <deque>
 #include <vector>
 #include <unordered_map>
 #include <memory>
@@ -9,23 +11,28 @@
 namespace rgd {
 
 struct BranchContext {
+  virtual ~BranchContext() {}
   void *addr;
   bool direction;
+  // the seen flag of the interned context, nullptr if it isn't one
+  const bool *seen = nullptr;
 };
 
-struct HybridBranchContext : public BranchContext {
+// the finer contexts share the BranchContext, so a FullBranchContext is
+// still one
+struct HybridBranchContext : public virtual BranchContext {
   uint32_t id;
 };
 
-struct ContextAwareBranchContext : public BranchContext {
+struct ContextAwareBranchContext : public virtual BranchContext {
   uint32_t context;
 };
 
-struct LoopAwareBranchContext : public BranchContext {
+struct LoopAwareBranchContext : public virtual BranchContext {
   uint32_t loop_counter;
 };
 
-struct HistoryAwareBranchContext : public BranchContext {
+struct HistoryAwareBranchContext : public virtual BranchContext {
   uint32_t history;
 };
 
@@ -35,42 +42,332 @@ struct FullBranchContext : public HybridBranchContext,
                           public HistoryAwareBranchContext {
 };
 
+// the contexts handed out by a CovManager are interned, one per branch
+// context and direction, and live as long as the manager, so tasks can
+// point to them and tracing a branch doesn't allocate
 class CovManager {
 public:
   virtual ~CovManager() {}
-  virtual const std::shared_ptr<BranchContext> // don't want the saved context to be modified
+  virtual const BranchContext*
     add_branch(void *addr, uint32_t id, bool direction, uint32_t context, bool is_loop_header, bool is_loop_exit) = 0;
   virtual bool
-    is_branch_interesting(const std::shared_ptr<BranchContext> context) = 0;
+    is_branch_interesting(const BranchContext *context) = 0;
+  // the context of the same branch for the given direction
+  virtual const BranchContext*
+    flip(const BranchContext *context, bool direction) = 0;
+  // if the branch direction has been covered since, e.g., by the trace of
+  // another seed, O(1) and only for contexts handed out by the manager;
+  // may be called while another thread adds branches
+  virtual bool is_covered(const BranchContext *context) {
+    return context->seen && __atomic_load_n(context->seen, __ATOMIC_RELAXED);
+  }
+  // the branches added from now on come from the trace of a new seed
+  virtual void start_trace() {}
+  // the branch contexts with a covered direction, as a key per context and
+  // a bit per direction (1 for false, 2 for true), to be restored in a later
+  // run on the same binary
+  virtual void covered(std::vector<std::pair<uint64_t, uint8_t>> &out) {}
+  // marks the directions of a context covered, as covered() listed them
+  virtual void restore(uint64_t key, uint8_t dirs) {}
 };
 
 class EdgeCovManager : public CovManager {
 private:
-  using BranchTargets = std::pair<bool, bool>;
+  // the contexts of both directions, [1] for true, and if they've been seen
+  struct BranchTargets {
+    BranchContext ctx[2];
+    bool seen[2] = {false, false};
+  };
   std::unordered_map<void*, BranchTargets> branches;
-  std::shared_ptr<BranchContext> _ctx;
 
-public:
-  EdgeCovManager() { _ctx = std::make_shared<BranchContext>(); }
+  BranchTargets &get(void *addr) {
+    auto itr = branches.find(addr);
+    if (itr == branches.end()) {
+      BranchTargets t;
+      for (int d = 0; d < 2; d++) {
+        t.ctx[d].addr = addr;
+        t.ctx[d].direction = d;
+      }
+      itr = branches.emplace(addr, t).first;
+      for (int d = 0; d < 2; d++) {
+        itr->second.ctx[d].seen = &itr->second.seen[d];
+      }
+    }
+    return itr->second;
+  }
 
-  const std::shared_ptr<BranchContext>
+public:
+  const BranchContext*
   add_branch(void *addr, uint32_t id, bool direction, uint32_t context, bool is_loop_header, bool is_loop_exit) override {
-    auto &itr = branches[addr];
-    itr.first |= direction? true : false;
-    itr.second |= direction? false : true;
-    _ctx->addr = addr;
-    _ctx->direction = direction;
-    return _ctx;
+    auto &itr = get(addr);
+    __atomic_store_n(&itr.seen[direction], true, __ATOMIC_RELAXED);
+    return &itr.ctx[direction];
   }
 
-  bool is_branch_interesting(const std::shared_ptr<BranchContext> context) override {
+  bool is_branch_interesting(const BranchContext *context) override {
     auto itr = branches.find(context->addr);
-    // assert(itr != branches.end());
-    if (context->direction) {
-      return itr->second.first == false;
-    } else {
-      return itr->second.second == false;
+    return itr == branches.end() || !itr->second.seen[context->direction];
+  }
+
+  const BranchContext* flip(const BranchContext *context, bool direction) override {
+    return &get(context->addr).ctx[direction];
+  }
+
+  void covered(std::vector<std::pair<uint64_t, uint8_t>> &out) override {
+    for (auto const& [addr, t] : branches) {
+      uint8_t dirs = (t.seen[0] ? 1 : 0) | (t.seen[1] ? 2 : 0);
+      if (dirs) out.push_back({(uint64_t)addr, dirs});
+    }
+  }
+
+  void restore(uint64_t key, uint8_t dirs) override {
+    auto &t = get((void*)key);
+    for (int d = 0; d < 2; d++) {
+      if (dirs & (1 << d)) t.seen[d] = true;
+    }
+  }
+};
+
+// maps a hash of a branch context to an index, in an open addressing table
+// with linear probing
+class BranchTable {
+public:
+  BranchTable() : keys_(kInitSlots, 0), vals_(kInitSlots, 0), used_(0) {}
+
+  // the index of key, 0 if it's new
+  uint32_t &operator[](uint64_t key) {
+    if (!key) key = 1; // 0 marks an empty slot
+    if ((used_ + 1) * 2 > keys_.size()) grow();
+    size_t s = slot(key);
+    if (!keys_[s]) {
+      keys_[s] = key;
+      used_++;
+    }
+    return vals_[s];
+  }
+
+  uint32_t find(uint64_t key) const {
+    if (!key) key = 1;
+    return vals_[slot(key)];
+  }
+
+private:
+  static const size_t kInitSlots = 1 << 16;
+
+  size_t slot(uint64_t key) const {
+    size_t mask = keys_.size() - 1;
+    size_t s = (key * 0x9e3779b97f4a7c15ULL) >> 20 & mask;
+    while (keys_[s] && keys_[s] != key) s = (s + 1) & mask;
+    return s;
+  }
+
+  void grow() {
+    std::vector<uint64_t> keys(keys_.size() * 2, 0);
+    std::vector<uint32_t> vals(vals_.size() * 2, 0);
+    keys.swap(keys_);
+    vals.swap(vals_);
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (keys[i]) {
+        size_t s = slot(keys[i]);
+        keys_[s] = keys[i];
+        vals_[s] = vals[i];
+      }
+    }
+  }
+
+  std::vector<uint64_t> keys_;
+  std::vector<uint32_t> vals_;
+  size_t used_;
+};
+
+static inline uint64_t cov_mix(uint64_t h, uint64_t v) {
+  uint64_t x = h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// coverage of branches in a finer context than their address, Ctx is the
+// context type; the per-trace state (hit counts for the loop buckets, the
+// recent branches for the history) is reset by start_trace
+template <class Ctx>
+class FlatCovManager : public CovManager {
+public:
+  // the hit count buckets, as AFL++ does
+  static uint32_t loop_bucket(uint32_t hits) {
+    if (hits <= 3) return hits;
+    if (hits <= 7) return 4;
+    if (hits <= 15) return 5;
+    if (hits <= 31) return 6;
+    if (hits <= 127) return 7;
+    return 8;
+  }
+
+  FlatCovManager() : hits(kHitSlots, 0), recent(0) {}
+
+  const BranchContext*
+  add_branch(void *addr, uint32_t id, bool direction, uint32_t context, bool is_loop_header, bool is_loop_exit) override {
+    uint16_t &h = hits[(cov_mix((uint64_t)addr, 0) >> 32) & (kHitSlots - 1)];
+    if (h != UINT16_MAX) h++;
+    _ctx.addr = addr;
+    _ctx.direction = direction;
+    fill(_ctx, id, context, h, recent);
+    auto &e = intern(_ctx);
+    __atomic_store_n(&e.seen[direction], true, __ATOMIC_RELAXED);
+    // the history of the next branch includes this one
+    recent = cov_mix(recent, ((uint64_t)addr << 1) | direction) & 0xffffffff;
+    return &e.ctx[direction];
+  }
+
+  bool is_branch_interesting(const BranchContext *context) override {
+    uint64_t k = key(dynamic_cast<const Ctx&>(*context));
+    uint32_t idx = branches.find(k);
+    if (!idx && !restored.empty()) {
+      auto itr = restored.find(k);
+      return itr == restored.end() || !(itr->second & (1 << context->direction));
     }
+    return !idx || !pool[idx - 1].seen[context->direction];
+  }
+
+  const BranchContext* flip(const BranchContext *context, bool direction) override {
+    return &intern(dynamic_cast<const Ctx&>(*context)).ctx[direction];
+  }
+
+  void start_trace() override {
+    std::fill(hits.begin(), hits.end(), 0);
+    recent = 0;
+  }
+
+  void covered(std::vector<std::pair<uint64_t, uint8_t>> &out) override {
+    for (auto const& e : pool) {
+      uint8_t dirs = (e.seen[0] ? 1 : 0) | (e.seen[1] ? 2 : 0);
+      if (dirs) out.push_back({key(e.ctx[0]), dirs});
+    }
+    for (auto const& r : restored) out.push_back(r);
+  }
+
+  // the contexts aren't known until a trace reaches them again, so the
+  // restored directions wait in restored until intern() makes the entry
+  void restore(uint64_t k, uint8_t dirs) override {
+    uint32_t idx = branches.find(k);
+    if (!idx) {
+      restored[k] |= dirs;
+      return;
+    }
+    for (int d = 0; d < 2; d++) {
+      if (dirs & (1 << d)) pool[idx - 1].seen[d] = true;
+    }
+  }
+
+protected:
+  // fills the context fields of Ctx, and hashes them with the address
+  virtual void fill(Ctx &ctx, uint32_t id, uint32_t context, uint32_t hits,
+                    uint32_t history) = 0;
+  virtual uint64_t key(const Ctx &ctx) = 0;
+
+private:
+  static const size_t kHitSlots = 1 << 16;
+
+  // the contexts of both directions, [1] for true, and if they've been seen
+  struct entry_t {
+    Ctx ctx[2];
+    bool seen[2] = {false, false};
+  };
+
+  entry_t &intern(const Ctx &ctx) {
+    uint64_t k = key(ctx);
+    uint32_t &idx = branches[k];
+    if (!idx) {
+      pool.emplace_back();
+      for (int d = 0; d < 2; d++) {
+        pool.back().ctx[d] = ctx;
+        pool.back().ctx[d].direction = d;
+        pool.back().ctx[d].seen = &pool.back().seen[d];
+      }
+      idx = pool.size();
+      auto itr = restored.empty() ? restored.end() : restored.find(k);
+      if (itr != restored.end()) {
+        for (int d = 0; d < 2; d++) {
+          if (itr->second & (1 << d)) pool.back().seen[d] = true;
+        }
+        restored.erase(itr);
+      }
+    }
+    return pool[idx - 1];
+  }
+
+  Ctx _ctx;
+  BranchTable branches;
+  std::deque<entry_t> pool; // stable addresses
+  // the directions restored from a checkpoint not traced again yet
+  std::unordered_map<uint64_t, uint8_t> restored;
+  std::vector<uint16_t> hits;
+  uint64_t recent;
+};
+
+// the address plus the branch id from the instrumentation
+class HybridCovManager : public FlatCovManager<HybridBranchContext> {
+protected:
+  void fill(HybridBranchContext &ctx, uint32_t id, uint32_t, uint32_t,
+            uint32_t) override {
+    ctx.id = id;
+  }
+  uint64_t key(const HybridBranchContext &ctx) override {
+    return cov_mix((uint64_t)ctx.addr, ctx.id);
+  }
+};
+
+// the address in each calling context
+class ContextAwareCovManager : public FlatCovManager<ContextAwareBranchContext> {
+protected:
+  void fill(ContextAwareBranchContext &ctx, uint32_t, uint32_t context, uint32_t,
+            uint32_t) override {
+    ctx.context = context;
+  }
+  uint64_t key(const ContextAwareBranchContext &ctx) override {
+    return cov_mix((uint64_t)ctx.addr, ctx.context);
+  }
+};
+
+// the address with the bucket of how many times it's been hit in the trace
+class LoopAwareCovManager : public FlatCovManager<LoopAwareBranchContext> {
+protected:
+  void fill(LoopAwareBranchContext &ctx, uint32_t, uint32_t, uint32_t hits,
+            uint32_t) override {
+    ctx.loop_counter = loop_bucket(hits);
+  }
+  uint64_t key(const LoopAwareBranchContext &ctx) override {
+    return cov_mix((uint64_t)ctx.addr, ctx.loop_counter);
+  }
+};
+
+// the address after the recent branches of the trace
+class HistoryAwareCovManager : public FlatCovManager<HistoryAwareBranchContext> {
+protected:
+  void fill(HistoryAwareBranchContext &ctx, uint32_t, uint32_t, uint32_t,
+            uint32_t history) override {
+    ctx.history = history;
+  }
+  uint64_t key(const HistoryAwareBranchContext &ctx) override {
+    return cov_mix((uint64_t)ctx.addr, ctx.history);
+  }
+};
+
+// all of the above
+class FullCovManager : public FlatCovManager<FullBranchContext> {
+protected:
+  void fill(FullBranchContext &ctx, uint32_t id, uint32_t context, uint32_t hits,
+            uint32_t history) override {
+    ctx.id = id;
+    ctx.context = context;
+    ctx.loop_counter = loop_bucket(hits);
+    ctx.history = history;
+  }
+  uint64_t key(const FullBranchContext &ctx) override {
+    uint64_t h = cov_mix((uint64_t)ctx.addr, ctx.id);
+    h = cov_mix(h, ctx.context);
+    h = cov_mix(h, ctx.loop_counter);
+    return cov_mix(h, ctx.history);
   }
 };
 
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace rgd {
+
+// immutable set of flattened input offsets, kept as sorted and disjoint
+// [begin, end) intervals, so its size follows the ranges a label reads
+// rather than the input size; a null pointer is the empty set
+class DepSet {
+public:
+  using ptr = std::shared_ptr<const DepSet>;
+  using interval_t = std::pair<size_t, size_t>;
+
+  static ptr make_range(size_t begin, size_t end) {
+    if (begin >= end) return nullptr;
+    auto s = std::make_shared<DepSet>();
+    s->ranges_.emplace_back(begin, end);
+    return s;
+  }
+
+  // the union shares an operand whenever it already covers the other one,
+  // which is the common case for labels built over the same bytes
+  static ptr merge(const ptr &a, const ptr &b) {
+    if (!a || a == b) return b;
+    if (!b) return a;
+    auto s = std::make_shared<DepSet>();
+    auto &out = s->ranges_;
+    out.reserve(a->ranges_.size() + b->ranges_.size());
+    auto i = a->ranges_.begin(), ie = a->ranges_.end();
+    auto j = b->ranges_.begin(), je = b->ranges_.end();
+    while (i != ie || j != je) {
+      const interval_t &r = (j == je || (i != ie && i->first <= j->first)) ? *i++ : *j++;
+      if (!out.empty() && r.first <= out.back().second) {
+        if (r.second > out.back().second) out.back().second = r.second;
+      } else {
+        out.push_back(r);
+      }
+    }
+    if (out == a->ranges_) return a;
+    if (out == b->ranges_) return b;
+    return s;
+  }
+
+  size_t first() const { return ranges_.front().first; }
+
+  template <typename F>
+  void for_each(F f) const {
+    for (auto const& r : ranges_) {
+      for (size_t i = r.first; i < r.second; ++i) f(i);
+    }
+  }
+
+  const std::vector<interval_t>& intervals() const { return ranges_; }
+
+private:
+  std::vector<interval_t> ranges_;
+};
+
+}; // namespace rgd
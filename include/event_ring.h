@@ -0,0 +1,27 @@
+#ifndef SYMSAN_EVENT_RING_H
+#define SYMSAN_EVENT_RING_H
+
+#include <stdint.h>
+
+/// Single-producer single-consumer byte ring carrying the same
+/// pipe_msg/gep_msg/memcmp_msg stream as the event pipe.
+/// It lives in the union table shm, right after the union table.
+/// The pipe is kept for wakeups (one byte, only when the consumer sleeps)
+/// and for EOF detection when the target exits.
+
+#define EVENT_RING_DATA_SIZE (1UL << 24)
+
+struct event_ring {
+  uint64_t head;      // bytes written, updated by the producer
+  char pad0[56];
+  uint64_t tail;      // bytes read, updated by the consumer
+  char pad1[56];
+  uint32_t waiting;   // consumer is blocked on the pipe
+  uint32_t size;      // size of data, power of 2
+  char pad2[56];
+  uint8_t data[];
+};
+
+#define EVENT_RING_SIZE (sizeof(struct event_ring) + EVENT_RING_DATA_SIZE)
+
+#endif /* !SYMSAN_EVENT_RING_H */
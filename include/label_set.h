@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace rgd {
+
+// a set of labels for one walk over an AST, open addressing with the slots
+// stamped by the walk they were filled in, so clearing it between walks
+// only bumps the stamp and the table is allocated once
+class LabelSet {
+public:
+  explicit LabelSet(size_t slots = 256) : slots_(slots), size_(0), gen_(1) {}
+
+  void clear() {
+    size_ = 0;
+    if (++gen_ == 0) {
+      // wrapped around, stale stamps could look current
+      std::fill(slots_.begin(), slots_.end(), slot_t());
+      gen_ = 1;
+    }
+  }
+
+  size_t size() const { return size_; }
+
+  size_t count(uint32_t label) const {
+    size_t mask = slots_.size() - 1;
+    for (size_t i = hash(label) & mask;; i = (i + 1) & mask) {
+      auto const &s = slots_[i];
+      if (s.gen != gen_) return 0;
+      if (s.label == label) return 1;
+    }
+  }
+
+  // false if label is there already
+  bool insert(uint32_t label) {
+    if ((size_ + 1) * 2 > slots_.size()) grow();
+    size_t mask = slots_.size() - 1;
+    for (size_t i = hash(label) & mask;; i = (i + 1) & mask) {
+      auto &s = slots_[i];
+      if (s.gen != gen_) {
+        s.gen = gen_;
+        s.label = label;
+        size_++;
+        return true;
+      }
+      if (s.label == label) return false;
+    }
+  }
+
+private:
+  struct slot_t {
+    uint32_t label = 0;
+    uint32_t gen = 0;
+  };
+
+  static inline size_t hash(uint32_t label) {
+    return ((uint64_t)label * 0x9e3779b97f4a7c15ULL) >> 32;
+  }
+
+  void grow() {
+    std::vector<slot_t> old(slots_.size() * 2);
+    old.swap(slots_);
+    uint32_t gen = gen_;
+    size_ = 0;
+    for (auto const &s : old) {
+      if (s.gen == gen) insert(s.label);
+    }
+  }
+
+  std::vector<slot_t> slots_;
+  size_t size_;
+  uint32_t gen_;
+};
+
+}; // namespace rgd
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace rgd {
+
+// a table indexed by label, like a vector, that can drop the entries of
+// the labels below a base as the labels it holds go up, so a long trace
+// only keeps those of its last labels; size() is one past the last label
+template <class T>
+class LabelTable {
+public:
+  size_t size() const { return base_ + data_.size(); }
+  size_t base() const { return base_; }
+  bool empty() const { return data_.empty(); }
+  bool has(size_t label) const { return label >= base_ && label < size(); }
+
+  // label must be in the table, see has()
+  T& operator[](size_t label) { return data_[label - base_]; }
+  const T& operator[](size_t label) const { return data_[label - base_]; }
+  T& at(size_t label) {
+    if (!has(label)) throw std::out_of_range("label not in table");
+    return data_[label - base_];
+  }
+
+  void push_back(T v) { data_.push_back(std::move(v)); }
+  template <class... Args>
+  void emplace_back(Args&&... args) { data_.emplace_back(std::forward<Args>(args)...); }
+  void reserve(size_t n) { if (n > base_) data_.reserve(n - base_); }
+  // truncates or extends to n labels; truncating below the base empties
+  // the table, which then starts at n
+  void resize(size_t n, T const& v = T()) {
+    if (n >= base_) {
+      data_.resize(n - base_, v);
+    } else {
+      data_.clear();
+      base_ = n;
+    }
+  }
+  void clear() {
+    data_.clear();
+    base_ = 0;
+  }
+  // clears it and hands its memory back
+  void release() {
+    std::vector<T>().swap(data_);
+    base_ = 0;
+  }
+  size_t capacity() const { return data_.capacity(); }
+
+  // drops the entries of the labels below base, handing each to drop;
+  // the entries are moved down in one go, so it's worth calling only once
+  // a good share of them can go
+  template <class F>
+  void drop_below(size_t base, F &&drop) {
+    if (base <= base_) return;
+    size_t n = std::min(base - base_, data_.size());
+    for (size_t i = 0; i < n; i++) drop(base_ + i, data_[i]);
+    data_.erase(data_.begin(), data_.begin() + n);
+    base_ += n;
+  }
+  void drop_below(size_t base) {
+    drop_below(base, [](size_t, T&) {});
+  }
+
+private:
+  size_t base_ = 0;
+  std::vector<T> data_;
+};
+
+}; // namespace rgd
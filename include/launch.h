@@ -10,9 +10,77 @@
 #define SYMSAN_MISSING_INPUT 5;
 #define SYMSAN_MISSING_ARGS 6;
 
+/// A session is a launcher with its own shm union table, event pipe, and
+/// child, so a process can trace several inputs at once, one per session.
+/// Each symsan_session_* call below takes one, and works as the symsan_*
+/// call of the same name; the symsan_* calls work on a single default
+/// session set up by symsan_init. A session must not be used by two
+/// threads at once.
+typedef struct symsan_config symsan_session_t;
+
+/// @brief create a launcher session
+/// @param symsan_bin: path to symsan binary
+/// @param uniontable_size: size of union table, passed on to the runtime;
+///        rounded up to the page size as the runtime does, so the parsers
+///        should be given page aligned sizes
+/// @return the session, NULL on error
+symsan_session_t* symsan_session_new(const char *symsan_bin, size_t uniontable_size);
+
+/// @brief the union table mapped by a session
+void* symsan_session_union_table(symsan_session_t *s);
+
+/// @brief bytes of the shm of a session (the union table, and the event
+/// ring and blob area if used) that are in memory
+size_t symsan_session_shm_bytes(symsan_session_t *s);
+
+int symsan_session_set_input(symsan_session_t *s, const char *input);
+int symsan_session_set_args(symsan_session_t *s, const int argc, char* const argv[]);
+int symsan_session_set_debug(symsan_session_t *s, int enable);
+int symsan_session_set_bounds_check(symsan_session_t *s, int enable);
+int symsan_session_set_exit_on_memerror(symsan_session_t *s, int enable);
+int symsan_session_set_trace_file_size(symsan_session_t *s, int enable);
+int symsan_session_set_force_stdin(symsan_session_t *s, int enable);
+int symsan_session_set_persistent_gc(symsan_session_t *s, int enable);
+int symsan_session_set_event_ring(symsan_session_t *s, int enable);
+int symsan_session_set_memcmp_blob(symsan_session_t *s, int enable);
+const void* symsan_session_get_blob(symsan_session_t *s, uint64_t offset, size_t size);
+int symsan_session_set_branch_filter(symsan_session_t *s, int enable);
+void symsan_session_set_site_limit(symsan_session_t *s, uint32_t limit);
+int symsan_session_mark_covered(symsan_session_t *s, uint32_t id, int direction);
+int symsan_session_set_snapshots(symsan_session_t *s, int enable);
+int symsan_session_mark_snapshot(symsan_session_t *s, uint32_t id);
+int symsan_session_get_snapshot(symsan_session_t *s, uint32_t *id,
+                                uint64_t *consumed, uint64_t *size);
+int symsan_session_resume(symsan_session_t *s, int fd);
+void symsan_session_drop_snapshot(symsan_session_t *s);
+int symsan_session_set_taint_ranges(symsan_session_t *s, const char *ranges);
+int symsan_session_set_lazy_mmap_taint(symsan_session_t *s, int enable);
+int symsan_session_set_summarize_sums(symsan_session_t *s, int enable);
+int symsan_session_set_taint_inputs(symsan_session_t *s, const char *files);
+int symsan_session_set_taint_argv(symsan_session_t *s, int enable);
+int symsan_session_set_taint_env(symsan_session_t *s, int enable);
+int symsan_session_set_max_ast_size(symsan_session_t *s, size_t size);
+int symsan_session_set_no_aslr(symsan_session_t *s, int enable);
+int symsan_session_set_huge_pages(symsan_session_t *s, int enable);
+int symsan_session_set_prefault(symsan_session_t *s, size_t mb);
+int symsan_session_set_affinity(symsan_session_t *s, int cpu);
+int symsan_session_set_numa_node(symsan_session_t *s, int node);
+/// @brief have the next run symbolize the pcs in the file, one hex number
+/// per line, to <path>.sym instead of running the target; NULL to unset
+int symsan_session_set_symbolize_pcs(symsan_session_t *s, const char *path);
+int symsan_session_set_forkserver(symsan_session_t *s, int enable);
+int symsan_session_set_persistent(symsan_session_t *s, int enable);
+int symsan_session_run(symsan_session_t *s, int fd);
+ssize_t symsan_session_read_event(symsan_session_t *s, void *buf, size_t size, unsigned int timeout);
+int symsan_session_terminate(symsan_session_t *s);
+int symsan_session_get_exit_status(symsan_session_t *s, int *status);
+
+/// @brief terminate the child of a session, and free it with its shm
+void symsan_session_destroy(symsan_session_t *s);
+
 /// @brief initialize symsan launcher
 /// @param symsan_bin: path to symsan binary
-/// @param uniontable_size: size of union table
+/// @param uniontable_size: size of union table, passed on to the runtime
 /// @return pointer to the mapped union table
 void* symsan_init(const char *symsan_bin, size_t uniontable_size);
 
@@ -42,6 +110,115 @@ int symsan_set_trace_file_size(int enable);
 /// @brief set the force stdin mode for the target binary
 int symsan_set_force_stdin(int enable);
 
+/// @brief keep labels still reachable from the shadow across persistent
+/// iterations and reclaim the rest, instead of dropping all taint
+int symsan_set_persistent_gc(int enable);
+
+/// @brief deliver events through the shm ring instead of the pipe
+int symsan_set_event_ring(int enable);
+
+/// @brief store memcmp content in the shm blob area, memcmp events then
+/// carry a memcmp_blob_msg (F_MEMCMP_BLOB) instead of the content
+int symsan_set_memcmp_blob(int enable);
+
+/// @brief get a buffer stored in the blob area by the current run
+/// @param offset: offset from the event
+/// @param size: size of the buffer
+/// @return pointer into the shm, valid until the next run; NULL if out of range
+const void* symsan_get_blob(uint64_t offset, size_t size);
+
+/// @brief let the runtime drop cond events with the shm branch filter
+/// instead of sending them, see branch_filter.h
+int symsan_set_branch_filter(int enable);
+
+/// @brief the max cond events the runtime sends per branch id, context and
+/// direction in a run, 0 for no limit; takes effect from the next run
+void symsan_set_site_limit(uint32_t limit);
+
+/// @brief tell the runtime a direction of a branch id is covered, so conds
+/// on that id that would flip to it are no longer sent
+/// @return success or error code, e.g., when the filter is full
+int symsan_mark_covered(uint32_t id, int direction);
+
+/// @brief let the runtime take snapshots at the branches marked with
+/// symsan_mark_snapshot, see snapshot.h; needs the branch filter shm
+int symsan_set_snapshots(int enable);
+
+/// @brief have the next run that reaches branch id take a snapshot there,
+/// one per run
+int symsan_mark_snapshot(uint32_t id);
+
+/// @brief the latest snapshot taken, dropping the older ones
+/// @param id: the branch it was taken at
+/// @param consumed: the input bytes read before it, a resumed input must
+/// have the same ones and the same size
+/// @param size: the size of its input
+/// @return 1 if it was taken since the last call, 0 if earlier, -1 if
+/// there is none
+int symsan_get_snapshot(uint32_t *id, uint64_t *consumed, uint64_t *size);
+
+/// @brief run the target from the latest snapshot with the input fd, the
+/// events are read as for symsan_run
+/// @return as symsan_run, -1 if the snapshot is gone (and dropped)
+int symsan_resume(int fd);
+
+/// @brief let the dormant copy of the latest snapshot exit
+void symsan_drop_snapshot();
+
+/// @brief only label the given byte ranges of the input, e.g., "0-63,512-"
+/// the other bytes stay concrete
+int symsan_set_taint_ranges(const char *ranges);
+
+/// @brief label mmapped ranges of the input file on first access
+/// instead of eagerly at mmap time
+int symsan_set_lazy_mmap_taint(int enable);
+
+/// @brief label sums of input bytes at consecutive offsets, as loops over
+/// the input add them up, as one fsum instead of a chain of Adds
+int symsan_set_summarize_sums(int enable);
+
+/// @brief also taint the given files, e.g., "cfg.ini,data.bin", as inputs
+/// 1, 2, ... of the labels, the input file being input 0
+int symsan_set_taint_inputs(const char *files);
+
+/// @brief taint the bytes of the arguments (the environment) of the target,
+/// each followed by its NUL, as the input after the taint inputs
+int symsan_set_taint_argv(int enable);
+int symsan_set_taint_env(int enable);
+
+/// @brief have the runtime concretize expressions with more than size
+/// nodes where they're built, 0 (the default) for no limit
+int symsan_set_max_ast_size(size_t size);
+
+/// @brief run the target with ASLR off, so the branch addresses in the
+/// events are the same across runs
+int symsan_set_no_aslr(int enable);
+
+/// @brief back the union table (on both sides) and the runtime's union
+/// hashtable with transparent huge pages, where the kernel allows it
+int symsan_set_huge_pages(int enable);
+
+/// @brief fault in the first mb MB of each half of the union table (and
+/// of the runtime's hashtable without a forkserver) up front
+int symsan_set_prefault(size_t mb);
+
+/// @brief pin the target (and the forkserver) to cpu, -1 for any; the shm
+/// is bound to the numa node of cpu unless a node is set. Set it before
+/// the prefault, or the faulted pages are moved
+int symsan_set_affinity(int cpu);
+
+/// @brief run the target on the cpus of a numa node and bind the shm to
+/// it, -1 for any
+int symsan_set_numa_node(int node);
+
+/// @brief set the forkserver mode for the target binary
+/// the target is exec'ed once and later runs are forked from the runtime
+int symsan_set_forkserver(int enable);
+
+/// @brief set the persistent mode for the target binary
+/// the target loops over inputs with __symsan_loop, implies forkserver mode
+int symsan_set_persistent(int enable);
+
 /// @brief run the target binary with the input file descriptor
 /// @param fd: input file descriptor, only used if input is "stdin"
 /// @return < 0 on syscall error, > 0 on setup error, 0 on success
@@ -57,6 +234,9 @@ ssize_t symsan_read_event(void *buf, size_t size, unsigned int timeout);
 /// @brief terminate target binary
 int symsan_terminate();
 
+/// @brief bytes of the shm in memory, see symsan_session_shm_bytes
+size_t symsan_shm_bytes();
+
 /// @brief retrieve exit status
 int symsan_get_exit_status(int *status);
 
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace rgd {
+
+// a map holding up to capacity entries, the least recently found or
+// inserted one goes first; 0 for no limit
+template <class K, class V>
+class LruMap {
+public:
+  explicit LruMap(size_t capacity = 0) : capacity_(capacity) {}
+
+  void set_capacity(size_t capacity) {
+    capacity_ = capacity;
+    trim();
+  }
+  size_t size() const { return index_.size(); }
+
+  // nullptr if key isn't there
+  V* find(K const& key) {
+    auto itr = index_.find(key);
+    if (itr == index_.end()) return nullptr;
+    order_.splice(order_.begin(), order_, itr->second);
+    return &itr->second->second;
+  }
+
+  // keeps the value already there, if any
+  void insert(K const& key, V value) {
+    auto itr = index_.find(key);
+    if (itr != index_.end()) {
+      order_.splice(order_.begin(), order_, itr->second);
+      return;
+    }
+    order_.emplace_front(key, std::move(value));
+    index_.emplace(key, order_.begin());
+    trim();
+  }
+
+  template <class Pred>
+  void erase_if(Pred &&pred) {
+    for (auto itr = order_.begin(); itr != order_.end();) {
+      if (pred(itr->first, itr->second)) {
+        index_.erase(itr->first);
+        itr = order_.erase(itr);
+      } else {
+        ++itr;
+      }
+    }
+  }
+
+  void clear() {
+    index_.clear();
+    order_.clear();
+  }
+
+private:
+  void trim() {
+    while (capacity_ && index_.size() > capacity_) {
+      index_.erase(order_.back().first);
+      order_.pop_back();
+    }
+  }
+
+  size_t capacity_;
+  std::list<std::pair<K, V>> order_;
+  std::unordered_map<K, typename std::list<std::pair<K, V>>::iterator> index_;
+};
+
+}; // namespace rgd
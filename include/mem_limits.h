@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+namespace rgd {
+
+// The memory of the subsystems of the mutator, as the bytes each one last
+// reported (an estimate for the parser caches and the queued tasks), and
+// a soft limit per subsystem: going over it doesn't fail anything, it has
+// the owner trim what it holds, with the policy of the subsystem (cut the
+// trace, drop the parser caches, spill the tasks, evict JIT'ed code, reset
+// the Z3 caches). Each trim is counted, so the users of a subsystem that
+// don't own it can tell when to drop what they hold too.
+class MemLimits {
+public:
+  enum subsystem_t {
+    UnionTable, // the shm of the union table, resident
+    Parser,     // the caches of the parser
+    Tasks,      // the tasks queued
+    Jit,        // the code of the JIT'ed constraints
+    Z3,         // everything Z3 allocated
+    NumSubsystems
+  };
+
+  static const char* name(subsystem_t s) {
+    static const char *names[NumSubsystems] = {
+      "union", "parser", "tasks", "jit", "z3"
+    };
+    return names[s];
+  }
+
+  MemLimits() {
+    for (int i = 0; i < NumSubsystems; i++) {
+      limit_[i] = 0;
+      bytes_[i].store(0, std::memory_order_relaxed);
+      peak_[i].store(0, std::memory_order_relaxed);
+      trims_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // the limits in MB, as "<name>=<mb>" separated by commas, e.g.,
+  // "union=4096,parser=512"; false on an unknown name
+  bool parse(const char *spec) {
+    while (*spec) {
+      const char *eq = strchr(spec, '=');
+      if (!eq) return false;
+      int s = 0;
+      while (s < NumSubsystems &&
+             (strlen(name((subsystem_t)s)) != (size_t)(eq - spec) ||
+              strncmp(spec, name((subsystem_t)s), eq - spec))) {
+        s++;
+      }
+      if (s == NumSubsystems) return false;
+      char *end;
+      limit_[s] = (size_t)strtoull(eq + 1, &end, 0) << 20;
+      if (*end == ',') end++;
+      else if (*end) return false;
+      spec = end;
+    }
+    return true;
+  }
+
+  // 0 for no limit
+  size_t limit(subsystem_t s) const { return limit_[s]; }
+  void set_limit(subsystem_t s, size_t bytes) { limit_[s] = bytes; }
+
+  // records the bytes s holds now, true if that's over its limit
+  bool update(subsystem_t s, size_t bytes) {
+    bytes_[s].store(bytes, std::memory_order_relaxed);
+    size_t peak = peak_[s].load(std::memory_order_relaxed);
+    while (bytes > peak &&
+           !peak_[s].compare_exchange_weak(peak, bytes, std::memory_order_relaxed)) {}
+    return limit_[s] && bytes > limit_[s];
+  }
+
+  size_t bytes(subsystem_t s) const {
+    return bytes_[s].load(std::memory_order_relaxed);
+  }
+
+  // the owner of s trimmed it
+  void trimmed(subsystem_t s, uint64_t n = 1) {
+    trims_[s].fetch_add(n, std::memory_order_relaxed);
+  }
+  uint64_t trims(subsystem_t s) const {
+    return trims_[s].load(std::memory_order_relaxed);
+  }
+
+  // "mem_<name>_<key> : <value>" lines, like the solvers' write_stats
+  void write_stats(int fd) const {
+    for (int i = 0; i < NumSubsystems; i++) {
+      subsystem_t s = (subsystem_t)i;
+      write_stat(fd, s, "bytes", bytes(s));
+      write_stat(fd, s, "peak", peak_[i].load(std::memory_order_relaxed));
+      if (limit_[i]) {
+        write_stat(fd, s, "limit", limit_[i]);
+        write_stat(fd, s, "trims", trims(s));
+      }
+    }
+  }
+
+private:
+  static void write_stat(int fd, subsystem_t s, const char *key, uint64_t v) {
+    // the keys line up with the other ones of the stats file
+    int pad = 18 - 5 - (int)(strlen(name(s)) + strlen(key));
+    dprintf(fd, "mem_%s_%s%*s: %lu\n", name(s), key, pad > 0 ? pad : 0, "", v);
+  }
+
+  size_t limit_[NumSubsystems];
+  std::atomic<size_t> bytes_[NumSubsystems];
+  std::atomic<size_t> peak_[NumSubsystems];
+  std::atomic<uint64_t> trims_[NumSubsystems];
+};
+
+}; // namespace rgd
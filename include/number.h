@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <algorithm>
+
+namespace rgd {
+
+// room for the longest number encode_number() writes: a sign and 64
+// binary digits, padded or not
+static const size_t kMaxNumberLen = 72;
+
+// writes the value of the low bytes of val, sign-extended, in base (2 to
+// 36) to out, as strtol() reads it back, with leading zeros up to width
+// characters; returns the number of characters, 0 for an invalid base
+static inline size_t encode_number(uint64_t val, uint32_t base, uint32_t bytes,
+                                   size_t width, char *out) {
+  if (base < 2 || base > 36) return 0;
+  if (bytes && bytes < 8) {
+    uint64_t sign = 1ULL << (bytes * 8 - 1);
+    val = ((val & ((sign << 1) - 1)) ^ sign) - sign;
+  }
+  size_t len = 0;
+  if ((int64_t)val < 0) {
+    out[len++] = '-';
+    val = 0 - val;
+  }
+  char tmp[64];
+  size_t n = 0;
+  do {
+    tmp[n++] = "0123456789abcdefghijklmnopqrstuvwxyz"[val % base];
+    val /= base;
+  } while (val);
+  width = std::min(width, kMaxNumberLen);
+  while (len + n < width) out[len++] = '0';
+  while (n) out[len++] = tmp[--n];
+  return len;
+}
+
+};  // namespace rgd
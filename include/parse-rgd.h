@@ -2,24 +2,35 @@
 
 #include "parse.h"
 
+#include "const_dict.h"
 #include "task.h"
 #include "union_find.h"
+#include "dep_set.h"
+#include "label_table.h"
+#include "lru_map.h"
+#include "label_set.h"
 
-#include "boost/dynamic_bitset.hpp"
+#include <chrono>
+
+class ThreadPool;
 
 namespace rgd {
 
 class RGDAstParser : public symsan::ASTParser<SearchTask> {
 public:
   RGDAstParser() = delete;
-  RGDAstParser(void *base, size_t size, bool solve_nested = false, size_t max_ast_size = 200)
-    : symsan::ASTParser<SearchTask>(base, size),
-      solve_nested_(solve_nested), max_ast_size_(max_ast_size) {}
-  ~RGDAstParser() {}
+  RGDAstParser(void *base, size_t size, bool solve_nested = false, size_t max_ast_size = 200,
+               size_t scan_threads = 0);
+  ~RGDAstParser();
 
   int restart(std::vector<symsan::input_t> &inputs) override;
   int parse_cond(dfsan_label label, bool result, bool add_nested,
                  std::vector<uint64_t> &tasks) override;
+  int parse_switch(dfsan_label label, uint64_t result,
+                   const std::vector<uint64_t> &cases,
+                   const std::vector<uint32_t> &targets,
+                   dfsan_label taken_label,
+                   std::vector<std::pair<uint32_t, uint64_t>> &tasks) override;
   int parse_gep(dfsan_label ptr_label, uptr ptr,
                 dfsan_label index_label, int64_t index,
                 uint64_t num_elems, uint64_t elem_size,
@@ -28,9 +39,95 @@ public:
 
   int add_constraints(dfsan_label label, uint64_t result) override;
 
+  static constexpr size_t kDefaultDnfClauses = 4096;
+  static constexpr size_t kDefaultDnfLiterals = 1 << 16;
+  /// @brief Limit how much of the DNF of a branch condition is turned into
+  /// tasks, 0 for no limit
+  /// @param max_clauses number of clauses
+  /// @param max_literals total number of relational expressions in them
+  void set_dnf_budget(size_t max_clauses, size_t max_literals) {
+    max_dnf_clauses_ = max_clauses;
+    max_dnf_literals_ = max_literals;
+  }
+
+  /// @brief Bound the branch constraints collected for nested solving, takes
+  /// effect from the next restart
+  /// @param window the last window branches per input byte (or union-find set
+  /// of bytes) are used, 0 for all of them
+  /// @param slice only use the branches reading the same bytes, instead of
+  /// every byte transitively merged with them
+  void set_nested_window(size_t window, bool slice) {
+    nested_window_ = window;
+    nested_slice_ = slice;
+  }
+
+  /// @brief Split the tasks into the components of their constraints that
+  /// read disjoint input bytes, for the solvers to solve one at a time; the
+  /// components of a nested task without the flipped branch's constraints
+  /// only have branches the input took, so they're dropped
+  void set_split_tasks(bool enable) { split_tasks_ = enable; }
+  /// @brief Collect the constants the comparisons test input against, and
+  /// the memcmp targets, into dict
+  void set_const_dict(std::shared_ptr<ConstDict> dict) { const_dict_ = std::move(dict); }
+  /// @brief Constraints dropped from nested tasks by splitting them
+  uint64_t split_dropped() const { return split_dropped_; }
+
+  static constexpr size_t kDefaultStreamingExprs = 1 << 16;
+  /// @brief Bound the memory of the caches for very long traces, takes
+  /// effect from the next restart: only the last window labels keep all
+  /// they cache, the labels below keep their AST size and input deps in a
+  /// fixed-size summary table for as long as no other label takes their
+  /// slot, and the root exprs and constraints are cached up to max_exprs
+  /// each; an expr over a label that's gone from both is concretized
+  /// @param window number of labels, 0 for unbounded caches
+  /// @param max_exprs root exprs and constraints cached
+  void set_streaming(size_t window, size_t max_exprs = kDefaultStreamingExprs) {
+    window_labels_ = window;
+    max_exprs_ = max_exprs;
+  }
+
+  /// @brief Estimated bytes held by the caches, and by the ASTs of the
+  /// current seed
+  size_t cache_bytes() const;
+  /// @brief Empty all the caches at the next restart, as for a new input
+  /// layout, and hand their memory back
+  void drop_caches() { drop_caches_ = true; }
+
+  /// @brief Time the union table scans, for the benchmark harness
+  void set_profile(bool enable) { profile_ = enable; }
+  /// @brief Time spent scanning the union table while profiling, in us
+  uint64_t scan_time() const { return scan_time_; }
+  /// @brief Nodes of the AST of a label parsed already, 0 otherwise
+  uint32_t ast_size(dfsan_label label) const {
+    return label < ast_size_cache.size() ? label_size(label) : 0;
+  }
+  /// @brief Scan label without parsing it
+  /// @return the (flattened) input bytes it depends on, nullptr if none
+  const DepSet* input_deps(dfsan_label label) {
+    if (label < CONST_OFFSET || label == __dfsan::kInitializingLabel ||
+        label >= size_ || !scan_labels(label)) {
+      return nullptr;
+    }
+    return label_deps(label).get();
+  }
+
 protected:
   const bool solve_nested_;
   const size_t max_ast_size_;
+  // threads for scanning long stretches of new labels, 0 scans inline
+  const size_t scan_threads_;
+  size_t max_dnf_clauses_ = kDefaultDnfClauses;
+  size_t max_dnf_literals_ = kDefaultDnfLiterals;
+  size_t nested_window_ = 0;
+  bool nested_slice_ = false;
+  bool split_tasks_ = false;
+  std::shared_ptr<ConstDict> const_dict_;
+  uint64_t split_dropped_ = 0;
+  bool profile_ = false;
+  uint64_t scan_time_ = 0;
+  size_t window_labels_ = 0;
+  size_t max_exprs_ = kDefaultStreamingExprs;
+  bool drop_caches_ = false;
 
 private:
   enum ast_node_t {
@@ -43,20 +140,98 @@ private:
   using expr_t = std::shared_ptr<rgd::AstNode>;
   using constraint_t = std::shared_ptr<rgd::Constraint>;
   using clause_t = std::vector<const rgd::AstNode*>;
-  using formula_t = std::vector<clause_t>;
 
   // caches
   std::vector<symsan::input_t> inputs_cache; // input cache
-  std::unordered_map<dfsan_label, expr_t> root_expr_cache; // label -> root expr
-  std::unordered_map<dfsan_label, constraint_t> constraint_cache; // label -> constraint
-  std::vector<uint32_t> ast_size_cache; // label -> size of the AST
-  std::vector<uint8_t> nested_cmp_cache; // label -> nested comparison
-  std::unordered_map<dfsan_label, uint8_t> concretize_node; // label -> concretize node
+  LruMap<dfsan_label, expr_t> root_expr_cache; // label -> root expr
+  LruMap<dfsan_label, constraint_t> constraint_cache; // label -> constraint
+  LabelTable<uint32_t> ast_size_cache; // label -> size of the AST
+  LabelTable<uint32_t> shape_key_cache; // label -> shape_key(), 0 if not computed
+  LabelTable<uint8_t> nested_cmp_cache; // label -> nested comparison
+  LabelTable<uint8_t> label_status_; // label -> kConcretize* and kLabelInvalid bits
+  // the structural caches above survive restart() when the input layout
+  // stays the same, seeds sharing a trace prefix produce the same labels
+  LabelTable<uint64_t> label_fp_cache; // label -> fingerprint of info and operands
+  size_t verified_labels_ = 0; // labels below are known to match this run
+  std::unordered_set<dfsan_label> added_constraints_; // add_constraints done this run
+  std::unique_ptr<ThreadPool> scan_pool_;
+  // backs the constraints and per-run exprs of the current seed
+  std::shared_ptr<AstArena> arena_;
+  // fewer new labels than this are not worth the round trip to the pool
+  static constexpr size_t kParallelScanLabels = 1 << 16;
+  static constexpr size_t kScanBlockLabels = 1 << 14;
 
   // dependencies tracking
   size_t input_size_; // record the whole input size
-  using input_dep_t = boost::dynamic_bitset<>;
-  std::vector<input_dep_t> branch_to_inputs; // label -> flattened input dependencies
+  using input_dep_t = DepSet::ptr;
+  LabelTable<input_dep_t> branch_to_inputs; // label -> flattened input dependencies, shared
+  // in streaming mode, what the labels below the window keep, in the slot
+  // of label modulo the (power of two) size of the table
+  struct label_summary_t {
+    dfsan_label label = 0; // 0 for an empty slot
+    uint32_t size = 0;
+    input_dep_t deps;
+  };
+  std::vector<label_summary_t> summaries_;
+  // the AST size of a label that's gone, larger than any that's parsed
+  static constexpr uint32_t kUnknownAstSize = 1U << 30;
+  inline const label_summary_t* find_summary(dfsan_label label) const {
+    if (summaries_.empty()) return nullptr;
+    auto &s = summaries_[label & (summaries_.size() - 1)];
+    return s.label == label ? &s : nullptr;
+  }
+  inline uint32_t label_size(dfsan_label label) const {
+    if (label == 0) return 1;
+    if (ast_size_cache.has(label)) return ast_size_cache[label];
+    auto *s = find_summary(label);
+    return s ? s->size : kUnknownAstSize;
+  }
+  inline void set_label_size(dfsan_label label, uint32_t size) {
+    if (ast_size_cache.has(label)) ast_size_cache[label] = size;
+    else if (auto *s = find_summary(label)) const_cast<label_summary_t*>(s)->size = size;
+  }
+  inline const input_dep_t& label_deps(dfsan_label label) const {
+    static const input_dep_t none;
+    if (branch_to_inputs.has(label)) return branch_to_inputs[label];
+    auto *s = find_summary(label);
+    return s ? s->deps : none;
+  }
+  // known not to read any input, so its value is the same on every input;
+  // a label that's gone isn't known
+  inline bool label_input_free(dfsan_label label) const {
+    if (branch_to_inputs.has(label)) return !branch_to_inputs[label];
+    auto *s = find_summary(label);
+    return s && !s->deps;
+  }
+  // the labels that are gone are left as they are, not searched for
+  // comparisons
+  inline uint8_t label_nested(dfsan_label label) const {
+    return nested_cmp_cache.has(label) ? nested_cmp_cache[label] : 0;
+  }
+  // the operands of a comparison too large to parse are concretized; a
+  // label that failed to parse for what it is (not for what the seed has,
+  // e.g., a memcmp's content) fails again, and so does every label over it
+  static constexpr uint8_t kConcretizeLeft = 1;
+  static constexpr uint8_t kConcretizeRight = 2;
+  static constexpr uint8_t kLabelInvalid = 4;
+  inline uint8_t label_status(dfsan_label label) const {
+    return label_status_.has(label) ? label_status_[label] : 0;
+  }
+  inline uint8_t label_concretized(dfsan_label label) const {
+    return label_status(label) & (kConcretizeLeft | kConcretizeRight);
+  }
+  inline bool label_invalid(dfsan_label label) const {
+    return label_status(label) & kLabelInvalid;
+  }
+  inline void mark_invalid(dfsan_label label) {
+    if (label_status_.has(label)) label_status_[label] |= kLabelInvalid;
+  }
+  // a label failing because its child does fails for what it is too
+  inline bool inherit_invalid(dfsan_label label, dfsan_label child) {
+    if (label_invalid(child)) mark_invalid(label);
+    return false;
+  }
+  void slide_window();
   // <input_id, offset> will be flattened to bit \sigma_{i=0}^{input_id}{size_of(input_i)} + offset
   inline size_t input_to_dep_idx(uint32_t input_id, uint32_t offset) {
     size_t idx = 0;
@@ -66,22 +241,69 @@ private:
     return idx + offset;
   }
   UnionFind data_flow_deps;
+  // the labels expanded by find_roots and do_uta_rel, reused across walks
+  LabelSet roots_visited_;
+  LabelSet uta_visited_;
+  // the labels find_roots is under, all of them over the one that failed
+  std::vector<dfsan_label> roots_stack_;
   std::vector<std::vector<expr_t> > input_to_branches;
+  std::vector<std::vector<expr_t> > byte_to_branches_; // only in slice mode
+  // the buckets filled since the last restart, the only ones to clear
+  std::vector<size_t> used_buckets_;
+  std::vector<size_t> used_byte_buckets_;
+  // keep the buckets from growing past twice the window
+  inline void trim_bucket(std::vector<expr_t> &bucket) {
+    if (nested_window_ && bucket.size() >= 2 * nested_window_) {
+      bucket.erase(bucket.begin(), bucket.end() - nested_window_);
+    }
+  }
 
-  [[nodiscard]] expr_t get_root_expr(dfsan_label label);
-  [[nodiscard]] bool scan_labels(dfsan_label label);
+  // rejected is set if the label failed to parse before, nullptr then
+  [[nodiscard]] expr_t get_root_expr(dfsan_label label, bool &rejected);
+  [[nodiscard]] bool scan_labels(dfsan_label label) {
+    if (!profile_) return do_scan_labels(label);
+    auto start = std::chrono::steady_clock::now();
+    bool ret = do_scan_labels(label);
+    scan_time_ += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return ret;
+  }
+  [[nodiscard]] bool do_scan_labels(dfsan_label label);
+  inline uint64_t label_fingerprint(dfsan_label label);
+  // see Constraint::digest
+  inline uint64_t label_digest(dfsan_label label, const AstNode *root) {
+    return ((uint64_t)get_label_info(label)->hash << 32) | root->hash();
+  }
+  void validate_labels(dfsan_label label);
+  [[nodiscard]] bool prescan_label(size_t i, uint64_t &fp, input_dep_t &deps);
+  size_t prescan_parallel(size_t start, size_t end, std::vector<uint64_t> &fps,
+                          std::vector<input_dep_t> &leaves);
   [[nodiscard]] int find_roots(dfsan_label label, AstNode *ret,
                                std::unordered_set<dfsan_label> &subroots);
   inline dfsan_label strip_zext(dfsan_label label);
   [[nodiscard]] int to_nnf(bool expected_r, rgd::AstNode *node);
-  void to_dnf(const rgd::AstNode *node, formula_t &formula);
-  [[nodiscard]] task_t construct_task(const clause_t &clause);
+  [[nodiscard]] bool within_dnf_budget(size_t clauses, size_t literals) const;
+  // the first query constraints of clause are those of the branch to flip,
+  // the rest are kept only if they share input bytes with them
+  [[nodiscard]] task_t construct_task(const clause_t &clause, size_t query = SIZE_MAX);
+  void split_components(SearchTask &task, std::vector<bool> const& in_query);
   [[nodiscard]] constraint_t parse_constraint(dfsan_label label);
+  [[nodiscard]] constraint_t parse_partial_constraint(dfsan_label label,
+                                                      uint32_t ast_size);
+  void collect_nested_clause(dfsan_label label, clause_t &nested_caluse);
+  bool collect_bucket(const std::vector<expr_t> &bucket,
+                      std::unordered_set<dfsan_label> &inserted,
+                      clause_t &nested_caluse);
+  bool collect_related_branches(const DepSet &deps,
+                                std::unordered_set<dfsan_label> &inserted,
+                                clause_t &nested_caluse);
   [[nodiscard]] bool do_uta_rel(dfsan_label label, rgd::AstNode *ret,
-                                constraint_t constraint,
-                                std::unordered_set<dfsan_label> &visited);
+                                constraint_t constraint, LabelSet &visited);
   uint32_t map_arg(uint32_t input_id, uint32_t offset, uint32_t length,
                    constraint_t constraint);
+  uint32_t shape_key(dfsan_label label, uint32_t size);
+  bool eval_input_free(dfsan_label label, uint64_t &val);
+  bool fold_operand(dfsan_label label, uint32_t kind, uint64_t &val);
 
   bool save_constraint(expr_t expr, bool result);
   inline void add_nested_constraint(task_t task, const clause_t &nested_caluse);
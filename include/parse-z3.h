@@ -1,9 +1,19 @@
 #pragma once
 
 #include "parse.h"
+#include "dep_set.h"
+#include "unsat_cores.h"
 
 #include <z3++.h>
 
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class ThreadPool;
+
 namespace symsan {
 
 using z3_task_t = std::vector<z3::expr>;
@@ -16,6 +26,11 @@ public:
   int restart(std::vector<input_t> &inputs) override;
   int parse_cond(dfsan_label label, bool result, bool add_nested,
                  std::vector<uint64_t> &tasks) override;
+  int parse_switch(dfsan_label label, uint64_t result,
+                   const std::vector<uint64_t> &cases,
+                   const std::vector<uint32_t> &targets,
+                   dfsan_label taken_label,
+                   std::vector<std::pair<uint32_t, uint64_t>> &tasks) override;
   int parse_gep(dfsan_label ptr_label, uptr ptr,
                 dfsan_label index_label, int64_t index,
                 uint64_t num_elems, uint64_t elem_size,
@@ -29,17 +44,31 @@ protected:
   const char* input_name_format;
   const char* atoi_name_format;
 
+  // the in-bounds tasks of symbolic indices, which ask for any value of
+  // index in [lb, ub) other than curr; keyed by task id
+  struct index_range {
+    z3::expr index;
+    uint64_t curr, lb, ub;
+  };
+  std::unordered_map<uint64_t, index_range> index_ranges_;
+
 private:
   // fsize flag
   bool has_fsize;
 
   // input deps
   using input_dep_set_t = std::unordered_set<offset_t, offset_hash>;
+  // shared among labels, offsets are keyed as (input << 32 | offset)
+  using label_deps_t = rgd::DepSet::ptr;
 
   // caches
   std::unordered_map<dfsan_label, uint32_t> tsize_cache_;
-  std::unordered_map<dfsan_label, input_dep_set_t> deps_cache_;
+  std::unordered_map<dfsan_label, label_deps_t> deps_cache_;
   std::unordered_map<dfsan_label, z3::expr> expr_cache_;
+  // the labels that failed to serialize this run, and the ones over them,
+  // rejected without going down again; not for a memcmp whose content the
+  // run didn't record
+  std::unordered_set<dfsan_label> invalid_labels_;
 
   // dependencies
   struct expr_hash {
@@ -74,13 +103,33 @@ private:
     offset_deps[off.second] = std::move(dep);
   }
 
-  inline z3::expr cache_expr(dfsan_label label, z3::expr const &e, input_dep_set_t &deps) {
+  // unions of the deps of two operands, labels built over the same pair of
+  // subexpressions share the result
+  struct dep_pair_hash {
+    std::size_t operator()(const std::pair<const void*, const void*> &p) const {
+      return std::hash<const void*>{}(p.first) * 31 + std::hash<const void*>{}(p.second);
+    }
+  };
+  struct dep_union {
+    label_deps_t lhs, rhs; // keep the keys alive
+    label_deps_t result;
+  };
+  std::unordered_map<std::pair<const void*, const void*>, dep_union, dep_pair_hash> dep_union_cache_;
+
+  static inline size_t dep_key(uint32_t input, uint32_t offset) {
+    return ((size_t)input << 32) | offset;
+  }
+
+  inline z3::expr cache_expr(dfsan_label label, z3::expr const &e, label_deps_t const &deps) {
     expr_cache_.insert({label, e});
     deps_cache_.insert({label, deps});
     return e;
   }
 
+  label_deps_t merge_deps(label_deps_t const &lhs, label_deps_t const &rhs);
   z3::expr read_concrete(dfsan_label label, uint16_t size);
+  z3::expr serialize(dfsan_label label, label_deps_t &deps);
+  z3::expr do_serialize(dfsan_label label, label_deps_t &deps);
   z3::expr serialize(dfsan_label label, input_dep_set_t &deps);
   inline void collect_more_deps(input_dep_set_t &deps);
   inline size_t add_nested_constraints(input_dep_set_t &deps, z3_task_t *task);
@@ -94,9 +143,10 @@ private:
 class Z3ParserSolver : public Z3AstParser {
 public:
   Z3ParserSolver() = delete;
-  Z3ParserSolver(void *base, size_t size, z3::context &context)
-      : Z3AstParser(base, size, context) {}
-  ~Z3ParserSolver() {}
+  Z3ParserSolver(void *base, size_t size, z3::context &context);
+  ~Z3ParserSolver();
+
+  int restart(std::vector<input_t> &inputs) override;
 
   struct solution_val {
     uint32_t id;
@@ -117,9 +167,71 @@ public:
 
   using solution_t = std::vector<struct solution_val>;
   solving_status solve_task(uint64_t task_id, unsigned timeout, solution_t &solutions);
+  // solves the in-bounds task of a symbolic index for up to k distinct values,
+  // the farthest from the current index first; other tasks are solved once
+  solving_status solve_index_task(uint64_t task_id, unsigned timeout, size_t k,
+                                  std::vector<solution_t> &solutions);
+
+  // solving on n worker threads, each task in a z3 context of its own that
+  // it's translated into on submit, as the parser's context can only be used
+  // from the parser's thread; 0 stops the workers once their tasks are done
+  void set_workers(unsigned n);
+  unsigned workers() const { return num_workers_; }
+  // queues a task for the workers, false if it's invalid or there are none
+  bool submit_task(uint64_t task_id, unsigned timeout);
+  // the result of a submitted task, in the order they're done; false if no
+  // task is pending, or if none is done yet and wait is false
+  bool poll_result(uint64_t &task_id, solving_status &status,
+                   solution_t &solutions, bool wait);
+  size_t pending() const { return pending_; }
+
+  // the first constraint of a task is checked on its own on a solver of
+  // the tactic chain (see z3_tactics.h), the nested ones still on the
+  // solver with the cores; null or "none" for none, false on an unknown
+  // tactic
+  bool set_tactics(const char *chain);
 
 private:
   void generate_solution(z3::model &m, solution_t &solutions);
+  // checks e alone on the tactic solver, or on solver_, which has it
+  // asserted already
+  z3::check_result check_first(z3::expr const &e, unsigned timeout,
+                               z3::model &m);
+
+  // the solver is kept across the tasks of a trace: nested constraints are
+  // asserted once, guarded by a literal that is only assumed by the tasks
+  // that need them, so what's learned about them carries over
+  static const size_t kMaxTrackedConstraints = 1 << 14;
+  struct tracked_constraint {
+    z3::expr expr; // keeps the id alive
+    z3::expr guard;
+  };
+  z3::solver solver_;
+  std::unordered_map<unsigned, tracked_constraint> tracked_;
+  // the chain, for the workers to build in their contexts, and its solver
+  std::string tactics_;
+  std::unique_ptr<z3::solver> tactic_solver_;
+  // the cores of the unsat tasks, by the structural hashes of their
+  // constraints, so the tasks with one of them aren't solved again
+  rgd::UnsatCoreCache unsat_cores_;
+
+  z3::expr track_constraint(z3::expr const &e);
+
+  struct async_job;
+  struct async_result {
+    uint64_t task_id;
+    solving_status status;
+    solution_t solutions;
+  };
+  void solve_async(async_job &job);
+
+  unsigned num_workers_ = 0;
+  std::unique_ptr<ThreadPool> workers_;
+  // submitted and not yet polled, only touched by the parser's thread
+  size_t pending_ = 0;
+  std::mutex results_lock_;
+  std::condition_variable results_cv_;
+  std::deque<async_result> results_;
 
 };
 
@@ -27,19 +27,54 @@ struct offset_hash {
   }
 };
 
+// memcmp content of a trace, in chunks that are kept across traces so
+// recording it doesn't allocate once they've grown to fit
+class MemcmpArena {
+public:
+  // size bytes that stay valid until the next clear
+  uint8_t* alloc(size_t size) {
+    while (cur_ < chunks_.size() && used_ + size > chunks_[cur_].second) {
+      cur_++;
+      used_ = 0;
+    }
+    if (cur_ == chunks_.size()) {
+      size_t chunk_size = size > kChunkSize ? size : kChunkSize;
+      chunks_.emplace_back(std::make_unique<uint8_t[]>(chunk_size), chunk_size);
+      used_ = 0;
+    }
+    uint8_t *p = chunks_[cur_].first.get() + used_;
+    used_ += size;
+    return p;
+  }
+
+  void clear() {
+    cur_ = 0;
+    used_ = 0;
+  }
+
+private:
+  static const size_t kChunkSize = 64 * 1024;
+
+  std::vector<std::pair<std::unique_ptr<uint8_t[]>, size_t>> chunks_;
+  size_t cur_ = 0;
+  size_t used_ = 0;
+};
+
 template <class T>
 class ASTParser {
 public:
   ASTParser() = delete;
   ASTParser(void *base, size_t size)
     : base_(static_cast<dfsan_label_info*>(base)),
-      size_(size / sizeof(dfsan_label_info)),
+      operands_(get_label_operands_base(base, size)),
+      size_(size / (sizeof(dfsan_label_info) + sizeof(dfsan_label_operands))),
       prev_task_id_(0) {}
   virtual ~ASTParser() {}
 
   virtual int restart(std::vector<input_t> &inputs) {
     (void)inputs;
     memcmp_cache_.clear();
+    memcmp_content_.clear();
     return 0;
   }
   /// @brief Parse a conditional branch
@@ -50,6 +85,20 @@ public:
   /// @return 0 on success, -1 on failure
   virtual int parse_cond(dfsan_label label, bool result, bool add_nested,
                          std::vector<uint64_t> &tasks) = 0;
+  /// @brief Parse a switch with a symbolic condition, all at once
+  /// @param label the label of the condition
+  /// @param result the concrete value of the condition
+  /// @param cases the case values, zero extended to 64 bits
+  /// @param targets indices of the cases to reach, cases.size() for the default
+  /// @param taken_label label of (condition == result) if a case is taken,
+  ///        added as a nested constraint, 0 otherwise
+  /// @param tasks the tasks to be added, each with the target it reaches
+  /// @return 0 on success, -1 on failure
+  virtual int parse_switch(dfsan_label label, uint64_t result,
+                           const std::vector<uint64_t> &cases,
+                           const std::vector<uint32_t> &targets,
+                           dfsan_label taken_label,
+                           std::vector<std::pair<uint32_t, uint64_t>> &tasks) = 0;
   /// @brief Parse a GEP instruction with symbolic index
   /// @param ptr_label symbol label of the pointer (e.g., bounds info)
   /// @param ptr actual pointer value
@@ -74,9 +123,21 @@ public:
   virtual int add_constraints(dfsan_label label, uint64_t result) = 0;
 
   virtual int record_memcmp(dfsan_label label, uint8_t* buf, size_t size) {
-    auto content = std::make_unique<uint8_t[]>(size);
-    memcpy(content.get(), buf, size);
-    memcmp_cache_.insert({label, std::move(content)});
+    uint8_t *content = memcmp_buffer(size);
+    memcpy(content, buf, size);
+    return record_memcmp_ref(label, content);
+  };
+
+  /// @brief A buffer for memcmp content that stays valid until the next
+  /// restart, to read the content into and record with record_memcmp_ref
+  uint8_t* memcmp_buffer(size_t size) {
+    return memcmp_content_.alloc(size);
+  }
+
+  /// @brief Record the memcmp content without copying it, e.g., from the
+  /// shm blob area; buf must stay valid until the next restart
+  virtual int record_memcmp_ref(dfsan_label label, const uint8_t* buf) {
+    memcmp_cache_.insert({label, buf});
     return 0;
   };
 
@@ -99,6 +160,22 @@ protected:
     return &base_[label];
   }
 
+  inline dfsan_label_operands* get_label_operands(dfsan_label label) {
+    if (label >= size_) {
+      throw std::out_of_range("label too large " + std::to_string(label));
+    }
+    return &operands_[label];
+  }
+
+  // the union table is far larger than the caches, so a walk fetches the
+  // records of the children before it gets to them
+  inline void prefetch_label(dfsan_label label) {
+    if (label < size_) {
+      __builtin_prefetch(&base_[label]);
+      __builtin_prefetch(&operands_[label]);
+    }
+  }
+
   inline uint64_t save_task(std::shared_ptr<T> task) {
     uint64_t tid = prev_task_id_++;
     tasks_.insert({tid, task});
@@ -106,10 +183,12 @@ protected:
   }
 
   dfsan_label_info *base_;
+  dfsan_label_operands *operands_;
   size_t size_;
   uint64_t prev_task_id_;
   std::unordered_map<uint64_t, std::shared_ptr<T>> tasks_;
-  std::unordered_map<dfsan_label, std::unique_ptr<uint8_t[]>> memcmp_cache_;
+  std::unordered_map<dfsan_label, const uint8_t*> memcmp_cache_;
+  MemcmpArena memcmp_content_; // copied content
 };
 
 }; // namespace symsan
@@ -0,0 +1,55 @@
+#pragma once
+
+// USDT probes of the "symsan" provider, for perf and bpftrace on a release
+// build; built in with -DSYMSAN_USDT=ON, which needs sys/sdt.h (systemtap's
+// sdt headers), and compiled out otherwise. A probe is a nop until a tracer
+// attaches to it, and its arguments are only read then, so they shouldn't
+// be computed for it alone; the calls with a duration have a _begin and an
+// _end probe instead of a timestamp, e.g.:
+//
+//   $ bpftrace -e 'usdt:./target:symsan:parse_cond_begin { @s[tid] = nsecs }
+//       usdt:./target:symsan:parse_cond_end /@s[tid]/ {
+//         @us = hist((nsecs - @s[tid]) / 1000); delete(@s[tid]) }'
+//
+// See the README for the list of probes and their arguments.
+
+#if SYMSAN_USDT
+
+#include <sys/sdt.h>
+
+#define SYMSAN_PROBE(name) DTRACE_PROBE(symsan, name)
+#define SYMSAN_PROBE1(name, a) DTRACE_PROBE1(symsan, name, a)
+#define SYMSAN_PROBE2(name, a, b) DTRACE_PROBE2(symsan, name, a, b)
+#define SYMSAN_PROBE3(name, a, b, c) DTRACE_PROBE3(symsan, name, a, b, c)
+#define SYMSAN_PROBE4(name, a, b, c, d) DTRACE_PROBE4(symsan, name, a, b, c, d)
+#define SYMSAN_PROBE5(name, a, b, c, d, e) \
+  DTRACE_PROBE5(symsan, name, a, b, c, d, e)
+
+#ifdef __cplusplus
+namespace symsan {
+// runs a probe when the scope is left, for the functions with more than
+// one return
+template <typename F>
+struct probe_on_exit {
+  F f;
+  ~probe_on_exit() { f(); }
+};
+template <typename F>
+probe_on_exit<F> make_probe_on_exit(F f) { return {f}; }
+}
+// the probe statement runs with the locals as they are on the way out
+#define SYMSAN_PROBE_ON_EXIT(stmt) \
+  auto &&symsan_probe_on_exit_ = ::symsan::make_probe_on_exit([&] { stmt; })
+#endif
+
+#else
+
+#define SYMSAN_PROBE(name) do { } while (0)
+#define SYMSAN_PROBE1(name, a) do { } while (0)
+#define SYMSAN_PROBE2(name, a, b) do { } while (0)
+#define SYMSAN_PROBE3(name, a, b, c) do { } while (0)
+#define SYMSAN_PROBE4(name, a, b, c, d) do { } while (0)
+#define SYMSAN_PROBE5(name, a, b, c, d, e) do { } while (0)
+#define SYMSAN_PROBE_ON_EXIT(stmt) do { } while (0)
+
+#endif
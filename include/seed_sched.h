@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <unordered_map>
+
+namespace rgd {
+
+// decides whether a seed AFL++ moved on to is worth tracing now, from how
+// many tasks the traces of earlier seeds that look alike (by size, depth in
+// the queue, and whether AFL++ favors them) made per ms of tracing; a seed
+// from a bucket yielding far less than the average is deferred to a later
+// visit, so the traces go to the more promising seeds first, and one from
+// a bucket that never made a task is skipped; every kExplore-th seed of
+// a bucket held back is traced anyway, so a bucket can make up for a bad
+// start
+class SeedScheduler {
+public:
+  enum decision_t { TRACE, DEFER, SKIP };
+
+  // a seed is traced anyway once it's been deferred that many times
+  static const uint32_t kMaxDefers = 4;
+  // traces of a bucket before it's judged
+  static const uint32_t kMinTraces = 16;
+  // deferred below this fraction of the average yield
+  static constexpr double kDeferRatio = 0.25;
+  static const uint32_t kExplore = 16;
+
+  struct seed_info_t {
+    uint32_t id;
+    size_t len;
+    uint32_t depth;
+    bool favored;
+  };
+
+  decision_t decide(seed_info_t const& seed) {
+    auto &b = buckets_[bucket(seed)];
+    if (b.traces < kMinTraces) return TRACE;
+    if (b.tasks > 0 && b.yield() >= total_.yield() * kDeferRatio) return TRACE;
+    if (++b.held % kExplore == 0) return TRACE;
+    if (b.tasks == 0) return SKIP;
+    auto &defers = defers_[seed.id];
+    if (defers >= kMaxDefers) {
+      defers_.erase(seed.id);
+      return TRACE;
+    }
+    defers++;
+    return DEFER;
+  }
+
+  void record(seed_info_t const& seed, uint64_t trace_us, size_t tasks) {
+    auto &b = buckets_[bucket(seed)];
+    b.add(trace_us, tasks);
+    total_.add(trace_us, tasks);
+    defers_.erase(seed.id);
+  }
+
+private:
+  struct stats_t {
+    uint64_t traces = 0;
+    uint64_t tasks = 0;
+    uint64_t time = 0;
+    uint64_t held = 0;
+    void add(uint64_t us, size_t n) {
+      traces += 1;
+      tasks += n;
+      time += us;
+    }
+    // tasks per ms of tracing
+    double yield() const {
+      return (double)tasks * 1000 / (time + 1);
+    }
+  };
+
+  static uint32_t bucket(seed_info_t const& seed) {
+    uint32_t len_class = seed.len <= 256 ? 0 : seed.len <= 4096 ? 1 :
+                         seed.len <= 65536 ? 2 : 3;
+    uint32_t depth_class = seed.depth <= 2 ? 0 : seed.depth <= 8 ? 1 : 2;
+    return len_class | (depth_class << 2) | ((uint32_t)seed.favored << 4);
+  }
+
+  stats_t total_;
+  std::unordered_map<uint32_t, stats_t> buckets_;
+  std::unordered_map<uint32_t, uint32_t> defers_;
+};
+
+}; // namespace rgd
@@ -0,0 +1,27 @@
+#ifndef SYMSAN_SNAPSHOT_H
+#define SYMSAN_SNAPSHOT_H
+
+#include <stdint.h>
+
+/// Snapshot of a run at a branch the consumer marked with BRANCH_SNAPSHOT
+/// in the branch filter: the runtime forks a copy of the target that stays
+/// dormant at the branch, and sends a snapshot_msg with the control socket
+/// of the copy attached (SCM_RIGHTS) on SNAPSHOT_FD. The copy serves run
+/// requests on that socket like the forkserver does, the event pipe and
+/// the new input fd attached to each, and the child of a request resumes
+/// the target from the branch on the new input. That is only sound for an
+/// input of the same size that agrees with the snapshot's on the bytes
+/// read before the branch, the first consumed ones. Closing the socket
+/// ends the copy.
+
+// fixed fd of the snapshot socket in the target, similar to FORKSRV_CTL_FD
+#define SNAPSHOT_FD 197
+
+struct snapshot_msg {
+  uint32_t id;        // of the branch
+  int32_t pid;        // of the dormant copy
+  uint64_t consumed;  // input bytes read before the branch
+  uint64_t size;      // of the input
+};
+
+#endif /* !SYMSAN_SNAPSHOT_H */
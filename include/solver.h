@@ -1,15 +1,28 @@
 #pragma once
 
+#include "number.h"
+#include "const_dict.h"
 #include "task.h"
+#include "unsat_cores.h"
 
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <z3++.h>
 
+#include <algorithm>
+#include <string>
 #include <vector>
 #include <unordered_map>
 #include <utility>
 #include <memory>
 #include <atomic>
+#include <mutex>
+#include <unordered_set>
+
+class ThreadPool;
+struct Btor;
+struct BoolectorNode;
 
 namespace rgd {
 
@@ -20,44 +33,332 @@ enum solver_result_t {
   SOLVER_TIMEOUT,
 };
 
+// a solution as the edits to the input it was solved on, so it can be
+// applied to a copy of the input that is kept around (and undone again)
+// instead of copying the whole input for every solution: the bytes set,
+// then at most one range replaced by bytes of another length, e.g., a
+// number printed with more digits than the one it replaces
+struct patch_t {
+  solution_map_t bytes;
+  bool spliced = false;
+  size_t splice_offset = 0;
+  size_t splice_len = 0; // of the range replaced
+  std::vector<uint8_t> splice;
+
+  void clear() {
+    bytes.clear();
+    spliced = false;
+    splice.clear();
+  }
+  void set(size_t offset, uint8_t value) { bytes[offset] = value; }
+  void replace(size_t offset, size_t len, const uint8_t *data, size_t size) {
+    spliced = true;
+    splice_offset = offset;
+    splice_len = len;
+    splice.assign(data, data + size);
+  }
+  // the byte at offset with the bytes set, but not the splice
+  uint8_t get(const uint8_t *in_buf, size_t offset) const {
+    auto itr = bytes.find(offset);
+    return itr != bytes.end() ? itr->second : in_buf[offset];
+  }
+  size_t size(size_t in_size) const {
+    return spliced ? in_size - splice_len + splice.size() : in_size;
+  }
+
+  // writes the patched input to out_buf, returns its size
+  size_t write(const uint8_t *in_buf, size_t in_size, uint8_t *out_buf) const {
+    if (!spliced) {
+      memcpy(out_buf, in_buf, in_size);
+      for (auto const &[offset, value] : bytes) out_buf[offset] = value;
+      return in_size;
+    }
+    size_t end = splice_offset + splice_len;
+    memcpy(out_buf, in_buf, splice_offset);
+    memcpy(out_buf + splice_offset, splice.data(), splice.size());
+    memcpy(out_buf + splice_offset + splice.size(), in_buf + end, in_size - end);
+    for (auto const &[offset, value] : bytes) {
+      if (offset < splice_offset) out_buf[offset] = value;
+      else if (offset >= end) out_buf[offset - splice_len + splice.size()] = value;
+    }
+    return size(in_size);
+  }
+
+  // applies the bytes set to buf, a copy of the input, in place, saving the
+  // ones they overwrite to undo; false if the patch has a splice, which
+  // moves the rest of the input
+  bool apply(uint8_t *buf, std::vector<std::pair<size_t, uint8_t>> &undo) const {
+    if (spliced) return false;
+    for (auto const &[offset, value] : bytes) {
+      undo.push_back({offset, buf[offset]});
+      buf[offset] = value;
+    }
+    return true;
+  }
+  static void revert(uint8_t *buf, std::vector<std::pair<size_t, uint8_t>> &undo) {
+    for (auto itr = undo.rbegin(); itr != undo.rend(); ++itr) buf[itr->first] = itr->second;
+    undo.clear();
+  }
+
+  // spreads the change of a sum of n bytes at offset to val, mod 2^(8 *
+  // length), over the bytes, each as far as it goes, first to last
+  void add_sum(const uint8_t *in_buf, size_t in_size, size_t offset,
+               uint32_t length, uint32_t n, uint64_t val) {
+    n = (uint32_t)std::min((size_t)n, in_size - offset);
+    uint64_t m = length >= 8 ? ~0ULL : (1ULL << (8 * length)) - 1;
+    uint64_t cur = 0, max = 255ULL * n;
+    for (uint32_t i = 0; i < n; i++) cur += get(in_buf, offset + i);
+    // the reachable sum closest to the current one that wraps to val
+    uint64_t want = (cur & ~m) | (val & m);
+    if (want > max && m < max) want -= m + 1;
+    if (want > max) return;
+    for (uint32_t i = 0; i < n && want != cur; i++) {
+      uint8_t b = get(in_buf, offset + i);
+      uint64_t d = want > cur ? std::min<uint64_t>(want - cur, 255 - b)
+                              : std::min<uint64_t>(cur - want, b);
+      set(offset + i, want > cur ? b + d : b - d);
+      cur = want > cur ? cur + d : cur - d;
+    }
+  }
+
+  // turns the solved bytes of the atoi results of task back into strings
+  // of digits, written over the ones they replace; a number with more
+  // digits than the one it replaces is spliced in, the others are padded
+  // with zeros to its width, so the rest of the input stays where it was
+  void add_atoi(const SearchTask &task, const uint8_t *in_buf, size_t in_size) {
+    for (auto const &[offset, info] : task.atoi_info) {
+      uint64_t val = 0;
+      uint32_t length = std::get<0>(info);
+      for (auto i = length; i != 0; --i) {
+        auto itr = bytes.find(offset + i - 1);
+        if (itr != bytes.end())
+          val |= (uint64_t)itr->second << (8 * (i - 1));
+      }
+      // the solved bytes are the number, not the string
+      for (uint32_t i = 0; i < length && offset + i < in_size; i++)
+        set(offset + i, in_buf[offset + i]);
+      if (offset >= in_size) continue;
+      uint32_t base = std::get<1>(info);
+      if (base == ATOI_SUM_BASE) {
+        add_sum(in_buf, in_size, offset, length, std::get<2>(info), val);
+        continue;
+      }
+      if (base == 0) {
+        // strlen, the string now ends after val bytes
+        size_t end = val < in_size - offset ? offset + val : in_size;
+        for (size_t i = offset; i < end; i++) {
+          if (get(in_buf, i) == 0) set(i, 'A');
+        }
+        if (end < in_size) set(end, 0);
+        continue;
+      }
+      char digits[kMaxNumberLen];
+      size_t width = std::min((size_t)std::get<2>(info), in_size - offset);
+      size_t n = encode_number(val, base, length, width, digits);
+      if (n == 0) {
+        fprintf(stderr, "unsupported base %d\n", base);
+      } else if (n <= width) {
+        for (size_t i = 0; i < n; i++) set(offset + i, digits[i]);
+      } else if (!spliced) {
+        replace(offset, width, (const uint8_t *)digits, n);
+      } else {
+        // as snprintf to the rest of the input would
+        n = std::min(n, in_size - offset - 1);
+        for (size_t i = 0; i < n; i++) set(offset + i, digits[i]);
+        set(offset + n, 0);
+      }
+    }
+  }
+};
+
+// I2SSolver and JITSolver can be used by several threads at once, while
+// each thread needs a Z3Solver of its own
 class Solver {
 public:
   virtual ~Solver() {};
+  // the solution is returned as a patch to in_buf
   virtual solver_result_t solve(std::shared_ptr<SearchTask> task,
                                 const uint8_t *in_buf, size_t in_size,
-                                uint8_t *out_buf, size_t &out_size) = 0;
+                                patch_t &patch) = 0;
+  // the same, writing the patched input to out_buf
+  solver_result_t solve(std::shared_ptr<SearchTask> task,
+                        const uint8_t *in_buf, size_t in_size,
+                        uint8_t *out_buf, size_t &out_size) {
+    patch_t patch;
+    solver_result_t ret = solve(task, in_buf, in_size, patch);
+    if (ret == SOLVER_SAT) out_size = patch.write(in_buf, in_size, out_buf);
+    return ret;
+  }
+  // up to n other solutions of task, which this solver has just solved,
+  // each differing from task->solution and the others in some byte the
+  // task reads; for the solvers that can look for more, returns how many
+  virtual size_t solve_more(std::shared_ptr<SearchTask> task,
+                            const uint8_t *in_buf, size_t in_size,
+                            size_t n, std::vector<patch_t> &patches) {
+    return 0;
+  }
+  // tasks about to be queued for solving, so per task setup can be batched
+  virtual void prepare(std::vector<std::shared_ptr<SearchTask>> const& tasks) {}
+  // hands back what the solver keeps across tasks, e.g., over a memory limit
+  virtual void drop_caches() {}
   virtual void print_stats(int fd) = 0;
+  // short name, the prefix of the solver's keys in the stats file
+  virtual const char* name() const = 0;
+  // the solver's own counters as "<name>_<key> : <value>" lines, like
+  // AFL++'s fuzzer_stats
+  virtual void write_stats(int fd) {}
+  // where the cores of unsat tasks go, by the fingerprints of their
+  // constraints, if the solver can tell them
+  void set_unsat_cores(std::shared_ptr<UnsatCoreCache> cores) {
+    unsat_cores_ = std::move(cores);
+  }
+protected:
+  std::shared_ptr<UnsatCoreCache> unsat_cores_;
 };
 
 class Z3Solver : public Solver {
 public:
-  Z3Solver();
+  using expr_cache_t = std::unordered_map<uint64_t, z3::expr>;
+  // the tasks are checked on a solver of the tactic chain, if given (see
+  // z3_tactics.h), unless their unsat cores are asked for
+  explicit Z3Solver(const char *tactics = nullptr);
+  using Solver::solve;
   solver_result_t solve(std::shared_ptr<SearchTask> task,
                         const uint8_t *in_buf, size_t in_size,
-                        uint8_t *out_buf, size_t &out_size) override;
+                        patch_t &patch) override;
+  // checks again with the solutions so far blocked on the task's bytes
+  size_t solve_more(std::shared_ptr<SearchTask> task,
+                    const uint8_t *in_buf, size_t in_size,
+                    size_t n, std::vector<patch_t> &patches) override;
+  void drop_caches() override;
   void print_stats(int fd) override {} ;
+  const char* name() const override { return "z3"; }
+  // what Z3 has allocated, for all the contexts of the process
+  static size_t allocated_bytes();
+  // the chain it was made with, "" for none
+  const char* tactics() const { return tactics_.c_str(); }
 private:
   z3::expr serialize_rel(uint32_t comparison,
                          const AstNode* node,
                          const std::vector<std::pair<bool, uint64_t>> &input_args,
-                         std::unordered_map<uint32_t,z3::expr> &expr_cache);
+                         expr_cache_t &expr_cache);
 
   z3::expr serialize(const AstNode* node,
                      const std::vector<std::pair<bool, uint64_t>> &input_args,
-                     std::unordered_map<uint32_t,z3::expr> &expr_cache);
+                     expr_cache_t &expr_cache);
+
+  // the solver the task is checked on
+  z3::solver& query_solver() {
+    return unsat_cores_ || !tactic_solver_ ? solver_ : *tactic_solver_;
+  }
 
-  z3::context &context_;
+  z3::context context_;
   z3::solver solver_;
+  std::string tactics_;
+  std::unique_ptr<z3::solver> tactic_solver_;
+  // serialized expressions, kept across the tasks of a trace
+  expr_cache_t expr_cache_;
+  std::shared_ptr<AstArena> cache_arena_;
+};
+
+// the same queries on Boolector, which is often faster on QF_BV; only
+// built if the library is found (SYMSAN_HAS_BOOLECTOR)
+class BtorSolver : public Solver {
+public:
+  using expr_cache_t = std::unordered_map<uint64_t, BoolectorNode*>;
+  BtorSolver();
+  ~BtorSolver();
+  using Solver::solve;
+  solver_result_t solve(std::shared_ptr<SearchTask> task,
+                        const uint8_t *in_buf, size_t in_size,
+                        patch_t &patch) override;
+  void drop_caches() override;
+  void print_stats(int fd) override {}
+  const char* name() const override { return "btor"; }
+private:
+  void reset();
+  BoolectorNode* input(uint32_t offset);
+  BoolectorNode* bv_val(uint64_t val, uint32_t bits);
+  BoolectorNode* serialize_rel(uint32_t comparison, const AstNode* node,
+                               const std::vector<std::pair<bool, uint64_t>> &input_args);
+  BoolectorNode* serialize(const AstNode* node,
+                           const std::vector<std::pair<bool, uint64_t>> &input_args);
+
+  // nodes are owned by btor_ and only released along with it, when the
+  // cache is dropped for the tasks of another trace
+  Btor *btor_ = nullptr;
+  std::unordered_map<uint32_t, BoolectorNode*> inputs_;
+  expr_cache_t expr_cache_;
+  std::shared_ptr<AstArena> cache_arena_;
+  uint64_t deadline_ = 0;
 };
 
 class JITSolver : public Solver {
 public:
-  JITSolver();
+  // with async_jit, cache misses are JIT'ed by a background thread and
+  // interpreted until the code is ready; with search_threads > 1, each task
+  // is searched from that many start points at once; the cache of JIT'ed
+  // functions, shared by all instances, evicts entries once their code
+  // takes more than cache_size bytes (0 for no limit), as set by the first
+  JITSolver(bool async_jit = false, unsigned search_threads = 1,
+            size_t cache_size = 0);
+  ~JITSolver();
+  using Solver::solve;
   solver_result_t solve(std::shared_ptr<SearchTask> task,
                         const uint8_t *in_buf, size_t in_size,
-                        uint8_t *out_buf, size_t &out_size) override;
+                        patch_t &patch) override;
+  // searches again from random start points
+  size_t solve_more(std::shared_ptr<SearchTask> task,
+                    const uint8_t *in_buf, size_t in_size,
+                    size_t n, std::vector<patch_t> &patches) override;
+  void prepare(std::vector<std::shared_ptr<SearchTask>> const& tasks) override;
   void print_stats(int fd) override;
+  const char* name() const override { return "jit"; }
+  void write_stats(int fd) override;
+  // compile with quick codegen first, and again with the IR optimizations
+  // once the searches have evaluated a constraint evals times, 0 compiles
+  // everything once with the default codegen
+  void set_hot_threshold(uint64_t evals) { hot_evals = evals; }
+  // JIT one function evaluating all the constraints of each task with at
+  // least that many constraints, 0 evaluates them one by one
+  void set_fusion_threshold(size_t constraints) { fuse_constraints = constraints; }
+  // search each task for up to us microseconds, instead of for a fixed
+  // number of evaluations of its constraints; 0 for the latter
+  void set_task_budget(uint64_t us) { task_budget_us = us; }
+  // the constants the restarts of all the searches start from in part,
+  // shared by all instances; set before solving
+  void set_const_dict(std::shared_ptr<const ConstDict> dict);
+  // time spent JIT'ing and in the gradient search so far, in us
+  uint64_t jit_us() const { return jit_time.load(); }
+  uint64_t search_us() const { return solving_time.load(); }
+  // the code of the JIT'ed functions of all the instances, in bytes
+  static size_t code_bytes();
 private:
+  using constraint_t = std::shared_ptr<const Constraint>;
+  void jit_batch(std::vector<constraint_t> const& constraints);
+  void jit_async(constraint_t const& c);
+  void jit_optimized(constraint_t const& c);
+  void jit_task(std::shared_ptr<SearchTask> const& task);
+  bool search(std::shared_ptr<SearchTask> task);
+  solver_result_t solve_components(std::shared_ptr<SearchTask> task,
+                                   const uint8_t *in_buf, size_t in_size,
+                                   patch_t &patch);
+
+  std::unique_ptr<ThreadPool> compile_pool;
+  std::mutex pending_lock;
+  std::unordered_set<uint32_t> pending_shapes;
+  // runs the searches from the other start points
+  std::unique_ptr<ThreadPool> search_pool;
+  unsigned search_threads;
+  uint64_t hot_evals;
+  size_t fuse_constraints;
+  uint64_t task_budget_us;
+  // the solutions of the components solved so far, of any task, by their
+  // fingerprint; they only read their own bytes, so they hold on any seed
+  static const size_t kMaxComponentSolutions = 1 << 16;
+  std::mutex component_lock;
+  std::unordered_map<uint64_t, solution_map_t> component_solutions;
+
   std::atomic_ulong uuid;
   std::atomic_ulong cache_hits;
   std::atomic_ulong cache_misses;
@@ -66,19 +367,93 @@ private:
   std::atomic_ulong process_time;
   std::atomic_ulong jit_time;
   std::atomic_ulong solving_time;
+  std::atomic_ulong num_interpreted;
+  std::atomic_ulong num_optimized;
+  std::atomic_ulong num_fused;
+  std::atomic_ulong num_split;
+  std::atomic_ulong component_hits;
 };
 
 class I2SSolver : public Solver {
 public:
   I2SSolver();
+  using Solver::solve;
   solver_result_t solve(std::shared_ptr<SearchTask> task,
                         const uint8_t *in_buf, size_t in_size,
-                        uint8_t *out_buf, size_t &out_size) override;
+                        patch_t &patch) override;
   void print_stats(int fd) override {};
+  const char* name() const override { return "i2s"; }
+  void write_stats(int fd) override;
 private:
-  uint64_t matches;
-  uint64_t mismatches;
+  solver_result_t solve_one(std::shared_ptr<const Constraint> const& c,
+                            ConsMeta const& cm, uint32_t comparison,
+                            const uint8_t *in_buf, size_t in_size,
+                            patch_t &patch);
+  solver_result_t solve_conjunction(std::shared_ptr<SearchTask> task,
+                                    const uint8_t *in_buf, size_t in_size,
+                                    patch_t &patch);
+
+  std::atomic_ulong matches;
+  std::atomic_ulong mismatches;
   std::bitset<rgd::LastOp> binop_mask;
 };
 
+// equalities whose sides read a value through a chain of invertible
+// operations, e.g., ((x + 3) ^ 0x5a) << 1 == K, are solved by walking the
+// chain down to the value, undoing each operation on the other side
+class InverseSolver : public Solver {
+public:
+  InverseSolver(): solved_tasks(0), not_invertible(0) {}
+  using Solver::solve;
+  solver_result_t solve(std::shared_ptr<SearchTask> task,
+                        const uint8_t *in_buf, size_t in_size,
+                        patch_t &patch) override;
+  void print_stats(int fd) override {};
+  const char* name() const override { return "inverse"; }
+  void write_stats(int fd) override;
+private:
+  std::atomic_ulong solved_tasks;
+  std::atomic_ulong not_invertible;
+};
+
+// constraints that are linear (mod 2^n) in the input values they read,
+// e.g., length fields, offsets and sums, are solved in closed form, one
+// value at a time with the rest of the input fixed, instead of searched
+class LinearSolver : public Solver {
+public:
+  LinearSolver(): solved_tasks(0), nonlinear(0) {}
+  using Solver::solve;
+  solver_result_t solve(std::shared_ptr<SearchTask> task,
+                        const uint8_t *in_buf, size_t in_size,
+                        patch_t &patch) override;
+  void print_stats(int fd) override {};
+  const char* name() const override { return "linear"; }
+  void write_stats(int fd) override;
+private:
+  std::atomic_ulong solved_tasks;
+  std::atomic_ulong nonlinear;
+};
+
+// memcmps against a buffer recorded with the trace, e.g., magic strings,
+// are solved by writing the buffer over the input bytes they compare (or,
+// for the ones that have to differ, changing one of those bytes), and the
+// other constraints of the task checked on the result
+class MemcmpSolver : public Solver {
+public:
+  MemcmpSolver(): solved_tasks(0), not_direct(0), conflicts(0),
+                  nested_failed(0) {}
+  using Solver::solve;
+  solver_result_t solve(std::shared_ptr<SearchTask> task,
+                        const uint8_t *in_buf, size_t in_size,
+                        patch_t &patch) override;
+  void print_stats(int fd) override {};
+  const char* name() const override { return "memcmp"; }
+  void write_stats(int fd) override;
+private:
+  std::atomic_ulong solved_tasks;
+  std::atomic_ulong not_direct;
+  std::atomic_ulong conflicts;
+  std::atomic_ulong nested_failed;
+};
+
 }; // namespace rgd
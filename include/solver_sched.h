@@ -0,0 +1,104 @@
+#pragma once
+
+#include "task.h"
+#include "solver.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <mutex>
+#include <numeric>
+#include <unordered_map>
+#include <vector>
+
+namespace rgd {
+
+// picks the order of the solvers for each task, from how each of them did on
+// earlier tasks that look alike; tasks are bucketed by a few cheap features
+// (number of constraints and input bytes, nonlinear ops, memcmp, atoi), and
+// a solver is tried before the others if it's expected to spend less time
+// per task it settles (SAT or UNSAT)
+class SolverScheduler {
+public:
+  // a solver that hasn't settled any of its first kGiveUp tasks of a bucket
+  // is only tried there once every kExplore tasks
+  static const uint32_t kGiveUp = 64;
+  static const uint32_t kExplore = 32;
+
+  SolverScheduler(size_t num_solvers) : num_solvers(num_solvers) {}
+
+  // the solvers to try on task, in order
+  std::vector<size_t> order(task_t const& task) {
+    uint32_t b = bucket(task);
+    std::vector<size_t> res(num_solvers);
+    std::iota(res.begin(), res.end(), 0);
+    std::lock_guard<std::mutex> lock(stats_lock);
+    auto &s = get_stats(b);
+    // a stable sort keeps the configured order among the untried ones
+    std::stable_sort(res.begin(), res.end(), [&s](size_t a, size_t b) {
+      return s[a].cost() < s[b].cost();
+    });
+    size_t cheapest = res[0];
+    res.erase(std::remove_if(res.begin(), res.end(), [&s](size_t i) {
+      auto &st = s[i];
+      if (st.attempts < kGiveUp || st.settled > 0) return false;
+      return (st.skipped++ % kExplore) != 0;
+    }), res.end());
+    if (res.empty()) res.push_back(cheapest);
+    return res;
+  }
+
+  void record(task_t const& task, size_t solver, solver_result_t result,
+              uint64_t us) {
+    uint32_t b = bucket(task);
+    std::lock_guard<std::mutex> lock(stats_lock);
+    auto &st = get_stats(b)[solver];
+    st.attempts += 1;
+    st.time += us;
+    if (result == SOLVER_SAT || result == SOLVER_UNSAT) st.settled += 1;
+  }
+
+private:
+  struct stats_t {
+    uint64_t attempts = 0;
+    uint64_t settled = 0;
+    uint64_t time = 0;
+    uint64_t skipped = 0;
+    // expected time spent per settled task, the untried ones cost next to
+    // nothing so they get a go first
+    double cost() const {
+      return (double)(time + 1) / (settled + 1);
+    }
+  };
+
+  static uint32_t bucket(task_t const& task) {
+    uint32_t num_cons = task->constraints.size();
+    uint32_t num_bytes = 0;
+    bool nonlinear = false, memcmp = false, atoi = false;
+    for (size_t i = 0; i < task->constraints.size(); i++) {
+      auto const& c = task->constraints[i];
+      num_bytes += c->local_map.size();
+      nonlinear |= c->ops.test(Mul) || c->ops.test(UDiv) || c->ops.test(SDiv) ||
+                   c->ops.test(URem) || c->ops.test(SRem) ||
+                   c->ops.test(Shl) || c->ops.test(LShr) || c->ops.test(AShr);
+      memcmp |= task->comparisons[i] == Memcmp || task->comparisons[i] == MemcmpN;
+      atoi |= !c->atoi_info.empty();
+    }
+    uint32_t cons_class = num_cons <= 1 ? 0 : (num_cons <= 4 ? 1 : 2);
+    uint32_t bytes_class = num_bytes <= 8 ? 0 : (num_bytes <= 32 ? 1 : 2);
+    return cons_class | (bytes_class << 2) | (nonlinear << 4) |
+           (memcmp << 5) | (atoi << 6);
+  }
+
+  std::vector<stats_t>& get_stats(uint32_t b) {
+    auto &s = stats[b];
+    if (s.empty()) s.resize(num_solvers);
+    return s;
+  }
+
+  size_t num_solvers;
+  std::mutex stats_lock;
+  std::unordered_map<uint32_t, std::vector<stats_t>> stats;
+};
+
+}; // namespace rgd
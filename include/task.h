@@ -1,7 +1,10 @@
 #pragma once
 
 #include <stdint.h>
+#include <time.h>
 
+#include <algorithm>
+#include <atomic>
 #include <bitset>
 #include <cassert>
 #include <map>
@@ -18,19 +21,122 @@ namespace rgd {
 // JIT'ed function for each relational constraint
 typedef void(*test_fn_type)(uint64_t*);
 
+// the same, evaluating kBatchLanes candidate inputs at once; the arguments
+// are laid out by slot, slot s of candidate l is at args[s * kBatchLanes + l]
+typedef void(*batch_fn_type)(uint64_t*);
+static const unsigned kBatchLanes = 8;
+
+// JIT'ed function evaluating all the constraints of a task at once on the
+// values of its inputs (as in MutInput), for n constraints, it writes the
+// distance of constraint i to out[i] and its operands to out[n + 2 * i]
+// and out[n + 2 * i + 1], and returns the sum of the distances
+typedef uint64_t(*task_fn_type)(const uint64_t*, uint64_t*);
+
+// the distance of a comparison between its operands a and b, and the same
+// for each lane of a batch, added to single[l] and f[l]; one of each per
+// comparison kind, picked once per constraint by the search
+typedef uint64_t(*distance_fn_type)(uint64_t a, uint64_t b);
+typedef void(*batch_distance_fn_type)(const uint64_t *a, const uint64_t *b,
+                                      uint64_t *single, uint64_t *f);
+
+class ConstraintProgram;
+
+// the clock of the solving budgets, in us; it only ticks every few ms, but
+// reading it is as cheap as reading memory
+static inline uint64_t coarse_now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 // the first two slots of the arguments for reseved for the left and right operands
 static const int RET_OFFSET = 2;
 
+// the base of the atoi_info of a sum of input bytes (an fsum label), whose
+// original length is the number of bytes it adds up; bases of numbers are
+// 2 to 36, and 0 is strlen
+#define ATOI_SUM_BASE 1U
+
+// per-constraint tables, allocated from the parser's arena
+template <class K, class V>
+using arena_map = flat_map<K, V, ArenaAllocator<std::pair<K, V>>>;
+using local_map_t = arena_map<size_t, uint32_t>;
+// the bytes of a solution, offset -> value
+using solution_map_t = flat_map<size_t, uint8_t>;
+
+// the constraints reading an input byte, a slice of SearchTask::cmap_cons
+struct cons_range {
+  const uint32_t *first, *last;
+  const uint32_t *begin() const { return first; }
+  const uint32_t *end() const { return last; }
+  size_t size() const { return last - first; }
+  bool empty() const { return first == last; }
+  uint32_t operator[](size_t i) const { return first[i]; }
+};
+
 struct Constraint {
   Constraint() = delete;
-  Constraint(int ast_size): fn(nullptr), const_num(0) {
-    ast = std::make_shared<AstNode>(ast_size);
+  Constraint(int ast_size, const std::shared_ptr<AstArena> &arena = nullptr)
+    : fn(nullptr), batch_fn(nullptr), shape(0), digest(0), local_map(arena), inputs(arena), shapes(arena),
+      atoi_info(arena), const_num(0) {
+    ast = make_ast(arena, ast_size);
   }
   Constraint(const Constraint&) = default; // XXX: okay to use default?
   const AstNode *get_root() const { return const_cast<const AstNode*>(ast.get()); }
 
+  // the functions and the program are filled in while other threads may
+  // be solving with the constraint, so they are read and set atomically;
+  // fn is set last, once it's there the batched function is too
+  test_fn_type get_fn() const { return __atomic_load_n(&fn, __ATOMIC_ACQUIRE); }
+  batch_fn_type get_batch_fn() const { return __atomic_load_n(&batch_fn, __ATOMIC_ACQUIRE); }
+  // keeps the first functions set, along with the code they live in, which
+  // stays around as long as the constraint does
+  void set_functions(test_fn_type f, batch_fn_type b,
+                     std::shared_ptr<const void> c) const {
+    std::shared_ptr<const void> none;
+    if (!std::atomic_compare_exchange_strong(&code, &none, c)) return;
+    __atomic_store_n(&batch_fn, b, __ATOMIC_RELEASE);
+    __atomic_store_n(&fn, f, __ATOMIC_RELEASE);
+  }
+  std::shared_ptr<const void> get_code() const {
+    return std::atomic_load(&code);
+  }
+  // swaps in faster functions for the ones in from; the old code is kept
+  // too, as other threads may still be running it
+  void upgrade_functions(test_fn_type f, batch_fn_type b,
+                         std::shared_ptr<const void> c,
+                         std::shared_ptr<const void> from) const {
+    if (!std::atomic_compare_exchange_strong(&code, &from, c)) return;
+    std::atomic_store(&old_code, from);
+    __atomic_store_n(&batch_fn, b, __ATOMIC_RELEASE);
+    __atomic_store_n(&fn, f, __ATOMIC_RELEASE);
+  }
+  std::shared_ptr<const ConstraintProgram> get_program() const {
+    return std::atomic_load(&program);
+  }
+  // keeps the first program set
+  void set_program(std::shared_ptr<const ConstraintProgram> p) const {
+    std::shared_ptr<const ConstraintProgram> none;
+    std::atomic_compare_exchange_strong(&program, &none, p);
+  }
+
   // JIT'ed function for a comparison expression
-  test_fn_type fn;
+  mutable test_fn_type fn;
+  // its batched variant, nullptr if there is none (yet)
+  mutable batch_fn_type batch_fn;
+  // the JIT'ed module holding them, and the one they replaced
+  mutable std::shared_ptr<const void> code;
+  mutable std::shared_ptr<const void> old_code;
+  // interpreted in place of fn until it's JIT'ed
+  mutable std::shared_ptr<const ConstraintProgram> program;
+  // AstShapes id of the AST, constraints with the same id share the JIT'ed
+  // function; 0 if the AST hasn't been interned
+  uint32_t shape;
+  // structural hash of the AST, the runtime's hash of the label it's parsed
+  // from (ops, sizes, and input offsets) over the hash of its root (arg
+  // layout and what got concretized), so it can be keyed without a walk;
+  // the constants are in input_args; 0 if not known
+  uint64_t digest;
   // the AST
   std::shared_ptr<AstNode> ast;
 
@@ -39,18 +145,18 @@ struct Constraint {
   // function consumes inputs as an input array.  So, when building the
   // function, we need to map the offset to the idx in input array,
   // which is stored in local_map.
-  std::map<size_t, uint32_t> local_map;
+  local_map_t local_map;
   // if const {false, const value}, if symbolic {true, index in the inputs}
   // during local search, we use a single global array (to avoid memory
   // allocation and free) to prepare the inputs, so we need to know where
   // to load the input values into the input array.
   std::vector<std::pair<bool, uint64_t>> input_args;
   // map the offset to iv (initial value)
-  std::unordered_map<uint32_t, uint8_t> inputs;
+  arena_map<uint32_t, uint8_t> inputs;
   // shape information about the input (e.g., 1, 2, 4, 8 bytes)
-  std::unordered_map<uint32_t, uint32_t> shapes;
+  arena_map<uint32_t, uint32_t> shapes;
   // special infomation for atoi: offset -> (result_length, base, str_length)
-  std::unordered_map<uint32_t, std::tuple<uint32_t, uint32_t, uint32_t>> atoi_info;
+  arena_map<uint32_t, std::tuple<uint32_t, uint32_t, uint32_t>> atoi_info;
   // record the involved operations
   std::bitset<rgd::LastOp> ops;
   // number of constant in the input array
@@ -67,15 +173,22 @@ struct ConsMeta {
   // input2state inference related
   std::vector<std::pair<size_t, uint32_t>> i2s_candidates;
   uint64_t op1, op2;
+  // the distance of comparison, bound by gd_entry()
+  distance_fn_type distance_fn = nullptr;
+  batch_distance_fn_type batch_distance_fn = nullptr;
 };
 
 struct SearchTask {
-  SearchTask(): scratch_args(nullptr), max_const_num(0),
-      stopped(false), attempts(0), solved(false), skip_next(false),
-      base_task(nullptr) {}
+  SearchTask(): max_const_num(0), scratch_args(nullptr), batch_args(nullptr),
+      stopped(false), attempts(0), cancel(nullptr), solved(false),
+      base_task(nullptr), skip_next(false) {}
   SearchTask(const SearchTask&) = delete;
-  ~SearchTask() { if (scratch_args) free(scratch_args); }
-  bool has_finalized() const { return scratch_args != nullptr; }
+  ~SearchTask() {
+    if (scratch_args) free(scratch_args);
+    if (batch_args) free(batch_args);
+  }
+  bool has_finalized() const { return finalized; }
+  bool has_search_state() const { return scratch_args != nullptr; }
 
   uint32_t num_exprs;
   // constraints, could be shared, strictly read-only
@@ -83,50 +196,106 @@ struct SearchTask {
   // temporary storage for the comparison operation
   std::vector<uint32_t> comparisons;
   // per-constraint mutable metadata
-  std::vector<std::unique_ptr<ConsMeta>> consmeta;
+  std::vector<ConsMeta> consmeta;
 
   // inputs as pairs of <offset (from the beginning of the input, and value>
   std::vector<std::pair<uint32_t, uint8_t>> inputs;
-  // shape information at each offset
-  std::unordered_map<uint32_t, uint32_t> shapes;
+  // shape information of each input, indexed like inputs
+  std::vector<uint32_t> shapes;
   // aggreated atoi info
-  std::unordered_map<uint32_t, std::tuple<uint32_t, uint32_t, uint32_t>> atoi_info;
+  flat_map<uint32_t, std::tuple<uint32_t, uint32_t, uint32_t>> atoi_info;
   // max number of constants in the input array
   uint32_t max_const_num;
-  // record constraints that use a certain input byte
-  std::unordered_map<uint32_t, std::vector<size_t>> cmap;
+  // the search state, set up by prepare_search()
+  // record constraints that use a certain input byte: those of input i are
+  // cmap_cons[cmap_start[i], cmap_start[i + 1]), in increasing order
+  std::vector<uint32_t> cmap_start;
+  std::vector<uint32_t> cmap_cons;
+  cons_range cmap(size_t i) const {
+    if (i + 1 >= cmap_start.size()) return {nullptr, nullptr};
+    return {cmap_cons.data() + cmap_start[i], cmap_cons.data() + cmap_start[i + 1]};
+  }
+  // the inputs the gradient is taken over, see prepare_search()
+  std::vector<uint32_t> grad_inputs;
   // the input array used for all JIT'ed functions
   // all input bytes are extended to 64 bits
   uint64_t* scratch_args;
+  // the same for the batched functions, kBatchLanes times as large
+  uint64_t* batch_args;
 
   // intermediate states for the search
   std::vector<uint64_t> min_distances; // current best
   std::vector<uint64_t> distances; // general scratch
-  std::vector<uint64_t> plus_distances; // used in partial derivation
-  std::vector<uint64_t> minus_distances; // used in partial derivation
+  // evaluates all the constraints in one call instead, if set, with out
+  // sized for it; the code is kept alive by task_code
+  task_fn_type task_fn = nullptr;
+  std::shared_ptr<const void> task_code;
+  std::vector<uint64_t> task_out;
+  // the input the constraints were last evaluated on by distance(), with
+  // their distances then, and whether a byte they read has changed since
+  std::vector<uint64_t> eval_input;
+  std::vector<uint64_t> eval_distances;
+  std::vector<uint8_t> eval_dirty;
 
   // statistics
   uint64_t start; //start time
   bool stopped;
   int attempts;
+  // set once another search of the same task has solved it
+  const std::atomic<bool> *cancel;
+  // with a deadline (by coarse_now_us()), the search runs until then
+  // instead of for a fixed number of attempts
+  uint64_t deadline = 0;
 
   // solutions
   bool solved;
-  std::unordered_map<size_t, uint8_t> solution;
+  solution_map_t solution;
+  // the best candidate the solvers tried so far came up with, in the form
+  // of solution, and the sum of the distances it leaves, so the next one
+  // can start from it; kUnknownDistance for a candidate that wasn't
+  // measured, e.g., the model of a Z3 query that timed out, which only
+  // fills an empty slot
+  static const uint64_t kUnknownDistance = UINT64_MAX - 1;
+  solution_map_t best;
+  uint64_t best_distance = UINT64_MAX;
+  bool offer_best(solution_map_t const& candidate, uint64_t dist) {
+    if (candidate.empty() || dist >= best_distance) return false;
+    best = candidate;
+    best_distance = dist;
+    return true;
+  }
 
   // base task
   std::shared_ptr<SearchTask> base_task;
   bool skip_next; // FIXME: an ugly hack to skip the next task
+  // what the base tasks tell this one, see ancestors()
+  struct chain_t {
+    // the nearest base task with skip_next, nullptr if there's none
+    const SearchTask *skip = nullptr;
+    // the solutions of the solved base tasks below it, the nearest first
+    solution_map_t hints;
+  };
+  mutable std::shared_ptr<const chain_t> chain;
+  // the branch address the driver queued the task for, when profiling
+  uint64_t site = 0;
+  bool finalized = false;
+  // the constraints, by index, of each of the components reading disjoint
+  // input bytes, which can be solved one at a time; empty for just one
+  std::vector<std::vector<uint32_t>> components;
 
   void finalize() {
     // aggregate the contraints, map each input byte to a constraint to
     // an index in the "global" input array (i.e., the scratch_args)
     std::unordered_map<uint32_t, uint32_t> sym_map;
+    // the number of constraints using each input
+    std::vector<uint32_t> num_uses;
     uint32_t gidx = 0;
+    consmeta.reserve(constraints.size());
     for (size_t i = 0; i < constraints.size(); i++) {
-      std::unique_ptr<ConsMeta> cm = std::make_unique<ConsMeta>();
-      cm->input_args = constraints[i]->input_args;
-      cm->comparison = comparisons[i];
+      consmeta.emplace_back();
+      ConsMeta &cm = consmeta.back();
+      cm.input_args = constraints[i]->input_args;
+      cm.comparison = comparisons[i];
       uint32_t last_offset = -1;
       uint32_t size = 0;
       for (const auto& [offset, lidx] : constraints[i]->local_map) {
@@ -135,47 +304,42 @@ struct SearchTask {
           gidx = inputs.size();
           sym_map[offset] = gidx;
           inputs.push_back(std::make_pair(offset, constraints[i]->inputs.at(offset)));
-          shapes[offset] = constraints[i]->shapes.at(offset);
+          shapes.push_back(constraints[i]->shapes.at(offset));
+          num_uses.push_back(0);
         } else {
           gidx = gitr->second;
         }
         // record input to constraint mapping
         // skip memcmp constraints
-        if (cm->comparison != rgd::Memcmp && cm->comparison != rgd::MemcmpN) {
-          auto slot = cmap.find(gidx);
-          if (slot != cmap.end()) {
-            slot->second.push_back(i);
-          } else {
-            cmap.emplace(std::make_pair(gidx, std::vector<size_t>{i}));
-          }
+        if (cm.comparison != rgd::Memcmp && cm.comparison != rgd::MemcmpN) {
+          num_uses[gidx]++;
         }
         // save the mapping between the local index (i.e., where the JIT'ed
         // function is going to read the input from) and the global index
         // (i.e., where the current value corresponding to the input byte
         // is stored in MutInput)
-        cm->input_args[lidx].second = gidx;
+        cm.input_args[lidx].second = gidx;
 
         // check if the input bytes are consecutive
-        // using std::map ensures that the offsets (keys) are sorted
+        // local_map keeps the offsets (keys) sorted
         if (last_offset != -1 && last_offset + 1 != offset) {
           // a new set of consecutive input bytes, save the info
           // and resset
-          cm->i2s_candidates.push_back({last_offset + 1 - size, size});
+          cm.i2s_candidates.push_back({last_offset + 1 - size, size});
           size = 0;
         }
         last_offset = offset;
         size++;
       }
       // save the last set of consecutive input bytes
-      cm->i2s_candidates.push_back({last_offset + 1 - size, size});
+      cm.i2s_candidates.push_back({last_offset + 1 - size, size});
 
       // process atoi
       for (const auto& [offset, info] : constraints[i]->atoi_info) {
         // check dependencies
         uint32_t length = std::get<2>(info);
         for (auto j = 0; j < length; ++j) {
-          auto ditr = cmap.find(offset + j);
-          if (ditr != cmap.end()) {
+          if (offset + j < num_uses.size() && num_uses[offset + j]) {
             fprintf(stderr, "atoi bytes (%d) used in other constraints\n", offset + j);
           }
         }
@@ -190,25 +354,161 @@ struct SearchTask {
       // update the number of required constants in the input array
       if (max_const_num < constraints[i]->const_num)
         max_const_num = constraints[i]->const_num;
+    }
 
-      // insert the constraint metadata
-      consmeta.push_back(std::move(cm));
+    finalized = true;
+  }
+
+  // the state only the search needs: the constraints of each input, the
+  // input arrays and the distances; left out by finalize() as most tasks
+  // are solved by I2S or skipped, gd_entry() sets it up on first use
+  void prepare_search() {
+    if (has_search_state()) return;
+    // counting sort the constraints by the inputs they read, the ones of
+    // each input end up in increasing order; each input is read at most
+    // once by a constraint
+    cmap_start.assign(inputs.size() + 1, 0);
+    for (auto const& cm : consmeta) {
+      if (cm.comparison == rgd::Memcmp || cm.comparison == rgd::MemcmpN) continue;
+      for (auto const& arg : cm.input_args)
+        if (arg.first) cmap_start[arg.second + 1]++;
+    }
+    for (size_t i = 0; i < inputs.size(); i++)
+      cmap_start[i + 1] += cmap_start[i];
+    cmap_cons.resize(cmap_start[inputs.size()]);
+    std::vector<uint32_t> next(cmap_start.begin(), cmap_start.end() - 1);
+    for (size_t i = 0; i < consmeta.size(); i++) {
+      auto const& cm = consmeta[i];
+      if (cm.comparison == rgd::Memcmp || cm.comparison == rgd::MemcmpN) continue;
+      for (auto const& arg : cm.input_args)
+        if (arg.first) cmap_cons[next[arg.second]++] = i;
+    }
+
+    // the bytes of a value are added up rather than or'ed when it's read,
+    // so moving its first byte moves the whole value; the other bytes are
+    // left out of the gradient unless a constraint reads them without the
+    // first one, and the search descends on the value as one variable
+    std::vector<std::pair<uint32_t, uint32_t>> by_offset;
+    by_offset.reserve(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++)
+      by_offset.push_back({inputs[i].first, i});
+    std::sort(by_offset.begin(), by_offset.end());
+    std::vector<uint8_t> skip(inputs.size(), 0);
+    for (size_t p = 0; p < by_offset.size(); p++) {
+      uint32_t head = by_offset[p].second;
+      if (shapes[head] < 2 || shapes[head] > 8) continue;
+      auto const hcons = cmap(head);
+      for (uint32_t j = 1; j < shapes[head] && p + j < by_offset.size(); j++) {
+        if (by_offset[p + j].first != by_offset[p].first + j) break;
+        uint32_t idx = by_offset[p + j].second;
+        auto const cons = cmap(idx);
+        // those only memcmps read are not in cmap, keep them
+        if (!cons.empty() &&
+            std::includes(hcons.begin(), hcons.end(), cons.begin(), cons.end()))
+          skip[idx] = 1;
+      }
     }
+    grad_inputs.clear();
+    for (size_t i = 0; i < inputs.size(); i++)
+      if (!skip[i]) grad_inputs.push_back(i);
 
     // allocate the input array, reserver 2 for comparison operands a,b
     scratch_args = (uint64_t*)aligned_alloc(sizeof(*scratch_args),
         (2 + inputs.size() + max_const_num + 1) * sizeof(*scratch_args));
+    batch_args = (uint64_t*)aligned_alloc(kBatchLanes * sizeof(*batch_args),
+        (2 + inputs.size() + max_const_num + 1) * kBatchLanes * sizeof(*batch_args));
     min_distances.resize(constraints.size(), 0);
     distances.resize(constraints.size(), 0);
-    plus_distances.resize(constraints.size(), 0);
-    minus_distances.resize(constraints.size(), 0);
+    eval_distances.resize(constraints.size(), 0);
+    eval_dirty.resize(constraints.size(), 1);
+    task_out.resize(constraints.size() * 3, 0);
+  }
+
+  // drops the constraints and what finalize() made of them, e.g. while
+  // the task waits on disk; finalize() again once they're back
+  void unload() {
+    constraints.clear();
+    consmeta.clear();
+    inputs.clear();
+    shapes.clear();
+    atoi_info.clear();
+    max_const_num = 0;
+    task_fn = nullptr;
+    task_code.reset();
+    finalized = false;
+  }
+
+  // a task asking the same as this one, with the same inputs but its own
+  // search state, to search it from several start points at once
+  std::shared_ptr<SearchTask> fork() const {
+    auto t = std::make_shared<SearchTask>();
+    t->constraints = constraints;
+    t->comparisons = comparisons;
+    t->finalize();
+    t->inputs = inputs;
+    // the inputs are in the same order, so the task function fits it too
+    t->task_fn = task_fn;
+    t->task_code = task_code;
+    return t;
+  }
+
+  // the components as tasks of their own, whose inputs start from the
+  // values they have here, e.g. the hints loaded
+  std::vector<std::shared_ptr<SearchTask>> split() const {
+    std::unordered_map<uint32_t, uint8_t> values(inputs.begin(), inputs.end());
+    std::vector<std::shared_ptr<SearchTask>> parts;
+    for (auto const& component : components) {
+      auto t = std::make_shared<SearchTask>();
+      for (uint32_t i : component) {
+        t->constraints.push_back(constraints[i]);
+        t->comparisons.push_back(comparisons[i]);
+      }
+      t->finalize();
+      for (auto &input : t->inputs) {
+        auto itr = values.find(input.first);
+        if (itr != values.end()) input.second = itr->second;
+      }
+      parts.push_back(t);
+    }
+    return parts;
+  }
+
+  // the base tasks, summed up the first time they're asked for and kept,
+  // so the nested tasks of a long chain don't walk it on every solve; a
+  // base task settled later is missed, which only costs a hint or a skip
+  const chain_t& ancestors() const {
+    auto c = std::atomic_load(&chain);
+    if (c) return *c;
+    if (!base_task) {
+      c = std::make_shared<chain_t>();
+    } else if (base_task->skip_next) {
+      auto n = std::make_shared<chain_t>();
+      n->skip = base_task.get();
+      c = n;
+    } else {
+      auto const &up = base_task->ancestors();
+      if (up.skip || !base_task->solved) {
+        // nothing to add, share the base's
+        c = std::atomic_load(&base_task->chain);
+      } else {
+        auto n = std::make_shared<chain_t>();
+        n->hints = base_task->solution;
+        for (auto const &kv : up.hints) n->hints.insert(kv);
+        c = n;
+      }
+    }
+    // racing threads come up with the same, keep the first
+    std::shared_ptr<const chain_t> none;
+    if (!std::atomic_compare_exchange_strong(&chain, &none, c)) c = none;
+    return *c;
   }
 
-  void load_hint() { // load hint from base task
-    if (!base_task || !base_task->solved) return;
+  void load_hint() { // load hint from base tasks
+    auto const &hints = ancestors().hints;
+    if (hints.empty()) return;
     for (auto itr = inputs.begin(); itr != inputs.end(); itr++) {
-      auto got = base_task->solution.find(itr->first);
-      if (got != base_task->solution.end())
+      auto got = hints.find(itr->first);
+      if (got != hints.end())
         itr->second = got->second;
     }
   }
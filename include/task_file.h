@@ -0,0 +1,300 @@
+#pragma once
+
+#include "task.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+namespace rgd {
+
+// Search tasks saved along with the input they were solved on, so the
+// solvers can be run again on the tasks of real campaigns, e.g., by
+// solver-bench. A file is a sequence of records, appended with one write
+// each, so several writers can share it. A record is the magic and the
+// size of its body, then, as native integers:
+// - the input, as its size and its bytes;
+// - the number of constraints, and for each of them its comparison, the
+//   digest, const_num, op1 and op2, the ops, the AST as the number of
+//   nodes and the nodes in preorder (kind, bits, index, boolvalue, label,
+//   hash and the number of children), then local_map, input_args, inputs,
+//   shapes and atoi_info, each as its size and its entries.
+// The rest of the task is derived from the constraints by finalize(), the
+// JIT'ed functions and the shapes aren't kept, and neither are base tasks.
+class TaskFile {
+public:
+  static const uint64_t kMagic = 0x314b534154ULL; // "TASK1"
+
+  TaskFile() = default;
+  TaskFile(const TaskFile&) = delete;
+  ~TaskFile() {
+    if (fd_ >= 0) ::close(fd_);
+  }
+
+  // opens path for appending, creating it if needed
+  bool open(const char *path) {
+    fd_ = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return fd_ >= 0;
+  }
+
+  bool append(SearchTask const& task, const uint8_t *in_buf, size_t in_size) {
+    if (fd_ < 0 || task.constraints.size() != task.comparisons.size()) {
+      return false;
+    }
+    std::vector<uint8_t> out;
+    put<uint64_t>(out, kMagic);
+    put<uint64_t>(out, 0); // the size, once known
+    put<uint64_t>(out, in_size);
+    out.insert(out.end(), in_buf, in_buf + in_size);
+    put<uint32_t>(out, task.constraints.size());
+    for (size_t i = 0; i < task.constraints.size(); i++) {
+      auto const& c = *task.constraints[i];
+      put<uint32_t>(out, task.comparisons[i]);
+      put<uint64_t>(out, c.digest);
+      put<uint32_t>(out, c.const_num);
+      put<uint64_t>(out, c.op1);
+      put<uint64_t>(out, c.op2);
+      put<uint64_t>(out, c.ops.to_ullong());
+      put<uint32_t>(out, count_nodes(*c.get_root()));
+      put_node(out, *c.get_root());
+      put<uint32_t>(out, c.local_map.size());
+      for (auto const& [offset, lidx] : c.local_map) {
+        put<uint64_t>(out, offset);
+        put<uint32_t>(out, lidx);
+      }
+      put<uint32_t>(out, c.input_args.size());
+      for (auto const& [sym, v] : c.input_args) {
+        put<uint8_t>(out, sym);
+        put<uint64_t>(out, v);
+      }
+      put<uint32_t>(out, c.inputs.size());
+      for (auto const& [offset, v] : c.inputs) {
+        put<uint32_t>(out, offset);
+        put<uint8_t>(out, v);
+      }
+      put<uint32_t>(out, c.shapes.size());
+      for (auto const& [offset, v] : c.shapes) {
+        put<uint32_t>(out, offset);
+        put<uint32_t>(out, v);
+      }
+      put<uint32_t>(out, c.atoi_info.size());
+      for (auto const& [offset, info] : c.atoi_info) {
+        put<uint32_t>(out, offset);
+        put<uint32_t>(out, std::get<0>(info));
+        put<uint32_t>(out, std::get<1>(info));
+        put<uint32_t>(out, std::get<2>(info));
+      }
+    }
+    uint64_t size = out.size() - 2 * sizeof(uint64_t);
+    memcpy(out.data() + sizeof(uint64_t), &size, sizeof(size));
+    return ::write(fd_, out.data(), out.size()) == (ssize_t)out.size();
+  }
+
+  // the records of a file, read from a private mapping of it
+  class Reader {
+  public:
+    Reader() = default;
+    Reader(const Reader&) = delete;
+    ~Reader() {
+      if (base_) munmap(base_, size_);
+    }
+
+    bool open(const char *path) {
+      int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+      struct stat st;
+      if (fd < 0) return false;
+      if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+      }
+      if (st.st_size == 0) {
+        // nothing captured yet
+        ::close(fd);
+        return true;
+      }
+      void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (p == MAP_FAILED) return false;
+      base_ = static_cast<uint8_t*>(p);
+      size_ = st.st_size;
+      return true;
+    }
+
+    void rewind() { pos_ = 0; }
+
+    // a new task, finalized, and its input; false at the end of the file or
+    // at a record that doesn't parse, after which nothing more is read
+    bool next(std::shared_ptr<SearchTask> &task, std::vector<uint8_t> &input) {
+      uint64_t magic, size;
+      const uint8_t *p = base_ + pos_, *end = base_ + size_;
+      if (!get(p, end, magic) || !get(p, end, size) || magic != kMagic ||
+          size > (uint64_t)(end - p)) {
+        pos_ = size_;
+        return false;
+      }
+      end = p + size;
+      task = std::make_shared<SearchTask>();
+      if (!read_task(p, end, *task, input) || p != end) {
+        pos_ = size_;
+        return false;
+      }
+      task->finalize();
+      pos_ = end - base_;
+      return true;
+    }
+
+  private:
+    uint8_t *base_ = nullptr;
+    size_t size_ = 0;
+    size_t pos_ = 0;
+  };
+
+private:
+  int fd_ = -1;
+
+  template <typename T>
+  static void put(std::vector<uint8_t> &out, T v) {
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(&v);
+    out.insert(out.end(), p, p + sizeof(T));
+  }
+
+  template <typename T>
+  static bool get(const uint8_t *&p, const uint8_t *end, T &v) {
+    if ((size_t)(end - p) < sizeof(T)) return false;
+    memcpy(&v, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+  }
+
+  static uint32_t count_nodes(const AstNode &node) {
+    uint32_t n = 1;
+    for (uint32_t i = 0; i < node.children_size(); i++) {
+      n += count_nodes(node.children(i));
+    }
+    return n;
+  }
+
+  static void put_node(std::vector<uint8_t> &out, const AstNode &node) {
+    put<uint16_t>(out, node.kind());
+    put<uint16_t>(out, node.bits());
+    put<uint32_t>(out, node.index());
+    put<uint8_t>(out, node.boolvalue());
+    put<uint32_t>(out, node.label());
+    put<uint32_t>(out, node.hash());
+    put<uint8_t>(out, node.children_size());
+    for (uint32_t i = 0; i < node.children_size(); i++) {
+      put_node(out, node.children(i));
+    }
+  }
+
+  // the tree has room for the nodes it was counted with, so a record that
+  // claims more children than that doesn't parse
+  static bool get_node(const uint8_t *&p, const uint8_t *end, AstNode *node,
+                       unsigned depth) {
+    uint16_t kind, bits;
+    uint32_t index, label, hash;
+    uint8_t boolvalue, children;
+    if (depth > 4096 || !get(p, end, kind) || !get(p, end, bits) ||
+        !get(p, end, index) || !get(p, end, boolvalue) ||
+        !get(p, end, label) || !get(p, end, hash) ||
+        !get(p, end, children) || children > 2) {
+      return false;
+    }
+    node->set_kind(kind);
+    node->set_bits(bits);
+    node->set_index(index);
+    // set_boolvalue stores the negation of its argument
+    node->set_boolvalue(!boolvalue);
+    node->set_label(label);
+    node->set_hash(hash);
+    for (uint8_t i = 0; i < children; i++) {
+      AstNode *child = node->add_children();
+      if (!child || !get_node(p, end, child, depth + 1)) return false;
+    }
+    return true;
+  }
+
+  static bool read_task(const uint8_t *&p, const uint8_t *end,
+                        SearchTask &task, std::vector<uint8_t> &input) {
+    uint64_t in_size;
+    uint32_t num;
+    if (!get(p, end, in_size) || in_size > (uint64_t)(end - p)) return false;
+    input.assign(p, p + in_size);
+    p += in_size;
+    if (!get(p, end, num)) return false;
+    for (uint32_t i = 0; i < num; i++) {
+      uint32_t comparison, const_num, nodes, n;
+      uint64_t digest, op1, op2, ops;
+      if (!get(p, end, comparison) || !get(p, end, digest) ||
+          !get(p, end, const_num) || !get(p, end, op1) || !get(p, end, op2) ||
+          !get(p, end, ops) || !get(p, end, nodes) ||
+          nodes > (uint64_t)(end - p)) {
+        return false;
+      }
+      auto c = std::make_shared<Constraint>(nodes);
+      if (!get_node(p, end, c->ast.get(), 0)) return false;
+      c->digest = digest;
+      c->const_num = const_num;
+      c->op1 = op1;
+      c->op2 = op2;
+      c->ops = std::bitset<rgd::LastOp>(ops);
+      if (!get(p, end, n)) return false;
+      for (uint32_t j = 0; j < n; j++) {
+        uint64_t offset;
+        uint32_t lidx;
+        if (!get(p, end, offset) || !get(p, end, lidx)) return false;
+        c->local_map[offset] = lidx;
+      }
+      if (!get(p, end, n)) return false;
+      for (uint32_t j = 0; j < n; j++) {
+        uint8_t sym;
+        uint64_t v;
+        if (!get(p, end, sym) || !get(p, end, v)) return false;
+        c->input_args.push_back({sym != 0, v});
+      }
+      if (!get(p, end, n)) return false;
+      for (uint32_t j = 0; j < n; j++) {
+        uint32_t offset;
+        uint8_t v;
+        if (!get(p, end, offset) || !get(p, end, v)) return false;
+        c->inputs[offset] = v;
+      }
+      if (!get(p, end, n)) return false;
+      for (uint32_t j = 0; j < n; j++) {
+        uint32_t offset, v;
+        if (!get(p, end, offset) || !get(p, end, v)) return false;
+        c->shapes[offset] = v;
+      }
+      if (!get(p, end, n)) return false;
+      for (uint32_t j = 0; j < n; j++) {
+        uint32_t offset, len, base, str_len;
+        if (!get(p, end, offset) || !get(p, end, len) ||
+            !get(p, end, base) || !get(p, end, str_len)) {
+          return false;
+        }
+        c->atoi_info[offset] = std::make_tuple(len, base, str_len);
+      }
+      // the local indices and the inputs have to agree, finalize() and the
+      // solvers look them up
+      for (auto const& [offset, lidx] : c->local_map) {
+        if (lidx >= c->input_args.size() || !c->inputs.count(offset) ||
+            !c->shapes.count(offset)) {
+          return false;
+        }
+      }
+      c->shape = AstShapes::global().intern(*c->get_root());
+      task.constraints.push_back(c);
+      task.comparisons.push_back(comparison);
+    }
+    task.num_exprs = num;
+    return num != 0;
+  }
+};
+
+}; // namespace rgd
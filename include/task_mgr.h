@@ -1,33 +1,73 @@
 #pragma once
 
 #include "task.h"
+#include "task_store.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <deque>
+#include <functional>
 #include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace rgd {
 
 class TaskManager {
 public:
   virtual ~TaskManager() {}
-  virtual bool add_task(std::shared_ptr<BranchContext> ctx, std::shared_ptr<SearchTask> task) = 0;
+  // ctx is interned by the CovManager, it outlives the queued task
+  virtual bool add_task(const BranchContext *ctx, std::shared_ptr<SearchTask> task) = 0;
   virtual std::shared_ptr<SearchTask> get_next_task() = 0;
   virtual size_t get_num_tasks() = 0;
+  // the tasks added from now on come from the trace of a new seed
+  virtual void start_trace() {}
+
+  // drops the tasks whose branch direction cov has seen covered by the
+  // time they'd be taken, e.g., by another seed, handing each to dropped
+  virtual void set_cov_manager(CovManager *cov,
+                               std::function<void(const SearchTask*)> dropped = nullptr) {
+    this->cov = cov;
+    this->dropped = std::move(dropped);
+  }
+  virtual size_t get_num_stale() const { return num_stale; }
+
+protected:
+  bool is_stale(const BranchContext *ctx, const SearchTask *task) {
+    if (!cov || !ctx || !cov->is_covered(ctx)) return false;
+    num_stale++;
+    drop(task);
+    return true;
+  }
+  // a queued task won't be handed out
+  void drop(const SearchTask *task) {
+    if (dropped) dropped(task);
+  }
+
+private:
+  CovManager *cov = nullptr;
+  std::function<void(const SearchTask*)> dropped;
+  size_t num_stale = 0;
 };
 
 class FIFOTaskManager : public TaskManager {
 public:
-  bool add_task(std::shared_ptr<BranchContext> ctx, std::shared_ptr<SearchTask> task) override {
-    (void)ctx;
-    tasks.push_back(std::move(task));
+  bool add_task(const BranchContext *ctx, std::shared_ptr<SearchTask> task) override {
+    tasks.push_back({ctx, std::move(task)});
     return true;
   }
 
   std::shared_ptr<SearchTask> get_next_task() override {
-    if (tasks.empty()) return nullptr;
-    auto task = std::move(tasks.front());
-    tasks.pop_front();
-    return task;
+    while (!tasks.empty()) {
+      auto entry = std::move(tasks.front());
+      tasks.pop_front();
+      if (!is_stale(entry.first, entry.second.get())) return entry.second;
+    }
+    return nullptr;
   }
 
   size_t get_num_tasks() override {
@@ -35,7 +75,371 @@ public:
   }
 
 private:
-  std::deque<task_t> tasks;
+  std::deque<std::pair<const BranchContext*, task_t>> tasks;
+};
+
+// tasks are queued by a small integer priority, in a bucket per priority,
+// so adding and taking a task is O(1) amortized; the priority favors
+// branches with few tasks queued for them so far, cheap tasks, and branches
+// deep into the trace of their seed, which the FIFO order gets to last
+class PriorityTaskManager : public TaskManager {
+public:
+  static const int kBuckets = 64;
+
+  PriorityTaskManager() : buckets(kBuckets), top(-1), num_tasks(0), depth(0) {}
+
+  bool add_task(const BranchContext *ctx, std::shared_ptr<SearchTask> task) override {
+    int prio = priority(ctx, task);
+    buckets[prio].push_back({ctx, std::move(task)});
+    if (prio > top) top = prio;
+    num_tasks++;
+    return true;
+  }
+
+  std::shared_ptr<SearchTask> get_next_task() override {
+    while (true) {
+      while (top >= 0 && buckets[top].empty()) top--;
+      if (top < 0) return nullptr;
+      auto entry = std::move(buckets[top].front());
+      buckets[top].pop_front();
+      num_tasks--;
+      if (!is_stale(entry.first, entry.second.get())) return entry.second;
+    }
+  }
+
+  size_t get_num_tasks() override {
+    return num_tasks;
+  }
+
+  void start_trace() override {
+    depth = 0;
+  }
+
+private:
+  static int log2(uint64_t v) {
+    return v ? 64 - __builtin_clzll(v) : 0;
+  }
+
+  int priority(const BranchContext *ctx, task_t const& task) {
+    // rarity: the fewer tasks for the branch so far, the better
+    uint64_t key = ctx ? (((uint64_t)ctx->addr << 1) | ctx->direction) : 0;
+    int rarity = log2(seen[key]++);
+    // cost: constraints and the input bytes they read
+    size_t num_bytes = 0;
+    for (auto const& c : task->constraints) num_bytes += c->local_map.size();
+    int cost = log2(task->constraints.size()) + log2(num_bytes) / 2;
+    // depth: how far into the trace the branch is
+    int deep = log2(++depth);
+    int prio = kBuckets / 2 - 2 * rarity - cost + deep;
+    return prio < 0 ? 0 : (prio >= kBuckets ? kBuckets - 1 : prio);
+  }
+
+  std::vector<std::deque<std::pair<const BranchContext*, task_t>>> buckets;
+  int top; // the highest bucket that may not be empty
+  size_t num_tasks;
+  uint64_t depth;
+  std::unordered_map<uint64_t, uint32_t> seen;
+};
+
+// drops the tasks asking the same as one added before, e.g., the same
+// branch flip reached by another seed: the same branch and direction, and
+// the same constraints (nested ones included) up to their labels, which
+// are only meaningful within a trace; wraps the manager that queues the rest
+class DedupTaskManager : public TaskManager {
+public:
+  DedupTaskManager(TaskManager *inner) : inner(inner), dropped(0) {}
+
+  bool add_task(const BranchContext *ctx, std::shared_ptr<SearchTask> task) override {
+    uint64_t fp = TaskStore::fingerprint(*task);
+    if (ctx) {
+      fp ^= ((uint64_t)ctx->addr << 1 | ctx->direction) * 0x9e3779b97f4a7c15ULL;
+    }
+    if (!seen.insert(fp).second) {
+      dropped++;
+      return false;
+    }
+    return inner->add_task(ctx, std::move(task));
+  }
+
+  std::shared_ptr<SearchTask> get_next_task() override {
+    return inner->get_next_task();
+  }
+
+  size_t get_num_tasks() override {
+    return inner->get_num_tasks();
+  }
+
+  void start_trace() override {
+    inner->start_trace();
+  }
+
+  void set_cov_manager(CovManager *cov,
+                       std::function<void(const SearchTask*)> dropped = nullptr) override {
+    inner->set_cov_manager(cov, std::move(dropped));
+  }
+
+  size_t get_num_stale() const override {
+    return inner->get_num_stale();
+  }
+
+  size_t get_num_dropped() const { return dropped; }
+
+private:
+  std::unique_ptr<TaskManager> inner;
+  std::unordered_set<uint64_t> seen;
+  size_t dropped;
+};
+
+// keeps the tasks queued in the manager it wraps within a memory budget:
+// once the tasks it holds would take more, the constraints of the tasks
+// added are written to an append-only file and dropped until the task is
+// taken again. The task itself stays queued as is (so the inner manager's
+// order and the base_task links of nested tasks still hold), but without
+// its constraints and what finalize() made of them. The budget is an
+// estimate, and constraints shared with tasks still in memory aren't freed
+class SpillTaskManager : public TaskManager {
+public:
+  SpillTaskManager(TaskManager *inner, size_t budget)
+    : inner(inner), budget(budget), resident(0), fd(-1), file_end(0),
+      num_spilled(0), total_spilled(0) {}
+  ~SpillTaskManager() {
+    if (fd >= 0) ::close(fd);
+  }
+
+  // the file is unlinked right away, it's gone with the fuzzer
+  bool open(const char *path) {
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return false;
+    unlink(path);
+    return true;
+  }
+
+  bool add_task(const BranchContext *ctx, std::shared_ptr<SearchTask> task) override {
+    size_t bytes = estimate(*task);
+    SearchTask *t = task.get();
+    if (!inner->add_task(ctx, std::move(task))) return false;
+    entry_t &e = entries[t];
+    e.ctx = ctx;
+    if (resident + bytes <= budget || !spill(*t, e)) {
+      e.bytes = bytes;
+      resident += bytes;
+    }
+    return true;
+  }
+
+  std::shared_ptr<SearchTask> get_next_task() override {
+    while (true) {
+      auto task = inner->get_next_task();
+      if (!task) return task;
+      auto itr = entries.find(task.get());
+      if (itr == entries.end()) return task;
+      entry_t e = itr->second;
+      entries.erase(itr);
+      // the inner manager isn't told about the coverage, so stale tasks
+      // are dropped here, before they're read back
+      bool stale = is_stale(e.ctx, task.get());
+      if (e.length == 0) {
+        resident -= e.bytes;
+        if (stale) continue;
+        return task;
+      }
+      bool loaded = !stale && load(*task, e);
+      // the file only grows while tasks are spilled
+      if (--num_spilled == 0 && ftruncate(fd, 0) == 0) file_end = 0;
+      if (loaded) return task;
+      // a task that can't be read back is dropped too
+      if (!stale) drop(task.get());
+    }
+  }
+
+  size_t get_num_tasks() override {
+    return inner->get_num_tasks();
+  }
+
+  void start_trace() override {
+    inner->start_trace();
+  }
+
+  size_t get_num_spilled() const { return num_spilled; }
+  size_t get_total_spilled() const { return total_spilled; }
+  // estimated bytes of the tasks in memory
+  size_t get_resident() const { return resident; }
+
+private:
+  struct entry_t {
+    const BranchContext *ctx = nullptr;
+    size_t bytes = 0;    // while in memory
+    uint64_t offset = 0; // while spilled
+    uint32_t length = 0;
+  };
+
+  // the memory held by the constraints of a task, counting shared ones
+  // each time
+  static size_t estimate(const SearchTask &task) {
+    size_t bytes = sizeof(SearchTask) + task.inputs.size() * 16;
+    for (auto const& c : task.constraints) {
+      bytes += sizeof(Constraint) + count_nodes(*c->get_root()) * sizeof(AstNode);
+      bytes += c->local_map.size() * 16 + c->input_args.size() * 16 +
+               c->inputs.size() * 8 + c->shapes.size() * 8 +
+               c->atoi_info.size() * 16;
+    }
+    return bytes + task.consmeta.size() * sizeof(ConsMeta);
+  }
+
+  static size_t count_nodes(const AstNode &node) {
+    size_t n = 1;
+    for (uint32_t i = 0; i < node.children_size(); i++)
+      n += count_nodes(node.children(i));
+    return n;
+  }
+
+  bool spill(SearchTask &task, entry_t &e) {
+    if (fd < 0) return false;
+    std::string buf;
+    put<uint32_t>(buf, task.constraints.size());
+    for (auto const& c : task.constraints) put_constraint(buf, *c);
+    if (pwrite(fd, buf.data(), buf.size(), file_end) != (ssize_t)buf.size())
+      return false;
+    e.offset = file_end;
+    e.length = buf.size();
+    file_end += buf.size();
+    num_spilled++;
+    total_spilled++;
+    task.unload();
+    return true;
+  }
+
+  bool load(SearchTask &task, entry_t const& e) {
+    std::string buf(e.length, '\0');
+    if (pread(fd, &buf[0], e.length, e.offset) != (ssize_t)e.length)
+      return false;
+    const char *p = buf.data();
+    uint32_t n = get<uint32_t>(p);
+    for (uint32_t i = 0; i < n; i++) task.constraints.push_back(get_constraint(p));
+    task.finalize();
+    return true;
+  }
+
+  template <class T>
+  static void put(std::string &buf, T v) {
+    buf.append(reinterpret_cast<const char*>(&v), sizeof(v));
+  }
+  template <class T>
+  static T get(const char *&p) {
+    T v;
+    memcpy(&v, p, sizeof(v));
+    p += sizeof(v);
+    return v;
+  }
+
+  static void put_node(std::string &buf, const AstNode &node) {
+    put<uint16_t>(buf, node.kind());
+    put<uint16_t>(buf, node.bits());
+    put<uint32_t>(buf, node.index());
+    put<uint8_t>(buf, node.boolvalue());
+    put<uint8_t>(buf, node.children_size());
+    put<uint32_t>(buf, node.label());
+    put<uint32_t>(buf, node.hash());
+    for (uint32_t i = 0; i < node.children_size(); i++)
+      put_node(buf, node.children(i));
+  }
+
+  static void get_node(const char *&p, AstNode *node) {
+    node->set_kind(get<uint16_t>(p));
+    node->set_bits(get<uint16_t>(p));
+    node->set_index(get<uint32_t>(p));
+    // set_boolvalue stores the negation
+    node->set_boolvalue(!get<uint8_t>(p));
+    uint8_t children = get<uint8_t>(p);
+    node->set_label(get<uint32_t>(p));
+    node->set_hash(get<uint32_t>(p));
+    for (uint8_t i = 0; i < children; i++)
+      get_node(p, node->add_children());
+  }
+
+  static void put_constraint(std::string &buf, const Constraint &c) {
+    put<uint32_t>(buf, count_nodes(*c.get_root()));
+    put_node(buf, *c.get_root());
+    put<uint32_t>(buf, c.shape);
+    put<uint64_t>(buf, c.digest);
+    put<uint64_t>(buf, c.ops.to_ullong());
+    put<uint32_t>(buf, c.const_num);
+    put<uint64_t>(buf, c.op1);
+    put<uint64_t>(buf, c.op2);
+    put<uint32_t>(buf, c.local_map.size());
+    for (auto const& [offset, lidx] : c.local_map) {
+      put<uint64_t>(buf, offset);
+      put<uint32_t>(buf, lidx);
+    }
+    put<uint32_t>(buf, c.input_args.size());
+    for (auto const& arg : c.input_args) {
+      put<uint8_t>(buf, arg.first);
+      put<uint64_t>(buf, arg.second);
+    }
+    put<uint32_t>(buf, c.inputs.size());
+    for (auto const& [offset, value] : c.inputs) {
+      put<uint32_t>(buf, offset);
+      put<uint8_t>(buf, value);
+    }
+    put<uint32_t>(buf, c.shapes.size());
+    for (auto const& [offset, shape] : c.shapes) {
+      put<uint32_t>(buf, offset);
+      put<uint32_t>(buf, shape);
+    }
+    put<uint32_t>(buf, c.atoi_info.size());
+    for (auto const& [offset, info] : c.atoi_info) {
+      put<uint32_t>(buf, offset);
+      put<uint32_t>(buf, std::get<0>(info));
+      put<uint32_t>(buf, std::get<1>(info));
+      put<uint32_t>(buf, std::get<2>(info));
+    }
+  }
+
+  // reloaded constraints live on the heap, their functions are found again
+  // in the JIT cache by their shape
+  static std::shared_ptr<const Constraint> get_constraint(const char *&p) {
+    uint32_t nodes = get<uint32_t>(p);
+    auto c = std::make_shared<Constraint>(nodes);
+    get_node(p, c->ast.get());
+    c->shape = get<uint32_t>(p);
+    c->digest = get<uint64_t>(p);
+    c->ops = std::bitset<rgd::LastOp>(get<uint64_t>(p));
+    c->const_num = get<uint32_t>(p);
+    c->op1 = get<uint64_t>(p);
+    c->op2 = get<uint64_t>(p);
+    for (uint32_t i = 0, n = get<uint32_t>(p); i < n; i++) {
+      size_t offset = get<uint64_t>(p);
+      c->local_map[offset] = get<uint32_t>(p);
+    }
+    for (uint32_t i = 0, n = get<uint32_t>(p); i < n; i++) {
+      bool symbolic = get<uint8_t>(p);
+      c->input_args.push_back({symbolic, get<uint64_t>(p)});
+    }
+    for (uint32_t i = 0, n = get<uint32_t>(p); i < n; i++) {
+      uint32_t offset = get<uint32_t>(p);
+      c->inputs[offset] = get<uint8_t>(p);
+    }
+    for (uint32_t i = 0, n = get<uint32_t>(p); i < n; i++) {
+      uint32_t offset = get<uint32_t>(p);
+      c->shapes[offset] = get<uint32_t>(p);
+    }
+    for (uint32_t i = 0, n = get<uint32_t>(p); i < n; i++) {
+      uint32_t offset = get<uint32_t>(p);
+      uint32_t length = get<uint32_t>(p);
+      uint32_t base = get<uint32_t>(p);
+      c->atoi_info[offset] = std::make_tuple(length, base, get<uint32_t>(p));
+    }
+    return c;
+  }
+
+  std::unique_ptr<TaskManager> inner;
+  size_t budget;
+  size_t resident; // estimated bytes of the tasks in memory
+  int fd;
+  uint64_t file_end;
+  size_t num_spilled; // tasks spilled now
+  size_t total_spilled;
+  std::unordered_map<const SearchTask*, entry_t> entries;
 };
 
 };  // namespace rgd
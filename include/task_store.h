@@ -0,0 +1,251 @@
+#pragma once
+
+#include "task.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+namespace rgd {
+
+// Outcomes of search tasks kept in a file, so restarted campaigns and
+// other fuzzer instances on the same host can skip tasks that have already
+// been shown unsolvable, or whose solution has already made it into the
+// corpus. The file is a fixed size open addressing table of
+// (fingerprint, outcome) pairs, mapped shared and updated with atomics,
+// entries are never removed.
+// Instances can also claim a task while they solve it, so the others skip
+// it instead of solving it again; a claim that isn't settled or released
+// within kClaimSecs, e.g. because its instance died, can be taken over.
+// The same table keeps the seeds traced by any instance, by content, in a
+// store of their own.
+class TaskStore {
+public:
+  enum outcome_t : uint32_t {
+    UNKNOWN = 0,
+    UNSAT = 1,
+    SOLVED = 2,
+    CLAIMED = 3,
+    TRACED = 4, // seeds only
+  };
+
+  static const uint32_t kClaimSecs = 60;
+
+  TaskStore() : table_(nullptr), slots_(0), map_size_(0) {}
+  TaskStore(const TaskStore&) = delete;
+  ~TaskStore() {
+    if (table_) munmap(table_, map_size_);
+  }
+
+  // maps path, creating it with 2^slots_log2 slots if needed
+  bool open(const char *path, unsigned slots_log2 = 20) {
+    int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return false;
+    size_t size = sizeof(header_t) + (sizeof(entry_t) << slots_log2);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      ::close(fd);
+      return false;
+    }
+    if (st.st_size == 0 && ftruncate(fd, size) != 0) {
+      ::close(fd);
+      return false;
+    } else if (st.st_size != 0) {
+      // an existing store decides its own size
+      size = st.st_size;
+    }
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return false;
+    header_t *h = static_cast<header_t*>(p);
+    uint64_t zero = 0;
+    // the first one to map a new file sets it up
+    if (__atomic_compare_exchange_n(&h->magic, &zero, kInitializing, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      h->slots = (size - sizeof(header_t)) / sizeof(entry_t);
+      __atomic_store_n(&h->magic, kMagic, __ATOMIC_RELEASE);
+    }
+    for (int i = 0; i < 1000 && __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == kInitializing; i++) {
+      usleep(1000);
+    }
+    if (h->magic != kMagic || h->slots == 0 ||
+        sizeof(header_t) + h->slots * sizeof(entry_t) > size ||
+        (h->slots & (h->slots - 1))) {
+      munmap(p, size);
+      return false;
+    }
+    table_ = p;
+    slots_ = h->slots;
+    map_size_ = size;
+    return true;
+  }
+
+  bool is_open() const { return table_ != nullptr; }
+
+  outcome_t lookup(uint64_t fp) const {
+    if (!table_ || fp == 0) return UNKNOWN;
+    entry_t *e = entries();
+    for (size_t i = 0, s = fp & (slots_ - 1); i < kMaxProbes; i++, s = (s + 1) & (slots_ - 1)) {
+      uint64_t key = __atomic_load_n(&e[s].key, __ATOMIC_ACQUIRE);
+      if (key == fp) return (outcome_t)__atomic_load_n(&e[s].outcome, __ATOMIC_ACQUIRE);
+      if (key == 0) return UNKNOWN;
+    }
+    return UNKNOWN;
+  }
+
+  // best effort, the outcome is dropped if the neighborhood is full
+  void record(uint64_t fp, outcome_t outcome) {
+    entry_t *e = find(fp);
+    if (e) __atomic_store_n(&e->outcome, (uint32_t)outcome, __ATOMIC_RELEASE);
+  }
+
+  // true if the caller now owns the task and should solve it, false if it's
+  // settled or another instance is on it
+  bool claim(uint64_t fp) {
+    entry_t *e = find(fp);
+    if (!e) return true; // best effort, as record
+    uint32_t now = time(nullptr);
+    uint32_t outcome = __atomic_load_n(&e->outcome, __ATOMIC_ACQUIRE);
+    if (outcome == UNKNOWN) {
+      __atomic_store_n(&e->claimed_at, now, __ATOMIC_RELEASE);
+      if (__atomic_compare_exchange_n(&e->outcome, &outcome, (uint32_t)CLAIMED,
+                                      false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return true;
+      }
+    }
+    if (outcome != CLAIMED) return false;
+    uint32_t since = __atomic_load_n(&e->claimed_at, __ATOMIC_ACQUIRE);
+    // a stale claim goes to the first one to notice
+    return now - since > kClaimSecs &&
+           __atomic_compare_exchange_n(&e->claimed_at, &since, now, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  }
+
+  // gives up a claim without an outcome, e.g. when the solvers time out
+  void release(uint64_t fp) {
+    if (!table_ || fp == 0) return;
+    entry_t *e = entries();
+    for (size_t i = 0, s = fp & (slots_ - 1); i < kMaxProbes; i++, s = (s + 1) & (slots_ - 1)) {
+      uint64_t key = __atomic_load_n(&e[s].key, __ATOMIC_ACQUIRE);
+      if (key == fp) {
+        uint32_t claimed = CLAIMED;
+        __atomic_compare_exchange_n(&e[s].outcome, &claimed, (uint32_t)UNKNOWN,
+                                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        return;
+      }
+      if (key == 0) return;
+    }
+  }
+
+  // a content hash of what a task asks the solvers, independent of the seed
+  // it came from: the ASTs with the input offsets they read, the relational
+  // operators, and the constants
+  static uint64_t fingerprint(const SearchTask &task) {
+    uint64_t h = kSeed;
+    for (size_t i = 0; i < task.constraints.size(); i++) {
+      h = mix_constraint(h, *task.constraints[i], task.comparisons[i]);
+    }
+    return h ? h : 1;
+  }
+
+  // the same for one constraint of a task, under its comparison
+  static uint64_t fingerprint(const Constraint &c, uint32_t comparison) {
+    uint64_t h = mix_constraint(kSeed, c, comparison);
+    return h ? h : 1;
+  }
+
+  // a content hash of a seed
+  static uint64_t fingerprint(const uint8_t *buf, size_t size) {
+    uint64_t h = mix(kSeed, size);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+      uint64_t v;
+      memcpy(&v, buf + i, 8);
+      h = mix(h, v);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, buf + i, size - i);
+    h = mix(h, tail);
+    return h ? h : 1;
+  }
+
+private:
+  static const uint64_t kMagic = 0x65726f74536b7354ULL; // "TskStore"
+  static const uint64_t kInitializing = 1;
+  static const uint64_t kSeed = 0x9e3779b97f4a7c15ULL;
+  static const size_t kMaxProbes = 64;
+
+  struct header_t {
+    uint64_t magic;
+    uint64_t slots;
+  };
+  struct entry_t {
+    uint64_t key;
+    uint32_t outcome;
+    uint32_t claimed_at; // seconds, truncated
+  };
+
+  entry_t* entries() const {
+    return reinterpret_cast<entry_t*>(static_cast<char*>(table_) + sizeof(header_t));
+  }
+
+  // the entry of fp, added if needed, nullptr if the neighborhood is full
+  entry_t* find(uint64_t fp) {
+    if (!table_ || fp == 0) return nullptr;
+    entry_t *e = entries();
+    for (size_t i = 0, s = fp & (slots_ - 1); i < kMaxProbes; i++, s = (s + 1) & (slots_ - 1)) {
+      uint64_t key = 0;
+      if (__atomic_compare_exchange_n(&e[s].key, &key, fp, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+          key == fp) {
+        return &e[s];
+      }
+    }
+    return nullptr;
+  }
+
+  static uint64_t mix(uint64_t h, uint64_t v) {
+    // splitmix64 finalizer over the running hash
+    uint64_t x = h ^ (v + kSeed + (h << 6) + (h >> 2));
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  static uint64_t mix_constraint(uint64_t h, const Constraint &c,
+                                 uint32_t comparison) {
+    h = mix(h, comparison);
+    h = c.digest ? mix(h, c.digest) : mix_ast(h, *c.get_root());
+    for (auto const& arg : c.input_args) {
+      if (!arg.first) h = mix(h, arg.second);
+    }
+    for (auto const& [offset, info] : c.atoi_info) {
+      h = mix(h, offset);
+      h = mix(h, ((uint64_t)std::get<0>(info) << 32) | std::get<1>(info));
+      h = mix(h, std::get<2>(info));
+    }
+    return h;
+  }
+
+  static uint64_t mix_ast(uint64_t h, const AstNode &node) {
+    h = mix(h, ((uint64_t)node.kind() << 48) | ((uint64_t)node.bits() << 32) | node.hash());
+    h = mix(h, ((uint64_t)node.index() << 1) | node.boolvalue());
+    h = mix(h, node.children_size());
+    for (uint32_t i = 0; i < node.children_size(); i++) {
+      h = mix_ast(h, node.children(i));
+    }
+    return h;
+  }
+
+  void *table_;
+  size_t slots_;
+  size_t map_size_;
+};
+
+};  // namespace rgd
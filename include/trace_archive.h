@@ -0,0 +1,315 @@
+#pragma once
+
+#include "trace_blob.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#if SYMSAN_HAS_ZLIB
+#include <zlib.h>
+#endif
+
+namespace rgd {
+
+// The traces of the seeds of a campaign, kept to be parsed and solved again
+// later, e.g., with better solvers, without running anything: each one is a
+// TraceBlob, with the labels its events reach, under the name of its seed.
+// Within a blob, the fields of the labels are interleaved, while each of
+// them on its own is much more regular (the deltas of the ids and of the
+// operands are small, the ops and sizes repeat), so a record keeps them in
+// columns, each deflated on its own if zlib was there at build time
+// (SYMSAN_HAS_ZLIB) and if that makes it smaller. A file is a sequence of
+// records, appended with one write each, so several writers can share it.
+// A record is the magic and the size of its body, then:
+// - the name of the seed, as its size and its bytes;
+// - the size of the blob, and the number of columns;
+// - each column as its coding (kRaw or kDeflate), its size, the size it's
+//   coded to, and its bytes.
+// The columns are, in order, the flags, the input and the number of labels;
+// for each label, the delta of its id, op, size, l1, l2, the hash, op1 and
+// op2 (as in the blob); and the events, as they are in the blob.
+class TraceArchive {
+public:
+  static const uint64_t kMagic = 0x3143524154ULL; // "TARC1"
+  enum coding_t : uint8_t { kRaw = 0, kDeflate = 1 };
+  enum column_t {
+    Header, Delta, Op, Size, L1, L2, Hash, Op1, Op2, Events, NumColumns
+  };
+
+  TraceArchive() = default;
+  TraceArchive(const TraceArchive&) = delete;
+  ~TraceArchive() {
+    if (fd_ >= 0) ::close(fd_);
+  }
+
+  // opens path for appending, creating it if needed
+  bool open(const char *path) {
+    fd_ = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return fd_ >= 0;
+  }
+
+  // the blob, as encoded by TraceBlob::encode, of the seed name; false if
+  // it doesn't parse or the write fails
+  bool append(std::string const& name, std::vector<uint8_t> const& blob) {
+    std::vector<uint8_t> columns[NumColumns];
+    if (fd_ < 0 || !split(blob, columns)) return false;
+    std::vector<uint8_t> out;
+    TraceBlob::put<uint64_t>(out, kMagic);
+    TraceBlob::put<uint64_t>(out, 0); // the size, once known
+    TraceBlob::put_varint(out, name.size());
+    out.insert(out.end(), name.begin(), name.end());
+    TraceBlob::put_varint(out, blob.size());
+    TraceBlob::put_varint(out, NumColumns);
+    for (auto const& col : columns) put_column(out, col);
+    uint64_t size = out.size() - 2 * sizeof(uint64_t);
+    memcpy(out.data() + sizeof(uint64_t), &size, sizeof(size));
+    if (::write(fd_, out.data(), out.size()) != (ssize_t)out.size()) {
+      return false;
+    }
+    blob_bytes_ += blob.size();
+    archived_bytes_ += out.size();
+    return true;
+  }
+
+  // of the blobs appended, and of their records
+  uint64_t blob_bytes() const { return blob_bytes_; }
+  uint64_t archived_bytes() const { return archived_bytes_; }
+
+  // the records of a file, read from a private mapping of it, in order or
+  // by their index
+  class Reader {
+  public:
+    Reader() = default;
+    Reader(const Reader&) = delete;
+    ~Reader() {
+      if (base_) munmap(base_, size_);
+    }
+
+    // maps path and indexes its records, up to the first one that doesn't
+    // parse
+    bool open(const char *path) {
+      int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+      struct stat st;
+      if (fd < 0) return false;
+      if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+      }
+      if (st.st_size == 0) {
+        // nothing archived yet
+        ::close(fd);
+        return true;
+      }
+      void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (p == MAP_FAILED) return false;
+      base_ = static_cast<uint8_t*>(p);
+      size_ = st.st_size;
+      const uint8_t *pos = base_, *end = base_ + size_;
+      uint64_t magic, size, name_size;
+      while (TraceBlob::get(pos, end, magic) && magic == kMagic &&
+             TraceBlob::get(pos, end, size) && size <= (uint64_t)(end - pos)) {
+        const uint8_t *body = pos, *body_end = pos + size;
+        if (!TraceBlob::get_varint(body, body_end, name_size) ||
+            name_size > (uint64_t)(body_end - body)) {
+          break;
+        }
+        records_.push_back({std::string(body, body + name_size),
+                            (size_t)(body + name_size - base_),
+                            (size_t)(body_end - body - name_size)});
+        pos = body_end;
+      }
+      return true;
+    }
+
+    size_t size() const { return records_.size(); }
+    std::string const& name(size_t i) const { return records_[i].name; }
+
+    // the blob of record i, for TraceBlob::decode; false if it doesn't
+    // decode, e.g., deflated without zlib
+    bool read(size_t i, std::vector<uint8_t> &blob) const {
+      if (i >= records_.size()) return false;
+      const uint8_t *p = base_ + records_[i].offset;
+      return join(p, p + records_[i].size, blob);
+    }
+
+    // the next record, from the first one; false at the end
+    bool next(std::string &name, std::vector<uint8_t> &blob) {
+      while (pos_ < records_.size()) {
+        size_t i = pos_++;
+        if (read(i, blob)) {
+          name = records_[i].name;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void rewind() { pos_ = 0; }
+
+  private:
+    struct record_t {
+      std::string name;
+      size_t offset; // past the name
+      size_t size;
+    };
+    uint8_t *base_ = nullptr;
+    size_t size_ = 0;
+    size_t pos_ = 0;
+    std::vector<record_t> records_;
+  };
+
+private:
+  int fd_ = -1;
+  uint64_t blob_bytes_ = 0;
+  uint64_t archived_bytes_ = 0;
+
+  // the fields of the blob into their columns, see TraceBlob::encode
+  static bool split(std::vector<uint8_t> const& blob,
+                    std::vector<uint8_t> *columns) {
+    const uint8_t *p = blob.data(), *end = p + blob.size();
+    uint64_t magic, flags, in_size, num_labels, v;
+    uint32_t hash;
+    if (!TraceBlob::get(p, end, magic) || magic != TraceBlob::kMagic ||
+        !TraceBlob::get_varint(p, end, flags) ||
+        !TraceBlob::get_varint(p, end, in_size) ||
+        in_size > (uint64_t)(end - p)) {
+      return false;
+    }
+    auto &header = columns[Header];
+    TraceBlob::put_varint(header, flags);
+    TraceBlob::put_varint(header, in_size);
+    header.insert(header.end(), p, p + in_size);
+    p += in_size;
+    if (!TraceBlob::get_varint(p, end, num_labels)) return false;
+    TraceBlob::put_varint(header, num_labels);
+    for (uint64_t i = 0; i < num_labels; i++) {
+      for (int c = Delta; c <= Op2; c++) {
+        if (c == Hash) {
+          if (!TraceBlob::get(p, end, hash)) return false;
+          TraceBlob::put<uint32_t>(columns[Hash], hash);
+        } else {
+          if (!TraceBlob::get_varint(p, end, v)) return false;
+          TraceBlob::put_varint(columns[c], v);
+        }
+      }
+    }
+    columns[Events].assign(p, end);
+    return true;
+  }
+
+  // the blob back from the columns of a record at p
+  static bool join(const uint8_t *p, const uint8_t *end,
+                   std::vector<uint8_t> &blob) {
+    uint64_t blob_size, num_columns;
+    if (!TraceBlob::get_varint(p, end, blob_size) ||
+        !TraceBlob::get_varint(p, end, num_columns) ||
+        num_columns != NumColumns) {
+      return false;
+    }
+    std::vector<uint8_t> columns[NumColumns];
+    for (auto &col : columns) {
+      if (!get_column(p, end, col)) return false;
+    }
+    const uint8_t *pos[NumColumns], *ends[NumColumns];
+    for (int c = 0; c < NumColumns; c++) {
+      pos[c] = columns[c].data();
+      ends[c] = pos[c] + columns[c].size();
+    }
+    blob.clear();
+    blob.reserve(blob_size);
+    uint64_t flags, in_size, num_labels, v;
+    uint32_t hash;
+    TraceBlob::put<uint64_t>(blob, TraceBlob::kMagic);
+    if (!TraceBlob::get_varint(pos[Header], ends[Header], flags) ||
+        !TraceBlob::get_varint(pos[Header], ends[Header], in_size) ||
+        in_size > (uint64_t)(ends[Header] - pos[Header])) {
+      return false;
+    }
+    TraceBlob::put_varint(blob, flags);
+    TraceBlob::put_varint(blob, in_size);
+    blob.insert(blob.end(), pos[Header], pos[Header] + in_size);
+    pos[Header] += in_size;
+    if (!TraceBlob::get_varint(pos[Header], ends[Header], num_labels)) {
+      return false;
+    }
+    TraceBlob::put_varint(blob, num_labels);
+    for (uint64_t i = 0; i < num_labels; i++) {
+      for (int c = Delta; c <= Op2; c++) {
+        if (c == Hash) {
+          if (!TraceBlob::get(pos[Hash], ends[Hash], hash)) return false;
+          TraceBlob::put<uint32_t>(blob, hash);
+        } else {
+          if (!TraceBlob::get_varint(pos[c], ends[c], v)) return false;
+          TraceBlob::put_varint(blob, v);
+        }
+      }
+    }
+    blob.insert(blob.end(), columns[Events].begin(), columns[Events].end());
+    return blob.size() == blob_size;
+  }
+
+  static void put_column(std::vector<uint8_t> &out,
+                         std::vector<uint8_t> const& col) {
+#if SYMSAN_HAS_ZLIB
+    uLongf coded_size = compressBound(col.size());
+    std::vector<uint8_t> coded(coded_size);
+    if (!col.empty() &&
+        compress2(coded.data(), &coded_size, col.data(), col.size(),
+                  Z_BEST_COMPRESSION) == Z_OK &&
+        coded_size < col.size()) {
+      TraceBlob::put<uint8_t>(out, kDeflate);
+      TraceBlob::put_varint(out, col.size());
+      TraceBlob::put_varint(out, coded_size);
+      out.insert(out.end(), coded.data(), coded.data() + coded_size);
+      return;
+    }
+#endif
+    TraceBlob::put<uint8_t>(out, kRaw);
+    TraceBlob::put_varint(out, col.size());
+    TraceBlob::put_varint(out, col.size());
+    out.insert(out.end(), col.begin(), col.end());
+  }
+
+  static bool get_column(const uint8_t *&p, const uint8_t *end,
+                         std::vector<uint8_t> &col) {
+    uint8_t coding;
+    uint64_t size, coded_size;
+    if (!TraceBlob::get(p, end, coding) ||
+        !TraceBlob::get_varint(p, end, size) ||
+        !TraceBlob::get_varint(p, end, coded_size) ||
+        coded_size > (uint64_t)(end - p)) {
+      return false;
+    }
+    if (coding == kRaw) {
+      if (size != coded_size) return false;
+      col.assign(p, p + size);
+      p += size;
+      return true;
+    }
+#if SYMSAN_HAS_ZLIB
+    // deflate shrinks by about 1032 times at most, a size past that is a
+    // corrupt record
+    if (coding == kDeflate && size <= (coded_size + 1) * 1032) {
+      col.resize(size);
+      uLongf out_size = size;
+      if (uncompress(col.data(), &out_size, p, coded_size) != Z_OK ||
+          out_size != size) {
+        return false;
+      }
+      p += coded_size;
+      return true;
+    }
+#endif
+    return false;
+  }
+};
+
+}; // namespace rgd
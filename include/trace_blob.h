@@ -0,0 +1,472 @@
+#pragma once
+
+#include "dfsan/dfsan.h"
+#include "solver.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace rgd {
+
+// A trace shipped to a remote worker to be parsed and solved there: the
+// input, the events of the branches the mutator wants flipped, in order,
+// and the slice of the union table they need, i.e., only the labels
+// reachable from the labels of the events, with the ids they have in the
+// table. The worker puts the labels back at their ids in a table of its
+// own, so the parser sees the same table, with holes where the labels
+// nobody needs were. A blob is:
+// - the magic, and the flags the mutator parsed with (kNested);
+// - the input, as its size and its bytes;
+// - the labels in ascending order, each as the delta of its id to the
+//   previous one, op, size, l1 and l2 as the delta back from the label
+//   (labels point backwards, 0 stays 0, and l2 is a byte count for a
+//   Load), the hash, and the operands;
+// - the events, each as its kind, then the arguments of the parser call
+//   it stands for.
+// All integers but the magic and the hashes are LEB128 varints, which is
+// most of what there is to compress in a table of small deltas.
+class TraceBlob {
+public:
+  static const uint64_t kMagic = 0x31424c4254ULL; // "TBLB1"
+  enum flags_t : uint32_t { kNested = 1 };
+  enum event_kind_t : uint8_t { Cond = 1, Switch, Gep, Memcmp };
+
+  // an event, as read back; content points into the blob
+  struct event_t {
+    uint8_t kind;
+    dfsan_label label; // of the condition, the index, or the memcmp
+    bool result;       // the direction taken, of a cond
+    bool add_nested;
+    dfsan_label taken_label; // of a switch
+    uint64_t value;          // of the switch condition, or the index
+    std::vector<uint64_t> cases;
+    std::vector<uint32_t> targets;
+    dfsan_label ptr_label;
+    uint64_t ptr;
+    uint64_t num_elems;
+    uint64_t elem_size;
+    int64_t current_offset;
+    const uint8_t *content;
+    size_t content_size;
+  };
+
+  void start(const uint8_t *input, size_t size, uint32_t flags) {
+    input_.assign(input, input + size);
+    flags_ = flags;
+    events_.clear();
+    roots_.clear();
+    num_events_ = 0;
+    num_branches_ = 0;
+  }
+
+  void add_cond(dfsan_label label, bool result, bool add_nested) {
+    put<uint8_t>(events_, Cond);
+    put_varint(events_, label);
+    put<uint8_t>(events_, (result ? 1 : 0) | (add_nested ? 2 : 0));
+    roots_.push_back(label);
+    num_events_++;
+    num_branches_++;
+  }
+
+  void add_switch(dfsan_label label, uint64_t result,
+                  std::vector<uint64_t> const& cases,
+                  std::vector<uint32_t> const& targets,
+                  dfsan_label taken_label) {
+    put<uint8_t>(events_, Switch);
+    put_varint(events_, label);
+    put_varint(events_, result);
+    put_varint(events_, taken_label);
+    put_varint(events_, cases.size());
+    for (auto c : cases) put_varint(events_, c);
+    put_varint(events_, targets.size());
+    for (auto t : targets) put_varint(events_, t);
+    roots_.push_back(label);
+    roots_.push_back(taken_label);
+    num_events_++;
+    num_branches_++;
+  }
+
+  void add_gep(dfsan_label ptr_label, uint64_t ptr, dfsan_label index_label,
+               int64_t index, uint64_t num_elems, uint64_t elem_size,
+               int64_t current_offset) {
+    put<uint8_t>(events_, Gep);
+    put_varint(events_, index_label);
+    put_varint(events_, (uint64_t)index);
+    put_varint(events_, ptr_label);
+    put_varint(events_, ptr);
+    put_varint(events_, num_elems);
+    put_varint(events_, elem_size);
+    put_varint(events_, (uint64_t)current_offset);
+    roots_.push_back(index_label);
+    roots_.push_back(ptr_label);
+    num_events_++;
+    num_branches_++;
+  }
+
+  void add_memcmp(dfsan_label label, const uint8_t *content, size_t size) {
+    put<uint8_t>(events_, Memcmp);
+    put_varint(events_, label);
+    put_varint(events_, size);
+    events_.insert(events_.end(), content, content + size);
+    roots_.push_back(label);
+    num_events_++;
+  }
+
+  // the branches and indices to solve, the memcmps only go along with them
+  size_t num_branches() const { return num_branches_; }
+
+  // the blob of the trace, with the labels the events reach in the table of
+  // max_label labels; false if a label is out of it or points forwards
+  bool encode(std::vector<uint8_t> &out, const dfsan_label_info *infos,
+              const dfsan_label_operands *ops, size_t max_label,
+              size_t *num_labels = nullptr) const {
+    std::unordered_set<dfsan_label> seen;
+    std::vector<dfsan_label> stack(roots_.begin(), roots_.end());
+    while (!stack.empty()) {
+      dfsan_label l = stack.back();
+      stack.pop_back();
+      if (l == CONST_LABEL) continue;
+      if (l >= max_label) return false;
+      if (!seen.insert(l).second) continue;
+      const dfsan_label_info &info = infos[l];
+      if ((info.l1 && info.l1 >= l) ||
+          (info.op != __dfsan::Load && info.l2 && info.l2 >= l)) {
+        return false;
+      }
+      if (info.l1) stack.push_back(info.l1);
+      if (info.l2 && info.op != __dfsan::Load) stack.push_back(info.l2);
+    }
+    std::vector<dfsan_label> labels(seen.begin(), seen.end());
+    std::sort(labels.begin(), labels.end());
+
+    out.clear();
+    put<uint64_t>(out, kMagic);
+    put_varint(out, flags_);
+    put_varint(out, input_.size());
+    out.insert(out.end(), input_.begin(), input_.end());
+    put_varint(out, labels.size());
+    dfsan_label prev = 0;
+    for (auto l : labels) {
+      const dfsan_label_info &info = infos[l];
+      put_varint(out, l - prev);
+      put_varint(out, info.op);
+      put_varint(out, info.size);
+      put_varint(out, info.l1 ? l - info.l1 : 0);
+      if (info.op == __dfsan::Load) put_varint(out, info.l2);
+      else put_varint(out, info.l2 ? l - info.l2 : 0);
+      put<uint32_t>(out, info.hash);
+      put_varint(out, ops[l].op1.i);
+      put_varint(out, ops[l].op2.i);
+      prev = l;
+    }
+    put_varint(out, num_events_);
+    out.insert(out.end(), events_.begin(), events_.end());
+    if (num_labels) *num_labels = labels.size();
+    return true;
+  }
+
+  // reads a blob, putting its labels into the table of max_label labels,
+  // and their ids into written, to be cleared again after; false if it
+  // doesn't parse, with the labels written so far in written
+  bool decode(const uint8_t *p, size_t size, dfsan_label_info *infos,
+              dfsan_label_operands *ops, size_t max_label,
+              std::vector<dfsan_label> &written) {
+    const uint8_t *end = p + size;
+    uint64_t magic, flags, in_size, num_labels, num_events;
+    if (!get(p, end, magic) || magic != kMagic ||
+        !get_varint(p, end, flags) || !get_varint(p, end, in_size) ||
+        in_size > (uint64_t)(end - p)) {
+      return false;
+    }
+    flags_ = (uint32_t)flags;
+    input_.assign(p, p + in_size);
+    p += in_size;
+    if (!get_varint(p, end, num_labels)) return false;
+    uint64_t l = 0;
+    for (uint64_t i = 0; i < num_labels; i++) {
+      uint64_t delta, op, lsize, l1, l2, op1, op2;
+      uint32_t hash;
+      if (!get_varint(p, end, delta) || !get_varint(p, end, op) ||
+          !get_varint(p, end, lsize) || !get_varint(p, end, l1) ||
+          !get_varint(p, end, l2) || !get(p, end, hash) ||
+          !get_varint(p, end, op1) || !get_varint(p, end, op2)) {
+        return false;
+      }
+      l += delta;
+      if (delta == 0 || l >= max_label || l1 > l ||
+          (op != __dfsan::Load && l2 > l)) {
+        return false;
+      }
+      dfsan_label_info &info = infos[l];
+      info.op = (uint16_t)op;
+      info.size = (uint16_t)lsize;
+      info.l1 = l1 ? (dfsan_label)(l - l1) : CONST_LABEL;
+      if (op == __dfsan::Load) info.l2 = (dfsan_label)l2;
+      else info.l2 = l2 ? (dfsan_label)(l - l2) : CONST_LABEL;
+      info.hash = hash;
+      ops[l].op1.i = op1;
+      ops[l].op2.i = op2;
+      written.push_back((dfsan_label)l);
+    }
+    if (!get_varint(p, end, num_events)) return false;
+    events_.assign(p, end);
+    num_events_ = num_events;
+    return true;
+  }
+
+  uint32_t flags() const { return flags_; }
+  std::vector<uint8_t> const& input() const { return input_; }
+
+  // the next event of a decoded blob, from pos; false at the end, or at an
+  // event that doesn't parse
+  bool next_event(size_t &pos, event_t &ev) const {
+    const uint8_t *p = events_.data() + pos, *end = events_.data() + events_.size();
+    uint64_t label, v, n;
+    uint8_t b;
+    if (!get(p, end, ev.kind) || !get_varint(p, end, label)) return false;
+    ev.label = (dfsan_label)label;
+    switch (ev.kind) {
+      case Cond:
+        if (!get(p, end, b)) return false;
+        ev.result = b & 1;
+        ev.add_nested = (b & 2) != 0;
+        break;
+      case Switch:
+        if (!get_varint(p, end, ev.value) || !get_varint(p, end, v) ||
+            !get_varint(p, end, n) || n > (uint64_t)(end - p)) {
+          return false;
+        }
+        ev.taken_label = (dfsan_label)v;
+        ev.cases.resize(n);
+        for (auto &c : ev.cases) {
+          if (!get_varint(p, end, c)) return false;
+        }
+        if (!get_varint(p, end, n) || n > (uint64_t)(end - p)) return false;
+        ev.targets.resize(n);
+        for (auto &t : ev.targets) {
+          if (!get_varint(p, end, v) || v > ev.cases.size()) return false;
+          t = (uint32_t)v;
+        }
+        break;
+      case Gep:
+        if (!get_varint(p, end, ev.value) || !get_varint(p, end, v) ||
+            !get_varint(p, end, ev.ptr) || !get_varint(p, end, ev.num_elems) ||
+            !get_varint(p, end, ev.elem_size) || !get_varint(p, end, n)) {
+          return false;
+        }
+        ev.ptr_label = (dfsan_label)v;
+        ev.current_offset = (int64_t)n;
+        break;
+      case Memcmp:
+        if (!get_varint(p, end, n) || n > (uint64_t)(end - p)) return false;
+        ev.content = p;
+        ev.content_size = n;
+        p += n;
+        break;
+      default:
+        return false;
+    }
+    pos = p - events_.data();
+    return true;
+  }
+
+  // the solutions of a trace, sent back: their number, then for each the
+  // bytes set, as the delta of the offset to the previous one and the
+  // value, and the splice, if any
+  static void encode_patches(std::vector<uint8_t> &out,
+                             std::vector<patch_t> const& patches) {
+    out.clear();
+    put<uint64_t>(out, kMagic);
+    put_varint(out, patches.size());
+    for (auto const& patch : patches) {
+      std::vector<std::pair<size_t, uint8_t>> bytes(patch.bytes.begin(),
+                                                    patch.bytes.end());
+      std::sort(bytes.begin(), bytes.end());
+      put_varint(out, bytes.size());
+      size_t prev = 0;
+      for (auto const& [offset, value] : bytes) {
+        put_varint(out, offset - prev);
+        put<uint8_t>(out, value);
+        prev = offset;
+      }
+      put<uint8_t>(out, patch.spliced);
+      if (patch.spliced) {
+        put_varint(out, patch.splice_offset);
+        put_varint(out, patch.splice_len);
+        put_varint(out, patch.splice.size());
+        out.insert(out.end(), patch.splice.begin(), patch.splice.end());
+      }
+    }
+  }
+
+  // the solutions, each checked to fit an input of in_size bytes
+  static bool decode_patches(const uint8_t *p, size_t size, size_t in_size,
+                             std::vector<patch_t> &patches) {
+    const uint8_t *end = p + size;
+    uint64_t magic, n;
+    if (!get(p, end, magic) || magic != kMagic || !get_varint(p, end, n) ||
+        n > (uint64_t)(end - p)) {
+      return false;
+    }
+    patches.resize(n);
+    for (auto &patch : patches) {
+      uint64_t count, offset = 0, delta;
+      uint8_t value, spliced;
+      if (!get_varint(p, end, count) || count > (uint64_t)(end - p)) return false;
+      for (uint64_t i = 0; i < count; i++) {
+        if (!get_varint(p, end, delta) || !get(p, end, value)) return false;
+        offset += delta;
+        if (offset >= in_size) return false;
+        patch.set(offset, value);
+      }
+      if (!get(p, end, spliced)) return false;
+      if (spliced) {
+        uint64_t s_offset, s_len, s_size;
+        if (!get_varint(p, end, s_offset) || !get_varint(p, end, s_len) ||
+            !get_varint(p, end, s_size) || s_size > (uint64_t)(end - p) ||
+            s_offset > in_size || s_len > in_size - s_offset) {
+          return false;
+        }
+        patch.replace(s_offset, s_len, p, s_size);
+        p += s_size;
+      }
+    }
+    return true;
+  }
+
+private:
+  // which recodes the blobs, with the same integers
+  friend class TraceArchive;
+
+  std::vector<uint8_t> input_;
+  uint32_t flags_ = 0;
+  std::vector<uint8_t> events_;
+  uint64_t num_events_ = 0;
+  size_t num_branches_ = 0;
+  std::vector<dfsan_label> roots_;
+
+  template <typename T>
+  static void put(std::vector<uint8_t> &out, T v) {
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(&v);
+    out.insert(out.end(), p, p + sizeof(T));
+  }
+
+  template <typename T>
+  static bool get(const uint8_t *&p, const uint8_t *end, T &v) {
+    if ((size_t)(end - p) < sizeof(T)) return false;
+    memcpy(&v, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+  }
+
+  static void put_varint(std::vector<uint8_t> &out, uint64_t v) {
+    while (v >= 0x80) {
+      out.push_back((uint8_t)v | 0x80);
+      v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+  }
+
+  static bool get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+    v = 0;
+    for (unsigned shift = 0; shift < 64 && p < end; shift += 7) {
+      uint8_t b = *p++;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80)) return true;
+    }
+    return false;
+  }
+};
+
+// The directories the mutators and the workers exchange the blobs through,
+// e.g., on a shared file system: traces/ has the blobs waiting, claimed/
+// the ones being solved, and patches/ the solutions of each, under the
+// name of its trace. A file is written under a dot name and renamed into
+// place once complete, and a worker claims a trace by renaming it into
+// claimed/, which only one of them gets to do.
+class TraceSpool {
+public:
+  bool open(const char *dir) {
+    dir_ = dir;
+    for (const char *sub : {"", "/traces", "/claimed", "/patches"}) {
+      std::string path = dir_ + sub;
+      if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) return false;
+    }
+    return true;
+  }
+
+  bool is_open() const { return !dir_.empty(); }
+
+  // sub/name, e.g., "traces"
+  std::string path(const char *sub, std::string const& name) const {
+    return dir_ + "/" + sub + "/" + name;
+  }
+
+  bool publish(const char *sub, std::string const& name,
+               std::vector<uint8_t> const& bytes) const {
+    std::string tmp = path(sub, "." + name);
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = ::write(fd, bytes.data(), bytes.size()) == (ssize_t)bytes.size();
+    ::close(fd);
+    if (!ok || rename(tmp.c_str(), path(sub, name).c_str()) != 0) {
+      unlink(tmp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // the complete files in sub whose names start with prefix
+  std::vector<std::string> list(const char *sub, std::string const& prefix) const {
+    std::vector<std::string> names;
+    DIR *d = opendir((dir_ + "/" + sub).c_str());
+    if (!d) return names;
+    while (struct dirent *e = readdir(d)) {
+      if (e->d_name[0] == '.') continue;
+      if (strncmp(e->d_name, prefix.c_str(), prefix.size()) == 0) {
+        names.emplace_back(e->d_name);
+      }
+    }
+    closedir(d);
+    return names;
+  }
+
+  // moves traces/name to claimed/name, false if another worker got it first
+  bool claim(std::string const& name) const {
+    return rename(path("traces", name).c_str(), path("claimed", name).c_str()) == 0;
+  }
+
+  bool read(const char *sub, std::string const& name,
+            std::vector<uint8_t> &bytes) const {
+    int fd = ::open(path(sub, name).c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) return false;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok) {
+      bytes.resize(st.st_size);
+      ok = ::read(fd, bytes.data(), bytes.size()) == (ssize_t)bytes.size();
+    }
+    ::close(fd);
+    return ok;
+  }
+
+  void remove(const char *sub, std::string const& name) const {
+    unlink(path(sub, name).c_str());
+  }
+
+private:
+  std::string dir_;
+};
+
+}; // namespace rgd
@@ -0,0 +1,36 @@
+#ifndef SYMSAN_TRACE_FILE_H
+#define SYMSAN_TRACE_FILE_H
+
+#include <stdint.h>
+
+/// A recorded run: the prefix of the union table its events refer to, the
+/// input it ran on, and its event stream, so the parsers and solvers can be
+/// fed without spawning the target. The layout is meant to be mmapped:
+/// - the header, in the first page;
+/// - the table, at TRACE_TABLE_OFFSET, laid out like the shm one: the label
+///   infos in the lower half and the operands in the upper half, so both
+///   halves can be mapped where the union table would be;
+/// - the input at input_offset, and the events at events_offset, as they
+///   came through the event stream, with the memcmp contents inline.
+
+#define TRACE_MAGIC 0x31454341525453ULL  // "STRACE1"
+#define TRACE_VERSION 1
+#define TRACE_TABLE_OFFSET 4096UL
+
+struct trace_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t num_labels;    // labels [0, num_labels) are in the table
+  uint64_t table_size;    // both halves, each rounded up to a page
+  uint64_t input_offset;
+  uint64_t input_size;
+  uint64_t events_offset;
+  uint64_t events_size;
+};
+
+// size of each half of the table of a trace with num_labels labels
+static inline uint64_t trace_table_half(uint32_t num_labels, uint64_t entry_size) {
+  return (num_labels * entry_size + TRACE_TABLE_OFFSET - 1) & ~(TRACE_TABLE_OFFSET - 1);
+}
+
+#endif /* !SYMSAN_TRACE_FILE_H */
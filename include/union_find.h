@@ -1,30 +1,35 @@
 #pragma once
 
 #include <stdint.h>
+#include <algorithm>
 #include <vector>
-#include <unordered_set>
 
 namespace rgd {
 
-// disjoint set data structure
+// disjoint set data structure; the elements are stamped with the
+// generation they were last touched in, so a reset only bumps the
+// generation and an element from an older one is taken as a set of its own
 class UnionFind {
 public:
   static const size_t INVALID = (size_t)-1;
 
-  UnionFind() : size_(0) {};
-  UnionFind(size_t size) {
+  UnionFind() : size_(0), gen_(1) {};
+  UnionFind(size_t size) : size_(0), gen_(1) {
     reset(size);
   };
 
   void reset(size_t size) {
     size_ = size;
-    parent.resize(size);
-    next.resize(size);
-    rank.resize(size);
-    for (size_t i = 0; i < size; ++i) {
-      parent[i] = i;
-      next[i] = i;
-      rank[i] = 0;
+    if (size > parent.size()) {
+      parent.resize(size);
+      next.resize(size);
+      rank.resize(size);
+      stamp.resize(size, 0);
+    }
+    if (++gen_ == 0) {
+      // wrapped around, stale stamps could look current
+      std::fill(stamp.begin(), stamp.end(), 0);
+      gen_ = 1;
     }
   }
 
@@ -32,6 +37,7 @@ public:
   size_t find(size_t x) {
     if (x >= size_) return INVALID;
 
+    touch(x);
     size_t p = parent[x];
     while (x != p) {
       size_t gp = parent[p];
@@ -69,24 +75,37 @@ public:
     }
   }
 
-  // get the set containing x
-  size_t get_set(size_t x, std::unordered_set<size_t> &set) {
+  // append the elements of the set containing x to set, return how many
+  size_t get_set(size_t x, std::vector<size_t> &set) {
     if (x >= size_) return INVALID;
+    touch(x);
     size_t temp = x;
-    set.clear();
-    set.insert(temp);
+    size_t n = 1;
+    set.push_back(temp);
     while (next[temp] != x) {
       temp = next[temp];
-      set.insert(temp);
+      set.push_back(temp);
+      n++;
     }
-    return set.size();
+    return n;
   }
 
 private:
+  // the links of a touched element only lead to touched ones
+  inline void touch(size_t x) {
+    if (stamp[x] == gen_) return;
+    stamp[x] = gen_;
+    parent[x] = x;
+    next[x] = x;
+    rank[x] = 0;
+  }
+
   size_t size_;
+  uint32_t gen_;
   std::vector<size_t> parent;
   std::vector<size_t> next;
   std::vector<size_t> rank;
+  std::vector<uint32_t> stamp;
 };
 
-};
\ No newline at end of file
+};
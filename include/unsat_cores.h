@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace rgd {
+
+// Unsat cores of solved tasks, as the sets of fingerprints of the
+// constraints in them, so a later task with all the constraints of a core
+// (e.g., a nested task over the same infeasible branches) can be rejected
+// without solving it. A core is indexed under its smallest fingerprint, a
+// query only looks at the cores indexed under the fingerprints it has.
+// Once there are max_cores cores, the cache starts over.
+class UnsatCoreCache {
+public:
+  using fp_set_t = std::vector<uint64_t>;
+
+  static const size_t kDefaultMaxCores = 1 << 16;
+
+  explicit UnsatCoreCache(size_t max_cores = kDefaultMaxCores)
+    : max_cores_(max_cores) {}
+
+  // a core is sorted and deduplicated here, a superset of a known core
+  // isn't added
+  void add(fp_set_t core) {
+    if (core.empty()) return;
+    std::sort(core.begin(), core.end());
+    core.erase(std::unique(core.begin(), core.end()), core.end());
+    std::lock_guard<std::mutex> lock(lock_);
+    if (covers_locked(core)) return;
+    if (cores_.size() >= max_cores_) {
+      cores_.clear();
+      index_.clear();
+    }
+    index_[core[0]].push_back(cores_.size());
+    cores_.push_back(std::move(core));
+  }
+
+  // whether fps, sorted, has all the fingerprints of some core
+  bool covers(fp_set_t const& fps) const {
+    if (fps.empty()) return false;
+    std::lock_guard<std::mutex> lock(lock_);
+    return covers_locked(fps);
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(lock_);
+    return cores_.size();
+  }
+
+private:
+  bool covers_locked(fp_set_t const& fps) const {
+    if (cores_.empty()) return false;
+    uint64_t last = 0;
+    for (size_t i = 0; i < fps.size(); i++) {
+      if (i && fps[i] == last) continue;
+      last = fps[i];
+      auto itr = index_.find(fps[i]);
+      if (itr == index_.end()) continue;
+      for (size_t c : itr->second) {
+        auto const &core = cores_[c];
+        // the elements before fps[i] are smaller than the core's smallest
+        if (std::includes(fps.begin() + i, fps.end(), core.begin(), core.end())) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  size_t max_cores_;
+  mutable std::mutex lock_;
+  std::vector<fp_set_t> cores_;
+  std::unordered_map<uint64_t, std::vector<size_t>> index_;
+};
+
+};  // namespace rgd
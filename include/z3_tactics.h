@@ -0,0 +1,56 @@
+#pragma once
+
+#include <z3++.h>
+
+#include <memory>
+#include <string>
+
+#include <string.h>
+
+namespace rgd {
+
+// A tactic chain for the queries of the solvers, which are small QF_BV
+// conjunctions over a few input bytes, where Z3's own preprocessing costs
+// more than the search. The chain is built once per context, the solvers
+// made of it are kept across queries; they're not incremental (the chain
+// runs again on every check), and they can't tell unsat cores, so the
+// checks that need one stay on Z3's own solver.
+class Z3Tactics {
+public:
+  static constexpr const char *kDefaultChain =
+      "simplify,propagate-values,solve-eqs,bit-blast,sat";
+
+  // the chain as the tactics' names separated by commas, "default" for
+  // kDefaultChain, null, "" or "none" for Z3's own solver; throws a
+  // z3::exception on an unknown tactic
+  Z3Tactics(z3::context &context, const char *chain) : context_(context) {
+    if (!chain || !*chain || !strcmp(chain, "none")) return;
+    if (!strcmp(chain, "default")) chain = kDefaultChain;
+    std::string names(chain);
+    size_t pos = 0;
+    while (pos <= names.size()) {
+      size_t comma = names.find(',', pos);
+      if (comma == std::string::npos) comma = names.size();
+      std::string name = names.substr(pos, comma - pos);
+      pos = comma + 1;
+      if (name.empty()) continue;
+      z3::tactic t(context_, name.c_str());
+      if (tactic_) *tactic_ = *tactic_ & t;
+      else tactic_.reset(new z3::tactic(t));
+    }
+  }
+
+  bool enabled() const { return tactic_ != nullptr; }
+
+  // a solver of the chain, or Z3's own one if there's none
+  z3::solver make_solver() const {
+    if (tactic_) return tactic_->mk_solver();
+    return z3::solver(context_, "QF_BV");
+  }
+
+private:
+  z3::context &context_;
+  std::unique_ptr<z3::tactic> tactic_;
+};
+
+}; // namespace rgd
@@ -21,6 +21,7 @@
 #include "llvm/ADT/None.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ADT/Triple.h"
@@ -39,6 +40,7 @@
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/InstVisitor.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Instruction.h"
@@ -48,6 +50,7 @@
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/User.h"
 #include "llvm/IR/Value.h"
@@ -57,8 +60,11 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/DJB.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
 #include "llvm/Support/SpecialCaseList.h"
 #include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Instrumentation.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
@@ -85,6 +91,9 @@ static const Align kShadowTLSAlignment = Align(4);
 static const unsigned kArgTLSSize = 800;
 static const unsigned kRetvalTLSSize = 800;
 
+// Ops of one lazily labelled FP expression, larger ones are split up.
+static const unsigned kMaxLazyFPNodes = 64;
+
 // External symbol to be used when generating the shadow address for
 // architectures with multiple VMAs. Instead of using a constant integer
 // the runtime will set the external mask based on the VMA range.
@@ -152,11 +161,114 @@ static cl::opt<bool> ClTraceFP(
     cl::desc("Propagate taint for floating pointer instructions."),
     cl::Hidden, cl::init(false));
 
+// The calling context attached to traced branches. Negative values hash the
+// whole call stack, otherwise only the innermost N functions are kept, each
+// in 32 / N bits of the context, and 0 drops the context altogether.
+static cl::opt<int> ClContextDepth(
+    "taint-context-depth",
+    cl::desc("Number of callers in the branch context, -1 for all of them"),
+    cl::Hidden, cl::init(-1));
+
+static cl::opt<bool> ClTraceFPLazy(
+    "taint-trace-fp-lazy",
+    cl::desc("Build the labels of floating point expressions only where they "
+             "are used by a comparison, a conversion to integer or memory."),
+    cl::Hidden, cl::init(false));
+
 static cl::opt<bool> ClTraceBound(
     "taint-trace-bound",
     cl::desc("Trace buffer bound info."),
     cl::Hidden, cl::init(true));
 
+static cl::opt<bool> ClAtomicShadow(
+    "taint-atomic-shadow",
+    cl::desc("Update the shadow of atomic accesses together with the access, "
+             "under a per-address lock of the runtime, so concurrent atomics "
+             "on the same location don't lose or tear their labels."),
+    cl::Hidden, cl::init(false));
+
+static cl::opt<bool> ClSparseShadow(
+    "taint-sparse-shadow",
+    cl::desc("Leave zero shadow stores and shadow copies to the runtime, "
+             "required by a runtime built with SYMSAN_SPARSE_SHADOW."),
+    cl::Hidden, cl::init(false));
+
+static cl::opt<unsigned> ClTraceBudget(
+    "taint-trace-budget",
+    cl::desc("Stop tracing a branch inline after it has been traced this "
+             "many times (at most 255), 0 for no limit."),
+    cl::Hidden, cl::init(0));
+
+static cl::opt<bool> ClCoalesceShadowLoads(
+    "taint-coalesce-shadow-loads",
+    cl::desc("Test the shadow of adjacent loads and aggregates for zero at "
+             "once before loading the labels one by one."),
+    cl::Hidden, cl::init(true));
+
+static cl::opt<bool> ClForwardShadowLoads(
+    "taint-forward-shadow-loads",
+    cl::desc("Reuse the shadow of an earlier load from, or store to, the "
+             "same address in a basic block when nothing in between may "
+             "write it."),
+    cl::Hidden, cl::init(true));
+
+static cl::opt<bool> ClInlineLoadShape(
+    "taint-inline-load-shape",
+    cl::desc("Test the shadow of 2-, 4- and 8-byte loads for consecutive "
+             "labels inline and pass them to the shape load entry point."),
+    cl::Hidden, cl::init(true));
+
+static cl::opt<bool> ClSpecializeUnion(
+    "taint-specialize-union",
+    cl::desc("Call the runtime union entry point specialized for the opcode "
+             "of binary and cast instructions."),
+    cl::Hidden, cl::init(true));
+
+static cl::opt<bool> ClPruneUntainted(
+    "taint-prune-untainted",
+    cl::desc("Skip the shadow of values that no taint source can reach, "
+             "found by a module-level pre-analysis."),
+    cl::Hidden, cl::init(false));
+
+static cl::opt<bool> ClLTO(
+    "taint-lto",
+    cl::desc("Instrument the merged module at link time instead of each "
+             "translation unit, implies -taint-prune-untainted."),
+    cl::Hidden, cl::init(false));
+
+// Lists of functions (fun:) and source files (src:) in the special case list
+// format. Functions outside the allowlist, or in the denylist, are compiled
+// without propagation or tracing but keep the instrumented ABI, so they can
+// still be called from and call into instrumented code.
+static cl::opt<std::string> ClAllowList(
+    "taint-allowlist",
+    cl::desc("File listing the only functions or sources to instrument"),
+    cl::Hidden);
+
+static cl::opt<std::string> ClDenyList(
+    "taint-denylist",
+    cl::desc("File listing functions or sources not to instrument"),
+    cl::Hidden);
+
+// A list of the functions that saw labels in earlier runs, written by the
+// runtime's taint_profile flag. Only those are instrumented, the others are
+// compiled like the ones outside the allowlist, which then adds functions
+// the profile missed instead of restricting it.
+static cl::opt<std::string> ClProfile(
+    "taint-profile",
+    cl::desc("Taint profile of earlier runs, only instrument the functions "
+             "in it"),
+    cl::Hidden);
+
+// A JSON object per instrumented function is appended to the file, one per
+// line: its instructions before and after the pass, the union, comparison and
+// GEP tracing calls it got, and the shadow loads and stores (including the
+// ones the runtime does for it, e.g., __taint_union_load).
+static cl::opt<std::string> ClReport(
+    "taint-report",
+    cl::desc("File to append a per function instrumentation report to"),
+    cl::Hidden);
+
 static StringRef GetGlobalTypeString(const GlobalValue &G) {
   // Types of GlobalVariables are always pointer types.
   Type *GType = G.getValueType();
@@ -207,6 +319,45 @@ class TaintABIList {
   }
 };
 
+/// The -taint-allowlist and -taint-denylist files.
+class TaintFilterList {
+  std::unique_ptr<SpecialCaseList> Allow;
+  std::unique_ptr<SpecialCaseList> Deny;
+  std::unique_ptr<SpecialCaseList> Profile;
+
+  static bool matches(const SpecialCaseList &SCL, StringRef Name,
+                      const Module &M) {
+    return SCL.inSection("taint", "src", M.getModuleIdentifier()) ||
+           SCL.inSection("taint", "fun", Name);
+  }
+
+ public:
+  void set(StringRef AllowFile, StringRef DenyFile, StringRef ProfileFile) {
+    if (!AllowFile.empty())
+      Allow = SpecialCaseList::createOrDie({AllowFile.str()},
+                                           *vfs::getRealFileSystem());
+    if (!DenyFile.empty())
+      Deny = SpecialCaseList::createOrDie({DenyFile.str()},
+                                          *vfs::getRealFileSystem());
+    if (!ProfileFile.empty())
+      Profile = SpecialCaseList::createOrDie({ProfileFile.str()},
+                                             *vfs::getRealFileSystem());
+  }
+
+  /// Returns whether F, named Name before the ABI prefix was added, should be
+  /// left uninstrumented.
+  bool isExcluded(const Function &F, StringRef Name) const {
+    const Module &M = *F.getParent();
+    if (Profile) {
+      if (!matches(*Profile, Name, M) && !(Allow && matches(*Allow, Name, M)))
+        return true;
+    } else if (Allow && !matches(*Allow, Name, M)) {
+      return true;
+    }
+    return Deny && matches(*Deny, Name, M);
+  }
+};
+
 /// TransformedFunction is used to express the result of transforming one
 /// function type into another.  This struct is immutable.  It holds metadata
 /// useful for updating calls of the old function to the new type.
@@ -273,9 +424,16 @@ AttributeList TransformFunctionAttributes(
       llvm::makeArrayRef(ArgumentAttributes));
 }
 
+// Per site counters of -taint-trace-budget, indexed by the low bits of the
+// instruction id, must match the runtime.
+static const unsigned kTraceBudgetBits = 16;
+
+class TaintReachability;
+
 class Taint : public ModulePass {
   friend struct TaintFunction;
   friend class TaintVisitor;
+  friend class TaintReachability;
 
   enum {
     ShadowWidthBits  = 32,
@@ -314,7 +472,10 @@ class Taint : public ModulePass {
     /// the IA_Args ABI, except that IA_Args uses a struct return type to
     /// pass the return value shadow in a register, while WK_Custom uses an
     /// extra pointer argument to return the shadow.  This allows the wrapped
-    /// form of the function type to be expressed in C.
+    /// form of the function type to be expressed in C.  With the additional
+    /// "fastpath" annotation, the wrapper only calls the function and returns
+    /// a zero label when all argument labels are zero, so the call site tests
+    /// them inline and only enters the wrapper when one of them is set.
     WK_Custom,
 
     /// Special cases for memcmp, strcmp, strncmp like functions
@@ -341,14 +502,19 @@ class Taint : public ModulePass {
   Constant *RetvalTLS;
   Constant *ExternalShadowMask;
   FunctionType *TaintUnionFnTy;
+  FunctionType *TaintUnionOpFnTy;
   FunctionType *TaintUnionLoadFnTy;
+  FunctionType *TaintUnionLoadShapeFnTy;
   FunctionType *TaintUnionStoreFnTy;
+  FunctionType *TaintCopyShadowFnTy;
+  FunctionType *TaintAtomicFnTy;
   FunctionType *TaintUnimplementedFnTy;
   FunctionType *TaintSetLabelFnTy;
   FunctionType *TaintNonzeroLabelFnTy;
   FunctionType *TaintVarargWrapperFnTy;
   FunctionType *TaintTraceCmpFnTy;
   FunctionType *TaintTraceCondFnTy;
+  FunctionType *TaintTraceSwitchFnTy;
   FunctionType *TaintTraceIndirectCallFnTy;
   FunctionType *TaintTraceGEPFnTy;
   FunctionType *TaintPushStackFrameFnTy;
@@ -363,13 +529,18 @@ class Taint : public ModulePass {
   FunctionCallee TaintUnionFn;
   FunctionCallee TaintCheckedUnionFn;
   FunctionCallee TaintUnionLoadFn;
+  FunctionCallee TaintUnionLoadShapeFn;
   FunctionCallee TaintUnionStoreFn;
+  FunctionCallee TaintCopyShadowFn;
+  FunctionCallee TaintAtomicBeginFn;
+  FunctionCallee TaintAtomicEndFn;
   FunctionCallee TaintUnimplementedFn;
   FunctionCallee TaintSetLabelFn;
   FunctionCallee TaintNonzeroLabelFn;
   FunctionCallee TaintVarargWrapperFn;
   FunctionCallee TaintTraceCmpFn;
   FunctionCallee TaintTraceCondFn;
+  FunctionCallee TaintTraceSwitchFn;
   FunctionCallee TaintTraceIndirectCallFn;
   FunctionCallee TaintTraceGEPFn;
   FunctionCallee TaintPushStackFrameFn;
@@ -382,20 +553,29 @@ class Taint : public ModulePass {
   FunctionCallee TaintStrncmpFn;
   FunctionCallee TaintDebugFn;
   Constant *CallStack;
+  Constant *TraceBudget;
+  Constant *BoundsTable;
   MDNode *ColdCallWeights;
   TaintABIList ABIList;
+  TaintFilterList FilterList;
   DenseMap<Value *, Function *> UnwrappedFnMap;
+  DenseMap<unsigned, FunctionCallee> UnionOpFns;
   AttrBuilder ReadOnlyNoneAttrs;
   bool TaintRuntimeShadowMask = false;
+  /// Set while instrumenting with -taint-prune-untainted.
+  TaintReachability *Reach = nullptr;
 
   Value *getShadowAddress(Value *Addr, IRBuilder<> &IRB);
+  FunctionCallee getUnionOpFn(unsigned Op);
   bool isInstrumented(const Function *F);
   bool isInstrumented(const GlobalAlias *GA);
+  bool isExcluded(const Function *F);
   FunctionType *getArgsFunctionType(FunctionType *T);
   FunctionType *getTrampolineFunctionType(FunctionType *T);
   TransformedFunction getCustomFunctionType(FunctionType *T);
   InstrumentedABI getInstrumentedABI();
   WrapperKind getWrapperKind(Function *F);
+  bool hasFastPath(Function *F);
   void addGlobalNamePrefix(GlobalValue *GV);
   Function *buildWrapperFunction(Function *F, StringRef NewFName,
                                  GlobalValue::LinkageTypes NewFLink,
@@ -452,6 +632,9 @@ struct TaintFunction {
   DominatorTree DT;
   Taint::InstrumentedABI IA;
   bool IsNativeABI;
+  /// Excluded by the allow/deny lists: all shadows are zero and only what the
+  /// instrumented ABI and memory need is emitted.
+  bool IsExcluded = false;
   Value *ArgTLSPtr = nullptr;
   Value *RetvalTLSPtr = nullptr;
   AllocaInst *LabelReturnAlloca = nullptr;
@@ -476,6 +659,27 @@ struct TaintFunction {
   DenseMap<Value *, Value *> CachedCollapsedShadows;
   DenseMap<Value *, std::set<Value *>> ShadowElements;
 
+  /// Loads from [Base + Begin, Base + End) in one basic block, without any
+  /// memory write in between, whose shadow is tested for zero at once.
+  struct LoadGroup {
+    Value *Base;
+    int64_t Begin;
+    int64_t End;
+    SmallVector<std::pair<LoadInst *, int64_t>, 4> Loads;
+    bool Emitted;
+  };
+  std::vector<LoadGroup> LoadGroups;
+  DenseMap<LoadInst *, unsigned> LoadGroupOf;
+  DenseMap<LoadInst *, Value *> CoalescedShadows;
+
+  /// The earlier load or store in the same basic block whose shadow a load
+  /// reads again.
+  DenseMap<LoadInst *, Instruction *> ShadowSources;
+
+  /// Stack slots of each size whose shadow holds the byte labels of a vector
+  /// while they're rearranged.
+  DenseMap<uint64_t, AllocaInst *> VectorSlots;
+
   TaintFunction(Taint &TT, Function *F, bool IsNativeABI)
       : TT(TT), F(F), IA(TT.getInstrumentedABI()), IsNativeABI(IsNativeABI) {
     DT.recalculate(*F);
@@ -496,6 +700,14 @@ struct TaintFunction {
   Value *getShadow(Value *V);
   void setShadow(Instruction *I, Value *Shadow);
 
+  /// Builds the labels of the FP expression tree rooted at Root right after
+  /// it, behind one test of the labels entering the tree.
+  Value *getLazyFPShadow(Instruction *Root);
+  void collectLazyFPTree(Instruction *I, SmallVectorImpl<Instruction *> &Nodes,
+                         SmallVectorImpl<Value *> &Leaves,
+                         SmallPtrSetImpl<Value *> &Seen);
+  Value *castToInt64(Value *V, IRBuilder<> &IRB);
+
   /// Returns the shadow value of a global variable GV.
   Value *getShadowForGlobal(GlobalVariable *GV, IRBuilder<> &IRB);
 
@@ -505,9 +717,20 @@ struct TaintFunction {
   Value *combineBinaryOperatorShadows(BinaryOperator *BO, uint8_t op);
   Value *combineCastInstShadows(CastInst *CI, uint8_t op);
   Value *combineCmpInstShadows(CmpInst *CI, uint8_t op);
+  // Vector Shadow
+  Value *extractElementShadow(ExtractElementInst *I);
+  Value *combineVectorShadows(
+      Instruction *I, ArrayRef<Value *> Ops,
+      function_ref<Value *(IRBuilder<> &, ArrayRef<Value *>)> Rearrange);
+  Value *expandVectorShadow(Value *V, Value *Shadow, IRBuilder<> &IRB);
+  Value *collapseVectorShadow(Value *V, Value *Bytes, IRBuilder<> &IRB);
+  AllocaInst *getVectorSlot(uint64_t Size);
   void visitCmpInst(CmpInst *I);
   void visitSwitchInst(SwitchInst *I);
   void visitCondition(Value *Cond, Instruction *I);
+  /// Guards a trace call of site CID at Pos with the site's budget, returns
+  /// where to emit the call.
+  Instruction *checkTraceBudget(Value *Shadow, uint32_t CID, Instruction *Pos);
   void visitGEPInst(GetElementPtrInst *I);
   Value *visitAllocaInst(AllocaInst *I, Value *ArraySize, Type *ElTy);
   void checkBounds(Value *Ptr, Value *Size, Instruction *Pos);
@@ -536,18 +759,37 @@ struct TaintFunction {
   void storeShadow(Value *Addr, uint64_t Size, Align Alignment,
                    Value *Shadow, Instruction *Pos);
 
+  /// With -taint-atomic-shadow, takes the runtime's lock of Addr before the
+  /// shadow code of the atomic access I, and releases it right after I.
+  void lockAtomic(Value *Addr, Instruction *I);
+
+  /// Groups the loads whose shadow can be tested for zero together, must be
+  /// called before visiting the function.
+  void coalesceShadowLoads();
+  /// Returns the shadow of LI if it belongs to a load group, emitting the
+  /// test of the group at its first load.
+  Value *getCoalescedShadow(LoadInst *LI);
+  /// Finds the loads whose shadow is that of an earlier access, must be
+  /// called after coalesceShadowLoads.
+  void forwardShadowLoads();
+  /// Returns the shadow of LI if an earlier access has it, nullptr if not.
+  Value *getForwardedShadow(LoadInst *LI);
+
 private:
   /// Loads a primitive shadow label
   Value *loadPrimitiveShadow(Value *Addr, uint64_t Size, uint64_t Align,
                              IRBuilder<> &IRB);
   /// Loads shadow recursively for aggregate types
-  void loadShadowRecursive(Value *Shadow, SmallVector<unsigned, 4> &Indices,
+  void loadShadowRecursive(Value *&Shadow, SmallVector<unsigned, 4> &Indices,
                            Type *SubTy, Value *Addr, uint64_t Size,
                            uint64_t Align, IRBuilder<> &IRB);
   /// Stores an aggregate shadow label
   void storeShadowRecursive(Value *Shadow, SmallVector<unsigned, 4> &Indices,
                             Type *SubShadowTy, Value *ShadowAddr, uint64_t Size,
                             uint64_t Align, IRBuilder<> &IRB);
+  /// Returns an i1 that is true if all labels of [Addr, Addr + Size) are zero
+  Value *isZeroShadowRange(Value *Addr, uint64_t Size, IRBuilder<> &IRB);
+  bool isCoalescableLoad(LoadInst *LI);
   /// Returns the shadow value of an argument A.
   Value *getShadowForTLSArgument(Argument *A);
 };
@@ -586,6 +828,61 @@ public:
   void visitMemTransferInst(MemTransferInst &I);
 };
 
+/// Module-level pre-analysis finding the values that no taint source can
+/// reach, so their shadow is known to be zero. Labels enter a function through
+/// its arguments, call results, and loads; the analysis follows them through
+/// SSA values, memory that never escapes (allocas and internal globals only
+/// accessed as scalars), and the arguments and returns of internal functions
+/// that are only called directly. Everything else is assumed to be tainted,
+/// and so are pointers, whose shadow carries the bounds info.
+class TaintReachability {
+public:
+  TaintReachability(Taint &TT) : TT(TT) {}
+
+  void run(Module &M);
+
+  /// True for scalar values with a provably zero shadow, and for the loads
+  /// and stores of memory that never holds a label.
+  bool isUntainted(const Value *V) const { return Untainted.count(V); }
+
+  /// True if the callee never reads the shadow of argument ArgNo, so the call
+  /// doesn't have to pass it.
+  bool isArgShadowUnused(const CallBase &CB, unsigned ArgNo) const {
+    const Function *F = dyn_cast<Function>(CB.getCalledOperand());
+    return F && Internal.count(F) && Untainted.count(F->getArg(ArgNo));
+  }
+
+  /// True if F only returns unlabelled values, its returns then don't pass a
+  /// shadow and its callers don't read one.
+  bool isReturnShadowUnused(const Function *F) const {
+    return F && Internal.count(F) && !TaintedRets.count(F);
+  }
+
+private:
+  Taint &TT;
+  DenseSet<const Function *> Internal;
+  DenseMap<const Instruction *, const Value *> AccessObj;
+  DenseMap<const Value *, SmallVector<LoadInst *, 4>> ObjLoads;
+  DenseSet<const Value *> Tainted;
+  DenseSet<const Value *> TaintedObjs;
+  DenseSet<const Function *> TaintedRets;
+  SmallVector<Value *, 64> Worklist;
+  DenseSet<const Value *> Untainted;
+
+  static bool isPrunableType(Type *T) {
+    return T->isIntOrIntVectorTy() || T->isFPOrFPVectorTy();
+  }
+  bool isInternal(Function &F);
+  bool collectAccesses(Value *Obj, SmallVectorImpl<Instruction *> &Accesses);
+  void trackObject(Value *Obj);
+  bool isCallResultTainted(CallBase *CB);
+  bool dependsOnArgs(CallBase *CB);
+  void taint(Value *V);
+  void taintObject(const Value *Obj);
+  void taintReturn(Function *F);
+  void propagate(Value *V);
+};
+
 } // end anonymous namespace
 
 char Taint::ID;
@@ -615,6 +912,7 @@ Taint::Taint(
   // FIXME: should we propagate vfs::FileSystem to this constructor?
   ABIList.set(
       SpecialCaseList::createOrDie(AllABIListFiles, *vfs::getRealFileSystem()));
+  FilterList.set(ClAllowList, ClDenyList, ClProfile);
 }
 
 FunctionType *Taint::getArgsFunctionType(FunctionType *T) {
@@ -772,10 +1070,19 @@ void Taint::addContextRecording(Function &F) {
   }
   uint32_t hash = djbHash(FName);
 
-  ConstantInt *CID = ConstantInt::get(Int32Ty, hash);
   LoadInst *LCS = IRB.CreateLoad(CallStack);
   LCS->setMetadata(Mod->getMDKindID("nosanitize"), MDNode::get(*Ctx, None));
-  Value *NCS = IRB.CreateXor(LCS, CID);
+  Value *NCS;
+  if (ClContextDepth < 0) {
+    NCS = IRB.CreateXor(LCS, ConstantInt::get(Int32Ty, hash));
+  } else if (ClContextDepth == 1) {
+    NCS = ConstantInt::get(Int32Ty, hash);
+  } else {
+    // shift out the outermost function
+    unsigned Bits = 32 / std::min(ClContextDepth.getValue(), 32);
+    NCS = IRB.CreateOr(IRB.CreateShl(LCS, Bits),
+                       ConstantInt::get(Int32Ty, hash & ((1U << Bits) - 1)));
+  }
   StoreInst *SCS = IRB.CreateStore(NCS, CallStack);
   SCS->setMetadata(Mod->getMDKindID("nosanitize"), MDNode::get(*Ctx, None));
 
@@ -791,7 +1098,28 @@ void Taint::addContextRecording(Function &F) {
   }
 }
 
+// allocas that get a bounds label from __taint_trace_alloca
+static bool isBoundsTrackedAlloca(const AllocaInst &I) {
+  Type *T = I.getAllocatedType();
+  return I.isArrayAllocation() || T->isArrayTy() || T->isStructTy();
+}
+
 void Taint::addFrameTracing(Function &F) {
+  // the frame only restores the bounds labels of tracked allocas
+  if (!ClTraceBound)
+    return;
+  bool HasTrackedAlloca = false;
+  for (Instruction &I : instructions(F)) {
+    if (AllocaInst *AI = dyn_cast<AllocaInst>(&I)) {
+      if (isBoundsTrackedAlloca(*AI)) {
+        HasTrackedAlloca = true;
+        break;
+      }
+    }
+  }
+  if (!HasTrackedAlloca)
+    return;
+
   BasicBlock *BB = &F.getEntryBlock();
   assert(pred_begin(BB) == pred_end(BB) &&
          "Assume that entry block has no predecessors");
@@ -844,12 +1172,23 @@ bool Taint::doInitialization(Module &M) {
   Type *TaintUnionArgs[6] = { PrimitiveShadowTy, PrimitiveShadowTy, Int16Ty, Int16Ty, Int64Ty, Int64Ty};
   TaintUnionFnTy = FunctionType::get(
       PrimitiveShadowTy, TaintUnionArgs, /*isVarArg=*/ false);
+  Type *TaintUnionOpArgs[5] = { PrimitiveShadowTy, PrimitiveShadowTy, Int16Ty, Int64Ty, Int64Ty};
+  TaintUnionOpFnTy = FunctionType::get(
+      PrimitiveShadowTy, TaintUnionOpArgs, /*isVarArg=*/ false);
   Type *TaintUnionLoadArgs[2] = { PrimitiveShadowPtrTy, IntptrTy };
   TaintUnionLoadFnTy = FunctionType::get(
       PrimitiveShadowTy, TaintUnionLoadArgs, /*isVarArg=*/ false);
+  Type *TaintUnionLoadShapeArgs[3] = { PrimitiveShadowTy, PrimitiveShadowPtrTy, IntptrTy };
+  TaintUnionLoadShapeFnTy = FunctionType::get(
+      PrimitiveShadowTy, TaintUnionLoadShapeArgs, /*isVarArg=*/ false);
   Type *TaintUnionStoreArgs[3] = { PrimitiveShadowTy, PrimitiveShadowPtrTy, IntptrTy };
   TaintUnionStoreFnTy = FunctionType::get(
       Type::getVoidTy(*Ctx), TaintUnionStoreArgs, /*isVarArg=*/ false);
+  Type *TaintCopyShadowArgs[3] = { PrimitiveShadowPtrTy, PrimitiveShadowPtrTy, IntptrTy };
+  TaintCopyShadowFnTy = FunctionType::get(
+      Type::getVoidTy(*Ctx), TaintCopyShadowArgs, /*isVarArg=*/ false);
+  TaintAtomicFnTy = FunctionType::get(
+      Type::getVoidTy(*Ctx), Type::getInt8PtrTy(*Ctx), /*isVarArg=*/false);
   TaintUnimplementedFnTy = FunctionType::get(
       Type::getVoidTy(*Ctx), Type::getInt8PtrTy(*Ctx), /*isVarArg=*/false);
   Type *TaintSetLabelArgs[3] = { PrimitiveShadowTy, Type::getInt8PtrTy(*Ctx), IntptrTy };
@@ -867,6 +1206,10 @@ bool Taint::doInitialization(Module &M) {
   Type *TaintTraceCondArgs[3] = { PrimitiveShadowTy, Int8Ty, Int32Ty };
   TaintTraceCondFnTy = FunctionType::get(
       Type::getVoidTy(*Ctx), TaintTraceCondArgs, false);
+  Type *TaintTraceSwitchArgs[6] = { PrimitiveShadowTy, Int64Ty, Int32Ty,
+      PointerType::getUnqual(Int64Ty), Int32Ty, Int32Ty };
+  TaintTraceSwitchFnTy = FunctionType::get(
+      Type::getVoidTy(*Ctx), TaintTraceSwitchArgs, false);
   TaintTraceIndirectCallFnTy = FunctionType::get(
       Type::getVoidTy(*Ctx), { PrimitiveShadowTy }, false);
   Type *TaintTraceGEPArgs[7] = { PrimitiveShadowTy, Int64Ty, PrimitiveShadowTy,
@@ -908,6 +1251,15 @@ bool Taint::isInstrumented(const GlobalAlias *GA) {
   return !ABIList.isIn(*GA, "uninstrumented");
 }
 
+bool Taint::isExcluded(const Function *F) {
+  StringRef Name = F->getName();
+  // wrappers stay instrumented, they translate between the ABIs
+  if (Name.startswith("dfsw$"))
+    return false;
+  Name.consume_front("dfs$");
+  return FilterList.isExcluded(*F, Name);
+}
+
 Taint::InstrumentedABI Taint::getInstrumentedABI() {
   return ClArgsABI ? IA_Args : IA_TLS;
 }
@@ -930,6 +1282,10 @@ Taint::WrapperKind Taint::getWrapperKind(Function *F) {
   return WK_Warning;
 }
 
+bool Taint::hasFastPath(Function *F) {
+  return ABIList.isIn(*F, "fastpath") && !F->isVarArg();
+}
+
 void Taint::addGlobalNamePrefix(GlobalValue *GV) {
   std::string GVName = std::string(GV->getName()), Prefix = "dfs$";
   GV->setName(Prefix + GVName);
@@ -1017,6 +1373,31 @@ Constant *Taint::getOrBuildTrampolineFunction(FunctionType *FT,
   return cast<Constant>(C.getCallee());
 }
 
+// Returns __taint_union_<opcode>, the runtime union with the op fixed at
+// compile time, or a null callee if the op has no such entry point.
+FunctionCallee Taint::getUnionOpFn(unsigned Op) {
+  const char *Name;
+  switch (Op) {
+#define HANDLE_BINARY_INST(N, OPC, CLASS) case Instruction::OPC: Name = #OPC; break;
+#define HANDLE_CAST_INST(N, OPC, CLASS) case Instruction::OPC: Name = #OPC; break;
+#include "llvm/IR/Instruction.def"
+  default:
+    return FunctionCallee();
+  }
+  FunctionCallee &Fn = UnionOpFns[Op];
+  if (!Fn) {
+    AttributeList AL;
+    AL = AL.addAttribute(*Ctx, AttributeList::FunctionIndex,
+                         Attribute::NoUnwind);
+    AL = AL.addAttribute(*Ctx, AttributeList::ReturnIndex, Attribute::ZExt);
+    AL = AL.addParamAttribute(*Ctx, 0, Attribute::ZExt);
+    AL = AL.addParamAttribute(*Ctx, 1, Attribute::ZExt);
+    Fn = Mod->getOrInsertFunction(std::string("__taint_union_") + Name,
+                                  TaintUnionOpFnTy, AL);
+  }
+  return Fn;
+}
+
 // Initialize DataFlowSanitizer runtime functions and declare them in the module
 void Taint::initializeRuntimeFunctions(Module &M) {
   {
@@ -1050,6 +1431,16 @@ void Taint::initializeRuntimeFunctions(Module &M) {
     TaintUnionLoadFn =
         Mod->getOrInsertFunction("__taint_union_load", TaintUnionLoadFnTy, AL);
   }
+  {
+    AttributeList AL;
+    AL = AL.addAttribute(M.getContext(), AttributeList::FunctionIndex,
+                         Attribute::NoUnwind);
+    AL = AL.addAttribute(M.getContext(), AttributeList::ReturnIndex,
+                         Attribute::ZExt);
+    AL = AL.addParamAttribute(M.getContext(), 0, Attribute::ZExt);
+    TaintUnionLoadShapeFn = Mod->getOrInsertFunction(
+        "__taint_union_load_shape", TaintUnionLoadShapeFnTy, AL);
+  }
   {
     AttributeList AL;
     AL = AL.addAttribute(M.getContext(), AttributeList::FunctionIndex,
@@ -1058,6 +1449,22 @@ void Taint::initializeRuntimeFunctions(Module &M) {
     TaintUnionStoreFn =
         Mod->getOrInsertFunction("__taint_union_store", TaintUnionStoreFnTy, AL);
   }
+  {
+    AttributeList AL;
+    AL = AL.addAttribute(M.getContext(), AttributeList::FunctionIndex,
+                         Attribute::NoUnwind);
+    TaintCopyShadowFn =
+        Mod->getOrInsertFunction("__taint_copy_shadow", TaintCopyShadowFnTy, AL);
+  }
+  {
+    AttributeList AL;
+    AL = AL.addAttribute(M.getContext(), AttributeList::FunctionIndex,
+                         Attribute::NoUnwind);
+    TaintAtomicBeginFn =
+        Mod->getOrInsertFunction("__taint_atomic_begin", TaintAtomicFnTy, AL);
+    TaintAtomicEndFn =
+        Mod->getOrInsertFunction("__taint_atomic_end", TaintAtomicFnTy, AL);
+  }
   {
     TaintUnimplementedFn =
         Mod->getOrInsertFunction("__dfsan_unimplemented", TaintUnimplementedFnTy);
@@ -1098,6 +1505,14 @@ void Taint::initializeCallbackFunctions(Module &M) {
     TaintTraceCondFn =
         Mod->getOrInsertFunction("__taint_trace_cond", TaintTraceCondFnTy, AL);
   }
+  {
+    AttributeList AL;
+    AL = AL.addAttribute(M.getContext(), AttributeList::FunctionIndex,
+                         Attribute::NoUnwind);
+    AL = AL.addParamAttribute(M.getContext(), 0, Attribute::ZExt);
+    TaintTraceSwitchFn =
+        Mod->getOrInsertFunction("__taint_trace_switch", TaintTraceSwitchFnTy, AL);
+  }
   {
     AttributeList AL;
     AL = AL.addAttribute(M.getContext(), AttributeList::FunctionIndex,
@@ -1184,6 +1599,310 @@ void Taint::initializeCallbackFunctions(Module &M) {
 
 }
 
+// Internal functions only called directly get their argument shadows from
+// the call sites we see.
+bool TaintReachability::isInternal(Function &F) {
+  if (F.isDeclaration() || !F.hasLocalLinkage() || F.isVarArg() ||
+      !TT.isInstrumented(&F) || F.getName().startswith("dfsw$"))
+    return false;
+  for (User *U : F.users()) {
+    CallBase *CB = dyn_cast<CallBase>(U);
+    if (!CB || CB->getCalledOperand() != &F ||
+        CB->getFunctionType() != F.getFunctionType())
+      return false;
+  }
+  return true;
+}
+
+// Returns false if the address of Obj escapes, or if it's accessed as anything
+// but scalars (whose labels can't be pointer bounds).
+bool TaintReachability::collectAccesses(
+    Value *Obj, SmallVectorImpl<Instruction *> &Accesses) {
+  SmallVector<Value *, 8> Ptrs{Obj};
+  while (!Ptrs.empty()) {
+    Value *P = Ptrs.pop_back_val();
+    for (User *U : P->users()) {
+      if (LoadInst *LI = dyn_cast<LoadInst>(U)) {
+        if (LI->isVolatile() || !isPrunableType(LI->getType()))
+          return false;
+        Accesses.push_back(LI);
+      } else if (StoreInst *SI = dyn_cast<StoreInst>(U)) {
+        if (SI->getPointerOperand() != P || SI->isVolatile() ||
+            !isPrunableType(SI->getValueOperand()->getType()))
+          return false;
+        Accesses.push_back(SI);
+      } else if (GEPOperator *GEP = dyn_cast<GEPOperator>(U)) {
+        if (!GEP->hasAllConstantIndices())
+          return false;
+        Ptrs.push_back(GEP);
+      } else if (isa<BitCastOperator>(U)) {
+        Ptrs.push_back(U);
+      } else if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(U)) {
+        if (II->getIntrinsicID() != Intrinsic::lifetime_start &&
+            II->getIntrinsicID() != Intrinsic::lifetime_end)
+          return false;
+      } else {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void TaintReachability::trackObject(Value *Obj) {
+  SmallVector<Instruction *, 16> Accesses;
+  if (!collectAccesses(Obj, Accesses))
+    return;
+  auto &Loads = ObjLoads[Obj];
+  for (Instruction *I : Accesses) {
+    AccessObj[I] = Obj;
+    if (LoadInst *LI = dyn_cast<LoadInst>(I))
+      Loads.push_back(LI);
+  }
+}
+
+// Whether the call itself may produce a label, regardless of its arguments.
+bool TaintReachability::isCallResultTainted(CallBase *CB) {
+  if (CB->isInlineAsm())
+    return true;
+  Function *F = dyn_cast<Function>(CB->getCalledOperand());
+  if (F && F->isIntrinsic())
+    return !F->doesNotAccessMemory();
+  if (F && Internal.count(F))
+    return false; // up to its returns
+  auto i = TT.UnwrappedFnMap.find(CB->getCalledOperand());
+  if (i != TT.UnwrappedFnMap.end()) {
+    switch (TT.getWrapperKind(i->second)) {
+    case Taint::WK_Warning:
+    case Taint::WK_Discard:
+      return false;
+    case Taint::WK_Functional:
+      return false; // up to its arguments
+    default:
+      return true;
+    }
+  }
+  return true;
+}
+
+// Whether the result of the call is labelled after its arguments.
+bool TaintReachability::dependsOnArgs(CallBase *CB) {
+  Function *F = dyn_cast<Function>(CB->getCalledOperand());
+  if (F && F->isIntrinsic())
+    return true;
+  auto i = TT.UnwrappedFnMap.find(CB->getCalledOperand());
+  return i != TT.UnwrappedFnMap.end() &&
+         TT.getWrapperKind(i->second) == Taint::WK_Functional;
+}
+
+void TaintReachability::taint(Value *V) {
+  if (Tainted.insert(V).second)
+    Worklist.push_back(V);
+}
+
+void TaintReachability::taintObject(const Value *Obj) {
+  if (!TaintedObjs.insert(Obj).second)
+    return;
+  for (LoadInst *LI : ObjLoads[Obj])
+    taint(LI);
+}
+
+void TaintReachability::taintReturn(Function *F) {
+  if (!TaintedRets.insert(F).second)
+    return;
+  for (User *U : F->users())
+    taint(U);
+}
+
+void TaintReachability::propagate(Value *V) {
+  for (User *U : V->users()) {
+    Instruction *I = dyn_cast<Instruction>(U);
+    if (!I)
+      continue;
+    if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
+      auto i = AccessObj.find(SI);
+      if (SI->getValueOperand() == V && i != AccessObj.end())
+        taintObject(i->second);
+    } else if (isa<LoadInst>(I)) {
+      // the label of the pointer is not combined on loads
+    } else if (isa<ReturnInst>(I)) {
+      if (Internal.count(I->getFunction()))
+        taintReturn(I->getFunction());
+    } else if (CallBase *CB = dyn_cast<CallBase>(I)) {
+      Function *F = dyn_cast<Function>(CB->getCalledOperand());
+      if (F && Internal.count(F)) {
+        for (unsigned n = 0; n < CB->arg_size(); ++n)
+          if (CB->getArgOperand(n) == V)
+            taint(F->getArg(n));
+      } else if (dependsOnArgs(CB)) {
+        taint(CB);
+      }
+    } else if (!I->getType()->isVoidTy()) {
+      taint(I);
+    }
+  }
+}
+
+void TaintReachability::run(Module &M) {
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    // blocks removed later on would leave dangling entries behind
+    removeUnreachableBlocks(F);
+    if (isInternal(F))
+      Internal.insert(&F);
+  }
+  for (GlobalVariable &GV : M.globals()) {
+    if (GV.hasLocalLinkage() && !GV.isExternallyInitialized())
+      trackObject(&GV);
+  }
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    for (Instruction &I : instructions(F))
+      if (AllocaInst *AI = dyn_cast<AllocaInst>(&I))
+        trackObject(AI);
+  }
+
+  // seed the labels entering each function
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    if (!Internal.count(&F)) {
+      for (Argument &A : F.args())
+        taint(&A);
+    }
+    for (Argument &A : F.args()) {
+      if (!isPrunableType(A.getType()))
+        taint(&A);
+    }
+    for (Instruction &I : instructions(F)) {
+      if (I.getType()->isVoidTy())
+        continue;
+      if (!isPrunableType(I.getType()))
+        taint(&I);
+      else if (CallBase *CB = dyn_cast<CallBase>(&I)) {
+        if (isCallResultTainted(CB))
+          taint(CB);
+      } else if (isa<LoadInst>(I)) {
+        if (!AccessObj.count(&I))
+          taint(&I);
+      } else if (I.mayReadFromMemory()) {
+        taint(&I);
+      }
+    }
+  }
+
+  while (!Worklist.empty())
+    propagate(Worklist.pop_back_val());
+
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    for (Argument &A : F.args()) {
+      if (!Tainted.count(&A))
+        Untainted.insert(&A);
+    }
+    for (Instruction &I : instructions(F)) {
+      auto i = AccessObj.find(&I);
+      if (i != AccessObj.end() && !TaintedObjs.count(i->second))
+        Untainted.insert(&I);
+      else if (!I.getType()->isVoidTy() && !Tainted.count(&I))
+        Untainted.insert(&I);
+    }
+  }
+}
+
+// The instructions an excluded function still has to instrument: the shadow
+// passed to its callees and callers, and the labels of the memory it writes,
+// which would otherwise keep stale taint. Everything else has a zero shadow.
+static bool isVisibleToCallers(const Instruction *I) {
+  return isa<StoreInst>(I) || isa<AtomicRMWInst>(I) || isa<ReturnInst>(I) ||
+         isa<CallBase>(I);
+}
+
+namespace {
+// what -taint-report says about a function
+struct InstrumentationCounts {
+  unsigned Insts = 0;
+  unsigned Loads = 0;
+  unsigned Stores = 0;
+  unsigned Unions = 0;
+  unsigned TraceCmps = 0;
+  unsigned TraceConds = 0;
+  unsigned TraceGEPs = 0;
+  unsigned ShadowLoadCalls = 0;
+  unsigned ShadowStoreCalls = 0;
+};
+}
+
+static InstrumentationCounts countInstrumentation(const Function &F) {
+  InstrumentationCounts C;
+  for (const Instruction &I : instructions(F)) {
+    C.Insts++;
+    if (isa<LoadInst>(I)) {
+      C.Loads++;
+    } else if (isa<StoreInst>(I)) {
+      C.Stores++;
+    } else if (const CallBase *CB = dyn_cast<CallBase>(&I)) {
+      const Function *Callee = CB->getCalledFunction();
+      if (!Callee)
+        continue;
+      StringRef Name = Callee->getName();
+      if (Name.startswith("__taint_union_load"))
+        C.ShadowLoadCalls++;
+      else if (Name == "__taint_union_store")
+        C.ShadowStoreCalls++;
+      else if (Name.startswith("__taint_union"))
+        C.Unions++;
+      else if (Name == "__taint_trace_cmp")
+        C.TraceCmps++;
+      else if (Name == "__taint_trace_cond")
+        C.TraceConds++;
+      else if (Name == "__taint_trace_gep")
+        C.TraceGEPs++;
+    }
+  }
+  return C;
+}
+
+// the loads and stores the pass added are those of the shadow, the argument
+// and return value TLS and the shadow mask
+static void writeReport(
+    const Module &M,
+    ArrayRef<std::pair<const Function *, InstrumentationCounts>> Before) {
+  std::error_code EC;
+  raw_fd_ostream OS(ClReport, EC, sys::fs::OF_Append);
+  if (EC) {
+    errs() << "taint: cannot open report " << ClReport << ": " << EC.message()
+           << "\n";
+    return;
+  }
+  std::string Buf;
+  raw_string_ostream Lines(Buf);
+  for (auto const &P : Before) {
+    InstrumentationCounts A = countInstrumentation(*P.first);
+    const InstrumentationCounts &B = P.second;
+    json::Object O{
+        {"module", json::fixUTF8(M.getModuleIdentifier())},
+        {"function", json::fixUTF8(P.first->getName())},
+        {"insts_before", B.Insts},
+        {"insts_after", A.Insts},
+        {"unions", A.Unions - B.Unions},
+        {"trace_cmp", A.TraceCmps - B.TraceCmps},
+        {"trace_cond", A.TraceConds - B.TraceConds},
+        {"trace_gep", A.TraceGEPs - B.TraceGEPs},
+        {"shadow_loads", (A.Loads > B.Loads ? A.Loads - B.Loads : 0) +
+                             A.ShadowLoadCalls - B.ShadowLoadCalls},
+        {"shadow_stores", (A.Stores > B.Stores ? A.Stores - B.Stores : 0) +
+                              A.ShadowStoreCalls - B.ShadowStoreCalls},
+    };
+    Lines << json::Value(std::move(O)) << "\n";
+  }
+  // one write, so the reports of parallel compiles don't interleave
+  OS << Lines.str();
+}
+
 bool Taint::runOnModule(Module &M) {
   if (ABIList.isIn(M, "skip"))
     return false;
@@ -1219,6 +1938,13 @@ bool Taint::runOnModule(Module &M) {
     G->setThreadLocalMode(GlobalVariable::InitialExecTLSModel);
   }
 
+  TraceBudget = Mod->getOrInsertGlobal(
+      "__taint_trace_budget", ArrayType::get(Int8Ty, 1U << kTraceBudgetBits));
+
+  // {lower, upper} of every label, see __taint_check_bounds
+  BoundsTable = Mod->getOrInsertGlobal("__taint_bounds",
+                                       PointerType::getUnqual(Int64Ty));
+
   initializeCallbackFunctions(M);
   initializeRuntimeFunctions(M);
 
@@ -1229,13 +1955,18 @@ bool Taint::runOnModule(Module &M) {
         &i != TaintUnionFn.getCallee()->stripPointerCasts() &&
         &i != TaintCheckedUnionFn.getCallee()->stripPointerCasts() &&
         &i != TaintUnionLoadFn.getCallee()->stripPointerCasts() &&
+        &i != TaintUnionLoadShapeFn.getCallee()->stripPointerCasts() &&
         &i != TaintUnionStoreFn.getCallee()->stripPointerCasts() &&
+        &i != TaintCopyShadowFn.getCallee()->stripPointerCasts() &&
+        &i != TaintAtomicBeginFn.getCallee()->stripPointerCasts() &&
+        &i != TaintAtomicEndFn.getCallee()->stripPointerCasts() &&
         &i != TaintUnimplementedFn.getCallee()->stripPointerCasts() &&
         &i != TaintSetLabelFn.getCallee()->stripPointerCasts() &&
         &i != TaintNonzeroLabelFn.getCallee()->stripPointerCasts() &&
         &i != TaintVarargWrapperFn.getCallee()->stripPointerCasts() &&
         &i != TaintTraceCmpFn.getCallee()->stripPointerCasts() &&
         &i != TaintTraceCondFn.getCallee()->stripPointerCasts() &&
+        &i != TaintTraceSwitchFn.getCallee()->stripPointerCasts() &&
         &i != TaintTraceIndirectCallFn.getCallee()->stripPointerCasts() &&
         &i != TaintTraceGEPFn.getCallee()->stripPointerCasts() &&
         &i != TaintPushStackFrameFn.getCallee()->stripPointerCasts() &&
@@ -1386,16 +2117,36 @@ bool Taint::runOnModule(Module &M) {
     }
   }
 
+  // the analysis sees the calls of the final ABI
+  std::unique_ptr<TaintReachability> R;
+  if ((ClPruneUntainted || ClLTO) && getInstrumentedABI() == IA_TLS) {
+    R.reset(new TaintReachability(*this));
+    R->run(M);
+    Reach = R.get();
+  }
+
+  std::vector<std::pair<const Function *, InstrumentationCounts>> Report;
   for (Function *i : FnsToInstrument) {
     if (!i || i->isDeclaration())
       continue;
-
-    addContextRecording(*i);
-    if (!i->getName().startswith("dfsw$"))
-      addFrameTracing(*i);
+    if (!ClReport.empty())
+      Report.push_back({i, countInstrumentation(*i)});
+
+    bool Excluded = !FnsWithNativeABI.count(i) && isExcluded(i);
+    if (!Excluded) {
+      if (ClContextDepth != 0)
+        addContextRecording(*i);
+      if (!i->getName().startswith("dfsw$"))
+        addFrameTracing(*i);
+    }
     removeUnreachableBlocks(*i);
 
     TaintFunction TF(*this, i, FnsWithNativeABI.count(i));
+    TF.IsExcluded = Excluded;
+    if (!Excluded) {
+      TF.coalesceShadowLoads();
+      TF.forwardShadowLoads();
+    }
 
     // TaintVisitor may create new basic blocks, which confuses df_iterator.
     // Build a copy of the list before iterating over it.
@@ -1411,7 +2162,8 @@ bool Taint::runOnModule(Module &M) {
         // TaintVisitor may delete Inst, so keep track of whether it was a
         // terminator.
         bool IsTerminator = Inst->isTerminator();
-        if (!TF.SkipInsts.count(Inst))
+        if (!TF.SkipInsts.count(Inst) &&
+            (!TF.IsExcluded || isVisibleToCallers(Inst)))
           TaintVisitor(TF).visit(Inst);
         if (IsTerminator)
           break;
@@ -1436,6 +2188,11 @@ bool Taint::runOnModule(Module &M) {
 
   }
 
+  Reach = nullptr;
+
+  if (!ClReport.empty())
+    writeReport(M, Report);
+
   return Changed || !FnsToInstrument.empty() ||
          M.global_size() != InitialGlobalSize || M.size() != InitialModuleSize;
 }
@@ -1500,13 +2257,44 @@ Value *TaintFunction::getShadowForGlobal(GlobalVariable *GV, IRBuilder<> &IRB) {
   return TT.ZeroPrimitiveShadow; // GV is always a ptr
 }
 
+// The FP arithmetic whose labels are built on demand with -taint-trace-fp-lazy.
+static bool isLazyFPOp(const Value *V) {
+  const Instruction *I = dyn_cast<Instruction>(V);
+  if (!I || !I->getType()->isFloatingPointTy() ||
+      I->getType()->getPrimitiveSizeInBits() > 64 ||
+      I->getMetadata("nosanitize"))
+    return false;
+  switch (I->getOpcode()) {
+  case Instruction::FAdd:
+  case Instruction::FSub:
+  case Instruction::FMul:
+  case Instruction::FDiv:
+  case Instruction::FRem:
+  case Instruction::FNeg:
+  case Instruction::FPExt:
+  case Instruction::FPTrunc:
+  case Instruction::SIToFP:
+  case Instruction::UIToFP:
+    return true;
+  default:
+    return false;
+  }
+}
+
 Value *TaintFunction::getShadow(Value *V) {
   if (!isa<Argument>(V) && !isa<Instruction>(V))
     return TT.getZeroShadow(V);
+  if (TT.Reach && TT.Reach->isUntainted(V))
+    return TT.getZeroShadow(V);
+  if (ClTraceFPLazy && isLazyFPOp(V) && !ValShadowMap.count(V)) {
+    Value *Shadow = getLazyFPShadow(cast<Instruction>(V));
+    ValShadowMap[V] = Shadow;
+    return Shadow;
+  }
   Value *&Shadow = ValShadowMap[V];
   if (!Shadow) {
     if (Argument *A = dyn_cast<Argument>(V)) {
-      if (IsNativeABI)
+      if (IsNativeABI || IsExcluded)
         return TT.getZeroShadow(V);
       switch (IA) {
       case Taint::IA_TLS: {
@@ -1582,7 +2370,7 @@ Value *TaintFunction::combineShadows(Value *V1, Value *V2,
   Type *Ty = Pos->getOperand(0)->getType();
   if (Ty->isFloatingPointTy()) {
     // check for FP
-    if (!ClTraceFP)
+    if (!ClTraceFP && !ClTraceFPLazy)
       return TT.getZeroShadow(Pos);
   } else if (Ty->isVectorTy()) {
     // FIXME: vector type
@@ -1599,46 +2387,142 @@ Value *TaintFunction::combineShadows(Value *V1, Value *V2,
   // FIXME: do not handle type larger than 64-bit
   if (size > 64) return TT.getZeroShadow(Pos);
 
-  IRBuilder<> IRB(Pos);
+  // Most operands are concrete at runtime, for which the union is always the
+  // zero label, so test inline and only call the runtime on the cold path.
+  BasicBlock *Head = Pos->getParent();
+  Instruction *CallPos = Pos;
+  if (!AvoidNewBlocks && !isa<PHINode>(Pos) && !Pos->isEHPad()) {
+    IRBuilder<> HeadIRB(Pos);
+    Value *Any = HeadIRB.CreateOr(V1, V2);
+    Value *Ne = HeadIRB.CreateICmpNE(Any, TT.ZeroPrimitiveShadow);
+    CallPos = SplitBlockAndInsertIfThen(Ne, Pos, false, TT.ColdCallWeights, &DT);
+  }
+
+  IRBuilder<> IRB(CallPos);
+  FunctionCallee UnionOpFn;
   if (CmpInst *CI = dyn_cast<CmpInst>(Pos)) { // for both icmp and fcmp
     size = DL.getTypeSizeInBits(CI->getOperand(0)->getType());
     // op should be predicate
     op |= (CI->getPredicate() << 8);
+  } else if (ClSpecializeUnion) {
+    UnionOpFn = TT.getUnionOpFn(op);
   }
   Value *Op = ConstantInt::get(TT.Int16Ty, op);
   Value *Size = ConstantInt::get(TT.Int16Ty, size);
-  Value *Op1 = Pos->getOperand(0);
-  Ty = Op1->getType();
+  Value *Op1 = castToInt64(Pos->getOperand(0), IRB);
+  Value *Op2 = ConstantInt::get(TT.Int64Ty, 0);
+  if (Pos->getNumOperands() > 1)
+    Op2 = castToInt64(Pos->getOperand(1), IRB);
+  CallInst *Call =
+      UnionOpFn ? IRB.CreateCall(UnionOpFn, {V1, V2, Size, Op1, Op2})
+                : IRB.CreateCall(TT.TaintUnionFn, {V1, V2, Op, Size, Op1, Op2});
+  Call->addAttribute(AttributeList::ReturnIndex, Attribute::ZExt);
+  Call->addParamAttr(0, Attribute::ZExt);
+  Call->addParamAttr(1, Attribute::ZExt);
+  if (CallPos == Pos)
+    return Call;
+
+  PHINode *Shadow = PHINode::Create(TT.PrimitiveShadowTy, 2, "", &Pos->getParent()->front());
+  Shadow->addIncoming(TT.ZeroPrimitiveShadow, Head);
+  Shadow->addIncoming(Call, Call->getParent());
+  return Shadow;
+}
+
+Value *TaintFunction::castToInt64(Value *V, IRBuilder<> &IRB) {
+  Type *Ty = V->getType();
   // bitcast to integer before extending
   if (Ty->isHalfTy())
-    Op1 = IRB.CreateBitCast(Op1, TT.Int16Ty);
+    V = IRB.CreateBitCast(V, TT.Int16Ty);
   else if (Ty->isFloatTy())
-    Op1 = IRB.CreateBitCast(Op1, TT.Int32Ty);
+    V = IRB.CreateBitCast(V, TT.Int32Ty);
   else if (Ty->isDoubleTy())
-    Op1 = IRB.CreateBitCast(Op1, TT.Int64Ty);
+    V = IRB.CreateBitCast(V, TT.Int64Ty);
   else if (Ty->isPointerTy())
-    Op1 = IRB.CreatePtrToInt(Op1, TT.Int64Ty);
-  Op1 = IRB.CreateZExtOrTrunc(Op1, TT.Int64Ty);
-  Value *Op2 = ConstantInt::get(TT.Int64Ty, 0);
-  if (Pos->getNumOperands() > 1) {
-    Op2 = Pos->getOperand(1);
-    Ty = Op2->getType();
-    // bitcast to integer before extending
-    if (Ty->isHalfTy())
-      Op2 = IRB.CreateBitCast(Op2, TT.Int16Ty);
-    else if (Ty->isFloatTy())
-      Op2 = IRB.CreateBitCast(Op2, TT.Int32Ty);
-    else if (Ty->isDoubleTy())
-      Op2 = IRB.CreateBitCast(Op2, TT.Int64Ty);
-    else if (Ty->isPointerTy())
-      Op2 = IRB.CreatePtrToInt(Op2, TT.Int64Ty);
-    Op2 = IRB.CreateZExtOrTrunc(Op2, TT.Int64Ty);
-  }
-  CallInst *Call = IRB.CreateCall(TT.TaintUnionFn, {V1, V2, Op, Size, Op1, Op2});
-  Call->addAttribute(AttributeList::ReturnIndex, Attribute::ZExt);
-  Call->addParamAttr(0, Attribute::ZExt);
-  Call->addParamAttr(1, Attribute::ZExt);
-  return Call;
+    V = IRB.CreatePtrToInt(V, TT.Int64Ty);
+  return IRB.CreateZExtOrTrunc(V, TT.Int64Ty);
+}
+
+void TaintFunction::collectLazyFPTree(Instruction *I,
+                                      SmallVectorImpl<Instruction *> &Nodes,
+                                      SmallVectorImpl<Value *> &Leaves,
+                                      SmallPtrSetImpl<Value *> &Seen) {
+  for (Value *Op : I->operands()) {
+    if (!Seen.insert(Op).second)
+      continue;
+    Instruction *OpI = dyn_cast<Instruction>(Op);
+    if (OpI && isLazyFPOp(OpI) && !ValShadowMap.count(OpI) &&
+        Nodes.size() < kMaxLazyFPNodes)
+      collectLazyFPTree(OpI, Nodes, Leaves, Seen);
+    else if (!isa<Constant>(Op))
+      Leaves.push_back(Op);
+  }
+  Nodes.push_back(I);
+}
+
+Value *TaintFunction::getLazyFPShadow(Instruction *Root) {
+  SmallVector<Instruction *, 16> Nodes;
+  SmallVector<Value *, 16> Leaves;
+  SmallPtrSet<Value *, 16> Seen;
+  collectLazyFPTree(Root, Nodes, Leaves, Seen);
+
+  // leaves past the node limit are built (and tested) on their own
+  DenseMap<Value *, Value *> Shadows;
+  Value *Any = nullptr;
+  Instruction *Pos = Root->getNextNode();
+  for (Value *L : Leaves) {
+    Value *S = getShadow(L);
+    Shadows[L] = S;
+    if (TT.isZeroShadow(S))
+      continue;
+    IRBuilder<> IRB(Pos);
+    Any = Any ? IRB.CreateOr(Any, S) : S;
+  }
+  if (!Any)
+    return TT.getZeroShadow(Root);
+
+  BasicBlock *Head = Root->getParent();
+  Instruction *CallPos = Pos;
+  if (!AvoidNewBlocks) {
+    IRBuilder<> HeadIRB(Pos);
+    Value *Ne = HeadIRB.CreateICmpNE(Any, TT.ZeroPrimitiveShadow);
+    CallPos = SplitBlockAndInsertIfThen(Ne, Pos, false, TT.ColdCallWeights, &DT);
+  }
+
+  // the concrete operands stand in for everything that isn't tainted
+  IRBuilder<> IRB(CallPos);
+  auto &DL = F->getParent()->getDataLayout();
+  Value *Shadow = nullptr;
+  for (Instruction *I : Nodes) {
+    uint16_t Op = I->getOpcode();
+    Value *A = I->getOperand(0);
+    Value *B = I->getNumOperands() > 1 ? I->getOperand(1) : nullptr;
+    if (Op == Instruction::FNeg) { // -0.0 - x
+      Op = Instruction::FSub;
+      B = A;
+      A = ConstantFP::getNegativeZero(I->getType());
+    }
+    auto shadowOf = [&](Value *V) -> Value * {
+      auto i = Shadows.find(V);
+      return i != Shadows.end() ? i->second : TT.ZeroPrimitiveShadow;
+    };
+    Value *Size = ConstantInt::get(TT.Int16Ty, DL.getTypeSizeInBits(I->getType()));
+    CallInst *Call = IRB.CreateCall(
+        TT.TaintUnionFn,
+        {shadowOf(A), B ? shadowOf(B) : TT.ZeroPrimitiveShadow,
+         ConstantInt::get(TT.Int16Ty, Op), Size, castToInt64(A, IRB),
+         B ? castToInt64(B, IRB) : ConstantInt::get(TT.Int64Ty, 0)});
+    Call->addAttribute(AttributeList::ReturnIndex, Attribute::ZExt);
+    Call->addParamAttr(0, Attribute::ZExt);
+    Call->addParamAttr(1, Attribute::ZExt);
+    Shadows[I] = Shadow = Call;
+  }
+  if (CallPos == Pos)
+    return Shadow;
+
+  PHINode *Phi = PHINode::Create(TT.PrimitiveShadowTy, 2, "", &Pos->getParent()->front());
+  Phi->addIncoming(TT.ZeroPrimitiveShadow, Head);
+  Phi->addIncoming(Shadow, CallPos->getParent());
+  return Phi;
 }
 
 Value *TaintFunction::combineCastInstShadows(CastInst *CI,
@@ -1657,7 +2541,151 @@ Value *TaintFunction::combineCmpInstShadows(CmpInst *CI,
   return Shadow;
 }
 
+// the runtime's Extract, the fourth op after the last LLVM opcode
+static const uint16_t kExtractOp = Instruction::OtherOpsEnd + 3;
+// vectors up to this size (AVX-512) have their lanes rearranged
+static const uint64_t kMaxVectorShadowBytes = 64;
+
+// the label of a vector covers all its bits, so a lane is an Extract of it,
+// which the runtime folds into the labels of the lane's input bytes
+Value *TaintFunction::extractElementShadow(ExtractElementInst *I) {
+  Value *VecShadow = getShadow(I->getVectorOperand());
+  if (TT.isZeroShadow(VecShadow))
+    return TT.getZeroShadow(I);
+  auto &DL = F->getParent()->getDataLayout();
+  uint64_t Bits = DL.getTypeSizeInBits(I->getType());
+  if (Bits % 8 || Bits > 64)
+    return TT.getZeroShadow(I);
+
+  BasicBlock *Head = I->getParent();
+  Instruction *CallPos = I;
+  if (!AvoidNewBlocks) {
+    IRBuilder<> HeadIRB(I);
+    Value *Ne = HeadIRB.CreateICmpNE(VecShadow, TT.ZeroPrimitiveShadow);
+    CallPos = SplitBlockAndInsertIfThen(Ne, I, false, TT.ColdCallWeights, &DT);
+  }
+  IRBuilder<> IRB(CallPos);
+  Value *Offset = IRB.CreateMul(
+      IRB.CreateZExtOrTrunc(I->getIndexOperand(), TT.Int64Ty),
+      ConstantInt::get(TT.Int64Ty, Bits));
+  CallInst *Call = IRB.CreateCall(
+      TT.TaintUnionFn,
+      {VecShadow, TT.ZeroPrimitiveShadow, ConstantInt::get(TT.Int16Ty, kExtractOp),
+       ConstantInt::get(TT.Int16Ty, Bits), ConstantInt::get(TT.Int64Ty, 0),
+       Offset});
+  Call->addAttribute(AttributeList::ReturnIndex, Attribute::ZExt);
+  Call->addParamAttr(0, Attribute::ZExt);
+  Call->addParamAttr(1, Attribute::ZExt);
+  if (CallPos == I)
+    return Call;
+
+  PHINode *Shadow = PHINode::Create(TT.PrimitiveShadowTy, 2, "", &I->getParent()->front());
+  Shadow->addIncoming(TT.ZeroPrimitiveShadow, Head);
+  Shadow->addIncoming(Call, Call->getParent());
+  return Shadow;
+}
+
+AllocaInst *TaintFunction::getVectorSlot(uint64_t Size) {
+  AllocaInst *&Slot = VectorSlots[Size];
+  if (!Slot) {
+    IRBuilder<> IRB(&*F->getEntryBlock().getFirstInsertionPt());
+    Slot = IRB.CreateAlloca(ArrayType::get(IRB.getInt8Ty(), Size));
+    Slot->setAlignment(Align(kMaxVectorShadowBytes));
+  }
+  return Slot;
+}
+
+// the labels of the bytes of V, by breaking Shadow up on the shadow of a
+// stack slot as a store would, as a vector
+Value *TaintFunction::expandVectorShadow(Value *V, Value *Shadow,
+                                         IRBuilder<> &IRB) {
+  auto &DL = F->getParent()->getDataLayout();
+  uint64_t Size = DL.getTypeStoreSize(V->getType());
+  auto *BytesTy = FixedVectorType::get(TT.PrimitiveShadowTy, Size);
+  if (TT.isZeroShadow(Shadow))
+    return ConstantAggregateZero::get(BytesTy);
+  Value *ShadowAddr = TT.getShadowAddress(getVectorSlot(Size), IRB);
+  IRB.CreateCall(TT.TaintUnionStoreFn,
+                 {Shadow, ShadowAddr, ConstantInt::get(TT.IntptrTy, Size)});
+  Value *Ptr = IRB.CreateBitCast(ShadowAddr, PointerType::getUnqual(BytesTy));
+  Value *Bytes = IRB.CreateAlignedLoad(BytesTy, Ptr, Align(Taint::ShadowWidthBytes));
+  IRB.CreateAlignedStore(ConstantAggregateZero::get(BytesTy), Ptr,
+                         Align(Taint::ShadowWidthBytes));
+  return Bytes;
+}
+
+// the label of V from the labels of its bytes, loaded as the runtime loads
+// any other value, so the untainted bytes are read from a copy of V
+Value *TaintFunction::collapseVectorShadow(Value *V, Value *Bytes,
+                                           IRBuilder<> &IRB) {
+  auto &DL = F->getParent()->getDataLayout();
+  uint64_t Size = DL.getTypeStoreSize(V->getType());
+  AllocaInst *Slot = getVectorSlot(Size);
+  IRB.CreateAlignedStore(
+      V, IRB.CreateBitCast(Slot, PointerType::getUnqual(V->getType())), Align(1));
+  Value *ShadowAddr = TT.getShadowAddress(Slot, IRB);
+  Value *Ptr = IRB.CreateBitCast(ShadowAddr, PointerType::getUnqual(Bytes->getType()));
+  IRB.CreateAlignedStore(Bytes, Ptr, Align(Taint::ShadowWidthBytes));
+  CallInst *Shadow = IRB.CreateCall(
+      TT.TaintUnionLoadFn, {ShadowAddr, ConstantInt::get(TT.IntptrTy, Size)});
+  Shadow->addAttribute(AttributeList::ReturnIndex, Attribute::ZExt);
+  IRB.CreateAlignedStore(Constant::getNullValue(Bytes->getType()), Ptr,
+                         Align(Taint::ShadowWidthBytes));
+  return Shadow;
+}
+
+// the shadow of I, a vector built from the lanes of Ops, by rearranging the
+// labels of their bytes with Rearrange; untainted operands cost an or and a
+// compare, the rest is on a cold path
+Value *TaintFunction::combineVectorShadows(
+    Instruction *I, ArrayRef<Value *> Ops,
+    function_ref<Value *(IRBuilder<> &, ArrayRef<Value *>)> Rearrange) {
+  auto &DL = F->getParent()->getDataLayout();
+  if (!isa<FixedVectorType>(I->getType()) ||
+      DL.getTypeSizeInBits(I->getType()) % 8 ||
+      DL.getTypeStoreSize(I->getType()) > kMaxVectorShadowBytes)
+    return TT.getZeroShadow(I);
+  for (Value *Op : Ops) {
+    if (DL.getTypeSizeInBits(Op->getType()) % 8 ||
+        DL.getTypeStoreSize(Op->getType()) > kMaxVectorShadowBytes)
+      return TT.getZeroShadow(I);
+  }
+
+  // after I, the untainted bytes are read from its result
+  Instruction *Pos = I->getNextNode();
+  IRBuilder<> HeadIRB(Pos);
+  Value *Any = nullptr;
+  for (Value *Op : Ops) {
+    Value *S = getShadow(Op);
+    if (!TT.isZeroShadow(S))
+      Any = Any ? HeadIRB.CreateOr(Any, S) : S;
+  }
+  if (!Any)
+    return TT.getZeroShadow(I);
+
+  BasicBlock *Head = I->getParent();
+  Instruction *CallPos = Pos;
+  if (!AvoidNewBlocks) {
+    Value *Ne = HeadIRB.CreateICmpNE(Any, TT.ZeroPrimitiveShadow);
+    CallPos = SplitBlockAndInsertIfThen(Ne, Pos, false, TT.ColdCallWeights, &DT);
+  }
+  IRBuilder<> IRB(CallPos);
+  SmallVector<Value *, 3> Bytes;
+  for (Value *Op : Ops)
+    Bytes.push_back(expandVectorShadow(Op, getShadow(Op), IRB));
+  Value *Shadow = collapseVectorShadow(I, Rearrange(IRB, Bytes), IRB);
+  if (CallPos == Pos)
+    return Shadow;
+
+  PHINode *Phi = PHINode::Create(TT.PrimitiveShadowTy, 2, "", &Pos->getParent()->front());
+  Phi->addIncoming(TT.ZeroPrimitiveShadow, Head);
+  Phi->addIncoming(Shadow, CallPos->getParent());
+  return Phi;
+}
+
 void TaintFunction::checkBounds(Value *Ptr, Value* Size, Instruction *Pos) {
+  if (IsExcluded)
+    return;
   IRBuilder<> IRB(Pos);
   // another place to check for global variable as the ptr
   Value *PtrShadow = nullptr;
@@ -1668,11 +2696,35 @@ void TaintFunction::checkBounds(Value *Ptr, Value* Size, Instruction *Pos) {
   }
   Value *SizeShadow = getShadow(Size);
   // ptr shadow only exists for array and heap object
-  if (!TT.isZeroShadow(PtrShadow)) {
-    Value *Addr = IRB.CreatePtrToInt(Ptr, TT.Int64Ty);
-    Value *Size64 = IRB.CreateZExtOrTrunc(Size, TT.Int64Ty);
-    IRB.CreateCall(TT.TaintCheckBoundsFn, {PtrShadow, Addr, SizeShadow, Size});
+  if (TT.isZeroShadow(PtrShadow))
+    return;
+  Value *Addr = IRB.CreatePtrToInt(Ptr, TT.Int64Ty);
+  Value *Size64 = IRB.CreateZExtOrTrunc(Size, TT.Int64Ty);
+  if (AvoidNewBlocks) {
+    IRB.CreateCall(TT.TaintCheckBoundsFn, {PtrShadow, Addr, SizeShadow, Size64});
+    return;
   }
+  // the runtime is only called for an access out of the bounds of the label,
+  // which is also where a null, freed or uninitialized pointer ends up; the
+  // table is null when the runtime doesn't trace bounds
+  Value *Table = IRB.CreateLoad(PointerType::getUnqual(TT.Int64Ty),
+                                TT.BoundsTable);
+  Value *HasTable = IRB.CreateICmpNE(
+      Table, ConstantPointerNull::get(PointerType::getUnqual(TT.Int64Ty)));
+  Instruction *Check = SplitBlockAndInsertIfThen(HasTable, Pos, false, nullptr, &DT);
+  IRB.SetInsertPoint(Check);
+  Value *Idx = IRB.CreateShl(IRB.CreateZExt(PtrShadow, TT.Int64Ty), 1);
+  Value *Lower = IRB.CreateLoad(TT.Int64Ty, IRB.CreateGEP(TT.Int64Ty, Table, Idx));
+  Value *Upper = IRB.CreateLoad(
+      TT.Int64Ty, IRB.CreateGEP(TT.Int64Ty, Table,
+                                IRB.CreateOr(Idx, ConstantInt::get(TT.Int64Ty, 1))));
+  Value *End = IRB.CreateAdd(Addr, Size64);
+  Value *Out = IRB.CreateOr(
+      IRB.CreateOr(IRB.CreateICmpULT(Addr, Lower), IRB.CreateICmpUGT(End, Upper)),
+      IRB.CreateICmpULT(End, Addr));
+  IRB.SetInsertPoint(SplitBlockAndInsertIfThen(Out, Check, false,
+                                               TT.ColdCallWeights, &DT));
+  IRB.CreateCall(TT.TaintCheckBoundsFn, {PtrShadow, Addr, SizeShadow, Size64});
 }
 
 // Generates IR to load shadow corresponding to bytes [Addr, Addr+Size), where
@@ -1683,6 +2735,31 @@ Value *TaintFunction::loadPrimitiveShadow(Value *Addr, uint64_t Size, uint64_t A
     return TT.ZeroPrimitiveShadow;
 
   Value *ShadowAddr = TT.getShadowAddress(Addr, IRB);
+  if (ClInlineLoadShape && (Size == 2 || Size == 4 || Size == 8)) {
+    // ints read from the input have the consecutive labels of its bytes,
+    // compare the shadow to first, first + 1, ... with one vector load and
+    // let the runtime check just the operands of the labels; no new blocks,
+    // the runtime falls back to the generic load when first is 0
+    auto *VecTy = FixedVectorType::get(TT.PrimitiveShadowTy, Size);
+    Value *Ptr = IRB.CreateBitCast(ShadowAddr, PointerType::getUnqual(VecTy));
+    Value *Labels = IRB.CreateAlignedLoad(
+        VecTy, Ptr, llvm::Align(Taint::ShadowWidthBytes));
+    Value *First = IRB.CreateExtractElement(Labels, (uint64_t)0);
+    SmallVector<Constant *, 8> Steps;
+    for (uint64_t i = 0; i < Size; i++)
+      Steps.push_back(ConstantInt::get(TT.PrimitiveShadowTy, i));
+    Value *Expected = IRB.CreateAdd(IRB.CreateVectorSplat(Size, First),
+                                    ConstantVector::get(Steps));
+    IntegerType *MaskTy = IntegerType::get(*TT.Ctx, Size);
+    Value *Match = IRB.CreateBitCast(IRB.CreateICmpEQ(Labels, Expected), MaskTy);
+    Value *Shape = IRB.CreateICmpEQ(Match, Constant::getAllOnesValue(MaskTy));
+    CallInst *ShapeCall = IRB.CreateCall(
+        TT.TaintUnionLoadShapeFn,
+        {IRB.CreateSelect(Shape, First, TT.ZeroPrimitiveShadow), ShadowAddr,
+         ConstantInt::get(TT.IntptrTy, Size)});
+    ShapeCall->addAttribute(AttributeList::ReturnIndex, Attribute::ZExt);
+    return ShapeCall;
+  }
   CallInst *FallbackCall = IRB.CreateCall(
       TT.TaintUnionLoadFn, {ShadowAddr, ConstantInt::get(TT.IntptrTy, Size)});
   FallbackCall->addAttribute(AttributeList::ReturnIndex, Attribute::ZExt);
@@ -1690,7 +2767,7 @@ Value *TaintFunction::loadPrimitiveShadow(Value *Addr, uint64_t Size, uint64_t A
 }
 
 void TaintFunction::loadShadowRecursive(
-    Value *Shadow, SmallVector<unsigned, 4> &Indices, Type *SubTy,
+    Value *&Shadow, SmallVector<unsigned, 4> &Indices, Type *SubTy,
     Value *Addr, uint64_t Size, uint64_t Align, IRBuilder<> &IRB) {
   auto &DL = F->getParent()->getDataLayout();
 
@@ -1701,7 +2778,7 @@ void TaintFunction::loadShadowRecursive(
     // load a primitive shadow from address
     Value *PrimitiveShadow = loadPrimitiveShadow(Addr, SubSize, Align, IRB);
     // then insert the primitive shadow into the sub-field
-    IRB.CreateInsertValue(Shadow, PrimitiveShadow, Indices);
+    Shadow = IRB.CreateInsertValue(Shadow, PrimitiveShadow, Indices);
     return;
   }
 
@@ -1741,6 +2818,43 @@ void TaintFunction::loadShadowRecursive(
   llvm_unreachable("Unexpected shadow type");
 }
 
+// labels read from constant memory are always zero
+static bool isConstantMemory(Value *Addr) {
+  SmallVector<const Value *, 2> Objs;
+  getUnderlyingObjects(Addr, Objs);
+  for (const Value *Obj : Objs) {
+    if (isa<Function>(Obj) || isa<BlockAddress>(Obj))
+      continue;
+    if (isa<GlobalVariable>(Obj) && cast<GlobalVariable>(Obj)->isConstant())
+      continue;
+    return false;
+  }
+  return true;
+}
+
+// shadow bytes tested by one wide load
+static const uint64_t kZeroTestChunkBytes = 16;
+// aggregates and load groups up to this size are tested at once
+static const uint64_t kMaxCoalescedBytes = 64;
+
+Value *TaintFunction::isZeroShadowRange(Value *Addr, uint64_t Size,
+                                        IRBuilder<> &IRB) {
+  Value *ShadowAddr = TT.getShadowAddress(Addr, IRB);
+  Value *AllZero = nullptr;
+  for (uint64_t Off = 0; Off < Size; Off += kZeroTestChunkBytes) {
+    uint64_t Bytes = std::min(kZeroTestChunkBytes, Size - Off);
+    IntegerType *ChunkTy =
+        IntegerType::get(*TT.Ctx, Bytes * Taint::ShadowWidthBits);
+    Value *Ptr = IRB.CreateConstGEP1_64(TT.PrimitiveShadowTy, ShadowAddr, Off);
+    Ptr = IRB.CreateBitCast(Ptr, PointerType::getUnqual(ChunkTy));
+    Value *Chunk = IRB.CreateAlignedLoad(ChunkTy, Ptr,
+                                         Align(Taint::ShadowWidthBytes));
+    Value *IsZero = IRB.CreateICmpEQ(Chunk, ConstantInt::get(ChunkTy, 0));
+    AllZero = AllZero ? IRB.CreateAnd(AllZero, IsZero) : IsZero;
+  }
+  return AllZero;
+}
+
 Value *TaintFunction::loadShadow(Type *T, Value *Addr, uint64_t Size, uint64_t Align,
                                  Instruction *Pos) {
   IRBuilder<> IRB(Pos);
@@ -1753,19 +2867,7 @@ Value *TaintFunction::loadShadow(Type *T, Value *Addr, uint64_t Size, uint64_t A
   }
 
   // check if the target object is a constant
-  SmallVector<const Value *, 2> Objs;
-  getUnderlyingObjects(Addr, Objs);
-  bool AllConstants = true;
-  for (const Value *Obj : Objs) {
-    if (isa<Function>(Obj) || isa<BlockAddress>(Obj))
-      continue;
-    if (isa<GlobalVariable>(Obj) && cast<GlobalVariable>(Obj)->isConstant())
-      continue;
-
-    AllConstants = false;
-    break;
-  }
-  if (AllConstants)
+  if (isConstantMemory(Addr))
     return TT.getZeroShadow(T);
 
   // now check if we're loading an aggragate object
@@ -1776,8 +2878,203 @@ Value *TaintFunction::loadShadow(Type *T, Value *Addr, uint64_t Size, uint64_t A
   SmallVector<unsigned, 4> Indices;
   Type *ShadowTy = TT.getShadowTy(T);
   Value *Shadow = UndefValue::get(ShadowTy);
-  loadShadowRecursive(Shadow, Indices, T, Addr, Size, Align, IRB);
-  return Shadow;
+  if (!ClCoalesceShadowLoads || AvoidNewBlocks || Size > kMaxCoalescedBytes ||
+      isa<PHINode>(Pos)) {
+    loadShadowRecursive(Shadow, Indices, T, Addr, Size, Align, IRB);
+    return Shadow;
+  }
+
+  // most aggregates are untainted, test all fields at once first
+  BasicBlock *Head = Pos->getParent();
+  Value *AllZero = isZeroShadowRange(Addr, Size, IRB);
+  Instruction *Then = SplitBlockAndInsertIfThen(IRB.CreateNot(AllZero), Pos,
+                                                false, TT.ColdCallWeights, &DT);
+  IRBuilder<> ThenIRB(Then);
+  loadShadowRecursive(Shadow, Indices, T, Addr, Size, Align, ThenIRB);
+  PHINode *PN = PHINode::Create(ShadowTy, 2, "", &Pos->getParent()->front());
+  PN->addIncoming(TT.getZeroShadow(T), Head);
+  PN->addIncoming(Shadow, Then->getParent());
+  return PN;
+}
+
+bool TaintFunction::isCoalescableLoad(LoadInst *LI) {
+  if (LI->getMetadata("nosanitize") || !LI->isSimple())
+    return false;
+  if (TT.Reach && TT.Reach->isUntainted(LI))
+    return false;
+  Type *T = LI->getType();
+  if (isa<ArrayType>(T) || isa<StructType>(T))
+    return false;
+  uint64_t Size = F->getParent()->getDataLayout().getTypeStoreSize(T);
+  if (Size == 0 || Size > kMaxCoalescedBytes)
+    return false;
+  // locals with a shadow alloca and constants have no shadow to load
+  Value *Addr = LI->getPointerOperand();
+  return !isa<AllocaInst>(Addr) && !isConstantMemory(Addr);
+}
+
+void TaintFunction::coalesceShadowLoads() {
+  if (!ClCoalesceShadowLoads || AvoidNewBlocks)
+    return;
+  const DataLayout &DL = F->getParent()->getDataLayout();
+  for (BasicBlock &BB : *F) {
+    // groups still open for more loads from the same base
+    DenseMap<Value *, unsigned> Open;
+    for (Instruction &I : BB) {
+      if (I.mayWriteToMemory()) {
+        Open.clear();
+        continue;
+      }
+      LoadInst *LI = dyn_cast<LoadInst>(&I);
+      if (!LI || !isCoalescableLoad(LI))
+        continue;
+      int64_t Off = 0;
+      Value *Base =
+          GetPointerBaseWithConstantOffset(LI->getPointerOperand(), Off, DL);
+      int64_t End = Off + (int64_t)DL.getTypeStoreSize(LI->getType());
+      auto i = Open.find(Base);
+      if (i != Open.end()) {
+        LoadGroup &G = LoadGroups[i->second];
+        int64_t NewBegin = std::min(G.Begin, Off);
+        int64_t NewEnd = std::max(G.End, End);
+        if (NewEnd - NewBegin <= (int64_t)kMaxCoalescedBytes) {
+          G.Begin = NewBegin;
+          G.End = NewEnd;
+          G.Loads.push_back({LI, Off});
+          continue;
+        }
+      }
+      Open[Base] = LoadGroups.size();
+      LoadGroups.push_back({Base, Off, End, {{LI, Off}}, false});
+    }
+  }
+  for (unsigned n = 0; n < LoadGroups.size(); ++n) {
+    if (LoadGroups[n].Loads.size() < 2)
+      continue;
+    for (auto &L : LoadGroups[n].Loads)
+      LoadGroupOf[L.first] = n;
+  }
+}
+
+Value *TaintFunction::getCoalescedShadow(LoadInst *LI) {
+  auto i = LoadGroupOf.find(LI);
+  if (i == LoadGroupOf.end())
+    return nullptr;
+  LoadGroup &G = LoadGroups[i->second];
+  if (!G.Emitted) {
+    // LI is the first load of the group, and the base dominates it
+    G.Emitted = true;
+    const DataLayout &DL = F->getParent()->getDataLayout();
+    IRBuilder<> IRB(LI);
+    unsigned AS = G.Base->getType()->getPointerAddressSpace();
+    Value *Base = IRB.CreatePointerCast(G.Base, IRB.getInt8PtrTy(AS));
+    Value *Begin = IRB.CreateConstGEP1_64(IRB.getInt8Ty(), Base, G.Begin);
+    Value *AllZero = isZeroShadowRange(Begin, G.End - G.Begin, IRB);
+    BasicBlock *Head = LI->getParent();
+    Instruction *Then = SplitBlockAndInsertIfThen(IRB.CreateNot(AllZero), LI,
+                                                  false, TT.ColdCallWeights, &DT);
+    IRBuilder<> ThenIRB(Then);
+    for (auto &L : G.Loads) {
+      uint64_t Size = DL.getTypeStoreSize(L.first->getType());
+      Value *Addr = ThenIRB.CreateConstGEP1_64(ThenIRB.getInt8Ty(), Base, L.second);
+      Value *Shadow = loadPrimitiveShadow(Addr, Size, 1, ThenIRB);
+      PHINode *PN = PHINode::Create(TT.PrimitiveShadowTy, 2, "",
+                                    &LI->getParent()->front());
+      PN->addIncoming(TT.ZeroPrimitiveShadow, Head);
+      PN->addIncoming(Shadow, Then->getParent());
+      CoalescedShadows[L.first] = PN;
+    }
+  }
+  return CoalescedShadows.lookup(LI);
+}
+
+// whether the accesses of SizeA bytes at A and of SizeB bytes at B can't
+// overlap: constant offsets from one base, or distinct allocas and globals
+static bool isDisjointAccess(Value *A, uint64_t SizeA, Value *B,
+                             uint64_t SizeB, const DataLayout &DL) {
+  int64_t OffA = 0, OffB = 0;
+  Value *BaseA = GetPointerBaseWithConstantOffset(A, OffA, DL);
+  Value *BaseB = GetPointerBaseWithConstantOffset(B, OffB, DL);
+  if (BaseA == BaseB)
+    return OffA + (int64_t)SizeA <= OffB || OffB + (int64_t)SizeB <= OffA;
+  const Value *ObjA = getUnderlyingObject(BaseA);
+  const Value *ObjB = getUnderlyingObject(BaseB);
+  return ObjA != ObjB &&
+         (isa<AllocaInst>(ObjA) || isa<GlobalVariable>(ObjA)) &&
+         (isa<AllocaInst>(ObjB) || isa<GlobalVariable>(ObjB));
+}
+
+void TaintFunction::forwardShadowLoads() {
+  if (!ClForwardShadowLoads)
+    return;
+  const DataLayout &DL = F->getParent()->getDataLayout();
+  // an access whose shadow is still in memory as it left it
+  struct Access {
+    Value *Ptr;
+    Type *Ty;
+    uint64_t Size;
+    Instruction *I;
+  };
+  for (BasicBlock &BB : *F) {
+    SmallVector<Access, 8> Known;
+    for (Instruction &I : BB) {
+      if (I.getMetadata("nosanitize")) {
+        if (I.mayWriteToMemory())
+          Known.clear();
+        continue;
+      }
+      if (LoadInst *LI = dyn_cast<LoadInst>(&I)) {
+        Value *Ptr = LI->getPointerOperand();
+        Type *Ty = LI->getType();
+        uint64_t Size = DL.getTypeStoreSize(Ty);
+        if (Size == 0 || (TT.Reach && TT.Reach->isUntainted(LI)))
+          continue;
+        auto i = find_if(Known, [&](const Access &A) {
+          return A.Ptr == Ptr && A.Ty == Ty;
+        });
+        if (i != Known.end()) {
+          // a group has its shadow tested at once anyway
+          if (!LoadGroupOf.count(LI))
+            ShadowSources[LI] = i->I;
+          continue;
+        }
+        Known.push_back({Ptr, Ty, Size, LI});
+        continue;
+      }
+      if (StoreInst *SI = dyn_cast<StoreInst>(&I)) {
+        Value *Ptr = SI->getPointerOperand();
+        Type *Ty = SI->getValueOperand()->getType();
+        uint64_t Size = DL.getTypeStoreSize(Ty);
+        erase_if(Known, [&](const Access &A) {
+          return !isDisjointAccess(A.Ptr, A.Size, Ptr, Size, DL);
+        });
+        // the label stored is the one loaded back, unless none is stored
+        if (Size != 0 && !(TT.Reach && TT.Reach->isUntainted(SI)))
+          Known.push_back({Ptr, Ty, Size, SI});
+        continue;
+      }
+      // calls may write any shadow, through the runtime or custom wrappers
+      if (I.mayWriteToMemory())
+        Known.clear();
+    }
+  }
+}
+
+Value *TaintFunction::getForwardedShadow(LoadInst *LI) {
+  auto i = ShadowSources.find(LI);
+  if (i == ShadowSources.end())
+    return nullptr;
+  if (StoreInst *SI = dyn_cast<StoreInst>(i->second))
+    return getShadow(SI->getValueOperand());
+  return getShadow(i->second);
+}
+
+void TaintFunction::lockAtomic(Value *Addr, Instruction *I) {
+  IRBuilder<> IRB(I);
+  Value *Ptr = IRB.CreatePointerCast(Addr, Type::getInt8PtrTy(*TT.Ctx));
+  IRB.CreateCall(TT.TaintAtomicBeginFn, {Ptr});
+  IRB.SetInsertPoint(I->getNextNode());
+  IRB.CreateCall(TT.TaintAtomicEndFn, {Ptr});
 }
 
 void TaintVisitor::visitAtomicRMWInst(AtomicRMWInst &I) {
@@ -1786,6 +3083,9 @@ void TaintVisitor::visitAtomicRMWInst(AtomicRMWInst &I) {
   Value *Val = I.getValOperand();
   Type *Ty = I.getType();
   uint64_t Size = DL.getTypeStoreSize(Ty);
+  // the shadow is read, combined and written back in one go with I
+  if (ClAtomicShadow)
+    TF.lockAtomic(Ptr, &I);
 
   Value *Shadow1 = TF.loadShadow(Ty, Ptr, Size, I.getAlign().value(), &I);
   Value *Shadow2 = TF.getShadow(Val);
@@ -1855,9 +3155,23 @@ void TaintVisitor::visitLoadInst(LoadInst &LI) {
     return;
   }
 
+  if (TF.TT.Reach && TF.TT.Reach->isUntainted(&LI)) {
+    if (ClTraceBound)
+      TF.checkBounds(LI.getPointerOperand(), ConstantInt::get(TF.TT.Int64Ty, Size), &LI);
+    TF.setShadow(&LI, TF.TT.getZeroShadow(&LI));
+    return;
+  }
+
   Align Alignment = ClPreserveAlignment ? LI.getAlign() : Align(1);
-  Value *Shadow =
-      TF.loadShadow(LI.getType(), LI.getPointerOperand(), Size, Alignment.value(), &LI);
+  Value *Shadow = TF.getCoalescedShadow(&LI);
+  // another thread may have stored to it since, read it with the load
+  if (ClAtomicShadow && LI.isAtomic())
+    TF.lockAtomic(LI.getPointerOperand(), &LI);
+  else if (!Shadow)
+    Shadow = TF.getForwardedShadow(&LI);
+  if (!Shadow)
+    Shadow = TF.loadShadow(LI.getType(), LI.getPointerOperand(), Size,
+                           Alignment.value(), &LI);
 #if 0
   //FIXME: tainted pointer
   if (ClCombinePointerLabelsOnLoad) {
@@ -1943,6 +3257,13 @@ void TaintFunction::storeShadow(Value *Addr, uint64_t Size, Align Alignment,
   // check if the shadow is zero, if so, clear the shadow memory regardless
   // of the shadow type
   if (TT.isZeroShadow(Shadow)) {
+    if (ClSparseShadow) {
+      // the runtime skips clean shadow pages instead of mapping them in
+      IRB.CreateCall(TT.TaintUnionStoreFn,
+                     {TT.ZeroPrimitiveShadow, ShadowAddr,
+                      ConstantInt::get(TT.IntptrTy, Size)});
+      return;
+    }
     const Align ShadowAlign(Alignment.value() * TT.ShadowWidthBytes);
     IntegerType *ShadowTy = IntegerType::get(*TT.Ctx, Size * TT.ShadowWidthBits);
     Value *ExtZeroShadow = ConstantInt::get(ShadowTy, 0);
@@ -1977,7 +3298,16 @@ void TaintVisitor::visitStoreInst(StoreInst &SI) {
 
   const Align Alignment = ClPreserveAlignment ? SI.getAlign() : Align(1);;
 
+  // nothing ever reads a label from this memory
+  if (TF.TT.Reach && TF.TT.Reach->isUntainted(&SI)) {
+    if (ClTraceBound)
+      TF.checkBounds(SI.getPointerOperand(), ConstantInt::get(TF.TT.Int64Ty, Size), &SI);
+    return;
+  }
+
   Value* Shadow = TF.getShadow(SI.getValueOperand());
+  if (ClAtomicShadow && SI.isAtomic())
+    TF.lockAtomic(SI.getPointerOperand(), &SI);
 #if 0
   //FIXME: tainted pointer
   if (ClCombinePointerLabelsOnStore) {
@@ -2003,6 +3333,8 @@ void TaintVisitor::visitBinaryOperator(BinaryOperator &BO) {
 
 void TaintVisitor::visitCastInst(CastInst &CI) {
   if (CI.getMetadata("nosanitize")) return;
+  // built on demand
+  if (ClTraceFPLazy && isLazyFPOp(&CI)) return;
   Value *CombinedShadow =
     TF.combineCastInstShadows(&CI, CI.getOpcode());
   TF.setShadow(&CI, CombinedShadow);
@@ -2032,7 +3364,7 @@ void TaintFunction::visitCmpInst(CmpInst *I) {
 void TaintVisitor::visitCmpInst(CmpInst &CI) {
   if (CI.getMetadata("nosanitize")) return;
   // FIXME: integer only now
-  if (!ClTraceFP && !isa<ICmpInst>(CI)) return;
+  if (!ClTraceFP && !ClTraceFPLazy && !isa<ICmpInst>(CI)) return;
 #if 0 //TODO make an option
   TF.visitCmpInst(&CI);
 #endif
@@ -2049,20 +3381,31 @@ void TaintFunction::visitSwitchInst(SwitchInst *I) {
   Value *CondShadow = getShadow(Cond);
   if (TT.isZeroShadow(CondShadow))
     return;
+  if (I->getNumCases() == 0)
+    return;
   unsigned size = DL.getTypeSizeInBits(Cond->getType());
-  ConstantInt *Size = ConstantInt::get(TT.PrimitiveShadowTy, size);
-  ConstantInt *Predicate = ConstantInt::get(TT.PrimitiveShadowTy, 32); // EQ, ==
-  ConstantInt *CID = ConstantInt::get(TT.Int32Ty, TT.getInstructionId(I));
-
-  for (auto C : I->cases()) {
-    Value *CV = C.getCaseValue();
+  ConstantInt *Size = ConstantInt::get(TT.Int32Ty, size);
+  uint32_t Id = TT.getInstructionId(I);
+  ConstantInt *CID = ConstantInt::get(TT.Int32Ty, Id);
+  Instruction *Pos = checkTraceBudget(CondShadow, Id, I);
+
+  // one event with the whole case table, instead of one compare per case
+  SmallVector<Constant *, 16> Cases;
+  for (auto C : I->cases())
+    Cases.push_back(ConstantInt::get(
+        TT.Int64Ty, C.getCaseValue()->getValue().zextOrTrunc(64).getZExtValue()));
+  ArrayType *TableTy = ArrayType::get(TT.Int64Ty, Cases.size());
+  GlobalVariable *Table = new GlobalVariable(
+      *M, TableTy, /*isConstant=*/true, GlobalValue::PrivateLinkage,
+      ConstantArray::get(TableTy, Cases), "__taint_switch_cases");
+  Table->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
 
-    IRBuilder<> IRB(I);
-    Cond = IRB.CreateZExtOrTrunc(Cond, TT.Int64Ty);
-    CV = IRB.CreateZExtOrTrunc(CV, TT.Int64Ty);
-    IRB.CreateCall(TT.TaintTraceCmpFn, {CondShadow, TT.ZeroPrimitiveShadow,
-                    Size, Predicate, Cond, CV, CID});
-  }
+  IRBuilder<> IRB(Pos);
+  Cond = IRB.CreateZExtOrTrunc(Cond, TT.Int64Ty);
+  Value *TablePtr = IRB.CreateConstInBoundsGEP2_32(TableTy, Table, 0, 0);
+  IRB.CreateCall(TT.TaintTraceSwitchFn,
+                 {CondShadow, Cond, Size, TablePtr,
+                  ConstantInt::get(TT.Int32Ty, Cases.size()), CID});
 }
 
 void TaintVisitor::visitSwitchInst(SwitchInst &SWI) {
@@ -2149,15 +3492,68 @@ void TaintVisitor::visitGetElementPtrInst(GetElementPtrInst &GEPI) {
 }
 
 void TaintVisitor::visitExtractElementInst(ExtractElementInst &I) {
-  //FIXME:
+  if (I.getMetadata("nosanitize")) return;
+  TF.setShadow(&I, TF.extractElementShadow(&I));
+}
+
+// the bytes of lane j of a vector of Lanes lanes of LaneBytes bytes
+static SmallVector<int, 64> laneBytes(ArrayRef<int> Lanes, unsigned LaneBytes) {
+  SmallVector<int, 64> Mask;
+  for (int L : Lanes)
+    for (unsigned k = 0; k < LaneBytes; k++)
+      Mask.push_back(L < 0 ? -1 : L * LaneBytes + k);
+  return Mask;
 }
 
 void TaintVisitor::visitInsertElementInst(InsertElementInst &I) {
-  //FIXME:
+  if (I.getMetadata("nosanitize")) return;
+  auto *VT = cast<VectorType>(I.getType());
+  auto &DL = I.getModule()->getDataLayout();
+  unsigned LaneBytes = DL.getTypeStoreSize(VT->getElementType());
+  Value *Index = I.getOperand(2);
+  Value *Shadow = TF.combineVectorShadows(
+      &I, {I.getOperand(0), I.getOperand(1)},
+      [&](IRBuilder<> &IRB, ArrayRef<Value *> Bytes) -> Value * {
+        // the bytes of the element in every lane, taken where the lane is
+        // the index
+        unsigned N = cast<FixedVectorType>(Bytes[0]->getType())->getNumElements();
+        SmallVector<int, 64> Repeat;
+        SmallVector<Constant *, 64> LaneOf;
+        for (unsigned j = 0; j < N; j++) {
+          Repeat.push_back(j % LaneBytes);
+          LaneOf.push_back(ConstantInt::get(TF.TT.Int64Ty, j / LaneBytes));
+        }
+        Value *Elem = IRB.CreateShuffleVector(Bytes[1], Bytes[1], Repeat);
+        Value *Idx = IRB.CreateVectorSplat(
+            N, IRB.CreateZExtOrTrunc(Index, TF.TT.Int64Ty));
+        Value *Here = IRB.CreateICmpEQ(ConstantVector::get(LaneOf), Idx);
+        return IRB.CreateSelect(Here, Elem, Bytes[0]);
+      });
+  TF.setShadow(&I, Shadow);
 }
 
 void TaintVisitor::visitShuffleVectorInst(ShuffleVectorInst &I) {
-  //FIXME:
+  if (I.getMetadata("nosanitize")) return;
+  auto *VT = cast<VectorType>(I.getType());
+  auto &DL = I.getModule()->getDataLayout();
+  unsigned LaneBytes = DL.getTypeStoreSize(VT->getElementType());
+  SmallVector<int, 16> Lanes;
+  I.getShuffleMask(Lanes);
+  Value *Shadow = TF.combineVectorShadows(
+      &I, {I.getOperand(0), I.getOperand(1)},
+      [&](IRBuilder<> &IRB, ArrayRef<Value *> Bytes) -> Value * {
+        SmallVector<int, 64> Mask = laneBytes(Lanes, LaneBytes);
+        Value *Shuffled = IRB.CreateShuffleVector(Bytes[0], Bytes[1], Mask);
+        // undefined lanes are untainted
+        if (!is_contained(Lanes, -1))
+          return Shuffled;
+        SmallVector<Constant *, 64> Keep;
+        for (int M : Mask)
+          Keep.push_back(ConstantInt::getBool(*TF.TT.Ctx, M >= 0));
+        return IRB.CreateSelect(ConstantVector::get(Keep), Shuffled,
+                                Constant::getNullValue(Shuffled->getType()));
+      });
+  TF.setShadow(&I, Shadow);
 }
 
 void TaintVisitor::visitExtractValueInst(ExtractValueInst &I) {
@@ -2227,8 +3623,7 @@ void TaintVisitor::visitAllocaInst(AllocaInst &I) {
   } else {
     Type *T = I.getAllocatedType();
     Value *ArraySize = I.getArraySize();
-    bool TrackBounds = I.isArrayAllocation() | T->isArrayTy() | T->isStructTy();
-    if (TrackBounds) {
+    if (isBoundsTrackedAlloca(I)) {
       // array could be VLA, rely on runtime
       Value *Bounds = TF.visitAllocaInst(&I, ArraySize, T);
       TF.setShadow(&I, Bounds);
@@ -2256,8 +3651,23 @@ void TaintVisitor::visitSelectInst(SelectInst &I) {
   Value *TrueShadow = TF.getShadow(I.getTrueValue());
   Value *FalseShadow = TF.getShadow(I.getFalseValue());
 
-  if (isa<VectorType>(Condition->getType())) {
-    //FIXME:
+  if (auto *CondTy = dyn_cast<FixedVectorType>(Condition->getType())) {
+    // a lane-wise select of the byte labels of the lanes
+    auto &DL = I.getModule()->getDataLayout();
+    unsigned LaneBytes =
+        DL.getTypeStoreSize(cast<VectorType>(I.getType())->getElementType());
+    SmallVector<int, 16> Lanes;
+    for (unsigned j = 0; j < CondTy->getNumElements(); j++)
+      Lanes.push_back(j);
+    Value *Shadow = TF.combineVectorShadows(
+        &I, {I.getTrueValue(), I.getFalseValue()},
+        [&](IRBuilder<> &IRB, ArrayRef<Value *> Bytes) -> Value * {
+          Value *Cond = IRB.CreateShuffleVector(Condition, Condition,
+                                                laneBytes(Lanes, LaneBytes));
+          return IRB.CreateSelect(Cond, Bytes[0], Bytes[1]);
+        });
+    TF.setShadow(&I, Shadow);
+  } else if (isa<VectorType>(Condition->getType())) {
     TF.setShadow(&I, TF.TT.ZeroPrimitiveShadow);
   } else {
     Value *ShadowSel;
@@ -2294,6 +3704,13 @@ void TaintVisitor::visitMemTransferInst(MemTransferInst &I) {
   IRBuilder<> IRB(&I);
   Value *DestShadow = TF.TT.getShadowAddress(I.getDest(), IRB);
   Value *SrcShadow = TF.TT.getShadowAddress(I.getSource(), IRB);
+  if (ClSparseShadow) {
+    // the runtime has to track the shadow pages written by the copy
+    IRB.CreateCall(TF.TT.TaintCopyShadowFn,
+                   {DestShadow, SrcShadow,
+                    IRB.CreateZExtOrTrunc(I.getLength(), TF.TT.IntptrTy)});
+    return;
+  }
   Value *LenShadow = IRB.CreateMul(
       I.getLength(),
       ConstantInt::get(I.getLength()->getType(), TF.TT.ShadowWidthBytes));
@@ -2338,7 +3755,8 @@ void TaintVisitor::visitReturnInst(ReturnInst &RI) {
       Type *RT = TF.F->getFunctionType()->getReturnType();
       unsigned Size =
           getDataLayout().getTypeAllocSize(TF.TT.getShadowTy(RT));
-      if (Size <= kRetvalTLSSize) {
+      if (Size <= kRetvalTLSSize &&
+          !(TF.TT.Reach && TF.TT.Reach->isReturnShadowUnused(TF.F))) {
         // If the size overflows, stores nothing. At callsite, oversized return
         // shadows are set to zero.
         IRB.CreateAlignedStore(S, TF.getRetvalTLS(RT, IRB),
@@ -2457,6 +3875,44 @@ void TaintVisitor::visitCallBase(CallBase &CB) {
       // wrapper.
       if (CallInst *CI = dyn_cast<CallInst>(&CB)) {
         FunctionType *FT = F->getFunctionType();
+
+        // untainted calls of a fastpath function skip the wrapper
+        CallInst *NativeCI = nullptr;
+        if (TF.TT.hasFastPath(F)) {
+          Value *Tainted = nullptr;
+          bool Primitive = true;
+          for (unsigned n = 0; n < FT->getNumParams(); n++) {
+            Value *Arg = CB.getArgOperand(n);
+            auto *GV = dyn_cast<GlobalVariable>(Arg->stripPointerCasts());
+            Value *Shadow = GV ? TF.getShadowForGlobal(GV, IRB)
+                          : TF.getShadow(Arg);
+            if (TF.TT.isZeroShadow(Shadow))
+              continue;
+            if (Shadow->getType() != TF.TT.PrimitiveShadowTy) {
+              Primitive = false;
+              break;
+            }
+            Value *Ne = IRB.CreateICmpNE(Shadow, TF.TT.ZeroPrimitiveShadow);
+            Tainted = Tainted ? IRB.CreateOr(Tainted, Ne) : Ne;
+          }
+          if (Primitive && !Tainted) {
+            CB.setCalledFunction(F);
+            TF.setShadow(&CB, TF.TT.getZeroShadow(&CB));
+            return;
+          }
+          if (Primitive) {
+            Instruction *ThenTerm, *ElseTerm;
+            SplitBlockAndInsertIfThenElse(Tainted, CI, &ThenTerm, &ElseTerm,
+                                          TF.TT.ColdCallWeights);
+            // SplitBlockAndInsertIfThenElse can't update the tree itself
+            TF.DT.recalculate(*TF.F);
+            NativeCI = cast<CallInst>(CI->clone());
+            NativeCI->setCalledFunction(F);
+            NativeCI->insertBefore(ElseTerm);
+            IRB.SetInsertPoint(ThenTerm);
+          }
+        }
+
         TransformedFunction CustomFn = TF.TT.getCustomFunctionType(FT);
         std::string CustomFName = "__dfsw_";
         CustomFName += F->getName();
@@ -2552,13 +4008,34 @@ void TaintVisitor::visitCallBase(CallBase &CB) {
           }
         }
 
+        Instruction *RetVal = CustomCI;
+        Value *RetShadow = nullptr;
         if (!RetTy->isVoidTy()) {
-          LoadInst *LabelLoad =
+          RetShadow =
               IRB.CreateLoad(TF.TT.getShadowTy(RetTy), TF.LabelReturnAlloca);
-          TF.setShadow(CustomCI, LabelLoad);
         }
 
-        CI->replaceAllUsesWith(CustomCI);
+        if (NativeCI) {
+          // merge the wrapper and the native call in the tail block
+          if (!RetTy->isVoidTy()) {
+            Instruction *Pos = &CI->getParent()->front();
+            PHINode *RetPN = PHINode::Create(RetTy, 2, "", Pos);
+            RetPN->addIncoming(CustomCI, CustomCI->getParent());
+            RetPN->addIncoming(NativeCI, NativeCI->getParent());
+            PHINode *ShadowPN =
+                PHINode::Create(RetShadow->getType(), 2, "", Pos);
+            ShadowPN->addIncoming(RetShadow, CustomCI->getParent());
+            ShadowPN->addIncoming(TF.TT.getZeroShadow(RetTy),
+                                  NativeCI->getParent());
+            RetVal = RetPN;
+            RetShadow = ShadowPN;
+          }
+        }
+
+        if (RetShadow)
+          TF.setShadow(RetVal, RetShadow);
+
+        CI->replaceAllUsesWith(RetVal);
         CI->eraseFromParent();
         return;
       }
@@ -2577,6 +4054,10 @@ void TaintVisitor::visitCallBase(CallBase &CB) {
       // after overflow have zero shadow values.
       if (ArgOffset + Size > kArgTLSSize)
         break;
+      if (TF.TT.Reach && TF.TT.Reach->isArgShadowUnused(CB, I)) {
+        ArgOffset += alignTo(Size, kShadowTLSAlignment);
+        continue;
+      }
       Value *Arg = CB.getArgOperand(I);
       auto *GV = dyn_cast<GlobalVariable>(Arg->stripPointerCasts());
       Value *Shadow = GV ? TF.getShadowForGlobal(GV, IRB)
@@ -2608,8 +4089,12 @@ void TaintVisitor::visitCallBase(CallBase &CB) {
       IRBuilder<> NextIRB(Next);
       const DataLayout &DL = getDataLayout();
       unsigned Size = DL.getTypeAllocSize(TF.TT.getShadowTy(&CB));
-      if (Size > kRetvalTLSSize) {
-        // Set overflowed return shadow to be zero.
+      if (Size > kRetvalTLSSize ||
+          (TF.TT.Reach &&
+           (TF.TT.Reach->isUntainted(&CB) ||
+            TF.TT.Reach->isReturnShadowUnused(
+                dyn_cast<Function>(CB.getCalledOperand()))))) {
+        // Set overflowed or never labelled return shadow to be zero.
         TF.setShadow(&CB, TF.TT.getZeroShadow(&CB));
       } else {
         LoadInst *LI = NextIRB.CreateAlignedLoad(
@@ -2688,6 +4173,10 @@ void TaintVisitor::visitCallBase(CallBase &CB) {
 }
 
 void TaintVisitor::visitPHINode(PHINode &PN) {
+  if (TF.TT.Reach && TF.TT.Reach->isUntainted(&PN)) {
+    TF.setShadow(&PN, TF.TT.getZeroShadow(&PN));
+    return;
+  }
   Type *ShadowTy = TF.TT.getShadowTy(&PN);
   PHINode *ShadowPN =
       PHINode::Create(ShadowTy, PN.getNumIncomingValues(), "", &PN);
@@ -2703,13 +4192,36 @@ void TaintVisitor::visitPHINode(PHINode &PN) {
   TF.setShadow(&PN, ShadowPN);
 }
 
+Instruction *TaintFunction::checkTraceBudget(Value *Shadow, uint32_t CID,
+                                             Instruction *Pos) {
+  if (!ClTraceBudget || AvoidNewBlocks)
+    return Pos;
+  IRBuilder<> IRB(Pos);
+  uint64_t Budget = std::min(ClTraceBudget.getValue(), 255U);
+  Value *Counter = IRB.CreateConstInBoundsGEP2_64(
+      ArrayType::get(TT.Int8Ty, 1U << kTraceBudgetBits), TT.TraceBudget, 0,
+      CID & ((1U << kTraceBudgetBits) - 1));
+  Value *Count = IRB.CreateLoad(TT.Int8Ty, Counter);
+  // the counter only advances when the trace is taken
+  Value *Take = IRB.CreateAnd(
+      IRB.CreateICmpNE(Shadow, TT.ZeroPrimitiveShadow),
+      IRB.CreateICmpULT(Count, ConstantInt::get(TT.Int8Ty, Budget)));
+  Instruction *Then = SplitBlockAndInsertIfThen(Take, Pos, false,
+                                                TT.ColdCallWeights, &DT);
+  IRBuilder<> ThenIRB(Then);
+  ThenIRB.CreateStore(ThenIRB.CreateAdd(Count, ConstantInt::get(TT.Int8Ty, 1)),
+                      Counter);
+  return Then;
+}
+
 void TaintFunction::visitCondition(Value *Condition, Instruction *I) {
-  IRBuilder<> IRB(I);
   // get operand
   Value *Shadow = getShadow(Condition);
   if (TT.isZeroShadow(Shadow))
     return;
-  ConstantInt *CID = ConstantInt::get(TT.Int32Ty, TT.getInstructionId(I));
+  uint32_t Id = TT.getInstructionId(I);
+  IRBuilder<> IRB(checkTraceBudget(Shadow, Id, I));
+  ConstantInt *CID = ConstantInt::get(TT.Int32Ty, Id);
   IRB.CreateCall(TT.TaintTraceCondFn, {Shadow, Condition, CID});
 }
 
@@ -2723,10 +4235,18 @@ static RegisterPass<Taint> X("taint_pass", "Taint Pass");
 
 static void registerTaintPass(const PassManagerBuilder &,
                               legacy::PassManagerBase &PM) {
-
+  // instrumented once, after the modules are merged
+  if (ClLTO)
+    return;
   PM.add(new Taint());
 }
 
+static void registerTaintLTOPass(const PassManagerBuilder &,
+                                 legacy::PassManagerBase &PM) {
+  if (ClLTO)
+    PM.add(new Taint());
+}
+
 static RegisterStandardPasses
     RegisterTaintPass(PassManagerBuilder::EP_OptimizerLast,
                       registerTaintPass);
@@ -2734,3 +4254,7 @@ static RegisterStandardPasses
 static RegisterStandardPasses
     RegisterTaintPass0(PassManagerBuilder::EP_EnabledOnOptLevel0,
                        registerTaintPass);
+
+static RegisterStandardPasses
+    RegisterTaintLTOPass(PassManagerBuilder::EP_FullLinkTimeOptimizationLast,
+                         registerTaintLTOPass);
@@ -1,9 +1,20 @@
 #!/usr/bin/env bash
 #
-# usage: rebuild.sh path_to_ko_clang
+# usage: rebuild.sh [--lite] path_to_ko_clang
+#
+# --lite builds the taint-lite variant in build_taint_lite, which only
+# instruments the functions in lite_allowlist.txt
+
+BUILD_DIR=build_taint
+ALLOWLIST=""
+if [[ $# -eq 2 && "$1" == "--lite" ]]; then
+    BUILD_DIR=build_taint_lite
+    ALLOWLIST=$(readlink -f "$(dirname "$0")/lite_allowlist.txt")
+    shift
+fi
 
 if [[ $# -ne 1 ]]; then
-    echo "Usage: ${0} path_to_ko_clang" 1>&2
+    echo "Usage: ${0} [--lite] path_to_ko_clang" 1>&2
     exit 1
 fi
 
@@ -53,8 +64,8 @@ if [ ! -d $LLVM_SRC ]; then
   mv libunwind-${LLVM_VERSION}.src libunwind
 fi
 
-mkdir -p build_taint
-cd build_taint
+mkdir -p $BUILD_DIR
+cd $BUILD_DIR
 rm -rf *
 
 export KO_CONFIG=1
@@ -71,5 +82,8 @@ cmake -G Ninja -DLLVM_TARGETS_TO_BUILD=X86 -DCMAKE_BUILD_TYPE=Release \
     ../$LLVM_SRC
 
 unset KO_CONFIG
+if [ -n "$ALLOWLIST" ]; then
+  export KO_INSTRUMENT_ALLOWLIST=$ALLOWLIST
+fi
 ninja distribution
 
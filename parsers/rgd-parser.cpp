@@ -4,7 +4,12 @@
 #include "task.h"
 #include "union_find.h"
 #include "parse-rgd.h"
+#include "probes.h"
 
+#include "wheels/threadpool/ThreadPool.h"
+
+#include <algorithm>
+#include <future>
 #include <unordered_map>
 
 using namespace rgd;
@@ -108,32 +113,236 @@ static void printAst(FILE* f, const rgd::AstNode *node, int indent) {
   fprintf(f, ")\n");
 }
 
+namespace {
+
+// walks the clauses of the DNF of a formula in NNF one at a time, in the
+// same order as fully expanding it would, without materializing them:
+// LOr yields the clauses of its left child and then of its right one, and
+// LAnd pairs each clause of its left child with each of the right child
+class DnfEnumerator {
+public:
+  explicit DnfEnumerator(const rgd::AstNode *root) { build(root); }
+
+  // replaces clause with the next one, false once all have been visited
+  bool next(std::vector<const rgd::AstNode*> &clause) {
+    if (!advance(0)) {
+      return false;
+    }
+    clause.clear();
+    collect(0, clause);
+    return true;
+  }
+
+private:
+  struct cursor_t {
+    const rgd::AstNode *node;
+    uint32_t left, right;
+    uint8_t state; // leaf: visited; LOr: current child; LAnd: started
+  };
+  std::vector<cursor_t> cursors_;
+
+  uint32_t build(const rgd::AstNode *node) {
+    uint32_t i = cursors_.size();
+    cursors_.push_back({node, 0, 0, 0});
+    if (node->kind() == rgd::LAnd || node->kind() == rgd::LOr) {
+      uint32_t left = build(&node->children(0));
+      uint32_t right = build(&node->children(1));
+      cursors_[i].left = left;
+      cursors_[i].right = right;
+    }
+    return i;
+  }
+
+  void reset(uint32_t i) {
+    cursor_t &c = cursors_[i];
+    c.state = 0;
+    if (c.node->kind() == rgd::LAnd || c.node->kind() == rgd::LOr) {
+      reset(c.left);
+      reset(c.right);
+    }
+  }
+
+  bool advance(uint32_t i) {
+    cursor_t &c = cursors_[i];
+    if (c.node->kind() == rgd::LOr) {
+      if (c.state == 0) {
+        if (advance(c.left)) return true;
+        c.state = 1;
+      }
+      return advance(c.right);
+    } else if (c.node->kind() == rgd::LAnd) {
+      if (c.state == 0) {
+        c.state = 1;
+        return advance(c.left) && advance(c.right);
+      }
+      if (advance(c.right)) return true;
+      if (!advance(c.left)) return false;
+      reset(c.right);
+      return advance(c.right);
+    }
+    // a relational leaf is a clause by itself
+    if (c.state) return false;
+    c.state = 1;
+    return true;
+  }
+
+  void collect(uint32_t i, std::vector<const rgd::AstNode*> &clause) const {
+    const cursor_t &c = cursors_[i];
+    if (c.node->kind() == rgd::LOr) {
+      collect(c.state == 0 ? c.left : c.right, clause);
+    } else if (c.node->kind() == rgd::LAnd) {
+      collect(c.left, clause);
+      collect(c.right, clause);
+    } else {
+      clause.push_back(c.node);
+    }
+  }
+};
+
+}
+
+RGDAstParser::RGDAstParser(void *base, size_t size, bool solve_nested,
+                           size_t max_ast_size, size_t scan_threads)
+  : symsan::ASTParser<SearchTask>(base, size),
+    solve_nested_(solve_nested), max_ast_size_(max_ast_size),
+    scan_threads_(scan_threads),
+    scan_pool_(scan_threads ? std::make_unique<ThreadPool>(scan_threads) : nullptr),
+    arena_(std::make_shared<AstArena>()) {}
+
+RGDAstParser::~RGDAstParser() {}
+
 int RGDAstParser::restart(std::vector<symsan::input_t> &inputs) {
+  // the flattened input dependencies are only valid for the same layout
+  bool same_layout = inputs.size() == inputs_cache.size();
+  for (size_t i = 0; same_layout && i < inputs.size(); i++) {
+    same_layout = inputs[i].second == inputs_cache[i].second;
+  }
   // save a copy of the inputs
   inputs_cache = inputs;
-  // clear caches
+  // clear caches, constraints carry the input and memcmp bytes of the seed
   memcmp_cache_.clear(); // inherited from ASTParser
-  root_expr_cache.clear();
+  memcmp_content_.clear();
   constraint_cache.clear();
-  ast_size_cache.clear();
-  nested_cmp_cache.clear();
-  concretize_node.clear();
-  branch_to_inputs.clear();
+  added_constraints_.clear();
+  // queued tasks keep the old arena alive until they are gone
+  arena_ = std::make_shared<AstArena>();
+  // the structural caches are checked lazily against the new union table,
+  // see validate_labels()
+  verified_labels_ = 0;
+  // a long trace doesn't keep enough of its labels to check them
+  if (drop_caches_) {
+    root_expr_cache.clear();
+    ast_size_cache.release();
+    shape_key_cache.release();
+    nested_cmp_cache.release();
+    label_status_.release();
+    branch_to_inputs.release();
+    label_fp_cache.release();
+    drop_caches_ = false;
+  } else if (!same_layout || window_labels_) {
+    root_expr_cache.clear();
+    ast_size_cache.clear();
+    shape_key_cache.clear();
+    nested_cmp_cache.clear();
+    label_status_.clear();
+    branch_to_inputs.clear();
+    label_fp_cache.clear();
+  }
+  size_t slots = 0;
+  if (window_labels_) {
+    // a quarter of the window, rounded up to a power of two
+    slots = 1024;
+    while (slots < window_labels_ / 4) slots <<= 1;
+  }
+  summaries_.assign(slots, label_summary_t());
+  root_expr_cache.set_capacity(window_labels_ ? max_exprs_ : 0);
+  constraint_cache.set_capacity(window_labels_ ? max_exprs_ : 0);
 
   // reset data-flow dependencies
   input_size_ = 0;
   for (auto &i: inputs) {
     input_size_ += i.second;
   }
+  // only what the last trace touched is cleared, a large seed with a few
+  // symbolic bytes costs as little as a small one
   data_flow_deps.reset(input_size_);
-  for (auto &s: input_to_branches) {
-    s.clear();
+  for (auto i: used_buckets_) {
+    input_to_branches[i].clear();
+  }
+  used_buckets_.clear();
+  if (input_to_branches.size() < input_size_) {
+    input_to_branches.resize(input_size_);
+  }
+  for (auto i: used_byte_buckets_) {
+    byte_to_branches_[i].clear();
+  }
+  used_byte_buckets_.clear();
+  if (nested_slice_ && byte_to_branches_.size() < input_size_) {
+    byte_to_branches_.resize(input_size_);
   }
-  input_to_branches.resize(input_size_);
 
   return 0;
 }
 
+size_t RGDAstParser::cache_bytes() const {
+  // an entry of the lru maps, and of the hash maps, with their nodes
+  const size_t kMapEntry = 64;
+  size_t bytes = (root_expr_cache.size() + constraint_cache.size()) * kMapEntry;
+  bytes += ast_size_cache.capacity() * sizeof(uint32_t);
+  bytes += shape_key_cache.capacity() * sizeof(uint32_t);
+  bytes += nested_cmp_cache.capacity() * sizeof(uint8_t);
+  bytes += label_status_.capacity() * sizeof(uint8_t);
+  bytes += label_fp_cache.capacity() * sizeof(uint64_t);
+  // the dep sets themselves are shared, and not counted
+  bytes += branch_to_inputs.capacity() * sizeof(input_dep_t);
+  bytes += summaries_.capacity() * sizeof(label_summary_t);
+  bytes += input_to_branches.capacity() * sizeof(input_to_branches[0]);
+  if (arena_) bytes += arena_->bytes();
+  return bytes;
+}
+
+static inline bool is_commutative(uint16_t op) {
+  return op == __dfsan::Add || op == __dfsan::Mul || op == __dfsan::And ||
+         op == __dfsan::Or || op == __dfsan::Xor ||
+         is_rel_cmp(op, __dfsan::bveq) || is_rel_cmp(op, __dfsan::bvneq);
+}
+
+// hashes the structure of the AST of label, leaving out which input bytes
+// and constant values it reads (and so the arg indices), to order the
+// operands of commutative ops; size is that of a constant operand
+uint32_t RGDAstParser::shape_key(dfsan_label label, uint32_t size) {
+  if (label < CONST_OFFSET || label == __dfsan::kInitializingLabel) {
+    return rgd::xxhash(size, rgd::Constant, 0);
+  }
+  if (shape_key_cache.has(label) && shape_key_cache[label]) {
+    return shape_key_cache[label];
+  }
+  dfsan_label_info *info = get_label_info(label);
+  uint32_t key;
+  if (info->op == 0) {
+    key = rgd::xxhash(8, rgd::Read, 0);
+  } else if (info->op == __dfsan::Load) {
+    key = rgd::xxhash(info->l2 * 8, rgd::Read, 0);
+  } else if (info->op == __dfsan::fatoi || info->op == __dfsan::fstrlen ||
+             info->op == __dfsan::fsum) {
+    key = rgd::xxhash(info->size, rgd::Read, 1);
+  } else {
+    uint32_t k1 = shape_key(info->l1, info->size);
+    uint32_t k2 = shape_key(info->l2, info->size);
+    if (is_commutative(info->op) && k2 < k1) std::swap(k1, k2);
+    key = rgd::xxhash(k1, ((uint32_t)info->op << 16) | info->size, k2);
+  }
+  key |= (key == 0); // 0 is not computed yet
+  if (label < shape_key_cache.base()) {
+    return key; // gone from the window
+  }
+  if (shape_key_cache.size() <= label) {
+    shape_key_cache.resize(label + 1, 0);
+  }
+  shape_key_cache[label] = key;
+  return key;
+}
+
 uint32_t RGDAstParser::map_arg(uint32_t input_id, uint32_t offset, uint32_t length,
                                constraint_t constraint) {
   uint32_t hash = 0;
@@ -160,11 +369,87 @@ uint32_t RGDAstParser::map_arg(uint32_t input_id, uint32_t offset, uint32_t leng
   return hash;
 }
 
+static inline uint64_t mask_bits(uint64_t v, uint32_t bits) {
+  return bits >= 64 ? v : v & ((1ULL << bits) - 1);
+}
+
+static inline int64_t sext_bits(uint64_t v, uint32_t bits) {
+  if (bits >= 64) return (int64_t)v;
+  uint64_t m = 1ULL << (bits - 1);
+  return (int64_t)((mask_bits(v, bits) ^ m) - m);
+}
+
+// the value of a label that reads no input, from the constants under it;
+// false for what can't be folded, e.g., the bounds of an alloca or values
+// wider than 64 bits
+bool RGDAstParser::eval_input_free(dfsan_label label, uint64_t &val) {
+  dfsan_label_info *info = get_label_info(label);
+  dfsan_label_operands *ops = get_label_operands(label);
+  uint32_t bits = info->size;
+  if (bits == 0 || bits > 64 || OP_MAP.find(info->op) == OP_MAP.end() ||
+      (info->op & 0xff) == __dfsan::ICmp) {
+    return false;
+  }
+  uint64_t a = ops->op1.i, b = ops->op2.i;
+  if (info->l1 >= CONST_OFFSET && !eval_input_free(info->l1, a)) return false;
+  if (info->l2 >= CONST_OFFSET && !eval_input_free(info->l2, b)) return false;
+  // the size of the first operand where it differs from the result's
+  uint32_t bits1 = info->l1 >= CONST_OFFSET ? get_label_info(info->l1)->size :
+      info->l2 >= CONST_OFFSET ? bits - get_label_info(info->l2)->size : bits;
+  switch (info->op) {
+    case __dfsan::Extract: val = a >> b; break;
+    case __dfsan::Trunc: val = a; break;
+    case __dfsan::Concat: val = bits1 >= 64 ? a : (b << bits1) | mask_bits(a, bits1); break;
+    case __dfsan::ZExt: val = mask_bits(a, bits1); break;
+    case __dfsan::SExt: val = (uint64_t)sext_bits(a, bits1); break;
+    case __dfsan::Add: val = a + b; break;
+    case __dfsan::Sub: val = a - b; break;
+    case __dfsan::Mul: val = a * b; break;
+    case __dfsan::And: val = a & b; break;
+    case __dfsan::Or: val = a | b; break;
+    case __dfsan::Xor: val = a ^ b; break;
+    case __dfsan::UDiv:
+    case __dfsan::URem:
+      b = mask_bits(b, bits);
+      if (b == 0) return false;
+      val = info->op == __dfsan::UDiv ? mask_bits(a, bits) / b : mask_bits(a, bits) % b;
+      break;
+    case __dfsan::SDiv:
+    case __dfsan::SRem: {
+      int64_t sa = sext_bits(a, bits), sb = sext_bits(b, bits);
+      if (sb == 0 || (sb == -1 && sa == INT64_MIN)) return false;
+      val = (uint64_t)(info->op == __dfsan::SDiv ? sa / sb : sa % sb);
+      break;
+    }
+    case __dfsan::Shl: b = mask_bits(b, bits); val = b >= bits ? 0 : a << b; break;
+    case __dfsan::LShr: b = mask_bits(b, bits); val = b >= bits ? 0 : mask_bits(a, bits) >> b; break;
+    case __dfsan::AShr:
+      b = mask_bits(b, bits);
+      val = (uint64_t)(sext_bits(a, bits) >> (b >= bits ? bits - 1 : b));
+      break;
+    default:
+      return false;
+  }
+  val = mask_bits(val, bits);
+  return true;
+}
+
+// whether an operand of a kind node can be a constant, as it reads no
+// input, and its value; comparisons record the values of both operands
+bool RGDAstParser::fold_operand(dfsan_label label, uint32_t kind, uint64_t &val) {
+  if (!label_input_free(label)) return false;
+  uint64_t folded;
+  if (eval_input_free(label, folded)) {
+    val = folded;
+    return true;
+  }
+  return rgd::isRelationalKind(kind);
+}
+
 // this combines both AST construction and arg mapping
 [[gnu::hot]]
 bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
-                              constraint_t constraint,
-                              std::unordered_set<dfsan_label> &visited) {
+                              constraint_t constraint, LabelSet &visited) {
 
   // needed for recursion?
   if (unlikely(label < CONST_OFFSET || label == __dfsan::kInitializingLabel)) {
@@ -172,9 +457,17 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
     return false;
   }
 
+  if (unlikely(label_invalid(label))) {
+    return false;
+  }
+
   dfsan_label_info *info = get_label_info(label);
+  dfsan_label_operands *ops = get_label_operands(label);
+  // the children are expanded next
+  prefetch_label(info->l1);
+  prefetch_label(info->l2);
   DEBUGF("do_uta_real: %u = (l1:%u, l2:%u, op:%u, size:%u, op1:%lu, op2:%lu)\n",
-         label, info->l1, info->l2, info->op, info->size, info->op1.i, info->op2.i);
+         label, info->l1, info->l2, info->op, info->size, ops->op1.i, ops->op2.i);
 
   // we can't really reuse AST nodes across constraints,
   // but we still need to avoid duplicate nodes within a constraint
@@ -191,8 +484,8 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
     ret->set_kind(rgd::Read);
     ret->set_bits(8);
     ret->set_label(label);
-    uint32_t input_id = info->op2.i;
-    uint32_t offset = info->op1.i;
+    uint32_t input_id = ops->op2.i;
+    uint32_t offset = ops->op1.i;
     // this check should have been done during label scanning
     // if (unlikely(offset >= buf_size)) {
     //   WARNF("invalid offset: %lu >= %lu\n", offset, buf_size);
@@ -213,8 +506,8 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
     ret->set_kind(rgd::Read);
     ret->set_bits(info->l2 * 8);
     ret->set_label(label);
-    uint32_t input_id = get_label_info(info->l1)->op2.i;
-    uint32_t offset = get_label_info(info->l1)->op1.i;
+    uint32_t input_id = get_label_operands(info->l1)->op2.i;
+    uint32_t offset = get_label_operands(info->l1)->op1.i;
     // this check should have been done during label scanning
     // if (unlikely(offset + info->l2 > buf_size)) {
     //   WARNF("invalid offset: %lu + %u > %lu\n", offset, info->l2, buf_size);
@@ -239,7 +532,7 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
     }
     if (info->l1 >= CONST_OFFSET) {
       if (!do_uta_rel(info->l1, s1, constraint, visited)) {
-        return false;
+        return inherit_invalid(label, info->l1);
       }
       visited.insert(info->l1);
     } else {
@@ -253,13 +546,14 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
         WARNF("memcmp target not found for label %u\n", label);
         return false;
       }
+      if (const_dict_) const_dict_->add(itr->second, info->size);
       uint32_t arg_index = (uint32_t)constraint->input_args.size();
       s1->set_index(arg_index);
       uint16_t chunks = info->size / 8;
       uint16_t remain = info->size % 8;
       uint64_t val = 0;
       for (uint16_t i = 0; i < chunks; i++) {
-        val = *(uint64_t*)&(itr->second.get()[i * 8]);
+        val = *(const uint64_t*)&(itr->second[i * 8]);
         constraint->input_args.push_back(std::make_pair(false, val));
         constraint->const_num += 1;
         DEBUGF("memcmp constant chunk %d = 0x%lx\n", i, val);
@@ -267,7 +561,7 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
       if (remain) {
         val = 0;
         for (uint16_t i = 0; i < remain; i++) {
-          val |= (uint64_t)itr->second.get()[chunks * 8 + i] << (i * 8);
+          val |= (uint64_t)itr->second[chunks * 8 + i] << (i * 8);
         }
         constraint->input_args.push_back(std::make_pair(false, val));
         constraint->const_num += 1;
@@ -288,7 +582,7 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
       return false;
     }
     if (!do_uta_rel(info->l2, s2, constraint, visited)) {
-      return false;
+      return inherit_invalid(label, info->l2);
     }
     visited.insert(info->l2);
     ret->set_kind(rgd::Memcmp);
@@ -300,19 +594,32 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
     ret->set_name("memcmp");
 #endif
     return true;
-  } else if (info->op == __dfsan::fatoi) {
+  } else if (info->op == __dfsan::fatoi || info->op == __dfsan::fstrlen ||
+             info->op == __dfsan::fsum) {
     if (unlikely(info->l1 != 0 || info->l2 < CONST_OFFSET)) {
       WARNF("invalid atoi label %u\n", label);
+      mark_invalid(label);
+      return false;
+    }
+    // strlen maps to a length like atoi to a number, the scans returning
+    // pointers into the string don't
+    bool is_strlen = info->op == __dfsan::fstrlen;
+    bool is_sum = info->op == __dfsan::fsum;
+    if (is_strlen && (ops->op1.i != 0 || ops->op2.i != 0)) {
+      WARNF("unsupported string scan label %u\n", label);
+      mark_invalid(label);
       return false;
     }
     dfsan_label_info *src = get_label_info(info->l2);
-    if (unlikely(src->op != Load)) {
+    if (unlikely(src->op != Load && !((is_strlen || is_sum) && src->op == 0))) {
       WARNF("invalid atoi source label %u, op = %u\n", info->l2, src->op);
+      mark_invalid(label);
       return false;
     }
     visited.insert(info->l2);
-    uint32_t input_id = get_label_info(src->l1)->op2.i;
-    uint32_t offset = get_label_info(src->l1)->op1.i;
+    dfsan_label first = src->op == Load ? src->l1 : info->l2;
+    uint32_t input_id = get_label_operands(first)->op2.i;
+    uint32_t offset = get_label_operands(first)->op1.i;
     // this check should have been done during label scanning
     // if (unlikely(offset >= buf_size)) {
     //   WARNF("invalid offset: %lu >= %lu\n", offset, buf_size);
@@ -333,10 +640,27 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
     }
     uint32_t hash = 0;
     uint32_t length = info->size / 8; // bits to bytes
-    // record the offset, base, and original length
-    constraint->atoi_info[offset] = std::make_tuple(length, (uint32_t)info->op1.i, (uint32_t)info->op2.i);
+    uint32_t n = src->op == Load ? src->l2 : 1;
+    // a sum starts the search from its value on the input
+    uint64_t init = 0;
+    if (is_sum && input_id < inputs_cache.size()) {
+      auto *buf = inputs_cache[input_id].first;
+      size_t buf_size = inputs_cache[input_id].second;
+      for (uint32_t i = 0; i < n && offset + i < buf_size; i++) {
+        init += buf[offset + i];
+      }
+    }
+    // record the offset, base, and original length; base 0 is strlen,
+    // ATOI_SUM_BASE a sum of n bytes
+    if (is_strlen) {
+      constraint->atoi_info[offset] = std::make_tuple(length, 0U, n - 1);
+    } else if (is_sum) {
+      constraint->atoi_info[offset] = std::make_tuple(length, ATOI_SUM_BASE, n);
+    } else {
+      constraint->atoi_info[offset] = std::make_tuple(length, (uint32_t)ops->op1.i, (uint32_t)ops->op2.i);
+    }
     for (uint32_t i = 0; i < length; ++i, ++offset) {
-      uint8_t val = 0; // XXX: use 0 as initial value?
+      uint8_t val = i < 8 ? (uint8_t)(init >> (8 * i)) : 0; // XXX: use 0 as initial value for atoi?
       // because this is fake input, we always map it to a new index
       uint32_t arg_index = (uint32_t)constraint->input_args.size();
       constraint->inputs.insert({offset, val});
@@ -359,6 +683,7 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
   } else if (info->op == __dfsan::fsize) {
     // do nothing now
     WARNF("fsize not supported yet\n");
+    mark_invalid(label);
     return false;
   }
 
@@ -366,6 +691,7 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
   auto op_itr = OP_MAP.find(info->op);
   if (op_itr == OP_MAP.end()) {
     WARNF("invalid op: %u\n", info->op);
+    mark_invalid(label);
     return false;
   }
   ret->set_kind(op_itr->second.first);
@@ -379,10 +705,16 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
   constraint->ops[ret->kind()] = true;
 
   // in case we needs concretization
-  uint8_t needs_concretization = 0;
-  auto node_itr = concretize_node.find(label);
-  if (node_itr != concretize_node.end()) {
-    needs_concretization = node_itr->second;
+  uint8_t needs_concretization = label_concretized(label);
+
+  // put the operands of commutative ops in a canonical order, so ASTs that
+  // only differ in it get the same arg layout and share the JIT'ed function
+  dfsan_label l1 = info->l1, l2 = info->l2;
+  uint64_t op1 = ops->op1.i, op2 = ops->op2.i;
+  if (is_commutative(info->op) && shape_key(l2, info->size) < shape_key(l1, info->size)) {
+    std::swap(l1, l2);
+    std::swap(op1, op2);
+    if (needs_concretization) needs_concretization = 3 - needs_concretization;
   }
 
   // now we visit the children
@@ -391,15 +723,18 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
     WARNF("failed to add children\n");
     return false;
   }
-  if (likely(needs_concretization != 1) && (info->l1 >= CONST_OFFSET)) {
-    if (!do_uta_rel(info->l1, left, constraint, visited)) {
-      return false;
+  // a subtree that reads no input is folded into a constant
+  if (likely(needs_concretization != 1) && (l1 >= CONST_OFFSET) &&
+      !fold_operand(l1, ret->kind(), op1)) {
+    if (!do_uta_rel(l1, left, constraint, visited)) {
+      return inherit_invalid(label, l1);
     }
-    visited.insert(info->l1);
+    visited.insert(l1);
   } else {
     if (unlikely(needs_concretization)) {
       if (unlikely(!rgd::isRelationalKind(ret->kind()))) {
         WARNF("invalid kind for concretization %u\n", ret->kind());
+        mark_invalid(label);
         return false;
       }
     }
@@ -411,22 +746,23 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
     // to get the size of the constant, we need to subtract the size
     // of the other operand
     if (info->op == __dfsan::Concat) {
-      if (unlikely(info->l2 == 0)) {
-        WARNF("invalid concat node %u\n", info->l2);
+      if (unlikely(l2 == 0)) {
+        WARNF("invalid concat node %u\n", l2);
+        mark_invalid(label);
         return false;
       }
-      size -= get_label_info(info->l2)->size;
+      size -= get_label_info(l2)->size;
     }
     left->set_bits(size);
     // map args
     uint32_t arg_index = (uint32_t)constraint->input_args.size();
     left->set_index(arg_index);
-    constraint->input_args.push_back(std::make_pair(false, info->op1.i));
+    constraint->input_args.push_back(std::make_pair(false, op1));
     constraint->const_num += 1;
     uint32_t hash = rgd::xxhash(size, rgd::Constant, arg_index);
     left->set_hash(hash);
 #if NEED_OFFLINE
-    left->set_value(std::to_string(info->op1.i));
+    left->set_value(std::to_string(op1));
     left->set_name("constant");
 #endif
   }
@@ -436,7 +772,7 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
       info->op == __dfsan::Extract || info->op == __dfsan::Trunc) {
     uint32_t hash = rgd::xxhash(info->size, ret->kind(), left->hash());
     ret->set_hash(hash);
-    uint64_t offset = info->op == __dfsan::Extract ? info->op2.i : 0;
+    uint64_t offset = info->op == __dfsan::Extract ? op2 : 0;
     ret->set_index(offset);
     return true;
   }
@@ -446,15 +782,17 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
     WARNF("failed to add children\n");
     return false;
   }
-  if (likely(needs_concretization != 2) && (info->l2 >= CONST_OFFSET)) {
-    if (!do_uta_rel(info->l2, right, constraint, visited)) {
-      return false;
+  if (likely(needs_concretization != 2) && (l2 >= CONST_OFFSET) &&
+      !fold_operand(l2, ret->kind(), op2)) {
+    if (!do_uta_rel(l2, right, constraint, visited)) {
+      return inherit_invalid(label, l2);
     }
-    visited.insert(info->l2);
+    visited.insert(l2);
   } else {
     if (unlikely(needs_concretization)) {
       if (unlikely(!rgd::isRelationalKind(ret->kind()))) {
         WARNF("invalid kind for concretization %u\n", ret->kind());
+        mark_invalid(label);
         return false;
       }
     }
@@ -466,30 +804,36 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
     // to get the size of the constant, we need to subtract the size
     // of the other operand
     if (info->op == __dfsan::Concat) {
-      if (unlikely(info->l1 == 0)) {
-        WARNF("invalid concat node %u\n", info->l1);
+      if (unlikely(l1 == 0)) {
+        WARNF("invalid concat node %u\n", l1);
+        mark_invalid(label);
         return false;
       }
-      size -= get_label_info(info->l1)->size;
+      size -= get_label_info(l1)->size;
     }
     right->set_bits(size);
     // map args
     uint32_t arg_index = (uint32_t)constraint->input_args.size();
     right->set_index(arg_index);
-    constraint->input_args.push_back(std::make_pair(false, info->op2.i));
+    constraint->input_args.push_back(std::make_pair(false, op2));
     constraint->const_num += 1;
     uint32_t hash = rgd::xxhash(size, rgd::Constant, arg_index);
     right->set_hash(hash);
 #if NEED_OFFLINE
-    right->set_value(std::to_string(info->op1.i));
+    right->set_value(std::to_string(op2));
     right->set_name("constant");
 #endif
   }
 
   // record comparison operands
   if (rgd::isRelationalKind(ret->kind())) {
-    constraint->op1 = info->op1.i;
-    constraint->op2 = info->op2.i;
+    constraint->op1 = op1;
+    constraint->op2 = op2;
+    // the constant side of a comparison with input
+    if (const_dict_ && (left->kind() == rgd::Constant) != (right->kind() == rgd::Constant)) {
+      if (left->kind() == rgd::Constant) const_dict_->add_value(op1, left->bits() / 8);
+      else const_dict_->add_value(op2, right->bits() / 8);
+    }
   }
 
   // binary ops, we don't really care about comparison ops in jigsaw,
@@ -504,11 +848,16 @@ bool RGDAstParser::do_uta_rel(dfsan_label label, rgd::AstNode *ret,
 [[gnu::hot]]
 RGDAstParser::constraint_t RGDAstParser::parse_constraint(dfsan_label label) {
   DEBUGF("constructing constraint for label %u\n", label);
+  if (unlikely(label_invalid(label))) {
+    DEBUGF("label %u failed to parse before\n", label);
+    return nullptr;
+  }
   // make sure root is a comparison node
   // XXX: root should never go oob?
   dfsan_label_info *info = get_label_info(label);
   if (unlikely(((info->op & 0xff) != __dfsan::ICmp) && (info->op != __dfsan::fmemcmp))) {
     WARNF("invalid root node %u, non-comparison root op: %u\n", label, info->op);
+    mark_invalid(label);
     return nullptr;
   }
 
@@ -517,35 +866,44 @@ RGDAstParser::constraint_t RGDAstParser::parse_constraint(dfsan_label label) {
     WARNF("invalid label %u, larger than ast_size_cache: %lu\n", label, ast_size_cache.size());
     return nullptr;
   }
-  auto size = ast_size_cache.at(label);
+  auto size = label_size(label);
   if (unlikely(size == 0)) {
     WARNF("invalid label %u, ast_size_cache is 0\n", label);
     return nullptr;
+  } else if (unlikely(size >= kUnknownAstSize)) {
+    DEBUGF("label %u is gone from the window\n", label);
+    return nullptr;
   }
-  std::unordered_set<dfsan_label> visited;
+  auto &visited = uta_visited_;
+  visited.clear();
   try {
-    constraint_t constraint = std::make_shared<rgd::Constraint>(size);
+    constraint_t constraint = std::make_shared<rgd::Constraint>(size, arena_);
     if (!do_uta_rel(label, constraint->ast.get(), constraint, visited)) {
       return nullptr;
     }
+    constraint->shape = AstShapes::global().intern(*constraint->get_root());
+    constraint->digest = label_digest(label, constraint->get_root());
     return constraint;
   } catch (std::bad_alloc &e) {
     WARNF("failed to allocate memory for constraint\n");
     return nullptr;
   } catch (std::out_of_range &e) {
     WARNF("AST %u goes out of range at %s\n", label, e.what());
+    mark_invalid(label);
     return nullptr;
   }
 }
 
 [[gnu::hot]]
-task_t RGDAstParser::construct_task(const clause_t &clause) {
+task_t RGDAstParser::construct_task(const clause_t &clause, size_t query) {
   task_t task = std::make_shared<rgd::SearchTask>();
-  for (auto const& node: clause) {
-    auto itr = constraint_cache.find(node->label());
-    if (itr != constraint_cache.end()) {
-      task->constraints.push_back(itr->second);
+  std::vector<bool> in_query;
+  for (size_t n = 0; n < clause.size(); n++) {
+    auto const& node = clause[n];
+    if (auto *cached = constraint_cache.find(node->label())) {
+      task->constraints.push_back(*cached);
       task->comparisons.push_back(node->kind());
+      if (split_tasks_) in_query.push_back(n < query);
       continue;
     }
     // save the comparison op because we may have negated it
@@ -556,9 +914,13 @@ task_t RGDAstParser::construct_task(const clause_t &clause) {
     if (likely(constraint != nullptr)) {
       task->constraints.push_back(constraint);
       task->comparisons.push_back(node->kind());
-      constraint_cache.insert({node->label(), constraint});
+      constraint_cache.insert(node->label(), constraint);
+      if (split_tasks_) in_query.push_back(n < query);
     }
   }
+  if (split_tasks_ && !task->constraints.empty()) {
+    split_components(*task, in_query);
+  }
   if (!task->constraints.empty()) {
     task->finalize();
     return task;
@@ -566,6 +928,60 @@ task_t RGDAstParser::construct_task(const clause_t &clause) {
   return nullptr;
 }
 
+// groups the constraints of task by the input bytes they share; a group
+// without a query constraint only has branches the current input took, and
+// none of its bytes change with the query's, so it holds and is dropped
+void RGDAstParser::split_components(SearchTask &task,
+                                    std::vector<bool> const& in_query) {
+  size_t n = task.constraints.size();
+  std::vector<uint32_t> parent(n);
+  for (size_t i = 0; i < n; i++) parent[i] = i;
+  auto find = [&](uint32_t i) {
+    while (parent[i] != i) i = parent[i] = parent[parent[i]];
+    return i;
+  };
+  // the first constraint reading each byte
+  std::unordered_map<size_t, uint32_t> owner;
+  for (size_t i = 0; i < n; i++) {
+    for (auto const& [offset, lidx] : task.constraints[i]->local_map) {
+      auto [itr, added] = owner.emplace(offset, i);
+      if (!added) parent[find(i)] = find(itr->second);
+    }
+  }
+
+  std::unordered_map<uint32_t, size_t> index; // of the component of a root
+  std::vector<std::vector<uint32_t>> components;
+  std::vector<bool> keep;
+  for (size_t i = 0; i < n; i++) {
+    auto [itr, added] = index.emplace(find(i), components.size());
+    if (added) {
+      components.emplace_back();
+      keep.push_back(false);
+    }
+    components[itr->second].push_back(i);
+    if (in_query[i]) keep[itr->second] = true;
+  }
+
+  std::vector<std::shared_ptr<const rgd::Constraint>> constraints;
+  std::vector<uint32_t> comparisons;
+  task.components.clear();
+  for (size_t c = 0; c < components.size(); c++) {
+    if (!keep[c]) {
+      split_dropped_ += components[c].size();
+      continue;
+    }
+    task.components.emplace_back();
+    for (uint32_t i : components[c]) {
+      task.components.back().push_back(constraints.size());
+      constraints.push_back(task.constraints[i]);
+      comparisons.push_back(task.comparisons[i]);
+    }
+  }
+  if (task.components.size() == 1) task.components.clear();
+  task.constraints.swap(constraints);
+  task.comparisons.swap(comparisons);
+}
+
 // sometimes llvm will zext bool
 dfsan_label RGDAstParser::strip_zext(dfsan_label label) {
   dfsan_label_info *info = get_label_info(label);
@@ -592,18 +1008,20 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
   //   return INVALID_NODE;
   // }
 
-  std::vector<dfsan_label> stack;
+  auto &stack = roots_stack_;
+  stack.clear();
   dfsan_label root = label;
   dfsan_label prev = 0;
   std::vector<AstNode*> node_stack;
   AstNode *root_node = ret;
-  std::unordered_set<dfsan_label> visited;
+  auto &visited = roots_visited_;
+  visited.clear();
 
   try{
   while (root != 0 || !stack.empty()) {
     if (root != 0) {
       // check if the node has been visited before
-      if (visited.find(root) != visited.end()) {
+      if (visited.count(root)) {
         // already visited, skip the subtree
         prev = root;
         root = 0;
@@ -613,13 +1031,18 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
       stack.push_back(root);
       node_stack.push_back(root_node);
       auto *info = get_label_info(root);
-      if (nested_cmp_cache[info->l1] == 0) {
+      // the right child is looked at on the way up
+      prefetch_label(info->l2);
+      if (label_nested(info->l1) == 0) {
         // no nested comparison in the left child, stop going down
         // again, we only collect a partial AST with comparison nodes as leafs
         // so the traversal should stop before reaching any actual leaf node
         root = 0;
       } else {
         root = strip_zext(info->l1);
+        if (unlikely(label_invalid(root))) {
+          return INVALID_NODE;
+        }
         if (root) {
           // create a child node before going down
           root_node = root_node->add_children();
@@ -633,11 +1056,15 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
       // we have reached some leaf node, going up the tree
       auto curr = stack.back();
       auto info = get_label_info(curr);
+      auto ops = get_label_operands(curr);
       auto zsl2 = strip_zext(info->l2);
-      if (nested_cmp_cache[zsl2] > 0 && prev != zsl2) {
+      if (label_nested(zsl2) > 0 && prev != zsl2) {
         // we have a right child, and we haven't visited it yet,
         // and there is a nested comparison, going down the right tree
         root = zsl2;
+        if (unlikely(label_invalid(root))) {
+          return INVALID_NODE;
+        }
         root_node = node_stack.back()->add_children();
         if (unlikely(root_node == nullptr)) {
           WARNF("failed to add children\n");
@@ -645,7 +1072,7 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
         }
       } else {
         DEBUGF("label %d, l1 %d, l2 %d, op %d, size %d, op1 %ld, op2 %ld\n",
-               curr, info->l1, info->l2, info->op, info->size, info->op1.i, info->op2.i);
+               curr, info->l1, info->l2, info->op, info->size, ops->op1.i, ops->op2.i);
         // both children nodes have been visited, process the node (post-order)
         auto node = node_stack.back();
 
@@ -682,29 +1109,29 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
           uint32_t child = 0;
           rgd::AstNode *left = nullptr;
           rgd::AstNode *right = nullptr;
-          if (nested_cmp_cache[info->l1] > 0) {
+          if (label_nested(info->l1) > 0) {
             left = node->mutable_children(0);
             child = 1; // if left child exists, rhs will be child 1
           }
-          if (nested_cmp_cache[info->l2] > 0) {
+          if (label_nested(info->l2) > 0) {
             right = node->mutable_children(child);
           }
           node->set_bits(1);
 
           if (unlikely(info->l1 == 0)) {
             // lhs is a constant
-            if (info->op1.i == 0) { // 0 LAnd x = 0
+            if (ops->op1.i == 0) { // 0 LAnd x = 0
               node->set_kind(rgd::Bool);
               node->set_boolvalue(0);
               node->clear_children();
-            } else if (info->op1.i == 1) { // 1 LAnd x = x
+            } else if (ops->op1.i == 1) { // 1 LAnd x = x
               if (unlikely(right == nullptr)) {
                 WARNF("right child is null\n");
                 return INVALID_NODE;
               }
               node->CopyFrom(*right);
             } else {
-              WARNF("invalid constant %ld\n", info->op1.i);
+              WARNF("invalid constant %ld\n", ops->op1.i);
               return INVALID_NODE;
             }
           } else {
@@ -759,29 +1186,29 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
           uint32_t child = 0;
           rgd::AstNode *left = nullptr;
           rgd::AstNode *right = nullptr;
-          if (nested_cmp_cache[info->l1] > 0) {
+          if (label_nested(info->l1) > 0) {
             left = node->mutable_children(0);
             child = 1; // if left child exists, rhs will be child 1
           }
-          if (nested_cmp_cache[info->l2] > 0) {
+          if (label_nested(info->l2) > 0) {
             right = node->mutable_children(child);
           }
           node->set_bits(1);
 
           if (unlikely(info->l1 == 0)) {
             // lhs is a constant
-            if (info->op1.i == 1) { // x LOr 1 = 1
+            if (ops->op1.i == 1) { // x LOr 1 = 1
               node->set_kind(rgd::Bool);
               node->set_boolvalue(1);
               node->clear_children();
-            } else if (info->op1.i == 0) { // 0 LOr x = x
+            } else if (ops->op1.i == 0) { // 0 LOr x = x
               if (unlikely(right == nullptr)) {
                 WARNF("right child is null\n");
                 return INVALID_NODE;
               }
               node->CopyFrom(*right);
             } else {
-              WARNF("invalid constant %ld\n", info->op1.i);
+              WARNF("invalid constant %ld\n", ops->op1.i);
               return INVALID_NODE;
             }
           } else {
@@ -835,11 +1262,11 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
           uint32_t child = 0;
           rgd::AstNode *left = nullptr;
           rgd::AstNode *right = nullptr;
-          if (nested_cmp_cache[info->l1] > 0) {
+          if (label_nested(info->l1) > 0) {
             left = node->mutable_children(0);
             child = 1; // if left child exists, rhs will be child 1
           }
-          if (nested_cmp_cache[info->l2] > 0) {
+          if (label_nested(info->l2) > 0) {
             right = node->mutable_children(child);
           }
           node->set_bits(1);
@@ -853,11 +1280,11 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
             if (unlikely(right->kind() == rgd::Bool)) {
               // rhs is a constant
               node->set_kind(rgd::Bool);
-              node->set_boolvalue(right->boolvalue() ^ (uint32_t)info->op1.i);
+              node->set_boolvalue(right->boolvalue() ^ (uint32_t)ops->op1.i);
               node->clear_children();
             } else {
               // rhs is symbolic
-              if (info->op1.i == 1) { // 1 LXor x = LNot x
+              if (ops->op1.i == 1) { // 1 LXor x = LNot x
                 node->set_kind(rgd::LNot);
               } else { // 0 LXor x = x
                 node->CopyFrom(*right);
@@ -902,30 +1329,30 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
           if (likely(node->children_size() == 0)) {
             // if the node has no children, it's a leaf node
             // check size, concretize if too large
-            auto size = ast_size_cache.at(curr);
+            auto size = label_size(curr);
             // load previous value as previous concretization could have
             // changed the ast size used for allocation
-            auto itr = concretize_node.find(curr);
-            uint8_t concretize = (itr != concretize_node.end() ? itr->second : 0);
+            uint8_t concretize = label_concretized(curr);
             if (size > max_ast_size_) {
               DEBUGF("AST size too large: %d = %u\n", curr, size);
-              auto left_size = ast_size_cache.at(info->l1);
-              auto right_size = ast_size_cache.at(info->l2);
+              auto left_size = label_size(info->l1);
+              auto right_size = label_size(info->l2);
               if (left_size > max_ast_size_) {
                 // concretize left
-                concretize |= 1;
-                // update new size
-                size -= (left_size - 1);
+                concretize |= kConcretizeLeft;
+                left_size = 1;
               }
               if (right_size > max_ast_size_) {
                 // concretize right
-                concretize |= 2;
-                // update new size
-                size -= (right_size - 1);
+                concretize |= kConcretizeRight;
+                right_size = 1;
               }
+              // update new size, summed up again as the old one is capped
+              // once a label is gone
+              size = left_size + right_size + 1;
               DEBUGF("new size: %d = %u\n", curr, size);
-              ast_size_cache[curr] = size;
-              concretize_node[curr] = concretize;
+              set_label_size(curr, size);
+              if (label_status_.has(curr)) label_status_[curr] |= concretize;
             }
 
             // check for concrete ops
@@ -935,7 +1362,7 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
             if (concrete_ops == 3) {
               // well, both sides have been concretized, simplify the node
               node->set_kind(rgd::Bool);
-              node->set_boolvalue(eval_icmp(info->op, info->op1.i, info->op2.i));
+              node->set_boolvalue(eval_icmp(info->op, ops->op1.i, ops->op2.i));
             } else {
               auto itr = OP_MAP.find(info->op);
               if (unlikely(itr == OP_MAP.end())) {
@@ -954,9 +1381,9 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
               WARNF("unexpected icmp: %d\n", info->op);
               // unexpected icmp, set as a constant boolean
               node->set_kind(rgd::Bool);
-              node->set_boolvalue(eval_icmp(info->op, info->op1.i, info->op2.i));
+              node->set_boolvalue(eval_icmp(info->op, ops->op1.i, ops->op2.i));
             } else {
-              if (nested_cmp_cache[info->l1]) {
+              if (label_nested(info->l1)) {
                 // nested icmp in the lhs
                 rgd::AstNode *left = node->mutable_children(0);
                 if (unlikely(left->bits() != 1)) {
@@ -965,13 +1392,13 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
                 }
                 if (likely(info->l2 == 0)) {
                   if (is_rel_cmp(info->op, __dfsan::bveq)) {
-                    if (info->op2.i == 1) { // checking bool == true
+                    if (ops->op2.i == 1) { // checking bool == true
                       node->CopyFrom(*left);
                     } else { // checking bool == false
                       node->set_kind(rgd::LNot);
                     }
                   } else { // bvneq
-                    if (info->op2.i == 0) { // checking bool != false
+                    if (ops->op2.i == 0) { // checking bool != false
                       node->CopyFrom(*left);
                     } else { // checking bool != true
                       node->set_kind(rgd::LNot);
@@ -984,7 +1411,7 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
                   node->set_boolvalue(0);
                   node->clear_children();
                 }
-              } else if (nested_cmp_cache[info->l2] > 0) {
+              } else if (label_nested(info->l2) > 0) {
                 // nested icmp in the rhs
                 rgd::AstNode *right = node->mutable_children(0);
                 if (unlikely(right->bits() != 1)) {
@@ -993,13 +1420,13 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
                 }
                 if (likely(info->l1 == 0)) {
                   if (is_rel_cmp(info->op, __dfsan::bveq)) {
-                    if (info->op1.i == 1) { // checking true == bool
+                    if (ops->op1.i == 1) { // checking true == bool
                       node->CopyFrom(*right);
                     } else { // checking false == bool
                       node->set_kind(rgd::LNot);
                     }
                   } else { // bvneq
-                    if (info->op1.i == 0) { // checking false != bool
+                    if (ops->op1.i == 0) { // checking false != bool
                       node->CopyFrom(*right);
                     } else { // checking true != bool
                       node->set_kind(rgd::LNot);
@@ -1020,7 +1447,7 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
           } else {
             // both sides have another icmp, set as a constant boolean
             node->set_kind(rgd::Bool);
-            node->set_boolvalue(eval_icmp(info->op, info->op1.i, info->op2.i));
+            node->set_boolvalue(eval_icmp(info->op, ops->op1.i, ops->op2.i));
             node->clear_children();
           }
         } else if (info->op == __dfsan::fmemcmp) {
@@ -1056,106 +1483,199 @@ int RGDAstParser::find_roots(dfsan_label label, AstNode *ret,
   return 0;
 }
 
-[[gnu::hot]]
-bool RGDAstParser::scan_labels(dfsan_label label) {
-  // assuming label has been checked by caller
-  // assuming the last label scanned is the size of the cache
-  // turns out linear scan is way faster than tree traversal
-  for (size_t i = ast_size_cache.size(); i <= label; i++) {
-    if (i == 0) { // the constant label
-      ast_size_cache.push_back(1); // constant takes one node too
-      branch_to_inputs.emplace_back(input_dep_t(input_size_));
-      nested_cmp_cache.push_back(0);
+inline uint64_t RGDAstParser::label_fingerprint(dfsan_label label) {
+  dfsan_label_info *info = get_label_info(label);
+  dfsan_label_operands *ops = get_label_operands(label);
+  // the label hash doesn't cover the concrete operands
+  uint32_t h = rgd::xxhash(info->l1, info->l2, ((uint32_t)info->op << 16) | info->size);
+  uint32_t h1 = rgd::xxhash((uint32_t)ops->op1.i, (uint32_t)(ops->op1.i >> 32), h);
+  uint32_t h2 = rgd::xxhash((uint32_t)ops->op2.i, (uint32_t)(ops->op2.i >> 32), h1);
+  return ((uint64_t)h1 << 32) | h2;
+}
+
+void RGDAstParser::validate_labels(dfsan_label label) {
+  // labels only refer to earlier ones, so everything cached before the
+  // first changed label is still valid, and everything after it is not
+  size_t end = std::min<size_t>((size_t)label + 1, label_fp_cache.size());
+  for (size_t i = std::max(verified_labels_, label_fp_cache.base()); i < end; i++) {
+    if (likely(label_fp_cache[i] == label_fingerprint(i))) {
       continue;
     }
-    dfsan_label_info *info = get_label_info(i);
-    // conservatively check validity of labels
-    // so following parsing will not throw exceptions
-    if (unlikely(info->l1 >= size_ || info->l2 >= size_)) {
-      WARNF("invalid label: %lu, l1=%u, l2=%u\n", i, info->l1, info->l2);
+    DEBUGF("label %lu changed since the last run\n", i);
+    ast_size_cache.resize(i);
+    shape_key_cache.resize(std::min(i, shape_key_cache.size()));
+    nested_cmp_cache.resize(i);
+    label_status_.resize(i);
+    branch_to_inputs.resize(i);
+    label_fp_cache.resize(i);
+    root_expr_cache.erase_if([i](dfsan_label l, expr_t const&) { return l >= i; });
+    // labels at or after i haven't been parsed in this run yet, so the
+    // per-run caches hold nothing to drop
+    verified_labels_ = i;
+    return;
+  }
+  if (end > verified_labels_) {
+    verified_labels_ = end;
+  }
+}
+
+// the part of scanning a label that doesn't look at other labels' caches,
+// so it can run on any thread: sanity checks, the fingerprint, and the
+// input dependencies of a leaf (the constant, an input byte or a load)
+bool RGDAstParser::prescan_label(size_t i, uint64_t &fp, input_dep_t &deps) {
+  fp = label_fingerprint(i);
+  if (i == 0) { // the constant label
+    return true;
+  }
+  dfsan_label_info *info = get_label_info(i);
+  dfsan_label_operands *ops = get_label_operands(i);
+  // conservatively check validity of labels
+  // so following parsing will not throw exceptions
+  if (unlikely(info->l1 >= size_ || info->l2 >= size_)) {
+    WARNF("invalid label: %lu, l1=%u, l2=%u\n", i, info->l1, info->l2);
+    return false;
+  }
+  if (info->op == 0) {
+    uint32_t input_id = ops->op2.i;
+    uint32_t offset = ops->op1.i;
+    // skip if invalid
+    if (unlikely(input_id >= inputs_cache.size())) {
+      WARNF("invalid input id: %u\n", input_id);
       return false;
     }
-    if (info->op == 0) {
-      // AST nodes
-      ast_size_cache.push_back(1); // one Read node
-      // input deps
-      uint32_t input_id = info->op2.i;
-      uint32_t offset = info->op1.i;
-      // skip if invalid
-      if (unlikely(input_id >= inputs_cache.size())) {
-        WARNF("invalid input id: %u\n", input_id);
-        return false;
-      }
-      size_t buf_size = inputs_cache[input_id].second;
-      if (unlikely(offset >= buf_size)) {
-        WARNF("invalid input offset: %u >= %lu\n", offset, buf_size);
-        return false;
-      }
-      branch_to_inputs.emplace_back(input_dep_t(input_size_));
-      // get flattened index
-      size_t idx = input_to_dep_idx(input_id, offset);
-      auto &itr = branch_to_inputs[i];
-      itr.set(idx); // flattened location
-#if DEBUG
-      assert(branch_to_inputs[i].find_first() == idx);
-#endif
-      // nested cmp?
-      nested_cmp_cache.push_back(0);
-    } else if (info->op == __dfsan::Load) {
-      // AST nodes
-      ast_size_cache.push_back(1); // one Read node
-      // input deps
-      uint32_t input_id = get_label_info(info->l1)->op2.i;
-      uint32_t offset = get_label_info(info->l1)->op1.i;
-      // skip if invalid
-      if (unlikely(input_id >= inputs_cache.size())) {
-        WARNF("invalid input id: %u\n", input_id);
-        return false;
+    size_t buf_size = inputs_cache[input_id].second;
+    if (unlikely(offset >= buf_size)) {
+      WARNF("invalid input offset: %u >= %lu\n", offset, buf_size);
+      return false;
+    }
+    // get flattened index
+    size_t idx = input_to_dep_idx(input_id, offset);
+    deps = DepSet::make_range(idx, idx + 1); // flattened location
+  } else if (info->op == __dfsan::Load) {
+    uint32_t input_id = get_label_operands(info->l1)->op2.i;
+    uint32_t offset = get_label_operands(info->l1)->op1.i;
+    // skip if invalid
+    if (unlikely(input_id >= inputs_cache.size())) {
+      WARNF("invalid input id: %u\n", input_id);
+      return false;
+    }
+    size_t buf_size = inputs_cache[input_id].second;
+    if (unlikely(offset + info->l2 > buf_size)) {
+      WARNF("invalid input offset: %u + %u > %lu\n", offset, info->l2, buf_size);
+      return false;
+    }
+    // get flattened index
+    size_t idx = input_to_dep_idx(input_id, offset);
+    deps = DepSet::make_range(idx, idx + info->l2); // input offsets
+  }
+  return true;
+}
+
+// labels always point backwards, so the independent part of the scan is
+// done over blocks of the union table in parallel, and what's left is a
+// cheap sweep combining the children's results in order; returns the
+// first label that failed the checks, or end
+size_t RGDAstParser::prescan_parallel(size_t start, size_t end,
+                                      std::vector<uint64_t> &fps,
+                                      std::vector<input_dep_t> &leaves) {
+  size_t n = end - start;
+  fps.resize(n);
+  leaves.resize(n);
+  size_t block = std::max(kScanBlockLabels, n / (scan_threads_ * 4) + 1);
+  // block end -> the first label failing the checks, or the block end
+  std::vector<std::pair<size_t, std::future<size_t>>> blocks;
+  for (size_t b = start; b < end; b += block) {
+    size_t e = std::min(b + block, end);
+    blocks.emplace_back(e, scan_pool_->enqueue([this, b, e, start, &fps, &leaves] {
+      for (size_t i = b; i < e; i++) {
+        if (!prescan_label(i, fps[i - start], leaves[i - start])) {
+          return i;
+        }
       }
-      size_t buf_size = inputs_cache[input_id].second;
-      if (unlikely(offset + info->l2 > buf_size)) {
-        WARNF("invalid input offset: %u + %u > %lu\n", offset, info->l2, buf_size);
+      return e;
+    }));
+  }
+  // wait for all blocks, they write into the caller's buffers
+  size_t valid_end = end;
+  for (auto &b : blocks) {
+    size_t r = b.second.get();
+    if (r < b.first && valid_end == end) {
+      valid_end = r;
+    }
+  }
+  return valid_end;
+}
+
+[[gnu::hot]]
+bool RGDAstParser::do_scan_labels(dfsan_label label) {
+  // assuming label has been checked by caller
+  // drop what a previous run left behind if the labels differ
+  validate_labels(label);
+  // assuming the last label scanned is the size of the cache
+  // turns out linear scan is way faster than tree traversal
+  size_t start = ast_size_cache.size();
+  size_t end = (size_t)label + 1;
+  std::vector<uint64_t> fps;
+  std::vector<input_dep_t> leaves;
+  size_t valid_end = end;
+  bool parallel = scan_pool_ && start < end && end - start >= kParallelScanLabels;
+  if (parallel) {
+    valid_end = prescan_parallel(start, end, fps, leaves);
+    ast_size_cache.reserve(end);
+    nested_cmp_cache.reserve(end);
+    label_status_.reserve(end);
+    branch_to_inputs.reserve(end);
+    label_fp_cache.reserve(end);
+  }
+  for (size_t i = start; i < end; i++) {
+    uint64_t fp;
+    input_dep_t deps;
+    if (parallel) {
+      if (unlikely(i >= valid_end)) {
         return false;
       }
-      branch_to_inputs.emplace_back(input_dep_t(input_size_));
-      // get flattened index
-      size_t idx = input_to_dep_idx(input_id, offset);
-      auto &itr = branch_to_inputs[i];
-      for (size_t n = 0; n < info->l2; ++n) {
-        // DEBUGF("adding input: %lu <- %lu\n", i, offset + n);
-        itr.set(idx + n); // input offsets
-      }
-#if DEBUG
-      if (likely(info->l2 > 0))
-        assert(branch_to_inputs[i].find_first() == idx);
-#endif
-      // nested cmp?
+      fp = fps[i - start];
+      deps = std::move(leaves[i - start]);
+    } else if (!prescan_label(i, fp, deps)) {
+      return false;
+    }
+    dfsan_label_info *info = get_label_info(i);
+    if (i == 0 || info->op == 0 || info->op == __dfsan::Load) {
+      // the constant takes one node too, inputs are one Read node
+      ast_size_cache.push_back(1);
+      branch_to_inputs.emplace_back(std::move(deps));
       nested_cmp_cache.push_back(0);
     } else {
-      // AST nodes
-      uint32_t left  = info->l1 == 0 ? 1 : ast_size_cache[info->l1];
-      uint32_t right = info->l2 == 0 ? 1 : ast_size_cache[info->l2];
-      ast_size_cache.push_back(left + right + 1);
-      // input deps
-      branch_to_inputs.emplace_back(input_dep_t(input_size_));
-      auto &itr = branch_to_inputs[i];
-      if (info->l1 != 0) itr |= branch_to_inputs[info->l1];
-      if (info->l2 != 0) itr |= branch_to_inputs[info->l2];
+      // AST nodes, a label that's gone counts as too large to parse
+      // a child that reads no input is folded into a constant
+      uint32_t left  = label_input_free(info->l1) ? 1 : label_size(info->l1);
+      uint32_t right = label_input_free(info->l2) ? 1 : label_size(info->l2);
+      ast_size_cache.push_back(std::min(left + right + 1, kUnknownAstSize));
+      // input deps, shared with the children unless both add some
+      deps = DepSet::merge(label_deps(info->l1), label_deps(info->l2));
+      branch_to_inputs.emplace_back(std::move(deps));
       // nested cmp?
       uint8_t nested = 0;
-      nested += info->l1 == 0 ? 0 : nested_cmp_cache[info->l1];
-      nested += info->l2 == 0 ? 0 : nested_cmp_cache[info->l2];
+      nested += info->l1 == 0 ? 0 : label_nested(info->l1);
+      nested += info->l2 == 0 ? 0 : label_nested(info->l2);
       if (info->op == __dfsan::fmemcmp || (info->op & 0xff) == __dfsan::ICmp)
         nested += 1;
       nested_cmp_cache.push_back(nested);
     }
+    label_status_.push_back(0);
+    label_fp_cache.push_back(fp);
+  }
+  if (verified_labels_ <= label) {
+    verified_labels_ = label + 1;
+  }
+  if (window_labels_) {
+    slide_window();
   }
 #if DEBUG
   DEBUGF("ast_size: %d = %u\n", label, ast_size_cache[label]);
   DEBUGF("input deps %d:", label);
-  auto &itr = branch_to_inputs[label];
-  for (auto i = itr.find_first(); i != input_dep_t::npos; i = itr.find_next(i)) {
-    DEBUGF("%lu ", i);
+  if (branch_to_inputs[label]) {
+    branch_to_inputs[label]->for_each([](size_t i) { DEBUGF("%lu ", i); });
   }
   DEBUGF("\n");
   DEBUGF("nested cmp: %d = %d\n", label, nested_cmp_cache[label]);
@@ -1163,28 +1683,61 @@ bool RGDAstParser::scan_labels(dfsan_label label) {
   return true;
 }
 
-RGDAstParser::expr_t RGDAstParser::get_root_expr(dfsan_label label) {
+// once the labels scanned are twice the window, drops the caches of those
+// below it, keeping the size and deps of the ones that can still be parsed
+// as they are, i.e., not too large and without nested comparisons
+void RGDAstParser::slide_window() {
+  size_t end = ast_size_cache.size();
+  if (end - ast_size_cache.base() < 2 * window_labels_) {
+    return;
+  }
+  size_t base = end - window_labels_;
+  ast_size_cache.drop_below(base, [this](size_t l, uint32_t size) {
+    if (size > max_ast_size_ || nested_cmp_cache[l] > 0) return;
+    auto &s = summaries_[l & (summaries_.size() - 1)];
+    s.label = l;
+    s.size = size;
+    s.deps = branch_to_inputs[l];
+  });
+  branch_to_inputs.drop_below(base);
+  nested_cmp_cache.drop_below(base);
+  label_status_.drop_below(base);
+  shape_key_cache.drop_below(base);
+  label_fp_cache.drop_below(base);
+}
+
+RGDAstParser::expr_t RGDAstParser::get_root_expr(dfsan_label label,
+                                                 bool &rejected) {
+  rejected = false;
   if (label < CONST_OFFSET || label == __dfsan::kInitializingLabel || label >= size_) {
     return nullptr;
   }
 
+  // update ast_size and branch_to_inputs caches, this also drops the
+  // exprs that no longer match the union table
+  if (!scan_labels(label)) {
+    return nullptr;
+  }
+  if (label_invalid(label)) {
+    rejected = true;
+    return nullptr;
+  }
+
   expr_t root = nullptr;
-  auto itr = root_expr_cache.find(label);
-  if (itr != root_expr_cache.end()) {
-    root = itr->second;
+  if (auto *cached = root_expr_cache.find(label)) {
+    root = *cached;
   } else {
-    // update ast_size and branch_to_inputs caches
-    if (!scan_labels(label)) {
-      return nullptr;
-    }
     root = std::make_shared<rgd::AstNode>();
     std::unordered_set<dfsan_label> subroots;
     // we start by constructing a boolean formula with relational expressions
     // as leaf nodes
     if (find_roots(label, root.get(), subroots) != 0) {
+      // the labels it was under hold the one that failed
+      for (auto l : roots_stack_) mark_invalid(l);
+      mark_invalid(label);
       return nullptr;
     }
-    root_expr_cache.insert({label, root});
+    root_expr_cache.insert(label, root);
 #if DEBUG
     for (auto const& subroot : subroots) {
       DEBUGF("subroot: %d\n", subroot);
@@ -1277,42 +1830,32 @@ int RGDAstParser::to_nnf(bool expected_r, rgd::AstNode *node) {
   return 0;
 }
 
-[[gnu::hot]]
-void RGDAstParser::to_dnf(const rgd::AstNode *node, formula_t &formula) {
-  if (node->kind() == rgd::LAnd) {
-    formula_t left, right;
-    to_dnf(&node->children(0), left);
-    to_dnf(&node->children(1), right);
-    for (auto const& sub1: left) {
-      for (auto const& sub2: right) {
-        clause_t clause;
-        clause.insert(clause.end(), sub1.begin(), sub1.end());
-        clause.insert(clause.end(), sub2.begin(), sub2.end());
-        formula.push_back(clause);
-      }
-    }
-    if (left.size() == 0) {
-      formula = right;
-    }
-  } else if (node->kind() == rgd::LOr) {
-    // copy the clauses from the children
-    to_dnf(&node->children(0), formula);
-    to_dnf(&node->children(1), formula);
-  } else {
-    clause_t clause;
-    clause.push_back(node);
-    formula.push_back(clause);
+bool RGDAstParser::within_dnf_budget(size_t clauses, size_t literals) const {
+  if (max_dnf_clauses_ && clauses > max_dnf_clauses_) {
+    return false;
   }
+  if (max_dnf_literals_ && literals > max_dnf_literals_) {
+    return false;
+  }
+  return true;
 }
 
 int RGDAstParser::parse_cond(dfsan_label label, bool result, bool add_nested,
                              std::vector<uint64_t> &tasks) {
 
+  SYMSAN_PROBE3(parse_cond_begin, label, result, tasks.size());
+  SYMSAN_PROBE_ON_EXIT(SYMSAN_PROBE2(parse_cond_end, label, tasks.size()));
+
   // given a condition, we want to parse them into a DNF form of
   // relational sub-expressions, where each sub-expression only contains
   // one relational operator at the root
-  expr_t orig_root = get_root_expr(label);
-  if (orig_root == nullptr) {
+  bool rejected;
+  expr_t orig_root = get_root_expr(label, rejected);
+  if (rejected) {
+    // warned about the first time, nothing to do
+    DEBUGF("label %u failed to parse before\n", label);
+    return 0;
+  } else if (orig_root == nullptr) {
     WARNF("failed to get root expr for label %u\n", label);
     return -1;
   } else if (orig_root->kind() == rgd::Bool) {
@@ -1335,12 +1878,21 @@ int RGDAstParser::parse_cond(dfsan_label label, bool result, bool add_nested,
 #if DEBUG
   printAst(stderr, root.get(), 0);
 #endif
-  // then we need to convert the boolean formula into a DNF form
-  formula_t dnf;
-  to_dnf(root.get(), dnf);
+  // then we go through the clauses of its DNF form, one at a time, as
+  // nested LOr/LAnd can make the whole formula exponentially large
+  DnfEnumerator dnf(root.get());
+  clause_t clause;
+  size_t num_clauses = 0;
+  size_t num_literals = 0;
 
   // finally, we construct a search task for each clause in the DNF
-  for (auto const& clause : dnf) {
+  while (dnf.next(clause)) {
+    num_literals += clause.size();
+    if (!within_dnf_budget(++num_clauses, num_literals)) {
+      WARNF("DNF of label %u over budget after %lu clauses, skip the rest\n",
+            label, num_clauses - 1);
+      break;
+    }
     task_t task = construct_task(clause);
     if (task != nullptr) {
       tasks.push_back(save_task(task));
@@ -1361,45 +1913,29 @@ int RGDAstParser::parse_cond(dfsan_label label, bool result, bool add_nested,
       for (auto const& var: clause) {
         const dfsan_label l = var->label();
         // assert(branch_to_inputs.size() > l);
-        auto &itr = branch_to_inputs[l];
-        auto citr = concretize_node.find(l);
-        if (unlikely(citr != concretize_node.end())) {
+        const input_dep_t *itr = &label_deps(l);
+        auto concretized = label_concretized(l);
+        if (unlikely(concretized)) {
           // skip dependencies if the operand is concretized
-          if (citr->second == 1) {
+          if (concretized == kConcretizeLeft) {
             // if the lhs is concretized, use the rhs deps only
-            itr = branch_to_inputs[get_label_info(l)->l2];
-          } else if (citr->second == 2) {
+            itr = &label_deps(get_label_info(l)->l2);
+          } else if (concretized == kConcretizeRight) {
             // if the rhs is concretized, use the lhs deps only
-            itr = branch_to_inputs[get_label_info(l)->l1];
+            itr = &label_deps(get_label_info(l)->l1);
           }
         }
-        if (unlikely(itr.find_first() == input_dep_t::npos)) {
+        if (unlikely(!*itr)) {
           // not actual input dependency, skip
           continue;
         }
         // for each input byte used in the var, we collect additional constraints
-        // first, we use union find to add additional related input bytes
-        std::unordered_set<size_t> related_inputs;
-        for (auto input = itr.find_first(); input != input_dep_t::npos;
-             input = itr.find_next(input)) {
-          data_flow_deps.get_set(input, related_inputs); // FIXME: should be fine?
-        }
-        // then, we collect the branch constraints for each related input byte
-        for (auto input: related_inputs) {
-          auto const& bucket = input_to_branches[input];
-          for (auto const& nc : bucket) {
-            if (inserted.count(nc->label())) continue;
-            inserted.insert(nc->label());
-            has_nested = true;
-#if DEBUG
-            fprintf(stderr, "add nested constraint: (%d, %d)\n", nc->label(), nc->kind());
-#endif
-            nested_caluse.push_back(nc.get()); // XXX: borrow the raw ptr, should be fine?
-          }
+        if (collect_related_branches(**itr, inserted, nested_caluse)) {
+          has_nested = true;
         }
       }
       if (has_nested) { // only add nested task if there are additional constraints
-        task_t nested_task = construct_task(nested_caluse);
+        task_t nested_task = construct_task(nested_caluse, clause.size());
         if (nested_task != nullptr) {
           nested_task->base_task = task;
           tasks.push_back(save_task(nested_task));
@@ -1430,58 +1966,76 @@ bool RGDAstParser::save_constraint(expr_t expr, bool result) {
 #if DEBUG
   printAst(stderr, root.get(), 0);
 #endif
-  // then we need to convert the boolean formula into a DNF form
-  // NOTE: all ptrs in the formula are raw ptrs *temporarily*
+  // then we go through the clauses of its DNF form
+  // NOTE: all ptrs in the clauses are raw ptrs *temporarily*
   // burrowed from the root expr, they will be gone after return
-  formula_t dnf;
-  to_dnf(root.get(), dnf);
+  DnfEnumerator dnf(root.get());
+  clause_t clause;
+  size_t num_clauses = 0;
+  size_t num_literals = 0;
 
   // now we associate the constraints with input bytes
-  for (auto const& clause : dnf) {
+  while (dnf.next(clause)) {
+    num_literals += clause.size();
+    if (!within_dnf_budget(++num_clauses, num_literals)) {
+      break;
+    }
     // each clause is a conjunction of relational expressions
     // that need to be evaluated to true (satisfied)
     // we associate that with the corresponding input bytes
     for (auto const& var : clause) {
       // copy the node, as the original node will be gone after return
-      expr_t node = std::make_shared<rgd::AstNode>();
+      expr_t node = rgd::make_ast(arena_);
       node->CopyFrom(*var);
       // get the input bytes
       const dfsan_label l = node->label();
 #if DEBUG
       assert(branch_to_inputs.size() > l);
 #endif
-      auto &itr = branch_to_inputs[l];
-      auto citr = concretize_node.find(l);
-      if (unlikely(citr != concretize_node.end())) {
-        if (citr->second == 1) {
+      const input_dep_t *itr = &label_deps(l);
+      auto concretized = label_concretized(l);
+      if (unlikely(concretized)) {
+        if (concretized == kConcretizeLeft) {
           // if the lhs is concretized, use the rhs deps only
-          itr = branch_to_inputs[get_label_info(l)->l2];
-        } else if (citr->second == 2) {
+          itr = &label_deps(get_label_info(l)->l2);
+        } else if (concretized == kConcretizeRight) {
           // if the rhs is concretized, use the lhs deps only
-          itr = branch_to_inputs[get_label_info(l)->l1];
+          itr = &label_deps(get_label_info(l)->l1);
         }
       }
-      auto root = itr.find_first();
-      if (root == input_dep_t::npos) {
+      if (!*itr) {
         // not actual input dependency, skip
         // this can happen for atoi
         continue;
       }
       // update uion find
-      for (auto input = itr.find_next(root); input != input_dep_t::npos;
-           input = itr.find_next(input)) {
+      size_t root = (*itr)->first();
+      for (auto const& r : (*itr)->intervals()) {
+        for (size_t input = r.first; input < r.second; ++input) {
+          if (input == root) continue;
 #if DEBUG
-        DEBUGF("union input bytes: (%zu, %zu)\n", root, input);
+          DEBUGF("union input bytes: (%zu, %zu)\n", root, input);
 #endif
-        root = data_flow_deps.merge(root, input);
-        if (unlikely(root == rgd::UnionFind::INVALID)) {
-          WARNF("invalid input to union find\n");
-          return false;
+          root = data_flow_deps.merge(root, input);
+          if (unlikely(root == rgd::UnionFind::INVALID)) {
+            WARNF("invalid input to union find\n");
+            return false;
+          }
         }
       }
       // add the constraint
       auto &bucket = input_to_branches[root];
+      if (bucket.empty()) used_buckets_.push_back(root);
       bucket.push_back(node);
+      trim_bucket(bucket);
+      if (nested_slice_) {
+        (*itr)->for_each([&](size_t input) {
+          auto &byte_bucket = byte_to_branches_[input];
+          if (byte_bucket.empty()) used_byte_buckets_.push_back(input);
+          byte_bucket.push_back(node);
+          trim_bucket(byte_bucket);
+        });
+      }
       // we need to record the kind as it may be negated during transformation
 #if DEBUG
       DEBUGF("add df constraint: %zu <- (%d, %d)\n", root, l, node->kind());
@@ -1495,9 +2049,8 @@ bool RGDAstParser::save_constraint(expr_t expr, bool result) {
 void RGDAstParser::add_nested_constraint(task_t task, const clause_t &nested_caluse) {
   for (auto const& node: nested_caluse) {
     // check cache, should happen most of the time
-    auto itr = constraint_cache.find(node->label());
-    if (likely(itr != constraint_cache.end())) {
-      task->constraints.push_back(itr->second);
+    if (auto *cached = constraint_cache.find(node->label())) {
+      task->constraints.push_back(*cached);
       task->comparisons.push_back(node->kind());
       continue;
     }
@@ -1506,9 +2059,212 @@ void RGDAstParser::add_nested_constraint(task_t task, const clause_t &nested_cal
     if (likely(constraint != nullptr)) {
       task->constraints.push_back(constraint);
       task->comparisons.push_back(node->kind());
-      constraint_cache.insert({node->label(), constraint});
+      constraint_cache.insert(node->label(), constraint);
+    }
+  }
+}
+
+// parse a non-cmp label into a (const == label) constraint, the constant is
+// the first input arg and must be fixed up by the user of each copy
+RGDAstParser::constraint_t
+RGDAstParser::parse_partial_constraint(dfsan_label label, uint32_t ast_size) {
+  constraint_t partial_constraint = nullptr;
+  // check cache first
+  if (auto *cached = constraint_cache.find(label)) {
+    return *cached;
+  }
+
+  // otherwise, parse the AST into a constraint
+  auto &visited = uta_visited_;
+  visited.clear();
+  partial_constraint = std::make_shared<rgd::Constraint>(ast_size + 3, arena_); // leave extra one buffer?
+
+  // add the constant node first
+  auto const_node = partial_constraint->ast->add_children();
+  const_node->set_kind(rgd::Constant);
+  const_node->set_label(0);
+  uint32_t size = get_label_info(label)->size;
+  const_node->set_bits(size); // size of the label
+  // map args
+  uint32_t arg_index = 0; // first arg
+  const_node->set_index(arg_index);
+  partial_constraint->input_args.push_back(std::make_pair(false, 0)); // use 0 as a temporary placeholder
+  partial_constraint->const_num += 1;
+  uint32_t hash = rgd::xxhash(size, rgd::Constant, arg_index);
+  const_node->set_hash(hash);
+
+  // now, parse the label
+  auto label_node = partial_constraint->ast->add_children();
+  try {
+    if (!do_uta_rel(label, label_node, partial_constraint, visited)) {
+      WARNF("failed to parse label %u\n", label);
+      return nullptr;
+    }
+  } catch (std::bad_alloc &e) {
+    WARNF("failed to allocate memory for partial constraint\n");
+    return nullptr;
+  } catch (std::out_of_range &e) {
+    WARNF("AST %u goes out of range at %s\n", label, e.what());
+    return nullptr;
+  }
+
+  // setup root cmp node
+  auto cmp_node = partial_constraint->ast.get();
+  cmp_node->set_kind(rgd::Equal); // a placeholder, not really useful
+  cmp_node->set_label(0); // so jigsaw will not cache it as visited
+  cmp_node->set_bits(1);
+  // again, in jigsaw, we don't care about actual cmp kind
+  hash = rgd::xxhash(const_node->hash(), (rgd::Bool << 16) | 1, label_node->hash());
+  cmp_node->set_hash(hash);
+  partial_constraint->shape = AstShapes::global().intern(*partial_constraint->get_root());
+  partial_constraint->digest = label_digest(label, partial_constraint->get_root());
+
+  // done parsing, add to cache
+  constraint_cache.insert(label, partial_constraint);
+  return partial_constraint;
+}
+
+// collect the branch constraints sharing input bytes with label
+void RGDAstParser::collect_nested_clause(dfsan_label label, clause_t &nested_caluse) {
+  auto &itr = label_deps(label);
+  if (unlikely(itr != nullptr)) {
+    std::unordered_set<dfsan_label> inserted;
+    collect_related_branches(*itr, inserted, nested_caluse);
+  }
+}
+
+// push the last nested_window_ branches of bucket not in inserted yet
+bool RGDAstParser::collect_bucket(const std::vector<expr_t> &bucket,
+                                  std::unordered_set<dfsan_label> &inserted,
+                                  clause_t &nested_caluse) {
+  bool added = false;
+  size_t begin = 0;
+  if (nested_window_ && bucket.size() > nested_window_) {
+    begin = bucket.size() - nested_window_;
+  }
+  for (size_t i = begin; i < bucket.size(); i++) {
+    auto const& nc = bucket[i];
+    if (inserted.insert(nc->label()).second) {
+      DEBUGF("add nested constraint: (%d, %d)\n", nc->label(), nc->kind());
+      nested_caluse.push_back(nc.get()); // XXX: borrow the raw ptr, should be fine?
+      added = true;
+    }
+  }
+  return added;
+}
+
+// collect the earlier branch constraints related to the input bytes in deps
+bool RGDAstParser::collect_related_branches(const DepSet &deps,
+                                            std::unordered_set<dfsan_label> &inserted,
+                                            clause_t &nested_caluse) {
+  bool added = false;
+  if (nested_slice_) {
+    // only the branches reading one of the bytes
+    deps.for_each([&](size_t input) {
+      added |= collect_bucket(byte_to_branches_[input], inserted, nested_caluse);
+    });
+    return added;
+  }
+  // use union find to add additional related input bytes, the sets are
+  // disjoint so a set already seen, by its root, brings in nothing new
+  std::vector<size_t> roots;
+  std::vector<size_t> related_inputs;
+  deps.for_each([&](size_t input) {
+    size_t root = data_flow_deps.find(input);
+    if (root == rgd::UnionFind::INVALID ||
+        std::find(roots.begin(), roots.end(), root) != roots.end()) {
+      return;
+    }
+    roots.push_back(root);
+    data_flow_deps.get_set(input, related_inputs);
+  });
+  // collect the branch constraints for each related input byte
+  for (auto input: related_inputs) {
+    added |= collect_bucket(input_to_branches[input], inserted, nested_caluse);
+  }
+  return added;
+}
+
+int RGDAstParser::parse_switch(dfsan_label label, uint64_t result,
+                               const std::vector<uint64_t> &cases,
+                               const std::vector<uint32_t> &targets,
+                               dfsan_label taken_label,
+                               std::vector<std::pair<uint32_t, uint64_t>> &tasks) {
+  // check validity of the label
+  if (label < CONST_OFFSET || label == __dfsan::kInitializingLabel || label >= size_) {
+    return -1;
+  }
+
+  // update ast_size and branch_to_inputs caches
+  if (!scan_labels(label)) {
+    return -1;
+  }
+  if (unlikely(nested_cmp_cache.at(label) > 0)) {
+    WARNF("unexpected nested cmp in parse_switch for %u, skip\n", label);
+    return -1;
+  }
+  auto ast_size = ast_size_cache.at(label);
+  if (unlikely(ast_size == 0)) {
+    WARNF("invalid label %u, ast_size_cache is 0\n", label);
+    return 0;
+  } else if (unlikely(ast_size > max_ast_size_)) {
+    DEBUGF("skip large AST (%lu) in parse_switch for %u\n", ast_size, label);
+    return 0; // not an error, just skip
+  } else if (unlikely(label_invalid(label))) {
+    DEBUGF("label %u failed to parse before\n", label);
+    return 0; // warned about the first time
+  }
+
+  // like gep, the case constraints are not in the union table, the condition
+  // is parsed once and each case gets a copy with its own constant
+  constraint_t partial_constraint = parse_partial_constraint(label, ast_size);
+  if (unlikely(partial_constraint == nullptr)) {
+    WARNF("failed to parse switch label %u\n", label);
+    return -1;
+  }
+
+  clause_t nested_caluse;
+  if (solve_nested_) {
+    collect_nested_clause(label, nested_caluse);
+  }
+
+  auto add_case = [&](task_t task, uint64_t value, rgd::AstKind cmp) {
+    constraint_t c = std::make_shared<rgd::Constraint>(*partial_constraint);
+    c->input_args[0].second = value; // IMPORTANT: fix the constant arg
+    c->op1 = value;
+    c->op2 = result;
+    task->constraints.push_back(c);
+    task->comparisons.push_back(cmp);
+  };
+
+  for (auto target : targets) {
+    task_t task = std::make_shared<rgd::SearchTask>();
+    if (target < cases.size()) {
+      add_case(task, cases[target], rgd::Equal);
+    } else {
+      // the default, none of the cases
+      for (auto value : cases)
+        add_case(task, value, rgd::Distinct);
     }
+    task->finalize();
+    tasks.push_back({target, save_task(task)});
+    if (solve_nested_ && !nested_caluse.empty()) {
+      task_t nested_task = std::make_shared<rgd::SearchTask>();
+      nested_task->constraints = task->constraints;
+      nested_task->comparisons = task->comparisons;
+      add_nested_constraint(nested_task, nested_caluse);
+      nested_task->finalize();
+      nested_task->base_task = task;
+      tasks.push_back({target, save_task(nested_task)});
+    }
+  }
+
+  // the taken case is in the union table and can be saved as usual
+  if (taken_label) {
+    add_constraints(taken_label, 1);
   }
+
+  return 0;
 }
 
 int RGDAstParser::parse_gep(dfsan_label ptr_label, uptr ptr,
@@ -1544,6 +2300,9 @@ int RGDAstParser::parse_gep(dfsan_label ptr_label, uptr ptr,
   } else if (unlikely(ast_size > max_ast_size_)) {
     DEBUGF("skip large AST (%lu) in parse_gep for %u\n", ast_size, index_label);
     return 0; // not an error, just skip
+  } else if (unlikely(label_invalid(index_label))) {
+    DEBUGF("label %u failed to parse before\n", index_label);
+    return 0; // warned about the first time
   }
 
   // early return if nothing to check
@@ -1561,58 +2320,7 @@ int RGDAstParser::parse_gep(dfsan_label ptr_label, uptr ptr,
 
   // first, parse the index_label into a partial constraint
   // again, the index_label is not a cmp node
-  constraint_t partial_constraint = nullptr;
-  // check cache first
-  auto itr = constraint_cache.find(index_label);
-  if (itr != constraint_cache.end()) {
-    partial_constraint = itr->second;
-  } else {
-    // otherwise, parse the AST into a constraint
-    std::unordered_set<dfsan_label> visited;
-    partial_constraint = std::make_shared<rgd::Constraint>(ast_size + 3); // leave extra one buffer?
-
-    // add the constant node first
-    auto const_node = partial_constraint->ast->add_children();
-    const_node->set_kind(rgd::Constant);
-    const_node->set_label(0);
-    uint32_t size = get_label_info(index_label)->size;
-    const_node->set_bits(size); // size of the index
-    // map args
-    uint32_t arg_index = 0; // first arg
-    const_node->set_index(arg_index);
-    partial_constraint->input_args.push_back(std::make_pair(false, 0)); // use 0 as a temporary placeholder
-    partial_constraint->const_num += 1;
-    uint32_t hash = rgd::xxhash(size, rgd::Constant, arg_index);
-    const_node->set_hash(hash);
-
-    // now, parse the index_label
-    auto index_node = partial_constraint->ast->add_children();
-    try {
-      if (!do_uta_rel(index_label, index_node, partial_constraint, visited)) {
-        WARNF("failed to parse index_label %u\n", index_label);
-        return -1;
-      }
-    } catch (std::bad_alloc &e) {
-      WARNF("failed to allocate memory for gep constraint\n");
-      return -1;
-    } catch (std::out_of_range &e) {
-      WARNF("AST %u goes out of range at %s\n", index_label, e.what());
-      return -1;
-    }
-
-    // setup root cmp node
-    auto cmp_node = partial_constraint->ast.get();
-    cmp_node->set_kind(rgd::Equal); // a placeholder, not really useful
-    cmp_node->set_label(0); // so jigsaw will not cache it as visited
-    cmp_node->set_bits(1);
-    // again, in jigsaw, we don't care about actual cmp kind
-    hash = rgd::xxhash(const_node->hash(), (rgd::Bool << 16) | 1, index_node->hash());
-    cmp_node->set_hash(hash);
-
-    // done parsing, add to cache
-    constraint_cache.insert({index_label, partial_constraint});
-  }
-
+  constraint_t partial_constraint = parse_partial_constraint(index_label, ast_size);
   if (unlikely(partial_constraint == nullptr)) {
     WARNF("failed to parse index_label %u\n", index_label);
     return -1;
@@ -1621,28 +2329,7 @@ int RGDAstParser::parse_gep(dfsan_label ptr_label, uptr ptr,
   // next, retrive nested constraints if needed
   clause_t nested_caluse;
   if (solve_nested_) {
-    auto &itr = branch_to_inputs[index_label];
-    if (unlikely(itr.find_first() != input_dep_t::npos)) {
-      // use union find to add additional related input bytes
-      std::unordered_set<size_t> related_inputs;
-      for (auto input = itr.find_first(); input != input_dep_t::npos;
-           input = itr.find_next(input)) {
-        data_flow_deps.get_set(input, related_inputs); // FIXME: should be fine?
-      }
-      // collect the branch constraints for each related input byte
-      std::unordered_set<dfsan_label> inserted;
-      for (auto input: related_inputs) {
-        auto const& bucket = input_to_branches[input];
-        for (auto const& nc : bucket) {
-          if (inserted.insert(nc->label()).second) {
-#if DEBUG
-            fprintf(stderr, "add nested constraint for gep: (%d, %d)\n", nc->label(), nc->kind());
-#endif
-            nested_caluse.push_back(nc.get()); // XXX: borrow the raw ptr, should be fine?
-          }
-        }
-      }
-    }
+    collect_nested_clause(index_label, nested_caluse);
   }
 
   // finally, we are ready to construct GEP tasks
@@ -1694,6 +2381,7 @@ int RGDAstParser::parse_gep(dfsan_label ptr_label, uptr ptr,
   } else {
     // struct or array with unknown compile time size
     auto bounds_info = get_label_info(ptr_label);
+    auto bounds = get_label_operands(ptr_label);
     if (bounds_info->op == __dfsan::Alloca) {
       // bounds information is available, check if allocation size is symbolic
       if (bounds_info->l2 ==0) {
@@ -1701,7 +2389,7 @@ int RGDAstParser::parse_gep(dfsan_label ptr_label, uptr ptr,
         // check underflow, lower_bound > index * elem_size + current_offset + ptr
         // => (lower_bound - current_offset - ptr) / elem_size > index
         constraint_t underflow = std::make_shared<rgd::Constraint>(*partial_constraint);
-        uint64_t lower_bound = (bounds_info->op1.i - current_offset - ptr) / elem_size;
+        uint64_t lower_bound = (bounds->op1.i - current_offset - ptr) / elem_size;
         underflow->input_args[0].second = lower_bound; // IMPORTANT: fix the constant arg
         underflow->op1 = lower_bound;
         underflow->op2 = index;
@@ -1721,7 +2409,7 @@ int RGDAstParser::parse_gep(dfsan_label ptr_label, uptr ptr,
         // check overflow, upper_bound <= index * elem_size + current_offset + ptr
         // => (upper_bound - current_offset - ptr) / elem_size <= index
         constraint_t overflow = std::make_shared<rgd::Constraint>(*partial_constraint);
-        uint64_t upper_bound = (bounds_info->op2.i - current_offset - ptr) / elem_size;
+        uint64_t upper_bound = (bounds->op2.i - current_offset - ptr) / elem_size;
         overflow->input_args[0].second = upper_bound; // IMPORTANT: fix the constant arg
         overflow->op1 = upper_bound;
         overflow->op2 = index;
@@ -1765,10 +2453,8 @@ int RGDAstParser::add_constraints(dfsan_label label, uint64_t result) {
     return -1;
   }
 
-  expr_t root = nullptr;
-  auto itr = root_expr_cache.find(label);
-  if (itr != root_expr_cache.end()) {
-    // the constraint has already been added, skip
+  // the constraint has already been added, skip
+  if (added_constraints_.count(label)) {
     return 0;
   }
 
@@ -1778,7 +2464,7 @@ int RGDAstParser::add_constraints(dfsan_label label, uint64_t result) {
   }
   // other sanitity checks
   // 1. there shouldn't be any nested cmp
-  if (nested_cmp_cache[label] > 0) {
+  if (label_nested(label) > 0) {
     WARNF("unexpected nested cmp in add_constraints for %u\n", label);
     return -1;
   }
@@ -1794,16 +2480,26 @@ int RGDAstParser::add_constraints(dfsan_label label, uint64_t result) {
     return -1;
   }
   // check for ast size
-  if (ast_size_cache[info->l2] > max_ast_size_) {
-    DEBUGF("skip large AST (%lu) in add_constraints for %u\n", ast_size_cache[label], label);
+  if (label_size(info->l2) > max_ast_size_) {
+    DEBUGF("skip large AST (%u) in add_constraints for %u\n", label_size(label), label);
     return 0; // not an error, just skip
   }
-  // setup node
-  root = std::make_shared<rgd::AstNode>(1);
-  root->set_bits(1);
-  root->set_kind(rgd::Equal);
-  root->set_label(label);
-  root_expr_cache.insert({label, root});
+  // setup node, unless a previous run left it behind
+  expr_t root = nullptr;
+  if (auto *cached = root_expr_cache.find(label)) {
+    if ((*cached)->kind() != rgd::Equal || (*cached)->children_size() != 0) {
+      // the label has been parsed as a branch condition
+      return 0;
+    }
+    root = *cached;
+  } else {
+    root = std::make_shared<rgd::AstNode>(1);
+    root->set_bits(1);
+    root->set_kind(rgd::Equal);
+    root->set_label(label);
+    root_expr_cache.insert(label, root);
+  }
+  added_constraints_.insert(label);
 
   if (!save_constraint(root, true)) {
     return -1;
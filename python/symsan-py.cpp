@@ -9,10 +9,14 @@ extern "C" {
 }
 
 #include "parse-z3.h"
+#include "parse-rgd.h"
+#include "solver.h"
 
 #include <z3++.h>
 
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <utility>
 #include <vector>
 
@@ -26,10 +30,258 @@ extern "C" {
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
-// z3parser
-static z3::context __z3_context;
-symsan::Z3ParserSolver *__z3_parser = nullptr;
+using namespace __dfsan;
+
+// a parser and solver over a union table, with its own z3 context, so
+// Python threads can parse and solve on separate objects at once; the
+// blocking calls drop the GIL and take the object's lock instead
+struct ParserObject {
+  PyObject_HEAD
+  z3::context *context;
+  symsan::Z3ParserSolver *parser;
+  std::mutex *lock;
+  dfsan_label_info *label_info;
+  size_t num_labels;
+};
+
+// the same over the RGD parser, solved by the RGD solvers in order, for
+// the tasks z3 isn't needed for; the solutions are patches of the input
+struct RGDParserObject {
+  PyObject_HEAD
+  rgd::RGDAstParser *parser;
+  std::vector<std::shared_ptr<rgd::Solver>> *solvers;
+  std::mutex *lock;
+  dfsan_label_info *label_info;
+  size_t num_labels;
+  // the input the tasks are solved against
+  std::vector<uint8_t> *input;
+};
+
+static PyTypeObject *__parser_type = nullptr;
+static PyTypeObject *__rgd_parser_type = nullptr;
+// the parser behind the module level functions
+static ParserObject *__default_parser = nullptr;
+// the union table mapped by init, for the views over it
+static void *__shm_base = nullptr;
+static size_t __ut_size = 0;
+// buffers exported over the table and not released yet, init and destroy
+// refuse to unmap it under them
+static Py_ssize_t __shm_exports = 0;
+static PyTypeObject *__shm_buffer_type = nullptr;
+
+// struct formats of the union table and the events, as PEP 3118 strings
+// numpy.dtype() and struct take; the label info is exactly 16 bytes and
+// the events are packed, so the standard sizes match the C layout
+static const char kLabelInfoFormat[] = "=IIHHI";  // l1, l2, op, size, hash
+static const char kLabelOperandsFormat[] = "=QQ"; // op1, op2
+// msg_type, flags, instance_id, addr, context, id, label, result
+static const char kPipeMsgFormat[] = "=HHIQIIIQ";
+static_assert(sizeof(dfsan_label_info) == 16, "LABEL_INFO_FORMAT is stale");
+static_assert(sizeof(dfsan_label_operands) == 16, "LABEL_OPERANDS_FORMAT is stale");
+static_assert(sizeof(pipe_msg) == 36, "PIPE_MSG_FORMAT is stale");
+
+// runs f without the GIL, holding the lock of p if any; a C++ exception is
+// turned into a RuntimeError, false is returned then
+template <class P, class F>
+static bool without_gil(P *p, F &&f) {
+  std::string error;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    if (p) {
+      std::lock_guard<std::mutex> guard(*p->lock);
+      f();
+    } else {
+      f();
+    }
+  } catch (std::exception &e) {
+    error = e.what();
+  }
+  Py_END_ALLOW_THREADS
+  if (!error.empty()) {
+    PyErr_SetString(PyExc_RuntimeError, error.c_str());
+    return false;
+  }
+  return true;
+}
+
+static int ParserInit(ParserObject *self, PyObject *args, PyObject *keywds) {
+  static const char *kwlist[] = {"shm", "ut_size", NULL};
+  PyObject *shm = NULL;
+  unsigned long long ut_size = uniontable_size;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|K", const_cast<char**>(kwlist),
+      &shm, &ut_size)) {
+    return -1;
+  }
+
+  void *shm_base = PyCapsule_GetPointer(shm, "dfsan_label_info");
+  if (shm_base == NULL) {
+    return -1;
+  }
+
+  if (self->parser) {
+    PyErr_SetString(PyExc_RuntimeError, "parser already initialized");
+    return -1;
+  }
+  self->context = new z3::context();
+  self->parser = new symsan::Z3ParserSolver(shm_base, ut_size, *self->context);
+  self->lock = new std::mutex();
+  self->label_info = static_cast<dfsan_label_info*>(shm_base);
+  self->num_labels = ut_size / (sizeof(dfsan_label_info) + sizeof(dfsan_label_operands));
+  return 0;
+}
+
+static void ParserDealloc(ParserObject *self) {
+  delete self->parser;
+  delete self->context;
+  delete self->lock;
+  PyTypeObject *type = Py_TYPE(self);
+  type->tp_free((PyObject*)self);
+  Py_DECREF(type);
+}
+
+static int RGDParserInit(RGDParserObject *self, PyObject *args, PyObject *keywds) {
+  static const char *kwlist[] = {"shm", "ut_size", "solvers", "nested",
+                                 "max_ast_size", NULL};
+  PyObject *shm = NULL;
+  unsigned long long ut_size = uniontable_size;
+  const char *solvers = "i2s,jit";
+  int nested = 0;
+  unsigned long long max_ast_size = 200;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|KspK", const_cast<char**>(kwlist),
+      &shm, &ut_size, &solvers, &nested, &max_ast_size)) {
+    return -1;
+  }
+
+  void *shm_base = PyCapsule_GetPointer(shm, "dfsan_label_info");
+  if (shm_base == NULL) {
+    return -1;
+  }
+
+  if (self->parser) {
+    PyErr_SetString(PyExc_RuntimeError, "parser already initialized");
+    return -1;
+  }
+  // the solvers to try, in order, a later one only if an earlier times out
+  auto list = std::make_unique<std::vector<std::shared_ptr<rgd::Solver>>>();
+  std::string names(solvers);
+  size_t pos = 0;
+  while (pos <= names.size()) {
+    size_t end = names.find(',', pos);
+    if (end == std::string::npos) end = names.size();
+    std::string name = names.substr(pos, end - pos);
+    pos = end + 1;
+    if (name.empty()) continue;
+    if (name == "i2s") list->emplace_back(std::make_shared<rgd::I2SSolver>());
+    else if (name == "memcmp") list->emplace_back(std::make_shared<rgd::MemcmpSolver>());
+    else if (name == "inverse") list->emplace_back(std::make_shared<rgd::InverseSolver>());
+    else if (name == "linear") list->emplace_back(std::make_shared<rgd::LinearSolver>());
+    else if (name == "jit") list->emplace_back(std::make_shared<rgd::JITSolver>());
+    else if (name == "z3") list->emplace_back(std::make_shared<rgd::Z3Solver>());
+    else {
+      PyErr_Format(PyExc_ValueError, "unknown solver %s", name.c_str());
+      return -1;
+    }
+  }
+  if (list->empty()) {
+    PyErr_SetString(PyExc_ValueError, "no solvers");
+    return -1;
+  }
+  self->parser = new rgd::RGDAstParser(shm_base, ut_size, nested, max_ast_size);
+  self->solvers = list.release();
+  self->lock = new std::mutex();
+  self->label_info = static_cast<dfsan_label_info*>(shm_base);
+  self->num_labels = ut_size / (sizeof(dfsan_label_info) + sizeof(dfsan_label_operands));
+  self->input = new std::vector<uint8_t>();
+  return 0;
+}
+
+static void RGDParserDealloc(RGDParserObject *self) {
+  delete self->parser;
+  delete self->solvers;
+  delete self->lock;
+  delete self->input;
+  PyTypeObject *type = Py_TYPE(self);
+  type->tp_free((PyObject*)self);
+  Py_DECREF(type);
+}
+
+template <class P>
+static bool check_parser(P *p) {
+  if (p == nullptr || p->parser == nullptr) {
+    PyErr_SetString(PyExc_RuntimeError, "parser not initialized");
+    return false;
+  }
+  return true;
+}
 
+// the exporter of the views over the table, n items of format at buf
+typedef struct {
+  PyObject_HEAD
+  void *buf;
+  Py_ssize_t shape;
+  Py_ssize_t strides;
+  const char *format;
+} ShmBufferObject;
+
+static int ShmBufferGetBuffer(ShmBufferObject *self, Py_buffer *view, int flags) {
+  if (flags & PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "the union table is read-only");
+    return -1;
+  }
+  view->obj = (PyObject*)self;
+  Py_INCREF(self);
+  view->buf = self->buf;
+  view->len = self->shape * self->strides;
+  view->itemsize = self->strides;
+  view->readonly = 1;
+  view->ndim = 1;
+  view->format = (flags & PyBUF_FORMAT) ? const_cast<char*>(self->format) : NULL;
+  view->shape = (flags & PyBUF_ND) ? &self->shape : NULL;
+  view->strides = (flags & PyBUF_STRIDES) ? &self->strides : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  __shm_exports++;
+  return 0;
+}
+
+static void ShmBufferReleaseBuffer(ShmBufferObject *self, Py_buffer *view) {
+  __shm_exports--;
+}
+
+static void ShmBufferDealloc(ShmBufferObject *self) {
+  PyTypeObject *type = Py_TYPE(self);
+  type->tp_free((PyObject*)self);
+  Py_DECREF(type);
+}
+
+static PyType_Slot ShmBufferSlots[] = {
+  {Py_tp_doc, (void*)"a read-only buffer over the union table, see label_table"},
+  {Py_bf_getbuffer, (void*)ShmBufferGetBuffer},
+  {Py_bf_releasebuffer, (void*)ShmBufferReleaseBuffer},
+  {Py_tp_dealloc, (void*)ShmBufferDealloc},
+  {0, NULL},
+};
+
+static PyType_Spec ShmBufferSpec = {
+  "symsan.ShmBuffer",
+  sizeof(ShmBufferObject),
+  0,
+  Py_TPFLAGS_DEFAULT,
+  ShmBufferSlots,
+};
+
+// raises a BufferError if views over the table are still alive
+static bool shm_unexported() {
+  if (__shm_exports > 0) {
+    PyErr_Format(PyExc_BufferError,
+                 "%zd views over the union table are still alive, release them first",
+                 __shm_exports);
+    return false;
+  }
+  return true;
+}
 
 static PyObject* SymSanInit(PyObject *self, PyObject *args) {
   const char *program;
@@ -38,6 +290,9 @@ static PyObject* SymSanInit(PyObject *self, PyObject *args) {
   if (!PyArg_ParseTuple(args, "s|K", &program, &ut_size)) {
     return NULL;
   }
+  if (!shm_unexported()) {
+    return NULL;
+  }
 
   // setup launcher
   void *shm_base = symsan_init(program, ut_size);
@@ -46,14 +301,24 @@ static PyObject* SymSanInit(PyObject *self, PyObject *args) {
     return PyErr_SetFromErrno(PyExc_OSError);
   }
 
-  // setup parser
-  __z3_parser = new symsan::Z3ParserSolver(shm_base, ut_size, __z3_context);
-  if (__z3_parser == nullptr) {
+  PyObject *shm = PyCapsule_New(shm_base, "dfsan_label_info", NULL);
+  if (shm == NULL) {
+    return NULL;
+  }
+  __shm_base = shm_base;
+  __ut_size = ut_size;
+
+  // setup the default parser
+  Py_CLEAR(__default_parser);
+  __default_parser = (ParserObject*)PyObject_CallFunction(
+      (PyObject*)__parser_type, "OK", shm, ut_size);
+  if (__default_parser == nullptr) {
     fprintf(stderr, "Failed to initialize parser\n");
-    return PyErr_NoMemory();
+    Py_DECREF(shm);
+    return NULL;
   }
 
-  return PyCapsule_New(shm_base, "dfsan_label_info", NULL);
+  return shm;
 }
 
 static PyObject* SymSanConfig(PyObject *self, PyObject *args, PyObject *keywds) {
@@ -129,12 +394,13 @@ static PyObject* SymSanRun(PyObject *self, PyObject *args, PyObject *keywds) {
     }
   }
 
-  int ret = symsan_run(fd);
+  int ret = 0;
+  without_gil((ParserObject*)nullptr, [&] { ret = symsan_run(fd); });
 
   if (file) {
     close(fd);
   }
-  
+
   if (ret < 0) {
     PyErr_SetString(PyExc_ValueError, "failed to launch target");
     return NULL;
@@ -145,7 +411,6 @@ static PyObject* SymSanRun(PyObject *self, PyObject *args, PyObject *keywds) {
 
 static PyObject* SymSanReadEvent(PyObject *self, PyObject *args) {
   PyObject *ret;
-  char *buf;
   Py_ssize_t size;
   unsigned timeout = 0;
 
@@ -158,21 +423,86 @@ static PyObject* SymSanReadEvent(PyObject *self, PyObject *args) {
     return NULL;
   }
 
-  buf = (char *)malloc(size);
+  // read straight into the bytes object, shrunk to what was read
+  ret = PyBytes_FromStringAndSize(NULL, size);
+  if (ret == NULL) {
+    return NULL;
+  }
+  char *buf = PyBytes_AS_STRING(ret);
 
-  ssize_t read = symsan_read_event(buf, size, timeout);
+  ssize_t read = 0;
+  without_gil((ParserObject*)nullptr, [&] { read = symsan_read_event(buf, size, timeout); });
   if (read < 0) {
     PyErr_SetFromErrno(PyExc_OSError);
-    free(buf);
+    Py_DECREF(ret);
     return NULL;
   }
 
-  ret = PyBytes_FromStringAndSize(buf, read);
-  free(buf);
-
+  if (read != size && _PyBytes_Resize(&ret, read) != 0) {
+    return NULL;
+  }
   return ret;
 }
 
+// reads one event straight into a writable buffer, e.g. a slice of a
+// bytearray or numpy array, its whole length; returns the bytes read
+static PyObject* SymSanReadEventInto(PyObject *self, PyObject *args) {
+  Py_buffer view;
+  unsigned timeout = 0;
+
+  if (!PyArg_ParseTuple(args, "w*|I", &view, &timeout)) {
+    return NULL;
+  }
+
+  if (view.len <= 0) {
+    PyBuffer_Release(&view);
+    PyErr_SetString(PyExc_ValueError, "invalid buffer size");
+    return NULL;
+  }
+
+  ssize_t read = 0;
+  without_gil((ParserObject*)nullptr, [&] {
+    read = symsan_read_event(view.buf, view.len, timeout);
+  });
+  PyBuffer_Release(&view);
+  if (read < 0) {
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+  return PyLong_FromSsize_t(read);
+}
+
+// a read-only view of n items of format at buf, without a copy; init and
+// destroy, which unmap the table, fail while it's alive
+static PyObject* shm_view(void *buf, Py_ssize_t n, const char *format,
+                          Py_ssize_t itemsize) {
+  if (__shm_base == nullptr) {
+    PyErr_SetString(PyExc_RuntimeError, "symsan not initialized");
+    return NULL;
+  }
+  ShmBufferObject *exporter = PyObject_New(ShmBufferObject, __shm_buffer_type);
+  if (exporter == nullptr) {
+    return NULL;
+  }
+  exporter->buf = buf;
+  exporter->shape = n;
+  exporter->strides = itemsize;
+  exporter->format = format;
+  PyObject *view = PyMemoryView_FromObject((PyObject*)exporter);
+  Py_DECREF(exporter);
+  return view;
+}
+
+static PyObject* SymSanLabelTable(PyObject *self) {
+  size_t n = __ut_size / (sizeof(dfsan_label_info) + sizeof(dfsan_label_operands));
+  return shm_view(__shm_base, n, kLabelInfoFormat, sizeof(dfsan_label_info));
+}
+
+static PyObject* SymSanLabelOperands(PyObject *self) {
+  size_t n = __ut_size / (sizeof(dfsan_label_info) + sizeof(dfsan_label_operands));
+  void *base = __shm_base ? get_label_operands_base(__shm_base, __ut_size) : nullptr;
+  return shm_view(base, n, kLabelOperandsFormat, sizeof(dfsan_label_operands));
+}
+
 static PyObject* SymSanTerminate(PyObject *self) {
   if (symsan_terminate() != 0) {
     PyErr_SetString(PyExc_RuntimeError, "failed to terminate target");
@@ -190,17 +520,32 @@ static PyObject* SymSanTerminate(PyObject *self) {
 }
 
 static PyObject* SymSanDestroy(PyObject *self) {
-  if (__z3_parser != nullptr) {
-    delete __z3_parser;
+  if (!shm_unexported()) {
+    return NULL;
+  }
+  if (__default_parser != nullptr) {
+    Py_CLEAR(__default_parser);
     symsan_destroy();
-    __z3_parser = nullptr;
   }
+  __shm_base = nullptr;
+  __ut_size = 0;
   Py_RETURN_NONE;
 }
 
-static PyObject* InitParser(PyObject *self, PyObject *args) {
-  if (__z3_parser == nullptr) {
-    PyErr_SetString(PyExc_RuntimeError, "parser not initialized");
+// the z3 parser keeps the inputs itself, the RGD solvers need a copy
+static void keep_input(ParserObject *, std::vector<symsan::input_t> const&) {}
+
+static void keep_input(RGDParserObject *p, std::vector<symsan::input_t> const& inputs) {
+  if (inputs.empty()) {
+    p->input->clear();
+  } else {
+    p->input->assign(inputs[0].first, inputs[0].first + inputs[0].second);
+  }
+}
+
+template <class P>
+static PyObject* InitParser(P *self, PyObject *args) {
+  if (!check_parser(self)) {
     return NULL;
   }
 
@@ -231,7 +576,14 @@ static PyObject* InitParser(PyObject *self, PyObject *args) {
     inputs.push_back({(uint8_t*)data, size});
   }
 
-  if (__z3_parser->restart(inputs) != 0) {
+  int ret = 0;
+  if (!without_gil(self, [&] {
+        ret = self->parser->restart(inputs);
+        keep_input(self, inputs);
+      })) {
+    return NULL;
+  }
+  if (ret != 0) {
     PyErr_SetString(PyExc_RuntimeError, "failed to restart parser");
     return NULL;
   }
@@ -239,13 +591,21 @@ static PyObject* InitParser(PyObject *self, PyObject *args) {
   Py_RETURN_NONE;
 }
 
-static PyObject* ParseCond(PyObject *self, PyObject *args) {
-  if (__z3_parser == nullptr) {
-    PyErr_SetString(PyExc_RuntimeError, "parser not initialized");
+static PyObject* task_list(std::vector<uint64_t> const& tasks) {
+  PyObject *ret = PyList_New(tasks.size());
+  for (size_t i = 0; i < tasks.size(); i++) {
+    PyObject *task = PyLong_FromUnsignedLongLong(tasks[i]);
+    PyList_SetItem(ret, i, task);
+  }
+  return ret;
+}
+
+template <class P>
+static PyObject* ParseCond(P *self, PyObject *args) {
+  if (!check_parser(self)) {
     return NULL;
   }
 
-  PyObject *ret;
   dfsan_label label = 0;
   uint64_t result = 0;
   uint16_t flags = 0;
@@ -255,27 +615,26 @@ static PyObject* ParseCond(PyObject *self, PyObject *args) {
   }
 
   std::vector<uint64_t> tasks;
-  if (__z3_parser->parse_cond(label, result, flags & F_ADD_CONS, tasks) != 0) {
-    PyErr_SetString(PyExc_RuntimeError, "failed to parse condition");
+  int ret = 0;
+  if (!without_gil(self, [&] {
+        ret = self->parser->parse_cond(label, result, flags & F_ADD_CONS, tasks);
+      })) {
     return NULL;
   }
-
-  ret = PyList_New(tasks.size());
-  for (size_t i = 0; i < tasks.size(); i++) {
-    PyObject *task = PyLong_FromUnsignedLongLong(tasks[i]);
-    PyList_SetItem(ret, i, task);
+  if (ret != 0) {
+    PyErr_SetString(PyExc_RuntimeError, "failed to parse condition");
+    return NULL;
   }
 
-  return ret;
+  return task_list(tasks);
 }
 
-static PyObject* ParseGEP(PyObject *self, PyObject *args) {
-  if (__z3_parser == nullptr) {
-    PyErr_SetString(PyExc_RuntimeError, "parser not initialized");
+template <class P>
+static PyObject* ParseGEP(P *self, PyObject *args) {
+  if (!check_parser(self)) {
     return NULL;
   }
 
-  PyObject *ret;
   dfsan_label ptr_label = 0;
   uptr ptr = 0;
   dfsan_label index_label = 0;
@@ -283,7 +642,7 @@ static PyObject* ParseGEP(PyObject *self, PyObject *args) {
   uint64_t num_elems = 0;
   uint64_t elem_size = 0;
   int64_t current_offset = 0;
-  bool enum_index = false; // XXX: default to false?
+  int enum_index = 0; // XXX: default to false?
 
   if (!PyArg_ParseTuple(args, "IKILKKLp", &ptr_label, &ptr, &index_label, &index,
       &num_elems, &elem_size, &current_offset, &enum_index)) {
@@ -291,24 +650,24 @@ static PyObject* ParseGEP(PyObject *self, PyObject *args) {
   }
 
   std::vector<uint64_t> tasks;
-  if (__z3_parser->parse_gep(ptr_label, ptr, index_label, index, num_elems,
-                             elem_size, current_offset, enum_index, tasks) != 0) {
-    PyErr_SetString(PyExc_RuntimeError, "failed to parse GEP");
+  int ret = 0;
+  if (!without_gil(self, [&] {
+        ret = self->parser->parse_gep(ptr_label, ptr, index_label, index, num_elems,
+                                      elem_size, current_offset, enum_index, tasks);
+      })) {
     return NULL;
   }
-
-  ret = PyList_New(tasks.size());
-  for (size_t i = 0; i < tasks.size(); i++) {
-    PyObject *task = PyLong_FromUnsignedLongLong(tasks[i]);
-    PyList_SetItem(ret, i, task);
+  if (ret != 0) {
+    PyErr_SetString(PyExc_RuntimeError, "failed to parse GEP");
+    return NULL;
   }
 
-  return ret;
+  return task_list(tasks);
 }
 
-static PyObject* AddConstraint(PyObject *self, PyObject *args) {
-  if (__z3_parser == nullptr) {
-    PyErr_SetString(PyExc_RuntimeError, "parser not initialized");
+template <class P>
+static PyObject* AddConstraint(P *self, PyObject *args) {
+  if (!check_parser(self)) {
     return NULL;
   }
 
@@ -319,7 +678,11 @@ static PyObject* AddConstraint(PyObject *self, PyObject *args) {
     return NULL;
   }
 
-  if (__z3_parser->add_constraints(label, val) != 0) {
+  int ret = 0;
+  if (!without_gil(self, [&] { ret = self->parser->add_constraints(label, val); })) {
+    return NULL;
+  }
+  if (ret != 0) {
     PyErr_SetString(PyExc_RuntimeError, "failed to add constraint");
     return NULL;
   }
@@ -327,9 +690,9 @@ static PyObject* AddConstraint(PyObject *self, PyObject *args) {
   Py_RETURN_NONE;
 }
 
-static PyObject* RecordMemcmp(PyObject *self, PyObject *args) {
-  if (__z3_parser == nullptr) {
-    PyErr_SetString(PyExc_RuntimeError, "parser not initialized");
+template <class P>
+static PyObject* RecordMemcmp(P *self, PyObject *args) {
+  if (!check_parser(self)) {
     return NULL;
   }
 
@@ -347,7 +710,13 @@ static PyObject* RecordMemcmp(PyObject *self, PyObject *args) {
     return NULL;
   }
 
-  if (__z3_parser->record_memcmp(label, (uint8_t*)data, size) != 0) {
+  int ret = 0;
+  if (!without_gil(self, [&] {
+        ret = self->parser->record_memcmp(label, (uint8_t*)data, size);
+      })) {
+    return NULL;
+  }
+  if (ret != 0) {
     PyErr_SetString(PyExc_RuntimeError, "failed to record memcmp");
     return NULL;
   }
@@ -355,9 +724,8 @@ static PyObject* RecordMemcmp(PyObject *self, PyObject *args) {
   Py_RETURN_NONE;
 }
 
-static PyObject* SolveTask(PyObject *self, PyObject *args) {
-  if (__z3_parser == nullptr) {
-    PyErr_SetString(PyExc_RuntimeError, "parser not initialized");
+static PyObject* SolveTask(ParserObject *self, PyObject *args) {
+  if (!check_parser(self)) {
     return NULL;
   }
 
@@ -368,7 +736,12 @@ static PyObject* SolveTask(PyObject *self, PyObject *args) {
   }
 
   symsan::Z3ParserSolver::solution_t solutions;
-  int status = __z3_parser->solve_task(id, timeout, solutions);
+  int status = 0;
+  if (!without_gil(self, [&] {
+        status = self->parser->solve_task(id, timeout, solutions);
+      })) {
+    return NULL;
+  }
 
   PyObject *sols = PyList_New(solutions.size());
   for (size_t i = 0; i < solutions.size(); i++) {
@@ -387,19 +760,279 @@ static PyObject* SolveTask(PyObject *self, PyObject *args) {
   return ret;
 }
 
+// tries the solvers on task id in order, returns (status, patch, splice):
+// the bytes set as a list of (offset, value), and the range replaced with
+// bytes of another length as (offset, length, bytes) or None
+static PyObject* RGDSolveTask(RGDParserObject *self, PyObject *args) {
+  if (!check_parser(self)) {
+    return NULL;
+  }
+
+  uint64_t id = 0;
+  if (!PyArg_ParseTuple(args, "K", &id)) {
+    return NULL;
+  }
+
+  auto task = self->parser->retrieve_task(id);
+  if (!task) {
+    PyErr_Format(PyExc_KeyError, "no task %llu", (unsigned long long)id);
+    return NULL;
+  }
+
+  rgd::patch_t patch;
+  rgd::solver_result_t status = rgd::SOLVER_TIMEOUT;
+  if (!without_gil(self, [&] {
+        std::vector<std::shared_ptr<rgd::SearchTask>> batch{task};
+        for (auto &solver : *self->solvers) {
+          solver->prepare(batch);
+          patch.clear();
+          status = solver->solve(task, self->input->data(), self->input->size(), patch);
+          if (status == rgd::SOLVER_SAT || status == rgd::SOLVER_UNSAT) break;
+        }
+      })) {
+    return NULL;
+  }
+  if (status != rgd::SOLVER_SAT) {
+    patch.clear();
+  }
+
+  PyObject *bytes = PyList_New(patch.bytes.size());
+  size_t i = 0;
+  for (auto const& [offset, value] : patch.bytes) {
+    PyList_SetItem(bytes, i++, Py_BuildValue("(kB)", (unsigned long)offset, value));
+  }
+  PyObject *splice = Py_None;
+  if (patch.spliced) {
+    splice = Py_BuildValue("(kky#)", (unsigned long)patch.splice_offset,
+                           (unsigned long)patch.splice_len,
+                           (const char*)patch.splice.data(),
+                           (Py_ssize_t)patch.splice.size());
+  } else {
+    Py_INCREF(splice);
+  }
+  return Py_BuildValue("(iNN)", (int)status, bytes, splice);
+}
+
+// reads one event and its payload, and parses it if its type is in mask;
+// returns false once the target is done or the stream is broken
+template <class P>
+static bool drain_one(P *p, unsigned mask, unsigned timeout,
+                      std::vector<uint64_t> &tasks, std::vector<uint64_t> &cases) {
+  pipe_msg msg;
+  gep_msg gmsg;
+  switch_msg smsg;
+  memcmp_msg mmsg;
+  memcmp_blob_msg bmsg;
+  if (symsan_read_event(&msg, sizeof(msg), timeout) != sizeof(msg)) {
+    return false;
+  }
+  bool handle = mask & (1u << msg.msg_type);
+  switch (msg.msg_type) {
+    case cond_type:
+      if (handle && msg.label) {
+        p->parser->parse_cond(msg.label, msg.result, msg.flags & F_ADD_CONS, tasks);
+      }
+      break;
+    case gep_type:
+      if (symsan_read_event(&gmsg, sizeof(gmsg), 0) != sizeof(gmsg)) {
+        return false;
+      }
+      if (handle && msg.label && msg.label == gmsg.index_label) {
+        p->parser->parse_gep(gmsg.ptr_label, gmsg.ptr, gmsg.index_label,
+                             gmsg.index, gmsg.num_elems, gmsg.elem_size,
+                             gmsg.current_offset, false, tasks);
+      }
+      break;
+    case switch_type:
+      // not parsed here, only kept in sync
+      if (symsan_read_event(&smsg, sizeof(smsg), 0) != sizeof(smsg)) {
+        return false;
+      }
+      cases.resize(smsg.num_cases);
+      if (symsan_read_event(cases.data(), smsg.num_cases * sizeof(uint64_t), 0) !=
+          (ssize_t)(smsg.num_cases * sizeof(uint64_t))) {
+        return false;
+      }
+      break;
+    case memcmp_type: {
+      if (msg.label == 0 || msg.label >= p->num_labels) break;
+      dfsan_label_info *info = &p->label_info[msg.label];
+      // both operands symbolic, no content follows
+      if (info->l1 != CONST_LABEL && info->l2 != CONST_LABEL) break;
+      if (msg.flags & F_MEMCMP_BLOB) {
+        if (symsan_read_event(&bmsg, sizeof(bmsg), 0) != sizeof(bmsg)) {
+          return false;
+        }
+        const void *blob = symsan_get_blob(bmsg.offset, msg.result);
+        if (handle && blob && bmsg.label == msg.label) {
+          p->parser->record_memcmp_ref(msg.label, (const uint8_t*)blob);
+        }
+        break;
+      }
+      if (symsan_read_event(&mmsg, sizeof(mmsg), 0) != sizeof(mmsg)) {
+        return false;
+      }
+      uint8_t *content = p->parser->memcmp_buffer(msg.result);
+      if (symsan_read_event(content, msg.result, 0) != (ssize_t)msg.result) {
+        return false;
+      }
+      if (handle && mmsg.label == msg.label) {
+        p->parser->record_memcmp_ref(msg.label, content);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  return true;
+}
+
+template <class P>
+static PyObject* SymSanDrain(P *self, PyObject *args, PyObject *keywds) {
+  static const char *kwlist[] = {"handler_mask", "budget", "timeout", NULL};
+  unsigned mask = (1u << cond_type) | (1u << gep_type) | (1u << memcmp_type);
+  unsigned long long budget = 0;
+  unsigned timeout = 0;
+
+  if (!check_parser(self)) {
+    return NULL;
+  }
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywds, "|IKI", const_cast<char**>(kwlist),
+      &mask, &budget, &timeout)) {
+    return NULL;
+  }
+
+  std::vector<uint64_t> tasks;
+  std::vector<uint64_t> cases;
+  unsigned long long num_events = 0;
+  bool done = false;
+  if (!without_gil(self, [&] {
+        while (!budget || num_events < budget) {
+          if (!drain_one(self, mask, timeout, tasks, cases)) {
+            done = true;
+            break;
+          }
+          num_events++;
+        }
+      })) {
+    return NULL;
+  }
+
+  // the task ids as native uint64, for array.array('Q') or numpy.frombuffer
+  PyObject *ids = PyBytes_FromStringAndSize((const char*)tasks.data(),
+                                            tasks.size() * sizeof(uint64_t));
+  if (ids == NULL) {
+    return NULL;
+  }
+  return Py_BuildValue("(NKO)", ids, num_events, done ? Py_True : Py_False);
+}
+
+// the module level functions work on the parser set up by init
+#define DEFAULT_PARSER(name, impl) \
+  static PyObject* name(PyObject *self, PyObject *args) { \
+    return impl(__default_parser, args); \
+  }
+
+DEFAULT_PARSER(DefaultInitParser, InitParser)
+DEFAULT_PARSER(DefaultParseCond, ParseCond)
+DEFAULT_PARSER(DefaultParseGEP, ParseGEP)
+DEFAULT_PARSER(DefaultAddConstraint, AddConstraint)
+DEFAULT_PARSER(DefaultRecordMemcmp, RecordMemcmp)
+DEFAULT_PARSER(DefaultSolveTask, SolveTask)
+
+#undef DEFAULT_PARSER
+
+static PyObject* DefaultDrain(PyObject *self, PyObject *args, PyObject *keywds) {
+  return SymSanDrain(__default_parser, args, keywds);
+}
+
+static PyMethodDef ParserMethods[] = {
+  {"reset_input", (PyCFunction)InitParser<ParserObject>, METH_VARARGS, "reset the parser with a new input"},
+  {"parse_cond", (PyCFunction)ParseCond<ParserObject>, METH_VARARGS, "parse trace_cond event into solving tasks"},
+  {"parse_gep", (PyCFunction)ParseGEP<ParserObject>, METH_VARARGS, "parse trace_gep event into solving tasks"},
+  {"add_constraint", (PyCFunction)AddConstraint<ParserObject>, METH_VARARGS, "add a constraint"},
+  {"record_memcmp", (PyCFunction)RecordMemcmp<ParserObject>, METH_VARARGS, "record a memcmp event"},
+  {"solve_task", (PyCFunction)SolveTask, METH_VARARGS, "solve a task"},
+  {"drain", (PyCFunction)SymSanDrain<ParserObject>, METH_VARARGS | METH_KEYWORDS,
+   "read and parse up to budget events into this parser, see symsan.drain"},
+  {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+static PyType_Slot ParserSlots[] = {
+  {Py_tp_doc, (void*)"Parser(shm, ut_size): a z3 parser and solver over the union table "
+                     "returned by init, independent of the others"},
+  {Py_tp_new, (void*)PyType_GenericNew},
+  {Py_tp_init, (void*)ParserInit},
+  {Py_tp_dealloc, (void*)ParserDealloc},
+  {Py_tp_methods, (void*)ParserMethods},
+  {0, NULL},
+};
+
+static PyType_Spec ParserSpec = {
+  "symsan.Parser",
+  sizeof(ParserObject),
+  0,
+  Py_TPFLAGS_DEFAULT,
+  ParserSlots,
+};
+
+static PyMethodDef RGDParserMethods[] = {
+  {"reset_input", (PyCFunction)InitParser<RGDParserObject>, METH_VARARGS,
+   "reset the parser with a new input, the first one is what tasks are solved against"},
+  {"parse_cond", (PyCFunction)ParseCond<RGDParserObject>, METH_VARARGS, "parse trace_cond event into solving tasks"},
+  {"parse_gep", (PyCFunction)ParseGEP<RGDParserObject>, METH_VARARGS, "parse trace_gep event into solving tasks"},
+  {"add_constraint", (PyCFunction)AddConstraint<RGDParserObject>, METH_VARARGS, "add a constraint"},
+  {"record_memcmp", (PyCFunction)RecordMemcmp<RGDParserObject>, METH_VARARGS, "record a memcmp event"},
+  {"solve_task", (PyCFunction)RGDSolveTask, METH_VARARGS,
+   "solve a task with the solvers in order; returns (status, [(offset, value)], "
+   "(offset, length, bytes) or None)"},
+  {"drain", (PyCFunction)SymSanDrain<RGDParserObject>, METH_VARARGS | METH_KEYWORDS,
+   "read and parse up to budget events into this parser, see symsan.drain"},
+  {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+static PyType_Slot RGDParserSlots[] = {
+  {Py_tp_doc, (void*)"RGDParser(shm, ut_size, solvers='i2s,jit', nested=False, max_ast_size=200): "
+                     "an RGD parser over the union table returned by init, whose tasks are "
+                     "solved by the comma separated solvers (memcmp, i2s, inverse, linear, jit, z3)"},
+  {Py_tp_new, (void*)PyType_GenericNew},
+  {Py_tp_init, (void*)RGDParserInit},
+  {Py_tp_dealloc, (void*)RGDParserDealloc},
+  {Py_tp_methods, (void*)RGDParserMethods},
+  {0, NULL},
+};
+
+static PyType_Spec RGDParserSpec = {
+  "symsan.RGDParser",
+  sizeof(RGDParserObject),
+  0,
+  Py_TPFLAGS_DEFAULT,
+  RGDParserSlots,
+};
+
 static PyMethodDef SymSanMethods[] = {
   {"init", SymSanInit, METH_VARARGS, "initialize symsan target"},
   {"config", (PyCFunction)SymSanConfig, METH_VARARGS | METH_KEYWORDS, "config symsan"},
   {"run", (PyCFunction)SymSanRun, METH_VARARGS | METH_KEYWORDS, "run symsan target, optional stdin=file"},
   {"read_event", SymSanReadEvent, METH_VARARGS, "read a symsan event"},
+  {"read_event_into", SymSanReadEventInto, METH_VARARGS,
+   "read a symsan event into a writable buffer, filling all of it; returns the bytes read"},
+  {"label_table", (PyCFunction)SymSanLabelTable, METH_NOARGS,
+   "read-only memoryview of the dfsan_label_info array, format LABEL_INFO_FORMAT"},
+  {"label_operands", (PyCFunction)SymSanLabelOperands, METH_NOARGS,
+   "read-only memoryview of the label operands array, format LABEL_OPERANDS_FORMAT"},
+  {"drain", (PyCFunction)DefaultDrain, METH_VARARGS | METH_KEYWORDS,
+   "read and parse up to budget events (0 for all), only those whose type bit is in handler_mask; "
+   "returns (task ids as bytes of uint64, number of events, whether the target is done)"},
   {"terminate", (PyCFunction)SymSanTerminate, METH_NOARGS, "terminate current symsan instance"},
   {"destroy", (PyCFunction)SymSanDestroy, METH_NOARGS, "destroy symsan target"},
-  {"reset_input", InitParser, METH_VARARGS, "reset the symbolic expression parser with a new input"},
-  {"parse_cond", ParseCond, METH_VARARGS, "parse trace_cond event into solving tasks"},
-  {"parse_gep", ParseGEP, METH_VARARGS, "parse trace_gep event into solving tasks"},
-  {"add_constraint", AddConstraint, METH_VARARGS, "add a constraint"},
-  {"record_memcmp", RecordMemcmp, METH_VARARGS, "record a memcmp event"},
-  {"solve_task", SolveTask, METH_VARARGS, "solve a task"},
+  {"reset_input", DefaultInitParser, METH_VARARGS, "reset the symbolic expression parser with a new input"},
+  {"parse_cond", DefaultParseCond, METH_VARARGS, "parse trace_cond event into solving tasks"},
+  {"parse_gep", DefaultParseGEP, METH_VARARGS, "parse trace_gep event into solving tasks"},
+  {"add_constraint", DefaultAddConstraint, METH_VARARGS, "add a constraint"},
+  {"record_memcmp", DefaultRecordMemcmp, METH_VARARGS, "record a memcmp event"},
+  {"solve_task", DefaultSolveTask, METH_VARARGS, "solve a task"},
   {NULL, NULL, 0, NULL}  /* Sentinel */
 };
 
@@ -417,9 +1050,58 @@ static PyModuleDef SymSanModule = {
 PyMODINIT_FUNC
 PyInit_symsan(void) {
   // check if initialized before?
-  if (__z3_parser != nullptr) {
-    delete __z3_parser;
+  if (__default_parser != nullptr) {
+    Py_CLEAR(__default_parser);
     symsan_destroy();
   }
-  return PyModule_Create(&SymSanModule);
+  PyObject *m = PyModule_Create(&SymSanModule);
+  if (m == NULL) {
+    return NULL;
+  }
+  if (__parser_type == nullptr) {
+    __parser_type = (PyTypeObject*)PyType_FromSpec(&ParserSpec);
+    if (__parser_type == nullptr) {
+      Py_DECREF(m);
+      return NULL;
+    }
+  }
+  Py_INCREF(__parser_type);
+  if (PyModule_AddObject(m, "Parser", (PyObject*)__parser_type) != 0) {
+    Py_DECREF(__parser_type);
+    Py_DECREF(m);
+    return NULL;
+  }
+  if (__rgd_parser_type == nullptr) {
+    __rgd_parser_type = (PyTypeObject*)PyType_FromSpec(&RGDParserSpec);
+    if (__rgd_parser_type == nullptr) {
+      Py_DECREF(m);
+      return NULL;
+    }
+  }
+  Py_INCREF(__rgd_parser_type);
+  if (PyModule_AddObject(m, "RGDParser", (PyObject*)__rgd_parser_type) != 0) {
+    Py_DECREF(__rgd_parser_type);
+    Py_DECREF(m);
+    return NULL;
+  }
+  if (__shm_buffer_type == nullptr) {
+    __shm_buffer_type = (PyTypeObject*)PyType_FromSpec(&ShmBufferSpec);
+    if (__shm_buffer_type == nullptr) {
+      Py_DECREF(m);
+      return NULL;
+    }
+  }
+  // the status of RGDParser.solve_task
+  PyModule_AddIntConstant(m, "SOLVER_SAT", rgd::SOLVER_SAT);
+  PyModule_AddIntConstant(m, "SOLVER_UNSAT", rgd::SOLVER_UNSAT);
+  PyModule_AddIntConstant(m, "SOLVER_TIMEOUT", rgd::SOLVER_TIMEOUT);
+  PyModule_AddIntConstant(m, "SOLVER_ERROR", rgd::SOLVER_ERROR);
+  PyModule_AddStringConstant(m, "LABEL_INFO_FORMAT", kLabelInfoFormat);
+  PyModule_AddStringConstant(m, "LABEL_OPERANDS_FORMAT", kLabelOperandsFormat);
+  PyModule_AddStringConstant(m, "PIPE_MSG_FORMAT", kPipeMsgFormat);
+  // bits of the drain handler_mask
+  PyModule_AddIntConstant(m, "COND", 1 << cond_type);
+  PyModule_AddIntConstant(m, "GEP", 1 << gep_type);
+  PyModule_AddIntConstant(m, "MEMCMP", 1 << memcmp_type);
+  return m;
 }
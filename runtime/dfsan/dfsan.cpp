@@ -26,11 +26,22 @@
 #include "sanitizer_common/sanitizer_libc.h"
 #include "sanitizer_common/sanitizer_mutex.h"
 #include "sanitizer_common/sanitizer_posix.h"
+#include "sanitizer_common/sanitizer_procmaps.h"
+#include "sanitizer_common/sanitizer_stacktrace_printer.h"
+#include "sanitizer_common/sanitizer_symbolizer.h"
 
 #include "dfsan.h"
+#include "dfsan_stats.h"
+#include "snapshot.h"
+#include "label_dump.h"
+#include "lazy_shadow.h"
+#include "sparse_shadow.h"
 #include "taint_allocator.h"
+#include "taint_profile.h"
 #include "union_util.h"
 #include "union_hashtable.h"
+#include "union_simd.h"
+#include "probes.h"
 
 #include <assert.h>
 #include <arpa/inet.h>
@@ -44,22 +55,40 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 using namespace __dfsan;
 
 typedef atomic_uint32_t atomic_dfsan_label;
 
+// the end of the label blocks reserved by the threads
 static atomic_dfsan_label __dfsan_last_label;
+// the highest label handed out, what the dumps and scans of the table go
+// up to; the blocks of the threads may have unused tails above it
+static atomic_dfsan_label __dfsan_used_label;
 static dfsan_label_info *__dfsan_label_info;
+static dfsan_label_operands *__dfsan_label_operands;
 
-// FIXME: single thread
-// statck bottom
+// __taint_union_store memo: label -> first of its consecutive byte extracts,
+// packed as (label << 32 | first) so racing threads never see a torn entry
+static const uptr kExtractCacheSize = 4096;
+static atomic_uint64_t __extract_cache[kExtractCacheSize];
+
+// Bounds labels of allocas grow down from __alloca_stack_bottom. Each thread
+// reserves its own window of them on first use, below the windows of the
+// threads before it; __alloca_stack_floor is the lowest label reserved so far
+static const dfsan_label kThreadAllocaLabels = 1 << 16;
 static dfsan_label __alloca_stack_bottom;
-static dfsan_label __alloca_stack_top;
-static const int MAX_SAVED_STACK_ENTRIES = 1024;
-static dfsan_label __saved_alloca_stack_top[MAX_SAVED_STACK_ENTRIES];
-static int __current_saved_stack_index = 0;
+static atomic_dfsan_label __alloca_stack_floor;
+static THREADLOCAL dfsan_label __alloca_stack_top;
+static THREADLOCAL dfsan_label __alloca_stack_limit;
+// __alloca_stack_top at the entry of the active frames, per thread, grown
+// on demand so deep recursion keeps the bounds labels balanced
+static const uptr kInitialSavedStackEntries = 1024;
+static THREADLOCAL dfsan_label *__saved_alloca_stack_top;
+static THREADLOCAL uptr __saved_stack_capacity;
+static THREADLOCAL uptr __saved_stack_depth;
 
 // taint source
 struct taint_file __dfsan::tainted;
@@ -67,8 +96,13 @@ struct taint_socket __dfsan::tainted_socket;
 
 // Hash table
 static const uptr hashtable_size = (1ULL << 32);
-static const size_t hashtable_buckets = (1ULL << 20);
-static __taint::union_hashtable __union_table(hashtable_buckets);
+// 64-byte buckets with 8 slots each, 256MB of the hash table region,
+// can be overridden with the hashtable_buckets flag
+static const size_t hashtable_buckets = (1ULL << 22);
+static __taint::union_hashtable __union_table;
+
+// size of the union table in use, from the union_table_size flag
+static uptr __union_table_size = uniontable_size;
 
 Flags __dfsan::flags_data;
 bool print_debug;
@@ -85,6 +119,16 @@ SANITIZER_INTERFACE_ATTRIBUTE THREADLOCAL uint64_t
 
 SANITIZER_INTERFACE_ATTRIBUTE uptr __dfsan_shadow_ptr_mask;
 
+// per-site hit counters of -taint-trace-budget, indexed by the low 16 bits
+// of the site id (must match kTraceBudgetBits in the pass)
+SANITIZER_INTERFACE_ATTRIBUTE uint8_t __taint_trace_budget[1 << 16];
+
+// the bounds of the labels, see label_bounds; one entry for every possible
+// label, kInitializingLabel included, so the pass indexes it unchecked;
+// null without trace_bounds, the pass skips the checks then
+SANITIZER_INTERFACE_ATTRIBUTE label_bounds *__taint_bounds;
+static const uptr kBoundsTableEntries = 1ULL << 32;
+
 // On Linux/x86_64, memory is laid out as follows:
 //
 // +--------------------+ 0x800000000000 (top of memory)
@@ -116,7 +160,11 @@ int __dfsan::vmaSize;
 #endif
 
 static uptr UnusedAddr() {
-  return MappingArchImpl<MAPPING_UNION_TABLE_ADDR>() + uniontable_size;
+  return MappingArchImpl<MAPPING_UNION_TABLE_ADDR>() + __union_table_size;
+}
+
+uptr __dfsan::union_table_size() {
+  return __union_table_size;
 }
 
 // Checks we do not run out of labels.
@@ -124,12 +172,110 @@ static void dfsan_check_label(dfsan_label label) {
   if (label == kInitializingLabel) {
     Report("FATAL: Taint: out of labels\n");
     Die();
-  } else if (label >= __alloca_stack_top) {
+  } else if (label >= atomic_load(&__alloca_stack_floor, memory_order_relaxed)) {
     Report("FATAL: Exhausted labels\n");
     Die();
   }
 }
 
+// Labels are handed out from per-thread blocks, so threads don't bounce the
+// cache line of __dfsan_last_label. A thread takes a fresh block, which is
+// above every label allocated so far, when its block is used up, when the
+// labels have been reset (new epoch), or when an operand is not below the
+// next label of the block; the unused tail of the old one goes back if it's
+// still the last block reserved. __dfsan_used_label is the real high-water
+// mark, the blocks of other threads may still be partly unused.
+static const dfsan_label kLabelBlockSize = 4096;
+static atomic_uint32_t __label_epoch;
+static THREADLOCAL dfsan_label __tls_next_label;
+static THREADLOCAL dfsan_label __tls_end_label;
+static THREADLOCAL u32 __tls_label_epoch;
+
+// raises the high-water mark to last; only the thread with the highest
+// block gets past the load
+static ALWAYS_INLINE void note_labels_used(dfsan_label last) {
+  dfsan_label used = atomic_load(&__dfsan_used_label, memory_order_relaxed);
+  while (last > used &&
+         !atomic_compare_exchange_weak(&__dfsan_used_label, &used, last,
+                                       memory_order_relaxed)) {
+  }
+}
+
+// a fresh block of size labels for the thread, handing the unused tail of
+// its current one (above keep) back if no block was reserved past it
+static dfsan_label take_label_block(uptr size, u32 epoch, dfsan_label keep) {
+  if (__tls_label_epoch == epoch && __tls_next_label < __tls_end_label) {
+    dfsan_label end = __tls_end_label - 1;
+    dfsan_label tail = Max<dfsan_label>(__tls_next_label - 1, keep);
+    if (tail < end)
+      atomic_compare_exchange_strong(&__dfsan_last_label, &end, tail,
+                                     memory_order_relaxed);
+  }
+  dfsan_label first =
+    atomic_fetch_add(&__dfsan_last_label, size, memory_order_relaxed) + 1;
+  __tls_next_label = first;
+  __tls_end_label = first + size;
+  __tls_label_epoch = epoch;
+  return first;
+}
+
+static dfsan_label dfsan_alloc_label(dfsan_label l1, dfsan_label l2) {
+  u32 epoch = atomic_load(&__label_epoch, memory_order_relaxed);
+  if (UNLIKELY(__tls_next_label >= __tls_end_label ||
+               __tls_label_epoch != epoch ||
+               __tls_next_label <= Max(l1, l2))) {
+    dfsan_check_label(take_label_block(kLabelBlockSize, epoch, Max(l1, l2)));
+  }
+  dfsan_label label = __tls_next_label++;
+  dfsan_check_label(label);
+  note_labels_used(label);
+  return label;
+}
+
+// n consecutive labels, from the thread's block if they fit
+static dfsan_label dfsan_alloc_labels(uptr n) {
+  u32 epoch = atomic_load(&__label_epoch, memory_order_relaxed);
+  if (UNLIKELY((uptr)__tls_next_label + n > __tls_end_label ||
+               __tls_label_epoch != epoch)) {
+    uptr size = Max<uptr>(n, kLabelBlockSize);
+    dfsan_check_label(take_label_block(size, epoch, 0) + size - 1);
+  }
+  dfsan_label label = __tls_next_label;
+  __tls_next_label += n;
+  note_labels_used(label + n - 1);
+  return label;
+}
+
+// Approximate AST size (nodes, shared subtrees counted each time they're
+// used) and depth of each label, minus one, only kept with the max_ast_size
+// or max_ast_depth flags. The entries of leaves (inputs, bounds, and loads)
+// are never read, so only union_impl writes them.
+struct ast_info {
+  u16 nodes;
+  u16 depth;
+};
+static ast_info *__ast_info;
+static uptr __max_ast_size;
+static uptr __max_ast_depth;
+
+static void InitializeAstInfo(uptr num_labels) {
+  __max_ast_size = flags().max_ast_size;
+  __max_ast_depth = flags().max_ast_depth;
+  if (__max_ast_size == 0 && __max_ast_depth == 0)
+    return;
+  __ast_info = (ast_info *)MmapNoReserveOrDie(num_labels * sizeof(ast_info),
+                                               "ast info");
+}
+
+// adds the AST of operand l to the nodes and depth of its parent
+static ALWAYS_INLINE void ast_add_child(dfsan_label l, u32 *nodes, u32 *depth) {
+  if (l < CONST_OFFSET) return;
+  u16 op = get_label_info(l)->op;
+  bool leaf = op == 0 || op == __dfsan::Load || op == __dfsan::Alloca;
+  *nodes += leaf ? 1 : __ast_info[l].nodes + 1;
+  *depth = Max<u32>(*depth, leaf ? 1 : __ast_info[l].depth + 1);
+}
+
 // based on https://github.com/Cyan4973/xxHash
 // simplified since we only have 12 bytes info
 static inline uint32_t xxhash(uint32_t h1, uint32_t h2, uint32_t h3) {
@@ -162,6 +308,28 @@ dfsan_label_info* __dfsan::get_label_info(dfsan_label label) {
   return &__dfsan_label_info[label];
 }
 
+dfsan_label_operands* __dfsan::get_label_operands(dfsan_label label) {
+  return &__dfsan_label_operands[label];
+}
+
+void __dfsan::set_label_bounds(dfsan_label label, uptr lower, uptr upper) {
+  if (__taint_bounds) {
+    __taint_bounds[label].lower = lower;
+    __taint_bounds[label].upper = upper;
+  }
+}
+
+static void InitializeBounds() {
+  if (!flags().trace_bounds)
+    return;
+  __taint_bounds = (label_bounds *)MmapNoReserveOrDie(
+      kBoundsTableEntries * sizeof(label_bounds), "bounds table");
+  // an untainted pointer only has to be non-null, an uninitialized one is
+  // never in bounds
+  set_label_bounds(CONST_LABEL, 1, ~(uptr)0);
+  set_label_bounds(kInitializingLabel, ~(uptr)0, 0);
+}
+
 static inline bool is_constant_label(dfsan_label label) {
   return label == CONST_LABEL;
 }
@@ -179,11 +347,195 @@ static inline bool is_valid_op(uint16_t op) {
 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 dfsan_label __taint_union(dfsan_label l1, dfsan_label l2, uint16_t op, uint16_t size,
-                          uint64_t op1, uint64_t op2) {
-  if (!is_valid_op(op)) {
-    AOUT("WARNING: invalid op %d\n", op);
+                          uint64_t op1, uint64_t op2);
+
+static inline uint64_t low_mask(uint16_t bits) {
+  return bits >= 64 ? ~0ULL : ((uint64_t)1 << bits) - 1;
+}
+
+// Try to express bits [off, off + width) of label l without a new Extract
+// over l, by looking through extracts, concats, zero extensions and loads.
+// Returns false if nothing can be folded, otherwise *res is the result
+// (0 if the bits are concrete).
+static bool fold_extract(dfsan_label l, uint64_t off, uint16_t width,
+                         dfsan_label *res) {
+  dfsan_label_info *x = get_label_info(l);
+  if (off == 0 && width == x->size) {
+    *res = l;
+    return true;
+  }
+  switch (x->op) {
+    case __dfsan::Extract:
+      *res = __taint_union(x->l1, CONST_LABEL, __dfsan::Extract, width, 0,
+                           get_label_operands(l)->op2.i + off);
+      return true;
+    case __dfsan::Concat: {
+      // l1 holds the low bits, either operand may be a concrete piece
+      uint16_t low = x->l1 ? get_label_info(x->l1)->size
+                           : x->size - get_label_info(x->l2)->size;
+      if (off + width <= low) {
+        *res = x->l1 ? __taint_union(x->l1, CONST_LABEL, __dfsan::Extract,
+                                     width, 0, off)
+                     : CONST_LABEL;
+        return true;
+      } else if (off >= low) {
+        *res = x->l2 ? __taint_union(x->l2, CONST_LABEL, __dfsan::Extract,
+                                     width, 0, off - low)
+                     : CONST_LABEL;
+        return true;
+      }
+      return false;
+    }
+    case __dfsan::ZExt: {
+      uint16_t inner = get_label_info(x->l1)->size;
+      if (off + width <= inner) {
+        *res = __taint_union(x->l1, CONST_LABEL, __dfsan::Extract, width, 0, off);
+        return true;
+      } else if (off >= inner) {
+        *res = CONST_LABEL; // the zero extension
+        return true;
+      }
+      return false;
+    }
+    case __dfsan::Load:
+      // l1 is the first of l2 consecutive input bytes
+      if (off % 8 || width % 8)
+        return false;
+      *res = width == 8 ? x->l1 + (dfsan_label)(off / 8)
+                        : __taint_union(x->l1 + (dfsan_label)(off / 8),
+                                        (dfsan_label)(width / 8),
+                                        __dfsan::Load, width, 0, 0);
+      return true;
+  }
+  return false;
+}
+
+// the input byte added up by term l of a sum of size bits, as is or
+// zero-extended, 0 if it isn't one
+static dfsan_label sum_term(dfsan_label l, uint16_t size) {
+  dfsan_label_info *info = get_label_info(l);
+  if (info->op == __dfsan::ZExt) {
+    l = info->l1;
+    if (l < CONST_OFFSET) return 0;
+    info = get_label_info(l);
+  } else if (size != 8) {
     return 0;
   }
+  return info->op == 0 ? l : 0;
+}
+
+// sum + zext(b) where sum adds up the input bytes right before b, as a loop
+// over the input accumulates them, is one fsum over all the bytes rather
+// than a chain of an Add per iteration, which the parsers would reject
+// once it outgrows their AST size limit
+static bool fold_sum(dfsan_label l1, dfsan_label l2, uint16_t size,
+                     dfsan_label *res) {
+  for (int i = 0; i < 2; i++, Swap(l1, l2)) {
+    dfsan_label b = sum_term(l2, size);
+    if (!b) continue;
+    dfsan_label first = sum_term(l1, size);
+    uptr n = 1;
+    dfsan_label_info *x = get_label_info(l1);
+    if (!first && x->op == __dfsan::fsum && x->size == size) {
+      dfsan_label_info *src = get_label_info(x->l2);
+      first = src->op == __dfsan::Load ? src->l1 : x->l2;
+      n = src->op == __dfsan::Load ? src->l2 : 1;
+    }
+    if (!first || n >= FSUM_MAX_BYTES) continue;
+    dfsan_label_operands *f = get_label_operands(first);
+    dfsan_label_operands *o = get_label_operands(b);
+    if (o->op2.i != f->op2.i || o->op1.i != f->op1.i + n) continue;
+    dfsan_label src = __taint_union(first, (dfsan_label)(n + 1), __dfsan::Load,
+                                    (n + 1) * 8, 0, 0);
+    *res = __taint_union(CONST_LABEL, src, __dfsan::fsum, size, 0, 0);
+    return true;
+  }
+  return false;
+}
+
+// Algebraic rewrites applied before the dedup lookup, so the parsers see
+// smaller ASTs. Returns false if the operation has to be recorded as is.
+static bool fold_union(dfsan_label l1, dfsan_label l2, uint16_t op,
+                       uint16_t size, uint64_t op1, uint64_t op2,
+                       dfsan_label *res) {
+  if (l1 == l2 && l1 >= CONST_OFFSET) {
+    switch (op) {
+      case __dfsan::And: // x & x = x
+      case __dfsan::Or:  // x | x = x
+        *res = l1;
+        return true;
+      case __dfsan::Xor: // x ^ x = 0
+      case __dfsan::Sub: // x - x = 0
+        *res = CONST_LABEL;
+        return true;
+    }
+  }
+  // constants of commutative ops are in op1 after the swap
+  if (l1 == CONST_LABEL && l2 >= CONST_OFFSET) {
+    dfsan_label_info *x = get_label_info(l2);
+    if (op == __dfsan::Mul && op1 == 1) { // 1 * x = x
+      *res = l2;
+      return true;
+    }
+    if (op == __dfsan::And && x->op == __dfsan::ZExt) {
+      // the mask keeps all bits the zero extended value can have
+      uint64_t mask = low_mask(get_label_info(x->l1)->size);
+      if ((op1 & mask) == mask) {
+        *res = l2;
+        return true;
+      }
+    }
+  }
+  if (l2 == CONST_LABEL && l1 >= CONST_OFFSET && op2 == 1 &&
+      (op == __dfsan::UDiv || op == __dfsan::SDiv)) { // x / 1 = x
+    *res = l1;
+    return true;
+  }
+  if (l1 < CONST_OFFSET)
+    return false;
+  if (op == __dfsan::Add && l2 >= CONST_OFFSET && flags().summarize_sums &&
+      fold_sum(l1, l2, size, res))
+    return true;
+
+  dfsan_label_info *x = get_label_info(l1);
+  switch (op) {
+    case __dfsan::ZExt:
+    case __dfsan::SExt:
+      // zext(zext(y)) = zext(y), sext(sext(y)) = sext(y), sext(zext(y)) = zext(y)
+      if (x->op == __dfsan::ZExt || (x->op == __dfsan::SExt && op == __dfsan::SExt)) {
+        *res = __taint_union(x->l1, CONST_LABEL, x->op, size, 0, 0);
+        return true;
+      }
+      return false;
+    case __dfsan::Trunc:
+      if (x->op == __dfsan::ZExt || x->op == __dfsan::SExt) {
+        dfsan_label base = x->l1;
+        uint16_t base_size = get_label_info(base)->size;
+        if (size == base_size)
+          *res = base;
+        else if (size < base_size) // trunc(ext(y)) = trunc(y)
+          *res = __taint_union(base, CONST_LABEL, __dfsan::Trunc, size, 0, 0);
+        else // trunc(ext(y)) = ext(y) to a smaller size
+          *res = __taint_union(base, CONST_LABEL, x->op, size, 0, 0);
+        return true;
+      } else if (x->op == __dfsan::Trunc) { // trunc(trunc(y)) = trunc(y)
+        *res = __taint_union(x->l1, CONST_LABEL, __dfsan::Trunc, size, 0, 0);
+        return true;
+      } else if (x->op == __dfsan::Concat || x->op == __dfsan::Load) {
+        return fold_extract(l1, 0, size, res);
+      }
+      return false;
+    case __dfsan::Extract:
+      return fold_extract(l1, op2, size, res);
+  }
+  return false;
+}
+
+// The union of a valid op, inlined into the entry points below. With a
+// constant op most of the op checks fold away.
+static ALWAYS_INLINE dfsan_label union_impl(dfsan_label l1, dfsan_label l2,
+                                            uint16_t op, uint16_t size,
+                                            uint64_t op1, uint64_t op2) {
   if (l1 > l2 && is_commutative(op)) {
     // needs to swap both labels and concretes
     Swap(l1, l2);
@@ -206,7 +558,7 @@ dfsan_label __taint_union(dfsan_label l1, dfsan_label l2, uint16_t op, uint16_t
   }
 
   // special handling for bounds, which may use all four fields
-  // fatoi also uses both concrete operand fields
+  // fatoi and fstrlen also use both concrete operand fields
   // record icmp and fmemcmp operands as well
   if (op == __dfsan::fmemcmp) {
     // XXX: hacky, but maybe good enough for i2s inference
@@ -214,7 +566,8 @@ dfsan_label __taint_union(dfsan_label l1, dfsan_label l2, uint16_t op, uint16_t
     uint16_t len = size > 8 ? 8 : size; // for fmemcmp, size is in bytes, not bits
     if (l1 >= CONST_OFFSET) internal_memcpy(&op1, (void*)op1, len);
     if (l2 >= CONST_OFFSET) internal_memcpy(&op2, (void*)op2, len);
-  } else if (op != __dfsan::Alloca && (op & 0xff) != __dfsan::ICmp && op != __dfsan::fatoi) {
+  } else if (op != __dfsan::Alloca && (op & 0xff) != __dfsan::ICmp &&
+             op != __dfsan::fatoi && op != __dfsan::fstrlen) {
     if (l1 >= CONST_OFFSET) op1 = 0;
     if (l2 >= CONST_OFFSET) op2 = 0;
   }
@@ -245,12 +598,28 @@ dfsan_label __taint_union(dfsan_label l1, dfsan_label l2, uint16_t op, uint16_t
     else if (op == __dfsan::LShr) return l1; // x >> 0 = x
     else if (op == __dfsan::AShr) return l1; // x >> 0 = x
   }
-  if (op == __dfsan::Trunc) {
-    if (__dfsan_label_info[l1].op == __dfsan::ZExt ||
-        __dfsan_label_info[l1].op == __dfsan::SExt) {
-      dfsan_label base = __dfsan_label_info[l1].l1;
-      if (size == __dfsan_label_info[base].size) return base;
+  dfsan_label folded;
+  if (fold_union(l1, l2, op, size, op1, op2, &folded)) {
+    AOUT("folded (%u, %u, %u, %u) to %u\n", l1, l2, op, size, folded);
+    return folded;
+  }
+
+  // expressions past the caps, e.g., hashes and checksums over the input,
+  // are concretized where they start growing, like the parser would do with
+  // them later; comparisons are kept, the parser concretizes their sides
+  ast_info ast = {0, 0};
+  if (UNLIKELY(__ast_info) && op != __dfsan::Load) {
+    u32 nodes = 0, depth = 0;
+    ast_add_child(l1, &nodes, &depth);
+    ast_add_child(l2, &nodes, &depth);
+    if ((op & 0xff) != __dfsan::ICmp && op != __dfsan::fmemcmp &&
+        ((__max_ast_size && nodes + 1 > __max_ast_size) ||
+         (__max_ast_depth && depth + 1 > __max_ast_depth))) {
+      stat_inc(kStat_union_capped);
+      return 0;
     }
+    ast.nodes = Min<u32>(nodes, 0xffff);
+    ast.depth = Min<u32>(depth, 0xffff);
   }
 
   // setup a hash tree for dedup
@@ -261,33 +630,76 @@ dfsan_label __taint_union(dfsan_label l1, dfsan_label l2, uint16_t op, uint16_t
   uint32_t hash = xxhash(h1, h2, h3);
 
   struct dfsan_label_info label_info = {
-    .l1 = l1, .l2 = l2, .op1 = op1, .op2 = op2, .op = op, .size = size,
-    .hash = hash};
+    .l1 = l1, .l2 = l2, .op = op, .size = size, .hash = hash};
+  struct dfsan_label_operands label_operands = {.op1 = op1, .op2 = op2};
 
-  __taint::option res = __union_table.lookup(label_info);
+  __taint::option res = __union_table.lookup(label_info, label_operands);
   if (res != __taint::none()) {
     dfsan_label label = *res;
     AOUT("%u found\n", label);
+    stat_inc(kStat_union_hits);
+    SYMSAN_PROBE3(union_hit, label, op, size);
     return label;
   }
   // for debugging
   dfsan_label l = atomic_load(&__dfsan_last_label, memory_order_relaxed);
   // assert(l1 <= l && l2 <= l);
 
-  dfsan_label label =
-    atomic_fetch_add(&__dfsan_last_label, 1, memory_order_relaxed) + 1;
-  dfsan_check_label(label);
+  dfsan_label label = dfsan_alloc_label(l1, l2);
   assert(label > l1 && label > l2);
+  stat_inc(kStat_union_new);
+  stat_new_label(op);
+  SYMSAN_PROBE5(union_new, label, l1, l2, op, size);
 
   AOUT("%u = (%u, %u, %u, %u, %llu, %llu)\n", label, l1, l2, op, size, op1, op2);
 
+  __dfsan_label_operands[label] = label_operands;
   internal_memcpy(&__dfsan_label_info[label], &label_info, sizeof(dfsan_label_info));
+  if (UNLIKELY(__ast_info)) __ast_info[label] = ast;
+  if (op == __dfsan::Alloca) set_label_bounds(label, op1, op2);
   __union_table.insert(&__dfsan_label_info[label], label);
   return label;
 }
 
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+dfsan_label __taint_union(dfsan_label l1, dfsan_label l2, uint16_t op, uint16_t size,
+                          uint64_t op1, uint64_t op2) {
+  stat_inc(kStat_union_calls);
+  profile_pc(GET_CALLER_PC());
+  if (!is_valid_op(op)) {
+    AOUT("WARNING: invalid op %d\n", op);
+    return 0;
+  }
+  return union_impl(l1, l2, op, size, op1, op2);
+}
+
+// __taint_union_<opcode> for every binary and cast instruction, the pass calls
+// these instead of __taint_union when the op is known at compile time
+#define DFSAN_UNION_OP(num, opcode, Class)                                    \
+  extern "C" SANITIZER_INTERFACE_ATTRIBUTE dfsan_label                        \
+  __taint_union_##opcode(dfsan_label l1, dfsan_label l2, uint16_t size,       \
+                         uint64_t op1, uint64_t op2) {                        \
+    stat_inc(kStat_union_calls);                                              \
+    profile_pc(GET_CALLER_PC());                                              \
+    return union_impl(l1, l2, __dfsan::opcode, size, op1, op2);               \
+  }
+#define HANDLE_BINARY_INST(num, opcode, Class) DFSAN_UNION_OP(num, opcode, Class)
+#define HANDLE_CAST_INST(num, opcode, Class) DFSAN_UNION_OP(num, opcode, Class)
+#include "llvm/IR/Instruction.def"
+#undef HANDLE_BINARY_INST
+#undef HANDLE_CAST_INST
+#undef DFSAN_UNION_OP
+
+// loads larger than this scan the shadow for the shape of a read first
+static const uptr kVectorLoadBytes = 16;
+
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 dfsan_label __taint_union_load(const dfsan_label *ls, uptr n) {
+  if (shadow_is_clean(ls, n)) {
+    stat_inc(kStat_load_fast_const);
+    return CONST_LABEL;
+  }
+  profile_pc(GET_CALLER_PC());
   dfsan_label label0 = ls[0];
   if (label0 == kInitializingLabel) return kInitializingLabel;
 
@@ -298,6 +710,10 @@ dfsan_label __taint_union_load(const dfsan_label *ls, uptr n) {
 
   // fast path 1: constant and bounds
   if (is_constant_label(label0) || is_kind_of_label(label0, Alloca)) {
+    if (__taint::labels_match(ls, n, label0, 0)) {
+      stat_inc(kStat_load_fast_const);
+      return label0;
+    }
     bool same = true;
     for (uptr i = 1; i < n; i++) {
       if (ls[i] == kInitializingLabel) return kInitializingLabel;
@@ -306,7 +722,10 @@ dfsan_label __taint_union_load(const dfsan_label *ls, uptr n) {
         break;
       }
     }
-    if (same) return label0;
+    if (same) {
+      stat_inc(kStat_load_fast_const);
+      return label0;
+    }
   }
   AOUT("label0 = %d, n = %d, ls = %p\n", label0, n, ls);
 
@@ -315,18 +734,31 @@ dfsan_label __taint_union_load(const dfsan_label *ls, uptr n) {
   if (__dfsan_label_info[label0].op != 0) {
     // not raw input bytes
     shape = false;
+  } else if (n > kVectorLoadBytes && __taint::labels_match(ls, n, label0, 1)) {
+    // the labels of a read are usually consecutive, so large loads (from
+    // the libc wrappers) check the shadow with one vector scan and then
+    // walk the operands in order, rather than through each shadow label
+    const dfsan_label_operands *ops = get_label_operands(label0);
+    off_t offset = ops[0].op1.i;
+    for (uptr i = 1; i != n; ++i) {
+      if (ops[i].op1.i != offset + i) {
+        shape = false;
+        break;
+      }
+    }
   } else {
-    off_t offset = get_label_info(label0)->op1.i;
+    off_t offset = get_label_operands(label0)->op1.i;
     for (uptr i = 1; i != n; ++i) {
       dfsan_label next_label = ls[i];
       if (next_label == kInitializingLabel) return kInitializingLabel;
-      else if (get_label_info(next_label)->op1.i != offset + i) {
+      else if (get_label_operands(next_label)->op1.i != offset + i) {
         shape = false;
         break;
       }
     }
   }
   if (shape) {
+    stat_inc(kStat_load_fast_shape);
     if (n == 1) return label0;
 
     AOUT("shape: label0: %d %d\n", label0, n);
@@ -341,19 +773,22 @@ dfsan_label __taint_union_load(const dfsan_label *ls, uptr n) {
       dfsan_label next_label = ls[i];
       if (next_label == kInitializingLabel) return kInitializingLabel;
       dfsan_label_info *info = get_label_info(next_label);
-      if (info->op != Extract || offset != info->op2.i || parent != info->l1) {
+      if (info->op != Extract || parent != info->l1 ||
+          offset != get_label_operands(next_label)->op2.i) {
         break;
       }
       offset += info->size;
     }
     if (get_label_info(parent)->size == offset && offset == n * 8) {
       AOUT("Fast path (2): all labels are extracts: %u\n", parent);
+      stat_inc(kStat_load_fast_extract);
       return parent;
     }
   }
 
   // slowpath
   AOUT("union load slowpath at %p\n", __builtin_return_address(0));
+  stat_inc(kStat_load_slow);
   dfsan_label label = label0;
   for (uptr i = get_label_info(label0)->size / 8; i < n;) {
     dfsan_label next_label = ls[i];
@@ -381,29 +816,62 @@ dfsan_label __taint_union_load(const dfsan_label *ls, uptr n) {
   return label;
 }
 
+// the entry of 2-, 4- and 8-byte loads, where the pass already compared the
+// shadow to first, first + 1, ...; first is 0 when it isn't. Consecutive
+// labels are almost always those of consecutive bytes of one input, which
+// only takes a check of their operands rather than the generic scan
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+dfsan_label __taint_union_load_shape(dfsan_label first, const dfsan_label *ls,
+                                     uptr n) {
+  dfsan_label last = first + n - 1;
+  if (first < CONST_OFFSET || last < first || last == kInitializingLabel ||
+      __dfsan_label_info[first].op != 0) {
+    return __taint_union_load(ls, n);
+  }
+  const dfsan_label_operands *ops = get_label_operands(first);
+  for (uptr i = 1; i < n; i++) {
+    if (__dfsan_label_info[first + i].op != 0 ||
+        ops[i].op1.i != ops[0].op1.i + (off_t)i ||
+        ops[i].op2.i != ops[0].op2.i) {
+      return __taint_union_load(ls, n);
+    }
+  }
+  stat_inc(kStat_load_inline_shape);
+  profile_pc(GET_CALLER_PC());
+  return union_impl(first, (dfsan_label)n, Load, n * 8, 0, 0);
+}
+
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void __taint_union_store(dfsan_label l, dfsan_label *ls, uptr n) {
   //AOUT("label = %d, n = %d, ls = %p\n", l, n, ls);
+  if (l == CONST_LABEL) {
+    stat_inc(kStat_store_fast_const);
+    clear_shadow(ls, n);
+    return;
+  }
+  profile_pc(GET_CALLER_PC());
+  shadow_mark_dirty(ls, n);
   if (l != kInitializingLabel) {
     // for debugging
-    dfsan_label h = atomic_load(&__dfsan_last_label, memory_order_relaxed);
-    assert(l <= h || l >= __alloca_stack_top);
+    dfsan_label h = atomic_load(&__dfsan_used_label, memory_order_relaxed);
+    assert(l <= h || l >= atomic_load(&__alloca_stack_floor,
+                                      memory_order_relaxed));
   } else {
-    for (uptr i = 0; i < n; ++i)
-      ls[i] = l;
+    __taint::labels_fill(ls, n, l, 0);
     return;
   }
 
   // fast path 1: constant and bounds
   if (l == 0 || is_kind_of_label(l, Alloca)) {
-    for (uptr i = 0; i < n; ++i)
-      ls[i] = l;
+    stat_inc(kStat_store_fast_const);
+    __taint::labels_fill(ls, n, l, 0);
     return;
   }
 
   dfsan_label_info *info = get_label_info(l);
   // fast path 2: single byte
   if (n == 1 && info->size == 8) {
+    stat_inc(kStat_store_fast_byte);
     ls[0] = l;
     return;
   }
@@ -415,35 +883,127 @@ void __taint_union_store(dfsan_label l, dfsan_label *ls, uptr n) {
     if (n > info->l2) {
       Report("WARNING: store size=%u larger than load size=%d\n", n, info->l2);
     }
-    for (uptr i = 0; i < n; ++i)
-      ls[i] = label0 + i;
+    stat_inc(kStat_store_fast_load);
+    __taint::labels_fill(ls, n, label0, 1);
     return;
   }
 
+  // fast path 4: the same wide value stored again
+  bool cacheable = info->size == n * 8;
+  atomic_uint64_t *memo = &__extract_cache[l & (kExtractCacheSize - 1)];
+  if (cacheable) {
+    uint64_t e = atomic_load(memo, memory_order_relaxed);
+    if ((dfsan_label)(e >> 32) == l) {
+      stat_inc(kStat_store_fast_memo);
+      __taint::labels_fill(ls, n, (dfsan_label)e, 1);
+      return;
+    }
+  }
+
   // default fall through
+  stat_inc(kStat_store_extract);
   for (uptr i = 0; i < n; ++i) {
     ls[i] = __taint_union(l, CONST_LABEL, Extract, 8, 0, i * 8);
   }
+  if (cacheable && __taint::labels_match(ls, n, ls[0], 1))
+    atomic_store(memo, ((uint64_t)l << 32) | ls[0], memory_order_relaxed);
+}
+
+// with -taint-atomic-shadow, an atomic access runs with its shadow code
+// under the lock of its address, one of a few striped spin locks, so the
+// atomics on a location see each other's labels in the order they happen;
+// other accesses don't take a lock
+static const uptr kAtomicStripeBits = 10;
+static struct alignas(64) {
+  StaticSpinMutex mu;
+} __atomic_stripes[1 << kAtomicStripeBits];
+
+static inline StaticSpinMutex *atomic_stripe(void *addr) {
+  uptr h = ((uptr)addr >> 3) * 0x9e3779b97f4a7c15ULL;
+  return &__atomic_stripes[h >> (64 - kAtomicStripeBits)].mu;
+}
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __taint_atomic_begin(void *addr) {
+  atomic_stripe(addr)->Lock();
+}
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __taint_atomic_end(void *addr) {
+  atomic_stripe(addr)->Unlock();
+}
+
+// shadow side of memcpy/memmove intrinsics with -taint-sparse-shadow
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __taint_copy_shadow(dfsan_label *dst, const dfsan_label *src, uptr n) {
+  copy_shadow(dst, src, n);
+}
+
+static void GrowSavedStack() {
+  uptr capacity = __saved_stack_capacity ? __saved_stack_capacity * 2
+                                         : kInitialSavedStackEntries;
+  dfsan_label *stack = (dfsan_label *)MmapOrDie(capacity * sizeof(dfsan_label),
+                                                "alloca frame stack");
+  if (__saved_alloca_stack_top) {
+    internal_memcpy(stack, __saved_alloca_stack_top,
+                    __saved_stack_depth * sizeof(dfsan_label));
+    UnmapOrDie(__saved_alloca_stack_top,
+               __saved_stack_capacity * sizeof(dfsan_label));
+  }
+  __saved_alloca_stack_top = stack;
+  __saved_stack_capacity = capacity;
+}
+
+void __dfsan::ReleaseThreadFrameStack() {
+  if (__saved_alloca_stack_top)
+    UnmapOrDie(__saved_alloca_stack_top,
+               __saved_stack_capacity * sizeof(dfsan_label));
+  __saved_alloca_stack_top = nullptr;
+  __saved_stack_capacity = __saved_stack_depth = 0;
+}
+
+static void ReserveAllocaLabels() {
+  dfsan_label floor = atomic_fetch_sub(&__alloca_stack_floor,
+                                       kThreadAllocaLabels,
+                                       memory_order_relaxed);
+  if (floor <= kThreadAllocaLabels ||
+      floor - kThreadAllocaLabels <=
+          atomic_load(&__dfsan_last_label, memory_order_relaxed)) {
+    Report("FATAL: Exhausted labels\n");
+    Die();
+  }
+  __alloca_stack_top = floor;
+  __alloca_stack_limit = floor - kThreadAllocaLabels;
 }
 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void __taint_push_stack_frame() {
   if (flags().trace_bounds) {
-    if (__current_saved_stack_index < MAX_SAVED_STACK_ENTRIES)
-      __saved_alloca_stack_top[++__current_saved_stack_index] = __alloca_stack_top;
+    if (UNLIKELY(!__alloca_stack_top))
+      ReserveAllocaLabels();
+    if (UNLIKELY(__saved_stack_depth == __saved_stack_capacity))
+      GrowSavedStack();
+    __saved_alloca_stack_top[__saved_stack_depth++] = __alloca_stack_top;
   }
 }
 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void __taint_pop_stack_frame() {
-  if (flags().trace_bounds) {
-    __alloca_stack_top = __saved_alloca_stack_top[__current_saved_stack_index--];
+  // frames entered before trace_bounds took effect have nothing saved
+  if (flags().trace_bounds && LIKELY(__saved_stack_depth)) {
+    __alloca_stack_top = __saved_alloca_stack_top[--__saved_stack_depth];
   }
 }
 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 dfsan_label __taint_trace_alloca(dfsan_label l, uint64_t size, uint64_t elem_size, uint64_t base) {
   if (flags().trace_bounds) {
+    if (UNLIKELY(!__alloca_stack_top))
+      ReserveAllocaLabels();
+    if (UNLIKELY(__alloca_stack_top == __alloca_stack_limit)) {
+      Report("FATAL: Exhausted alloca labels of the thread\n");
+      Die();
+    }
     __alloca_stack_top -= 1;
     AOUT("label = %d, base = %p, size = %lld, elem_size = %lld\n",
         __alloca_stack_top, base, size, elem_size);
@@ -452,8 +1012,10 @@ dfsan_label __taint_trace_alloca(dfsan_label l, uint64_t size, uint64_t elem_siz
     info->l2    = l;
     info->op    = Alloca;
     info->size  = sizeof(void*) * 8;
-    info->op1.i = base;
-    info->op2.i = base + size * elem_size;
+    dfsan_label_operands *ops = get_label_operands(__alloca_stack_top);
+    ops->op1.i = base;
+    ops->op2.i = base + size * elem_size;
+    set_label_bounds(__alloca_stack_top, ops->op1.i, ops->op2.i);
 
     // set uninit label
     dfsan_set_label(kInitializingLabel, (void*)base, size * elem_size);
@@ -473,20 +1035,21 @@ dfsan_label __taint_trace_global(uint64_t addr, uint64_t size) {
     uint32_t hash = xxhash(h1, h2, Alloca);
 
     struct dfsan_label_info label_info = {
-      .l1 = 0, .l2 = 0, .op1 = addr, .op2 = addr + size, .op = Alloca, .size = sizeof(void*) * 8,
-      .hash = hash};
+      .l1 = 0, .l2 = 0, .op = Alloca, .size = sizeof(void*) * 8, .hash = hash};
+    struct dfsan_label_operands label_operands = {.op1 = addr, .op2 = addr + size};
 
-    __taint::option res = __union_table.lookup(label_info);
+    __taint::option res = __union_table.lookup(label_info, label_operands);
     if (res != __taint::none()) {
       dfsan_label label = *res;
       AOUT("global %u found\n", label);
       return label;
     }
 
-    dfsan_label label =
-      atomic_fetch_add(&__dfsan_last_label, 1, memory_order_relaxed) + 1;
-    dfsan_check_label(label);
+    dfsan_label label = dfsan_alloc_label(0, 0);
+    stat_new_label(Alloca);
+    __dfsan_label_operands[label] = label_operands;
     internal_memcpy(&__dfsan_label_info[label], &label_info, sizeof(dfsan_label_info));
+    set_label_bounds(label, addr, addr + size);
     __union_table.insert(&__dfsan_label_info[label], label);
 
     AOUT("adding global bounds %d=(%llx, %lld)\n", label, addr, size);
@@ -505,10 +1068,17 @@ SANITIZER_INTERFACE_WEAK_DEF(void, __taint_trace_memerr, dfsan_label, uptr, dfsa
 // .l2 = (element) size label
 // .op1 = lower bounds
 // .op2 = upper bounds
+// the instrumented code only calls this when the access isn't within the
+// bounds of its label, the custom wrappers always do
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void __taint_check_bounds(dfsan_label addr_label, uptr addr,
                           dfsan_label size_label, uint64_t size) {
   if (flags().trace_bounds) {
+    label_bounds *b = &__taint_bounds[addr_label];
+    if (LIKELY(addr >= b->lower && addr + size <= b->upper &&
+               addr + size >= addr)) {
+      return;
+    }
     void *retaddr = __builtin_return_address(0);
     if (addr == 0) {
       AOUT("WARNING: null ptr deref %p = %d @%p\n", addr, addr_label, retaddr);
@@ -529,13 +1099,14 @@ void __taint_check_bounds(dfsan_label addr_label, uptr addr,
       __taint_trace_memerr(addr_label, addr, size_label, size, F_MEMERR_UAF, retaddr);
       if (flags().exit_on_memerror) Die();
     } else if (info->op == Alloca) {
-      AOUT("addr = %p, lower = %p, upper = %p\n", addr, info->op1.i, info->op2.i);
-      if (addr < info->op1.i) {
+      dfsan_label_operands *bounds = get_label_operands(addr_label);
+      AOUT("addr = %p, lower = %p, upper = %p\n", addr, bounds->op1.i, bounds->op2.i);
+      if (addr < bounds->op1.i) {
         AOUT("ERROR: OOB underflow detected %p = %d, %llu = %d @%p\n",
              addr, addr_label, size, size_label, retaddr);
         __taint_trace_memerr(addr_label, addr, size_label, size, F_MEMERR_OLB, retaddr);
         if (flags().exit_on_memerror) Die();
-      } else if ((addr + size) > info->op2.i || (addr + size) < info->op1.i) {
+      } else if ((addr + size) > bounds->op2.i || (addr + size) < bounds->op1.i) {
         AOUT("ERROR: OOB overflow detected %p = %d, %llu = %d @%p\n",
              addr, addr_label, size, size_label, __builtin_return_address(0));
         __taint_trace_memerr(addr_label, addr, size_label, size, F_MEMERR_OUB, retaddr);
@@ -587,21 +1158,54 @@ dfsan_union(dfsan_label l1, dfsan_label l2, uint16_t op, uint16_t size, uint64_t
 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 dfsan_label dfsan_create_label(off_t offset) {
-  dfsan_label label =
-    atomic_fetch_add(&__dfsan_last_label, 1, memory_order_relaxed) + 1;
-  dfsan_check_label(label);
+  dfsan_label label = dfsan_alloc_label(0, 0);
+  stat_new_label(0);
   internal_memset(&__dfsan_label_info[label], 0, sizeof(dfsan_label_info));
   __dfsan_label_info[label].size = 8;
   // label may not equal to offset when using stdin
-  __dfsan_label_info[label].op1.i = offset;
+  __dfsan_label_operands[label].op1.i = offset;
+  __dfsan_label_operands[label].op2.i = 0;
   // init a non-zero hash
   __dfsan_label_info[label].hash = xxhash(offset, 0, 8);
   return label;
 }
 
+// n input labels for the bytes [offset, offset + n) of input, consecutive
+// so loads over them take the shape fast path
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+dfsan_label dfsan_create_labels(off_t offset, uint32_t input, uptr n) {
+  if (n == 0) return 0;
+  dfsan_label first = dfsan_alloc_labels(n);
+  for (uptr i = 0; i < n; i++) {
+    dfsan_label label = first + i;
+    stat_new_label(0);
+    internal_memset(&__dfsan_label_info[label], 0, sizeof(dfsan_label_info));
+    __dfsan_label_info[label].size = 8;
+    __dfsan_label_operands[label].op1.i = offset + i;
+    __dfsan_label_operands[label].op2.i = input;
+    __dfsan_label_info[label].hash = xxhash(offset + i, input, 8);
+  }
+  return first;
+}
+
+// shadow[i] = first + i for the n bytes at addr
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void dfsan_set_labels(dfsan_label first, void *addr, uptr n) {
+  if (addr == 0 || n == 0) return;
+  dfsan_label *ls = shadow_for(addr);
+  shadow_mark_dirty(ls, n);
+  __taint::labels_fill(ls, n, first, 1);
+}
+
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void __dfsan_set_label(dfsan_label label, void *addr, uptr size) {
   if (addr == 0) return;
+  if (label == 0) {
+    // same idea as below, but a block at a time
+    clear_shadow(shadow_for(addr), size);
+    return;
+  }
+  shadow_mark_dirty(shadow_for(addr), size);
   for (dfsan_label *labelp = shadow_for(addr); size != 0; --size, ++labelp) {
     // Don't write the label if it is already the value we need it to be.
     // In a program where most addresses are not labeled, it is common that
@@ -626,6 +1230,7 @@ void dfsan_set_label(dfsan_label label, void *addr, uptr size) {
 
 SANITIZER_INTERFACE_ATTRIBUTE
 void dfsan_add_label(dfsan_label label, uint8_t op, void *addr, uptr size) {
+  shadow_mark_dirty(shadow_for(addr), size);
   for (dfsan_label *labelp = shadow_for(addr); size != 0; --size, ++labelp)
     *labelp = __taint_union(*labelp, label, op, 1, 0, 0);
 }
@@ -658,6 +1263,17 @@ dfsan_label_info *dfsan_get_label_info(dfsan_label label) {
   return &__dfsan_label_info[label];
 }
 
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+dfsan_label_operands *dfsan_get_label_operands(dfsan_label label) {
+  dfsan_check_label(label);
+  return &__dfsan_label_operands[label];
+}
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+uint32_t dfsan_label_epoch(void) {
+  return atomic_load(&__label_epoch, memory_order_relaxed);
+}
+
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE int
 dfsan_has_label(dfsan_label label, dfsan_label elem) {
   if (label == kInitializingLabel || elem == kInitializingLabel) return false;
@@ -676,23 +1292,125 @@ dfsan_has_label(dfsan_label label, dfsan_label elem) {
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE uptr
 dfsan_get_label_count(void) {
   dfsan_label max_label_allocated =
-      atomic_load(&__dfsan_last_label, memory_order_relaxed);
+      atomic_load(&__dfsan_used_label, memory_order_relaxed);
 
   return static_cast<uptr>(max_label_allocated);
 }
 
+// writes all of buf, WriteToFile may stop short on large buffers
+static bool WriteAll(fd_t fd, const void *buf, uptr size) {
+  const char *p = (const char *)buf;
+  while (size) {
+    uptr written = 0;
+    if (!WriteToFile(fd, p, size, &written) || written == 0)
+      return false;
+    p += written;
+    size -= written;
+  }
+  return true;
+}
+
+static char __dump_zeros[LABEL_DUMP_ALIGN];
+
+static bool DumpPad(fd_t fd, uptr size) {
+  uptr pad = label_dump_align(size) - size;
+  return WriteAll(fd, __dump_zeros, pad);
+}
+
+// buffered writes of the delta stream
+struct DumpWriter {
+  static const uptr kSize = 1 << 20;
+  fd_t fd;
+  u8 *buf;
+  uptr len = 0;
+  uptr total = 0;
+  bool ok = true;
+
+  explicit DumpWriter(fd_t fd) : fd(fd) {
+    buf = (u8 *)MmapOrDie(kSize, "label dump buffer");
+  }
+  ~DumpWriter() { UnmapOrDie(buf, kSize); }
+
+  void flush() {
+    ok = ok && WriteAll(fd, buf, len);
+    total += len;
+    len = 0;
+  }
+  void varint(u64 v) {
+    if (len + 10 > kSize) flush();
+    while (v >= 0x80) {
+      buf[len++] = (u8)v | 0x80;
+      v >>= 7;
+    }
+    buf[len++] = (u8)v;
+  }
+  void u32le(u32 v) {
+    if (len + 4 > kSize) flush();
+    internal_memcpy(buf + len, &v, sizeof(v));
+    len += sizeof(v);
+  }
+};
+
+static inline u64 DeltaOperand(dfsan_label l, dfsan_label operand) {
+  if (operand == 0) return 0;
+  s64 d = (s64)l - (s64)operand;
+  return (((u64)d << 1) ^ (u64)(d >> 63)) + 1;
+}
+
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE void
 dfsan_dump_labels(int fd) {
   dfsan_label last_label =
-      atomic_load(&__dfsan_last_label, memory_order_relaxed);
+      atomic_load(&__dfsan_used_label, memory_order_relaxed);
+  u32 num_labels = (u32)Min<uptr>((uptr)last_label + 1, __union_table_size / 2 /
+                                  sizeof(dfsan_label_info));
+
+  label_dump_header header;
+  internal_memset(&header, 0, sizeof(header));
+  header.magic = LABEL_DUMP_MAGIC;
+  header.version = LABEL_DUMP_VERSION;
+  header.flags = flags().dump_labels_delta ? LABEL_DUMP_DELTA : 0;
+  header.num_labels = num_labels;
+  header.info_size = sizeof(dfsan_label_info);
+  header.operands_size = sizeof(dfsan_label_operands);
+  header.infos_offset = LABEL_DUMP_ALIGN;
+
+  if (!flags().dump_labels_delta) {
+    uptr infos = (uptr)num_labels * sizeof(dfsan_label_info);
+    uptr operands = (uptr)num_labels * sizeof(dfsan_label_operands);
+    header.operands_offset = header.infos_offset + label_dump_align(infos);
+    // straight from the union table, in as few writes as the kernel takes
+    if (!WriteAll(fd, &header, sizeof(header)) ||
+        !DumpPad(fd, sizeof(header)) ||
+        !WriteAll(fd, __dfsan_label_info, infos) || !DumpPad(fd, infos) ||
+        !WriteAll(fd, __dfsan_label_operands, operands)) {
+      Report("WARNING: DataFlowSanitizer: failed to dump labels\n");
+    }
+    return;
+  }
 
-  for (uptr l = 1; l <= last_label; ++l) {
-    char buf[64];
-    internal_snprintf(buf, sizeof(buf), "%u (%u %u %u %u)", l,
-                      __dfsan_label_info[l].l1, __dfsan_label_info[l].l2,
-                      __dfsan_label_info[l].op, __dfsan_label_info[l].size);
-    WriteToFile(fd, buf, internal_strlen(buf));
-    WriteToFile(fd, "\n", 1);
+  // the stream's size is only known at the end, so the header is written
+  // last, over the first page
+  if (!WriteAll(fd, __dump_zeros, LABEL_DUMP_ALIGN)) {
+    Report("WARNING: DataFlowSanitizer: failed to dump labels\n");
+    return;
+  }
+  DumpWriter w(fd);
+  for (dfsan_label l = 1; l < num_labels; ++l) {
+    const dfsan_label_info &info = __dfsan_label_info[l];
+    const dfsan_label_operands &ops = __dfsan_label_operands[l];
+    w.varint(DeltaOperand(l, info.l1));
+    w.varint(DeltaOperand(l, info.l2));
+    w.varint(info.op);
+    w.varint(info.size);
+    w.u32le(info.hash);
+    w.varint(ops.op1.i);
+    w.varint(ops.op2.i);
+  }
+  w.flush();
+  header.operands_offset = header.infos_offset + w.total;
+  if (!w.ok || internal_lseek(fd, 0, SEEK_SET) != 0 ||
+      !WriteAll(fd, &header, sizeof(header))) {
+    Report("WARNING: DataFlowSanitizer: failed to dump labels\n");
   }
 }
 
@@ -702,13 +1420,93 @@ __taint_debug(dfsan_label op1, dfsan_label op2, int predicate,
   if (op1 == 0 && op2 == 0) return;
 }
 
+// Kind of taint source each fd reads from, set when the fd is opened,
+// connected, or accepted, and cleared when it's closed. Lookups are lock-free
+// so concurrent connections of a server can all be traced in one run.
+enum taint_fd_kind {
+  kTaintFdNone = 0,
+  kTaintFdFile,
+  kTaintFdSocket,
+};
+
+static const int kMaxTaintFds = 1 << 16;
+static atomic_uint8_t __taint_fds[kMaxTaintFds];
+// input offset of the next byte received from any tainted socket
+static atomic_uint64_t __socket_offset;
+// with socket_inputs, each tainted connection (or bound datagram socket) is
+// its own input, numbered from 1 in the order they're opened, with its own
+// offsets
+static atomic_uint64_t __socket_offsets[kMaxTaintFds];
+static atomic_uint32_t __socket_inputs[kMaxTaintFds];
+static atomic_uint32_t __num_socket_inputs;
+
+// the files of taint_inputs, input i + 1 is __taint_inputs[i], their labels
+// are preallocated in one block each, right after the taint file's
+static const int kMaxTaintInputs = 16;
+static struct {
+  char filename[PATH_MAX];
+  off_t size;
+  dfsan_label base;
+} __taint_inputs[kMaxTaintInputs];
+static int __num_taint_inputs = 0;
+// input of each fd of kind kTaintFdFile
+static u8 __taint_fd_inputs[kMaxTaintFds];
+// inputs 0 .. __num_static_inputs - 1 are labeled at startup (files, argv
+// and env), sockets are numbered after them
+static u32 __num_static_inputs = 1;
+static int __taint_argc;
+static char **__taint_argv;
+static char **__taint_envp;
+
+static inline u8 get_taint_fd(int fd) {
+  if (fd < 0 || fd >= kMaxTaintFds) return kTaintFdNone;
+  return atomic_load(&__taint_fds[fd], memory_order_acquire);
+}
+
+static inline void set_taint_fd(int fd, u8 kind) {
+  if (fd < 0 || fd >= kMaxTaintFds) {
+    if (kind != kTaintFdNone)
+      Report("WARNING: fd %d is too large to be tracked as taint source\n", fd);
+    return;
+  }
+  atomic_store(&__taint_fds[fd], kind, memory_order_release);
+}
+
+// clears fd only if it still refers to a source of the given kind
+static inline void clear_taint_fd(int fd, u8 kind) {
+  if (fd < 0 || fd >= kMaxTaintFds) return;
+  u8 cmp = kind;
+  atomic_compare_exchange_strong(&__taint_fds[fd], &cmp, (u8)kTaintFdNone,
+                                 memory_order_acq_rel);
+}
+
+static void set_taint_socket(int fd) {
+  set_taint_fd(fd, kTaintFdSocket);
+  if (flags().socket_inputs && fd >= 0 && fd < kMaxTaintFds) {
+    u32 input = atomic_fetch_add(&__num_socket_inputs, 1, memory_order_relaxed) +
+                __num_static_inputs;
+    atomic_store(&__socket_offsets[fd], 0, memory_order_relaxed);
+    atomic_store(&__socket_inputs[fd], input, memory_order_relaxed);
+  }
+}
+
 SANITIZER_INTERFACE_ATTRIBUTE void
 taint_set_file(const char *filename, int fd) {
   char path[PATH_MAX];
   realpath(filename, path);
   if (internal_strcmp(tainted.filename, path) == 0) {
-    tainted.fd = fd;
+    if (fd >= 0 && fd < kMaxTaintFds) __taint_fd_inputs[fd] = 0;
+    set_taint_fd(fd, kTaintFdFile);
     AOUT("fd:%d created\n", fd);
+    return;
+  }
+  for (int i = 0; i < __num_taint_inputs; i++) {
+    if (internal_strcmp(__taint_inputs[i].filename, path) == 0) {
+      if (fd >= 0 && fd < kMaxTaintFds) __taint_fd_inputs[fd] = i + 1;
+      set_taint_fd(fd, kTaintFdFile);
+      AOUT("fd:%d created for input %d\n", fd, i + 1);
+      return;
+    }
   }
 }
 
@@ -727,9 +1525,9 @@ is_taint_file(const char *filename) {
 SANITIZER_INTERFACE_ATTRIBUTE off_t
 taint_get_file(int fd) {
   AOUT("fd: %d\n", fd);
-  AOUT("tainted.fd: %d\n", tainted.fd);
-  if (tainted.fd == fd) {
-    return tainted.size;
+  if (get_taint_fd(fd) == kTaintFdFile) {
+    u8 input = __taint_fd_inputs[fd];
+    return input ? __taint_inputs[input - 1].size : tainted.size;
   } else if (flags().force_stdin && fd == 0) {
     return tainted.size;
   } else {
@@ -737,12 +1535,46 @@ taint_get_file(int fd) {
   }
 }
 
+SANITIZER_INTERFACE_ATTRIBUTE uint32_t
+taint_get_file_input(int fd) {
+  if (get_taint_fd(fd) != kTaintFdFile) return 0;
+  return __taint_fd_inputs[fd];
+}
+
+SANITIZER_INTERFACE_ATTRIBUTE dfsan_label
+taint_input_label(uint32_t input, off_t offset) {
+  if (input == 0) return offset + CONST_OFFSET;
+  if (input > (u32)__num_taint_inputs || offset < 0 ||
+      offset >= __taint_inputs[input - 1].size)
+    return CONST_LABEL;
+  return __taint_inputs[input - 1].base + offset;
+}
+
+// the end of the bytes of the taint file read so far, by reads, maps, and
+// the file positions left behind by seeks and closes
+static atomic_uint64_t __taint_consumed;
+
+SANITIZER_INTERFACE_ATTRIBUTE void
+taint_note_consumed(int fd, off_t end) {
+  if (get_taint_fd(fd) != kTaintFdFile || __taint_fd_inputs[fd] != 0) return;
+  if (end < 0) {
+    uptr pos = internal_lseek(fd, 0, SEEK_CUR);
+    int err;
+    if (internal_iserror(pos, &err)) return;
+    end = pos;
+  }
+  u64 cur = atomic_load(&__taint_consumed, memory_order_relaxed);
+  while (cur < (u64)end &&
+         !atomic_compare_exchange_weak(&__taint_consumed, &cur, (u64)end,
+                                       memory_order_relaxed)) {
+  }
+}
+
 SANITIZER_INTERFACE_ATTRIBUTE void
 taint_close_file(int fd) {
-  if (fd == tainted.fd) {
-    AOUT("close tainted.fd: %d\n", tainted.fd);
-    tainted.fd = -1;
-  }
+  AOUT("close fd: %d\n", fd);
+  taint_note_consumed(fd, -1);
+  clear_taint_fd(fd, kTaintFdFile);
 }
 
 SANITIZER_INTERFACE_ATTRIBUTE int
@@ -750,6 +1582,56 @@ is_stdin_taint(void) {
   return tainted.is_stdin;
 }
 
+// byte ranges selected by taint_ranges, sorted, [beg, end)
+static const int kMaxTaintRanges = 64;
+static struct {
+  off_t beg;
+  off_t end;
+} __taint_ranges[kMaxTaintRanges];
+static int __num_taint_ranges = 0;
+
+SANITIZER_INTERFACE_ATTRIBUTE int
+is_taint_offset(off_t offset) {
+  if (__num_taint_ranges == 0)
+    return 1;
+  int lo = 0, hi = __num_taint_ranges;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (offset >= __taint_ranges[mid].end) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo < __num_taint_ranges && offset >= __taint_ranges[lo].beg;
+}
+
+// whether the taint sources label what they read, cleared while the
+// harness sets up, see dfsan_set_propagation()
+static atomic_uint8_t __taint_active;
+
+SANITIZER_INTERFACE_ATTRIBUTE int
+is_taint_active(void) {
+  return atomic_load(&__taint_active, memory_order_relaxed);
+}
+
+/// Suspends (0) or resumes the labeling of the input bytes the program
+/// reads; what's been read while suspended stays concrete, the labels
+/// already in memory are kept.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE void
+dfsan_set_propagation(int enable) {
+  atomic_store(&__taint_active, enable != 0, memory_order_relaxed);
+}
+
+/// Markers around the part of the harness that processes the input, e.g.,
+/// with taint_at_marker the setup before __symsan_start() reads no labels.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE void
+__symsan_start(void) {
+  dfsan_set_propagation(1);
+}
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE void
+__symsan_stop(void) {
+  dfsan_set_propagation(0);
+}
+
 // for utmp interface
 SANITIZER_INTERFACE_ATTRIBUTE int
 is_utmp_taint(void) {
@@ -776,45 +1658,66 @@ taint_get_offset_label() {
   return tainted.offset_label;
 }
 
-SANITIZER_INTERFACE_ATTRIBUTE void
-taint_set_socket(const void *addr, unsigned addrlen, int fd) {
+// Checks addr against the taint_socket flag. A socket bound to the wildcard
+// address also matches, as servers usually listen on all interfaces.
+static bool match_taint_socket(const void *addr, bool bound) {
   const struct sockaddr *sa = (struct sockaddr *)addr;
   AOUT("taint host %s:%d\n", tainted_socket.host, tainted_socket.port);
-  if (sa->sa_family != tainted_socket.family) return;
+  if (sa->sa_family != tainted_socket.family) return false;
 
   if (sa->sa_family == AF_INET) {
     struct sockaddr_in *sin = (struct sockaddr_in *)sa;
-    if (tainted_socket.port != ntohs(sin->sin_port)) return;
+    if (tainted_socket.port != ntohs(sin->sin_port)) return false;
+    if (bound && sin->sin_addr.s_addr == htonl(INADDR_ANY)) return true;
     struct in_addr addr;
     inet_pton(AF_INET, tainted_socket.host, &addr);
-    if (addr.s_addr != sin->sin_addr.s_addr) return;
-    // family, port, and address match
-    AOUT("taint sockfd %d\n", fd);
-    tainted_socket.fd = fd;
+    return addr.s_addr == sin->sin_addr.s_addr;
   } else if (sa->sa_family == AF_INET6) {
     struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
-    if (tainted_socket.port != ntohs(sin6->sin6_port)) return;
+    if (tainted_socket.port != ntohs(sin6->sin6_port)) return false;
+    if (bound && IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr)) return true;
     struct in6_addr addr;
     inet_pton(AF_INET6, tainted_socket.host, &addr);
-    if (internal_memcmp(&addr, &sin6->sin6_addr, sizeof(addr)) != 0) return;
-    // family, port, and address match
-    AOUT("taint sockfd %d\n", fd);
-    tainted_socket.fd = fd;
+    return internal_memcmp(&addr, &sin6->sin6_addr, sizeof(addr)) == 0;
   } else if (sa->sa_family == AF_UNIX) {
     struct sockaddr_un *sun = (struct sockaddr_un *)sa;
-    if (internal_strncmp(tainted_socket.host, sun->sun_path, sizeof(tainted_socket.host)) == 0) {
-      AOUT("taint sockfd %d\n", fd);
-      tainted_socket.fd = fd;
-    }
+    return internal_strncmp(tainted_socket.host, sun->sun_path,
+                            sizeof(tainted_socket.host)) == 0;
+  }
+  return false;
+}
+
+SANITIZER_INTERFACE_ATTRIBUTE void
+taint_set_socket(const void *addr, unsigned addrlen, int fd) {
+  if (match_taint_socket(addr, false)) {
+    // family, port, and address match
+    AOUT("taint sockfd %d\n", fd);
+    set_taint_socket(fd);
+  }
+}
+
+SANITIZER_INTERFACE_ATTRIBUTE void
+taint_bind_socket(const void *addr, unsigned addrlen, int fd) {
+  // datagrams are read from the bound socket itself, connections are
+  // tainted when they are accepted from it
+  if (match_taint_socket(addr, true)) {
+    AOUT("taint bound sockfd %d\n", fd);
+    set_taint_socket(fd);
+  }
+}
+
+SANITIZER_INTERFACE_ATTRIBUTE void
+taint_accept_socket(int listen_fd, int fd) {
+  if (get_taint_fd(listen_fd) == kTaintFdSocket) {
+    AOUT("taint accepted sockfd %d\n", fd);
+    set_taint_socket(fd);
   }
 }
 
 SANITIZER_INTERFACE_ATTRIBUTE off_t
 taint_get_socket(int fd) {
-  if (tainted_socket.fd == fd) {
-    return tainted_socket.offset;
-  } else if (flags().force_stdin) {
-    return tainted_socket.offset;
+  if (get_taint_fd(fd) == kTaintFdSocket || flags().force_stdin) {
+    return atomic_load(&__socket_offset, memory_order_relaxed);
   } else {
     return -1;
   }
@@ -822,16 +1725,27 @@ taint_get_socket(int fd) {
 
 SANITIZER_INTERFACE_ATTRIBUTE void
 taint_update_socket_offset(int fd, size_t size) {
-  if (tainted_socket.fd == fd)
-    tainted_socket.offset += size;
+  if (get_taint_fd(fd) == kTaintFdSocket || flags().force_stdin)
+    atomic_fetch_add(&__socket_offset, size, memory_order_relaxed);
+}
+
+SANITIZER_INTERFACE_ATTRIBUTE off_t
+taint_claim_socket(int fd, size_t size, uint32_t *input) {
+  *input = 0;
+  if (get_taint_fd(fd) == kTaintFdSocket || flags().force_stdin) {
+    if (flags().socket_inputs && fd >= 0 && fd < kMaxTaintFds &&
+        (*input = atomic_load(&__socket_inputs[fd], memory_order_relaxed))) {
+      return atomic_fetch_add(&__socket_offsets[fd], size, memory_order_relaxed);
+    }
+    return atomic_fetch_add(&__socket_offset, size, memory_order_relaxed);
+  }
+  return -1;
 }
 
 SANITIZER_INTERFACE_ATTRIBUTE void
 taint_close_socket(int fd) {
-  if (tainted_socket.fd == fd) {
-    AOUT("close tainted_socket.fd: %d\n", tainted_socket.fd);
-    tainted_socket.fd = -1;
-  }
+  AOUT("close sockfd: %d\n", fd);
+  clear_taint_fd(fd, kTaintFdSocket);
 }
 
 void Flags::SetDefaults() {
@@ -847,12 +1761,64 @@ static void RegisterDfsanFlags(FlagParser *parser, Flags *f) {
 #undef DFSAN_FLAG
 }
 
+// labels each string of strs from beg, up to end or the NULL one if end is
+// -1, followed by its NUL, as the consecutive bytes of input
+static void TaintStrings(char **strs, int beg, int end, u32 input) {
+  off_t offset = 0;
+  for (int i = beg; (end < 0 || i < end) && strs[i]; i++) {
+    uptr n = internal_strlen(strs[i]) + 1;
+    dfsan_set_labels(dfsan_create_labels(offset, input, n), strs[i], n);
+    offset += n;
+  }
+}
+
+// preallocates the labels of the taint_inputs files, after those of the
+// taint file so the offset + CONST_OFFSET labels stay valid, then labels
+// argv and env, whose bytes are already in memory
+static void InitializeTaintInputs() {
+  const char *p = flags().taint_inputs;
+  __num_taint_inputs = 0;
+  while (*p) {
+    const char *end = internal_strchr(p, ',');
+    uptr len = end ? end - p : internal_strlen(p);
+    if (len && len < PATH_MAX) {
+      char path[PATH_MAX];
+      struct stat st;
+      internal_memcpy(path, p, len);
+      path[len] = '\0';
+      if (__num_taint_inputs == kMaxTaintInputs) {
+        Report("WARNING: more than %d taint inputs, ignoring %s\n",
+               kMaxTaintInputs, path);
+      } else if (!realpath(path, __taint_inputs[__num_taint_inputs].filename) ||
+                 stat(path, &st)) {
+        Report("WARNING: failed to get to taint input %s\n", path);
+      } else {
+        int i = __num_taint_inputs++;
+        __taint_inputs[i].size = st.st_size;
+        __taint_inputs[i].base = dfsan_create_labels(0, i + 1, st.st_size);
+        AOUT("input %d: %s %lld size\n", i + 1, path, st.st_size);
+      }
+    }
+    if (!end) break;
+    p = end + 1;
+  }
+
+  __num_static_inputs = __num_taint_inputs + 1;
+  if (flags().taint_argv && __taint_argv)
+    TaintStrings(__taint_argv, 1, __taint_argc, __num_static_inputs++);
+  if (flags().taint_env && __taint_envp)
+    TaintStrings(__taint_envp, 0, -1, __num_static_inputs++);
+}
+
 static void InitializeTaintFile() {
   struct stat st;
   const char *filename = flags().taint_file;
   int err;
+  bool has_file = true;
+  // every input starts at the marker again
+  dfsan_set_propagation(!flags().taint_at_marker);
   if (internal_strcmp(filename, "stdin") == 0) {
-    tainted.fd = 0;
+    set_taint_fd(0, kTaintFdFile);
     // try to get the size, as stdin may be a file
     if (!fstat(0, &st) && S_ISREG(st.st_mode)) {
       tainted.size = st.st_size;
@@ -870,7 +1836,7 @@ static void InitializeTaintFile() {
       tainted.is_stdin = 1; // truly stdin
     }
   } else if (internal_strcmp(filename, "") == 0) {
-    tainted.fd = -1;
+    has_file = false;
   } else {
     if (!realpath(filename, tainted.filename)) {
       Report("WARNING: failed to get to real path for taint file\n");
@@ -889,12 +1855,60 @@ static void InitializeTaintFile() {
     AOUT("%s %lld size\n", filename, tainted.size);
   }
 
-  if (tainted.fd != -1 && !tainted.is_stdin) {
+  if (has_file && !tainted.is_stdin) {
     for (off_t i = 0; i < tainted.size; i++) {
       dfsan_label label = dfsan_create_label(i);
       dfsan_check_label(label);
     }
   }
+
+  InitializeTaintInputs();
+}
+
+// parses "a-b,c,d-" (inclusive bounds, open end) into __taint_ranges
+static void InitializeTaintRanges() {
+  const char *p = flags().taint_ranges;
+  while (*p) {
+    const char *end;
+    off_t beg = internal_simple_strtoll(p, &end, 0);
+    off_t last = beg;
+    if (end == p || beg < 0) break;
+    p = end;
+    if (*p == '-') {
+      ++p;
+      last = internal_simple_strtoll(p, &end, 0);
+      if (end == p) last = (off_t)(~0ULL >> 1) - 1; // to the end of file
+      p = end;
+    }
+    if (last < beg) break;
+    if (__num_taint_ranges == kMaxTaintRanges) {
+      Report("WARNING: too many taint ranges, ignoring the rest\n");
+      return;
+    }
+    // keep the ranges sorted
+    int i = __num_taint_ranges++;
+    while (i > 0 && __taint_ranges[i - 1].beg > beg) {
+      __taint_ranges[i] = __taint_ranges[i - 1];
+      --i;
+    }
+    __taint_ranges[i].beg = beg;
+    __taint_ranges[i].end = last + 1;
+    if (*p != ',') break;
+    ++p;
+  }
+  if (*p) {
+    Printf("FATAL: invalid taint_ranges at \"%s\"\n", p);
+    Die();
+  }
+  // merge overlapping ranges so the lookup can bisect
+  int n = 0;
+  for (int i = 0; i < __num_taint_ranges; i++) {
+    if (n > 0 && __taint_ranges[i].beg <= __taint_ranges[n - 1].end)
+      __taint_ranges[n - 1].end = Max(__taint_ranges[n - 1].end, __taint_ranges[i].end);
+    else
+      __taint_ranges[n++] = __taint_ranges[i];
+  }
+  __num_taint_ranges = n;
 }
 
 static void InitializeTaintSocket() {
@@ -902,7 +1916,6 @@ static void InitializeTaintSocket() {
   internal_memset(tainted_socket.host, 0, sizeof(tainted_socket.host));
   tainted_socket.family = -1;
   tainted_socket.port = -1;
-  tainted_socket.fd = -1;
   if (internal_strstr(host, "tcp@") == host || internal_strstr(host, "udp@") == host) {
     char *port = internal_strchr(host + 4, '@');
     if (port) {
@@ -944,6 +1957,273 @@ static void InitializeTaintSocket() {
 
 // information is passed implicitly through flags()
 extern "C" void InitializeSolver();
+// flushes the work of an in-process solver, before the input is unmapped
+extern "C" void FinalizeSolver();
+// drops the per-run state of the solver, between persistent iterations
+extern "C" void ResetSolver();
+
+// forkserver request: a 4-byte command word, with the write end of the event
+// pipe (and the input fd if tainting stdin) attached as SCM_RIGHTS
+static const int kMaxForkServerFds = 2;
+
+static int RecvForkServerRequest(int ctl_fd, int *fds) {
+  u32 cmd;
+  struct iovec iov = { &cmd, sizeof(cmd) };
+  char cbuf[CMSG_SPACE(sizeof(int) * kMaxForkServerFds)];
+  struct msghdr msg;
+  internal_memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  ssize_t n = recvmsg(ctl_fd, &msg, 0);
+  if (n != sizeof(cmd))
+    return -1; // launcher is gone
+
+  int nfds = 0;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+      continue;
+    int cnt = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int *cfds = (int *)CMSG_DATA(c);
+    for (int i = 0; i < cnt; i++) {
+      if (nfds < kMaxForkServerFds) fds[nfds++] = cfds[i];
+      else internal_close(cfds[i]);
+    }
+  }
+  return nfds;
+}
+
+static void ApplyForkServerRequest(int *fds, int nfds) {
+  // event pipe always goes to the fd given through pipe_fd
+  if (flags().pipe_fd != -1 && fds[0] != flags().pipe_fd) {
+    internal_dup2(fds[0], flags().pipe_fd);
+    internal_close(fds[0]);
+  }
+  if (nfds > 1) {
+    internal_dup2(fds[1], 0);
+    internal_close(fds[1]);
+    internal_lseek(0, 0, SEEK_SET);
+  }
+}
+
+// Persistent mode: the launcher talks to the process itself, each request
+// starts a new iteration of __symsan_loop
+static bool WaitPersistentRequest() {
+  int ctl_fd = flags().forkserver_fd;
+  int fds[kMaxForkServerFds] = {-1, -1};
+  int nfds = RecvForkServerRequest(ctl_fd, fds);
+  if (nfds <= 0)
+    return false;
+  ApplyForkServerRequest(fds, nfds);
+  int pid = internal_getpid();
+  return internal_write(ctl_fd, &pid, sizeof(pid)) == sizeof(pid);
+}
+
+// Runs in the preinit stage: the parent stays in the loop and serves fork
+// requests from the launcher, each child returns to run the program, so the
+// costly shadow mapping and runtime setup happen only once.
+static void StartForkServer() {
+  int ctl_fd = flags().forkserver_fd;
+  u32 hello = 0;
+  if (internal_write(ctl_fd, &hello, sizeof(hello)) != sizeof(hello)) {
+    Report("WARNING: no forkserver launcher, running in normal mode\n");
+    return;
+  }
+
+  while (true) {
+    int fds[kMaxForkServerFds] = {-1, -1};
+    int nfds = RecvForkServerRequest(ctl_fd, fds);
+    if (nfds <= 0) {
+      internal__exit(0);
+    }
+
+    int pid = fork();
+    if (pid < 0) {
+      Report("FATAL: forkserver failed to fork\n");
+      Die();
+    }
+    if (pid == 0) {
+      internal_close(ctl_fd);
+      ApplyForkServerRequest(fds, nfds);
+      return;
+    }
+
+    for (int i = 0; i < nfds; i++)
+      internal_close(fds[i]);
+
+    int status = 0;
+    if (internal_write(ctl_fd, &pid, sizeof(pid)) != sizeof(pid)) {
+      internal__exit(0);
+    }
+    if (waitpid(pid, &status, 0) < 0) {
+      Report("FATAL: forkserver failed to wait for child\n");
+      Die();
+    }
+    if (internal_write(ctl_fd, &status, sizeof(status)) != sizeof(status)) {
+      internal__exit(0);
+    }
+  }
+}
+
+// A snapshot (see snapshot.h) is taken once per run, the dormant copy
+// serves its requests like the forkserver, with the input fd required.
+// The runs in between reuse the union table, so the labels of the run so
+// far are copied aside and put back in each resumed child.
+static bool __snapshot_taken;
+
+// the taint file fds read the input of fd from their current positions,
+// and the copy of the input is remapped
+static void RebindTaintFile(int fd) {
+  char path[32];
+  internal_snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  for (int i = 0; i < kMaxTaintFds; i++) {
+    if (get_taint_fd(i) != kTaintFdFile || __taint_fd_inputs[i] != 0)
+      continue;
+    uptr pos = internal_lseek(i, 0, SEEK_CUR);
+    // each fd gets its own file position
+    uptr nfd = internal_open(path, O_RDONLY);
+    int err;
+    if (internal_iserror(nfd, &err)) {
+      Report("FATAL: failed to reopen the input of a snapshot\n");
+      Die();
+    }
+    internal_dup2(nfd, i);
+    internal_close(nfd);
+    if (!internal_iserror(pos, &err))
+      internal_lseek(i, pos, SEEK_SET);
+  }
+  if (tainted.buf) {
+    UnmapOrDie(tainted.buf, tainted.buf_size);
+    uptr map = internal_mmap(nullptr, tainted.buf_size, PROT_READ,
+                             MAP_PRIVATE, fd, 0);
+    int err;
+    if (internal_iserror(map, &err)) {
+      Report("FATAL: failed to map a copy of the input of a snapshot\n");
+      Die();
+    }
+    tainted.buf = reinterpret_cast<char *>(map);
+  }
+  internal_close(fd);
+}
+
+// the dormant copy, only returns in a resumed child
+static void ServeSnapshot(int ctl_fd, char *saved, uptr num_labels) {
+  // the run goes on without the copy holding its event pipe open
+  if (flags().pipe_fd != -1)
+    internal_close(flags().pipe_fd);
+  internal_close(flags().snapshot_fd);
+
+  while (true) {
+    int fds[kMaxForkServerFds] = {-1, -1};
+    int nfds = RecvForkServerRequest(ctl_fd, fds);
+    if (nfds < kMaxForkServerFds) {
+      for (int i = 0; i < nfds; i++)
+        internal_close(fds[i]);
+      internal__exit(0);
+    }
+
+    int pid = fork();
+    if (pid < 0) {
+      Report("FATAL: snapshot failed to fork\n");
+      Die();
+    }
+    if (pid == 0) {
+      internal_close(ctl_fd);
+      if (flags().pipe_fd != -1 && fds[0] != flags().pipe_fd) {
+        internal_dup2(fds[0], flags().pipe_fd);
+        internal_close(fds[0]);
+      }
+      RebindTaintFile(fds[1]);
+      uptr info_size = num_labels * sizeof(dfsan_label_info);
+      internal_memcpy(__dfsan_label_info, saved, info_size);
+      internal_memcpy(__dfsan_label_operands, saved + info_size,
+                      num_labels * sizeof(dfsan_label_operands));
+      return;
+    }
+
+    for (int i = 0; i < nfds; i++)
+      internal_close(fds[i]);
+
+    int status = 0;
+    if (internal_write(ctl_fd, &pid, sizeof(pid)) != sizeof(pid) ||
+        waitpid(pid, &status, 0) < 0 ||
+        internal_write(ctl_fd, &status, sizeof(status)) != sizeof(status)) {
+      internal__exit(0);
+    }
+  }
+}
+
+SANITIZER_INTERFACE_ATTRIBUTE void
+taint_snapshot(uint32_t id) {
+  int snap_fd = flags().snapshot_fd;
+  if (snap_fd == -1 || __snapshot_taken || flags().persistent)
+    return;
+  __snapshot_taken = true;
+  // only the taint file, from a regular file, can be swapped for another,
+  // and only the thread at the branch goes on in the copy
+  if (tainted.is_stdin || tainted.size == 0 || __num_taint_inputs ||
+      tainted_socket.family != -1 || GetTid() != internal_getpid())
+    return;
+
+  u64 consumed = atomic_load(&__taint_consumed, memory_order_relaxed);
+  for (int i = 0; i < kMaxTaintFds; i++) {
+    if (get_taint_fd(i) != kTaintFdFile || __taint_fd_inputs[i] != 0)
+      continue;
+    uptr pos = internal_lseek(i, 0, SEEK_CUR);
+    int err;
+    if (!internal_iserror(pos, &err) && pos > consumed)
+      consumed = pos;
+  }
+
+  // copied before the fork, as the run goes on writing labels
+  uptr num_labels = atomic_load(&__dfsan_used_label, memory_order_relaxed) + 1;
+  uptr info_size = num_labels * sizeof(dfsan_label_info);
+  uptr saved_size = RoundUpTo(info_size +
+      num_labels * sizeof(dfsan_label_operands), GetPageSizeCached());
+  char *saved = (char *)MmapNoReserveOrDie(saved_size, "snapshot labels");
+  internal_memcpy(saved, __dfsan_label_info, info_size);
+  internal_memcpy(saved + info_size, __dfsan_label_operands,
+                  num_labels * sizeof(dfsan_label_operands));
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    UnmapOrDie(saved, saved_size);
+    return;
+  }
+  int pid = fork();
+  if (pid == 0) {
+    internal_close(sv[0]);
+    ServeSnapshot(sv[1], saved, num_labels);
+    UnmapOrDie(saved, saved_size);
+    return;
+  }
+  UnmapOrDie(saved, saved_size);
+  internal_close(sv[1]);
+  if (pid < 0) {
+    internal_close(sv[0]);
+    return;
+  }
+
+  struct snapshot_msg hello = {id, pid, consumed, (u64)tainted.size};
+  struct iovec iov = { &hello, sizeof(hello) };
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  internal_memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  internal_memcpy(CMSG_DATA(c), &sv[0], sizeof(int));
+  // without a launcher to take it, the copy sees EOF and exits
+  sendmsg(snap_fd, &msg, MSG_NOSIGNAL);
+  internal_close(sv[0]);
+}
 
 static void InitializeFlags() {
   SetCommonFlagsDefaults();
@@ -975,6 +2255,9 @@ static void InitializePlatformEarly() {
 }
 
 static void dfsan_fini() {
+  FinalizeSolver();
+  PrintStats();
+  WriteProfile();
   if (internal_strcmp(flags().dump_labels_at_exit, "") != 0) {
     fd_t fd = OpenFile(flags().dump_labels_at_exit, WrOnly);
     if (fd == kInvalidFd) {
@@ -992,14 +2275,107 @@ static void dfsan_fini() {
     UnmapOrDie(tainted.buf, tainted.buf_size);
   }
   if (flags().shm_fd != -1) {
-    internal_munmap((void *)UnionTableAddr(), uniontable_size);
+    internal_munmap((void *)UnionTableAddr(), __union_table_size);
+  }
+}
+
+static void InitializeUnionTableSize() {
+  if (flags().union_table_size == 0)
+    return;
+  // labels are 32-bit, and the table must not run into the app memory
+  const uptr max_size = Min((uptr)(1ULL << 32) *
+                            (sizeof(dfsan_label_info) + sizeof(dfsan_label_operands)),
+                            AppAddr() - UnionTableAddr());
+  uptr size = RoundUpTo(flags().union_table_size, GetPageSizeCached());
+  if (size < 2 * GetPageSizeCached() || size > max_size) {
+    Printf("FATAL: invalid union table size 0x%zx, max 0x%zx\n", size, max_size);
+    Die();
+  }
+  __union_table_size = size;
+}
+
+// writes each pc of the file with its function and source location, for
+// the consumers' per-site reports; the addresses must come from runs at the
+// same load address, e.g., with ASLR off
+static void SymbolizePCs(const char *path) {
+  char *buf = nullptr;
+  uptr buf_size, len;
+  if (!ReadFileToBuffer(path, &buf, &buf_size, &len)) {
+    Report("WARNING: DataFlowSanitizer: unable to read %s\n", path);
+    return;
+  }
+  InternalScopedString out_path(kMaxPathLength);
+  out_path.append("%s.sym", path);
+  fd_t fd = OpenFile(out_path.data(), WrOnly);
+  if (fd == kInvalidFd) {
+    Report("WARNING: DataFlowSanitizer: unable to open %s\n", out_path.data());
+    UnmapOrDie(buf, buf_size);
+    return;
+  }
+  InternalScopedString line(kMaxPathLength * 2);
+  const char *p = buf, *end = buf + len;
+  while (p < end) {
+    const char *next;
+    uptr pc = (uptr)internal_simple_strtoll(p, &next, 16);
+    if (next == p) {
+      p++;
+      continue;
+    }
+    p = next;
+    line.clear();
+    line.append("0x%zx", pc);
+    // the innermost frame, where the branch is if it was inlined
+    SymbolizedStack *frames = Symbolizer::GetOrInit()->SymbolizePC(pc);
+    if (frames) {
+      RenderFrame(&line, " %f %L", 0, pc, &frames->info, false);
+      frames->ClearAll();
+    }
+    line.append("\n");
+    WriteToFile(fd, line.data(), line.length());
+  }
+  CloseFile(fd);
+  UnmapOrDie(buf, buf_size);
+}
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// Random walks over the label records and the hashtable buckets miss the
+// TLB on every other access with 4K pages. Huge pages of the shm union
+// table need shmem_enabled set to advise (or above) in the kernel.
+static void AdviseHugePages(uptr addr, uptr size) {
+  if (!flags().huge_pages) return;
+  if (internal_madvise(addr, size, MADV_HUGEPAGE) != 0)
+    AOUT("no huge pages for %p\n", (void *)addr);
+}
+
+// faults in the first prefault_mb of [addr, addr + size) for writing, so
+// the first unions don't pay for them one page at a time
+static void Prefault(uptr addr, uptr size) {
+  uptr n = Min<uptr>(size, flags().prefault_mb << 20);
+  if (n == 0) return;
+  if (internal_madvise(addr, n, MADV_POPULATE_WRITE) == 0) return;
+  // before 5.14, by touching the pages, no one else writes them yet
+  const uptr page = GetPageSizeCached();
+  for (uptr p = addr; p < addr + n; p += page) {
+    volatile char *c = (volatile char *)p;
+    *c = *c;
   }
 }
 
 static void dfsan_init(int argc, char **argv, char **envp) {
   InitializeFlags();
+  __taint_argc = argc;
+  __taint_argv = argv;
+  __taint_envp = envp;
   print_debug = flags().debug;
 
+  InitializeUnionTableSize();
+  InitializeTaintRanges();
+  InitializeStats(flags().print_stats);
+  InitializeProfile(flags().taint_profile);
+
   ::InitializePlatformEarly();
   uptr ret;
   int err;
@@ -1011,28 +2387,55 @@ static void dfsan_init(int argc, char **argv, char **envp) {
 
   // init union table
   __dfsan_label_info = (dfsan_label_info *)UnionTableAddr();
-if (flags().shm_fd != -1) {
+  __dfsan_label_operands = get_label_operands_base((void *)UnionTableAddr(),
+                                                   __union_table_size);
+  if (flags().shm_fd != -1) {
     AOUT("shm_fd %d\n", flags().shm_fd);
-    ret = internal_mmap((void*)UnionTableAddr(), uniontable_size,
+    ret = internal_mmap((void*)UnionTableAddr(), __union_table_size,
         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, flags().shm_fd, 0);
   } else {
-    ret = MmapFixedSuperNoReserve(UnionTableAddr(), uniontable_size);
+    ret = MmapFixedSuperNoReserve(UnionTableAddr(), __union_table_size);
   }
   if (internal_iserror(ret, &err)) {
     Printf("FATAL: error mapping shared union table %s\n", strerror(err));
     Die();
   }
+  // the records and the operands, each half used from its start
+  AdviseHugePages(UnionTableAddr(), __union_table_size);
+  Prefault(UnionTableAddr(), __union_table_size / 2);
+  Prefault((uptr)__dfsan_label_operands, __union_table_size / 2);
 
   // init const label
   internal_memset(&__dfsan_label_info[CONST_LABEL], 0, sizeof(dfsan_label_info));
   __dfsan_label_info[CONST_LABEL].size = 8;
+  internal_memset(&__dfsan_label_operands[CONST_LABEL], 0, sizeof(dfsan_label_operands));
 
   // init hashtable allocator
   __taint::allocator_init(HashTableAddr(), HashTableAddr() + hashtable_size);
+  AdviseHugePages(HashTableAddr(), hashtable_size);
+  // the forked children would copy the private pages on their first write
+  if (flags().forkserver_fd == -1)
+    Prefault(HashTableAddr(), hashtable_size);
+
+  // init hashtable, growing is capped so all generations fit the region
+  const uptr max_buckets = hashtable_size / 2 / sizeof(__taint::union_hashtable_bucket);
+  uptr buckets = flags().hashtable_buckets ? flags().hashtable_buckets : hashtable_buckets;
+  buckets = Min(RoundUpToPowerOfTwo(buckets), max_buckets);
+  __union_table.init(buckets, max_buckets);
+
+  // pick the shadow scan routines for this cpu
+  __taint::simd_init();
+
+  InitializeShadowBitmap();
 
   // init main thread
-  auto num_of_labels = uniontable_size / sizeof(dfsan_label_info);
-  __alloca_stack_top = __alloca_stack_bottom = (dfsan_label)(num_of_labels - 2);
+  auto num_of_labels = __union_table_size /
+      (sizeof(dfsan_label_info) + sizeof(dfsan_label_operands));
+  __alloca_stack_bottom = (dfsan_label)(num_of_labels - 2);
+  atomic_store(&__alloca_stack_floor, __alloca_stack_bottom,
+               memory_order_relaxed);
+  InitializeAstInfo(num_of_labels);
+  InitializeBounds();
 
   // Protect the region of memory we don't use, to preserve the one-to-one
   // mapping from application to shadow memory. But if ASLR is disabled, Linux
@@ -1045,7 +2448,18 @@ if (flags().shm_fd != -1) {
 
   InitializeInterceptors();
 
-  InitializeTaintFile();
+  if (internal_strcmp(flags().symbolize_pcs, "") != 0) {
+    SymbolizePCs(flags().symbolize_pcs);
+    internal__exit(0);
+  }
+
+  if (flags().lazy_mmap_taint)
+    InitializeLazyShadow();
+
+  // in forkserver mode, the input is only known in the forked child
+  bool use_forkserver = flags().forkserver_fd != -1;
+  if (!use_forkserver)
+    InitializeTaintFile();
 
   InitializeTaintSocket();
 
@@ -1055,6 +2469,189 @@ if (flags().shm_fd != -1) {
   // or it is killed by the runtime.
   Atexit(dfsan_fini);
   AddDieCallback(dfsan_fini);
+
+  if (use_forkserver) {
+    if (flags().persistent) {
+      u32 hello = 0;
+      if (internal_write(flags().forkserver_fd, &hello, sizeof(hello)) != sizeof(hello) ||
+          !WaitPersistentRequest()) {
+        Report("WARNING: no persistent launcher, running in normal mode\n");
+        flags().persistent = false;
+      }
+    } else {
+      StartForkServer();
+    }
+    InitializeTaintFile();
+  }
+}
+
+// Calls fn on each resident shadow range of the mapped app memory.
+template <typename Fn>
+static void ForEachAppShadow(Fn fn) {
+  const uptr page = GetPageSizeCached();
+  const uptr kChunkPages = 512;
+  unsigned char vec[kChunkPages];
+  MemoryMappingLayout proc_maps(/*cache_enabled*/false);
+  MemoryMappedSegment segment;
+  while (proc_maps.Next(&segment)) {
+    if (segment.start < AppAddr())
+      continue;
+    uptr beg = RoundDownTo((uptr)shadow_for((void *)segment.start), page);
+    uptr end = RoundUpTo((uptr)shadow_for((void *)segment.end), page);
+    for (uptr chunk = beg; chunk < end; chunk += kChunkPages * page) {
+      uptr len = Min(kChunkPages * page, end - chunk);
+      if (mincore((void *)chunk, len, vec) != 0)
+        continue;
+      for (uptr i = 0; i < len / page; i++) {
+        if (!(vec[i] & 1)) continue; // never touched, all zero
+        dfsan_label *p = (dfsan_label *)(chunk + i * page);
+        fn(p, (dfsan_label *)((uptr)p + page));
+      }
+    }
+  }
+}
+
+// Epoch-based reclaim for persistent mode: only keep the labels reachable
+// from the shadow (and from the bounds labels), compact them to the bottom of
+// the union table and rewrite the shadow. Operands always have smaller labels
+// than their users, so one downward pass marks and one upward pass compacts.
+static void ReclaimLabels() {
+  dfsan_label last = atomic_load(&__dfsan_used_label, memory_order_relaxed);
+  dfsan_label alloca_floor =
+      atomic_load(&__alloca_stack_floor, memory_order_relaxed);
+  __union_table.reset();
+  if (last == 0)
+    return;
+
+  auto is_normal = [last](dfsan_label l) {
+    return l >= CONST_OFFSET && l <= last;
+  };
+  // 0: unreachable, otherwise marked and later the new label
+  uptr remap_size = RoundUpTo((last + 1) * sizeof(dfsan_label), GetPageSizeCached());
+  dfsan_label *remap = (dfsan_label *)MmapOrDie(remap_size, "label remap");
+
+  // roots
+  ForEachAppShadow([&](dfsan_label *b, dfsan_label *e) {
+    for (dfsan_label *p = b; p < e; ++p)
+      if (is_normal(*p)) remap[*p] = 1;
+  });
+  for (dfsan_label l = alloca_floor; l < __alloca_stack_bottom; ++l) {
+    dfsan_label_info *info = &__dfsan_label_info[l];
+    if (is_normal(info->l1)) remap[info->l1] = 1;
+    if (is_normal(info->l2)) remap[info->l2] = 1;
+  }
+
+  // mark
+  for (dfsan_label l = last; l >= CONST_OFFSET; --l) {
+    if (!remap[l]) continue;
+    dfsan_label_info *info = &__dfsan_label_info[l];
+    if (info->op == __dfsan::Load) {
+      // l2 is the number of consecutive input labels starting at l1
+      for (dfsan_label i = 0; i < info->l2; i++)
+        if (is_normal(info->l1 + i)) remap[info->l1 + i] = 1;
+    } else {
+      if (is_normal(info->l1)) remap[info->l1] = 1;
+      if (is_normal(info->l2)) remap[info->l2] = 1;
+    }
+  }
+
+  // compact, a marked Load range stays consecutive
+  dfsan_label next = CONST_LABEL;
+  for (dfsan_label l = CONST_OFFSET; l <= last; ++l) {
+    if (!remap[l]) continue;
+    dfsan_label nl = ++next;
+    remap[l] = nl;
+    dfsan_label_info info = __dfsan_label_info[l];
+    if (is_normal(info.l1)) info.l1 = remap[info.l1];
+    if (info.op != __dfsan::Load && is_normal(info.l2)) info.l2 = remap[info.l2];
+    internal_memcpy(&__dfsan_label_info[nl], &info, sizeof(info));
+    __dfsan_label_operands[nl] = __dfsan_label_operands[l];
+    if (__ast_info) __ast_info[nl] = __ast_info[l];
+    if (__taint_bounds) __taint_bounds[nl] = __taint_bounds[l];
+    // input labels are never deduplicated
+    if (info.op != 0)
+      __union_table.insert(&__dfsan_label_info[nl], nl);
+  }
+
+  ForEachAppShadow([&](dfsan_label *b, dfsan_label *e) {
+    for (dfsan_label *p = b; p < e; ++p)
+      if (is_normal(*p)) *p = remap[*p];
+  });
+  for (dfsan_label l = alloca_floor; l < __alloca_stack_bottom; ++l) {
+    dfsan_label_info *info = &__dfsan_label_info[l];
+    if (is_normal(info->l1)) info->l1 = remap[info->l1];
+    if (is_normal(info->l2)) info->l2 = remap[info->l2];
+  }
+
+  AOUT("reclaimed %u labels, %u left\n", last - next, next);
+  atomic_store(&__dfsan_last_label, next, memory_order_relaxed);
+  atomic_store(&__dfsan_used_label, next, memory_order_relaxed);
+  atomic_fetch_add(&__label_epoch, 1, memory_order_relaxed);
+  UnmapOrDie(remap, remap_size);
+}
+
+// Reset the per-input state, so labels can be reused by the next iteration.
+static void ResetTaintState() {
+  // mappings labelled on demand belong to the previous input
+  lazy_shadow_reset();
+  if (flags().persistent_gc) {
+    // keep the taint that survives the iteration, drop the rest
+    ReclaimLabels();
+  } else {
+    // stale labels in the shadow would refer to labels to be reused
+    ReleaseMemoryPagesToOS(ShadowAddr(), HashTableAddr());
+    shadow_bitmap_reset();
+    __union_table.reset();
+    atomic_store(&__dfsan_last_label, 0, memory_order_relaxed);
+    atomic_store(&__dfsan_used_label, 0, memory_order_relaxed);
+    atomic_fetch_add(&__label_epoch, 1, memory_order_relaxed);
+  }
+  // labels passed around in the TLS or memoized are not valid anymore
+  internal_memset(__extract_cache, 0, sizeof(__extract_cache));
+  internal_memset(__dfsan_arg_tls, 0, sizeof(__dfsan_arg_tls));
+  internal_memset(__dfsan_retval_tls, 0, sizeof(__dfsan_retval_tls));
+  // every input gets a fresh trace budget
+  internal_memset(__taint_trace_budget, 0, sizeof(__taint_trace_budget));
+
+  if (tainted.buf) {
+    UnmapOrDie(tainted.buf, tainted.buf_size);
+  }
+  internal_memset(&tainted, 0, sizeof(tainted));
+  for (int fd = 0; fd < kMaxTaintFds; fd++)
+    atomic_store(&__taint_fds[fd], kTaintFdNone, memory_order_relaxed);
+  atomic_store(&__socket_offset, 0, memory_order_relaxed);
+  atomic_store(&__taint_consumed, 0, memory_order_relaxed);
+  if (flags().socket_inputs) {
+    internal_memset(__socket_inputs, 0, sizeof(__socket_inputs));
+    atomic_store(&__num_socket_inputs, 0, memory_order_relaxed);
+  }
+}
+
+/// Persistent loop, similar to __AFL_LOOP, returns non-zero while the harness
+/// should process another input. Without a persistent launcher, the harness
+/// body runs once.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE int
+__symsan_loop(unsigned max_cnt) {
+  static unsigned iter = 0;
+  if (iter++ == 0)
+    return 1; // the first input has been setup by dfsan_init
+
+  if (!flags().persistent || (max_cnt && iter > max_cnt))
+    return 0;
+
+  // signal the end of the current run: EOF on the event pipe, then status 0
+  int status = 0;
+  if (flags().pipe_fd != -1)
+    internal_close(flags().pipe_fd);
+  if (internal_write(flags().forkserver_fd, &status, sizeof(status)) != sizeof(status))
+    return 0;
+
+  ResetTaintState();
+  ResetSolver();
+  if (!WaitPersistentRequest())
+    return 0;
+  InitializeTaintFile();
+  return 1;
 }
 
 #if SANITIZER_CAN_USE_PREINIT_ARRAY
@@ -1064,11 +2661,15 @@ static void (*dfsan_init_ptr)(int, char **, char **) = dfsan_init;
 
 extern "C" {
 SANITIZER_INTERFACE_WEAK_DEF(void, InitializeSolver, void) {}
+SANITIZER_INTERFACE_WEAK_DEF(void, FinalizeSolver, void) {}
+SANITIZER_INTERFACE_WEAK_DEF(void, ResetSolver, void) {}
 
 // Default empty implementations (weak) for hooks
 SANITIZER_INTERFACE_WEAK_DEF(void, __taint_trace_cmp, dfsan_label, dfsan_label,
                              uint32_t, uint32_t, uint64_t, uint64_t, uint32_t) {}
 SANITIZER_INTERFACE_WEAK_DEF(void, __taint_trace_cond, dfsan_label, uint8_t, uint32_t) {}
+SANITIZER_INTERFACE_WEAK_DEF(void, __taint_trace_switch, dfsan_label, uint64_t,
+                             uint32_t, const uint64_t *, uint32_t, uint32_t) {}
 SANITIZER_INTERFACE_WEAK_DEF(void, __taint_trace_indcall, dfsan_label) {}
 SANITIZER_INTERFACE_WEAK_DEF(void, __taint_trace_gep, dfsan_label, uint64_t,
                              dfsan_label, int64_t, uint64_t, uint64_t, int64_t) {}
@@ -41,15 +41,30 @@ typedef union {
   double d;
 } data;
 
+// The union table is split in two parallel arrays indexed by label:
+// the lower half holds the 16-byte records walked by the dedup and the
+// parsers, the upper half holds the (wide) concrete operands, which are
+// only touched once a record matches.
 struct dfsan_label_info {
   dfsan_label l1;
   dfsan_label l2;
-  data op1;
-  data op2;
   uint16_t op;
   uint16_t size; // FIXME: this limit the size of the operand to 65535 bits or bytes (in case of memcmp)
-  uint32_t hash;
-} __attribute__((aligned (8), packed));
+  uint32_t hash; // of l1's and l2's hashes, op and size, i.e., of the whole
+                 // AST and the input offsets it reads, but no constants
+} __attribute__((aligned (16)));
+
+struct dfsan_label_operands {
+  data op1;
+  data op2;
+} __attribute__((aligned (16)));
+
+// operands of label l are at get_label_operands_base(...)[l]
+static inline dfsan_label_operands *
+get_label_operands_base(void *base, size_t table_size) {
+  return reinterpret_cast<dfsan_label_operands*>(
+      static_cast<char*>(base) + table_size / 2);
+}
 
 #ifndef PATH_MAX
 # define PATH_MAX 4096
@@ -57,11 +72,12 @@ struct dfsan_label_info {
 #define CONST_OFFSET 1
 #define CONST_LABEL 0
 
-static const size_t uniontable_size = 0xc00000000; // FIXME
+// default size of the union table, the runtime can be told to use a
+// different one through the union_table_size flag
+static const size_t uniontable_size = 0xc00000000;
 
 struct taint_file {
   char filename[PATH_MAX];
-  int fd;
   off_t offset;
   dfsan_label offset_label;
   dfsan_label label;
@@ -75,8 +91,6 @@ struct taint_file {
 struct taint_socket {
   int family;
   int port;
-  int fd;
-  off_t offset;
   char host[PATH_MAX];
 };
 
@@ -88,8 +102,14 @@ void dfsan_store_label(dfsan_label l1, void *addr, uptr size);
 dfsan_label dfsan_union(dfsan_label l1, dfsan_label l2, uint16_t op, uint16_t size,
                         uint64_t op1, uint64_t op2);
 dfsan_label dfsan_create_label(off_t offset);
+dfsan_label dfsan_create_labels(off_t offset, uint32_t input, uptr n);
+void dfsan_set_labels(dfsan_label first, void *addr, uptr n);
 dfsan_label dfsan_get_label(const void *addr);
 dfsan_label_info* dfsan_get_label_info(dfsan_label label);
+dfsan_label_operands* dfsan_get_label_operands(dfsan_label label);
+// bumped whenever the labels are reset or reclaimed, a label kept across
+// calls is only valid in the epoch it was made in
+uint32_t dfsan_label_epoch(void);
 
 // taint source
 void taint_set_file(const char *filename, int fd);
@@ -97,8 +117,22 @@ off_t taint_get_file(int fd);
 void taint_close_file(int fd);
 int is_taint_file(const char *filename);
 int is_stdin_taint(void);
+int is_taint_offset(off_t offset);
+// whether reads of the input are labeled, see dfsan_set_propagation()
+int is_taint_active(void);
+void dfsan_set_propagation(int enable);
+// the input fd reads, 0 for the taint file, or for the taint_inputs the
+// index in the list + 1
+uint32_t taint_get_file_input(int fd);
+// the preallocated label of a byte of input, CONST_LABEL past its end
+dfsan_label taint_input_label(uint32_t input, off_t offset);
 void taint_set_offset_label(dfsan_label label);
 dfsan_label taint_get_offset_label();
+// the taint file has been read up to end, or up to the current position of
+// fd with a negative end; a snapshot is only valid for the bytes before it
+void taint_note_consumed(int fd, off_t end);
+// takes the snapshot of the run at branch id, if there is none yet
+void taint_snapshot(uint32_t id);
 
 // taint source utmp
 off_t get_utmp_offset(void);
@@ -107,8 +141,13 @@ int is_utmp_taint(void);
 
 // taint source socket
 void taint_set_socket(const void *addr, unsigned addrlen, int fd);
+void taint_bind_socket(const void *addr, unsigned addrlen, int fd);
+void taint_accept_socket(int listen_fd, int fd);
 off_t taint_get_socket(int fd);
 void taint_update_socket_offset(int fd, size_t size);
+// reserves the offsets of size received bytes in the input of fd, -1 if fd
+// isn't tainted
+off_t taint_claim_socket(int fd, size_t size, uint32_t *input);
 void taint_close_socket(int fd);
 }  // extern "C"
 
@@ -122,6 +161,8 @@ namespace __dfsan {
 const dfsan_label kInitializingLabel = -1;
 
 void InitializeInterceptors();
+// frees the calling thread's saved alloca frames, e.g., at thread exit
+void ReleaseThreadFrameStack();
 
 inline dfsan_label *shadow_for(void *ptr) {
   return (dfsan_label *) ((((uptr) ptr) & ShadowMask()) << 2);
@@ -136,6 +177,18 @@ inline void *app_for(const dfsan_label *l) {
 }
 
 dfsan_label_info* get_label_info(dfsan_label label);
+dfsan_label_operands* get_label_operands(dfsan_label label);
+uptr union_table_size();
+
+// [lower, upper) of the object an Alloca label is the pointer label of, in
+// a table by label next to the union table, for the checks the pass inlines
+// (see __taint_check_bounds); any other label has an empty range and takes
+// the slow path, a freed label gets one
+struct label_bounds {
+  uptr lower;
+  uptr upper;
+};
+void set_label_bounds(dfsan_label label, uptr lower, uptr upper);
 
 struct Flags {
 #define DFSAN_FLAG(Type, Name, DefaultValue, Description) Type Name;
@@ -177,7 +230,9 @@ enum operators {
   fmemcmp   = last_llvm_op + 7,
   fsize     = last_llvm_op + 8,
   fatoi     = last_llvm_op + 9,
-  LastOp    = last_llvm_op + 10,
+  fstrlen   = last_llvm_op + 10,
+  fsum      = last_llvm_op + 11,
+  LastOp    = last_llvm_op + 12,
 };
 
 enum predicate {
@@ -210,6 +265,26 @@ static inline uint8_t get_const_result(uint64_t c1, uint64_t c2, uint32_t predic
   return 0;
 }
 
+// fstrlen summarizes a scan for the first stop byte (strlen, strchr,
+// memchr, strpbrk) over the input bytes in l2, a Load or a single byte;
+// op1 packs the stop bytes, op2 is the base returned pointer (0 for an
+// index, as strlen)
+#define FSTRLEN_MAX_STOPS 7
+#define FSTRLEN_NO_NUL    0x80
+
+static inline uint64_t fstrlen_stops(const char *stops, uint8_t num_stops,
+                                     bool nul_stops) {
+  uint64_t packed = num_stops | (nul_stops ? 0 : FSTRLEN_NO_NUL);
+  for (uint8_t i = 0; i < num_stops; i++)
+    packed |= (uint64_t)(uint8_t)stops[i] << (8 * (i + 1));
+  return packed;
+}
+
+// fsum summarizes a loop adding up input bytes at consecutive offsets,
+// each zero-extended to size bits, over the input bytes in l2, a Load or a
+// single byte; no concrete operands
+#define FSUM_MAX_BYTES 4096
+
 static inline bool is_commutative(unsigned char op) {
   switch(op) {
     case Not:
@@ -233,10 +308,14 @@ enum pipe_msg_type {
   memcmp_type = 2,
   fsize_type = 3,
   memerr_type = 4,
+  switch_type = 5,
 };
 
 #define F_ADD_CONS  0x1
 
+// memcmp content is in the blob area, a memcmp_blob_msg follows
+#define F_MEMCMP_BLOB 0x2
+
 #define F_MEMERR_UAF 0x1
 #define F_MEMERR_OLB 0x2
 #define F_MEMERR_OUB 0x4
@@ -265,12 +344,26 @@ struct gep_msg {
   int64_t current_offset;
 } __attribute__((packed));
 
+// case table of a switch, the condition value is in pipe_msg.result
+struct switch_msg {
+  uint32_t label;
+  uint32_t taken_label; // (condition == case) if a case is taken, else 0
+  uint32_t num_cases;
+  uint64_t cases[0];    // zero extended to 64 bits
+} __attribute__((packed));
+
 // saving the memcmp target
 struct memcmp_msg {
   uint32_t label;
   uint8_t content[0];
 } __attribute__((packed));
 
+// memcmp target stored in the shm blob area
+struct memcmp_blob_msg {
+  uint32_t label;
+  uint64_t offset;
+} __attribute__((packed));
+
 }  // namespace __dfsan
 
 #endif  // DFSAN_H
@@ -43,6 +43,8 @@
 #include <wchar.h>
 
 #include "dfsan.h"
+#include "lazy_shadow.h"
+#include "sparse_shadow.h"
 
 #include "sanitizer_common/sanitizer_common.h"
 #include "sanitizer_common/sanitizer_internal_defs.h"
@@ -65,12 +67,127 @@ static off_t current_stdin_offset = 0;
 
 static inline dfsan_label get_label_for(int fd, off_t offset) {
   // check if fd is stdin, if so, the label hasn't been pre-allocated
-  if (is_stdin_taint() || (fd ==0 && flags().force_stdin))
-    return dfsan_create_label(current_stdin_offset++);
+  if (is_stdin_taint() || (fd ==0 && flags().force_stdin)) {
+    off_t stdin_offset = current_stdin_offset++;
+    // bytes outside of taint_ranges stay concrete, as do those read
+    // before the marker
+    if (!is_taint_offset(stdin_offset) || !is_taint_active()) return CONST_LABEL;
+    return dfsan_create_label(stdin_offset);
+  }
+  else if (!is_taint_active()) return CONST_LABEL;
   // if fd is a tainted file, the label should have been pre-allocated
+  else if (uint32_t input = taint_get_file_input(fd))
+    return taint_input_label(input, offset);
+  else if (!is_taint_offset(offset)) return CONST_LABEL;
   else return (offset + CONST_OFFSET);
 }
 
+// labels of fd are the pre-allocated offset + CONST_OFFSET ones
+static inline bool has_preallocated_labels(int fd) {
+  return !(is_stdin_taint() || (fd == 0 && flags().force_stdin)) &&
+         taint_get_file_input(fd) == 0;
+}
+
+// the position of the tainted stream last read by the stdio wrappers, kept
+// as a counter so loops of fgetc and friends don't pay an ftell (a lock,
+// and often an lseek) per call; it's only trusted while the stream's buffer
+// pointers are where the wrapper left them, a seek, an ungetc or a read
+// that isn't wrapped moves them
+struct stream_pos {
+  FILE *stream;
+  char *read_ptr;
+  char *read_end;
+  off_t offset;
+  // the source the stream reads, looked up when the cursor moves to it or
+  // the taint state is reset (a new label epoch)
+  int fd;
+  bool preallocated;
+  uint32_t input;
+  u32 epoch;
+};
+static THREADLOCAL stream_pos __stream_pos;
+
+// the offset of stream if it reads the taint file, -1 otherwise
+static inline off_t stream_tell(FILE *stream) {
+  const stream_pos &p = __stream_pos;
+  // the cursor is only left on streams of the taint file
+  if (p.stream == stream && p.read_ptr == stream->_IO_read_ptr &&
+      p.read_end == stream->_IO_read_end && p.epoch == dfsan_label_epoch()) {
+    return p.offset;
+  }
+  if (!taint_get_file(fileno(stream))) return -1;
+  return ftell(stream);
+}
+
+// n bytes were read from offset, as returned by stream_tell
+static inline void stream_read(FILE *stream, off_t offset, size_t n) {
+  if (offset < 0) return;
+  stream_pos &p = __stream_pos;
+  u32 epoch = dfsan_label_epoch();
+  if (p.stream != stream || p.epoch != epoch) {
+    p.fd = fileno(stream);
+    p.preallocated = has_preallocated_labels(p.fd);
+    p.input = taint_get_file_input(p.fd);
+    p.epoch = epoch;
+  }
+  p.stream = stream;
+  p.read_ptr = stream->_IO_read_ptr;
+  p.read_end = stream->_IO_read_end;
+  p.offset = offset + (off_t)n;
+}
+
+// the label of the byte at offset of the stream at the cursor, as
+// get_label_for gives it, without looking its source up again
+static inline dfsan_label stream_label(off_t offset) {
+  const stream_pos &p = __stream_pos;
+  if (!p.preallocated) return get_label_for(p.fd, offset);
+  if (!is_taint_active()) return CONST_LABEL;
+  if (p.input) return taint_input_label(p.input, offset);
+  return is_taint_offset(offset) ? offset + CONST_OFFSET : CONST_LABEL;
+}
+
+// the int the getc wrappers last returned, as the label of the byte and
+// that of its zero extension; tokenizers read a byte again after each
+// ungetc, which then doesn't go through the union table
+struct getc_label {
+  dfsan_label byte;
+  dfsan_label ret;
+  u32 epoch;
+};
+static THREADLOCAL getc_label __getc_label;
+
+// getc_fn(stream), with the label of the byte it returns zero extended to
+// the int in *ret_label
+static ALWAYS_INLINE int stream_getc(FILE *stream, int (*getc_fn)(FILE *),
+                                     dfsan_label *ret_label) {
+  off_t offset = stream_tell(stream);
+  int ret = getc_fn(stream);
+  stream_read(stream, offset, ret != EOF);
+  dfsan_label label = CONST_LABEL;
+  if (ret != EOF) {
+    if (offset >= 0) {
+      label = stream_label(offset);
+    } else if (taint_get_file(fileno(stream))) {
+      // e.g., stdin from a pipe, which can't tell its position
+      label = get_label_for(fileno(stream), offset);
+    }
+  }
+  if (label == CONST_LABEL) {
+    *ret_label = 0;
+    return ret;
+  }
+  getc_label &last = __getc_label;
+  u32 epoch = dfsan_label_epoch();
+  if (last.byte != label || last.epoch != epoch) {
+    last.byte = label;
+    last.ret = dfsan_union(label, CONST_LABEL, ZExt, 32, 0, 0);
+    last.epoch = epoch;
+  }
+  *ret_label = last.ret;
+  AOUT("%d label is read by getc\n", *ret_label);
+  return ret;
+}
+
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE void
 __taint_trace_offset(dfsan_label offset_label, int64_t offset, unsigned size);
 
@@ -178,25 +295,38 @@ __dfsw_lstat(const char *path, struct stat *buf, dfsan_label path_label,
   return ret;
 }
 
+// one fstrlen label for a scan of the first n bytes of s, which stopped at
+// the last one (or ran out), rather than a union over the n bytes; only
+// bytes of the input at consecutive offsets can be summarized
+static const size_t kMaxScanBytes = 4096;
+
+static dfsan_label __taint_scan(const void *s, size_t n, const char *stops,
+                                size_t num_stops, bool nul_stops, uptr base) {
+  if (!flags().trace_string_scans || n == 0 || n > kMaxScanBytes ||
+      num_stops > FSTRLEN_MAX_STOPS) {
+    return 0;
+  }
+  dfsan_label l = dfsan_read_label(s, n);
+  if (l < CONST_OFFSET || l == kInitializingLabel) {
+    return 0;
+  }
+  dfsan_label_info *info = get_label_info(l);
+  if (!(n == 1 ? info->op == 0 : info->op == Load)) {
+    return 0;
+  }
+  return dfsan_union(0, l, fstrlen, 64,
+                     fstrlen_stops(stops, num_stops, nul_stops), base);
+}
+
 SANITIZER_INTERFACE_ATTRIBUTE char *__dfsw_strchr(char *s, int c,
                                                   dfsan_label s_label,
                                                   dfsan_label c_label,
                                                   dfsan_label *ret_label) {
-  *ret_label = 0;
-  return strchr(s, c);
-  /* FIXME
-  for (size_t i = 0;; ++i) {
-    if (s[i] == c || s[i] == 0) {
-      if (flags().strict_data_dependencies) {
-        *ret_label = s_label;
-      } else {
-        *ret_label = taint_union(taint_read_label(s, i + 1),
-                                 taint_union(s_label, c_label));
-      }
-      return s[i] == 0 ? nullptr : const_cast<char *>(s+i);
-    }
-  }
-  */
+  char *ret = strchr(s, c);
+  size_t n = (ret ? ret - s : strlen(s)) + 1;
+  char stop = (char)c;
+  *ret_label = c_label ? 0 : __taint_scan(s, n, &stop, 1, true, (uptr)s);
+  return ret;
 }
 
 SANITIZER_INTERFACE_ATTRIBUTE char *__dfsw_strpbrk(const char *s,
@@ -206,17 +336,13 @@ SANITIZER_INTERFACE_ATTRIBUTE char *__dfsw_strpbrk(const char *s,
                                                    dfsan_label *ret_label) {
   *ret_label = 0;
   const char *ret = strpbrk(s, accept);
-  /* FIXME
-  if (flags().strict_data_dependencies) {
-    *ret_label = ret ? s_label : 0;
-  } else {
-    size_t s_bytes_read = (ret ? ret - s : strlen(s)) + 1;
-    *ret_label =
-        dfsan_union(dfsan_read_label(s, s_bytes_read),
-                    dfsan_union(dfsan_read_label(accept, strlen(accept) + 1),
-                                dfsan_union(s_label, accept_label)));
+  // only a short, concrete set of stop bytes fits in the summary
+  size_t num_accept = strlen(accept);
+  if (num_accept <= FSTRLEN_MAX_STOPS &&
+      dfsan_read_label(accept, num_accept + 1) == 0) {
+    size_t n = (ret ? ret - s : strlen(s)) + 1;
+    *ret_label = __taint_scan(s, n, accept, num_accept, true, (uptr)s);
   }
-  */
   return const_cast<char *>(ret);
 }
 
@@ -361,21 +487,14 @@ __dfsw_strncasecmp(const char *s1, const char *s2, size_t n,
 SANITIZER_INTERFACE_ATTRIBUTE size_t
 __dfsw_strlen(const char *s, dfsan_label s_label, dfsan_label *ret_label) {
   size_t ret = strlen(s);
-  *ret_label = 0;
-  /*
-  if (flags().strict_data_dependencies) {
-    *ret_label = 0;
-  } else {
-    *ret_label = taint_read_label(s, ret + 1);
-  }*/
+  *ret_label = __taint_scan(s, ret + 1, nullptr, 0, true, 0);
   return ret;
 }
 
 static void *dfsan_memcpy(void *dest, const void *src, size_t n) {
   dfsan_label *sdest = shadow_for(dest);
   const dfsan_label *ssrc = shadow_for(src);
-  // FIXME: check and avoid copying labels?
-  internal_memcpy((void *)sdest, (const void *)ssrc, n * sizeof(dfsan_label));
+  copy_shadow(sdest, ssrc, n);
   return internal_memcpy(dest, src, n);
 }
 
@@ -400,12 +519,11 @@ void *__dfsw_memmove(void *dest, const void *src, size_t n,
                      dfsan_label n_label, dfsan_label *ret_label) {
   __taint_check_bounds(src_label, (uptr)src, n_label, n);
   __taint_check_bounds(dest_label, (uptr)dest, n_label, n);
-  dfsan_label tmp[n];
   dfsan_label *sdest = shadow_for(dest);
   const dfsan_label *ssrc = shadow_for(src);
-  internal_memcpy((void *)tmp, (const void *)ssrc, n * sizeof(dfsan_label));
+  // copy_shadow handles the overlap, no need for a temporary copy
+  copy_shadow(sdest, ssrc, n);
   void *ret = internal_memmove(dest, src, n);
-  internal_memcpy((void *)sdest, (const void *)tmp, n * sizeof(dfsan_label));
   *ret_label = dest_label;
   return ret;
 }
@@ -499,6 +617,7 @@ __dfsw_pread(int fd, void *buf, size_t count, off_t offset,
   *ret_label = 0;
   if (ret >= 0) {
     if (taint_get_file(fd)) {
+      taint_note_consumed(fd, offset + ret);
       for (ssize_t i = 0; i < ret; i++) {
         dfsan_set_label(get_label_for(fd, offset + i), (char *)buf + i, 1);
       }
@@ -522,6 +641,7 @@ __dfsw_read(int fd, void *buf, size_t count,
   if (ret >= 0) {
     if (taint_get_file(fd)) {
       AOUT("offset = %d, ret = %d\n", offset, ret);
+      taint_note_consumed(fd, offset + ret);
       for(ssize_t i = 0; i < ret; i++) {
         dfsan_set_label(get_label_for(fd, offset + i), (char *)buf + i, 1);
       }
@@ -575,8 +695,10 @@ static void *pthread_create_cb(void *p) {
   pthread_create_info pci(*(pthread_create_info *)p);
   free(p);
   dfsan_label ret_label;
-  return pci.start_routine_trampoline(pci.start_routine, pci.arg, 0,
-                                      &ret_label);
+  void *ret = pci.start_routine_trampoline(pci.start_routine, pci.arg, 0,
+                                           &ret_label);
+  ReleaseThreadFrameStack();
+  return ret;
 }
 
 SANITIZER_INTERFACE_ATTRIBUTE int __dfsw_pthread_create(
@@ -710,7 +832,7 @@ char *__dfsw_stpcpy(char *dest, const char *src, dfsan_label dest_label,
   __taint_check_bounds(dest_label, (uptr)dest, 0, len);
   char *ret = stpcpy(dest, src);
   if (ret) {
-    internal_memcpy(shadow_for(dest), shadow_for(src), sizeof(dfsan_label) * len);
+    copy_shadow(shadow_for(dest), shadow_for(src), len);
   }
   *ret_label = dest_label;
   return ret;
@@ -723,8 +845,7 @@ char *__dfsw_strcpy(char *dest, const char *src, dfsan_label dst_label,
   __taint_check_bounds(dst_label, (uptr)dest, 0, len);
   char *ret = strcpy(dest, src);
   if (ret) {
-    internal_memcpy(shadow_for(dest), shadow_for(src),
-                    sizeof(dfsan_label) * len);
+    copy_shadow(shadow_for(dest), shadow_for(src), len);
   }
   *ret_label = dst_label;
   return ret;
@@ -988,7 +1109,10 @@ int __dfsw_sigaction(int signum, const struct sigaction *act,
                      struct sigaction *oldact, dfsan_label signum_label,
                      dfsan_label act_label, dfsan_label oldact_label,
                      dfsan_label *ret_label) {
-  int ret = sigaction(signum, act, oldact);
+  int ret = 0;
+  // the lazy shadow handler stays installed and chains to the program's one
+  if (!lazy_shadow_sigaction(signum, act, oldact))
+    ret = sigaction(signum, act, oldact);
   if (oldact) {
     dfsan_set_label(0, oldact, sizeof(struct sigaction));
   }
@@ -1017,18 +1141,9 @@ SANITIZER_INTERFACE_ATTRIBUTE void *__dfsw_memchr(void *s, int c, size_t n,
                                                   dfsan_label n_label,
                                                   dfsan_label *ret_label) {
   void *ret = memchr(s, c, n);
-  /*
-  if (flags().strict_data_dependencies) {
-    *ret_label = ret ? s_label : 0;
-  } else {
-    size_t len =
-        ret ? reinterpret_cast<char *>(ret) - reinterpret_cast<char *>(s) + 1
-            : n;
-    *ret_label =
-        taint_union(taint_read_label(s, len), taint_union(s_label, c_label));
-  }
-  */
-  *ret_label = 0;
+  size_t len = ret ? (char *)ret - (char *)s + 1 : n;
+  char stop = (char)c;
+  *ret_label = c_label ? 0 : __taint_scan(s, len, &stop, 1, false, (uptr)s);
   return ret;
 }
 
@@ -1096,6 +1211,49 @@ SANITIZER_INTERFACE_ATTRIBUTE int __dfsw_connect(
   return ret;
 }
 
+SANITIZER_INTERFACE_ATTRIBUTE int __dfsw_bind(
+    int sockfd, const struct sockaddr *addr, socklen_t addrlen,
+    dfsan_label sockfd_label, dfsan_label addr_label, dfsan_label addrlen_label,
+    dfsan_label *ret_label) {
+  int ret = bind(sockfd, addr, addrlen);
+  if (ret == 0) {
+    taint_bind_socket(addr, addrlen, sockfd);
+  }
+  *ret_label = 0;
+  return ret;
+}
+
+static void accepted_socket(int sockfd, int ret, struct sockaddr *addr,
+                            socklen_t *addrlen, socklen_t alen) {
+  if (ret < 0) return;
+  taint_accept_socket(sockfd, ret);
+  // the peer address may be truncated to the buffer
+  if (addr) dfsan_set_label(0, addr, *addrlen < alen ? *addrlen : alen);
+  if (addrlen) dfsan_set_label(0, addrlen, sizeof(*addrlen));
+}
+
+SANITIZER_INTERFACE_ATTRIBUTE int __dfsw_accept(
+    int sockfd, struct sockaddr *addr, socklen_t *addrlen,
+    dfsan_label sockfd_label, dfsan_label addr_label, dfsan_label addrlen_label,
+    dfsan_label *ret_label) {
+  socklen_t alen = addrlen ? *addrlen : 0;
+  int ret = accept(sockfd, addr, addrlen);
+  accepted_socket(sockfd, ret, addr, addrlen, alen);
+  *ret_label = 0;
+  return ret;
+}
+
+SANITIZER_INTERFACE_ATTRIBUTE int __dfsw_accept4(
+    int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags,
+    dfsan_label sockfd_label, dfsan_label addr_label, dfsan_label addrlen_label,
+    dfsan_label flags_label, dfsan_label *ret_label) {
+  socklen_t alen = addrlen ? *addrlen : 0;
+  int ret = accept4(sockfd, addr, addrlen, flags);
+  accepted_socket(sockfd, ret, addr, addrlen, alen);
+  *ret_label = 0;
+  return ret;
+}
+
 
 SANITIZER_INTERFACE_ATTRIBUTE ssize_t __dfsw_recv(
     int sockfd, void *buf, size_t leng, int flags, dfsan_label sockfd_label,
@@ -1108,13 +1266,11 @@ SANITIZER_INTERFACE_ATTRIBUTE ssize_t __dfsw_recv(
   if (ret == 0 && readed > 0) ret = readed; // we actually readed something
 #endif
   if (ret > 0) {
-    off_t offset = taint_get_socket(sockfd);
-    if (offset >= 0) {
+    uint32_t input;
+    off_t offset = taint_claim_socket(sockfd, ret, &input);
+    if (offset >= 0 && is_taint_active()) {
       AOUT("recv: fd = %d, offset = %d, ret = %d\n", sockfd, offset, ret);
-      for (ssize_t i = 0; i < ret; i++) {
-        dfsan_set_label(dfsan_create_label(offset + i), (char *)buf + i, 1);
-      }
-      taint_update_socket_offset(sockfd, ret);
+      dfsan_set_labels(dfsan_create_labels(offset, input, ret), buf, ret);
     } else {
       // clear the label?
       dfsan_set_label(0, buf, ret);
@@ -1139,12 +1295,10 @@ SANITIZER_INTERFACE_ATTRIBUTE ssize_t __dfsw_recvfrom(
   if (ret == 0 && readed > 0) ret = readed; // we actually readed something
 #endif
   if (ret > 0) {
-    off_t offset = taint_get_socket(sockfd);
-    if (offset >= 0) {
-      for (ssize_t i = 0; i < ret; i++) {
-        dfsan_set_label(dfsan_create_label(offset + i), (char *)buf + i, 1);
-      }
-      taint_update_socket_offset(sockfd, ret);
+    uint32_t input;
+    off_t offset = taint_claim_socket(sockfd, ret, &input);
+    if (offset >= 0 && is_taint_active()) {
+      dfsan_set_labels(dfsan_create_labels(offset, input, ret), buf, ret);
     } else {
       // clear the label?
       dfsan_set_label(0, buf, ret);
@@ -1164,18 +1318,20 @@ SANITIZER_INTERFACE_ATTRIBUTE ssize_t __dfsw_recvmsg(
     // clear labels
     if (msg->msg_name) dfsan_set_label(0, msg->msg_name, msg->msg_namelen);
     if (msg->msg_control) dfsan_set_label(0, msg->msg_control, msg->msg_controllen);
-    off_t offset = taint_get_socket(sockfd);
+    // label the whole message at once, other connections may be read
+    // concurrently, and the iovecs get consecutive labels
+    uint32_t input;
+    off_t offset = ret > 0 ? taint_claim_socket(sockfd, ret, &input) : -1;
+    dfsan_label first = offset >= 0 && is_taint_active()
+                            ? dfsan_create_labels(offset, input, ret) : 0;
     for (size_t i = 0, bytes_written = ret; bytes_written > 0; ++i) {
       assert(i < msg->msg_iovlen);
       struct iovec *iov = &msg->msg_iov[i];
       size_t iov_written =
           bytes_written < iov->iov_len ? bytes_written : iov->iov_len;
-      if (offset >= 0) {
-        for (size_t j = 0; j < iov_written; ++j) {
-          dfsan_set_label(dfsan_create_label(offset + j), (char *)iov->iov_base + j, 1);
-        }
-        taint_update_socket_offset(sockfd, iov_written);
-        offset += iov_written;
+      if (first) {
+        dfsan_set_labels(first, iov->iov_base, iov_written);
+        first += iov_written;
       } else {
         dfsan_set_label(0, iov->iov_base, iov_written);
       }
@@ -1424,9 +1580,8 @@ static int format_buffer(char *str, size_t size, const char *fmt,
           char *arg = va_arg(ap, char *);
           retval = formatter.format(arg);
           va_labels++;
-          internal_memcpy(shadow_for(formatter.str_cur()), shadow_for(arg),
-                          sizeof(dfsan_label) *
-                              formatter.num_written_bytes(retval));
+          copy_shadow(shadow_for(formatter.str_cur()), shadow_for(arg),
+                      formatter.num_written_bytes(retval));
           end_fmt = true;
           break;
         }
@@ -1583,6 +1738,7 @@ __dfsw_freopen(const char *filename, const char *mode,
 SANITIZER_INTERFACE_ATTRIBUTE int
 __dfsw_close(int fd, dfsan_label fd_label, dfsan_label *ret_label) {
   taint_close_file(fd);
+  taint_close_socket(fd);
   *ret_label = 0;
   return close(fd);
 }
@@ -1590,6 +1746,8 @@ __dfsw_close(int fd, dfsan_label fd_label, dfsan_label *ret_label) {
 SANITIZER_INTERFACE_ATTRIBUTE int
 __dfsw_fclose(FILE *fp, dfsan_label fp_label, dfsan_label *ret_label) {
   int fd = fileno(fp);
+  if (__stream_pos.stream == fp) __stream_pos.stream = nullptr;
+  taint_note_consumed(fd, -1);
   int ret = fclose(fp);
   if (!ret) taint_close_file(fd);
   *ret_label = 0;
@@ -1603,7 +1761,7 @@ __dfsw_fread(void *ptr, size_t size, size_t nmemb, FILE *stream,
              dfsan_label *ret_label) {
   int fd = fileno(stream);
   off_t tfsize = taint_get_file(fd);
-  off_t offset = ftell(stream);
+  off_t offset = stream_tell(stream);
   *ret_label = 0;
 #if 0
   // check taint file size
@@ -1625,6 +1783,7 @@ __dfsw_fread(void *ptr, size_t size, size_t nmemb, FILE *stream,
 #endif
   __taint_check_bounds(ptr_label, (uptr)ptr, nmemb_label, size * nmemb);
   size_t ret = fread(ptr, size, nmemb, stream);
+  stream_read(stream, offset, ret * size);
   AOUT("fread(%u,%u) = %lld, off = %lld\n", size, nmemb, ret, offset);
   if (ret) {
     if (tfsize) {
@@ -1650,7 +1809,7 @@ __dfsw_fread_unlocked(
              dfsan_label *ret_label) {
   int fd = fileno(stream);
   off_t tfsize = taint_get_file(fd);
-  off_t offset = ftell(stream);
+  off_t offset = stream_tell(stream);
   *ret_label = 0;
 #if 0
   // check taint file size
@@ -1672,6 +1831,7 @@ __dfsw_fread_unlocked(
 #endif
   __taint_check_bounds(ptr_label, (uptr)ptr, nmemb_label, size * nmemb);
   size_t ret = fread_unlocked(ptr, size, nmemb, stream);
+  stream_read(stream, offset, ret * size);
   AOUT("fread(%u,%u) = %lld, off = %lld\n", size, nmemb, ret, offset);
   if (ret) {
     if (tfsize) {
@@ -1694,8 +1854,9 @@ __dfsw_getline(char **lineptr, size_t *n, FILE *stream,
                dfsan_label lineptr_label, dfsan_label n_label,
                dfsan_label stream_label, dfsan_label *ret_label) {
   int fd = fileno(stream);
-  off_t offset = ftell(stream);
+  off_t offset = stream_tell(stream);
   ssize_t ret = getline(lineptr, n, stream);
+  stream_read(stream, offset, ret > 0 ? ret : 0);
   *ret_label = 0;
   if (ret) {
     if (taint_get_file(fd)) {
@@ -1721,8 +1882,9 @@ __dfsw_getdelim(char **lineptr, size_t *n, int delim, FILE *stream,
                 dfsan_label delim_label, dfsan_label stream_label,
                 dfsan_label *ret_label) {
   int fd = fileno(stream);
-  off_t offset = ftell(stream);
+  off_t offset = stream_tell(stream);
   ssize_t ret = getdelim(lineptr, n, delim, stream);
+  stream_read(stream, offset, ret > 0 ? ret : 0);
   *ret_label = 0;
   if (ret) {
     if (taint_get_file(fd)) {
@@ -1747,8 +1909,9 @@ __dfsw___getdelim(char **lineptr, size_t *n, int delim, FILE *stream,
                   dfsan_label delim_label, dfsan_label stream_label,
                   dfsan_label *ret_label) {
   int fd = fileno(stream);
-  off_t offset = ftell(stream);
+  off_t offset = stream_tell(stream);
   ssize_t ret = __getdelim(lineptr, n, delim, stream);
+  stream_read(stream, offset, ret > 0 ? ret : 0);
   *ret_label = 0;
   if (ret) {
     if (taint_get_file(fd)) {
@@ -1768,9 +1931,10 @@ __dfsw___getdelim(char **lineptr, size_t *n, int delim, FILE *stream,
 
 SANITIZER_INTERFACE_ATTRIBUTE char*
 __dfsw_gets(char *str, dfsan_label str_label, dfsan_label *ret_label) {
-  off_t offset = ftell(stdin);
+  off_t offset = stream_tell(stdin);
   // gets discard until c11
   char *ret = fgets(str, sizeof(str), stdin);
+  stream_read(stdin, offset, ret ? strlen(ret) : 0);
   if (ret && taint_get_file(0)) {
     for (off_t i = 0; i <= strlen(ret); i++)
       dfsan_set_label(get_label_for(0, offset + i), ret + i, 1);
@@ -1817,9 +1981,10 @@ char *__dfsw_fgets(char *s, int size, FILE *stream, dfsan_label s_label,
                    dfsan_label size_label, dfsan_label stream_label,
                    dfsan_label *ret_label) {
   int fd = fileno(stream);
-  off_t offset = ftell(stream);
+  off_t offset = stream_tell(stream);
   __taint_check_bounds(s_label, (uptr)s, size_label, size);
   char *ret = fgets(s, size, stream);
+  stream_read(stream, offset, ret ? strlen(ret) : 0);
   if (ret) {
     if (taint_get_file(fd)) {
       // including terminating \0
@@ -1845,9 +2010,10 @@ char *__dfsw_fgets_unlocked(char *s, int size, FILE *stream, dfsan_label s_label
                    dfsan_label size_label, dfsan_label stream_label,
                    dfsan_label *ret_label) {
   int fd = fileno(stream);
-  off_t offset = ftell(stream);
+  off_t offset = stream_tell(stream);
   __taint_check_bounds(s_label, (uptr)s, size_label, size);
   char *ret = fgets_unlocked(s, size, stream);
+  stream_read(stream, offset, ret ? strlen(ret) : 0);
   if (ret) {
     if (taint_get_file(fd)) {
       // including terminating \0
@@ -1870,6 +2036,13 @@ char *__dfsw_fgets_unlocked(char *s, int size, FILE *stream, dfsan_label s_label
   return ret;
 }
 
+// the prefix of a reallocated chunk gets the old labels, only clear the rest
+static void clear_realloc_shadow(void *ret, size_t new_size, void *old) {
+  size_t keep = old ? malloc_usable_size(old) : 0;
+  if (keep > new_size) keep = new_size;
+  clear_shadow(shadow_for((char *)ret + keep), new_size - keep);
+}
+
 SANITIZER_INTERFACE_ATTRIBUTE void *
 __dfsw_realloc(void *ptr, size_t new_size,
                dfsan_label ptr_label, dfsan_label new_size_label,
@@ -1878,7 +2051,7 @@ __dfsw_realloc(void *ptr, size_t new_size,
   *ret_label = 0;
 
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * new_size);
+    clear_realloc_shadow(ret, new_size, ptr);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(0, new_size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + new_size);
@@ -1892,7 +2065,7 @@ __dfsw_realloc(void *ptr, size_t new_size,
       size_t size = malloc_usable_size(ptr);
       size = size < new_size ? size : new_size;
       internal_memcpy(ret, ptr, size);
-      internal_memcpy(shadow_for(ret), shadow_for(ptr), sizeof(dfsan_label) * size);
+      copy_shadow(shadow_for(ret), shadow_for(ptr), size);
     }
     if (flags().trace_bounds) {
       // mark old buffer as freed without truely free it
@@ -1900,7 +2073,10 @@ __dfsw_realloc(void *ptr, size_t new_size,
       if (info->op != Alloca) {
         AOUT("WARNING: wrong ptr op %d = %d\n", ptr_label, info->op);
         // Die();
-      } else info->op = Free;
+      } else {
+        info->op = Free;
+        set_label_bounds(ptr_label, 0, 0);
+      }
     } else {
       free(ptr);
     }
@@ -1921,7 +2097,7 @@ __dfsw___libc_realloc(void *ptr, size_t new_size,
   void *ret = malloc(new_size);
   *ret_label = 0;
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * new_size);
+    clear_realloc_shadow(ret, new_size, ptr);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(0, new_size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + new_size);
@@ -1935,7 +2111,7 @@ __dfsw___libc_realloc(void *ptr, size_t new_size,
       size_t size = malloc_usable_size(ptr);
       size = size < new_size ? size : new_size;
       internal_memcpy(ret, ptr, size);
-      internal_memcpy(shadow_for(ret), shadow_for(ptr), sizeof(dfsan_label) * size);
+      copy_shadow(shadow_for(ret), shadow_for(ptr), size);
     }
     if (flags().trace_bounds) {
       // mark old buffer as freed without truely free it
@@ -1943,7 +2119,10 @@ __dfsw___libc_realloc(void *ptr, size_t new_size,
       if (info->op != Alloca) {
         AOUT("WARNING: wrong ptr op %d = %d\n", ptr_label, info->op);
         // Die();
-      } else info->op = Free;
+      } else {
+        info->op = Free;
+        set_label_bounds(ptr_label, 0, 0);
+      }
     } else {
       free(ptr);
     }
@@ -1964,7 +2143,7 @@ void *__dfsw_reallocarray(void *ptr, size_t nmemb, size_t new_size,
   void *ret = calloc(nmemb, new_size);
   *ret_label = 0;
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * new_size * nmemb);
+    clear_realloc_shadow(ret, new_size * nmemb, ptr);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(nmemb_label, new_size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + (new_size * nmemb));
@@ -1978,7 +2157,7 @@ void *__dfsw_reallocarray(void *ptr, size_t nmemb, size_t new_size,
       size_t size = malloc_usable_size(ptr);
       size = size < new_size ? size : new_size * nmemb;
       internal_memcpy(ret, ptr, size);
-      internal_memcpy(shadow_for(ret), shadow_for(ptr), sizeof(dfsan_label) * size);
+      copy_shadow(shadow_for(ret), shadow_for(ptr), size);
     }
     if (flags().trace_bounds) {
       // mark old buffer as freed without truely free it
@@ -1986,7 +2165,10 @@ void *__dfsw_reallocarray(void *ptr, size_t nmemb, size_t new_size,
       if (info->op != Alloca) {
         AOUT("WARNING: wrong ptr op %d = %d\n", ptr_label, info->op);
         // Die();
-      } else info->op = Free;
+      } else {
+        info->op = Free;
+        set_label_bounds(ptr_label, 0, 0);
+      }
     } else {
       free(ptr);
     }
@@ -2006,7 +2188,7 @@ void *__dfsw___libc_reallocarray(void *ptr, size_t nmemb, size_t new_size,
                                  dfsan_label new_size_label, dfsan_label *ret_label) {
   void *ret = calloc(nmemb, new_size);
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * new_size * nmemb);
+    clear_realloc_shadow(ret, new_size * nmemb, ptr);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(nmemb_label, new_size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + (new_size * nmemb));
@@ -2020,7 +2202,7 @@ void *__dfsw___libc_reallocarray(void *ptr, size_t nmemb, size_t new_size,
       size_t size = malloc_usable_size(ptr);
       size = size < new_size ? size : new_size * nmemb;
       internal_memcpy(ret, ptr, size);
-      internal_memcpy(shadow_for(ret), shadow_for(ptr), sizeof(dfsan_label) * size);
+      copy_shadow(shadow_for(ret), shadow_for(ptr), size);
     }
     if (flags().trace_bounds) {
       // mark old buffer as freed without truely free it
@@ -2028,7 +2210,10 @@ void *__dfsw___libc_reallocarray(void *ptr, size_t nmemb, size_t new_size,
       if (info->op != Alloca) {
         AOUT("WARNING: wrong ptr op %d = %d\n", ptr_label, info->op);
         // Die();
-      } else info->op = Free;
+      } else {
+        info->op = Free;
+        set_label_bounds(ptr_label, 0, 0);
+      }
     } else {
       free(ptr);
     }
@@ -2049,7 +2234,7 @@ void *__dfsw_calloc(size_t nmemb, size_t size,
   void *ret = calloc(nmemb, size);
   *ret_label = 0;
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * size * nmemb);
+    clear_shadow(shadow_for(ret), size * nmemb);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(nmemb_label, size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + (size * nmemb));
@@ -2068,7 +2253,7 @@ void *__dfsw___libc_calloc(size_t nmemb, size_t size,
   void *ret = calloc(nmemb, size);
   *ret_label = 0;
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * size * nmemb);
+    clear_shadow(shadow_for(ret), size * nmemb);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(nmemb_label, size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + (size * nmemb));
@@ -2089,7 +2274,7 @@ void *__dfsw_malloc(size_t size, dfsan_label size_label,
   void *ret = malloc(size);
   *ret_label = 0;
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * size);
+    clear_shadow(shadow_for(ret), size);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(0, size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + size);
@@ -2106,7 +2291,7 @@ void *__dfsw___libc_malloc(size_t size, dfsan_label size_label,
   void *ret = malloc(size);
   *ret_label = 0;
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * size);
+    clear_shadow(shadow_for(ret), size);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(0, size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + size);
@@ -2124,7 +2309,7 @@ void *__dfsw_aligned_alloc(size_t alignment, size_t size,
   void *ret = aligned_alloc(alignment, size);
   *ret_label = 0;
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * size);
+    clear_shadow(shadow_for(ret), size);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(0, size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + size);
@@ -2142,7 +2327,7 @@ int __dfsw_posix_memalign(void **memptr, size_t alignment, size_t size,
   int ret = posix_memalign(memptr, alignment, size);
   *ret_label = 0;
   if (!ret && memptr && *memptr) {
-    internal_memset(shadow_for(*memptr), 0, sizeof(dfsan_label) * size);
+    clear_shadow(shadow_for(*memptr), size);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(0, size_label, Alloca, sizeof(*memptr) * 8,
           (uint64_t)(*memptr), (uint64_t)(*memptr) + size);
@@ -2158,7 +2343,7 @@ void *__dfsw_valloc(size_t size, dfsan_label size_label, dfsan_label *ret_label)
   void *ret = valloc(size);
   *ret_label = 0;
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * size);
+    clear_shadow(shadow_for(ret), size);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(0, size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + size);
@@ -2174,7 +2359,7 @@ void *__dfsw___libc_valloc(size_t size, dfsan_label size_label, dfsan_label *ret
   void *ret = valloc(size);
   *ret_label = 0;
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * size);
+    clear_shadow(shadow_for(ret), size);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(0, size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + size);
@@ -2191,7 +2376,7 @@ void *__dfsw_memalign(size_t alignment, size_t size, dfsan_label alignment_label
   void *ret = memalign(alignment, size);
   *ret_label = 0;
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * size);
+    clear_shadow(shadow_for(ret), size);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(0, size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + size);
@@ -2208,7 +2393,7 @@ void *__dfsw___libc_memalign(size_t alignment, size_t size, dfsan_label alignmen
   void *ret = memalign(alignment, size);
   *ret_label = 0;
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * size);
+    clear_shadow(shadow_for(ret), size);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(0, size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + size);
@@ -2224,7 +2409,7 @@ void *__dfsw_pvalloc(size_t size, dfsan_label size_label, dfsan_label *ret_label
   void *ret = pvalloc(size);
   *ret_label = 0;
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * size);
+    clear_shadow(shadow_for(ret), size);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(0, size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + size);
@@ -2240,7 +2425,7 @@ void *__dfsw___libc_pvalloc(size_t size, dfsan_label size_label, dfsan_label *re
   void *ret = pvalloc(size);
   *ret_label = 0;
   if (ret) {
-    internal_memset(shadow_for(ret), 0, sizeof(dfsan_label) * size);
+    clear_shadow(shadow_for(ret), size);
     if (flags().trace_bounds) {
       dfsan_label bound = dfsan_union(0, size_label, Alloca, sizeof(ret) * 8,
           (uint64_t)ret, (uint64_t)ret + size);
@@ -2260,7 +2445,10 @@ SANITIZER_INTERFACE_ATTRIBUTE void __dfsw_free(void *ptr, dfsan_label ptr_label)
     if (info->op != Alloca) {
       AOUT("WARNING: wrong ptr op %d = %d @%p\n", ptr_label, info->op, __builtin_return_address(0));
       // Die();
-    } else info->op = Free;
+    } else {
+      info->op = Free;
+      set_label_bounds(ptr_label, 0, 0);
+    }
   } else {
     free(ptr);
   }
@@ -2276,7 +2464,10 @@ void __dfsw___libc_free(void *ptr, dfsan_label ptr_label) {
     if (info->op != Alloca) {
       AOUT("WARNING: wrong ptr op %d = %d\n", ptr_label, info->op);
       // Die();
-    } else info->op = Free;
+    } else {
+      info->op = Free;
+      set_label_bounds(ptr_label, 0, 0);
+    }
   } else {
     free(ptr);
   }
@@ -2284,62 +2475,28 @@ void __dfsw___libc_free(void *ptr, dfsan_label ptr_label) {
 
 SANITIZER_INTERFACE_ATTRIBUTE int
 __dfsw_fgetc(FILE *stream, dfsan_label stream_label, dfsan_label *ret_label) {
-  int fd = fileno(stream);
-  off_t offset = ftell(stream);
-  int ret = fgetc(stream);
-  if (ret != EOF && taint_get_file(fd)) {
-    *ret_label = dfsan_union(get_label_for(fd, offset), CONST_LABEL, ZExt, 32, 0, 0);
-    AOUT("%d label is readed by fgetc\n", *ret_label);
-  } else *ret_label = 0;
-  return ret;
+  return stream_getc(stream, fgetc, ret_label);
 }
 
 SANITIZER_INTERFACE_ATTRIBUTE int
 __dfsw_getc(FILE *stream, dfsan_label stream_label, dfsan_label *ret_label) {
-  int fd = fileno(stream);
-  off_t offset = ftell(stream);
-  int ret = getc(stream);
-  if (ret != EOF && taint_get_file(fd)) {
-    *ret_label = dfsan_union(get_label_for(fd, offset), CONST_LABEL, ZExt, 32, 0, 0);
-    AOUT("%d label is readed by getc\n", *ret_label);
-  } else *ret_label = 0;
-  return ret;
+  return stream_getc(stream, getc, ret_label);
 }
 
 SANITIZER_INTERFACE_ATTRIBUTE int
 __dfsw_getc_unlocked(FILE *stream, dfsan_label stream_label,
                      dfsan_label *ret_label) {
-  int fd = fileno(stream);
-  off_t offset = ftell(stream);
-  int ret = getc_unlocked(stream);
-  if (ret != EOF && taint_get_file(fd)) {
-    *ret_label = dfsan_union(get_label_for(fd, offset), CONST_LABEL, ZExt, 32, 0, 0);
-    AOUT("%d label is readed by getc_unlocked\n", *ret_label);
-  } else *ret_label = 0;
-  return ret;
+  return stream_getc(stream, getc_unlocked, ret_label);
 }
 
 SANITIZER_INTERFACE_ATTRIBUTE int
 __dfsw__IO_getc(FILE *stream, dfsan_label stream_label, dfsan_label *ret_label) {
-  int fd = fileno(stream);
-  off_t offset = ftell(stream);
-  int ret = getc(stream);
-  if (ret != EOF && taint_get_file(fd)) {
-    *ret_label = dfsan_union(get_label_for(fd, offset), CONST_LABEL, ZExt, 32, 0, 0);
-    AOUT("%d label is readed by __IO_getc\n", *ret_label);
-  } else *ret_label = 0;
-  return ret;
+  return stream_getc(stream, getc, ret_label);
 }
 
 SANITIZER_INTERFACE_ATTRIBUTE int
 __dfsw_getchar(dfsan_label *ret_label) {
-  off_t offset = ftell(stdin);
-  int ret = getchar();
-  if (ret != EOF && taint_get_file(0)) {
-    *ret_label = dfsan_union(get_label_for(0, offset), CONST_LABEL, ZExt, 32, 0, 0);
-    AOUT("%d label is readed by getchar\n", *ret_label);
-  } else *ret_label = 0;
-  return ret;
+  return stream_getc(stdin, getc, ret_label);
 }
 
 SANITIZER_INTERFACE_ATTRIBUTE size_t
@@ -2366,11 +2523,22 @@ __dfsw_mmap(void *start, size_t length, int prot, int flags, int fd,
   void *ret = mmap(start, length, prot, flags, fd, offset);
   if (ret != MAP_FAILED) {
     off_t fsize = taint_get_file(fd);
+    // the new mapping may replace a lazily labelled one
+    lazy_shadow_unmap(ret, length);
     if (fsize) {
       AOUT("mmap tainted file at addr %p, offset: %lld, length %lld \n",
            ret, offset, length);
       size_t tainted_length = (offset + length) > fsize ? (fsize - offset)
                                                         : length;
+      taint_note_consumed(fd, offset + tainted_length);
+      uint32_t input = taint_get_file_input(fd);
+      if (__dfsan::flags().lazy_mmap_taint &&
+          (input || has_preallocated_labels(fd)) && is_taint_active() &&
+          lazy_shadow_map(ret, length, offset, tainted_length, input)) {
+        AOUT("lazy taint for %p, length %lld\n", ret, length);
+        *ret_label = 0;
+        return ret;
+      }
       for (size_t i = 0; i < tainted_length; i++)
         dfsan_set_label(get_label_for(fd, offset + i), (char *)ret + i, 1);
       for (size_t i = tainted_length; i < length; i++)
@@ -2389,7 +2557,10 @@ __dfsw_munmap(void *addr, size_t length, dfsan_label addr_label,
   // clear sth
   AOUT("munmap, addr %p, length %lld \n", addr, length);
   int ret = munmap(addr, length);
-  if (!ret) dfsan_set_label(0, addr, length);
+  if (!ret) {
+    lazy_shadow_unmap(addr, length);
+    dfsan_set_label(0, addr, length);
+  }
   *ret_label = 0;
   return ret;
 }
@@ -2398,6 +2569,7 @@ SANITIZER_INTERFACE_ATTRIBUTE off_t
 __dfsw_lseek(int fd, off_t offset, int whence, dfsan_label fd_label,
              dfsan_label offset_label, dfsan_label whence_label,
              dfsan_label *ret_label) {
+  taint_note_consumed(fd, -1);
   off_t ret = lseek(fd, offset, whence);
   if (ret != (off_t)-1) {
     if (taint_get_file(fd)) {
@@ -2416,6 +2588,7 @@ __dfsw_fseek(FILE *stream, long offset, int whence, dfsan_label stream_label,
              dfsan_label offset_label, dfsan_label whence_label,
              dfsan_label *ret_label) {
   int fd = fileno(stream);
+  taint_note_consumed(fd, -1);
   int ret = fseek(stream, offset, whence);
   *ret_label = 0;
   if (ret == 0 && taint_get_file(fd)) {
@@ -2432,6 +2605,7 @@ __dfsw_fseeko(FILE *stream, off_t offset, int whence, dfsan_label stream_label,
              dfsan_label offset_label, dfsan_label whence_label,
              dfsan_label *ret_label) {
   int fd = fileno(stream);
+  taint_note_consumed(fd, -1);
   int ret = fseeko(stream, offset, whence);
   *ret_label = 0;
   if (ret == 0 && taint_get_file(fd)) {
@@ -2448,6 +2622,7 @@ __dfsw_fseeko64(FILE *stream, off64_t offset, int whence, dfsan_label stream_lab
              dfsan_label offset_label, dfsan_label whence_label,
              dfsan_label *ret_label) {
   int fd = fileno(stream);
+  taint_note_consumed(fd, -1);
   int ret = fseeko64(stream, offset, whence);
   *ret_label = 0;
   if (ret == 0 && taint_get_file(fd)) {
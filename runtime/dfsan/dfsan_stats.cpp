@@ -0,0 +1,65 @@
+#include "sanitizer_common/sanitizer_atomic.h"
+#include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_libc.h"
+
+#include "dfsan_stats.h"
+
+using namespace __sanitizer;
+
+namespace __dfsan {
+
+// threads past the last slot share it, their counts are only approximate
+static const u32 kMaxStatThreads = 64;
+
+bool stats_enabled = false;
+static runtime_stats stats_slots[kMaxStatThreads];
+static atomic_uint32_t num_stat_slots;
+static THREADLOCAL runtime_stats *tls_stats;
+
+static const char *const stat_desc[] = {
+#define DFSAN_STAT_DESC(name, desc) desc,
+  DFSAN_STATS(DFSAN_STAT_DESC)
+#undef DFSAN_STAT_DESC
+};
+
+runtime_stats *thread_stats() {
+  if (UNLIKELY(!tls_stats)) {
+    u32 slot = atomic_fetch_add(&num_stat_slots, 1, memory_order_relaxed);
+    tls_stats = &stats_slots[Min(slot, kMaxStatThreads - 1)];
+  }
+  return tls_stats;
+}
+
+void InitializeStats(bool enable) {
+  stats_enabled = enable;
+}
+
+void PrintStats() {
+  if (!stats_enabled)
+    return;
+  u32 n = Min(atomic_load(&num_stat_slots, memory_order_relaxed), kMaxStatThreads);
+  runtime_stats total;
+  internal_memset(&total, 0, sizeof(total));
+  for (u32 t = 0; t < n; t++) {
+    for (int i = 0; i < kNumStats; i++)
+      total.counters[i] += stats_slots[t].counters[i];
+    for (int i = 0; i < kNumStatOps; i++)
+      total.labels_by_op[i] += stats_slots[t].labels_by_op[i];
+  }
+
+  Printf("==%d== DFSan runtime stats (%u threads)\n", internal_getpid(), n);
+  for (int i = 0; i < kNumStats; i++)
+    Printf("  %-48s %llu\n", stat_desc[i], total.counters[i]);
+  u64 lookups = total.counters[kStat_hash_lookups];
+  u64 probes = total.counters[kStat_hash_probes];
+  if (lookups)
+    Printf("  %-48s %llu.%02llu\n", "hashtable buckets per lookup",
+           probes / lookups, probes * 100 / lookups % 100);
+  Printf("  new labels by op:\n");
+  for (int i = 0; i < kNumStatOps; i++) {
+    if (total.labels_by_op[i])
+      Printf("    op %3d: %llu\n", i, total.labels_by_op[i]);
+  }
+}
+
+} // namespace __dfsan
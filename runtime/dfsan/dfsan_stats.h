@@ -0,0 +1,65 @@
+#ifndef DFSAN_STATS_H
+#define DFSAN_STATS_H
+
+#include "sanitizer_common/sanitizer_internal_defs.h"
+
+using __sanitizer::u16;
+using __sanitizer::u64;
+
+namespace __dfsan {
+
+// Cheap per-thread counters for the runtime hot paths, enabled with the
+// print_stats flag and printed at exit.
+#define DFSAN_STATS(X)                                                \
+  X(union_calls,       "__taint_union calls")                         \
+  X(union_hits,        "__taint_union dedup hits")                    \
+  X(union_new,         "__taint_union new labels")                    \
+  X(union_capped,      "__taint_union concretized over the AST caps") \
+  X(hash_lookups,      "hashtable lookups")                           \
+  X(hash_probes,       "hashtable buckets probed")                    \
+  X(hash_inserts,      "hashtable inserts")                           \
+  X(load_fast_const,   "union_load fast path: constant/bounds")       \
+  X(load_fast_shape,   "union_load fast path: input shape")           \
+  X(load_fast_extract, "union_load fast path: extracts of a parent")  \
+  X(load_inline_shape, "union_load_shape: consecutive input labels")  \
+  X(load_slow,         "union_load slow path")                        \
+  X(store_fast_const,  "union_store fast path: constant/bounds")      \
+  X(store_fast_byte,   "union_store fast path: single byte")          \
+  X(store_fast_load,   "union_store fast path: break up a load")      \
+  X(store_fast_memo,   "union_store fast path: memoized extracts")    \
+  X(store_extract,     "union_store default: new extracts")           \
+  X(cond_sampled,      "cond events dropped by branch_sample_after")
+
+enum stat_kind {
+#define DFSAN_STAT_ENUM(name, desc) kStat_##name,
+  DFSAN_STATS(DFSAN_STAT_ENUM)
+#undef DFSAN_STAT_ENUM
+  kNumStats
+};
+
+static const int kNumStatOps = 256;
+
+struct runtime_stats {
+  u64 counters[kNumStats];
+  u64 labels_by_op[kNumStatOps]; // new labels, indexed by the low byte of op
+};
+
+extern bool stats_enabled;
+runtime_stats *thread_stats();
+
+inline void stat_inc(stat_kind kind, u64 n = 1) {
+  if (UNLIKELY(stats_enabled))
+    thread_stats()->counters[kind] += n;
+}
+
+inline void stat_new_label(u16 op) {
+  if (UNLIKELY(stats_enabled))
+    thread_stats()->labels_by_op[op & (kNumStatOps - 1)]++;
+}
+
+void InitializeStats(bool enable);
+void PrintStats();
+
+} // namespace __dfsan
+
+#endif // DFSAN_STATS_H
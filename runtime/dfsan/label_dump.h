@@ -0,0 +1,41 @@
+#ifndef DFSAN_LABEL_DUMP_H
+#define DFSAN_LABEL_DUMP_H
+
+#include <stdint.h>
+
+/// The labels written by dfsan_dump_labels, e.g., with dump_labels_at_exit.
+/// The header is in the first page, followed by either:
+/// - the label infos of labels [0, num_labels) at infos_offset, then their
+///   operands at operands_offset, both raw and page aligned, so they can be
+///   mmapped and indexed by label like the union table; or
+/// - with LABEL_DUMP_DELTA, a stream of labels [1, num_labels) at
+///   infos_offset, each as:
+///     varint l1, l2   0, or zigzag(label - operand) + 1, small as labels
+///                     mostly point to the ones right before them
+///     varint op, size
+///     u32 hash
+///     varint op1, op2
+///   operands_offset is then the end of the stream.
+
+#define LABEL_DUMP_MAGIC 0x31504d55444c53ULL  // "SLDUMP1"
+#define LABEL_DUMP_VERSION 1
+#define LABEL_DUMP_DELTA 1
+#define LABEL_DUMP_ALIGN 4096UL
+
+struct label_dump_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t flags;
+  uint32_t num_labels;   // labels [0, num_labels), 0 is never used
+  uint32_t info_size;    // sizeof(dfsan_label_info)
+  uint32_t operands_size; // sizeof(dfsan_label_operands)
+  uint32_t reserved;
+  uint64_t infos_offset;
+  uint64_t operands_offset;
+};
+
+static inline uint64_t label_dump_align(uint64_t size) {
+  return (size + LABEL_DUMP_ALIGN - 1) & ~(LABEL_DUMP_ALIGN - 1);
+}
+
+#endif  // DFSAN_LABEL_DUMP_H
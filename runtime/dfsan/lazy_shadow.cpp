@@ -0,0 +1,235 @@
+#include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_libc.h"
+#include "sanitizer_common/sanitizer_mutex.h"
+#include "sanitizer_common/sanitizer_posix.h"
+
+#include "dfsan.h"
+#include "lazy_shadow.h"
+#include "sparse_shadow.h"
+
+#include <sys/mman.h>
+
+using namespace __sanitizer;
+
+namespace __dfsan {
+
+static const int kMaxLazyRegions = 64;
+
+struct lazy_region {
+  uptr shadow_beg;      // page aligned
+  uptr shadow_end;
+  uptr length;          // length of the mapping
+  uptr tainted_length;  // bytes backed by the taint file
+  off_t offset;         // file offset of the mapping
+  uint32_t input;       // as taint_get_file_input() of the file
+  bool active;
+};
+
+static lazy_region regions[kMaxLazyRegions];
+static StaticSpinMutex regions_lock;
+static struct sigaction chained_action;
+static bool lazy_enabled;
+
+// the pre-allocated label of the byte at offset of the input, as the read
+// wrappers' get_label_for gives it
+static dfsan_label file_label(uint32_t input, off_t offset) {
+  if (input)
+    return taint_input_label(input, offset);
+  return is_taint_offset(offset) ? offset + CONST_OFFSET : CONST_LABEL;
+}
+
+static void fill_shadow_page(const lazy_region &r, uptr page, dfsan_label *out,
+                             uptr page_size) {
+  uptr first = (page - r.shadow_beg) / sizeof(dfsan_label);
+  for (uptr i = 0; i < page_size / sizeof(dfsan_label); i++) {
+    uptr off = first + i;
+    if (off < r.tainted_length)
+      out[i] = file_label(r.input, r.offset + off);
+    else if (off < r.length)
+      out[i] = kInitializingLabel;
+    else
+      out[i] = 0;
+  }
+}
+
+// Populates the shadow page containing addr if it belongs to a lazy range.
+static bool handle_fault(uptr addr) {
+  const uptr page_size = GetPageSizeCached();
+  SpinMutexLock l(&regions_lock);
+  for (int i = 0; i < kMaxLazyRegions; i++) {
+    const lazy_region &r = regions[i];
+    if (!r.active || addr < r.shadow_beg || addr >= r.shadow_end)
+      continue;
+    uptr page = RoundDownTo(addr, page_size);
+    // another thread may have populated it while we waited for the lock
+    unsigned char vec;
+    if (mincore((void *)page, page_size, &vec) == 0 && (vec & 1))
+      return true;
+    // fill a private page and move it over the shadow in one step, so other
+    // threads never see a half filled shadow page
+    void *tmp = mmap(nullptr, page_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (tmp != MAP_FAILED) {
+      fill_shadow_page(r, page, (dfsan_label *)tmp, page_size);
+      if (mremap(tmp, page_size, page_size, MREMAP_MAYMOVE | MREMAP_FIXED,
+                 (void *)page) != MAP_FAILED)
+        return true;
+      munmap(tmp, page_size);
+    }
+    // likely out of mappings (vm.max_map_count), fill in place
+    if (internal_mprotect((void *)page, page_size, PROT_READ | PROT_WRITE) != 0)
+      return false;
+    fill_shadow_page(r, page, (dfsan_label *)page, page_size);
+    return true;
+  }
+  return false;
+}
+
+static void lazy_segv_handler(int signum, siginfo_t *info, void *ctx) {
+  if (handle_fault((uptr)info->si_addr))
+    return;
+  // not ours, hand it over to the program's handler or the default action
+  if (chained_action.sa_flags & SA_SIGINFO) {
+    if (chained_action.sa_sigaction) {
+      chained_action.sa_sigaction(signum, info, ctx);
+      return;
+    }
+  } else if (chained_action.sa_handler != SIG_DFL &&
+             chained_action.sa_handler != SIG_IGN) {
+    chained_action.sa_handler(signum);
+    return;
+  }
+  // re-executing the faulting instruction terminates the program
+  struct sigaction dfl;
+  internal_memset(&dfl, 0, sizeof(dfl));
+  dfl.sa_handler = SIG_DFL;
+  sigaction(SIGSEGV, &dfl, nullptr);
+}
+
+void InitializeLazyShadow() {
+  struct sigaction act;
+  internal_memset(&act, 0, sizeof(act));
+  act.sa_sigaction = lazy_segv_handler;
+  act.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+  sigemptyset(&act.sa_mask);
+  if (sigaction(SIGSEGV, &act, &chained_action) != 0) {
+    Report("WARNING: failed to install SIGSEGV handler, lazy mmap taint disabled\n");
+    return;
+  }
+  lazy_enabled = true;
+}
+
+// Makes [beg, end) of the shadow accessible again, dropping what's in it.
+static void unprotect_shadow(uptr beg, uptr end) {
+  internal_mprotect((void *)beg, end - beg, PROT_READ | PROT_WRITE);
+  ReleaseMemoryPagesToOS(beg, end);
+}
+
+bool lazy_shadow_map(void *addr, uptr length, off_t offset, uptr tainted_length,
+                     uint32_t input) {
+  const uptr page_size = GetPageSizeCached();
+  if (!lazy_enabled || !IsAligned((uptr)addr, page_size) || length == 0)
+    return false;
+  lazy_shadow_unmap(addr, length);
+  uptr beg = (uptr)shadow_for(addr);
+  uptr end = (uptr)shadow_for((char *)addr + RoundUpTo(length, page_size));
+  SpinMutexLock l(&regions_lock);
+  for (int i = 0; i < kMaxLazyRegions; i++) {
+    lazy_region &r = regions[i];
+    if (r.active)
+      continue;
+    // stale labels must not survive, and untouched pages must be non-resident
+    ReleaseMemoryPagesToOS(beg, end);
+    if (internal_mprotect((void *)beg, end - beg, PROT_NONE) != 0)
+      return false;
+    // the pages are filled behind the bitmap's back
+    shadow_mark_dirty((dfsan_label *)beg, (end - beg) / sizeof(dfsan_label));
+    r.shadow_beg = beg;
+    r.shadow_end = end;
+    r.length = length;
+    r.tainted_length = tainted_length;
+    r.offset = offset;
+    r.input = input;
+    r.active = true;
+    return true;
+  }
+  return false;
+}
+
+// drops the first bytes of the shadow of r, up to the shadow address beg
+static void trim_front(lazy_region &r, uptr beg) {
+  uptr n = (beg - r.shadow_beg) / sizeof(dfsan_label);
+  r.shadow_beg = beg;
+  r.offset += n;
+  r.length = r.length > n ? r.length - n : 0;
+  r.tainted_length = r.tainted_length > n ? r.tainted_length - n : 0;
+}
+
+void lazy_shadow_unmap(void *addr, uptr length) {
+  if (!lazy_enabled)
+    return;
+  const uptr page_size = GetPageSizeCached();
+  uptr beg = RoundDownTo((uptr)shadow_for(addr), page_size);
+  uptr end = RoundUpTo((uptr)shadow_for((char *)addr + length), page_size);
+  SpinMutexLock l(&regions_lock);
+  for (int i = 0; i < kMaxLazyRegions; i++) {
+    lazy_region &r = regions[i];
+    if (!r.active || end <= r.shadow_beg || beg >= r.shadow_end)
+      continue;
+    uptr b = Max(beg, r.shadow_beg);
+    uptr e = Min(end, r.shadow_end);
+    // the caller resets the labels of the range anyway
+    unprotect_shadow(b, e);
+    if (b == r.shadow_beg && e == r.shadow_end) {
+      r.active = false;
+    } else if (b == r.shadow_beg) {
+      trim_front(r, e);
+    } else if (e == r.shadow_end) {
+      r.shadow_end = b;
+    } else {
+      // a hole in the middle, the rest past it becomes a region of its own
+      lazy_region tail = r;
+      trim_front(tail, e);
+      r.shadow_end = b;
+      int j = 0;
+      while (j < kMaxLazyRegions && regions[j].active) j++;
+      if (j < kMaxLazyRegions) {
+        regions[j] = tail;
+        // past i, the loop may look at it, but it doesn't overlap the hole
+        continue;
+      }
+      // no slot left, label the rest now
+      internal_mprotect((void *)tail.shadow_beg, tail.shadow_end - tail.shadow_beg,
+                        PROT_READ | PROT_WRITE);
+      for (uptr page = tail.shadow_beg; page < tail.shadow_end; page += page_size)
+        fill_shadow_page(tail, page, (dfsan_label *)page, page_size);
+    }
+  }
+}
+
+void lazy_shadow_reset() {
+  if (!lazy_enabled)
+    return;
+  SpinMutexLock l(&regions_lock);
+  for (int i = 0; i < kMaxLazyRegions; i++) {
+    lazy_region &r = regions[i];
+    if (!r.active)
+      continue;
+    unprotect_shadow(r.shadow_beg, r.shadow_end);
+    r.active = false;
+  }
+}
+
+bool lazy_shadow_sigaction(int signum, const struct sigaction *act,
+                           struct sigaction *oldact) {
+  if (!lazy_enabled || signum != SIGSEGV)
+    return false;
+  SpinMutexLock l(&regions_lock);
+  if (oldact)
+    *oldact = chained_action;
+  if (act)
+    chained_action = *act;
+  return true;
+}
+
+} // namespace __dfsan
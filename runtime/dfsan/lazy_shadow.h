@@ -0,0 +1,40 @@
+#ifndef LAZY_SHADOW_H
+#define LAZY_SHADOW_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sanitizer_common/sanitizer_internal_defs.h"
+
+using __sanitizer::uptr;
+
+namespace __dfsan {
+
+// On-demand labelling of mmapped taint file ranges. Instead of writing one
+// label per byte at mmap time, the shadow of the mapping is protected and
+// each shadow page is filled on its first access from the SIGSEGV handler.
+// Only usable when the file labels are pre-allocated, i.e., not for stdin.
+
+void InitializeLazyShadow();
+
+// Returns false if the range can not be handled lazily, the caller must
+// then label it eagerly. Bytes past tainted_length get kInitializingLabel,
+// the others the labels of input (see taint_get_file_input) at their offset.
+bool lazy_shadow_map(void *addr, uptr length, off_t offset, uptr tainted_length,
+                     uint32_t input);
+// Forgets [addr, addr + length) of the ranges, their shadow there becomes
+// accessible (and zero where it was never touched); the rest of them stays
+// lazy.
+void lazy_shadow_unmap(void *addr, uptr length);
+// Drops all ranges, e.g., when the labels are reset.
+void lazy_shadow_reset();
+
+// Keeps our SIGSEGV handler in place when the program installs its own one,
+// which is then chained. Returns false if signum is not handled here.
+bool lazy_shadow_sigaction(int signum, const struct sigaction *act,
+                           struct sigaction *oldact);
+
+} // namespace __dfsan
+
+#endif // LAZY_SHADOW_H
@@ -0,0 +1,116 @@
+#include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_libc.h"
+
+#include "dfsan.h"
+#include "sparse_shadow.h"
+#include "union_simd.h"
+
+using namespace __sanitizer;
+
+namespace __dfsan {
+
+#if DFSAN_SPARSE_SHADOW
+
+// one bit per granule of shadow (64 bytes of app memory), the shadow lives
+// below the hashtable. Granules are smaller than pages so that clearing a
+// heap chunk can skip the parts that never held a label.
+static const uptr kGranuleShift = 8;
+static const uptr kGranuleLabels = (1 << kGranuleShift) / sizeof(dfsan_label);
+static u8 *shadow_bitmap;
+static uptr shadow_bitmap_size;
+
+void InitializeShadowBitmap() {
+  shadow_bitmap_size = RoundUpTo(HashTableAddr() >> (kGranuleShift + 3),
+                                 GetPageSizeCached());
+  shadow_bitmap = (u8 *)MmapNoReserveOrDie(shadow_bitmap_size, "shadow bitmap");
+}
+
+void shadow_bitmap_reset() {
+  ReleaseMemoryPagesToOS((uptr)shadow_bitmap,
+                         (uptr)shadow_bitmap + shadow_bitmap_size);
+}
+
+static inline bool granule_dirty(uptr g) {
+  return __atomic_load_n(&shadow_bitmap[g >> 3], __ATOMIC_RELAXED) & (1 << (g & 7));
+}
+
+bool shadow_is_clean(const dfsan_label *ls, uptr n) {
+  if (n == 0)
+    return true;
+  uptr g = (uptr)ls >> kGranuleShift;
+  uptr end = (((uptr)(ls + n) - 1) >> kGranuleShift) + 1;
+  while (g < end) {
+    // whole bitmap bytes at a time for large ranges
+    if ((g & 7) == 0 && g + 8 <= end) {
+      if (__atomic_load_n(&shadow_bitmap[g >> 3], __ATOMIC_RELAXED))
+        return false;
+      g += 8;
+      continue;
+    }
+    if (granule_dirty(g))
+      return false;
+    g++;
+  }
+  return true;
+}
+
+void shadow_mark_dirty(const dfsan_label *ls, uptr n) {
+  if (n == 0)
+    return;
+  uptr beg = (uptr)ls >> kGranuleShift;
+  uptr end = ((uptr)(ls + n) - 1) >> kGranuleShift;
+  for (uptr g = beg; g <= end; g++) {
+    // read first, so marking a dirty granule doesn't dirty the bitmap page
+    if (!granule_dirty(g))
+      __atomic_fetch_or(&shadow_bitmap[g >> 3], (u8)(1 << (g & 7)),
+                        __ATOMIC_RELAXED);
+  }
+}
+
+void clear_shadow(dfsan_label *ls, uptr n) {
+  if (n == 0)
+    return;
+  dfsan_label *end = ls + n;
+  uptr g = (uptr)ls >> kGranuleShift;
+  uptr last = ((uptr)end - 1) >> kGranuleShift;
+  while (g <= last) {
+    if ((g & 7) == 0 && g + 7 <= last &&
+        !__atomic_load_n(&shadow_bitmap[g >> 3], __ATOMIC_RELAXED)) {
+      g += 8;
+      continue;
+    }
+    if (granule_dirty(g)) {
+      dfsan_label *gbeg = (dfsan_label *)(g << kGranuleShift);
+      dfsan_label *gend = gbeg + kGranuleLabels;
+      dfsan_label *b = gbeg < ls ? ls : gbeg;
+      dfsan_label *e = gend > end ? end : gend;
+      __taint::labels_clear(b, e - b);
+      // only a granule owned by the range as a whole becomes clean again,
+      // the others may be shared with the neighbors (e.g., heap chunks)
+      if (b == gbeg && e == gend)
+        __atomic_fetch_and(&shadow_bitmap[g >> 3], (u8)~(1 << (g & 7)),
+                           __ATOMIC_RELAXED);
+    }
+    g++;
+  }
+}
+
+#else
+
+void clear_shadow(dfsan_label *ls, uptr n) {
+  __taint::labels_clear(ls, n);
+}
+
+#endif
+
+void copy_shadow(dfsan_label *dst, const dfsan_label *src, uptr n) {
+  if (shadow_is_clean(src, n)) {
+    clear_shadow(dst, n);
+    return;
+  }
+  shadow_mark_dirty(dst, n);
+  // untainted blocks are skipped
+  __taint::labels_move(dst, src, n);
+}
+
+} // namespace __dfsan
@@ -0,0 +1,40 @@
+#ifndef SPARSE_SHADOW_H
+#define SPARSE_SHADOW_H
+
+#include "sanitizer_common/sanitizer_internal_defs.h"
+#include "dfsan.h"
+
+using __sanitizer::uptr;
+
+namespace __dfsan {
+
+// With DFSAN_SPARSE_SHADOW (SYMSAN_SPARSE_SHADOW in cmake), a bitmap keeps
+// track of the shadow granules (64 bytes of app memory) that held a non-zero
+// label since they were last cleared. Loads from clean granules return 0,
+// zero stores to them are dropped without touching the shadow, so the
+// shadow of untainted memory is never mapped in, and clearing the shadow of
+// a new heap chunk only touches the granules that got tainted. All
+// non-zero shadow writes of the runtime must go through shadow_mark_dirty
+// (or copy_shadow), the instrumentation leaves shadow writes to the runtime
+// with -taint-sparse-shadow.
+
+#if DFSAN_SPARSE_SHADOW
+void InitializeShadowBitmap();
+void shadow_bitmap_reset();
+bool shadow_is_clean(const dfsan_label *ls, uptr n);
+void shadow_mark_dirty(const dfsan_label *ls, uptr n);
+#else
+inline void InitializeShadowBitmap() {}
+inline void shadow_bitmap_reset() {}
+inline bool shadow_is_clean(const dfsan_label *ls, uptr n) { return false; }
+inline void shadow_mark_dirty(const dfsan_label *ls, uptr n) {}
+#endif
+
+// dst[i] = src[i] for i < n, the ranges may overlap
+void copy_shadow(dfsan_label *dst, const dfsan_label *src, uptr n);
+// ls[i] = 0 for i < n, granules covered as a whole become clean
+void clear_shadow(dfsan_label *ls, uptr n);
+
+} // namespace __dfsan
+
+#endif // SPARSE_SHADOW_H
@@ -0,0 +1,102 @@
+#include "sanitizer_common/sanitizer_atomic.h"
+#include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_file.h"
+#include "sanitizer_common/sanitizer_libc.h"
+#include "sanitizer_common/sanitizer_stacktrace.h"
+#include "sanitizer_common/sanitizer_symbolizer.h"
+
+#include "taint_profile.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+
+using namespace __sanitizer;
+
+namespace __dfsan {
+
+// distinct call sites, open addressing on the pc, lock-free as the entry
+// points are called from every thread; sites past the capacity are dropped
+static const uptr kMaxProfileSites = 1 << 16;
+
+bool profile_enabled = false;
+static const char *profile_path;
+static atomic_uintptr_t profile_sites[kMaxProfileSites];
+static atomic_uint8_t profile_full;
+
+void profile_record(uptr pc) {
+  uptr h = (pc * 0x9e3779b97f4a7c15ULL) >> 48;
+  for (uptr i = 0; i < kMaxProfileSites; i++) {
+    atomic_uintptr_t *slot = &profile_sites[(h + i) & (kMaxProfileSites - 1)];
+    uptr cur = atomic_load(slot, memory_order_relaxed);
+    if (cur == pc)
+      return;
+    if (cur == 0) {
+      if (atomic_compare_exchange_strong(slot, &cur, pc, memory_order_relaxed) ||
+          cur == pc)
+        return;
+    }
+  }
+  atomic_store(&profile_full, 1, memory_order_relaxed);
+}
+
+void InitializeProfile(const char *path) {
+  if (internal_strcmp(path, "") == 0)
+    return;
+  profile_path = path;
+  profile_enabled = true;
+  // the pass matches the ABI list against the mangled names, set before
+  // the symbolizer is started
+  setenv("LLVM_SYMBOLIZER_OPTS", "--no-demangle", 1);
+}
+
+static bool name_less(const char *a, const char *b) {
+  return internal_strcmp(a, b) < 0;
+}
+
+void WriteProfile() {
+  if (!profile_enabled)
+    return;
+  profile_enabled = false;
+
+  // the function of each site, and the ones it was inlined into
+  InternalMmapVector<char *> names;
+  for (uptr i = 0; i < kMaxProfileSites; i++) {
+    uptr pc = atomic_load(&profile_sites[i], memory_order_relaxed);
+    if (pc == 0)
+      continue;
+    SymbolizedStack *frames = Symbolizer::GetOrInit()->SymbolizePC(
+        StackTrace::GetPreviousInstructionPc(pc));
+    for (SymbolizedStack *f = frames; f; f = f->next) {
+      if (f->info.function)
+        names.push_back(internal_strdup(f->info.function));
+    }
+    if (frames)
+      frames->ClearAll();
+  }
+  Sort(names.data(), names.size(), name_less);
+
+  if (atomic_load(&profile_full, memory_order_relaxed))
+    Report("WARNING: DataFlowSanitizer: taint profile is full, some sites "
+           "are missing\n");
+
+  // appended, so the profile of a campaign builds up over its runs, a line
+  // per write so the ones of concurrent runs don't interleave
+  uptr fd = internal_open(profile_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (internal_iserror(fd)) {
+    Report("WARNING: DataFlowSanitizer: unable to open %s\n", profile_path);
+  } else {
+    InternalScopedString line(kMaxPathLength * 2);
+    for (uptr i = 0; i < names.size(); i++) {
+      if (i > 0 && internal_strcmp(names[i - 1], names[i]) == 0)
+        continue;
+      line.clear();
+      line.append("fun:%s\n", names[i]);
+      internal_write(fd, line.data(), line.length());
+    }
+    internal_close(fd);
+  }
+  for (uptr i = 0; i < names.size(); i++)
+    InternalFree(names[i]);
+}
+
+} // namespace __dfsan
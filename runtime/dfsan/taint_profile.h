@@ -0,0 +1,28 @@
+#ifndef DFSAN_TAINT_PROFILE_H
+#define DFSAN_TAINT_PROFILE_H
+
+#include "sanitizer_common/sanitizer_internal_defs.h"
+
+using __sanitizer::uptr;
+
+namespace __dfsan {
+
+// The functions that computed on, loaded or stored labels, recorded by the
+// return addresses of the runtime entry points when the taint_profile flag
+// is set, and appended to that file at exit as an ABI list that ko-clang
+// takes back with KO_PGO_PROFILE.
+
+extern bool profile_enabled;
+void profile_record(uptr pc);
+
+inline void profile_pc(uptr pc) {
+  if (UNLIKELY(profile_enabled))
+    profile_record(pc);
+}
+
+void InitializeProfile(const char *path);
+void WriteProfile();
+
+} // namespace __dfsan
+
+#endif // DFSAN_TAINT_PROFILE_H
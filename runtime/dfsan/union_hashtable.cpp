@@ -1,46 +1,191 @@
+#include "sanitizer_common/sanitizer_common.h"
 #include "sanitizer_common/sanitizer_libc.h"
+#include "dfsan_stats.h"
 #include "union_hashtable.h"
 #include "union_util.h"
+#include "probes.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using namespace __taint;
 
-union_hashtable::union_hashtable(uint64_t n) {
-  bucket_size = n;
-  bucket = reinterpret_cast<atomic_uintptr_t*>(
-      allocator_alloc(n * sizeof(atomic_uintptr_t)));
-  __sanitizer::internal_memset(bucket, 0, n * sizeof(atomic_uintptr_t));
+static union_hashtable_bucket *alloc_buckets(uint64_t n) {
+  // fresh pages from the allocator region are already zero
+  return reinterpret_cast<union_hashtable_bucket*>(
+      allocator_alloc(n * sizeof(union_hashtable_bucket)));
+}
+
+static void release_buckets(union_hashtable_bucket *table, uint64_t n) {
+  __sanitizer::ReleaseMemoryPagesToOS(
+      reinterpret_cast<uptr>(table), reinterpret_cast<uptr>(table + n));
+}
+
+void
+union_hashtable::init(uint64_t n, uint64_t max_n) {
+  max_bucket_size = max_n < n ? n : max_n;
+  tables[0] = {alloc_buckets(n), n};
+  num_tables = 1;
+  atomic_store(&table, reinterpret_cast<uptr>(&tables[0]), memory_order_release);
+  atomic_store(&count, 0, memory_order_relaxed);
+  atomic_store(&old_table, 0, memory_order_relaxed);
+  migrate_cursor = 0;
+}
+
+// bitmask of slots whose hash matches h
+static inline uint32_t match_hash(const union_hashtable_bucket *b, uint32_t h) {
+#if defined(__SSE2__)
+  __m128i v = _mm_set1_epi32(h);
+  __m128i lo = _mm_load_si128(reinterpret_cast<const __m128i*>(&b->hash[0]));
+  __m128i hi = _mm_load_si128(reinterpret_cast<const __m128i*>(&b->hash[4]));
+  return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(lo, v))) |
+         (_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(hi, v))) << 4);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < kBucketSlots; i++)
+    if (b->hash[i] == h) mask |= 1U << i;
+  return mask;
+#endif
 }
 
-uint32_t
-union_hashtable::hash(const dfsan_label_info &key) {
-  return key.hash & (bucket_size - 1);
+bool
+union_hashtable::insert_slot(union_hashtable_bucket *table, uint64_t size,
+                             uint32_t hash, dfsan_label entry) {
+  uint64_t index = hash & (size - 1);
+  for (int probe = 0; probe < kMaxProbe; probe++) {
+    union_hashtable_bucket *b = &table[(index + probe) & (size - 1)];
+    for (int i = 0; i < kBucketSlots; i++) {
+      uint32_t expected = 0;
+      if (atomic_load(&b->label[i], memory_order_relaxed) == 0 &&
+          atomic_compare_exchange_strong(&b->label[i], &expected, entry,
+                                         memory_order_acq_rel)) {
+        // a concurrent lookup may miss it before the hash is set, which only
+        // costs a duplicated label
+        b->hash[i] = hash;
+        return true;
+      }
+    }
+  }
+  // too crowded, skip dedup for this one
+  return false;
+}
+
+void
+union_hashtable::grow() {
+  // the old table must be fully migrated before growing again
+  auto cur = current();
+  if (atomic_load(&old_table, memory_order_relaxed) || cur->size >= max_bucket_size)
+    return;
+  int next = cur - tables + 1;
+  if (next >= kMaxTables)
+    return;
+  if (next == num_tables) {
+    tables[next] = {alloc_buckets(cur->size * 2), cur->size * 2};
+    num_tables++;
+  }
+  migrate_cursor = 0;
+  // readers look up the current table before the old one, so either finds
+  // the entries of cur
+  atomic_store(&old_table, reinterpret_cast<uptr>(cur), memory_order_release);
+  atomic_store(&table, reinterpret_cast<uptr>(&tables[next]), memory_order_release);
+  atomic_store(&count, 0, memory_order_relaxed);
+}
+
+void
+union_hashtable::migrate() {
+  auto old = reinterpret_cast<const union_hashtable_table*>(
+      atomic_load(&old_table, memory_order_relaxed));
+  if (!old)
+    return;
+  auto cur = current();
+  for (int n = 0; n < kMigrateStep && migrate_cursor < old->size; n++) {
+    union_hashtable_bucket *b = &old->bucket[migrate_cursor++];
+    for (int i = 0; i < kBucketSlots; i++) {
+      dfsan_label l = atomic_load(&b->label[i], memory_order_relaxed);
+      if (l == 0)
+        break;
+      // use the hash from the union table, the inline copy may be unset
+      if (insert_slot(cur->bucket, cur->size, __dfsan::get_label_info(l)->hash, l))
+        atomic_fetch_add(&count, 1, memory_order_relaxed);
+    }
+  }
+  if (migrate_cursor >= old->size) {
+    atomic_store(&old_table, 0, memory_order_release);
+    // late readers of the old table only see zero pages, i.e., misses
+    release_buckets(old->bucket, old->size);
+  }
 }
 
 void
 union_hashtable::insert(dfsan_label_info *key, dfsan_label entry) {
-  uint32_t index = hash(*key);
-  auto curr = (struct union_hashtable_entry *)
-      allocator_alloc(sizeof(struct union_hashtable_entry));
-  curr->key = key; curr->entry = entry;
-  uptr p = atomic_load(&bucket[index], memory_order_acquire);
-  while (true) {
-    curr->next = reinterpret_cast<struct union_hashtable_entry *>(p);
-    if (atomic_compare_exchange_strong(&bucket[index], &p, (uptr)curr,
-                                       memory_order_seq_cst))
-      break; // spin until succeed, when fail, p will contain the current head
+  __dfsan::stat_inc(__dfsan::kStat_hash_inserts);
+  auto t = current();
+  if (insert_slot(t->bucket, t->size, key->hash, entry)) {
+    uint64_t c = atomic_fetch_add(&count, 1, memory_order_relaxed) + 1;
+    SYMSAN_PROBE3(hash_insert, entry, key->hash, c);
+    // keep the load factor under 3/4
+    if (c > t->size * kBucketSlots / 4 * 3 || atomic_load(&old_table, memory_order_relaxed)) {
+      if (grow_lock.TryLock()) {
+        if (!atomic_load(&old_table, memory_order_relaxed)) {
+          SYMSAN_PROBE2(hash_grow, current()->size, c);
+          grow();
+        }
+        migrate();
+        grow_lock.Unlock();
+      }
+    }
   }
 }
 
 option
-union_hashtable::lookup(const dfsan_label_info &key) {
-  uint64_t index = hash(key);
-  uptr p = atomic_load(&bucket[index], memory_order_acquire);
-  auto curr = reinterpret_cast<struct union_hashtable_entry *>(p);
-  while (curr) {
-    if (*(curr->key) == key) {
-      return some_dfsan_label(curr->entry);
+union_hashtable::lookup_table(union_hashtable_bucket *table, uint64_t size,
+                              const dfsan_label_info &key,
+                              const dfsan_label_operands &operands) {
+  uint64_t index = key.hash & (size - 1);
+  for (int probe = 0; probe < kMaxProbe; probe++) {
+    union_hashtable_bucket *b = &table[(index + probe) & (size - 1)];
+    __dfsan::stat_inc(__dfsan::kStat_hash_probes);
+    uint32_t mask = match_hash(b, key.hash);
+    while (mask) {
+      int i = __builtin_ctz(mask);
+      dfsan_label l = atomic_load(&b->label[i], memory_order_acquire);
+      // operands are out of line, only compare them on a record match
+      if (l != 0 && *__dfsan::get_label_info(l) == key &&
+          *__dfsan::get_label_operands(l) == operands) {
+        return some_dfsan_label(l);
+      }
+      mask &= mask - 1;
     }
-    curr = curr->next; // no data race here
+    // an empty slot means the key is not further down the probe sequence
+    if (atomic_load(&b->label[kBucketSlots - 1], memory_order_relaxed) == 0)
+      break;
   }
   return none();
 }
+
+option
+union_hashtable::lookup(const dfsan_label_info &key,
+                        const dfsan_label_operands &operands) {
+  __dfsan::stat_inc(__dfsan::kStat_hash_lookups);
+  auto t = current();
+  option res = lookup_table(t->bucket, t->size, key, operands);
+  if (res != none())
+    return res;
+  auto old = reinterpret_cast<const union_hashtable_table*>(
+      atomic_load(&old_table, memory_order_acquire));
+  if (old)
+    return lookup_table(old->bucket, old->size, key, operands);
+  return res;
+}
+
+void
+union_hashtable::reset() {
+  // drop all entries and go back to the initial table, not thread-safe
+  for (int i = 0; i < num_tables; i++)
+    release_buckets(tables[i].bucket, tables[i].size);
+  atomic_store(&old_table, 0, memory_order_relaxed);
+  atomic_store(&table, reinterpret_cast<uptr>(&tables[0]), memory_order_release);
+  atomic_store(&count, 0, memory_order_relaxed);
+  migrate_cursor = 0;
+}
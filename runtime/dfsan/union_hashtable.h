@@ -4,32 +4,83 @@
 #include <stdint.h>
 #include "sanitizer_common/sanitizer_atomic.h"
 #include "sanitizer_common/sanitizer_internal_defs.h"
+#include "sanitizer_common/sanitizer_mutex.h"
 #include "taint_allocator.h"
 #include "union_util.h"
 #include "dfsan.h"
 
+using __sanitizer::atomic_uint32_t;
+using __sanitizer::atomic_uint64_t;
 using __sanitizer::atomic_uintptr_t;
 using __sanitizer::atomic_load;
+using __sanitizer::atomic_store;
+using __sanitizer::atomic_fetch_add;
 using __sanitizer::atomic_compare_exchange_strong;
 using __sanitizer::memory_order_acquire;
-using __sanitizer::memory_order_seq_cst;
+using __sanitizer::memory_order_release;
+using __sanitizer::memory_order_relaxed;
+using __sanitizer::memory_order_acq_rel;
+using __sanitizer::StaticSpinMutex;
 
 namespace __taint {
 
-struct union_hashtable_entry {
-  dfsan_label_info *key;
-  dfsan_label entry;
-  struct union_hashtable_entry *next;
+static const int kBucketSlots = 8;
+// stop probing after this many buckets, the table is only a dedup cache
+static const int kMaxProbe = 8;
+// buckets moved from the old table on each insert while rehashing
+static const int kMigrateStep = 4;
+
+// one cache line, hashes and labels are kept apart for SIMD probing
+struct union_hashtable_bucket {
+  uint32_t hash[kBucketSlots];
+  atomic_uint32_t label[kBucketSlots]; // 0 means empty
+} __attribute__((aligned(64)));
+
+// the buckets and their number, published to the readers as one pointer
+// so they never index a table with the size of another
+struct union_hashtable_table {
+  union_hashtable_bucket *bucket;
+  uint64_t size;
 };
 
+// each growth doubles the table
+static const int kMaxTables = 64;
+
+// No constructor on purpose, the table lives in a global that must not be
+// touched by static initializers after dfsan_init, call init() instead.
 class union_hashtable {
-  atomic_uintptr_t *bucket;
-  uint64_t bucket_size;
-  uint32_t hash(const dfsan_label_info &key);
+  // the initial table and those it grew into, each allocated on its first
+  // growth and kept, so a reader holding one always sees it whole, and a
+  // reset followed by a growth reuses it
+  union_hashtable_table tables[kMaxTables];
+  int num_tables;
+  uint64_t max_bucket_size;
+  atomic_uint64_t count;
+  // the table in use, one of tables
+  atomic_uintptr_t table;
+  // incremental rehash state, old_table is null when not rehashing
+  atomic_uintptr_t old_table;
+  uint64_t migrate_cursor;
+  StaticSpinMutex grow_lock;
+
+  const union_hashtable_table *current() {
+    return reinterpret_cast<const union_hashtable_table*>(
+        atomic_load(&table, memory_order_acquire));
+  }
+
+  bool insert_slot(union_hashtable_bucket *table, uint64_t size,
+                   uint32_t hash, dfsan_label entry);
+  option lookup_table(union_hashtable_bucket *table, uint64_t size,
+                      const dfsan_label_info &key,
+                      const dfsan_label_operands &operands);
+  void grow();
+  void migrate();
 public:
-  union_hashtable(uint64_t n);
+  void init(uint64_t n, uint64_t max_n);
   void insert(dfsan_label_info *key, dfsan_label value);
-  option lookup(const dfsan_label_info &key);
+  option lookup(const dfsan_label_info &key,
+                const dfsan_label_operands &operands);
+  void reset();
 };
 
 }
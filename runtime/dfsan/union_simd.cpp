@@ -0,0 +1,263 @@
+#include "union_simd.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace __taint {
+
+static bool labels_match_scalar(const dfsan_label *ls, uptr n,
+                                dfsan_label base, dfsan_label step) {
+  for (uptr i = 0; i < n; ++i) {
+    if (ls[i] != base + (dfsan_label)i * step)
+      return false;
+  }
+  return true;
+}
+
+static void labels_fill_scalar(dfsan_label *ls, uptr n,
+                               dfsan_label base, dfsan_label step) {
+  for (uptr i = 0; i < n; ++i)
+    ls[i] = base + (dfsan_label)i * step;
+}
+
+static void labels_move_scalar(dfsan_label *dst, const dfsan_label *src,
+                               uptr n) {
+  if (dst <= src) {
+    for (uptr i = 0; i < n; ++i) {
+      if (dst[i] != src[i])
+        dst[i] = src[i];
+    }
+  } else {
+    for (uptr i = n; i > 0; --i) {
+      if (dst[i - 1] != src[i - 1])
+        dst[i - 1] = src[i - 1];
+    }
+  }
+}
+
+static void labels_clear_scalar(dfsan_label *ls, uptr n) {
+  for (uptr i = 0; i < n; ++i) {
+    if (ls[i])
+      ls[i] = 0;
+  }
+}
+
+#if defined(__x86_64__)
+
+// clears of at least this many labels bypass the cache
+static const uptr kNonTemporalLabels = (1 << 20) / sizeof(dfsan_label);
+
+static inline bool is_zero_sse2(__m128i v) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi32(v, _mm_setzero_si128())) == 0xffff;
+}
+
+static bool labels_match_sse2(const dfsan_label *ls, uptr n,
+                              dfsan_label base, dfsan_label step) {
+  __m128i expect = _mm_setr_epi32(base, base + step, base + 2 * step,
+                                  base + 3 * step);
+  const __m128i inc = _mm_set1_epi32(4 * step);
+  uptr i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(ls + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, expect)) != 0xffff)
+      return false;
+    expect = _mm_add_epi32(expect, inc);
+  }
+  return labels_match_scalar(ls + i, n - i, base + (dfsan_label)i * step, step);
+}
+
+static void labels_fill_sse2(dfsan_label *ls, uptr n,
+                             dfsan_label base, dfsan_label step) {
+  __m128i v = _mm_setr_epi32(base, base + step, base + 2 * step,
+                             base + 3 * step);
+  const __m128i inc = _mm_set1_epi32(4 * step);
+  uptr i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_si128((__m128i *)(ls + i), v);
+    v = _mm_add_epi32(v, inc);
+  }
+  labels_fill_scalar(ls + i, n - i, base + (dfsan_label)i * step, step);
+}
+
+// each block is loaded before the overlapping one is stored, so copying
+// forward is safe for dst <= src and backward for dst > src
+static void labels_move_sse2(dfsan_label *dst, const dfsan_label *src,
+                             uptr n) {
+  if (dst <= src) {
+    uptr i = 0;
+    for (; i + 4 <= n; i += 4) {
+      __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+      if (is_zero_sse2(s) &&
+          is_zero_sse2(_mm_loadu_si128((const __m128i *)(dst + i))))
+        continue;
+      _mm_storeu_si128((__m128i *)(dst + i), s);
+    }
+    labels_move_scalar(dst + i, src + i, n - i);
+  } else {
+    uptr i = n;
+    for (; i >= 4; i -= 4) {
+      __m128i s = _mm_loadu_si128((const __m128i *)(src + i - 4));
+      if (is_zero_sse2(s) &&
+          is_zero_sse2(_mm_loadu_si128((const __m128i *)(dst + i - 4))))
+        continue;
+      _mm_storeu_si128((__m128i *)(dst + i - 4), s);
+    }
+    labels_move_scalar(dst, src, i);
+  }
+}
+
+static void labels_clear_sse2(dfsan_label *ls, uptr n) {
+  const __m128i zero = _mm_setzero_si128();
+  bool stream = n >= kNonTemporalLabels;
+  uptr i = 0;
+  // streaming stores need aligned addresses
+  for (; i < n && ((uptr)(ls + i) & 15); ++i) {
+    if (ls[i])
+      ls[i] = 0;
+  }
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_load_si128((const __m128i *)(ls + i));
+    if (is_zero_sse2(v))
+      continue;
+    if (stream)
+      _mm_stream_si128((__m128i *)(ls + i), zero);
+    else
+      _mm_store_si128((__m128i *)(ls + i), zero);
+  }
+  if (stream)
+    _mm_sfence();
+  labels_clear_scalar(ls + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static bool labels_match_avx2(const dfsan_label *ls, uptr n,
+                              dfsan_label base, dfsan_label step) {
+  __m256i expect = _mm256_add_epi32(
+      _mm256_set1_epi32(base),
+      _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                         _mm256_set1_epi32(step)));
+  const __m256i inc = _mm256_set1_epi32(8 * step);
+  uptr i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(ls + i));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, expect)) != -1)
+      return false;
+    expect = _mm256_add_epi32(expect, inc);
+  }
+  // 4-byte loads and the tail
+  return labels_match_sse2(ls + i, n - i, base + (dfsan_label)i * step, step);
+}
+
+__attribute__((target("avx2")))
+static void labels_fill_avx2(dfsan_label *ls, uptr n,
+                             dfsan_label base, dfsan_label step) {
+  __m256i v = _mm256_add_epi32(
+      _mm256_set1_epi32(base),
+      _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                         _mm256_set1_epi32(step)));
+  const __m256i inc = _mm256_set1_epi32(8 * step);
+  uptr i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_si256((__m256i *)(ls + i), v);
+    v = _mm256_add_epi32(v, inc);
+  }
+  labels_fill_sse2(ls + i, n - i, base + (dfsan_label)i * step, step);
+}
+
+__attribute__((target("avx2")))
+static void labels_move_avx2(dfsan_label *dst, const dfsan_label *src,
+                             uptr n) {
+  if (dst <= src) {
+    uptr i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+      if (_mm256_testz_si256(s, s)) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        if (_mm256_testz_si256(d, d))
+          continue;
+      }
+      _mm256_storeu_si256((__m256i *)(dst + i), s);
+    }
+    labels_move_sse2(dst + i, src + i, n - i);
+  } else {
+    uptr i = n;
+    for (; i >= 8; i -= 8) {
+      __m256i s = _mm256_loadu_si256((const __m256i *)(src + i - 8));
+      if (_mm256_testz_si256(s, s)) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i - 8));
+        if (_mm256_testz_si256(d, d))
+          continue;
+      }
+      _mm256_storeu_si256((__m256i *)(dst + i - 8), s);
+    }
+    labels_move_sse2(dst, src, i);
+  }
+}
+
+__attribute__((target("avx2")))
+static void labels_clear_avx2(dfsan_label *ls, uptr n) {
+  const __m256i zero = _mm256_setzero_si256();
+  bool stream = n >= kNonTemporalLabels;
+  uptr i = 0;
+  for (; i < n && ((uptr)(ls + i) & 31); ++i) {
+    if (ls[i])
+      ls[i] = 0;
+  }
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_load_si256((const __m256i *)(ls + i));
+    if (_mm256_testz_si256(v, v))
+      continue;
+    if (stream)
+      _mm256_stream_si256((__m256i *)(ls + i), zero);
+    else
+      _mm256_store_si256((__m256i *)(ls + i), zero);
+  }
+  if (stream)
+    _mm_sfence();
+  labels_clear_scalar(ls + i, n - i);
+}
+
+static bool has_avx2() {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  // the OS must save the ymm state
+  if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+    return false;
+  unsigned xcr0_lo, xcr0_hi;
+  __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  if ((xcr0_lo & 0x6) != 0x6)
+    return false;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return false;
+  return ebx & bit_AVX2;
+}
+
+labels_match_fn labels_match_impl = labels_match_sse2;
+labels_fill_fn labels_fill_impl = labels_fill_sse2;
+labels_move_fn labels_move_impl = labels_move_sse2;
+labels_clear_fn labels_clear_impl = labels_clear_sse2;
+
+void simd_init() {
+  if (has_avx2()) {
+    labels_match_impl = labels_match_avx2;
+    labels_fill_impl = labels_fill_avx2;
+    labels_move_impl = labels_move_avx2;
+    labels_clear_impl = labels_clear_avx2;
+  }
+}
+
+#else
+
+labels_match_fn labels_match_impl = labels_match_scalar;
+labels_fill_fn labels_fill_impl = labels_fill_scalar;
+labels_move_fn labels_move_impl = labels_move_scalar;
+labels_clear_fn labels_clear_impl = labels_clear_scalar;
+
+void simd_init() {}
+
+#endif
+
+} // namespace
@@ -0,0 +1,72 @@
+#ifndef UNION_SIMD_H
+#define UNION_SIMD_H
+
+#include "sanitizer_common/sanitizer_internal_defs.h"
+#include "dfsan.h"
+
+using __sanitizer::uptr;
+
+namespace __taint {
+
+// Vectorized scans of shadow label arrays for the union load/store fast
+// paths. The implementation (scalar, SSE2 or AVX2) is picked once by
+// simd_init() based on CPUID.
+
+typedef bool (*labels_match_fn)(const dfsan_label *ls, uptr n,
+                                dfsan_label base, dfsan_label step);
+typedef void (*labels_fill_fn)(dfsan_label *ls, uptr n,
+                               dfsan_label base, dfsan_label step);
+typedef void (*labels_move_fn)(dfsan_label *dst, const dfsan_label *src, uptr n);
+typedef void (*labels_clear_fn)(dfsan_label *ls, uptr n);
+
+extern labels_match_fn labels_match_impl;
+extern labels_fill_fn labels_fill_impl;
+extern labels_move_fn labels_move_impl;
+extern labels_clear_fn labels_clear_impl;
+
+void simd_init();
+
+// up to this many labels, the loads and stores of scalars, the loops are
+// inlined instead of calling through the pointers
+static const uptr kInlineLabels = 8;
+
+// true if ls[i] == base + i * step for all i < n
+ALWAYS_INLINE bool labels_match(const dfsan_label *ls, uptr n,
+                                dfsan_label base, dfsan_label step) {
+  if (n <= kInlineLabels) {
+    for (uptr i = 0; i < n; ++i) {
+      if (ls[i] != base + (dfsan_label)i * step)
+        return false;
+    }
+    return true;
+  }
+  return labels_match_impl(ls, n, base, step);
+}
+
+// ls[i] = base + i * step for all i < n
+ALWAYS_INLINE void labels_fill(dfsan_label *ls, uptr n,
+                               dfsan_label base, dfsan_label step) {
+  if (n <= kInlineLabels) {
+    for (uptr i = 0; i < n; ++i)
+      ls[i] = base + (dfsan_label)i * step;
+    return;
+  }
+  labels_fill_impl(ls, n, base, step);
+}
+
+// Shadow copy for memcpy/memmove, dst and src may overlap. Blocks that are
+// zero in both src and dst are not written, so untainted copies neither
+// dirty nor un-share (copy-on-write) zero shadow pages.
+inline void labels_move(dfsan_label *dst, const dfsan_label *src, uptr n) {
+  labels_move_impl(dst, src, n);
+}
+
+// ls[i] = 0 for all i < n, skipping blocks that are zero already. Large
+// ranges are cleared with non-temporal stores to keep them out of the cache.
+inline void labels_clear(dfsan_label *ls, uptr n) {
+  labels_clear_impl(ls, n);
+}
+
+} // namespace
+
+#endif // UNION_SIMD_H
@@ -44,8 +44,12 @@ operator==(const dfsan_label_info& lhs, const dfsan_label_info& rhs) {
   return lhs.l1 == rhs.l1
       && lhs.l2 == rhs.l2
       && lhs.op == rhs.op
-      && lhs.size == rhs.size
-      && lhs.op1.i == rhs.op1.i
+      && lhs.size == rhs.size;
+}
+
+bool
+operator==(const dfsan_label_operands& lhs, const dfsan_label_operands& rhs) {
+  return lhs.op1.i == rhs.op1.i
       && lhs.op2.i == rhs.op2.i;
 }
 
@@ -24,6 +24,8 @@ option none();
 
 bool operator==(const dfsan_label_info& lhs, 
     const dfsan_label_info& rhs);
+bool operator==(const dfsan_label_operands& lhs,
+    const dfsan_label_operands& rhs);
 
 } // namespace
 
@@ -65,12 +65,24 @@ size_t dfsan_get_label_count(void);
 /// callback executes.  Pass in NULL to remove any callback.
 void dfsan_set_write_callback(dfsan_write_callback_t labeled_write_callback);
 
-/// Writes the labels currently used by the program to the given file
-/// descriptor. The lines of the output have the following format:
-///
-/// <label> <parent label 1> <parent label 2> <label description if any>
+/// Writes the labels currently used by the program, and their operands, to
+/// the given file descriptor, in the binary layout of dfsan/label_dump.h.
 void dfsan_dump_labels(int fd);
 
+/// Persistent loop, similar to __AFL_LOOP. Returns non-zero while there is
+/// another input to process, at most \c max_cnt times (0 for unlimited).
+int __symsan_loop(unsigned max_cnt);
+
+/// Suspends (0) or resumes the labeling of the input the program reads,
+/// e.g., around a setup phase of the harness; the bytes read while it's
+/// suspended stay concrete, labels already in memory are kept.
+void dfsan_set_propagation(int enable);
+
+/// The same, as markers: with the taint_at_marker flag, the input read
+/// before __symsan_start() isn't labeled.
+void __symsan_start(void);
+void __symsan_stop(void);
+
 /// Interceptor hooks.
 /// Whenever a dfsan's custom function is called the corresponding
 /// hook is called it non-zero. The hooks should be defined by the user.
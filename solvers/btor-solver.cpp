@@ -0,0 +1,305 @@
+#include "solver.h"
+
+extern "C" {
+#include <boolector/boolector.h>
+}
+
+#include <chrono>
+#include <stdexcept>
+
+#include <string.h>
+
+using namespace rgd;
+
+#if !DEBUG
+#undef DEBUGF
+#define DEBUGF(_str...) do { } while (0)
+#endif
+
+#ifndef WARNF
+#define WARNF(_str...) do { fprintf(stderr, _str); } while (0)
+#endif
+
+const unsigned kSolverTimeout = 10000; // 10 seconds, as for z3
+
+static uint64_t now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// boolector polls this while solving, a non-zero return stops it
+static int32_t past_deadline(void *state) {
+  return now_ms() > *(uint64_t*)state;
+}
+
+BtorSolver::BtorSolver() {
+  reset();
+}
+
+BtorSolver::~BtorSolver() {
+  if (btor_) boolector_delete(btor_);
+}
+
+// a fresh instance, dropping all nodes and the cache
+void BtorSolver::reset() {
+  if (btor_) boolector_delete(btor_);
+  btor_ = boolector_new();
+  boolector_set_opt(btor_, BTOR_OPT_MODEL_GEN, 1);
+  boolector_set_opt(btor_, BTOR_OPT_INCREMENTAL, 1);
+  // nodes are never released one by one
+  boolector_set_opt(btor_, BTOR_OPT_AUTO_CLEANUP, 1);
+  boolector_set_term(btor_, past_deadline, &deadline_);
+  inputs_.clear();
+  expr_cache_.clear();
+}
+
+void BtorSolver::drop_caches() {
+  cache_arena_.reset();
+  reset();
+}
+
+// the variable of an input byte
+BoolectorNode* BtorSolver::input(uint32_t offset) {
+  auto itr = inputs_.find(offset);
+  if (itr != inputs_.end()) return itr->second;
+  char name[16];
+  snprintf(name, sizeof(name), "i%u", offset);
+  auto *var = boolector_var(btor_, boolector_bitvec_sort(btor_, 8), name);
+  inputs_.emplace(offset, var);
+  return var;
+}
+
+BoolectorNode* BtorSolver::bv_val(uint64_t val, uint32_t bits) {
+  char dec[24];
+  snprintf(dec, sizeof(dec), "%lu", val);
+  return boolector_constd(btor_, boolector_bitvec_sort(btor_, bits), dec);
+}
+
+// same as for z3
+static inline uint64_t expr_key(const AstNode *node) {
+  return ((uint64_t)node->hash() << 32) | node->label();
+}
+
+BoolectorNode* BtorSolver::serialize(const AstNode* node,
+    const std::vector<std::pair<bool, uint64_t>> &input_args) {
+
+  auto itr = expr_cache_.find(expr_key(node));
+  if (node->label() != 0 && itr != expr_cache_.end())
+    return itr->second;
+
+  // booleans are 1-bit vectors in boolector, so unlike z3 there's no
+  // converting between the two
+  BoolectorNode *ret = nullptr;
+  switch (node->kind()) {
+    case rgd::Bool:
+      return node->boolvalue() ? boolector_true(btor_) : boolector_false(btor_);
+    case rgd::Constant: {
+      if (node->bits() <= 64) {
+        return bv_val(input_args[node->index()].second, node->bits());
+      }
+      uint32_t chunks = node->bits() / 64;
+      uint32_t remain = node->bits() % 64;
+      ret = bv_val(input_args[node->index()].second, 64);
+      for (uint32_t i = 1; i < chunks; i++) {
+        ret = boolector_concat(btor_,
+            bv_val(input_args[node->index() + i].second, 64), ret);
+      }
+      if (remain > 0) {
+        ret = boolector_concat(btor_,
+            bv_val(input_args[node->index() + chunks].second, remain), ret);
+      }
+      return ret;
+    }
+    case rgd::Read: {
+      ret = input(node->index());
+      for (uint32_t i = 1; i < node->bits() / 8; i++) {
+        ret = boolector_concat(btor_, input(node->index() + i), ret);
+      }
+      break;
+    }
+    case rgd::Concat: {
+      auto *c1 = serialize(&node->children(0), input_args);
+      auto *c2 = serialize(&node->children(1), input_args);
+      ret = boolector_concat(btor_, c2, c1);
+      break;
+    }
+    case rgd::Extract: {
+      auto *c1 = serialize(&node->children(0), input_args);
+      ret = boolector_slice(btor_, c1, node->index() + node->bits() - 1,
+                            node->index());
+      break;
+    }
+    case rgd::ZExt: {
+      auto *c1 = serialize(&node->children(0), input_args);
+      ret = boolector_uext(btor_, c1, node->bits() - node->children(0).bits());
+      break;
+    }
+    case rgd::SExt: {
+      auto *c1 = serialize(&node->children(0), input_args);
+      ret = boolector_sext(btor_, c1, node->bits() - node->children(0).bits());
+      break;
+    }
+    case rgd::Neg: {
+      auto *c1 = serialize(&node->children(0), input_args);
+      ret = boolector_neg(btor_, c1);
+      break;
+    }
+    case rgd::Not: {
+      auto *c1 = serialize(&node->children(0), input_args);
+      ret = boolector_not(btor_, c1);
+      break;
+    }
+    default: {
+      if (node->children_size() != 2) {
+        throw std::runtime_error("unsupported operator");
+      }
+      auto *c1 = serialize(&node->children(0), input_args);
+      auto *c2 = serialize(&node->children(1), input_args);
+      switch (node->kind()) {
+        case rgd::Add: ret = boolector_add(btor_, c1, c2); break;
+        case rgd::Sub: ret = boolector_sub(btor_, c1, c2); break;
+        case rgd::Mul: ret = boolector_mul(btor_, c1, c2); break;
+        case rgd::UDiv: ret = boolector_udiv(btor_, c1, c2); break;
+        case rgd::SDiv: ret = boolector_sdiv(btor_, c1, c2); break;
+        case rgd::URem: ret = boolector_urem(btor_, c1, c2); break;
+        case rgd::SRem: ret = boolector_srem(btor_, c1, c2); break;
+        case rgd::And: ret = boolector_and(btor_, c1, c2); break;
+        case rgd::Or: ret = boolector_or(btor_, c1, c2); break;
+        case rgd::Xor: ret = boolector_xor(btor_, c1, c2); break;
+        case rgd::Shl: ret = boolector_sll(btor_, c1, c2); break;
+        case rgd::LShr: ret = boolector_srl(btor_, c1, c2); break;
+        case rgd::AShr: ret = boolector_sra(btor_, c1, c2); break;
+        default:
+          WARNF("unhandler expr: %d\n", node->kind());
+          throw std::runtime_error("unsupported operator");
+      }
+      break;
+    }
+  }
+  if (node->label() != 0)
+    expr_cache_.insert({expr_key(node), ret});
+  return ret;
+}
+
+BoolectorNode* BtorSolver::serialize_rel(uint32_t comparison,
+    const AstNode* node,
+    const std::vector<std::pair<bool, uint64_t>> &input_args) {
+
+  if (node->children_size() != 2) {
+    throw std::runtime_error("invalid children size");
+  }
+  auto *c1 = serialize(&node->children(0), input_args);
+  auto *c2 = serialize(&node->children(1), input_args);
+
+  switch(comparison) {
+    case rgd::Equal:
+    case rgd::Memcmp:
+      return boolector_eq(btor_, c1, c2);
+    case rgd::Distinct:
+    case rgd::MemcmpN:
+      return boolector_ne(btor_, c1, c2);
+    case rgd::Ult: return boolector_ult(btor_, c1, c2);
+    case rgd::Ule: return boolector_ulte(btor_, c1, c2);
+    case rgd::Ugt: return boolector_ugt(btor_, c1, c2);
+    case rgd::Uge: return boolector_ugte(btor_, c1, c2);
+    case rgd::Slt: return boolector_slt(btor_, c1, c2);
+    case rgd::Sle: return boolector_slte(btor_, c1, c2);
+    case rgd::Sgt: return boolector_sgt(btor_, c1, c2);
+    case rgd::Sge: return boolector_sgte(btor_, c1, c2);
+    default:
+      WARNF("unhandler comparison: %d", comparison);
+      throw std::runtime_error("unsupported operator");
+  }
+}
+
+// the value of an input byte in the model, its bits as "01x..." from msb
+static inline uint8_t byte_value(const char *bits) {
+  uint8_t value = 0;
+  for (int i = 0; i < 8 && bits[i]; i++) {
+    value = (value << 1) | (bits[i] == '1');
+  }
+  return value;
+}
+
+solver_result_t
+BtorSolver::solve(std::shared_ptr<SearchTask> task,
+                  const uint8_t *in_buf, size_t in_size,
+                  patch_t &patch) {
+
+  auto const &chain = task->ancestors();
+  // no need to solve
+  if (chain.skip) {
+    DEBUGF("skipping task\n");
+    task->skip_next = true; // set the flag for following tasks
+    if (chain.skip->solved) {
+      patch.bytes = chain.skip->solution;
+      return SOLVER_SAT;
+    } else {
+      return SOLVER_UNSAT;
+    }
+  }
+
+  try {
+    // the nodes serialized for earlier tasks of the same trace are reused,
+    // those of other traces dropped along with the instance
+    auto const &arena = task->constraints[0]->local_map.get_allocator().arena();
+    if (!arena || arena != cache_arena_) {
+      reset();
+      cache_arena_ = arena;
+    }
+
+    // the constraints of a task are only asserted in a scope of its own
+    boolector_push(btor_, 1);
+    for (size_t i = 0; i < task->constraints.size(); i++) {
+      auto const &c = task->constraints[i];
+      boolector_assert(btor_, serialize_rel(task->comparisons[i],
+                                            c->get_root(), c->input_args));
+    }
+    deadline_ = now_ms() + kSolverTimeout;
+    // prefer a solution close to those of the base tasks, the assumptions
+    // only hold for one check
+    int32_t ret = BOOLECTOR_UNKNOWN;
+    if (!chain.hints.empty()) {
+      for (auto const &[offset, value] : chain.hints) {
+        boolector_assume(btor_, boolector_eq(btor_, input(offset),
+                                             bv_val(value, 8)));
+      }
+      ret = boolector_sat(btor_);
+    }
+    if (ret != BOOLECTOR_SAT) {
+      ret = boolector_sat(btor_);
+    }
+    if (ret == BOOLECTOR_SAT) {
+      for (auto const &[offset, value] : task->inputs) {
+        if (offset >= in_size) {
+          WARNF("offset %u out of range %zu\n", offset, in_size);
+          continue;
+        }
+        const char *bits = boolector_bv_assignment(btor_, input(offset));
+        task->solution[offset] = byte_value(bits);
+        DEBUGF("generate_input offset:%u => %u\n", offset, task->solution[offset]);
+        boolector_free_bv_assignment(btor_, bits);
+      }
+      patch.bytes = task->solution;
+      if (!task->atoi_info.empty()) {
+        // if there are atoi bytes, handle them
+        patch.add_atoi(*task, in_buf, in_size);
+      }
+      task->solved = true;
+    }
+    boolector_pop(btor_, 1);
+    if (ret == BOOLECTOR_SAT) {
+      return SOLVER_SAT;
+    } else if (ret == BOOLECTOR_UNSAT) {
+      return SOLVER_UNSAT;
+    } else {
+      return SOLVER_TIMEOUT;
+    }
+  } catch (std::exception const& e) {
+    WARNF("boolector exception %s\n", e.what());
+    // drop whatever scope the task was left in
+    reset();
+    cache_arena_.reset();
+  }
+  return SOLVER_ERROR;
+}
@@ -18,8 +18,15 @@
 
 #include "sanitizer_common/sanitizer_common.h"
 #include "sanitizer_common/sanitizer_file.h"
+#include "sanitizer_common/sanitizer_mutex.h"
 #include "sanitizer_common/sanitizer_posix.h"
 #include "dfsan/dfsan.h"
+#include "dfsan/dfsan_stats.h"
+#include "event_ring.h"
+#include "blob_area.h"
+#include "branch_filter.h"
+
+#include <sys/mman.h>
 
 using namespace __dfsan;
 
@@ -27,14 +34,214 @@ static uint32_t __instance_id;
 static uint32_t __session_id;
 static int __pipe_fd;
 
+// shm event ring, nullptr if events go through the pipe
+static struct event_ring *__event_ring;
+static StaticSpinMutex __event_ring_lock;
+
+static void __ring_write(const void *buf, uptr size) {
+  SpinMutexLock l(&__event_ring_lock);
+  const uint8_t *src = (const uint8_t *)buf;
+  uint32_t mask = __event_ring->size - 1;
+  uint64_t head = __atomic_load_n(&__event_ring->head, __ATOMIC_RELAXED);
+  while (size) {
+    // wait for space, the consumer keeps draining
+    uint64_t tail = __atomic_load_n(&__event_ring->tail, __ATOMIC_ACQUIRE);
+    uptr avail = __event_ring->size - (head - tail);
+    if (avail == 0) {
+      internal_sched_yield();
+      continue;
+    }
+    uptr n = size < avail ? size : avail;
+    uptr off = head & mask;
+    uptr first = n < __event_ring->size - off ? n : __event_ring->size - off;
+    internal_memcpy(&__event_ring->data[off], src, first);
+    internal_memcpy(&__event_ring->data[0], src + first, n - first);
+    head += n;
+    src += n;
+    size -= n;
+    __atomic_store_n(&__event_ring->head, head, __ATOMIC_SEQ_CST);
+  }
+  // wake up the consumer if it's sleeping on the pipe
+  if (__atomic_load_n(&__event_ring->waiting, __ATOMIC_SEQ_CST) &&
+      __atomic_exchange_n(&__event_ring->waiting, 0, __ATOMIC_SEQ_CST)) {
+    char c = 0;
+    internal_write(__pipe_fd, &c, 1);
+  }
+}
+
+// shm blob area for memcmp content, nullptr if content is sent inline
+static struct blob_area *__blob_area;
+static StaticSpinMutex __blob_area_lock;
+
+// content addressed index of the blob area, entries are verified against
+// the area on lookup, so stale ones (e.g., inherited over fork after the
+// consumer reset the area) are harmless
+static const uptr kBlobIndexSize = 4096;
+struct blob_entry {
+  uint64_t hash;
+  uint64_t offset;
+  uint64_t size;
+};
+static blob_entry __blob_index[kBlobIndexSize];
+
+static uint64_t __blob_hash(const uint8_t *buf, uptr size) {
+  uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+  for (uptr i = 0; i < size; i++) {
+    h ^= buf[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// returns false if the area is full
+static bool __blob_store(const uint8_t *buf, uptr size, uint64_t *offset) {
+  uint64_t h = __blob_hash(buf, size);
+  blob_entry *e = &__blob_index[h & (kBlobIndexSize - 1)];
+  SpinMutexLock l(&__blob_area_lock);
+  uint64_t used = __atomic_load_n(&__blob_area->used, __ATOMIC_RELAXED);
+  if (e->hash == h && e->size == size && e->offset + size <= used &&
+      internal_memcmp(&__blob_area->data[e->offset], buf, size) == 0) {
+    *offset = e->offset;
+    return true;
+  }
+  if (used + size > __blob_area->size)
+    return false;
+  internal_memcpy(&__blob_area->data[used], buf, size);
+  // content must be visible before the event referring to it
+  __atomic_store_n(&__blob_area->used, used + size, __ATOMIC_RELEASE);
+  e->hash = h;
+  e->offset = used;
+  e->size = size;
+  *offset = used;
+  return true;
+}
+
+static inline uptr __send_event(const void *buf, uptr size) {
+  if (__event_ring) {
+    __ring_write(buf, size);
+    return size;
+  }
+  return internal_write(__pipe_fd, buf, size);
+}
+
 // filter?
 SANITIZER_INTERFACE_ATTRIBUTE THREADLOCAL uint32_t __taint_trace_callstack;
 
+// shm branch filter set by the consumer, nullptr if every cond is sent
+static struct branch_filter *__branch_filter;
+
+// the conds sent per (id, context) in this run, for the site limit, and
+// those seen, for sampling; a site that doesn't find a slot within a few
+// probes is never limited nor sampled
+static const uptr kSiteSlots = 1 << 16;
+static const uptr kSiteProbes = 8;
+struct site_entry {
+  uint32_t id;
+  uint32_t context;
+  uint16_t sent[2];
+  uint16_t used;
+  uint32_t seen[2];
+};
+static site_entry __sites[kSiteSlots];
+
+static site_entry *__find_site(uint32_t cid, uint32_t context) {
+  uptr h = (cid ^ (context * 0x9e3779b1U)) & (kSiteSlots - 1);
+  for (uptr n = 0; n < kSiteProbes; n++, h = (h + 1) & (kSiteSlots - 1)) {
+    site_entry *e = &__sites[h];
+    if (!e->used) {
+      e->used = 1;
+      e->id = cid;
+      e->context = context;
+      return e;
+    } else if (e->id == cid && e->context == context) {
+      return e;
+    }
+  }
+  return nullptr;
+}
+
+static THREADLOCAL uint64_t __sample_state;
+
+static inline uint64_t __sample_rand() {
+  if (UNLIKELY(__sample_state == 0))
+    __sample_state = 0x9e3779b97f4a7c15ULL ^ (uptr)&__sample_state;
+  uint64_t x = __sample_state; // xorshift64
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return __sample_state = x;
+}
+
+// with branch_sample_after = n, the first n conds of a (site, direction) are
+// all sent, after that about n out of every seen so far, so a hot loop costs
+// a logarithmic number of events while a new site or direction always
+// gets through
+static bool __sample_cond(uint32_t cid, uint8_t result) {
+  uptr after = flags().branch_sample_after;
+  if (after == 0)
+    return true;
+  site_entry *e = __find_site(cid, __taint_trace_callstack);
+  if (!e)
+    return true;
+  uint32_t seen = e->seen[result != 0];
+  if (seen != ~0U)
+    e->seen[result != 0] = seen + 1;
+  if (seen < after)
+    return true;
+  if (__sample_rand() % (seen + 1) < after)
+    return true;
+  stat_inc(kStat_cond_sampled);
+  return false;
+}
+
+static uint32_t __covered_directions(uint32_t id) {
+  uint32_t mask = BRANCH_FILTER_SLOTS - 1;
+  for (uint32_t i = branch_filter_hash(id); ; i = (i + 1) & mask) {
+    branch_filter_slot *slot = &__branch_filter->slots[i];
+    uint32_t slot_id = __atomic_load_n(&slot->id, __ATOMIC_ACQUIRE);
+    if (slot_id == id)
+      return __atomic_load_n(&slot->covered, __ATOMIC_RELAXED);
+    if (slot_id == 0)
+      return 0;
+  }
+}
+
+// false if the consumer would drop the cond anyway: its other direction is
+// covered, or the site has used up its limit in this run
+static bool __filter_cond(uint32_t cid, uint8_t result) {
+  if (!__branch_filter)
+    return true;
+
+  bool direction = result != 0;
+  uint32_t covered = __covered_directions(cid);
+  // before the cond is sent, so the resumed runs start with it
+  if (UNLIKELY(covered & BRANCH_SNAPSHOT))
+    taint_snapshot(cid);
+  if (!flags().branch_filter)
+    return true;
+  if (covered & (direction ? BRANCH_COVERED_FALSE : BRANCH_COVERED_TRUE))
+    return false;
+
+  uint32_t limit = __atomic_load_n(&__branch_filter->site_limit, __ATOMIC_RELAXED);
+  if (limit == 0)
+    return true;
+  site_entry *e = __find_site(cid, __taint_trace_callstack);
+  if (!e)
+    return true;
+  if (e->sent[direction] >= limit)
+    return false;
+  e->sent[direction]++;
+  return true;
+}
+
 static inline void __solve_cond(dfsan_label label, uint8_t result, uint8_t add_nested, uint32_t cid, void *addr) {
 
   if (__pipe_fd < 0)
     return;
 
+  if (!__sample_cond(cid, result) || !__filter_cond(cid, result))
+    return;
+
   uint16_t flags = 0;
   if (add_nested) flags |= F_ADD_CONS;
 
@@ -50,7 +257,7 @@ static inline void __solve_cond(dfsan_label label, uint8_t result, uint8_t add_n
     .result = result
   };
 
-  if (internal_write(__pipe_fd, &msg, sizeof(msg)) < 0) {
+  if (__send_event(&msg, sizeof(msg)) < 0) {
     Die();
   }
 }
@@ -88,6 +295,69 @@ __taint_trace_cond(dfsan_label label, uint8_t r, uint32_t cid) {
   __solve_cond(label, r, 1, cid, addr);
 }
 
+// switches with more cases send their table from the heap
+static const uint32_t kStackSwitchCases = 64;
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE void
+__taint_trace_switch(dfsan_label label, uint64_t cond, uint32_t size,
+                     const uint64_t *cases, uint32_t num_cases, uint32_t cid) {
+  if (label == 0)
+    return;
+
+  void *addr = __builtin_return_address(0);
+
+  AOUT("solving switch: %u %llu %u %u 0x%x @%p\n",
+       label, cond, size, num_cases, cid, addr);
+
+  if (__pipe_fd < 0)
+    return;
+
+  // the taken case is kept as a nested constraint
+  dfsan_label taken = 0;
+  for (uint32_t i = 0; i < num_cases; i++) {
+    if (cases[i] == cond) {
+      taken = dfsan_union(CONST_LABEL, label, (bveq << 8) | ICmp, size,
+                          cond, cond);
+      break;
+    }
+  }
+
+  pipe_msg msg = {
+    .msg_type = switch_type,
+    .flags = 0,
+    .instance_id = __instance_id,
+    .addr = (uptr)addr,
+    .context = __taint_trace_callstack,
+    .id = cid,
+    .label = label,
+    .result = cond
+  };
+
+  if (__send_event(&msg, sizeof(msg)) < 0) {
+    Die();
+  }
+
+  // the case table goes with the header in one event, on the stack unless
+  // the switch is large
+  size_t msg_size = sizeof(switch_msg) + num_cases * sizeof(uint64_t);
+  alignas(switch_msg) char stack_buf[sizeof(switch_msg) +
+                                     kStackSwitchCases * sizeof(uint64_t)];
+  bool on_stack = num_cases <= kStackSwitchCases;
+  switch_msg *smsg = on_stack ? (switch_msg*)stack_buf
+                              : (switch_msg*)MmapOrDie(msg_size, "switch msg");
+  smsg->label = label;
+  smsg->taken_label = taken;
+  smsg->num_cases = num_cases;
+  internal_memcpy(smsg->cases, cases, num_cases * sizeof(uint64_t));
+
+  // FIXME: assuming single writer so msg will arrive in the same order
+  uptr ret = __send_event(smsg, msg_size);
+  if (!on_stack) UnmapOrDie(smsg, msg_size);
+  if (ret < 0) {
+    Die();
+  }
+}
+
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE void
 __taint_trace_indcall(dfsan_label label) {
   if (label == 0)
@@ -121,7 +391,7 @@ __taint_trace_gep(dfsan_label ptr_label, uint64_t ptr, dfsan_label index_label,
     .result = (uint64_t)index
   };
 
-  if (internal_write(__pipe_fd, &msg, sizeof(msg)) < 0) {
+  if (__send_event(&msg, sizeof(msg)) < 0) {
     Die();
   }
 
@@ -136,7 +406,7 @@ __taint_trace_gep(dfsan_label ptr_label, uint64_t ptr, dfsan_label index_label,
   };
 
   // FIXME: assuming single writer so msg will arrive in the same order
-  if (internal_write(__pipe_fd, &gmsg, sizeof(gmsg)) < 0) {
+  if (__send_event(&gmsg, sizeof(gmsg)) < 0) {
     Die();
   }
 
@@ -166,6 +436,13 @@ __taint_trace_memcmp(dfsan_label label) {
   if (info->l1 != CONST_LABEL && info->l2 != CONST_LABEL)
     has_content = 0;
 
+  // concrete oprand is always in op1
+  const uint8_t *content = (const uint8_t *)get_label_operands(label)->op1.i;
+  uint64_t blob_offset = 0;
+  if (has_content && __blob_area &&
+      __blob_store(content, info->size, &blob_offset))
+    has_content |= F_MEMCMP_BLOB;
+
   pipe_msg msg = {
     .msg_type = memcmp_type,
     .flags = has_content,
@@ -176,20 +453,28 @@ __taint_trace_memcmp(dfsan_label label) {
     .result = (uint64_t)info->size
   };
 
-  if (internal_write(__pipe_fd, &msg, sizeof(msg)) < 0) {
+  if (__send_event(&msg, sizeof(msg)) < 0) {
     Die();
   }
 
   if (!has_content)
     return;
 
+  if (has_content & F_MEMCMP_BLOB) {
+    memcmp_blob_msg bmsg = {.label = label, .offset = blob_offset};
+    if (__send_event(&bmsg, sizeof(bmsg)) < 0) {
+      Die();
+    }
+    return;
+  }
+
   size_t msg_size = sizeof(memcmp_msg) + info->size;
   memcmp_msg *mmsg = (memcmp_msg*)__builtin_alloca(msg_size);
   mmsg->label = label;
-  internal_memcpy(mmsg->content, (void*)info->op1.i, info->size); // concrete oprand is always in op1
+  internal_memcpy(mmsg->content, content, info->size);
 
   // FIXME: assuming single writer so msg will arrive in the same order
-  if (internal_write(__pipe_fd, mmsg, msg_size) < 0) {
+  if (__send_event(mmsg, msg_size) < 0) {
     Die();
   }
 
@@ -224,7 +509,7 @@ __taint_trace_memerr(dfsan_label ptr_label, uptr ptr, dfsan_label size_label,
     .result = r
   };
 
-  if (internal_write(__pipe_fd, &msg, sizeof(msg)) < 0) {
+  if (__send_event(&msg, sizeof(msg)) < 0) {
     Die();
   }
 }
@@ -233,4 +518,44 @@ extern "C" void InitializeSolver() {
   __instance_id = flags().instance_id;
   __session_id = flags().session_id;
   __pipe_fd = flags().pipe_fd;
+  if (flags().event_ring && flags().shm_fd != -1 && __pipe_fd != -1) {
+    // the ring follows the union table in the shm
+    uptr ret = internal_mmap(nullptr, EVENT_RING_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, flags().shm_fd, union_table_size());
+    int err;
+    if (internal_iserror(ret, &err)) {
+      Report("WARNING: failed to map event ring, fallback to pipe\n");
+    } else {
+      __event_ring = (struct event_ring *)ret;
+    }
+  }
+  if (flags().memcmp_blob && flags().shm_fd != -1 && __pipe_fd != -1) {
+    // the blob area follows the event ring
+    uptr ret = internal_mmap(nullptr, BLOB_AREA_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, flags().shm_fd,
+                             union_table_size() + EVENT_RING_SIZE);
+    int err;
+    if (internal_iserror(ret, &err)) {
+      Report("WARNING: failed to map blob area, fallback to inline memcmp content\n");
+    } else {
+      __blob_area = (struct blob_area *)ret;
+    }
+  }
+  if ((flags().branch_filter || flags().snapshot_fd != -1) &&
+      flags().shm_fd != -1 && __pipe_fd != -1) {
+    // the branch filter follows the blob area
+    uptr ret = internal_mmap(nullptr, BRANCH_FILTER_SIZE, PROT_READ,
+                             MAP_SHARED, flags().shm_fd,
+                             union_table_size() + EVENT_RING_SIZE + BLOB_AREA_SIZE);
+    int err;
+    if (internal_iserror(ret, &err)) {
+      Report("WARNING: failed to map branch filter, sending all conds\n");
+    } else {
+      __branch_filter = (struct branch_filter *)ret;
+    }
+  }
+}
+
+extern "C" void ResetSolver() {
+  internal_memset(__sites, 0, sizeof(__sites));
 }
@@ -1,8 +1,10 @@
 #include "solver.h"
+#include "jigsaw/interp.h"
 
 #include "dfsan/dfsan.h"
 
 #include <math.h>
+#include <stdio.h>
 #include <string.h>
 
 using namespace rgd;
@@ -211,27 +213,128 @@ I2SSolver::I2SSolver(): matches(0), mismatches(0) {
   binop_mask.set(rgd::AShr);
 }
 
+// whether the comparison holds on the operands, as the JIT'ed functions
+// compute them
+static bool holds(uint32_t comparison, uint64_t a, uint64_t b) {
+  switch (comparison) {
+    case rgd::Equal: return a == b;
+    case rgd::Distinct: return a != b;
+    case rgd::Ult: return a < b;
+    case rgd::Ule: return a <= b;
+    case rgd::Ugt: return a > b;
+    case rgd::Uge: return a >= b;
+    case rgd::Slt: return (int64_t)a < (int64_t)b;
+    case rgd::Sle: return (int64_t)a <= (int64_t)b;
+    case rgd::Sgt: return (int64_t)a > (int64_t)b;
+    case rgd::Sge: return (int64_t)a >= (int64_t)b;
+    case rgd::Memcmp: return a == 1;
+    case rgd::MemcmpN: return a == 0;
+    default: return false;
+  }
+}
+
+// runs c on the input in buf with patch, with its JIT'ed function or its
+// program
+static bool check_constraint(std::shared_ptr<const Constraint> const& c,
+                             uint32_t comparison, const uint8_t *buf,
+                             patch_t const& patch, std::vector<uint64_t> &args) {
+  if (!c->get_fn() && !c->get_program()) {
+    c->set_program(ConstraintProgram::compile(c->get_root(), c->local_map));
+    if (!c->get_program()) return false;
+  }
+  args.assign(RET_OFFSET + c->input_args.size() + 1, 0);
+  for (size_t i = 0; i < c->input_args.size(); i++) {
+    if (!c->input_args[i].first)
+      args[RET_OFFSET + i] = c->input_args[i].second;
+  }
+  for (auto const& [offset, lidx] : c->local_map) {
+    args[RET_OFFSET + lidx] = patch.get(buf, offset);
+  }
+  run_constraint(*c, args.data());
+  return holds(comparison, args[0], args[1]);
+}
+
 solver_result_t
 I2SSolver::solve(std::shared_ptr<SearchTask> task,
                  const uint8_t *in_buf, size_t in_size,
-                 uint8_t *out_buf, size_t &out_size) {
+                 patch_t &patch) {
 
   if (task->constraints.size() > 1) {
-    // FIXME: only support single constraint for now
-    return SOLVER_TIMEOUT;
+    return solve_conjunction(task, in_buf, in_size, patch);
   }
-  auto const& c = task->constraints[0];
-  auto const& cm = task->consmeta[0];
-  auto comparison = task->comparisons[0];
+  return solve_one(task->constraints[0], task->consmeta[0],
+                   task->comparisons[0], in_buf, in_size, patch);
+}
+
+// constraints over disjoint input bytes are solved one by one, each on
+// its own bytes, and the combined input is checked against all of them
+solver_result_t
+I2SSolver::solve_conjunction(std::shared_ptr<SearchTask> task,
+                             const uint8_t *in_buf, size_t in_size,
+                             patch_t &patch) {
+  std::unordered_set<uint32_t> bytes;
+  for (auto const& c : task->constraints) {
+    // atoi solutions can change the length of the input
+    if (!c->atoi_info.empty()) {
+      return SOLVER_TIMEOUT;
+    }
+    for (auto const& [offset, lidx] : c->local_map) {
+      if (!bytes.insert(offset).second) {
+        return SOLVER_TIMEOUT;
+      }
+    }
+  }
+
+  patch_t one;
+  for (size_t i = 0; i < task->constraints.size(); i++) {
+    auto const& c = task->constraints[i];
+    one.clear();
+    if (solve_one(c, task->consmeta[i], task->comparisons[i], in_buf, in_size,
+                  one) != SOLVER_SAT) {
+      return SOLVER_TIMEOUT;
+    }
+    for (auto const& [offset, value] : one.bytes) {
+      if (c->local_map.count(offset)) patch.set(offset, value);
+    }
+  }
+
+  std::vector<uint64_t> args;
+  for (size_t i = 0; i < task->constraints.size(); i++) {
+    if (!check_constraint(task->constraints[i], task->comparisons[i], in_buf, patch, args)) {
+      mismatches++;
+      // each constraint holds on its own bytes, a fair start for the search
+      task->offer_best(patch.bytes, SearchTask::kUnknownDistance);
+      return SOLVER_TIMEOUT;
+    }
+  }
+  return SOLVER_SAT;
+}
+
+solver_result_t
+I2SSolver::solve_one(std::shared_ptr<const Constraint> const& c,
+                     ConsMeta const& cm, uint32_t comparison,
+                     const uint8_t *in_buf, size_t in_size,
+                     patch_t &patch) {
+
   if (likely(isRelationalKind(comparison))) {
     uint64_t value = 0, value_r = 0;
     uint64_t r = 0;
-    for (auto const& candidate : cm->i2s_candidates) {
+    // runs of input bytes wider than 8 bytes are tried at each offset, as
+    // wide as the operands
+    std::vector<std::pair<size_t, uint32_t>> candidates;
+    uint32_t width = c->get_root()->children(0).bits() / 8;
+    for (auto const& candidate : cm.i2s_candidates) {
+      if (candidate.second <= 8) {
+        candidates.push_back(candidate);
+      } else if (width > 0 && width <= 8) {
+        for (uint32_t k = 0; k + width <= candidate.second; k++) {
+          candidates.push_back({candidate.first + k, width});
+        }
+      }
+    }
+    for (auto const& candidate : candidates) {
       size_t offset = candidate.first;
       uint32_t s = candidate.second;
-      if (s > 8) {
-        continue;
-      }
       auto atoi = c->atoi_info.find(offset);
       if (likely(atoi == c->atoi_info.end())) {
         // size can be not a power of 2
@@ -329,22 +432,21 @@ I2SSolver::solve(std::shared_ptr<SearchTask> task,
           continue; // next offset
         }
         DEBUGF("i2s: %lu = 0x%lx\n", offset, r);
-        memcpy(out_buf, in_buf, in_size);
-        out_size = in_size;
-        memcpy(&out_buf[offset], &r, s);
+        for (uint32_t k = 0; k < s; k++) {
+          patch.set(offset + k, (r >> (8 * k)) & 0xff);
+        }
         return SOLVER_SAT;
       } else {
         uint32_t base = std::get<1>(atoi->second);
         uint32_t old_len = std::get<2>(atoi->second);
+        // a sum isn't written as digits, the search spreads it
+        if (base == ATOI_SUM_BASE) continue;
         DEBUGF("i2s: try atoi %lu, base %u, old_len %u\n", offset, base, old_len);
-        long num = 0;
         unsigned long unum = 0;
-        bool is_signed = false;
         if (old_len > 0) {
           char buf[old_len + 1];
           memcpy(buf, &in_buf[offset], old_len);
           buf[old_len] = 0;
-          is_signed = (buf[0] == '-');
           unum = strtoul(buf, NULL, base); // all operands are unsgined in symsan
         }
         if (c->op1 == unum) {
@@ -357,32 +459,20 @@ I2SSolver::solve(std::shared_ptr<SearchTask> task,
           continue; // next offset
         }
         DEBUGF("i2s-atoi: %lu = %lx\n", offset, r);
-        const char *format = nullptr;
-        switch (base) {
-          case 2: format = "%lb"; break;
-          case 8: format = "%lo"; break;
-          case 10: format = is_signed ? "%ld" : "%lu"; break;
-          case 16: format = "%lx"; break;
-          default: {
-            WARNF("unsupported base %d\n", base);
-            continue;
-          }
-        }
-        memcpy(out_buf, in_buf, offset); // extend size as in cmplog
-        size_t num_len;
-        if (is_signed) {
-          num_len = snprintf((char*)out_buf + offset, 64, format, (long)r);
-        } else {
-          num_len = snprintf((char*)out_buf + offset, 64, format, r);
+        // the size can change, as in cmplog; a value past LONG_MAX is
+        // written negative, which strtoul() reads back the same
+        char digits[kMaxNumberLen];
+        size_t num_len = encode_number(r, base, sizeof(r), old_len, digits);
+        if (num_len == 0) {
+          WARNF("unsupported base %d\n", base);
+          continue;
         }
-        memcpy(out_buf + offset + num_len, in_buf + offset + old_len, in_size - offset - old_len);
-        out_size = in_size + num_len - old_len;
+        patch.replace(offset, old_len, (const uint8_t*)digits, num_len);
         return SOLVER_SAT;
       }
     }
   } else if (comparison == rgd::Memcmp) {
     DEBUGF("i2s: try memcmp\n");
-    memcpy(out_buf, in_buf, in_size);
 
     size_t const_index = 0;
     for (auto const& arg : c->input_args) {
@@ -393,12 +483,12 @@ I2SSolver::solve(std::shared_ptr<SearchTask> task,
       mismatches++;
       return SOLVER_TIMEOUT;
     }
-    if (cm->i2s_candidates.size() != 1) {
+    if (cm.i2s_candidates.size() != 1) {
       WARNF("only support single i2s candidate\n");
       return SOLVER_TIMEOUT;
     }
-    size_t offset = cm->i2s_candidates[0].first;
-    uint32_t size = cm->i2s_candidates[0].second;
+    size_t offset = cm.i2s_candidates[0].first;
+    uint32_t size = cm.i2s_candidates[0].second;
     if (size != c->local_map.size()) {
       WARNF("input size mismatch\n");
       return SOLVER_TIMEOUT;
@@ -412,7 +502,7 @@ I2SSolver::solve(std::shared_ptr<SearchTask> task,
         if (i == 0)
           value = c->input_args[const_index].second;
         uint8_t v = ((value >> i) & 0xff);
-        out_buf[o] = v;
+        patch.set(o, v);
         DEBUGF("  %lu = %u\n", o, v);
         i += 8;
         if (i == 64) {
@@ -420,12 +510,12 @@ I2SSolver::solve(std::shared_ptr<SearchTask> task,
           i = 0;
         }
       }
-      out_size = in_size;
       return SOLVER_SAT;
     } else {
       // there could be transformations on the input
-      auto *info = __dfsan::get_label_info(c->get_root()->label());
-      uint64_t sample = info->op2.i;
+      dfsan_label root = c->get_root()->label();
+      auto *info = __dfsan::get_label_info(root);
+      uint64_t sample = __dfsan::get_label_operands(root)->op2.i;
       uint16_t sample_len = info->size > 8 ? 8 : info->size;
       uint8_t sample_buf[sample_len];
       memcpy(sample_buf, &sample, sample_len);
@@ -468,7 +558,7 @@ I2SSolver::solve(std::shared_ptr<SearchTask> task,
           if (i == 0)
             value = c->input_args[const_index].second;
           uint8_t v = ((value >> i) & 0xff);
-          out_buf[o] = (uint8_t)_get_binop_value_r(v, encode_val, kind, false);
+          patch.set(o, (uint8_t)_get_binop_value_r(v, encode_val, kind, false));
           DEBUGF("  %lu = %u\n", o, v);
           i += 8;
           if (i == 64) {
@@ -476,7 +566,6 @@ I2SSolver::solve(std::shared_ptr<SearchTask> task,
             i = 0;
           }
         }
-        out_size = in_size;
         return SOLVER_SAT;
       } else if (touppwer) {
         DEBUGF("i2s: memcmp try touppwer\n");
@@ -484,7 +573,7 @@ I2SSolver::solve(std::shared_ptr<SearchTask> task,
           if (i == 0)
             value = c->input_args[const_index].second;
           uint8_t v = ((value >> i) & 0xff);
-          out_buf[o] = v | 0x20;
+          patch.set(o, v | 0x20);
           DEBUGF("  %lu = %u\n", o, v);
           i += 8;
           if (i == 64) {
@@ -492,7 +581,6 @@ I2SSolver::solve(std::shared_ptr<SearchTask> task,
             i = 0;
           }
         }
-        out_size = in_size;
         return SOLVER_SAT;
       } else if (tolower) {
         DEBUGF("i2s: memcmp try tolower\n");
@@ -500,7 +588,7 @@ I2SSolver::solve(std::shared_ptr<SearchTask> task,
           if (i == 0)
             value = c->input_args[const_index].second;
           uint8_t v = ((value >> i) & 0xff);
-          out_buf[o] = v & 0x5f;
+          patch.set(o, v & 0x5f);
           DEBUGF("  %lu = %u\n", o, v);
           i += 8;
           if (i == 64) {
@@ -508,7 +596,6 @@ I2SSolver::solve(std::shared_ptr<SearchTask> task,
             i = 0;
           }
         }
-        out_size = in_size;
         return SOLVER_SAT;
       } else {
         mismatches++;
@@ -517,13 +604,14 @@ I2SSolver::solve(std::shared_ptr<SearchTask> task,
     }
   } else if (comparison == rgd::MemcmpN) {
     DEBUGF("i2s: try memcmpN\n");
-    memcpy(out_buf, in_buf, in_size);
-    size_t offset = cm->i2s_candidates[0].first;
-    uint32_t size = cm->i2s_candidates[0].second;
-    out_buf[offset] = in_buf[offset] + 8;
-    out_size = in_size;
+    size_t offset = cm.i2s_candidates[0].first;
+    patch.set(offset, in_buf[offset] + 8);
     return SOLVER_SAT;
   }
   mismatches++;
   return SOLVER_TIMEOUT;
-}
\ No newline at end of file
+}
+void I2SSolver::write_stats(int fd) {
+  dprintf(fd, "i2s_matches       : %lu\n", matches.load());
+  dprintf(fd, "i2s_mismatches    : %lu\n", mismatches.load());
+}
@@ -0,0 +1,314 @@
+#include "solver.h"
+#include "jigsaw/interp.h"
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace rgd;
+
+#define DEBUG 0
+
+#if !DEBUG
+#undef DEBUGF
+#define DEBUGF(_str...) do { } while (0)
+#endif
+
+static inline uint64_t mask(uint64_t v, uint32_t bits) {
+  return bits >= 64 ? v : v & ((1ULL << bits) - 1);
+}
+
+static inline int64_t sext(uint64_t v, uint32_t bits) {
+  if (bits >= 64) return (int64_t)v;
+  uint64_t m = 1ULL << (bits - 1);
+  return (int64_t)((mask(v, bits) ^ m) - m);
+}
+
+// the value of node on the input in buf with patch, as the interpreter
+// computes it; false if it has values wider than 64 bits
+static bool eval(const AstNode *node,
+                 std::vector<std::pair<bool, uint64_t>> const& input_args,
+                 const uint8_t *buf, patch_t const& patch, uint64_t &v) {
+  uint32_t bits = node->bits();
+  if (bits == 0 || bits > 64) return false;
+  uint64_t a = 0, b = 0;
+  if (node->kind() != rgd::Read && node->kind() != rgd::Constant) {
+    if (node->children_size() > 0 &&
+        !eval(&node->children(0), input_args, buf, patch, a)) {
+      return false;
+    }
+    if (node->children_size() > 1 &&
+        !eval(&node->children(1), input_args, buf, patch, b)) {
+      return false;
+    }
+  }
+  switch (node->kind()) {
+    case rgd::Bool: v = node->boolvalue(); break;
+    case rgd::Constant: v = input_args[node->index()].second; break;
+    case rgd::Read:
+      v = 0;
+      for (uint32_t i = 0; i < bits / 8; i++) {
+        v |= (uint64_t)patch.get(buf, node->index() + i) << (i * 8);
+      }
+      break;
+    case rgd::Concat: {
+      uint32_t lo = node->children(0).bits();
+      v = lo >= 64 ? a : (b << lo) | a;
+      break;
+    }
+    case rgd::Extract: v = a >> node->index(); break;
+    case rgd::ZExt: v = a; break;
+    case rgd::SExt: v = (uint64_t)sext(a, node->children(0).bits()); break;
+    case rgd::Add: v = a + b; break;
+    case rgd::Sub: v = a - b; break;
+    case rgd::Mul: v = a * b; break;
+    case rgd::UDiv: v = a / (b ? b : 1); break;
+    case rgd::URem: v = a % (b ? b : 1); break;
+    case rgd::Neg: v = 0 - a; break;
+    case rgd::Not: v = ~a; break;
+    case rgd::And: v = a & b; break;
+    case rgd::Or: v = a | b; break;
+    case rgd::Xor: v = a ^ b; break;
+    case rgd::Shl: v = b >= bits ? 0 : a << b; break;
+    case rgd::LShr: v = b >= 64 ? 0 : a >> b; break;
+    default: return false;
+  }
+  v = mask(v, bits);
+  return true;
+}
+
+// whether the subtree of node reads the value at offset, as bits wide
+static bool reads(const AstNode *node, uint32_t offset, uint32_t bits) {
+  if (node->kind() == rgd::Read) {
+    return node->index() == offset && node->bits() == bits;
+  }
+  if (node->kind() == rgd::Constant) return false;
+  for (uint32_t i = 0; i < node->children_size(); i++) {
+    if (reads(&node->children(i), offset, bits)) return true;
+  }
+  return false;
+}
+
+// the inverse of an odd number mod 2^64, by Newton's iteration
+static inline uint64_t inverse(uint64_t a) {
+  uint64_t inv = a;
+  for (int i = 0; i < 6; i++) inv *= 2 - a * inv;
+  return inv;
+}
+
+namespace {
+
+// walks from the root down to the read of the target value, turning the
+// value each node has to take into the one its operand on the path has to
+// take; the operands off the path keep their values on the current input
+struct Inverter {
+  std::vector<std::pair<bool, uint64_t>> const& input_args;
+  const uint8_t *buf;
+  patch_t const& patch;
+  uint32_t offset, width; // the target read
+
+  bool invert(const AstNode *node, uint64_t t, uint64_t &x) {
+    uint32_t bits = node->bits();
+    if (bits > 64 || mask(t, bits) != t) return false;
+    if (node->kind() == rgd::Read) {
+      if (node->index() != offset || bits != width) return false;
+      x = t;
+      return true;
+    }
+    if (node->kind() == rgd::Constant || node->children_size() == 0) {
+      return false;
+    }
+    // the operand on the path, and the value of the other one
+    int on = -1;
+    for (uint32_t i = 0; i < node->children_size() && i < 2; i++) {
+      if (reads(&node->children(i), offset, width)) {
+        if (on >= 0) return false; // the value is read on both sides
+        on = i;
+      }
+    }
+    if (on < 0) return false;
+    const AstNode *child = &node->children(on);
+    uint32_t cbits = child->bits();
+    uint64_t other = 0, cur = 0;
+    if (node->children_size() > 1 &&
+        !eval(&node->children(1 - on), input_args, buf, patch, other)) {
+      return false;
+    }
+    if (!eval(child, input_args, buf, patch, cur)) return false;
+
+    uint64_t c;
+    switch (node->kind()) {
+      case rgd::Add: c = t - other; break;
+      case rgd::Sub: c = on == 0 ? t + other : other - t; break;
+      case rgd::Xor: c = t ^ other; break;
+      case rgd::Not: c = ~t; break;
+      case rgd::Neg: c = 0 - t; break;
+      case rgd::Mul: {
+        // the low bits of an even factor are lost
+        if (other == 0) return false;
+        unsigned z = __builtin_ctzll(other);
+        if (mask(t, z) != 0) return false;
+        c = (t >> z) * inverse(other >> z);
+        // the top z bits don't matter, keep them
+        c = mask(c, bits - z) | (cur & ~mask(~0ULL, bits - z));
+        break;
+      }
+      case rgd::Shl: {
+        if (on != 0 || other >= bits || mask(t, other) != 0) return false;
+        c = (t >> other) | (cur & ~mask(~0ULL, bits - other));
+        break;
+      }
+      case rgd::LShr: {
+        if (on != 0 || other >= bits) return false;
+        if (other && (t >> (bits - other)) != 0) return false;
+        c = (t << other) | mask(cur, other);
+        break;
+      }
+      case rgd::ZExt:
+        if (t >> cbits) return false;
+        c = t;
+        break;
+      case rgd::SExt:
+        if ((uint64_t)sext(t, cbits) != (uint64_t)sext(t, bits)) return false;
+        c = t;
+        break;
+      case rgd::Extract: {
+        uint64_t m = mask(~0ULL, bits) << node->index();
+        c = (cur & ~m) | (t << node->index());
+        break;
+      }
+      case rgd::Concat: {
+        // children(0) is the low part
+        uint32_t lo = node->children(0).bits();
+        if (on == 0) {
+          if ((t >> lo) != other) return false;
+          c = mask(t, lo);
+        } else {
+          if (mask(t, lo) != other) return false;
+          c = t >> lo;
+        }
+        break;
+      }
+      default:
+        return false;
+    }
+    return invert(child, mask(c, cbits), x);
+  }
+};
+
+}
+
+// runs c on the input in buf with patch, as the i2s solver does
+static bool check_constraint(std::shared_ptr<const Constraint> const& c,
+                             uint32_t comparison, const uint8_t *buf,
+                             patch_t const& patch, std::vector<uint64_t> &args) {
+  if (!c->get_fn() && !c->get_program()) {
+    c->set_program(ConstraintProgram::compile(c->get_root(), c->local_map));
+    if (!c->get_program()) return false;
+  }
+  args.assign(RET_OFFSET + c->input_args.size() + 1, 0);
+  for (size_t i = 0; i < c->input_args.size(); i++) {
+    if (!c->input_args[i].first)
+      args[RET_OFFSET + i] = c->input_args[i].second;
+  }
+  for (auto const& [offset, lidx] : c->local_map) {
+    args[RET_OFFSET + lidx] = patch.get(buf, offset);
+  }
+  run_constraint(*c, args.data());
+  uint32_t bits = c->get_root()->children(0).bits();
+  uint64_t a = mask(args[0], bits), b = mask(args[1], bits);
+  return comparison == rgd::Equal ? a == b : a != b;
+}
+
+// the reads in the subtree of node, as (offset, bits)
+static void collect_reads(const AstNode *node,
+                          std::vector<std::pair<uint32_t, uint32_t>> &out) {
+  if (node->kind() == rgd::Read) {
+    std::pair<uint32_t, uint32_t> r{node->index(), node->bits()};
+    if (std::find(out.begin(), out.end(), r) == out.end()) out.push_back(r);
+    return;
+  }
+  for (uint32_t i = 0; i < node->children_size(); i++) {
+    collect_reads(&node->children(i), out);
+  }
+}
+
+// equalities that don't hold yet are solved one at a time, by inverting
+// the side that reads one of their values and setting it to the value of
+// the other side; the result must satisfy all the constraints of the task
+solver_result_t
+InverseSolver::solve(std::shared_ptr<SearchTask> task,
+                     const uint8_t *in_buf, size_t in_size,
+                     patch_t &patch) {
+
+  for (size_t i = 0; i < task->constraints.size(); i++) {
+    uint32_t comparison = task->comparisons[i];
+    // the bytes of an atoi are digits, not the value
+    if ((comparison != rgd::Equal && comparison != rgd::Distinct) ||
+        !task->constraints[i]->atoi_info.empty()) {
+      return SOLVER_TIMEOUT;
+    }
+  }
+
+  std::vector<uint64_t> args;
+  std::vector<std::pair<uint32_t, uint32_t>> locked, leaves;
+  for (size_t i = 0; i < task->constraints.size(); i++) {
+    auto const& c = task->constraints[i];
+    if (check_constraint(c, task->comparisons[i], in_buf, patch, args)) continue;
+    // a distinct that doesn't hold is an equality that does
+    if (task->comparisons[i] != rgd::Equal) return SOLVER_TIMEOUT;
+    const AstNode *root = c->get_root();
+    if (root->children_size() != 2) return SOLVER_TIMEOUT;
+
+    leaves.clear();
+    collect_reads(root, leaves);
+    bool solved = false;
+    for (auto const& [offset, bits] : leaves) {
+      if (bits % 8 || offset + bits / 8 > in_size) continue;
+      bool free = true;
+      for (auto const& [o, b] : locked) {
+        if (offset < o + b / 8 && o < offset + bits / 8) free = false;
+      }
+      if (!free) continue;
+      Inverter inv{c->input_args, in_buf, patch, offset, bits};
+      for (int side = 0; side < 2 && !solved; side++) {
+        uint64_t t, x;
+        if (!reads(&root->children(side), offset, bits) ||
+            !eval(&root->children(1 - side), c->input_args, in_buf, patch, t) ||
+            !inv.invert(&root->children(side), t, x)) {
+          continue;
+        }
+        patch_t trial = patch;
+        for (uint32_t b = 0; b < bits / 8; b++) {
+          trial.set(offset + b, (uint8_t)(x >> (b * 8)));
+        }
+        if (check_constraint(c, rgd::Equal, in_buf, trial, args)) {
+          DEBUGF("inverse: %u[%u] = %lx\n", offset, bits / 8, x);
+          patch = std::move(trial);
+          locked.push_back({offset, bits});
+          solved = true;
+        }
+      }
+      if (solved) break;
+    }
+    if (!solved) {
+      not_invertible++;
+      return SOLVER_TIMEOUT;
+    }
+  }
+
+  for (size_t i = 0; i < task->constraints.size(); i++) {
+    if (!check_constraint(task->constraints[i], task->comparisons[i],
+                          in_buf, patch, args)) {
+      return SOLVER_TIMEOUT;
+    }
+  }
+  task->solution = patch.bytes;
+  task->solved = true;
+  solved_tasks++;
+  return SOLVER_SAT;
+}
+
+void InverseSolver::write_stats(int fd) {
+  dprintf(fd, "inverse_solved    : %lu\n", solved_tasks.load());
+  dprintf(fd, "inverse_failed    : %lu\n", not_invertible.load());
+}
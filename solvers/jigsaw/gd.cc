@@ -1,13 +1,17 @@
 #include <stdint.h>
 #include <assert.h>
 #include <iostream>
+#include <algorithm>
+#include <ctime>
 
 #include "jit.h"
+#include "interp.h"
 #include "input.h"
 #include "grad.h"
 #include "config.h"
 #include "ast.h"
 #include "task.h"
+#include "probes.h"
 
 using namespace rgd;
 
@@ -30,6 +34,28 @@ using namespace rgd;
                                                                                \
   })
 
+// another search of the task got there first
+static inline bool cancelled(std::shared_ptr<SearchTask> &task) {
+  return task->cancel && task->cancel->load(std::memory_order_relaxed);
+}
+
+// how often the searches with a deadline read the clock, in attempts
+static const int kClockStride = 64;
+
+// counts an evaluation of the constraints, and stops the search once it's
+// out of attempts or time, or another search has solved the task
+static inline void count_attempt(std::shared_ptr<SearchTask> &task) {
+  task->attempts += 1;
+  if (task->deadline) {
+    if (task->attempts % kClockStride == 0 && coarse_now_us() > task->deadline)
+      task->stopped = true;
+  } else if (task->attempts > MAX_EXEC_TIMES) {
+    task->stopped = true;
+  }
+  if (cancelled(task))
+    task->stopped = true;
+}
+
 static void dump_results(MutInput &input, std::shared_ptr<SearchTask> task) {
   int i = 0;
   for (auto it : task->inputs) {
@@ -45,47 +71,44 @@ static void dump_distances(std::vector<uint64_t> &distances) {
 }
 
 
-static void add_results(MutInput &input, std::shared_ptr<SearchTask> task) {
+static void add_results(MutInput &input, std::shared_ptr<SearchTask> task,
+                        solution_map_t &solution) {
   int i = 0;
   // since we used a trick (allow each byte to overflow and then use add instead
   // of bitwise or to concatenate, so the overflow would be visible)
   // to allow us to manipulate each byte individually during gradient descent,
   // we need to do a bit more work to get the final result
 
-  // first, we order the inputs by their offset
-  std::map<uint32_t, uint64_t> ordered_inputs;
+  // first, we order the inputs by their offset, keeping their index
+  std::vector<std::pair<uint32_t, uint32_t> > ordered_inputs;
+  ordered_inputs.reserve(task->inputs.size());
   for (auto it : task->inputs) {
-    ordered_inputs[it.first] = input.value[i];
+    ordered_inputs.push_back({it.first, i});
     i++;
   }
-
-  // next, convert the ordered inputs to a vector for easier access
-  std::vector<std::pair<uint32_t, uint64_t> > ordered_inputs_v;
-  for (const auto& pair : ordered_inputs) {
-    ordered_inputs_v.push_back(pair);
-  }
+  std::sort(ordered_inputs.begin(), ordered_inputs.end());
 
   // finally, we calculate the final result
   uint32_t length = 1;
   uint64_t result = 0;
   uint32_t start = 0;
-  for (i = 0; i < ordered_inputs_v.size();) {
-    start = ordered_inputs_v[i].first;
-    result = ordered_inputs_v[i].second;
-    length = task->shapes[start];
+  for (i = 0; i < ordered_inputs.size();) {
+    start = ordered_inputs[i].first;
+    result = input.value[ordered_inputs[i].second];
+    length = task->shapes[ordered_inputs[i].second];
     if (length == 0) { ++i; continue; }
     if (length <= 8) { // 8 bytes or less
       // first, concatenate the bytes according to the shape
       for (int j = 1; j < length; ++j) {
-        result += (ordered_inputs_v[i + j].second << (8 * j));
+        result += (input.value[ordered_inputs[i + j].second] << (8 * j));
       }
       // then extract the correct values, little endian
       for (int j = 0; j < length; ++j) {
-        task->solution[start + j] = (uint8_t)((result >> (8 * j)) & 0xff);
+        solution[start + j] = (uint8_t)((result >> (8 * j)) & 0xff);
       }
     } else { // if it's too large, just copy the value
       for (int j = 0; j < length; ++j) {
-        task->solution[start + j] = ordered_inputs_v[i + j].second;
+        solution[start + j] = input.value[ordered_inputs[i + j].second];
       }
     }
     i += length;
@@ -98,88 +121,72 @@ static inline uint64_t sat_inc(uint64_t base, uint64_t inc) {
 }
 
 
-static uint32_t negate(uint32_t op) {
-  switch (op) {
-    case rgd::Equal: return rgd::Distinct;
-    case rgd::Distinct: return rgd::Equal;
-    case rgd::Sge: return rgd::Slt;
-    case rgd::Sgt:  return rgd::Sle;
-    case rgd::Sle:  return rgd::Sgt;
-    case rgd::Slt:  return rgd::Sge;
-    case rgd::Uge:  return rgd::Ult;
-    case rgd::Ugt:  return rgd::Ule;
-    case rgd::Ule:  return rgd::Ugt;
-    case rgd::Ult:  return rgd::Uge;
-    default: fprintf(stderr, "Non-relational op!\n");
-  };
+// the distance of comparison Comp between a and b, zero once it holds
+template <uint32_t Comp>
+static inline uint64_t distance_of(uint64_t a, uint64_t b) {
+  switch (Comp) {
+    case rgd::Equal: return a >= b ? a - b : b - a;
+    case rgd::Distinct: return a == b;
+    case rgd::Ult: return a < b ? 0 : sat_inc(a - b, 1);
+    case rgd::Ule: return a <= b ? 0 : a - b;
+    case rgd::Ugt: return a > b ? 0 : sat_inc(b - a, 1);
+    case rgd::Uge: return a >= b ? 0 : b - a;
+    case rgd::Slt: return (int64_t)a < (int64_t)b ? 0 : sat_inc(a - b, 1);
+    case rgd::Sle: return (int64_t)a <= (int64_t)b ? 0 : a - b;
+    case rgd::Sgt: return (int64_t)a > (int64_t)b ? 0 : sat_inc(b - a, 1);
+    case rgd::Sge: return (int64_t)a >= (int64_t)b ? 0 : b - a;
+    case rgd::Memcmp: return a ^ 1;
+    case rgd::MemcmpN: return a;
+  }
   return 0;
 }
 
-
-static uint64_t get_distance(uint32_t comp, uint64_t a, uint64_t b) {
-  uint64_t dis = 0;
-  switch (comp) {
-    case rgd::Equal:
-      if (a >= b) dis = a - b;
-      else dis = b - a;
-      break;
-    case rgd::Distinct:
-      if (a == b) dis = 1;
-      else dis = 0;
-      break;
-    case rgd::Ult:
-      if (a < b) dis = 0;
-      else dis = sat_inc(a - b, 1);
-      break;
-    case rgd::Ule:
-      if (a <= b) dis = 0;
-      else dis = a - b;
-      break;
-    case rgd::Ugt:
-      if (a > b) dis = 0;
-      else dis = sat_inc(b - a, 1);
-      break;
-    case rgd::Uge:
-      if (a >= b) dis = 0;
-      else dis = b - a;
-      break;
-    case rgd::Slt:
-      if ((int64_t)a < (int64_t)b) return 0;
-      else dis = sat_inc(a - b, 1);
-      break;
-    case rgd::Sle:
-      if ((int64_t)a <= (int64_t)b) return 0;
-      else dis = a - b;
-      break;
-    case rgd::Sgt:
-      if ((int64_t)a > (int64_t)b) return 0;
-      else dis = sat_inc(b - a, 1);
-      break;
-    case rgd::Sge:
-      if ((int64_t)a >= (int64_t)b) return 0;
-      else dis = b - a;
-      break;
-    case rgd::Memcmp:
-      dis = a ^ 1;
-      break;
-    case rgd::MemcmpN:
-      dis = a;
-      break;
-    default:
-      fprintf(stderr, "Non-relational op!\n");
+// the same over the lanes of a batch, without a branch per lane
+template <uint32_t Comp>
+static void batch_distance_of(const uint64_t *a, const uint64_t *b,
+                              uint64_t *single, uint64_t *f) {
+  for (unsigned l = 0; l < kBatchLanes; l++) {
+    uint64_t dis = distance_of<Comp>(a[l], b[l]);
+    single[l] = sat_inc(single[l], dis);
+    f[l] = sat_inc(f[l], dis);
   }
-  return dis;
 }
 
+static uint64_t no_distance(uint64_t a, uint64_t b) {
+  fprintf(stderr, "Non-relational op!\n");
+  return 0;
+}
+
+static void no_batch_distance(const uint64_t *a, const uint64_t *b,
+                              uint64_t *single, uint64_t *f) {
+  fprintf(stderr, "Non-relational op!\n");
+}
+
+static void bind_distance(ConsMeta &cm) {
+  switch (cm.comparison) {
+#define BIND(kind) \
+    case rgd::kind: \
+      cm.distance_fn = distance_of<rgd::kind>; \
+      cm.batch_distance_fn = batch_distance_of<rgd::kind>; \
+      return;
+    BIND(Equal) BIND(Distinct)
+    BIND(Ult) BIND(Ule) BIND(Ugt) BIND(Uge)
+    BIND(Slt) BIND(Sle) BIND(Sgt) BIND(Sge)
+    BIND(Memcmp) BIND(MemcmpN)
+#undef BIND
+  }
+  cm.distance_fn = no_distance;
+  cm.batch_distance_fn = no_batch_distance;
+}
 
 static uint64_t single_distance(MutInput &input, std::vector<uint64_t> &distances, std::shared_ptr<SearchTask> task, int index) {
   // only re-compute the distance of the constraints that are affected by the change
   uint64_t res = 0;
-  for (uint32_t cons_id : task->cmap[index]) {
+  for (uint32_t cons_id : task->cmap(index)) {
     auto& c = task->constraints[cons_id];
     auto& cm = task->consmeta[cons_id];
     int arg_idx = 0;
-    for (auto const &arg : cm->input_args) {
+    for (auto const &arg : cm.input_args) {
       if (arg.first) {// symbolic
         task->scratch_args[RET_OFFSET + arg_idx] = input.value[arg.second];
       } else {
@@ -187,8 +194,8 @@ static uint64_t single_distance(MutInput &input, std::vector<uint64_t> &distance
       }
       ++arg_idx;
     }
-    c->fn(task->scratch_args);
-    uint64_t dis = get_distance(cm->comparison, task->scratch_args[0], task->scratch_args[1]);
+    run_constraint(*c, task->scratch_args);
+    uint64_t dis = cm.distance_fn(task->scratch_args[0], task->scratch_args[1]);
     distances[cons_id] = dis;
 #if DEBUG
     std::cout << "single distance of constraint " << cons_id << " is " << dis << std::endl;
@@ -199,17 +206,55 @@ static uint64_t single_distance(MutInput &input, std::vector<uint64_t> &distance
 }
 
 
-static uint64_t distance(MutInput &input, std::vector<uint64_t> &distances, std::shared_ptr<SearchTask> task) {
-  static int timeout = 0;
-  static int solved= 0;
+// all the constraints in one call of the task function, which is cheaper
+// than marshalling the arguments of each dirty one
+static uint64_t run_task_fn(MutInput &input, std::vector<uint64_t> &distances,
+                            std::shared_ptr<SearchTask> &task) {
+  size_t n = task->constraints.size();
+  uint64_t *out = task->task_out.data();
+  uint64_t res = task->task_fn(input.value, out);
+  for (size_t i = 0; i < n; i++) {
+    distances[i] = out[i];
+    auto& cm = task->consmeta[i];
+    cm.op1 = out[n + 2 * i];
+    cm.op2 = out[n + 2 * i + 1];
+  }
+  // the cached distances aren't kept up to date
+  task->eval_input.clear();
+  return res;
+}
+
+static uint64_t eval_constraints(MutInput &input, std::vector<uint64_t> &distances,
+                                 std::shared_ptr<SearchTask> &task) {
   uint64_t res = 0;
 
+  // only re-compute the constraints reading a byte that changed since the
+  // last call, the others keep their distance and operands; memcmp ones
+  // aren't in cmap, they are always re-computed
+  size_t size = input.len();
+  if (task->eval_input.size() != size) {
+    task->eval_input.assign(input.value, input.value + size);
+    std::fill(task->eval_dirty.begin(), task->eval_dirty.end(), 1);
+  } else {
+    for (size_t i = 0; i < size; i++) {
+      if (input.value[i] == task->eval_input[i]) continue;
+      task->eval_input[i] = input.value[i];
+      for (uint32_t cons_id : task->cmap(i)) task->eval_dirty[cons_id] = 1;
+    }
+  }
+
   for (int i = 0; i < task->constraints.size(); i++) {
     auto& c = task->constraints[i];
     auto& cm = task->consmeta[i];
+    if (!task->eval_dirty[i] &&
+        cm.comparison != rgd::Memcmp && cm.comparison != rgd::MemcmpN) {
+      distances[i] = task->eval_distances[i];
+      res = sat_inc(res, distances[i]);
+      continue;
+    }
     // mapping symbolic args
     int arg_idx = 0;
-    for (auto const &arg : cm->input_args) {
+    for (auto const &arg : cm.input_args) {
       if (arg.first) { // symbolic
         task->scratch_args[RET_OFFSET + arg_idx] = input.value[arg.second];
       } else {
@@ -217,93 +262,119 @@ static uint64_t distance(MutInput &input, std::vector<uint64_t> &distances, std:
       }
       ++arg_idx;
     }
-    c->fn(task->scratch_args);
-    uint64_t dis = get_distance(cm->comparison, task->scratch_args[0], task->scratch_args[1]);
+    run_constraint(*c, task->scratch_args);
+    uint64_t dis = cm.distance_fn(task->scratch_args[0], task->scratch_args[1]);
     distances[i] = dis;
-    cm->op1 = task->scratch_args[0];
-    cm->op2 = task->scratch_args[1];
+    task->eval_distances[i] = dis;
+    task->eval_dirty[i] = 0;
+    cm.op1 = task->scratch_args[0];
+    cm.op2 = task->scratch_args[1];
 #if DEBUG
     std::cout << "distance of constraint " << i << " is " << dis << std::endl;
 #endif
     res = sat_inc(res, dis);
   }
+  return res;
+}
+
+static uint64_t distance(MutInput &input, std::vector<uint64_t> &distances, std::shared_ptr<SearchTask> task) {
+  uint64_t res = task->task_fn ? run_task_fn(input, distances, task)
+                               : eval_constraints(input, distances, task);
   if (res == 0) {
     task->stopped = true;
     task->solved = true;
     //dump_results(input, task);
-    add_results(input, task);
-  }
-  task->attempts++;
-  if (task->attempts > MAX_EXEC_TIMES) {
-    task->stopped = true;
-    task->solved = false;
+    add_results(input, task, task->solution);
   }
+  count_attempt(task);
   return res;
 }
 
 
+// the probes of partial_derivative, where x+delta and x-delta land when
+// delta goes 1, 4, 16, 64 and is added up; the plus ones go in the first
+// half of the lanes, the minus ones in the second
+static const unsigned kProbes = kBatchLanes / 2;
+static const uint64_t kProbeOffsets[kProbes] = {1, 5, 21, 85};
+
+// evaluates the constraints affected by input byte index at all the probes
+// with one batched call each; single[l] is the distance of those
+// constraints with the byte set to values[l], and f[l] that of all of them
+static void probe_distances(MutInput &input, size_t index,
+    const uint64_t *values, uint64_t *single, uint64_t *f,
+    std::shared_ptr<SearchTask> task) {
+  auto const cons_ids = task->cmap(index);
+  // the distance of the unaffected constraints is the same for every lane,
+  // cons_ids is in increasing order
+  uint64_t rest = 0;
+  for (size_t i = 0, k = 0; i < task->constraints.size(); i++) {
+    if (k < cons_ids.size() && cons_ids[k] == i) { k++; continue; }
+    rest = sat_inc(rest, task->min_distances[i]);
+  }
+  for (unsigned l = 0; l < kBatchLanes; l++) {
+    single[l] = 0;
+    f[l] = rest;
+  }
+
+  uint64_t *args = task->batch_args;
+  for (uint32_t cons_id : cons_ids) {
+    auto& c = task->constraints[cons_id];
+    auto& cm = task->consmeta[cons_id];
+    size_t slot = RET_OFFSET;
+    for (auto const &arg : cm.input_args) {
+      uint64_t *lanes = &args[slot * kBatchLanes];
+      if (arg.first && arg.second == index) {
+        for (unsigned l = 0; l < kBatchLanes; l++) lanes[l] = values[l];
+      } else {
+        uint64_t v = arg.first ? input.value[arg.second] : arg.second;
+        for (unsigned l = 0; l < kBatchLanes; l++) lanes[l] = v;
+      }
+      ++slot;
+    }
+    run_constraint_batch(*c, args, task->scratch_args, slot);
+    cm.batch_distance_fn(args, args + kBatchLanes, single, f);
+  }
+}
+
+
 static void partial_derivative(MutInput &orig_input, size_t index, uint64_t f0, bool *sign, bool* is_linear, uint64_t *val, std::shared_ptr<SearchTask> task) {
 
   uint64_t orig_val = orig_input.value[index];
-  uint64_t delta = 1;
   uint64_t f_plus = 0, f_minus = 0;
-  uint64_t single_dis;
-
-  // calculate f(x+delta)
-  for (delta = 1; delta < 256; delta = delta << 1) {
-    task->plus_distances = task->min_distances;
-    orig_input.update(index, true, delta);
-    single_dis = single_distance(orig_input, task->plus_distances, task, index);
-    if (single_dis == 0) { // well, we got lucky and found a solution
-      *sign = true;
-      *is_linear = false;
-      *val = 0;
-      return;
-    }
-    f_plus = 0;
-    for (int i = 0; i < task->constraints.size(); i++)
-      f_plus = sat_inc(f_plus, task->plus_distances[i]);
+  uint64_t values[kBatchLanes], single[kBatchLanes], f[kBatchLanes];
 
-    task->attempts += 1;
-    if (task->attempts > MAX_EXEC_TIMES)
-      task->stopped = true;
-    if (task->stopped) { *val = 0; return; }
-
-    if (f_plus == f0) { // if f(x+delta) == f(x), delta is not large enough
-      delta = delta << 1;
-    } else {
-      break;
-    }
+  for (unsigned k = 0; k < kProbes; k++) {
+    values[k] = orig_val + kProbeOffsets[k];
+    values[kProbes + k] = orig_val - kProbeOffsets[k];
   }
-  orig_input.value[index] = orig_val; // restore the original value
-
-  // calculate f(x-delta)
-  for (delta = 1; delta < 256; delta = delta << 1) {
-    task->minus_distances = task->min_distances;
-    orig_input.update(index, false, delta);
-    single_dis = single_distance(orig_input, task->minus_distances, task, index);
-    if (single_dis == 0) { // well, we got lucky and found a solution
-      *sign = false;
-      *is_linear = false;
-      *val = 0;
-      return;
-    }
-    f_minus = 0;
-    for (int i = 0; i < task->constraints.size(); i++)
-      f_minus = sat_inc(f_minus, task->minus_distances[i]);
+  probe_distances(orig_input, index, values, single, f, task);
+
+  // walk the probes in the order they used to be tried one at a time, so
+  // the outcome and the attempts they count stay the same
+  for (int dir = 0; dir < 2; dir++) {
+    uint64_t &f_dir = dir == 0 ? f_plus : f_minus;
+    for (unsigned k = 0; k < kProbes; k++) {
+      unsigned l = dir * kProbes + k;
+      if (single[l] == 0) { // well, we got lucky and found a solution
+        orig_input.value[index] = values[l];
+        *sign = dir == 0;
+        *is_linear = false;
+        *val = 0;
+        return;
+      }
+      f_dir = f[l];
 
-    task->attempts += 1;
-    if (task->attempts > MAX_EXEC_TIMES)
-      task->stopped = true;
-    if (task->stopped) { *val = 0; return;}
+      count_attempt(task);
+      if (task->stopped) {
+        orig_input.value[index] = values[l];
+        *val = 0;
+        return;
+      }
 
-    if (f_minus == f0) { // if f(x-delta) == f(x), delta is not large enough
-      delta = delta << 1;
-    } else {
-      break;
+      // if f(x+delta) == f(x), delta is not large enough
+      if (f_dir != f0) break;
     }
   }
-  orig_input.value[index] = orig_val; // restore the original value
 
 #if DEBUG
   std::cout << "calculating partial and f0 is " << f0 << " f_minus is " << f_minus << " and f_plus is " << f_plus << std::endl;
@@ -342,24 +413,23 @@ static void partial_derivative(MutInput &orig_input, size_t index, uint64_t f0,
 
 static void compute_delta_all(MutInput &input, Grad &grad, size_t step) {
   double fstep = (double)step;
-  int index = 0;
-  for (auto &gradu : grad.get_value()) {
-    double movement = gradu.pct * step;
-    input.update(index, gradu.sign, (uint64_t)movement);
+  for (size_t index = 0; index < grad.len(); index++) {
+    double movement = grad.pct(index) * step;
+    input.update(index, grad.sign(index), (uint64_t)movement);
 #if DEBUG
     std::cout << "compute_delta_all for index = " << index
-              << ", sign = " << gradu.sign
+              << ", sign = " << grad.sign(index)
               << ", move = " << movement << std::endl;
 #endif
-    index++;
   }
 }
 
 
+// the entries of the bytes left out of grad_inputs stay 0, so the descent
+// doesn't move them
 static void cal_gradient(MutInput &input, uint64_t f0, Grad &grad, std::shared_ptr<SearchTask> task) {
   uint64_t max = 0;
-  int index = 0;
-  for (auto &gradu : grad.get_value()) {
+  for (uint32_t index : task->grad_inputs) {
 
     if (task->stopped) {
       break;
@@ -377,9 +447,7 @@ static void cal_gradient(MutInput &input, uint64_t f0, Grad &grad, std::shared_p
               << task->inputs[index].first << ", val = " << val << std::endl;
 #endif
     //linear = linear && l;
-    gradu.sign = sign;
-    gradu.val = val;
-    index++;
+    grad.set(index, sign, val);
   }
 }
 
@@ -402,7 +470,7 @@ static uint64_t descend(MutInput &input_min, MutInput &input, uint64_t f0, Grad
       // found a solution
       task->stopped = true;
       task->solved = true;
-      add_results(input, task);
+      add_results(input, task, task->solution);
       return 0;
     } else {
       input_min = input;
@@ -422,21 +490,19 @@ static uint64_t descend(MutInput &input_min, MutInput &input, uint64_t f0, Grad
 
       uint64_t f_new = 0;
       if (doDelta) {
-        double movement = grad.get_value()[deltaIdx].pct * (double)step;
-        input.update(deltaIdx, grad.get_value()[deltaIdx].sign, (uint64_t)movement);
+        double movement = grad.pct(deltaIdx) * (double)step;
+        input.update(deltaIdx, grad.sign(deltaIdx), (uint64_t)movement);
 #if DEBUG
         std::cout << "update index = " << deltaIdx << ", offset = "
                   << task->inputs[deltaIdx].first << ", sign = "
-                  << grad.get_value()[deltaIdx].sign
+                  << grad.sign(deltaIdx)
                   << ", movement = " << movement << std::endl;
 #endif
 
         uint64_t single_dis = single_distance(input, task->distances, task, deltaIdx);
         for (int i = 0; i < task->constraints.size(); i++)
           f_new = sat_inc(f_new, task->distances[i]);
-        task->attempts += 1;
-        if (task->attempts > MAX_EXEC_TIMES)
-          task->stopped = true;
+        count_attempt(task);
         if (single_dis == 0) {
           // if we're doing delta and the single distance is 0
           // we're done with the current index
@@ -452,7 +518,7 @@ static uint64_t descend(MutInput &input_min, MutInput &input, uint64_t f0, Grad
         // found a solution
         task->stopped = true;
         task->solved = true;
-        add_results(input, task);
+        add_results(input, task, task->solution);
         return 0;
       } else if (f_new > f_last) { // use > to give the next larger step a chance
         //if (f_new == UINTMAX_MAX)
@@ -470,7 +536,7 @@ static uint64_t descend(MutInput &input_min, MutInput &input, uint64_t f0, Grad
     } else {
       if (doDelta) deltaIdx++;
       else { deltaIdx = 0; doDelta = true;}
-      while ((deltaIdx < grad.len()) && grad.get_value()[deltaIdx].pct < 0.01) {
+      while ((deltaIdx < grad.len()) && grad.pct(deltaIdx) < 0.01) {
         deltaIdx++ ;
       }
       if (deltaIdx >= grad.len()) {
@@ -509,7 +575,7 @@ static uint64_t get_i2s_value(uint32_t comp, uint64_t v, bool rhs) {
 }
 
 
-static uint64_t try_new_i2s_value(std::shared_ptr<const Constraint> &c, uint32_t comparison, uint64_t value, std::shared_ptr<SearchTask> task) {
+static uint64_t try_new_i2s_value(std::shared_ptr<const Constraint> &c, distance_fn_type distance_fn, uint64_t value, std::shared_ptr<SearchTask> task) {
   int i = 0;
   for (auto const& [offset, lidx] : c->local_map) {
     uint64_t v = ((value >> i) & 0xff);
@@ -523,8 +589,8 @@ static uint64_t try_new_i2s_value(std::shared_ptr<const Constraint> &c, uint32_t
     if (!arg.first) task->scratch_args[RET_OFFSET + arg_idx] = arg.second;
     ++arg_idx;
   }
-  c->fn(task->scratch_args);
-  return get_distance(comparison, task->scratch_args[0], task->scratch_args[1]);
+  run_constraint(*c, task->scratch_args);
+  return distance_fn(task->scratch_args[0], task->scratch_args[1]);
 }
 
 
@@ -535,11 +601,11 @@ static uint64_t try_i2s(MutInput &input_min, MutInput &temp_input, uint64_t f0,
     auto& c = task->constraints[k];
     auto& cm = task->consmeta[k];
     if (task->min_distances[k]) {
-      if (likely(isRelationalKind(cm->comparison))) {
+      if (likely(isRelationalKind(cm.comparison))) {
         // check consecutive input bytes against comparison operands
         // FIXME: add support for other input encodings
         uint64_t input = 0, input_r, value = 0, dis = -1;
-        for (auto const& candidate : cm->i2s_candidates) {
+        for (auto const& candidate : cm.i2s_candidates) {
           const size_t offset = candidate.first;
           const uint32_t size = candidate.second;
           if (size > 8) {
@@ -548,26 +614,26 @@ static uint64_t try_i2s(MutInput &input_min, MutInput &temp_input, uint64_t f0,
           int i = 0, t = size * 8;
           for (size_t off = offset; off < offset + size; off++) {
             const uint32_t lidx = c->local_map.at(off);
-            uint64_t v = input_min.get(cm->input_args[lidx].second);
+            uint64_t v = input_min.get(cm.input_args[lidx].second);
             input |= (v << i);
             input_r |= (v << (t - i - 8));
             i += 8;
           }
-          if (input == cm->op1) {
-            value = get_i2s_value(cm->comparison, cm->op2, true);
-          } else if (input == cm->op2) {
-            value = get_i2s_value(cm->comparison, cm->op1, false);
+          if (input == cm.op1) {
+            value = get_i2s_value(cm.comparison, cm.op2, true);
+          } else if (input == cm.op2) {
+            value = get_i2s_value(cm.comparison, cm.op1, false);
           } else {
             goto try_reverse;
           }
 
           // test the new value
-          dis = try_new_i2s_value(c, cm->comparison, value, task);
+          dis = try_new_i2s_value(c, cm.distance_fn, value, task);
           if (dis == 0) {
 #if DEBUG
             std::cerr << "i2s updated c = " << k << " t = " << t << " input = " << input
-                      << " op1 = " << cm->op1 << " op2 = " << cm->op2
-                      << " cmp = " << cm->comparison << " value = " << value
+                      << " op1 = " << cm.op1 << " op2 = " << cm.op2
+                      << " cmp = " << cm.comparison << " value = " << value
                       << " old-dis = " << task->min_distances[k] << " new-dis = " << dis << std::endl;
 #endif
             // successful, update the real inputs
@@ -575,7 +641,7 @@ static uint64_t try_i2s(MutInput &input_min, MutInput &temp_input, uint64_t f0,
             for (size_t off = offset; off < offset + size; off++) {
               const uint32_t lidx = c->local_map.at(off);
               uint8_t v = ((value >> i) & 0xff);
-              temp_input.set(cm->input_args[lidx].second, v);
+              temp_input.set(cm.input_args[lidx].second, v);
               i += 8;
             }
             updated = true;
@@ -584,17 +650,17 @@ static uint64_t try_i2s(MutInput &input_min, MutInput &temp_input, uint64_t f0,
 
 try_reverse:
           // try reverse encoding
-          if (input_r == cm->op1) {
-            value = get_i2s_value(cm->comparison, cm->op2, true);
-          } else if (input_r == cm->op2) {
-            value = get_i2s_value(cm->comparison, cm->op1, false);
+          if (input_r == cm.op1) {
+            value = get_i2s_value(cm.comparison, cm.op2, true);
+          } else if (input_r == cm.op2) {
+            value = get_i2s_value(cm.comparison, cm.op1, false);
           } else {
             continue;
           }
 
           // test the new value
           value = SWAP64(value) >> (64 - t); // reverse the value
-          dis = try_new_i2s_value(c, cm->comparison, value, task);
+          dis = try_new_i2s_value(c, cm.distance_fn, value, task);
           if (dis == 0) {
             // successful, update the real inputs
             i = 0;
@@ -602,14 +668,14 @@ try_reverse:
               const uint32_t lidx = c->local_map.at(off);
               uint8_t v = ((value >> i) & 0xff);
               // uint8_t v = ((value >> (t - i - 8)) & 0xff);
-              temp_input.set(cm->input_args[lidx].second, v);
+              temp_input.set(cm.input_args[lidx].second, v);
               i += 8;
             }
             updated = true;
             break;
           }
         } // end foreach candidate
-      } else if (cm->comparison == rgd::Memcmp) {
+      } else if (cm.comparison == rgd::Memcmp) {
         size_t const_index = 0;
         for (auto const& arg : c->input_args) {
           if (!arg.first) break;
@@ -618,12 +684,12 @@ try_reverse:
         // memcmp(s1, s2) is i2s_feasible iff s1 is constant
         // try copy s1 to s2
         if (const_index == c->input_args.size()) continue;
-        if (cm->i2s_candidates.size() != 1) {
+        if (cm.i2s_candidates.size() != 1) {
           fprintf(stderr, "memcmp should have only one candidate\n");
           continue;
         }
-        size_t offset = cm->i2s_candidates[0].first;
-        uint32_t size = cm->i2s_candidates[0].second;
+        size_t offset = cm.i2s_candidates[0].first;
+        uint32_t size = cm.i2s_candidates[0].second;
         if (size != c->local_map.size()) {
           fprintf(stderr, "input size mismatch\n");
           continue;
@@ -635,7 +701,7 @@ try_reverse:
           if (i == 0)
             value = c->input_args[const_index].second;
           uint8_t v = ((value >> i) & 0xff);
-          temp_input.set(cm->input_args[lidx].second, v);
+          temp_input.set(cm.input_args[lidx].second, v);
           i += 8;
           if (i == 64) {
             const_index++; // move on to the next 64-bit chunk
@@ -658,13 +724,73 @@ try_reverse:
   return f0;
 }
 
+static std::shared_ptr<const ConstDict> restart_dict;
+
+void rgd::set_restart_dict(std::shared_ptr<const ConstDict> dict) {
+  restart_dict = std::move(dict);
+}
+
 static uint64_t repick_start_point(MutInput &input_min, std::shared_ptr<SearchTask> task) {
   input_min.randomize();
+  // about half the values (by their shape) are set to the constants the
+  // campaign has compared input against, most of the rest of the width is
+  // the same bytes anyway
+  const ConstDict *dict = restart_dict.get();
+  size_t n = dict ? dict->size() : 0;
+  for (size_t i = 0; n && i < task->inputs.size(); ) {
+    size_t width = task->shapes[i];
+    if (width == 0 || (input_min.get_rand() & 1)) {
+      i += std::max<size_t>(width, 1);
+      continue;
+    }
+    size_t r = input_min.get_rand() | (input_min.get_rand() << 8) |
+               (input_min.get_rand() << 16);
+    const uint8_t *buf;
+    size_t len;
+    if (dict->get(r % n, buf, len)) {
+      uint32_t offset = task->inputs[i].first;
+      for (size_t j = 0; j < std::min(width, len) && i + j < task->inputs.size() &&
+                         task->inputs[i + j].first == offset + j; j++) {
+        input_min.set(i + j, buf[j]);
+      }
+    }
+    i += width;
+  }
   uint64_t ret = distance(input_min, task->min_distances, task);
   return ret;
 }
 
 
+// keeps the point a search leaves, e.g. stuck in a local minimum, as the
+// task's best candidate if it's the closest one so far
+static void keep_best(MutInput &input, uint64_t f0, std::shared_ptr<SearchTask> task) {
+  if (task->solved || f0 >= task->best_distance) return;
+  solution_map_t point;
+  add_results(input, task, point);
+  task->offer_best(point, f0);
+}
+
+// starts from the best candidate of the solvers before instead of the
+// input, if it's closer
+static uint64_t warm_start(MutInput &input_min, uint64_t f0, std::shared_ptr<SearchTask> task) {
+  if (task->best.empty() || f0 == 0) return f0;
+  std::vector<std::pair<uint32_t, uint8_t>> values(task->inputs);
+  bool changed = false;
+  for (auto &[offset, value] : values) {
+    auto itr = task->best.find(offset);
+    if (itr != task->best.end() && itr->second != value) {
+      value = itr->second;
+      changed = true;
+    }
+  }
+  if (!changed) return f0;
+  input_min.assign(values);
+  uint64_t f = distance(input_min, task->min_distances, task);
+  if (f < f0) return f;
+  input_min.assign(task->inputs);
+  return distance(input_min, task->min_distances, task);
+}
+
 static uint64_t reload_input(MutInput &input_min, std::shared_ptr<SearchTask> task) {
   input_min.assign(task->inputs);
 #if 0
@@ -677,12 +803,37 @@ static uint64_t reload_input(MutInput &input_min, std::shared_ptr<SearchTask> ta
   return ret;
 }
 
-bool rgd::gd_entry(std::shared_ptr<SearchTask> task) {
-  MutInput input(task->inputs.size());
-  MutInput scratch_input(task->inputs.size());
+// the inputs and gradient of the searches on a thread, reused across tasks
+// so a search doesn't allocate them or seed a new random state
+struct gd_state {
+  MutInput input;
+  MutInput scratch_input;
+  Grad grad;
+};
+static thread_local gd_state gd_states;
+
+bool rgd::gd_entry(std::shared_ptr<SearchTask> task, unsigned start) {
+  SYMSAN_PROBE2(gd_entry_begin, task->constraints.size(), start);
+  SYMSAN_PROBE_ON_EXIT(SYMSAN_PROBE2(gd_entry_end, task->attempts, task->solved));
+  task->prepare_search();
+  for (auto &cm : task->consmeta) {
+    if (!cm.distance_fn) bind_distance(cm);
+  }
+  MutInput &input = gd_states.input;
+  MutInput &scratch_input = gd_states.scratch_input;
+  input.resize(task->inputs.size());
+  scratch_input.resize(task->inputs.size());
   task->attempts = 0;
 
-  uint64_t f0 = reload_input(input, task);
+  // the first start is the input itself, the others are random
+  uint64_t f0;
+  if (start == 0) {
+    f0 = reload_input(input, task);
+    f0 = warm_start(input, f0, task);
+  } else {
+    input.seed((unsigned)time(NULL) + start * 0x9e3779b9U);
+    f0 = repick_start_point(input, task);
+  }
   f0 = try_i2s(input, scratch_input, f0, task);
   if (task->stopped)
     return task->solved;
@@ -692,7 +843,8 @@ bool rgd::gd_entry(std::shared_ptr<SearchTask> task) {
 
   int ep_i = 0;
 
-  Grad grad(input.len());
+  Grad &grad = gd_states.grad;
+  grad.resize(input.len());
 
   while (true) {
     if (task->stopped) {
@@ -716,6 +868,7 @@ bool rgd::gd_entry(std::shared_ptr<SearchTask> task) {
       g_i++;
       //f0 = repick_start_point(input, f0, rng);
       //f0 = reload_input(input);
+      keep_best(input, f0, task);
       f0 = repick_start_point(input, task);
       f0 = try_i2s(input, scratch_input, f0, task);
       if (task->stopped)
@@ -734,5 +887,6 @@ bool rgd::gd_entry(std::shared_ptr<SearchTask> task) {
     //if (ep_i == 2) break;
   }
 
+  keep_best(input, f0, task);
   return task->solved;
 }
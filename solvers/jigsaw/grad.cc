@@ -1,23 +1,27 @@
 #include "grad.h"
 #include <stdint.h>
-#include <iostream>
+#include <algorithm>
 
 using namespace rgd;
 
-Grad::Grad(size_t size) : grads(size) {
+Grad::Grad(size_t size) {
+  resize(size);
 }
 
-std::vector<GradUnit>& Grad::get_value() {
-  return grads;
+void Grad::resize(size_t size) {
+  signs.resize(size);
+  vals.resize(size);
+  pcts.resize(size);
+  clear();
 }
 
 
 uint64_t Grad::max_val() {
+  const uint64_t *v = vals.data();
+  size_t n = vals.size();
   uint64_t ret = 0;
-  for (auto gradu : grads) {
-    //std::cout << "graud value is " << gradu.val <<std::endl;
-    if (gradu.val > ret)
-      ret = gradu.val;
+  for (size_t i = 0; i < n; i++) {
+    ret = v[i] > ret ? v[i] : ret;
   }
   return ret;
 }
@@ -25,30 +29,33 @@ uint64_t Grad::max_val() {
 void Grad::normalize() {
   double max_grad = (double)max_val();
   if (max_grad > 0.0) {
-    for(auto &grad : grads) {
-      grad.pct = 1.0 * ((double)grad.val / max_grad);
+    const uint64_t *v = vals.data();
+    double *p = pcts.data();
+    size_t n = vals.size();
+    for (size_t i = 0; i < n; i++) {
+      p[i] = (double)v[i] / max_grad;
     }
   }
 }
 
 void Grad::clear() {
-  for (auto gradu : grads) {
-    gradu.val = 0;
-    gradu.pct = 0.0;
-  }
+  std::fill(signs.begin(), signs.end(), 0);
+  std::fill(vals.begin(), vals.end(), 0);
+  std::fill(pcts.begin(), pcts.end(), 0.0);
 }
 
 size_t Grad::len() {
-  return grads.size();
+  return vals.size();
 }
 
 
 uint64_t Grad::val_sum() {
+  const uint64_t *v = vals.data();
+  size_t n = vals.size();
   uint64_t ret = 0;
-  for (auto gradu : grads) {
+  for (size_t i = 0; i < n; i++) {
     //FIXME: saturating_add
-    ret += gradu.val;
+    ret += v[i];
   }
   return ret;
 }
-
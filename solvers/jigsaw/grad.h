@@ -7,20 +7,21 @@
 
 namespace rgd {
 
-class GradUnit {
-public:
-  bool sign;
-  uint64_t val;
-  double pct;
-};
-
-
+// the gradient of a search, one entry per input byte, kept as separate
+// arrays so max_val, val_sum and normalize run over contiguous values;
+// resizing keeps the storage, so a Grad can be reused across tasks
 class Grad {
 private:
-  std::vector<GradUnit> grads;
+  std::vector<uint8_t> signs;
+  std::vector<uint64_t> vals;
+  std::vector<double> pcts;
 public:
-  Grad(size_t size);
-  std::vector<GradUnit>& get_value();
+  Grad(size_t size = 0);
+  void resize(size_t size);
+  bool sign(size_t i) const { return signs[i]; }
+  uint64_t val(size_t i) const { return vals[i]; }
+  double pct(size_t i) const { return pcts[i]; }
+  void set(size_t i, bool sign, uint64_t val) { signs[i] = sign; vals[i] = val; }
   uint64_t max_val();
   void clear();
   size_t len();
@@ -19,8 +19,8 @@ uint8_t MutInput::get_rand()
   uint8_t r = (uint8_t)r_val;
   r_val >>= 8;
   r_idx++;
-  if (r_idx == 4) {
-    random_r(&r_d, &r_val);
+  if (r_idx == 8) {
+    r_val = next_rand();
     r_idx = 0;
   }
   return r;
@@ -67,9 +67,18 @@ void MutInput::dump() {
 }
 
 void MutInput::randomize() {
-  for(int i=0;i<size_;i++) {
-    value[i] = (uint64_t)get_rand();
-    //std::cout << "randomize " << i << " and assign value " << (int)value[i] << std::endl;
+  size_t i = 0;
+  for (; i + 8 <= size_; i += 8) {
+    uint64_t r = next_rand();
+    for (size_t k = 0; k < 8; k++) {
+      value[i + k] = (r >> (8 * k)) & 0xff;
+    }
+  }
+  if (i < size_) {
+    uint64_t r = next_rand();
+    for (; i < size_; i++, r >>= 8) {
+      value[i] = r & 0xff;
+    }
   }
 }
 
@@ -77,17 +86,28 @@ uint8_t MutInput::get(const size_t i) {
   return value[i];
 }
 
-MutInput::MutInput(size_t size) {
-  r_idx = 0;
-  value = (uint64_t*)malloc(size * sizeof(uint64_t));
+MutInput::MutInput(size_t size) : value(nullptr), size_(0), capacity_(0) {
+  resize(size);
+  seed((unsigned)time(NULL));
+}
+
+void MutInput::resize(size_t size) {
+  if (size > capacity_) {
+    // grow to the next power of two, so a reused input settles on the
+    // size class of the largest task it has seen
+    size_t cap = 64;
+    while (cap < size) cap <<= 1;
+    free(value);
+    value = (uint64_t*)malloc(cap * sizeof(uint64_t));
+    capacity_ = cap;
+  }
   size_ = size;
-  unsigned int seed;
-  //_rdseed32_step(&seed);
-  seed = (unsigned)time(NULL);
-  memset(r_s, 0, 256);
-  memset(&r_d, 0, sizeof(struct random_data));
-  initstate_r(seed, r_s, 256, &r_d);
-  random_r(&r_d, &r_val);
+}
+
+void MutInput::seed(unsigned seed) {
+  r_state = seed;
+  r_idx = 0;
+  r_val = next_rand();
 }
 
 MutInput::~MutInput()
@@ -23,18 +23,28 @@ public:
   uint64_t* value;
   // std::vector<InputMeta> meta;
   size_t size_;
+  size_t capacity_;
   size_t get_size();
-  MutInput(size_t size);
+  MutInput(size_t size = 0);
+  MutInput(const MutInput &other) = delete;
   ~MutInput();
+  // sets the number of values, keeping the buffer if it's large enough
+  void resize(size_t size);
   void dump();
   uint64_t len();
   uint64_t val_len();
+  // sets every value to a random byte, 8 of them per draw
   void randomize();
-  //random
-  char r_s[256];
-  struct random_data r_d;
-  int32_t r_val;
-  int32_t r_idx;
+  void seed(unsigned seed);
+  //random, wyrand: a 64-bit state, handed out a byte at a time
+  uint64_t r_state;
+  uint64_t r_val;
+  uint32_t r_idx;
+  uint64_t next_rand() {
+    r_state += 0xa0761d6478bd642fULL;
+    __uint128_t t = (__uint128_t)r_state * (r_state ^ 0xe7037ed1a0b428dbULL);
+    return (uint64_t)(t >> 64) ^ (uint64_t)t;
+  }
   uint8_t get_rand();
 
   uint8_t get(const size_t i);
@@ -44,14 +54,10 @@ public:
   void assign(std::vector<std::pair<uint32_t,uint8_t>> &input);
   MutInput& operator=(const MutInput &other);
 
+  // copies the values only, each input keeps its own random state
   static void copy(MutInput *dst, const MutInput *src)
   {
-    uint64_t *dst_value = dst->value;
-    memcpy(dst, src, sizeof(MutInput));
-    if (!dst_value)
-      dst->value = (uint64_t*)malloc(src->size_ * sizeof(uint64_t));
-    else
-      dst->value = dst_value;
+    dst->resize(src->size_);
     memcpy(dst->value, src->value, src->size_ * sizeof(uint64_t));
   }
 };
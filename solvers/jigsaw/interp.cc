@@ -0,0 +1,205 @@
+#include <stdint.h>
+
+#include <unordered_map>
+
+#include "interp.h"
+
+using namespace rgd;
+
+static inline uint64_t mask(uint64_t v, uint32_t bits) {
+  return bits >= 64 ? v : v & ((1ULL << bits) - 1);
+}
+
+static inline int64_t sext(uint64_t v, uint32_t bits) {
+  if (bits >= 64) return (int64_t)v;
+  uint64_t m = 1ULL << (bits - 1);
+  return (int64_t)((mask(v, bits) ^ m) - m);
+}
+
+static inline uint64_t shift_amount(uint64_t b, uint32_t bits) {
+  return b & (bits > 32 ? 63 : 31);
+}
+
+namespace {
+
+// emits the instructions of node in post order, and returns its register;
+// values with the same label are computed once, as in the JIT
+struct ProgramBuilder {
+  local_map_t const& local_map;
+  std::unordered_map<uint32_t, uint32_t> value_cache;
+
+  template <class Code>
+  bool emit(Code &code, const AstNode *node, uint32_t &reg) {
+    if (node->label() != 0) {
+      auto itr = value_cache.find(node->label());
+      if (itr != value_cache.end()) {
+        reg = itr->second;
+        return true;
+      }
+    }
+    if (node->bits() > 64) return false;
+
+    typename Code::value_type in = {node->kind(), node->bits(), 0, 0, 0, 0};
+    switch (node->kind()) {
+      case rgd::Bool:
+        in.bits = 1;
+        in.imm = node->boolvalue();
+        break;
+      case rgd::Constant:
+        in.imm = node->index() + RET_OFFSET;
+        break;
+      case rgd::Read: {
+        auto itr = local_map.find(node->index());
+        if (itr == local_map.end()) return false;
+        in.imm = itr->second + RET_OFFSET;
+        break;
+      }
+      // unary
+      case rgd::Extract:
+        in.imm = node->index();
+        // fall through
+      case rgd::ZExt:
+      case rgd::SExt:
+      case rgd::Neg:
+      case rgd::Not:
+        if (node->children_size() < 1) return false;
+        if (!emit(code, &node->children(0), in.a)) return false;
+        in.src_bits = node->children(0).bits();
+        break;
+      // binary
+      case rgd::Concat:
+      case rgd::Add:
+      case rgd::Sub:
+      case rgd::Mul:
+      case rgd::UDiv:
+      case rgd::SDiv:
+      case rgd::URem:
+      case rgd::SRem:
+      case rgd::And:
+      case rgd::Or:
+      case rgd::Xor:
+      case rgd::Shl:
+      case rgd::LShr:
+      case rgd::AShr:
+      case rgd::Equal:
+      case rgd::Distinct:
+      case rgd::Ult:
+      case rgd::Ule:
+      case rgd::Ugt:
+      case rgd::Uge:
+      case rgd::Slt:
+      case rgd::Sle:
+      case rgd::Sgt:
+      case rgd::Sge:
+      case rgd::Memcmp:
+      case rgd::MemcmpN:
+        if (node->children_size() < 2) return false;
+        if (!emit(code, &node->children(0), in.a)) return false;
+        if (!emit(code, &node->children(1), in.b)) return false;
+        in.src_bits = node->children(0).bits();
+        break;
+      default:
+        // logical ops and ITE, which the JIT rejects too
+        return false;
+    }
+    reg = code.size();
+    code.push_back(in);
+    if (node->label() != 0) value_cache.insert({node->label(), reg});
+    return true;
+  }
+};
+
+}
+
+std::shared_ptr<const ConstraintProgram>
+ConstraintProgram::compile(const AstNode *node, local_map_t const& local_map) {
+  if (!isRelationalKind(node->kind()) &&
+      node->kind() != rgd::Memcmp &&
+      node->kind() != rgd::MemcmpN) {
+    return nullptr;
+  }
+  auto program = std::make_shared<ConstraintProgram>();
+  ProgramBuilder builder{local_map, {}};
+  uint32_t reg;
+  if (!builder.emit(program->code_, node, reg)) {
+    return nullptr;
+  }
+  return program;
+}
+
+void ConstraintProgram::run(uint64_t *args) const {
+  // programs are small, the registers fit on the stack most of the time
+  uint64_t stack_regs[256];
+  std::unique_ptr<uint64_t[]> heap_regs;
+  uint64_t *r = stack_regs;
+  if (code_.size() > 256) {
+    heap_regs.reset(new uint64_t[code_.size()]);
+    r = heap_regs.get();
+  }
+  // leaves don't read their operands, but make them defined
+  r[0] = 0;
+
+  for (size_t i = 0; i < code_.size(); i++) {
+    const insn &in = code_[i];
+    uint64_t a = r[in.a], b = r[in.b];
+    uint64_t v = 0;
+    switch (in.kind) {
+      case rgd::Bool: v = in.imm; break;
+      case rgd::Constant: v = args[in.imm]; break;
+      case rgd::Read:
+        // bytes are added rather than or'ed, like the JIT'ed code does
+        v = args[in.imm];
+        for (uint32_t k = 1; k < in.bits / 8u; k++) {
+          v += args[in.imm + k] << (8 * k);
+        }
+        break;
+      case rgd::Concat: v = in.src_bits >= 64 ? a : (b << in.src_bits) | a; break;
+      case rgd::Extract: v = a >> in.imm; break;
+      case rgd::ZExt: v = a; break;
+      case rgd::SExt: v = (uint64_t)sext(a, in.src_bits); break;
+      case rgd::Add: v = a + b; break;
+      case rgd::Sub: v = a - b; break;
+      case rgd::Mul: v = a * b; break;
+      // division by zero divides by one instead, see codegen
+      case rgd::UDiv: v = a / (b ? b : 1); break;
+      case rgd::URem: v = a % (b ? b : 1); break;
+      case rgd::SDiv:
+      case rgd::SRem: {
+        int64_t sa = sext(a, in.bits), sb = sext(b, in.bits);
+        if (sb == 0) sb = 1;
+        if (sb == -1) v = in.kind == rgd::SDiv ? (uint64_t)0 - (uint64_t)sa : 0;
+        else v = (uint64_t)(in.kind == rgd::SDiv ? sa / sb : sa % sb);
+        break;
+      }
+      case rgd::Neg: v = (uint64_t)0 - a; break;
+      case rgd::Not: v = ~a; break;
+      case rgd::And: v = a & b; break;
+      case rgd::Or: v = a | b; break;
+      case rgd::Xor: v = a ^ b; break;
+      // oversized shifts are poison in LLVM, do what its x86 code does with
+      // them: the amount is masked to 5 bits, 6 for 64-bit values, and
+      // logical right shifts are done on 64 bits
+      case rgd::Shl:
+        b = shift_amount(b, in.bits);
+        v = b >= in.bits ? 0 : a << b;
+        break;
+      case rgd::LShr:
+        v = a >> (b & 63);
+        break;
+      case rgd::AShr:
+        b = shift_amount(b, in.bits);
+        v = (uint64_t)(sext(a, in.bits) >> (b >= in.bits ? in.bits - 1 : b));
+        break;
+      case rgd::Memcmp:
+      case rgd::MemcmpN:
+        args[0] = a == b;
+        continue;
+      default:
+        // comparisons, only the operands are saved
+        args[0] = a;
+        args[1] = b;
+        continue;
+    }
+    r[i] = mask(v, in.bits);
+  }
+}
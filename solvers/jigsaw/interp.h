@@ -0,0 +1,64 @@
+#ifndef JIGSAW_INTERP_H_
+#define JIGSAW_INTERP_H_
+
+#include <memory>
+#include <vector>
+
+#include "ast.h"
+#include "task.h"
+
+namespace rgd {
+
+// a comparison AST flattened into register code, computing the same
+// outputs as its JIT'ed function, for use while that is being compiled
+class ConstraintProgram {
+public:
+  // nullptr if the AST isn't a comparison the JIT would take, or has
+  // values wider than 64 bits
+  static std::shared_ptr<const ConstraintProgram> compile(const AstNode *node,
+      local_map_t const& local_map);
+
+  // same calling convention as test_fn_type
+  void run(uint64_t *args) const;
+
+private:
+  struct insn {
+    uint16_t kind;
+    uint16_t bits;
+    uint16_t src_bits; // bits of the first operand
+    uint32_t a, b;     // operand registers
+    uint64_t imm;      // constant value, or the argument slot to load from
+  };
+
+  std::vector<insn> code_;
+};
+
+// runs the JIT'ed function of c, or its program until there is one
+static inline void run_constraint(const Constraint &c, uint64_t *args) {
+  test_fn_type fn = c.get_fn();
+  if (__builtin_expect(fn != nullptr, 1)) fn(args);
+  else c.get_program()->run(args);
+}
+
+// runs the batched function of c over batch_args, which hold nargs slots;
+// without one, the lanes are run one by one through args
+static inline void run_constraint_batch(const Constraint &c,
+    uint64_t *batch_args, uint64_t *args, size_t nargs) {
+  batch_fn_type batch_fn = c.get_batch_fn();
+  if (batch_fn != nullptr) {
+    batch_fn(batch_args);
+    return;
+  }
+  for (unsigned l = 0; l < kBatchLanes; l++) {
+    for (size_t s = RET_OFFSET; s < nargs; s++) {
+      args[s] = batch_args[s * kBatchLanes + l];
+    }
+    run_constraint(c, args);
+    batch_args[l] = args[0];
+    batch_args[kBatchLanes + l] = args[1];
+  }
+}
+
+}
+
+#endif
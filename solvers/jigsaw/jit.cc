@@ -23,16 +23,71 @@
 #include "jit.h"
 #include "ast.h"
 #include "rgdJit.h"
+#include "probes.h"
 
 using namespace llvm;
 using namespace rgd;
 
 std::unique_ptr<GradJit> JIT;
 
+// with lanes > 1, values are vectors of one element per candidate, and
+// argument slot s of lane l is at arg[s * lanes + l] (see batch_fn_type)
+static inline llvm::Type* intTy(llvm::IRBuilder<> &Builder, uint32_t bits,
+    unsigned lanes) {
+  llvm::Type *ty = llvm::Type::getIntNTy(Builder.getContext(), bits);
+  if (lanes > 1) return llvm::FixedVectorType::get(ty, lanes);
+  return ty;
+}
+
+static inline llvm::Value* slotPtr(llvm::IRBuilder<> &Builder, llvm::Value* arg,
+    uint32_t slot, unsigned lanes) {
+  llvm::Value* idx[1];
+  idx[0] = llvm::ConstantInt::get(Builder.getInt32Ty(), slot * lanes);
+  llvm::Value* ptr = Builder.CreateGEP(arg, idx);
+  if (lanes > 1) {
+    ptr = Builder.CreateBitCast(ptr,
+        llvm::PointerType::getUnqual(intTy(Builder, 64, lanes)));
+  }
+  return ptr;
+}
+
+// where codegen gets the argument slots of a constraint from: the argument
+// array of its function, or, in the function of a whole task, the values
+// of the task's inputs and the constants bound to the constraint, in which
+// case the operands of the comparison are returned in operands
+struct ArgSlots {
+  llvm::Value* arg;
+  // the constraint's ConsMeta::input_args
+  const std::vector<std::pair<bool, uint64_t>>* bind = nullptr;
+  std::vector<llvm::Value*>* operands = nullptr;
+
+  // slot s as a 64-bit value
+  llvm::Value* load(llvm::IRBuilder<> &Builder, uint32_t slot,
+      unsigned lanes) const {
+    if (!bind) return Builder.CreateLoad(slotPtr(Builder, arg, slot, lanes));
+    auto const& b = bind->at(slot - RET_OFFSET);
+    if (!b.first) return Builder.getInt64(b.second);
+    return Builder.CreateLoad(slotPtr(Builder, arg, b.second, 1));
+  }
+
+  // the operands of a comparison, zero-extended to 64 bits
+  void result(llvm::IRBuilder<> &Builder, llvm::Value* c1, llvm::Value* c2,
+      unsigned lanes) const {
+    if (operands) {
+      operands->push_back(c1);
+      operands->push_back(c2);
+      return;
+    }
+    Builder.CreateStore(c1, slotPtr(Builder, arg, 0, lanes));
+    if (c2) Builder.CreateStore(c2, slotPtr(Builder, arg, 1, lanes));
+  }
+};
+
 static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
     const AstNode* node,
-    std::map<size_t, uint32_t> const& local_map, llvm::Value* arg,
-    std::unordered_map<uint32_t, llvm::Value*> &value_cache) {
+    local_map_t const& local_map, ArgSlots const& arg,
+    std::unordered_map<uint32_t, llvm::Value*> &value_cache,
+    unsigned lanes) {
 
   llvm::Value* ret = nullptr;
   //std::cout << "code gen and nargs is " << nargs << std::endl;
@@ -44,13 +99,15 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
     return itr->second;
   }
 
+  // a lane is a 64-bit slot
+  if (lanes > 1 && node->bits() > 64) {
+    throw std::invalid_argument("wide value in batch");
+  }
+
   switch (node->kind()) {
     case rgd::Bool: {
       // getTrue is actually 1 bit integer 1
-      if (node->boolvalue())
-        ret = llvm::ConstantInt::getTrue(Builder.getContext());
-      else
-        ret = llvm::ConstantInt::getFalse(Builder.getContext());
+      ret = llvm::ConstantInt::get(intTy(Builder, 1, lanes), node->boolvalue());
       break;
     }
     case rgd::Constant: {
@@ -58,11 +115,27 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
       uint32_t start = node->index();
       uint32_t length = node->bits() / 8;
 
+      if (lanes > 1) {
+        ret = arg.load(Builder, start + RET_OFFSET, lanes);
+        ret = Builder.CreateTrunc(ret, intTy(Builder, node->bits(), lanes));
+        break;
+      }
+      if (arg.bind) {
+        // baked in, the slots of a wide constant are its 64-bit chunks
+        llvm::APInt value(node->bits(), 0);
+        for (uint32_t k = 0; k * 64 < node->bits(); k++) {
+          llvm::APInt chunk(node->bits(),
+              arg.bind->at(start + k).second);
+          value |= chunk.shl(k * 64);
+        }
+        ret = llvm::ConstantInt::get(Builder.getContext(), value);
+        break;
+      }
       llvm::Value* idx[1];
       idx[0] = llvm::ConstantInt::get(Builder.getInt32Ty(), start + RET_OFFSET);
       llvm::PointerType *constPtr = llvm::PointerType::getUnqual(
           llvm::Type::getIntNTy(Builder.getContext(), node->bits()));
-      ret = Builder.CreateGEP(arg, idx); // calculate the offset
+      ret = Builder.CreateGEP(arg.arg, idx); // calculate the offset
       ret = Builder.CreateBitCast(ret, constPtr);
       ret = Builder.CreateLoad(ret); // load length bytes at once
       break;
@@ -71,14 +144,11 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
       uint32_t start = local_map.at(node->index());
       size_t length = node->bits() / 8;
       //std::cout << "read index " << start << " length " << length << std::endl;
-      llvm::Type *retTy = llvm::Type::getIntNTy(Builder.getContext(), node->bits());
-      llvm::Value* idx[1];
-      idx[0] = llvm::ConstantInt::get(Builder.getInt32Ty(), start + RET_OFFSET);
-      ret = Builder.CreateLoad(Builder.CreateGEP(arg, idx));
+      llvm::Type *retTy = intTy(Builder, node->bits(), lanes);
+      ret = arg.load(Builder, start + RET_OFFSET, lanes);
       ret = Builder.CreateZExtOrTrunc(ret, retTy);
       for (uint32_t k = 1; k < length; k++) {
-        idx[0] = llvm::ConstantInt::get(Builder.getInt32Ty(), start + k + RET_OFFSET);
-        llvm::Value* tmp = Builder.CreateLoad(Builder.CreateGEP(arg, idx));
+        llvm::Value* tmp = arg.load(Builder, start + k + RET_OFFSET, lanes);
         tmp = Builder.CreateZExtOrTrunc(tmp, retTy);
         tmp = Builder.CreateShl(tmp, 8 * k);
         ret = Builder.CreateAdd(ret, tmp);
@@ -89,13 +159,13 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
       uint32_t bits = rc1->bits() + rc2->bits(); 
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
       ret = Builder.CreateOr(
           Builder.CreateShl(
-            Builder.CreateZExt(c2,llvm::Type::getIntNTy(Builder.getContext(),bits)),
+            Builder.CreateZExt(c2,intTy(Builder, bits, lanes)),
             rc1->bits()),
-          Builder.CreateZExt(c1, llvm::Type::getIntNTy(Builder.getContext(), bits)));
+          Builder.CreateZExt(c1, intTy(Builder, bits, lanes)));
       break;
     }
     case rgd::Extract: {
@@ -103,10 +173,10 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
       //std::cerr << "Extract expression" << std::endl;
 #endif
       const AstNode* rc = &node->children(0);
-      llvm::Value* c = codegen(Builder, rc, local_map, arg, value_cache);
+      llvm::Value* c = codegen(Builder, rc, local_map, arg, value_cache, lanes);
       ret = Builder.CreateTrunc(
           Builder.CreateLShr(c, node->index()),
-          llvm::Type::getIntNTy(Builder.getContext(), node->bits()));
+          intTy(Builder, node->bits(), lanes));
       break;
     }
     case rgd::ZExt: {
@@ -114,10 +184,10 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
       // std::cerr << "ZExt the bits is " << node->bits() << std::endl;
 #endif
       const AstNode* rc = &node->children(0);
-      llvm::Value* c = codegen(Builder, rc, local_map, arg, value_cache);
+      llvm::Value* c = codegen(Builder, rc, local_map, arg, value_cache, lanes);
       //FIXME: we may face ZEXT to boolean expr
       ret = Builder.CreateZExtOrTrunc(c,
-          llvm::Type::getIntNTy(Builder.getContext(), node->bits()));
+          intTy(Builder, node->bits(), lanes));
       break;
     }
     case rgd::SExt: {
@@ -125,42 +195,42 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
       // std::cerr << "SExt the bits is " << node->bits() << std::endl;
 #endif
       const AstNode* rc = &node->children(0);
-      llvm::Value* c = codegen(Builder, rc,local_map, arg, value_cache);
+      llvm::Value* c = codegen(Builder, rc,local_map, arg, value_cache, lanes);
       ret = Builder.CreateSExt(c,
-          llvm::Type::getIntNTy(Builder.getContext(), node->bits()));
+          intTy(Builder, node->bits(), lanes));
       break;
     }
     case rgd::Add: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
       ret = Builder.CreateAdd(c1, c2);
       break;
     }
     case rgd::Sub: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
       ret = Builder.CreateSub(c1, c2);
       break;
     }
     case rgd::Mul: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
       ret = Builder.CreateMul(c1, c2);
       break;
     }
     case rgd::UDiv: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
-      llvm::Value* VA0 = llvm::ConstantInt::get(llvm::Type::getIntNTy(Builder.getContext(), node->bits()), 0);
-      llvm::Value* VA1 = llvm::ConstantInt::get(llvm::Type::getIntNTy(Builder.getContext(), node->bits()), 1);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
+      llvm::Value* VA0 = llvm::ConstantInt::get(intTy(Builder, node->bits(), lanes), 0);
+      llvm::Value* VA1 = llvm::ConstantInt::get(intTy(Builder, node->bits(), lanes), 1);
       // FIXME: this is a hack to avoid division by zero, but should use a better way
       // FIXME: should record the divisor to avoid gradient vanish
       llvm::Value* cond = Builder.CreateICmpEQ(c2, VA0);
@@ -171,10 +241,10 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
     case rgd::SDiv: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
-      llvm::Value* VA0 = llvm::ConstantInt::get(llvm::Type::getIntNTy(Builder.getContext(), node->bits()), 0);
-      llvm::Value* VA1 = llvm::ConstantInt::get(llvm::Type::getIntNTy(Builder.getContext(), node->bits()), 1);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
+      llvm::Value* VA0 = llvm::ConstantInt::get(intTy(Builder, node->bits(), lanes), 0);
+      llvm::Value* VA1 = llvm::ConstantInt::get(intTy(Builder, node->bits(), lanes), 1);
       // FIXME: this is a hack to avoid division by zero, but should use a better way
       // FIXME: should record the divisor to avoid gradient vanish
       llvm::Value* cond = Builder.CreateICmpEQ(c2, VA0);
@@ -185,10 +255,10 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
     case rgd::URem: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
-      llvm::Value* VA0 = llvm::ConstantInt::get(llvm::Type::getIntNTy(Builder.getContext(), node->bits()), 0);
-      llvm::Value* VA1 = llvm::ConstantInt::get(llvm::Type::getIntNTy(Builder.getContext(), node->bits()), 1);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
+      llvm::Value* VA0 = llvm::ConstantInt::get(intTy(Builder, node->bits(), lanes), 0);
+      llvm::Value* VA1 = llvm::ConstantInt::get(intTy(Builder, node->bits(), lanes), 1);
       // FIXME: this is a hack to avoid division by zero, but should use a better way
       // FIXME: should record the divisor to avoid gradient vanish
       llvm::Value* cond = Builder.CreateICmpEQ(c2, VA0);
@@ -199,10 +269,10 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
     case rgd::SRem: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
-      llvm::Value* VA0 = llvm::ConstantInt::get(llvm::Type::getIntNTy(Builder.getContext(), node->bits()), 0);
-      llvm::Value* VA1 = llvm::ConstantInt::get(llvm::Type::getIntNTy(Builder.getContext(), node->bits()), 1);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
+      llvm::Value* VA0 = llvm::ConstantInt::get(intTy(Builder, node->bits(), lanes), 0);
+      llvm::Value* VA1 = llvm::ConstantInt::get(intTy(Builder, node->bits(), lanes), 1);
       // FIXME: this is a hack to avoid division by zero, but should use a better way
       // FIXME: should record the divisor to avoid gradient vanish
       llvm::Value* cond = Builder.CreateICmpEQ(c2, VA0);
@@ -212,61 +282,61 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
     }
     case rgd::Neg: {
       const AstNode* rc = &node->children(0);
-      llvm::Value* c = codegen(Builder, rc, local_map, arg, value_cache);
+      llvm::Value* c = codegen(Builder, rc, local_map, arg, value_cache, lanes);
       ret = Builder.CreateNeg(c);
       break;
     }
     case rgd::Not: {
       const AstNode* rc = &node->children(0);
-      llvm::Value* c = codegen(Builder, rc, local_map, arg, value_cache);
+      llvm::Value* c = codegen(Builder, rc, local_map, arg, value_cache, lanes);
       ret = Builder.CreateNot(c);
       break;
     }
     case rgd::And: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
       ret = Builder.CreateAnd(c1, c2);
       break;
     }
     case rgd::Or: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
       ret = Builder.CreateOr(c1, c2);
       break;
     }
     case rgd::Xor: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
       ret = Builder.CreateXor(c1, c2);
       break;
     }
     case rgd::Shl: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
       ret = Builder.CreateShl(c1, c2);
       break;
     }
     case rgd::LShr: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
       ret = Builder.CreateLShr(c1, c2);
       break;
     }
     case rgd::AShr: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
       ret = Builder.CreateAShr(c1, c2);
       break;
     }
@@ -284,19 +354,15 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
     // we don't really care about the comparison, just need to save the operands
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
       // extend to 64-bit to avoid overflow
-      llvm::Value* c1e = Builder.CreateZExt(c1, Builder.getInt64Ty());
-      llvm::Value* c2e = Builder.CreateZExt(c2, Builder.getInt64Ty());
+      llvm::Value* c1e = Builder.CreateZExt(c1, intTy(Builder, 64, lanes));
+      llvm::Value* c2e = Builder.CreateZExt(c2, intTy(Builder, 64, lanes));
 
       // save the comparison operands to the output args
       // so it's easier to negate the condition
-      llvm::Value* idx[1];
-      idx[0] = llvm::ConstantInt::get(Builder.getInt32Ty(), 0);
-      Builder.CreateStore(c1e, Builder.CreateGEP(arg, idx));
-      idx[0] = llvm::ConstantInt::get(Builder.getInt32Ty(), 1);
-      Builder.CreateStore(c2e, Builder.CreateGEP(arg, idx));
+      arg.result(Builder, c1e, c2e, lanes);
 
       ret = nullptr;
       break;
@@ -305,16 +371,14 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
     case rgd::MemcmpN: {
       const AstNode* rc1 = &node->children(0);
       const AstNode* rc2 = &node->children(1);
-      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache);
-      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache);
+      llvm::Value* c1 = codegen(Builder, rc1, local_map, arg, value_cache, lanes);
+      llvm::Value* c2 = codegen(Builder, rc2, local_map, arg, value_cache, lanes);
       // c1 & c2 should be IntNty
       llvm::Value* ret = Builder.CreateICmpEQ(c1, c2);
-      ret = Builder.CreateZExt(ret, Builder.getInt64Ty());
+      ret = Builder.CreateZExt(ret, intTy(Builder, 64, lanes));
 
       // just save the results
-      llvm::Value* idx[1];
-      idx[0] = llvm::ConstantInt::get(Builder.getInt32Ty(), 0);
-      Builder.CreateStore(ret, Builder.CreateGEP(arg, idx));
+      arg.result(Builder, ret, nullptr, lanes);
 
       ret = nullptr;
       break;
@@ -342,9 +406,9 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
       const AstNode* rcond = &node->children(0);
       const AstNode* rtv = &node->children(1);
       const AstNode* rfv = &node->children(2);
-      llvm::Value* cond = codegen(rcond, local_map, arg, value_cache);
-      llvm::Value* tv = codegen(rtv, local_map, arg, value_cache);
-      llvm::Value* fv = codegen(rfv, local_map, arg, value_cache);
+      llvm::Value* cond = codegen(rcond, local_map, arg, value_cache, lanes);
+      llvm::Value* tv = codegen(rtv, local_map, arg, value_cache, lanes);
+      llvm::Value* fv = codegen(rfv, local_map, arg, value_cache, lanes);
       ret = Builder.CreateSelect(cond, tv, fv);
 #endif
       break;
@@ -363,66 +427,343 @@ static llvm::Value* codegen(llvm::IRBuilder<> &Builder,
   return ret; 
 }
 
-int rgd::addFunction(const AstNode* node,
-    std::map<size_t,uint32_t> const& local_map,
-    uint64_t id) {
+// emits the function testing node into module, returns false if it cannot;
+// with lanes > 1, the batched variant evaluating that many candidates
+static bool emitFunction(llvm::Module &module, const AstNode* node,
+    local_map_t const& local_map, std::string const& funcName,
+    unsigned lanes = 1) {
 
   if ((!isRelationalKind(node->kind()) &&
       node->kind() != rgd::Memcmp &&
       node->kind() != rgd::MemcmpN)) {
     std::cerr << "non-relational expr\n";
-    return -1;
+    return false;
   }
 
-  // Open a new module.
-  std::string moduleName = "rgdjit_m" + std::to_string(id);
-  std::string funcName = "rgdjit_f" + std::to_string(id);
-
-  auto TheCtx = std::make_unique<llvm::LLVMContext>();
-  auto TheModule = std::make_unique<Module>(moduleName, *TheCtx);
-  TheModule->setDataLayout(JIT->getDataLayout());
-  llvm::IRBuilder<> Builder(*TheCtx);
+  llvm::IRBuilder<> Builder(module.getContext());
 
   std::vector<llvm::Type*> input_type(1,
       llvm::PointerType::getUnqual(Builder.getInt64Ty()));
   llvm::FunctionType *funcType;
   funcType = llvm::FunctionType::get(Builder.getVoidTy(), input_type, false);
   auto *fooFunc = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage,
-      funcName, TheModule.get());
+      funcName, &module);
   auto *po = llvm::BasicBlock::Create(Builder.getContext(), "entry", fooFunc);
   Builder.SetInsertPoint(po);
-  uint32_t idx = 0;
 
   auto args = fooFunc->arg_begin();
   llvm::Value* var = &(*args);
   std::unordered_map<uint32_t, llvm::Value*> value_cache;
   llvm::Value* body = nullptr;
   try {
-    body = codegen(Builder, node, local_map, var, value_cache);
+    body = codegen(Builder, node, local_map, ArgSlots{var}, value_cache, lanes);
   } catch (std::invalid_argument &e) {
-    std::cerr << "Invalid node: " << e.what() << std::endl;
-    return -1;
+    // not worth a warning, the scalar function is still there
+    if (lanes == 1) std::cerr << "Invalid node: " << e.what() << std::endl;
+    fooFunc->eraseFromParent();
+    return false;
   }
   if (body != nullptr) {
     std::cerr << "non-comparison expr\n";
-    return -1;
+    fooFunc->eraseFromParent();
+    return false;
   }
   Builder.CreateRet(body);
 
   llvm::raw_ostream *stream = &llvm::outs();
   llvm::verifyFunction(*fooFunc, stream);
+  return true;
+}
+
+static inline llvm::Value* satInc(llvm::IRBuilder<> &Builder, llvm::Value* x) {
+  llvm::Value* max = Builder.getInt64(-1);
+  return Builder.CreateSelect(Builder.CreateICmpEQ(x, max), max,
+      Builder.CreateAdd(x, Builder.getInt64(1)));
+}
+
+// the distance of comparison between a and b, as distance_of() in gd.cc
+static llvm::Value* emitDistance(llvm::IRBuilder<> &Builder, uint32_t comparison,
+    llvm::Value* a, llvm::Value* b) {
+  llvm::Value* zero = Builder.getInt64(0);
+  switch (comparison) {
+    case rgd::Equal:
+      return Builder.CreateSelect(Builder.CreateICmpUGE(a, b),
+          Builder.CreateSub(a, b), Builder.CreateSub(b, a));
+    case rgd::Distinct:
+      return Builder.CreateZExt(Builder.CreateICmpEQ(a, b), Builder.getInt64Ty());
+    case rgd::Ult:
+      return Builder.CreateSelect(Builder.CreateICmpULT(a, b), zero,
+          satInc(Builder, Builder.CreateSub(a, b)));
+    case rgd::Ule:
+      return Builder.CreateSelect(Builder.CreateICmpULE(a, b), zero,
+          Builder.CreateSub(a, b));
+    case rgd::Ugt:
+      return Builder.CreateSelect(Builder.CreateICmpUGT(a, b), zero,
+          satInc(Builder, Builder.CreateSub(b, a)));
+    case rgd::Uge:
+      return Builder.CreateSelect(Builder.CreateICmpUGE(a, b), zero,
+          Builder.CreateSub(b, a));
+    case rgd::Slt:
+      return Builder.CreateSelect(Builder.CreateICmpSLT(a, b), zero,
+          satInc(Builder, Builder.CreateSub(a, b)));
+    case rgd::Sle:
+      return Builder.CreateSelect(Builder.CreateICmpSLE(a, b), zero,
+          Builder.CreateSub(a, b));
+    case rgd::Sgt:
+      return Builder.CreateSelect(Builder.CreateICmpSGT(a, b), zero,
+          satInc(Builder, Builder.CreateSub(b, a)));
+    case rgd::Sge:
+      return Builder.CreateSelect(Builder.CreateICmpSGE(a, b), zero,
+          Builder.CreateSub(b, a));
+    case rgd::Memcmp:
+      return Builder.CreateXor(a, Builder.getInt64(1));
+    case rgd::MemcmpN:
+      return a;
+    default:
+      throw std::invalid_argument("non-relational comparison");
+  }
+}
+
+// emits the function of a whole task (see task_fn_type), returns false if
+// one of its constraints cannot be JIT'ed
+static bool emitTaskFunction(llvm::Module &module, SearchTask const& task,
+    std::string const& funcName) {
+
+  llvm::IRBuilder<> Builder(module.getContext());
+  llvm::Type* i64Ptr = llvm::PointerType::getUnqual(Builder.getInt64Ty());
+  llvm::FunctionType *funcType = llvm::FunctionType::get(Builder.getInt64Ty(),
+      {i64Ptr, i64Ptr}, false);
+  auto *fooFunc = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage,
+      funcName, &module);
+  auto *po = llvm::BasicBlock::Create(Builder.getContext(), "entry", fooFunc);
+  Builder.SetInsertPoint(po);
+
+  llvm::Value* values = fooFunc->getArg(0);
+  llvm::Value* out = fooFunc->getArg(1);
+  size_t n = task.constraints.size();
+  llvm::Value* sum = Builder.getInt64(0);
+  try {
+    for (size_t i = 0; i < n; i++) {
+      auto const& c = task.constraints[i];
+      auto const& cm = task.consmeta[i];
+      if (!isRelationalKind(c->get_root()->kind()) &&
+          c->get_root()->kind() != rgd::Memcmp &&
+          c->get_root()->kind() != rgd::MemcmpN) {
+        throw std::invalid_argument("non-relational expr");
+      }
+      // labels are per constraint, so is the cache
+      std::unordered_map<uint32_t, llvm::Value*> value_cache;
+      std::vector<llvm::Value*> operands;
+      codegen(Builder, c->get_root(), c->local_map,
+          ArgSlots{values, &cm.input_args, &operands}, value_cache, 1);
+      llvm::Value* a = operands.at(0);
+      llvm::Value* b = operands.at(1) ? operands[1] : Builder.getInt64(0);
+      llvm::Value* dis = emitDistance(Builder, cm.comparison, a, b);
+      Builder.CreateStore(dis, slotPtr(Builder, out, i, 1));
+      Builder.CreateStore(a, slotPtr(Builder, out, n + 2 * i, 1));
+      Builder.CreateStore(b, slotPtr(Builder, out, n + 2 * i + 1, 1));
+      // saturating, as sat_inc()
+      llvm::Value* next = Builder.CreateAdd(sum, dis);
+      sum = Builder.CreateSelect(Builder.CreateICmpULT(next, sum),
+          Builder.getInt64(-1), next);
+    }
+  } catch (std::exception &e) {
+    std::cerr << "Invalid task: " << e.what() << std::endl;
+    fooFunc->eraseFromParent();
+    return false;
+  }
+  Builder.CreateRet(sum);
+
+  llvm::raw_ostream *stream = &llvm::outs();
+  llvm::verifyFunction(*fooFunc, stream);
+  return true;
+}
+
+static inline std::string functionName(uint64_t id) {
+  return "rgdjit_f" + std::to_string(id);
+}
+
+static inline std::string batchFunctionName(uint64_t id) {
+  return "rgdjit_b" + std::to_string(id);
+}
+
+static inline std::string taskFunctionName(uint64_t id) {
+  return "rgdjit_t" + std::to_string(id);
+}
+
+// removes the module when the last jit_code_t holding it goes away
+struct ModuleCode {
+  llvm::orc::ResourceTrackerSP RT;
+  ModuleCode(llvm::orc::ResourceTrackerSP RT) : RT(std::move(RT)) {}
+  ~ModuleCode() {
+    if (auto Err = RT->remove())
+      llvm::consumeError(std::move(Err));
+  }
+};
+
+static void addModule(std::unique_ptr<Module> M,
+    std::unique_ptr<llvm::LLVMContext> Ctx, jit_code_t *code, jit_tier_t tier) {
+  auto RT = JIT->addModule(std::move(M), std::move(Ctx),
+      tier == JIT_TIER_FAST, tier == JIT_TIER_OPTIMIZED);
+  if (code) *code = std::make_shared<ModuleCode>(std::move(RT));
+}
+
+size_t rgd::jitCodeSize() {
+  return JIT ? JIT->codeSize() : 0;
+}
+
+int rgd::addFunction(const AstNode* node,
+    local_map_t const& local_map,
+    uint64_t id, bool *batched, jit_code_t *code, jit_tier_t tier) {
+
+  SYMSAN_PROBE2(add_function_begin, id, tier);
+  SYMSAN_PROBE_ON_EXIT(SYMSAN_PROBE1(add_function_end, id));
+
+  // Open a new module.
+  std::string moduleName = "rgdjit_m" + std::to_string(id);
+
+  auto TheCtx = std::make_unique<llvm::LLVMContext>();
+  auto TheModule = std::make_unique<Module>(moduleName, *TheCtx);
+  TheModule->setDataLayout(JIT->getDataLayout());
+
+  if (!emitFunction(*TheModule, node, local_map, functionName(id))) {
+    return -1;
+  }
+  bool has_batch = emitFunction(*TheModule, node, local_map,
+      batchFunctionName(id), kBatchLanes);
+  if (batched) *batched = has_batch;
 #if DEBUG
   // TheModule->print(llvm::errs(), nullptr);
 #endif
 
-  JIT->addModule(std::move(TheModule), std::move(TheCtx));
+  addModule(std::move(TheModule), std::move(TheCtx), code, tier);
 
   return 0;
 }
 
+int rgd::addFunctions(std::vector<jit_request_t> const& requests,
+    std::vector<bool> &added, std::vector<bool> &batched, jit_code_t *code,
+    jit_tier_t tier) {
+
+  added.assign(requests.size(), false);
+  batched.assign(requests.size(), false);
+  if (requests.empty()) {
+    return 0;
+  }
+  SYMSAN_PROBE2(add_functions_begin, requests.size(), tier);
+  SYMSAN_PROBE_ON_EXIT(SYMSAN_PROBE1(add_functions_end, requests.size()));
+
+  // one module for the whole batch, named after its first function
+  std::string moduleName = "rgdjit_m" + std::to_string(requests[0].id);
+
+  auto TheCtx = std::make_unique<llvm::LLVMContext>();
+  auto TheModule = std::make_unique<Module>(moduleName, *TheCtx);
+  TheModule->setDataLayout(JIT->getDataLayout());
+
+  int num_added = 0;
+  for (size_t i = 0; i < requests.size(); i++) {
+    auto const& r = requests[i];
+    if (emitFunction(*TheModule, r.node, *r.local_map, functionName(r.id))) {
+      added[i] = true;
+      num_added++;
+      batched[i] = emitFunction(*TheModule, r.node, *r.local_map,
+          batchFunctionName(r.id), kBatchLanes);
+    }
+  }
+
+  if (num_added) {
+    addModule(std::move(TheModule), std::move(TheCtx), code, tier);
+  }
+
+  return num_added;
+}
+
+int rgd::addTaskFunction(SearchTask const& task, uint64_t id,
+    jit_code_t *code, jit_tier_t tier) {
+
+  std::string moduleName = "rgdjit_m" + std::to_string(id);
+
+  auto TheCtx = std::make_unique<llvm::LLVMContext>();
+  auto TheModule = std::make_unique<Module>(moduleName, *TheCtx);
+  TheModule->setDataLayout(JIT->getDataLayout());
+
+  if (!emitTaskFunction(*TheModule, task, taskFunctionName(id))) {
+    return -1;
+  }
+
+  addModule(std::move(TheModule), std::move(TheCtx), code, tier);
+
+  return 0;
+}
+
+task_fn_type rgd::performTaskJit(uint64_t id) {
+  auto ExprSymbol = JIT->lookup(taskFunctionName(id));
+  if (!ExprSymbol) {
+    llvm::consumeError(ExprSymbol.takeError());
+    return nullptr;
+  }
+  return (task_fn_type)ExprSymbol->getAddress();
+}
+
 test_fn_type rgd::performJit(uint64_t id) {
-  std::string funcName = "rgdjit_f" + std::to_string(id);
+  SYMSAN_PROBE1(perform_jit_begin, id);
+  std::string funcName = functionName(id);
   auto ExprSymbol = JIT->lookup(funcName).get();
   auto func = (test_fn_type)ExprSymbol.getAddress();
+  SYMSAN_PROBE2(perform_jit_end, id, func);
   return func;
 }
+
+int rgd::performJit(std::vector<uint64_t> const& ids,
+    std::vector<test_fn_type> &fns) {
+
+  SYMSAN_PROBE1(perform_jit_batch_begin, ids.size());
+  SYMSAN_PROBE_ON_EXIT(SYMSAN_PROBE2(perform_jit_batch_end, ids.size(), fns.size()));
+  std::vector<std::string> names;
+  names.reserve(ids.size());
+  for (auto id : ids) {
+    names.push_back(functionName(id));
+  }
+  // a single lookup materializes the whole batch
+  auto Symbols = JIT->lookup(names);
+  if (!Symbols) {
+    llvm::consumeError(Symbols.takeError());
+    return -1;
+  }
+  fns.clear();
+  fns.reserve(ids.size());
+  for (auto &Sym : *Symbols) {
+    fns.push_back((test_fn_type)Sym.getAddress());
+  }
+  return 0;
+}
+
+batch_fn_type rgd::performBatchJit(uint64_t id) {
+  auto ExprSymbol = JIT->lookup(batchFunctionName(id));
+  if (!ExprSymbol) {
+    llvm::consumeError(ExprSymbol.takeError());
+    return nullptr;
+  }
+  return (batch_fn_type)ExprSymbol->getAddress();
+}
+
+int rgd::performBatchJit(std::vector<uint64_t> const& ids,
+    std::vector<batch_fn_type> &fns) {
+
+  std::vector<std::string> names;
+  names.reserve(ids.size());
+  for (auto id : ids) {
+    names.push_back(batchFunctionName(id));
+  }
+  auto Symbols = JIT->lookup(names);
+  if (!Symbols) {
+    llvm::consumeError(Symbols.takeError());
+    return -1;
+  }
+  fns.clear();
+  fns.reserve(ids.size());
+  for (auto &Sym : *Symbols) {
+    fns.push_back((batch_fn_type)Sym.getAddress());
+  }
+  return 0;
+}
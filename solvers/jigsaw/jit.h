@@ -2,19 +2,79 @@
 #define JIGSAW_H_
 
 #include <memory>
+#include <vector>
 
 #include "ast.h"
+#include "const_dict.h"
 #include "task.h"
 
 namespace rgd {
 
+// keeps the code of a JIT'ed module alive, the module is removed from the
+// JIT and its memory freed once the last copy goes away
+using jit_code_t = std::shared_ptr<const void>;
+
+// how much effort goes into compiling a module: the default codegen, quick
+// codegen for code that may run only a few times, or the IR optimizations
+// and the default codegen for hot code
+enum jit_tier_t {
+  JIT_TIER_DEFAULT = 0,
+  JIT_TIER_FAST,
+  JIT_TIER_OPTIMIZED,
+};
+
+// also emits the batched variant of the function when the AST has no
+// value wider than a lane, and tells so in batched
 int addFunction(const AstNode* node,
-    std::map<size_t, uint32_t> const& local_map,
-    uint64_t id);
+    local_map_t const& local_map,
+    uint64_t id, bool *batched = nullptr, jit_code_t *code = nullptr,
+    jit_tier_t tier = JIT_TIER_DEFAULT);
 
 test_fn_type performJit(uint64_t id);
 
-bool gd_entry(std::shared_ptr<SearchTask> task);
+// nullptr if id has no batched variant
+batch_fn_type performBatchJit(uint64_t id);
+
+// constraints JIT'ed together, into one module
+struct jit_request_t {
+  const AstNode* node;
+  local_map_t const* local_map;
+  uint64_t id;
+};
+
+// added[i] tells whether requests[i] made it into the module, and
+// batched[i] whether its batched variant did too, returns the number of
+// functions added; code holds the module
+int addFunctions(std::vector<jit_request_t> const& requests,
+    std::vector<bool> &added, std::vector<bool> &batched,
+    jit_code_t *code = nullptr, jit_tier_t tier = JIT_TIER_DEFAULT);
+
+// one function evaluating all the constraints of a finalized task, see
+// task_fn_type; the values of the constants are baked into the code
+int addTaskFunction(SearchTask const& task, uint64_t id,
+    jit_code_t *code, jit_tier_t tier = JIT_TIER_DEFAULT);
+
+// nullptr if id has no task function
+task_fn_type performTaskJit(uint64_t id);
+
+// bytes held by the JIT'ed code that hasn't been freed yet
+size_t jitCodeSize();
+
+// looks up all of ids at once, fns follows the order of ids
+int performJit(std::vector<uint64_t> const& ids,
+    std::vector<test_fn_type> &fns);
+
+int performBatchJit(std::vector<uint64_t> const& ids,
+    std::vector<batch_fn_type> &fns);
+
+// start picks the start point of the search, 0 for the task's input and
+// others for random ones; see SearchTask::cancel for searching a task from
+// several start points at once
+bool gd_entry(std::shared_ptr<SearchTask> task, unsigned start = 0);
+
+// the constants the random start points take half their values from, set
+// before any search runs; nullptr for all random ones
+void set_restart_dict(std::shared_ptr<const ConstDict> dict);
 
 }
 
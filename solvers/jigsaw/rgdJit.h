@@ -20,6 +20,7 @@
 #include "llvm/Transforms/Scalar/GVN.h"
 
 #include <algorithm>
+#include <atomic>
 #include <map>
 #include <memory>
 #include <set>
@@ -28,21 +29,62 @@
 
 namespace rgd {
 
+  // counts the pages of the sections it allocates, so the JIT cache can
+  // keep the code under a budget; the count goes down with the module
+  class CountingMemoryManager : public llvm::SectionMemoryManager {
+    private:
+      std::atomic<size_t> &Total;
+      size_t Size = 0;
+
+      void count(uintptr_t Bytes) {
+        Bytes = (Bytes + 4095) & ~(uintptr_t)4095;
+        Size += Bytes;
+        Total += Bytes;
+      }
+
+    public:
+      CountingMemoryManager(std::atomic<size_t> &Total) : Total(Total) {}
+      ~CountingMemoryManager() { Total -= Size; }
+
+      uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+          unsigned SectionID, llvm::StringRef SectionName) override {
+        count(Size);
+        return SectionMemoryManager::allocateCodeSection(Size, Alignment,
+            SectionID, SectionName);
+      }
+
+      uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+          unsigned SectionID, llvm::StringRef SectionName,
+          bool IsReadOnly) override {
+        count(Size);
+        return SectionMemoryManager::allocateDataSection(Size, Alignment,
+            SectionID, SectionName, IsReadOnly);
+      }
+  };
+
   class GradJit {
     private:
+      std::atomic<size_t> CodeSize{0};
       llvm::orc::ExecutionSession ES;
       llvm::orc::RTDyldObjectLinkingLayer ObjectLayer;
       llvm::orc::IRCompileLayer CompileLayer;
+      // quick codegen, for code that may only run a few times
+      llvm::orc::IRCompileLayer FastCompileLayer;
+      // IR optimizations before the default codegen, for hot code
+      llvm::orc::IRTransformLayer OptimizeLayer;
 
       llvm::DataLayout DL;
       llvm::orc::MangleAndInterner Mangle;
       llvm::orc::JITDylib *MainJD;
 
     public:
-      GradJit(std::unique_ptr<llvm::TargetMachine> TM, llvm::DataLayout DL)
+      GradJit(std::unique_ptr<llvm::TargetMachine> TM,
+              std::unique_ptr<llvm::TargetMachine> FastTM, llvm::DataLayout DL)
         : ObjectLayer(ES,
-            []() { return std::make_unique<llvm::SectionMemoryManager>(); }),
+            [this]() { return std::make_unique<CountingMemoryManager>(CodeSize); }),
         CompileLayer(ES, ObjectLayer, std::make_unique<llvm::orc::TMOwningSimpleCompiler>(std::move(TM))),
+        FastCompileLayer(ES, ObjectLayer, std::make_unique<llvm::orc::TMOwningSimpleCompiler>(std::move(FastTM))),
+        OptimizeLayer(ES, CompileLayer, optimizeModule),
         DL(std::move(DL)), Mangle(ES, this->DL)
         {
           MainJD = &cantFail(ES.createJITDylib("main"));
@@ -79,19 +121,60 @@ namespace rgd {
           return TM.takeError();
         }
 
-        return std::make_unique<GradJit>(std::move(*TM), std::move(*DL));
+        JTMB->setCodeGenOptLevel(llvm::CodeGenOpt::None);
+        auto FastTM = JTMB->createTargetMachine();
+        if (!FastTM) {
+          llvm::errs() << "Cannot creat the target machine: " << FastTM.takeError() << "\n";
+          return FastTM.takeError();
+        }
+
+        return std::make_unique<GradJit>(std::move(*TM), std::move(*FastTM),
+                                         std::move(*DL));
       }
 
-      void addModule(std::unique_ptr<llvm::Module> M,
-                            std::unique_ptr<llvm::LLVMContext> ctx) {
-        cantFail(CompileLayer.add(*MainJD,
-          llvm::orc::ThreadSafeModule(std::move(M), std::move(ctx))));
+      // removing the returned tracker frees the module's code; fast skips
+      // the codegen optimizations, optimize runs the IR ones first
+      llvm::orc::ResourceTrackerSP addModule(std::unique_ptr<llvm::Module> M,
+                            std::unique_ptr<llvm::LLVMContext> ctx,
+                            bool fast = false, bool optimize = false) {
+        auto RT = MainJD->createResourceTracker();
+        llvm::orc::ThreadSafeModule TSM(std::move(M), std::move(ctx));
+        if (optimize)
+          cantFail(OptimizeLayer.add(RT, std::move(TSM)));
+        else if (fast)
+          cantFail(FastCompileLayer.add(RT, std::move(TSM)));
+        else
+          cantFail(CompileLayer.add(RT, std::move(TSM)));
+        return RT;
       }
 
+      // bytes of the code and data of the modules materialized so far and
+      // not removed yet, in pages
+      size_t codeSize() const { return CodeSize.load(std::memory_order_relaxed); }
+
       llvm::Expected<llvm::JITEvaluatedSymbol> lookup(llvm::StringRef Name) {
         return ES.lookup({MainJD}, Mangle(Name.str()));
       }
 
+      // resolves all names in one session lookup, in the order given
+      llvm::Expected<std::vector<llvm::JITEvaluatedSymbol>>
+      lookup(const std::vector<std::string> &Names) {
+        llvm::orc::SymbolLookupSet Symbols;
+        std::vector<llvm::orc::SymbolStringPtr> Mangled;
+        for (auto &Name : Names) {
+          Mangled.push_back(Mangle(Name));
+          Symbols.add(Mangled.back());
+        }
+        auto Result = ES.lookup(llvm::orc::makeJITDylibSearchOrder(MainJD), std::move(Symbols));
+        if (!Result)
+          return Result.takeError();
+        std::vector<llvm::JITEvaluatedSymbol> Ret;
+        Ret.reserve(Mangled.size());
+        for (auto &Name : Mangled)
+          Ret.push_back((*Result)[Name]);
+        return Ret;
+      }
+
     private:
       static llvm::orc::ThreadSafeModule
       optimizeModule(llvm::orc::ThreadSafeModule TSM, const llvm::orc::MaterializationResponsibility &R) {
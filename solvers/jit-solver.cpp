@@ -3,9 +3,18 @@
 
 #include "solver.h"
 #include "ast.h"
+#include "task_store.h"
 #include "jigsaw/rgdJit.h"
 #include "jigsaw/jit.h"
-#include "wheels/lockfreehash/lprobe/hash_table.h"
+#include "jigsaw/interp.h"
+#include "wheels/threadpool/ThreadPool.h"
+
+#include <time.h>
+
+#include <deque>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace rgd;
 
@@ -24,143 +33,461 @@ using namespace rgd;
 
 static const uint64_t kUsToS = 1000000;
 
+// monotonic, unlike gettimeofday(), and as cheap
 static uint64_t getTimeStamp() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return tv.tv_sec * kUsToS + tv.tv_usec;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * kUsToS + ts.tv_nsec / 1000;
 }
 
 extern std::unique_ptr<GradJit> JIT;
 
-struct myKV {
-  std::shared_ptr<AstNode> node;
-  test_fn_type fn;
-  myKV(std::shared_ptr<AstNode> anode, test_fn_type f) : node(anode), fn(f) {}
-};
+// JIT'ed functions are keyed by the AstShapes id of the AST, so a lookup
+// compares integers and the cache doesn't keep any AST alive. Once the code
+// of the entries adds up to more than the budget, they are evicted in clock
+// order; the code itself is freed when the last constraint using it goes away
+class FunctionCache {
+public:
+  struct entry_t {
+    test_fn_type fn = nullptr;
+    batch_fn_type batch_fn = nullptr;
+    jit_code_t code;
+    jit_tier_t tier = JIT_TIER_DEFAULT;
+  };
+
+  // budget in bytes, 0 for no limit
+  FunctionCache(size_t budget) : budget(budget), total(0), evictions(0) {}
+
+  bool find(uint32_t shape, entry_t &e) {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex);
+    auto itr = slots.find(shape);
+    if (itr == slots.end()) return false;
+    itr->second.referenced.store(true, std::memory_order_relaxed);
+    e = itr->second.entry;
+    return true;
+  }
+
+  bool contains(uint32_t shape) {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex);
+    return slots.count(shape) != 0;
+  }
+
+  // bytes is the share of the entry in the code of its module; with
+  // replace, an entry already there gets the new functions
+  void insert(uint32_t shape, entry_t const& e, size_t bytes,
+              bool replace = false) {
+    std::unique_lock<std::shared_timed_mutex> lock(mutex);
+    auto res = slots.emplace(std::piecewise_construct,
+                             std::forward_as_tuple(shape), std::forward_as_tuple());
+    if (res.second) {
+      hand.push_back(shape);
+    } else if (replace) {
+      total -= res.first->second.bytes;
+    } else {
+      return;
+    }
+    res.first->second.entry = e;
+    res.first->second.bytes = bytes;
+    total += bytes;
+    while (budget && total > budget && evict_one()) {}
+  }
+
+  // adds n evaluations to a quickly compiled entry, true for the call that
+  // takes it to threshold
+  bool count(uint32_t shape, uint64_t n, uint64_t threshold) {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex);
+    auto itr = slots.find(shape);
+    if (itr == slots.end() || itr->second.entry.tier != JIT_TIER_FAST) return false;
+    uint64_t evals = itr->second.evals.fetch_add(n, std::memory_order_relaxed);
+    return evals < threshold && evals + n >= threshold;
+  }
+
+  uint64_t num_evictions() const { return evictions.load(); }
+
+private:
+  struct slot_t {
+    entry_t entry;
+    size_t bytes = 0;
+    std::atomic<bool> referenced{false};
+    std::atomic<uint64_t> evals{0};
+  };
 
-struct myHash {
-  using eType = struct myKV*;
-  using kType = std::shared_ptr<AstNode>;
-  eType empty() {return nullptr;}
-  kType getKey(eType v) {return v->node;}
-  int hash(kType v) {return v->hash();} //hash64_2(v);}
-  //int hash(kType v) {return hash64_2(v);}
-  //int cmp(kType v, kType b) {return (v > b) ? 1 : ((v == b) ? 0 : -1);}
-  int cmp(kType v, kType b) {return (isEqualAst(*v,*b)) ? 0 : -1;}
-  bool replaceQ(eType, eType) {return 0;}
-  eType update(eType v, eType) {return v;}
-  bool cas(eType* p, eType o, eType n) {return pbbs::atomic_compare_and_swap(p, o, n);}
+  // the entries looked up since the hand last passed them get another round
+  bool evict_one() {
+    while (!hand.empty()) {
+      uint32_t shape = hand.front();
+      hand.pop_front();
+      auto itr = slots.find(shape);
+      if (itr->second.referenced.exchange(false, std::memory_order_relaxed)) {
+        hand.push_back(shape);
+        continue;
+      }
+      total -= itr->second.bytes;
+      slots.erase(itr);
+      evictions++;
+      return true;
+    }
+    return false;
+  }
+
+  std::shared_timed_mutex mutex;
+  std::unordered_map<uint32_t, slot_t> slots;
+  std::deque<uint32_t> hand;
+  const size_t budget;
+  size_t total;
+  std::atomic_ulong evictions;
 };
 
-static pbbs::Table<myHash> fCache(8000016, myHash(), 1.3);
+static inline void set_functions(std::shared_ptr<const Constraint> const& c,
+                                 FunctionCache::entry_t const& e) {
+  c->set_functions(e.fn, e.batch_fn, e.code);
+}
+
+// with tiering, the first compile is a quick one
+static inline jit_tier_t first_tier(uint64_t hot_evals) {
+  return hot_evals ? JIT_TIER_FAST : JIT_TIER_DEFAULT;
+}
+
+// never freed, releasing its code at exit could come after the JIT is gone
+static FunctionCache *fCache;
+
+// the JIT and fCache are shared by all the solver instances, e.g., one per
+// solving thread; the JIT is used by one thread at a time
+static std::once_flag jit_init;
+static std::mutex jit_lock;
+
+JITSolver::JITSolver(bool async_jit, unsigned search_threads, size_t cache_size)
+  : search_threads(search_threads), hot_evals(0), fuse_constraints(0),
+    task_budget_us(0), uuid(0),
+    num_interpreted(0), num_optimized(0), num_fused(0), num_split(0),
+    component_hits(0) {
+  // the first solver sets the budget of the cache
+  std::call_once(jit_init, [cache_size]() {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+    JIT = std::move(GradJit::Create().get());
+    fCache = new FunctionCache(cache_size);
+  });
+
+  // a single compiler thread, the JIT isn't used concurrently anyway
+  if (async_jit) {
+    compile_pool = std::make_unique<ThreadPool>(1);
+  }
+  if (search_threads > 1) {
+    search_pool = std::make_unique<ThreadPool>(search_threads - 1);
+  }
+}
+
+JITSolver::~JITSolver() {
+  // finish the pending compiles before the rest goes away
+  compile_pool.reset();
+  search_pool.reset();
+}
+
+// searches task from the input on this thread and from random start points
+// on the pool, the first one to solve it stops the others
+bool JITSolver::search(std::shared_ptr<SearchTask> task) {
+  if (!search_pool) {
+    return gd_entry(task);
+  }
+
+  std::atomic<bool> found(false);
+  std::vector<std::shared_ptr<SearchTask>> forks;
+  std::vector<std::future<bool>> results;
+  for (unsigned i = 1; i < search_threads; i++) {
+    auto fork = task->fork();
+    fork->cancel = &found;
+    fork->deadline = task->deadline;
+    forks.push_back(fork);
+    results.push_back(search_pool->enqueue([fork, i, &found]() {
+      bool solved = gd_entry(fork, i);
+      if (solved) found.store(true, std::memory_order_relaxed);
+      return solved;
+    }));
+  }
+  task->cancel = &found;
+  bool res = gd_entry(task);
+  if (res) found.store(true, std::memory_order_relaxed);
+  for (size_t i = 0; i < results.size(); i++) {
+    // wait for all of them, they point to found
+    if (results[i].get() && !res) {
+      task->solution = forks[i]->solution;
+      task->solved = res = true;
+    }
+  }
+  task->cancel = nullptr;
+  return res;
+}
+
+// JITs the constraints not cached yet, in one module; only fills the
+// cache, which is safe to read from other threads
+void JITSolver::jit_batch(std::vector<constraint_t> const& constraints) {
+  std::vector<jit_request_t> requests;
+  std::vector<uint32_t> shapes; // of each request
+  std::unordered_set<uint32_t> batched;
+  std::lock_guard<std::mutex> lock(jit_lock);
+  uint64_t start = getTimeStamp();
+  for (auto const& c : constraints) {
+    // the same shape shows up many times in a trace
+    if (fCache->contains(c->shape) || !batched.insert(c->shape).second) {
+      continue;
+    }
+    cache_misses++;
+    requests.push_back({c->get_root(), &c->local_map, ++uuid});
+    shapes.push_back(c->shape);
+  }
+  if (requests.empty()) {
+    return;
+  }
+
+  std::vector<bool> added, has_batch;
+  jit_code_t code;
+  addFunctions(requests, added, has_batch, &code, first_tier(hot_evals));
+  std::vector<uint64_t> ids, batch_ids;
+  for (size_t i = 0; i < requests.size(); i++) {
+    if (added[i]) ids.push_back(requests[i].id);
+    if (has_batch[i]) batch_ids.push_back(requests[i].id);
+  }
+  process_time += (getTimeStamp() - start);
+  if (ids.empty()) {
+    return;
+  }
+
+  start = getTimeStamp();
+  size_t code_size = jitCodeSize();
+  std::vector<test_fn_type> fns;
+  if (performJit(ids, fns) != 0) {
+    WARNF("failed to jit %zu functions\n", ids.size());
+    return;
+  }
+  std::vector<batch_fn_type> batch_fns;
+  if (!batch_ids.empty() && performBatchJit(batch_ids, batch_fns) != 0) {
+    batch_fns.clear();
+    batch_ids.clear();
+  }
+  jit_time += (getTimeStamp() - start);
+
+  // the functions share the module's code evenly, as far as the budget goes
+  size_t bytes = (jitCodeSize() - std::min(code_size, jitCodeSize())) / ids.size();
+  for (size_t i = 0, j = 0, k = 0; i < requests.size(); i++) {
+    if (!added[i]) continue;
+    FunctionCache::entry_t e;
+    e.fn = fns[j++];
+    if (has_batch[i] && k < batch_ids.size()) e.batch_fn = batch_fns[k++];
+    e.code = code;
+    e.tier = first_tier(hot_evals);
+    fCache->insert(shapes[i], e, bytes);
+  }
+}
+
+// re-JITs a constraint that got hot with the IR optimizations, the
+// constraints using it pick up the new code from the cache in solve()
+void JITSolver::jit_optimized(constraint_t const& c) {
+  std::lock_guard<std::mutex> lock(jit_lock);
+  FunctionCache::entry_t e;
+  uint64_t id = ++uuid;
+  bool batched = false;
+  uint64_t start = getTimeStamp();
+  if (addFunction(c->get_root(), c->local_map, id, &batched, &e.code,
+                  JIT_TIER_OPTIMIZED) != 0) {
+    return;
+  }
+  process_time += (getTimeStamp() - start);
+  start = getTimeStamp();
+  size_t code_size = jitCodeSize();
+  e.fn = performJit(id);
+  e.batch_fn = batched ? performBatchJit(id) : nullptr;
+  jit_time += (getTimeStamp() - start);
+  e.tier = JIT_TIER_OPTIMIZED;
+  fCache->insert(c->shape, e, jitCodeSize() - std::min(code_size, jitCodeSize()), true);
+  num_optimized++;
+}
+
+// JITs the function of a whole task, which the search calls in place of
+// those of its constraints; it's only good for this task, so isn't cached
+void JITSolver::jit_task(std::shared_ptr<SearchTask> const& task) {
+  std::lock_guard<std::mutex> lock(jit_lock);
+  uint64_t id = ++uuid;
+  jit_code_t code;
+  uint64_t start = getTimeStamp();
+  if (addTaskFunction(*task, id, &code) != 0) {
+    return;
+  }
+  process_time += (getTimeStamp() - start);
+  start = getTimeStamp();
+  task_fn_type fn = performTaskJit(id);
+  jit_time += (getTimeStamp() - start);
+  if (!fn) {
+    return;
+  }
+  task->task_fn = fn;
+  task->task_code = std::move(code);
+  num_fused++;
+}
+
+void JITSolver::jit_async(constraint_t const& c) {
+  {
+    std::lock_guard<std::mutex> lock(pending_lock);
+    // failures stay pending, and interpreted
+    if (!pending_shapes.insert(c->shape).second) return;
+  }
+  // holding c keeps its AST alive until it's compiled
+  compile_pool->enqueue([this, c]() { jit_batch({c}); });
+}
 
-JITSolver::JITSolver(): uuid(0) {
-  llvm::InitializeNativeTarget();
-  llvm::InitializeNativeTargetAsmPrinter();
-  llvm::InitializeNativeTargetAsmParser();
+// JITs the constraints of tasks that aren't cached yet in one module,
+// instead of one module and one lookup for each of them in solve()
+void JITSolver::prepare(std::vector<std::shared_ptr<SearchTask>> const& tasks) {
+  std::vector<constraint_t> misses;
+  for (auto const& task : tasks) {
+    for (auto const& c : task->constraints) {
+      if (c->get_fn() != nullptr || !c->shape) {
+        continue;
+      }
+      FunctionCache::entry_t e;
+      if (fCache->find(c->shape, e)) {
+        cache_hits++;
+        set_functions(c, e);
+        continue;
+      }
+      misses.push_back(c);
+    }
+  }
+  if (misses.empty()) {
+    return;
+  }
+
+  if (compile_pool) {
+    {
+      std::lock_guard<std::mutex> lock(pending_lock);
+      for (auto const& c : misses) pending_shapes.insert(c->shape);
+    }
+    // solve() picks up the functions from the cache once they're ready
+    compile_pool->enqueue([this, misses]() { jit_batch(misses); });
+    return;
+  }
 
-  JIT = std::move(GradJit::Create().get());
+  // the requests failing to compile are left to solve(), which reports them
+  jit_batch(misses);
+  for (auto const& c : misses) {
+    FunctionCache::entry_t e;
+    if (fCache->find(c->shape, e)) {
+      set_functions(c, e);
+    }
+  }
 }
 
 solver_result_t
 JITSolver::solve(std::shared_ptr<SearchTask> task,
                  const uint8_t *in_buf, size_t in_size,
-                 uint8_t *out_buf, size_t &out_size) {
+                 patch_t &patch) {
 
-  auto base_task = task->base_task;
+  auto const &chain = task->ancestors();
   uint64_t start;
-  while (base_task != nullptr) {
-    // no need to solve
-    if (base_task->skip_next) {
-      DEBUGF("skipping task\n");
-      task->skip_next = true; // set the flag for following tasks
-      out_size = in_size;
-      memcpy(out_buf, in_buf, in_size);
-      if (base_task->solved) {
-        for (auto const &[offset, value] : base_task->solution) {
-          out_buf[offset] = value;
-        }
-        return SOLVER_SAT;
-      } else {
-        return SOLVER_UNSAT;
-      }
-    } else if (base_task->solved) {
-      task->load_hint();
+  // no need to solve
+  if (chain.skip) {
+    DEBUGF("skipping task\n");
+    task->skip_next = true; // set the flag for following tasks
+    if (chain.skip->solved) {
+      patch.bytes = chain.skip->solution;
+      return SOLVER_SAT;
+    } else {
+      return SOLVER_UNSAT;
     }
-    base_task = base_task->base_task;
+  }
+  task->load_hint();
+  // an atoi patch spans the components
+  if (!task->components.empty() && task->atoi_info.empty()) {
+    return solve_components(task, in_buf, in_size, patch);
   }
 
   for (size_t i = 0; i < task->constraints.size(); i++) {
     auto &c = task->constraints[i];
-    DEBUGF("process constraint %d (fn=%p)\n", c->ast->label(), c->fn);
+    DEBUGF("process constraint %d (fn=%p)\n", c->ast->label(), c->get_fn());
     // jit the AST into a native function if haven't done so
-    if (c->fn == nullptr) {
-      struct myKV *res = fCache.find(c->ast);
-      if (res == nullptr) {
+    if (c->get_fn() == nullptr) {
+      // constraints without a shape are JIT'ed every time
+      FunctionCache::entry_t e;
+      bool cached = c->shape && fCache->find(c->shape, e);
+      if (!cached && compile_pool && c->shape) {
+        // interpret it until the compiler thread is done with it
+        if (!c->get_program()) {
+          c->set_program(ConstraintProgram::compile(c->get_root(), c->local_map));
+        }
+        if (c->get_program()) {
+          num_interpreted++;
+          jit_async(c);
+          continue;
+        }
+      }
+      if (!cached) {
         cache_misses++;
         DEBUGF("jit constraint %d\n", c->ast->label());
+        std::lock_guard<std::mutex> lock(jit_lock);
         uint64_t id = ++uuid;
+        bool batched = false;
         start = getTimeStamp();
-        if (addFunction(c->get_root(), c->local_map, id) != 0) {
+        if (addFunction(c->get_root(), c->local_map, id, &batched, &e.code,
+                        first_tier(hot_evals)) != 0) {
           WARNF("failed to add function\n");
           return SOLVER_ERROR;
         }
         process_time += (getTimeStamp() - start);
         start = getTimeStamp();
-        auto fn = performJit(id);
+        size_t code_size = jitCodeSize();
+        e.fn = performJit(id);
+        e.batch_fn = batched ? performBatchJit(id) : nullptr;
+        e.tier = first_tier(hot_evals);
         jit_time += (getTimeStamp() - start);
-        auto kv = new struct myKV(c->ast, fn);
-        if (!fCache.insert(kv))
-          delete kv;
-        const_cast<Constraint*>(c.get())->fn = fn; // XXX: workaround, no concurrent access
+        if (c->shape) {
+          fCache->insert(c->shape, e,
+                         jitCodeSize() - std::min(code_size, jitCodeSize()));
+        }
+        set_functions(c, e);
       } else {
         cache_hits++;
-        const_cast<Constraint*>(c.get())->fn = res->fn; // XXX: workaround
+        set_functions(c, e);
+      }
+    } else if (hot_evals && c->shape) {
+      // switch to the optimized code once it's there
+      FunctionCache::entry_t e;
+      auto code = c->get_code();
+      if (fCache->find(c->shape, e) && e.tier == JIT_TIER_OPTIMIZED &&
+          e.code != code) {
+        c->upgrade_functions(e.fn, e.batch_fn, e.code, code);
       }
     }
   }
 
+  if (fuse_constraints && task->constraints.size() >= fuse_constraints &&
+      !task->task_fn && task->has_finalized()) {
+    jit_task(task);
+  }
+
   // solve the task
   start = getTimeStamp();
-  bool res = gd_entry(task);
+  task->deadline = task_budget_us ? coarse_now_us() + task_budget_us : 0;
+  bool res = search(task);
   solving_time += (getTimeStamp() - start);
+
+  // every attempt of the search evaluates the constraints (or most of them)
+  if (hot_evals) {
+    for (auto const& c : task->constraints) {
+      if (!c->shape || !fCache->count(c->shape, task->attempts, hot_evals)) continue;
+      if (compile_pool) {
+        compile_pool->enqueue([this, c]() { jit_optimized(c); });
+      } else {
+        jit_optimized(c);
+      }
+    }
+  }
   if (res) {
     DEBUGF("solved\n");
-    out_size = in_size;
-    memcpy(out_buf, in_buf, in_size);
-    for (auto const &[offset, value] : task->solution) {
-      DEBUGF("generate_input offset:%zu => %u\n", offset, value);
-      out_buf[offset] = value;
-    }
+    patch.bytes = task->solution;
     // handle atoi bytes
     if (!task->atoi_info.empty()) {
-      // if there are atoi bytes, handle them
-      for (auto const &[offset, info] : task->atoi_info) {
-        uint64_t val = 0;
-        uint32_t length = std::get<0>(info);
-        memcpy(out_buf + offset, in_buf + offset, length); // restore??
-        for (auto i = length; i != 0; --i) {
-          DEBUGF("generate_input atoi offset:%d => %lu\n", offset + i - 1, val);
-          auto itr = task->solution.find(offset + i - 1);
-          assert(itr != task->solution.end());
-          val |= itr->second << (8 * (i - 1));
-        }
-        uint32_t base = std::get<1>(info);
-        uint32_t orig_len = std::get<2>(info);
-        DEBUGF("generate_input atoi offset:%d => %lu, base = %d, original len = %d\n",
-            offset, val, base, orig_len);
-        const char *format = nullptr;
-        switch (base) {
-          case 2: format = "%lb"; break;
-          case 8: format = "%lo"; break;
-          case 10: format = "%ld"; break;
-          case 16: format = "%lx"; break;
-          default: WARNF("unsupported base %d\n", base);
-        }
-        if (format) {
-          snprintf((char*)out_buf + offset, in_size - offset, format, val);
-        }
-      }
+      patch.add_atoi(*task, in_buf, in_size);
     }
     num_solved++;
     return SOLVER_SAT;
@@ -171,13 +498,107 @@ JITSolver::solve(std::shared_ptr<SearchTask> task,
   }
 }
 
+void JITSolver::set_const_dict(std::shared_ptr<const ConstDict> dict) {
+  set_restart_dict(std::move(dict));
+}
+
+size_t JITSolver::solve_more(std::shared_ptr<SearchTask> task,
+                             const uint8_t *in_buf, size_t in_size,
+                             size_t n, std::vector<patch_t> &patches) {
+  if (!task->solved) return 0;
+  std::vector<solution_map_t> found{task->solution};
+  size_t added = 0;
+  // a start point often descends to a solution found already, so it gets
+  // a few more tries than solutions asked for
+  for (unsigned start = 1; added < n && start <= 2 * n; start++) {
+    auto fork = task->fork();
+    fork->deadline = task_budget_us ? coarse_now_us() + task_budget_us : 0;
+    uint64_t begin = getTimeStamp();
+    bool res = gd_entry(fork, start);
+    solving_time += (getTimeStamp() - begin);
+    if (!res || std::find(found.begin(), found.end(), fork->solution) != found.end()) {
+      continue;
+    }
+    found.push_back(fork->solution);
+    patches.emplace_back();
+    patches.back().bytes = fork->solution;
+    if (!task->atoi_info.empty()) {
+      patches.back().add_atoi(*task, in_buf, in_size);
+    }
+    added++;
+  }
+  return added;
+}
+
+// searches the components of task one at a time, each over only its own
+// bytes, unless it has been solved before as part of any task
+solver_result_t
+JITSolver::solve_components(std::shared_ptr<SearchTask> task,
+                            const uint8_t *in_buf, size_t in_size,
+                            patch_t &patch) {
+  num_split++;
+  solution_map_t solution;
+  for (auto const& part : task->split()) {
+    uint64_t fp = TaskStore::fingerprint(*part);
+    {
+      std::lock_guard<std::mutex> lock(component_lock);
+      auto itr = component_solutions.find(fp);
+      if (itr != component_solutions.end()) {
+        for (auto const& kv : itr->second) solution.insert(kv);
+        component_hits++;
+        continue;
+      }
+    }
+    patch_t part_patch;
+    solver_result_t ret = solve(part, in_buf, in_size, part_patch);
+    if (ret != SOLVER_SAT) return ret;
+    {
+      std::lock_guard<std::mutex> lock(component_lock);
+      if (component_solutions.size() >= kMaxComponentSolutions) {
+        component_solutions.clear();
+      }
+      component_solutions.emplace(fp, part->solution);
+    }
+    for (auto const& kv : part->solution) solution.insert(kv);
+  }
+  task->solution = solution;
+  task->solved = true;
+  patch.bytes = std::move(solution);
+  return SOLVER_SAT;
+}
+
 void JITSolver::print_stats(int fd) {
   dprintf(fd, "JIT solver stats:\n");
   dprintf(fd, "  cache hits: %lu\n", cache_hits.load());
   dprintf(fd, "  cache misses: %lu\n", cache_misses.load());
+  dprintf(fd, "  cache evictions: %lu\n", fCache->num_evictions());
+  dprintf(fd, "  code size: %zu\n", jitCodeSize());
+  dprintf(fd, "  interpreted: %lu\n", num_interpreted.load());
+  dprintf(fd, "  optimized: %lu\n", num_optimized.load());
+  dprintf(fd, "  fused tasks: %lu\n", num_fused.load());
+  dprintf(fd, "  split tasks: %lu\n", num_split.load());
+  dprintf(fd, "  component hits: %lu\n", component_hits.load());
   dprintf(fd, "  num solved: %lu\n", num_solved.load());
   dprintf(fd, "  num timeout: %lu\n", num_timeout.load());
   dprintf(fd, "  process time: %lu\n", process_time.load());
   dprintf(fd, "  jit  time: %lu\n", jit_time.load());
   dprintf(fd, "  solving time: %lu\n", solving_time.load());
 }
+
+size_t JITSolver::code_bytes() {
+  return jitCodeSize();
+}
+
+void JITSolver::write_stats(int fd) {
+  dprintf(fd, "jit_cache_hits    : %lu\n", cache_hits.load());
+  dprintf(fd, "jit_cache_misses  : %lu\n", cache_misses.load());
+  dprintf(fd, "jit_evictions     : %lu\n", fCache->num_evictions());
+  dprintf(fd, "jit_code_bytes    : %zu\n", jitCodeSize());
+  dprintf(fd, "jit_interpreted   : %lu\n", num_interpreted.load());
+  dprintf(fd, "jit_optimized     : %lu\n", num_optimized.load());
+  dprintf(fd, "jit_fused_tasks   : %lu\n", num_fused.load());
+  dprintf(fd, "jit_split_tasks   : %lu\n", num_split.load());
+  dprintf(fd, "jit_component_hits: %lu\n", component_hits.load());
+  dprintf(fd, "jit_compile_us    : %lu\n", jit_time.load());
+  dprintf(fd, "jit_search_us     : %lu\n", solving_time.load());
+}
@@ -0,0 +1,424 @@
+#include "solver.h"
+#include "jigsaw/interp.h"
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace rgd;
+
+#define DEBUG 0
+
+#if !DEBUG
+#undef DEBUGF
+#define DEBUGF(_str...) do { } while (0)
+#endif
+
+namespace {
+
+// an input value: the little-endian bytes [offset, offset + size)
+struct var_t {
+  uint32_t offset;
+  uint32_t size;
+  bool operator==(var_t const& o) const {
+    return offset == o.offset && size == o.size;
+  }
+  bool overlaps(var_t const& o) const {
+    return offset < o.offset + o.size && o.offset < offset + size;
+  }
+};
+
+// sum(coeff * var) + c, mod 2^bits
+struct linear_t {
+  uint32_t bits = 0;
+  uint64_t c = 0;
+  std::vector<std::pair<var_t, uint64_t>> terms;
+
+  bool is_const() const { return terms.empty(); }
+  // a single value, as is: it doesn't wrap when extended
+  bool is_var() const {
+    return terms.size() == 1 && terms[0].second == 1 && c == 0 &&
+           terms[0].first.size * 8 == bits;
+  }
+  uint64_t coeff(var_t const& v) const {
+    for (auto const& t : terms) {
+      if (t.first == v) return t.second;
+    }
+    return 0;
+  }
+};
+
+}
+
+static inline uint64_t mask(uint64_t v, uint32_t bits) {
+  return bits >= 64 ? v : v & ((1ULL << bits) - 1);
+}
+
+// a += k * b, both with a's width
+static void add_scaled(linear_t &a, linear_t const& b, uint64_t k) {
+  a.c = mask(a.c + k * b.c, a.bits);
+  for (auto const& [v, coeff] : b.terms) {
+    auto itr = std::find_if(a.terms.begin(), a.terms.end(),
+        [&v](std::pair<var_t, uint64_t> const& t) { return t.first == v; });
+    if (itr == a.terms.end()) {
+      a.terms.emplace_back(v, mask(k * coeff, a.bits));
+    } else {
+      itr->second = mask(itr->second + k * coeff, a.bits);
+    }
+  }
+  a.terms.erase(std::remove_if(a.terms.begin(), a.terms.end(),
+      [](std::pair<var_t, uint64_t> const& t) { return t.second == 0; }),
+      a.terms.end());
+}
+
+// the linear form of node, false if it isn't one (or is wider than 64 bits)
+static bool linearize(const AstNode *node,
+                      std::vector<std::pair<bool, uint64_t>> const& input_args,
+                      linear_t &out) {
+  uint32_t bits = node->bits();
+  if (bits == 0 || bits > 64) return false;
+  out.bits = bits;
+  out.c = 0;
+  out.terms.clear();
+  switch (node->kind()) {
+    case rgd::Bool:
+      out.c = node->boolvalue();
+      return true;
+    case rgd::Constant:
+      out.c = mask(input_args[node->index()].second, bits);
+      return true;
+    case rgd::Read:
+      out.terms.push_back({{node->index(), bits / 8}, 1});
+      return true;
+    case rgd::ZExt:
+    case rgd::SExt:
+    case rgd::Extract:
+    case rgd::Neg:
+    case rgd::Not: {
+      linear_t x;
+      if (!linearize(&node->children(0), input_args, x)) return false;
+      if (node->kind() == rgd::Extract) {
+        // only the low bits keep the form, mod a smaller power of two
+        if (x.is_const()) {
+          out.c = mask(x.c >> node->index(), bits);
+        } else if (node->index() == 0) {
+          add_scaled(out, x, 1);
+        } else {
+          return false;
+        }
+      } else if (node->kind() == rgd::ZExt) {
+        if (!x.is_const() && !x.is_var()) return false;
+        out.c = x.c;
+        out.terms = x.terms;
+      } else if (node->kind() == rgd::SExt) {
+        if (!x.is_const()) return false;
+        uint64_t sign = 1ULL << (x.bits - 1);
+        out.c = mask((x.c ^ sign) - sign, bits);
+      } else {
+        // -x, and ~x = -x - 1
+        add_scaled(out, x, (uint64_t)-1);
+        if (node->kind() == rgd::Not) out.c = mask(out.c - 1, bits);
+      }
+      return true;
+    }
+    case rgd::Concat: {
+      // hi * 2^k + lo, lo must not wrap
+      linear_t lo, hi;
+      if (!linearize(&node->children(0), input_args, lo) ||
+          !linearize(&node->children(1), input_args, hi)) {
+        return false;
+      }
+      if (!lo.is_const() && !lo.is_var()) return false;
+      add_scaled(out, lo, 1);
+      add_scaled(out, hi, lo.bits >= 64 ? 0 : 1ULL << lo.bits);
+      return true;
+    }
+    case rgd::Add:
+    case rgd::Sub:
+    case rgd::Mul:
+    case rgd::Shl: {
+      linear_t a, b;
+      if (!linearize(&node->children(0), input_args, a) ||
+          !linearize(&node->children(1), input_args, b)) {
+        return false;
+      }
+      if (node->kind() == rgd::Add || node->kind() == rgd::Sub) {
+        add_scaled(out, a, 1);
+        add_scaled(out, b, node->kind() == rgd::Add ? 1 : (uint64_t)-1);
+      } else if (node->kind() == rgd::Shl) {
+        if (!b.is_const()) return false;
+        add_scaled(out, a, b.c >= bits ? 0 : 1ULL << b.c);
+      } else if (b.is_const()) {
+        add_scaled(out, a, b.c);
+      } else if (a.is_const()) {
+        add_scaled(out, b, a.c);
+      } else {
+        return false;
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+static bool holds(uint32_t comparison, uint64_t a, uint64_t b, uint32_t bits) {
+  if (bits < 64) {
+    // sign extend for the signed comparisons
+    uint64_t sign = 1ULL << (bits - 1);
+    a = (a ^ sign) - sign;
+    b = (b ^ sign) - sign;
+  }
+  switch (comparison) {
+    case rgd::Equal: return a == b;
+    case rgd::Distinct: return a != b;
+    case rgd::Ult: return mask(a, bits) < mask(b, bits);
+    case rgd::Ule: return mask(a, bits) <= mask(b, bits);
+    case rgd::Ugt: return mask(a, bits) > mask(b, bits);
+    case rgd::Uge: return mask(a, bits) >= mask(b, bits);
+    case rgd::Slt: return (int64_t)a < (int64_t)b;
+    case rgd::Sle: return (int64_t)a <= (int64_t)b;
+    case rgd::Sgt: return (int64_t)a > (int64_t)b;
+    case rgd::Sge: return (int64_t)a >= (int64_t)b;
+    default: return false;
+  }
+}
+
+// the comparison with its operands swapped
+static uint32_t swap_operands(uint32_t comparison) {
+  switch (comparison) {
+    case rgd::Ult: return rgd::Ugt;
+    case rgd::Ule: return rgd::Uge;
+    case rgd::Ugt: return rgd::Ult;
+    case rgd::Uge: return rgd::Ule;
+    case rgd::Slt: return rgd::Sgt;
+    case rgd::Sle: return rgd::Sge;
+    case rgd::Sgt: return rgd::Slt;
+    case rgd::Sge: return rgd::Sle;
+    default: return comparison;
+  }
+}
+
+// the value of v in buf with patch
+static uint64_t load(var_t const& v, const uint8_t *buf, patch_t const& patch) {
+  uint64_t x = 0;
+  for (uint32_t i = 0; i < v.size; i++) {
+    x |= (uint64_t)patch.get(buf, v.offset + i) << (i * 8);
+  }
+  return x;
+}
+
+// the form without v, the others at their values in buf with patch
+static uint64_t eval_without(linear_t const& f, var_t const& v,
+                             const uint8_t *buf, patch_t const& patch) {
+  uint64_t r = f.c;
+  for (auto const& [u, coeff] : f.terms) {
+    if (!(u == v)) r += coeff * load(u, buf, patch);
+  }
+  return mask(r, f.bits);
+}
+
+// the smallest x with a * x = d (mod 2^bits), false if there is none
+static bool solve_mod(uint64_t a, uint64_t d, uint32_t bits, uint64_t &x) {
+  a = mask(a, bits);
+  d = mask(d, bits);
+  if (a == 0) return false;
+  unsigned t = __builtin_ctzll(a);
+  if (mask(d, t) != 0) return false;
+  a >>= t;
+  d >>= t;
+  // the inverse of the odd part, by Newton's iteration
+  uint64_t inv = a;
+  for (int i = 0; i < 6; i++) inv *= 2 - a * inv;
+  x = mask(d * inv, bits - t);
+  return true;
+}
+
+// the values of the side holding the variable, nearest to the bound first,
+// that satisfy "side comparison k"
+static void targets(uint32_t comparison, uint64_t k, uint32_t bits,
+                    std::vector<uint64_t> &out) {
+  uint64_t umax = mask(~0ULL, bits);
+  uint64_t smax = umax >> 1, smin = mask(smax + 1, bits);
+  out.clear();
+  switch (comparison) {
+    case rgd::Ult: if (k != 0) out.push_back(k - 1); out.push_back(0); break;
+    case rgd::Ule: out.push_back(k); out.push_back(0); break;
+    case rgd::Ugt: if (k != umax) out.push_back(k + 1); out.push_back(umax); break;
+    case rgd::Uge: out.push_back(k); out.push_back(umax); break;
+    case rgd::Slt: if (k != smin) out.push_back(mask(k - 1, bits)); out.push_back(smin); break;
+    case rgd::Sle: out.push_back(k); out.push_back(smin); break;
+    case rgd::Sgt: if (k != smax) out.push_back(mask(k + 1, bits)); out.push_back(smax); break;
+    case rgd::Sge: out.push_back(k); out.push_back(smax); break;
+    default: return;
+  }
+  // with an even coefficient only every 2^t-th value can be reached, so
+  // also try a few further from the bound
+  size_t n = out.size();
+  for (size_t i = 0; i < n; i++) {
+    bool up = comparison == rgd::Ugt || comparison == rgd::Uge ||
+              comparison == rgd::Sgt || comparison == rgd::Sge;
+    for (uint64_t j = 1; j < 8; j++) {
+      out.push_back(mask(up ? out[i] + j : out[i] - j, bits));
+    }
+  }
+}
+
+// a value of v making "lhs comparison rhs" hold, with the others fixed
+static bool solve_for(var_t const& v, linear_t const& lhs, linear_t const& rhs,
+                      uint32_t comparison, const uint8_t *buf,
+                      patch_t const& patch, uint64_t &x) {
+  uint32_t bits = lhs.bits;
+  uint32_t width = v.size * 8;
+  uint64_t cur = load(v, buf, patch);
+  uint64_t al = lhs.coeff(v), ar = rhs.coeff(v);
+  uint64_t bl = eval_without(lhs, v, buf, patch);
+  uint64_t br = eval_without(rhs, v, buf, patch);
+
+  // x from the value the form sees, keeping the bits it doesn't see
+  auto fit = [&](uint64_t low) {
+    if (width <= bits) {
+      x = low;
+      return width >= 64 || low < (1ULL << width);
+    }
+    x = (cur & ~mask(~0ULL, bits)) | low;
+    return true;
+  };
+  auto check = [&](uint64_t val) {
+    return holds(comparison, mask(al * val + bl, bits), mask(ar * val + br, bits), bits);
+  };
+
+  if (comparison == rgd::Distinct) {
+    if (mask(al - ar, bits) == 0) return false;
+    for (uint64_t delta : {1ULL, 2ULL, 4ULL, 8ULL}) {
+      if (fit(mask(cur + delta, std::min(bits, width))) && check(x)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  if (comparison == rgd::Equal) {
+    // (al - ar) * x = br - bl
+    uint64_t low;
+    return solve_mod(al - ar, br - bl, bits, low) && fit(low) && check(x);
+  }
+
+  // the variable on one side only, compared to the value of the other
+  std::vector<uint64_t> ys;
+  uint64_t a, b;
+  if (al != 0 && ar != 0) return false;
+  if (al != 0) {
+    a = al; b = bl;
+    targets(comparison, br, bits, ys);
+  } else {
+    a = ar; b = br;
+    targets(swap_operands(comparison), bl, bits, ys);
+  }
+  for (uint64_t y : ys) {
+    uint64_t low;
+    if (solve_mod(a, y - b, bits, low) && fit(low) && check(x)) return true;
+  }
+  return false;
+}
+
+// runs c on the input in buf with patch, as the i2s solver does
+static bool check_constraint(std::shared_ptr<const Constraint> const& c,
+                             uint32_t comparison, const uint8_t *buf,
+                             patch_t const& patch, std::vector<uint64_t> &args) {
+  if (!c->get_fn() && !c->get_program()) {
+    c->set_program(ConstraintProgram::compile(c->get_root(), c->local_map));
+    if (!c->get_program()) return false;
+  }
+  args.assign(RET_OFFSET + c->input_args.size() + 1, 0);
+  for (size_t i = 0; i < c->input_args.size(); i++) {
+    if (!c->input_args[i].first)
+      args[RET_OFFSET + i] = c->input_args[i].second;
+  }
+  for (auto const& [offset, lidx] : c->local_map) {
+    args[RET_OFFSET + lidx] = patch.get(buf, offset);
+  }
+  run_constraint(*c, args.data());
+  uint32_t bits = c->get_root()->children(0).bits();
+  return holds(comparison, args[0], args[1], bits);
+}
+
+// the constraints that don't hold yet are solved one at a time, each for
+// one of its values that no earlier one was solved for, with the rest of
+// the input fixed; the result must satisfy all of them
+solver_result_t
+LinearSolver::solve(std::shared_ptr<SearchTask> task,
+                    const uint8_t *in_buf, size_t in_size,
+                    patch_t &patch) {
+
+  for (auto const& c : task->constraints) {
+    // the bytes of an atoi are digits, not the value
+    if (!c->atoi_info.empty()) return SOLVER_TIMEOUT;
+  }
+
+  std::vector<uint64_t> args;
+  std::vector<var_t> locked;
+  linear_t lhs, rhs;
+  for (size_t i = 0; i < task->constraints.size(); i++) {
+    auto const& c = task->constraints[i];
+    uint32_t comparison = task->comparisons[i];
+    if (check_constraint(c, comparison, in_buf, patch, args)) continue;
+    const AstNode *root = c->get_root();
+    if (!isRelationalKind(comparison) || root->children_size() != 2 ||
+        !linearize(&root->children(0), c->input_args, lhs) ||
+        !linearize(&root->children(1), c->input_args, rhs) ||
+        lhs.bits != rhs.bits) {
+      nonlinear++;
+      return SOLVER_TIMEOUT;
+    }
+
+    std::vector<var_t> vars;
+    for (auto const* f : {&lhs, &rhs}) {
+      for (auto const& t : f->terms) {
+        if (std::find(vars.begin(), vars.end(), t.first) == vars.end())
+          vars.push_back(t.first);
+      }
+    }
+    bool solved = false;
+    for (auto const& v : vars) {
+      // the other values must stay as they are
+      bool free = v.offset + v.size <= in_size;
+      for (auto const& u : vars) {
+        if (!(u == v) && u.overlaps(v)) free = false;
+      }
+      for (auto const& u : locked) {
+        if (u.overlaps(v)) free = false;
+      }
+      uint64_t x;
+      if (!free || !solve_for(v, lhs, rhs, comparison, in_buf, patch, x)) {
+        continue;
+      }
+      patch_t trial = patch;
+      for (uint32_t b = 0; b < v.size; b++) {
+        trial.set(v.offset + b, (uint8_t)(x >> (b * 8)));
+      }
+      if (check_constraint(c, comparison, in_buf, trial, args)) {
+        DEBUGF("linear: %u[%u] = %lx\n", v.offset, v.size, x);
+        patch = std::move(trial);
+        locked.push_back(v);
+        solved = true;
+        break;
+      }
+    }
+    if (!solved) return SOLVER_TIMEOUT;
+  }
+
+  for (size_t i = 0; i < task->constraints.size(); i++) {
+    if (!check_constraint(task->constraints[i], task->comparisons[i],
+                          in_buf, patch, args)) {
+      return SOLVER_TIMEOUT;
+    }
+  }
+  task->solution = patch.bytes;
+  task->solved = true;
+  solved_tasks++;
+  return SOLVER_SAT;
+}
+
+void LinearSolver::write_stats(int fd) {
+  dprintf(fd, "linear_solved     : %lu\n", solved_tasks.load());
+  dprintf(fd, "linear_nonlinear  : %lu\n", nonlinear.load());
+}
@@ -0,0 +1,148 @@
+#include "solver.h"
+#include "jigsaw/interp.h"
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace rgd;
+
+#define DEBUG 0
+
+#if !DEBUG
+#undef DEBUGF
+#define DEBUGF(_str...) do { } while (0)
+#endif
+
+// whether the comparison holds on the operands, as the JIT'ed functions
+// compute them
+static bool holds(uint32_t comparison, uint64_t a, uint64_t b) {
+  switch (comparison) {
+    case rgd::Equal: return a == b;
+    case rgd::Distinct: return a != b;
+    case rgd::Ult: return a < b;
+    case rgd::Ule: return a <= b;
+    case rgd::Ugt: return a > b;
+    case rgd::Uge: return a >= b;
+    case rgd::Slt: return (int64_t)a < (int64_t)b;
+    case rgd::Sle: return (int64_t)a <= (int64_t)b;
+    case rgd::Sgt: return (int64_t)a > (int64_t)b;
+    case rgd::Sge: return (int64_t)a >= (int64_t)b;
+    case rgd::Memcmp: return a == 1;
+    case rgd::MemcmpN: return a == 0;
+    default: return false;
+  }
+}
+
+// runs c on the input in buf with patch, as the i2s solver does
+static bool check_constraint(std::shared_ptr<const Constraint> const& c,
+                             uint32_t comparison, const uint8_t *buf,
+                             patch_t const& patch, std::vector<uint64_t> &args) {
+  if (!c->get_fn() && !c->get_program()) {
+    c->set_program(ConstraintProgram::compile(c->get_root(), c->local_map));
+    if (!c->get_program()) return false;
+  }
+  args.assign(RET_OFFSET + c->input_args.size() + 1, 0);
+  for (size_t i = 0; i < c->input_args.size(); i++) {
+    if (!c->input_args[i].first)
+      args[RET_OFFSET + i] = c->input_args[i].second;
+  }
+  for (auto const& [offset, lidx] : c->local_map) {
+    args[RET_OFFSET + lidx] = patch.get(buf, offset);
+  }
+  run_constraint(*c, args.data());
+  return holds(comparison, args[0], args[1]);
+}
+
+// the memcmps of the task against a recorded buffer that don't hold yet
+// get the buffer written over the input bytes they compare, or for a
+// memcmp that has to differ, one of those bytes changed; the result must
+// then satisfy all the constraints of the task
+solver_result_t
+MemcmpSolver::solve(std::shared_ptr<SearchTask> task,
+                    const uint8_t *in_buf, size_t in_size,
+                    patch_t &patch) {
+
+  bool has_memcmp = false;
+  for (size_t i = 0; i < task->constraints.size(); i++) {
+    uint32_t comparison = task->comparisons[i];
+    has_memcmp |= comparison == rgd::Memcmp || comparison == rgd::MemcmpN;
+    // atoi solutions can change the length of the input
+    if (!task->constraints[i]->atoi_info.empty()) return SOLVER_TIMEOUT;
+  }
+  if (!has_memcmp) return SOLVER_TIMEOUT;
+
+  std::vector<uint64_t> args;
+  // the bytes written for the memcmps so far
+  std::vector<std::pair<uint32_t, uint32_t>> locked;
+  auto is_locked = [&locked](uint32_t offset, uint32_t len) {
+    for (auto const& [o, l] : locked) {
+      if (offset < o + l && o < offset + len) return true;
+    }
+    return false;
+  };
+  for (size_t i = 0; i < task->constraints.size(); i++) {
+    uint32_t comparison = task->comparisons[i];
+    if (comparison != rgd::Memcmp && comparison != rgd::MemcmpN) continue;
+    auto const& c = task->constraints[i];
+    if (check_constraint(c, comparison, in_buf, patch, args)) continue;
+    // the buffer is the constant side, the other side reads the input as is
+    const AstNode *root = c->get_root();
+    if (root->children_size() != 2 ||
+        root->children(0).kind() != rgd::Constant ||
+        root->children(1).kind() != rgd::Read) {
+      not_direct++;
+      return SOLVER_TIMEOUT;
+    }
+    uint32_t arg_index = root->children(0).index();
+    uint32_t offset = root->children(1).index();
+    uint32_t len = root->children(1).bits() / 8;
+    if (len == 0 || offset + len > in_size ||
+        arg_index + (len + 7) / 8 > c->input_args.size()) {
+      return SOLVER_TIMEOUT;
+    }
+    if (comparison == rgd::Memcmp) {
+      if (is_locked(offset, len)) {
+        conflicts++;
+        return SOLVER_TIMEOUT;
+      }
+      for (uint32_t k = 0; k < len; k++) {
+        uint64_t chunk = c->input_args[arg_index + k / 8].second;
+        patch.set(offset + k, (uint8_t)(chunk >> (8 * (k % 8))));
+      }
+      DEBUGF("memcmp: %u[%u] = buffer\n", offset, len);
+      locked.push_back({offset, len});
+    } else {
+      // the last byte is the least likely to be a magic's shared prefix
+      uint32_t k = len;
+      while (k > 0 && is_locked(offset + k - 1, 1)) k--;
+      if (k == 0) {
+        conflicts++;
+        return SOLVER_TIMEOUT;
+      }
+      patch.set(offset + k - 1, patch.get(in_buf, offset + k - 1) ^ 1);
+      DEBUGF("memcmp: %u differs\n", offset + k - 1);
+      locked.push_back({offset + k - 1, 1});
+    }
+  }
+  if (locked.empty()) return SOLVER_TIMEOUT;
+
+  // the nested constraints, and the memcmps on overlapping bytes
+  for (size_t i = 0; i < task->constraints.size(); i++) {
+    if (!check_constraint(task->constraints[i], task->comparisons[i],
+                          in_buf, patch, args)) {
+      nested_failed++;
+      return SOLVER_TIMEOUT;
+    }
+  }
+  task->solution = patch.bytes;
+  task->solved = true;
+  solved_tasks++;
+  return SOLVER_SAT;
+}
+
+void MemcmpSolver::write_stats(int fd) {
+  dprintf(fd, "memcmp_solved     : %lu\n", solved_tasks.load());
+  dprintf(fd, "memcmp_not_direct : %lu\n", not_direct.load());
+  dprintf(fd, "memcmp_conflicts  : %lu\n", conflicts.load());
+  dprintf(fd, "memcmp_nested     : %lu\n", nested_failed.load());
+}
@@ -1,4 +1,7 @@
 #include "solver.h"
+#include "task_store.h"
+#include "probes.h"
+#include "z3_tactics.h"
 
 #include <z3++.h>
 
@@ -15,31 +18,59 @@ using namespace rgd;
 #define WARNF(_str...) do { fprintf(stderr, _str); } while (0)
 #endif
 
-z3::context g_z3_context;
 const unsigned kSolverTimeout = 10000; // 10 seconds
 
-Z3Solver::Z3Solver()
-    : context_(g_z3_context), solver_(z3::solver(context_, "QF_BV"))
+// a context of its own, so solvers on different threads don't share one
+Z3Solver::Z3Solver(const char *tactics)
+    : context_(), solver_(z3::solver(context_, "QF_BV"))
 {
   // Set timeout for solver
   z3::params p(context_);
   p.set(":timeout", kSolverTimeout);
   solver_.set(p);
+  // the chain is only built once, its solver kept for every task
+  try {
+    Z3Tactics chain(context_, tactics);
+    if (chain.enabled()) {
+      tactic_solver_.reset(new z3::solver(chain.make_solver()));
+      tactic_solver_->set(p);
+      tactics_ = tactics;
+    }
+  } catch (z3::exception &e) {
+    WARNF("z3 tactics %s: %s, using the default solver\n", tactics, e.msg());
+  }
+}
+
+size_t Z3Solver::allocated_bytes() {
+  return Z3_get_estimated_alloc_size();
+}
+
+void Z3Solver::drop_caches() {
+  expr_cache_.clear();
+  cache_arena_.reset();
+  solver_.reset();
+  if (tactic_solver_) tactic_solver_->reset();
+}
+
+// labels are only unique within a trace, the cache is dropped along with
+// the arena of the trace; the hash is a cheap extra check
+static inline uint64_t expr_key(const AstNode *node) {
+  return ((uint64_t)node->hash() << 32) | node->label();
 }
 
 static inline z3::expr
-cache_expr(uint32_t label, z3::expr const &e, 
-           std::unordered_map<uint32_t, z3::expr> &expr_cache) {	
-  if (label != 0)
-    expr_cache.insert({label, e});
+cache_expr(const AstNode *node, z3::expr const &e,
+           Z3Solver::expr_cache_t &expr_cache) {
+  if (node->label() != 0)
+    expr_cache.insert({expr_key(node), e});
   return e;
 }
 
 z3::expr Z3Solver::serialize(const AstNode* node,
     const std::vector<std::pair<bool, uint64_t>> &input_args,
-    std::unordered_map<uint32_t, z3::expr> &expr_cache) {
+    expr_cache_t &expr_cache) {
 
-  auto itr = expr_cache.find(node->label());
+  auto itr = expr_cache.find(expr_key(node));
   if (node->label() != 0 && itr != expr_cache.end())
     return itr->second;
 
@@ -77,16 +108,16 @@ z3::expr Z3Solver::serialize(const AstNode* node,
         symbol = context_.int_symbol(node->index() + i);
         out = z3::concat(context_.constant(symbol, sort), out);
       }
-      return cache_expr(node->label(), out, expr_cache);
+      return cache_expr(node, out, expr_cache);
     }
     case rgd::Concat: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), z3::concat(c2, c1), expr_cache);
+      return cache_expr(node, z3::concat(c2, c1), expr_cache);
     }
     case rgd::Extract: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
-      return cache_expr(node->label(),
+      return cache_expr(node,
                         c1.extract(node->index() + node->bits() - 1, node->index()),
                         expr_cache);
     }
@@ -94,102 +125,102 @@ z3::expr Z3Solver::serialize(const AstNode* node,
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       if (c1.is_bool())
         c1 = z3::ite(c1, context_.bv_val(1,1), context_.bv_val(0, 1));
-      return cache_expr(node->label(),
+      return cache_expr(node,
                         z3::zext(c1, node->bits() - node->children(0).bits()),
                         expr_cache);
     }
     case rgd::SExt: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
-      return cache_expr(node->label(),
+      return cache_expr(node,
                         z3::sext(c1, node->bits() - node->children(0).bits()),
                         expr_cache);
     }
     case rgd::Add: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), c1 + c2, expr_cache);
+      return cache_expr(node, c1 + c2, expr_cache);
     }
     case rgd::Sub: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), c1 - c2, expr_cache);
+      return cache_expr(node, c1 - c2, expr_cache);
     }
     case rgd::Mul: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), c1 * c2, expr_cache);
+      return cache_expr(node, c1 * c2, expr_cache);
     }
     case rgd::UDiv: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), z3::udiv(c1, c2), expr_cache);
+      return cache_expr(node, z3::udiv(c1, c2), expr_cache);
     }
     case rgd::SDiv: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), c1 / c2, expr_cache); 
+      return cache_expr(node, c1 / c2, expr_cache); 
     }
     case rgd::URem: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), z3::urem(c1, c2), expr_cache);
+      return cache_expr(node, z3::urem(c1, c2), expr_cache);
     }
     case rgd::SRem: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), z3::srem(c1, c2), expr_cache);
+      return cache_expr(node, z3::srem(c1, c2), expr_cache);
     }
     case rgd::Neg: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
-      return cache_expr(node->label(), -c1, expr_cache);
+      return cache_expr(node, -c1, expr_cache);
     }
     case rgd::Not: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
-      return cache_expr(node->label(), ~c1, expr_cache);
+      return cache_expr(node, ~c1, expr_cache);
     }
     case rgd::And: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), c1 & c2, expr_cache);
+      return cache_expr(node, c1 & c2, expr_cache);
     }
     case rgd::Or: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), c1 | c2, expr_cache);
+      return cache_expr(node, c1 | c2, expr_cache);
     }
     case rgd::Xor: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), c1 ^ c2, expr_cache);
+      return cache_expr(node, c1 ^ c2, expr_cache);
     }
     case rgd::Shl: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), z3::shl(c1, c2), expr_cache);
+      return cache_expr(node, z3::shl(c1, c2), expr_cache);
     }
     case rgd::LShr: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), z3::lshr(c1, c2), expr_cache);
+      return cache_expr(node, z3::lshr(c1, c2), expr_cache);
     }
     case rgd::AShr: {
       z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
       z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-      return cache_expr(node->label(), z3::ashr(c1, c2), expr_cache);
+      return cache_expr(node, z3::ashr(c1, c2), expr_cache);
     }
     // case rgd::LOr: {
     //   z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
     //   z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-    //   return cache_expr(node->label(), c1 || c2, expr_cache);
+    //   return cache_expr(node, c1 || c2, expr_cache);
     // }
     // case rgd::LAnd: {
     //   z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
     //   z3::expr c2 = serialize(&node->children(1), input_args, expr_cache);
-    //   return cache_expr(node->label(), c1 && c2, expr_cache);
+    //   return cache_expr(node, c1 && c2, expr_cache);
     // }
     // case rgd::LNot: {
     //   z3::expr c1 = serialize(&node->children(0), input_args, expr_cache);
-    //   return cache_expr(node->label(), !c1, expr_cache);
+    //   return cache_expr(node, !c1, expr_cache);
     // }
     default:
       WARNF("unhandler expr: ");
@@ -201,7 +232,7 @@ z3::expr Z3Solver::serialize(const AstNode* node,
 z3::expr Z3Solver::serialize_rel(uint32_t comparison,
     const AstNode* node,
     const std::vector<std::pair<bool, uint64_t>> &input_args,
-    std::unordered_map<uint32_t,z3::expr> &expr_cache) {
+    expr_cache_t &expr_cache) {
 
   if (node->children_size() != 2) {
     throw z3::exception("invalid children size");
@@ -239,8 +270,8 @@ z3::expr Z3Solver::serialize_rel(uint32_t comparison,
   }
 }
 
-static inline void extract_model(z3::model &m, uint8_t *buf, size_t buf_size,
-                                 std::unordered_map<size_t, uint8_t> &solution) {
+static inline void extract_model(z3::model &m, size_t buf_size,
+                                 solution_map_t &solution) {
   unsigned num_constants = m.num_consts();
   for (unsigned i = 0; i< num_constants; i++) {
     z3::func_decl decl = m.get_const_decl(i);
@@ -250,7 +281,6 @@ static inline void extract_model(z3::model &m, uint8_t *buf, size_t buf_size,
       uint8_t value = (uint8_t)e.get_numeral_int();
       size_t offset = name.to_int();
       if (offset < buf_size) {
-        buf[offset] = value;
         solution[offset] = value;
         DEBUGF("generate_input offset:%zu => %u\n", offset, value);
       } else {
@@ -263,82 +293,110 @@ static inline void extract_model(z3::model &m, uint8_t *buf, size_t buf_size,
 solver_result_t
 Z3Solver::solve(std::shared_ptr<SearchTask> task,
                 const uint8_t *in_buf, size_t in_size,
-                uint8_t *out_buf, size_t &out_size) {
+                patch_t &patch) {
+
+  SYMSAN_PROBE2(z3_solve_begin, task->constraints.size(), in_size);
+  SYMSAN_PROBE_ON_EXIT(SYMSAN_PROBE1(z3_solve_end, task->solved));
+
+  z3::solver &solver = query_solver();
 
   try {
-    solver_.reset(); // reset solver
-    auto base_task = task->base_task;
+    auto const &chain = task->ancestors();
     std::vector<z3::expr> assumptions;
-    while (base_task != nullptr) {
-      // no need to solve
-      if (base_task->skip_next) {
-        DEBUGF("skipping task\n");
-        task->skip_next = true; // set the flag for following tasks
-        out_size = in_size;
-        memcpy(out_buf, in_buf, in_size);
-        if (base_task->solved) {
-          for (auto const &[offset, value] : base_task->solution) {
-            out_buf[offset] = value;
-          }
-          return SOLVER_SAT;
-        } else {
-          return SOLVER_UNSAT;
-        }
-      } else if (base_task->solved) {
-        for (auto const &[offset, value] : base_task->solution) {
-          z3::symbol symbol = context_.int_symbol(offset);
-          z3::sort sort = context_.bv_sort(8);
-          z3::expr i = context_.constant(symbol, sort);
-          assumptions.push_back(i == value);
-        }
+    // no need to solve
+    if (chain.skip) {
+      DEBUGF("skipping task\n");
+      task->skip_next = true; // set the flag for following tasks
+      if (chain.skip->solved) {
+        patch.bytes = chain.skip->solution;
+        return SOLVER_SAT;
+      } else {
+        return SOLVER_UNSAT;
       }
-      base_task = base_task->base_task;
+    }
+    for (auto const &[offset, value] : chain.hints) {
+      z3::symbol symbol = context_.int_symbol(offset);
+      z3::sort sort = context_.bv_sort(8);
+      z3::expr i = context_.constant(symbol, sort);
+      assumptions.push_back(i == value);
     }
 
-    std::unordered_map<uint32_t, z3::expr> expr_cache;
+    // the expressions serialized for earlier tasks of the same trace are
+    // reused, those of other traces dropped
+    auto const &arena = task->constraints[0]->local_map.get_allocator().arena();
+    if (!arena || arena != cache_arena_) {
+      expr_cache_.clear();
+      cache_arena_ = arena;
+    }
+
+    // the constraints of a task are only asserted in a scope of its own, the
+    // solver itself stays around for the next one; with a core cache, each
+    // one is guarded by an assumption, so the core tells which ones conflict
+    solver.push();
+    z3::expr_vector guards(context_);
     for (size_t i = 0; i < task->constraints.size(); i++) {
       auto const &c = task->constraints[i];
-      z3::expr z3expr = serialize_rel(task->comparisons[i], c->get_root(), c->input_args, expr_cache);
+      z3::expr z3expr = serialize_rel(task->comparisons[i], c->get_root(), c->input_args, expr_cache_);
       DEBUGF("adding expr %s\n", z3expr.to_string().c_str());
-      solver_.add(z3expr);
+      if (unsat_cores_) {
+        z3::expr guard = context_.bool_const(("c" + std::to_string(i)).c_str());
+        solver.add(z3::implies(guard, z3expr));
+        guards.push_back(guard);
+      } else {
+        solver.add(z3expr);
+      }
+    }
+    // and close to the best candidate of the solvers before, on the bytes
+    // the base tasks leave open
+    for (auto const &[offset, value] : task->best) {
+      if (chain.hints.count(offset)) continue;
+      z3::expr i = context_.constant(context_.int_symbol(offset), context_.bv_sort(8));
+      assumptions.push_back(i == value);
+    }
+    // prefer a solution close to those of the base tasks, but they are only
+    // assumptions, an unsat with them says nothing about the task
+    z3::check_result ret = z3::unknown;
+    if (!assumptions.empty()) {
+      z3::expr_vector hints(context_);
+      for (auto const &a : assumptions) hints.push_back(a);
+      for (auto const &g : guards) hints.push_back(g);
+      ret = solver.check(hints);
+    }
+    if (ret != z3::sat) {
+      ret = guards.empty() ? solver.check() : solver.check(guards);
+    }
+    if (ret == z3::unsat && unsat_cores_) {
+      // the guards are named after the constraints' indices
+      UnsatCoreCache::fp_set_t core;
+      z3::expr_vector conflict = solver.unsat_core();
+      for (unsigned i = 0; i < conflict.size(); i++) {
+        size_t idx = std::stoul(conflict[i].decl().name().str().substr(1));
+        core.push_back(TaskStore::fingerprint(*task->constraints[idx],
+                                              task->comparisons[idx]));
+      }
+      unsat_cores_->add(std::move(core));
+    }
+    if (ret == z3::unknown) {
+      // whatever the solver got to before it gave up, if it tells
+      try {
+        solution_map_t partial;
+        z3::model m = solver.get_model();
+        extract_model(m, in_size, partial);
+        task->offer_best(partial, SearchTask::kUnknownDistance);
+      } catch (z3::exception &e) {}
+    }
+    if (ret != z3::sat) {
+      solver.pop();
     }
-    auto ret = solver_.check();
     if (ret == z3::sat) {
-      memcpy(out_buf, in_buf, in_size);
-      out_size = in_size;
-      z3::model m = solver_.get_model();
-      extract_model(m, out_buf, out_size, task->solution);
+      z3::model m = solver.get_model();
+      extract_model(m, in_size, task->solution);
+      patch.bytes = task->solution;
       if (!task->atoi_info.empty()) {
         // if there are atoi bytes, handle them
-        for (auto const &[offset, info] : task->atoi_info) {
-          uint64_t val = 0;
-          uint32_t length = std::get<0>(info);
-          memcpy(out_buf + offset, in_buf + offset, length); // restore?
-          for (auto i = length; i != 0; --i) {
-            DEBUGF("generate_input atoi offset:%d => %lu\n", offset + i - 1, val);
-            auto itr = task->solution.find(offset + i - 1);
-            if (itr != task->solution.end())
-              val |= itr->second << (8 * (i - 1));
-            else
-              val |= 0 << (8 * (i - 1));
-          }
-          uint32_t base = std::get<1>(info);
-          uint32_t orig_len = std::get<2>(info);
-          DEBUGF("generate_input atoi offset:%d => %lu, base = %d, original len = %d\n",
-              offset, val, base, orig_len);
-          const char *format = nullptr;
-          switch (base) {
-            case 2: format = "%lb"; break;
-            case 8: format = "%lo"; break;
-            case 10: format = "%ld"; break;
-            case 16: format = "%lx"; break;
-            default: WARNF("unsupported base %d\n", base);
-          }
-          if (format) {
-            snprintf((char*)out_buf + offset, in_size - offset, format, val);
-          }
-        }
+        patch.add_atoi(*task, in_buf, in_size);
       }
+      solver.pop();
       task->solved = true;
       return SOLVER_SAT;
     } else if (ret == z3::unsat) {
@@ -348,6 +406,55 @@ Z3Solver::solve(std::shared_ptr<SearchTask> task,
     }
   } catch (z3::exception e) {
     WARNF("z3 exception %s\n", e.msg());
+    // drop whatever scope the task was left in
+    solver.reset();
   }
   return SOLVER_ERROR;
 }
+
+size_t Z3Solver::solve_more(std::shared_ptr<SearchTask> task,
+                            const uint8_t *in_buf, size_t in_size,
+                            size_t n, std::vector<patch_t> &patches) {
+  if (!task->solved || task->inputs.empty()) return 0;
+  z3::solver &solver = query_solver();
+  size_t added = 0;
+  try {
+    // the constraints are serialized already, so asserting them again in a
+    // scope of their own is cheap
+    solver.push();
+    for (size_t i = 0; i < task->constraints.size(); i++) {
+      auto const &c = task->constraints[i];
+      solver.add(serialize_rel(task->comparisons[i], c->get_root(),
+                               c->input_args, expr_cache_));
+    }
+    // a solution is blocked on the bytes the task reads
+    auto block = [&](solution_map_t const& solution) {
+      z3::expr_vector differs(context_);
+      for (auto const &[offset, value] : task->inputs) {
+        auto itr = solution.find(offset);
+        if (itr == solution.end()) continue;
+        z3::expr i = context_.constant(context_.int_symbol(offset), context_.bv_sort(8));
+        differs.push_back(i != context_.bv_val(itr->second, 8));
+      }
+      if (differs.empty()) return false;
+      solver.add(z3::mk_or(differs));
+      return true;
+    };
+    bool more = block(task->solution);
+    while (more && added < n && solver.check() == z3::sat) {
+      z3::model m = solver.get_model();
+      patches.emplace_back();
+      extract_model(m, in_size, patches.back().bytes);
+      more = block(patches.back().bytes);
+      if (!task->atoi_info.empty()) {
+        patches.back().add_atoi(*task, in_buf, in_size);
+      }
+      added++;
+    }
+    solver.pop();
+  } catch (z3::exception e) {
+    WARNF("z3 exception %s\n", e.msg());
+    solver.reset();
+  }
+  return added;
+}
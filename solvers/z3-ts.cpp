@@ -1,12 +1,20 @@
 #include "dfsan/dfsan.h"
 
 #include "parse-z3.h"
+#include "number.h"
+#include "probes.h"
+#include "z3_tactics.h"
 
+#include "wheels/threadpool/ThreadPool.h"
+
+#include <algorithm>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include <string.h>
+
 using namespace symsan;
 
 Z3AstParser::Z3AstParser(void *base, size_t size, z3::context &context)
@@ -19,9 +27,13 @@ int Z3AstParser::restart(std::vector<input_t> &inputs) {
 
   // reset caches
   memcmp_cache_.clear();
+  memcmp_content_.clear();
   tsize_cache_.clear();
   deps_cache_.clear();
+  dep_union_cache_.clear();
   expr_cache_.clear();
+  invalid_labels_.clear();
+  index_ranges_.clear();
   branch_deps_.clear();
   branch_deps_.resize(inputs.size());
 
@@ -35,10 +47,12 @@ int Z3AstParser::restart(std::vector<input_t> &inputs) {
   return 0;
 }
 
+static const char kNoMemcmpContent[] = "cannot find memcmp content";
+
 z3::expr Z3AstParser::read_concrete(dfsan_label label, uint16_t size) {
   auto itr = memcmp_cache_.find(label);
   if (itr == memcmp_cache_.end()) {
-    throw z3::exception("cannot find memcmp content");
+    throw z3::exception(kNoMemcmpContent);
   }
 
   z3::expr val = context_.bv_val(itr->second[0], 8);
@@ -68,19 +82,112 @@ static z3::expr get_cmd(z3::expr const &lhs, z3::expr const &rhs, uint32_t predi
   // std::unreachable();
 }
 
+// FP values are kept as their IEEE bits, like every other label
+static z3::expr to_fp(z3::expr const &bits) {
+  z3::context &ctx = bits.ctx();
+  switch (bits.get_sort().bv_size()) {
+    case 16: return bits.mk_from_ieee_bv(ctx.fpa_sort<16>());
+    case 32: return bits.mk_from_ieee_bv(ctx.fpa_sort<32>());
+    case 64: return bits.mk_from_ieee_bv(ctx.fpa_sort<64>());
+    default: throw z3::exception("unsupported fp size");
+  }
+}
+
+static z3::sort fp_sort(z3::context &ctx, uint16_t size) {
+  switch (size) {
+    case 16: return ctx.fpa_sort<16>();
+    case 32: return ctx.fpa_sort<32>();
+    case 64: return ctx.fpa_sort<64>();
+    default: throw z3::exception("unsupported fp size");
+  }
+}
+
+static z3::expr get_fcmp(z3::expr const &lhs, z3::expr const &rhs, uint32_t predicate) {
+  z3::context &ctx = lhs.ctx();
+  z3::expr eq = z3::expr(ctx, Z3_mk_fpa_eq(ctx, lhs, rhs));
+  z3::expr ord = !z3::expr(ctx, Z3_mk_fpa_is_nan(ctx, lhs)) &&
+                 !z3::expr(ctx, Z3_mk_fpa_is_nan(ctx, rhs));
+  // llvm::CmpInst::Predicate, the unordered ones also hold for NaN
+  switch (predicate) {
+    case 0:  return ctx.bool_val(false);
+    case 1:  return eq;
+    case 2:  return lhs > rhs;
+    case 3:  return lhs >= rhs;
+    case 4:  return lhs < rhs;
+    case 5:  return lhs <= rhs;
+    case 6:  return ord && !eq;
+    case 7:  return ord;
+    case 8:  return !ord;
+    case 9:  return !ord || eq;
+    case 10: return !ord || lhs > rhs;
+    case 11: return !ord || lhs >= rhs;
+    case 12: return !ord || lhs < rhs;
+    case 13: return !ord || lhs <= rhs;
+    case 14: return !eq;
+    case 15: return ctx.bool_val(true);
+    default:
+      throw z3::exception("unsupported fcmp predicate");
+  }
+}
+
+Z3AstParser::label_deps_t
+Z3AstParser::merge_deps(label_deps_t const &lhs, label_deps_t const &rhs) {
+  if (!lhs || !rhs || lhs == rhs) {
+    return rgd::DepSet::merge(lhs, rhs);
+  }
+  // union is symmetric
+  auto key = lhs.get() < rhs.get() ? std::make_pair((const void*)lhs.get(), (const void*)rhs.get())
+                                   : std::make_pair((const void*)rhs.get(), (const void*)lhs.get());
+  auto itr = dep_union_cache_.find(key);
+  if (itr != dep_union_cache_.end()) {
+    return itr->second.result;
+  }
+  label_deps_t result = rgd::DepSet::merge(lhs, rhs);
+  dep_union_cache_.emplace(key, dep_union{lhs, rhs, result});
+  return result;
+}
+
 z3::expr Z3AstParser::serialize(dfsan_label label, input_dep_set_t &deps) {
+  label_deps_t label_deps;
+  z3::expr e = serialize(label, label_deps);
+  if (label_deps) {
+    label_deps->for_each([&deps](size_t key) {
+      deps.insert(std::make_pair((uint32_t)(key >> 32), (uint32_t)key));
+    });
+  }
+  return e;
+}
+
+// deps is set to the input offsets label depends on
+z3::expr Z3AstParser::serialize(dfsan_label label, label_deps_t &deps) {
+  if (invalid_labels_.count(label)) {
+    throw z3::exception("label failed to serialize before");
+  }
+  try {
+    return do_serialize(label, deps);
+  } catch (z3::exception &e) {
+    // what the label is doesn't change within the run, what it reads may
+    if (strcmp(e.msg(), kNoMemcmpContent) != 0) {
+      invalid_labels_.insert(label);
+    }
+    throw;
+  }
+}
+
+z3::expr Z3AstParser::do_serialize(dfsan_label label, label_deps_t &deps) {
+  deps = nullptr;
   if (label < CONST_OFFSET || label == __dfsan::kInitializingLabel) {
     throw z3::exception("invalid label");
   }
 
   dfsan_label_info *info = get_label_info(label);
+  dfsan_label_operands *ops = get_label_operands(label);
   // printf("%u = (l1:%u, l2:%u, op:%u, size:%u, op1:%lu, op2:%lu)\n",
-  //       label, info->l1, info->l2, info->op, info->size, info->op1.i, info->op2.i);
+  //       label, info->l1, info->l2, info->op, info->size, ops->op1.i, ops->op2.i);
 
   auto expr_itr = expr_cache_.find(label);
   if (expr_itr != expr_cache_.end()) {
-    auto deps_itr = deps_cache_.find(label);
-    deps.insert(deps_itr->second.begin(), deps_itr->second.end());
+    deps = deps_cache_[label];
     return expr_itr->second;
   }
 
@@ -88,29 +195,29 @@ z3::expr Z3AstParser::serialize(dfsan_label label, input_dep_set_t &deps) {
   char name[256];
   if (info->op == 0) {
     // input
-    uint32_t offset = info->op1.i; // legacy: offset in op1
-    uint32_t input = info->op2.i;
+    uint32_t offset = ops->op1.i; // legacy: offset in op1
+    uint32_t input = ops->op2.i;
     snprintf(name, sizeof(name), input_name_format, input, offset);
     z3::symbol symbol = context_.str_symbol(name);
     z3::sort sort = context_.bv_sort(8);
     tsize_cache_[label] = 1; // lazy init
-    deps.insert(std::make_pair(input, offset));
+    deps = rgd::DepSet::make_range(dep_key(input, offset), dep_key(input, offset) + 1);
     // caching is not super helpful
     return context_.constant(symbol, sort);
   } else if (info->op == __dfsan::Load) {
-    uint32_t offset = get_label_info(info->l1)->op1.i; // legacy: offset in op1
-    uint32_t input = get_label_info(info->l1)->op2.i;
+    uint32_t offset = get_label_operands(info->l1)->op1.i; // legacy: offset in op1
+    uint32_t input = get_label_operands(info->l1)->op2.i;
     snprintf(name, sizeof(name), input_name_format, input, offset);
     z3::symbol symbol = context_.str_symbol(name);
     z3::sort sort = context_.bv_sort(8);
     z3::expr out = context_.constant(symbol, sort);
-    deps.insert(std::make_pair(input, offset));
     for (uint32_t i = 1; i < info->l2; i++) {
       snprintf(name, sizeof(name), input_name_format, input, offset + i);
       symbol = context_.str_symbol(name);
       out = z3::concat(context_.constant(symbol, sort), out);
-      deps.insert(std::make_pair(input, offset + i));
     }
+    deps = rgd::DepSet::make_range(dep_key(input, offset),
+                                   dep_key(input, offset) + (info->l2 ? info->l2 : 1));
     tsize_cache_[label] = 1; // lazy init
     return cache_expr(label, out, deps);
   } else if (info->op == __dfsan::ZExt) {
@@ -134,12 +241,39 @@ z3::expr Z3AstParser::serialize(dfsan_label label, input_dep_set_t &deps) {
     z3::expr e = serialize(info->l1, deps);
     tsize_cache_[label] = tsize_cache_[info->l1]; // lazy init
     return cache_expr(label, e, deps);
-  } //FIXME: other casting ops (PtrToInt, BitCast)?
+  } else if (info->op == __dfsan::BitCast) {
+    z3::expr e = serialize(info->l1, deps);
+    tsize_cache_[label] = tsize_cache_[info->l1]; // lazy init
+    return cache_expr(label, e, deps);
+  } else if (info->op == __dfsan::FPExt || info->op == __dfsan::FPTrunc) {
+    z3::expr base = to_fp(serialize(info->l1, deps));
+    tsize_cache_[label] = tsize_cache_[info->l1]; // lazy init
+    z3::expr e = z3::fpa_to_fpa(base, fp_sort(context_, info->size));
+    return cache_expr(label, e.mk_to_ieee_bv(), deps);
+  } else if (info->op == __dfsan::SIToFP || info->op == __dfsan::UIToFP) {
+    z3::expr base = serialize(info->l1, deps);
+    if (base.is_bool())
+      base = z3::ite(base, context_.bv_val(1, 1), context_.bv_val(0, 1));
+    tsize_cache_[label] = tsize_cache_[info->l1]; // lazy init
+    z3::sort sort = fp_sort(context_, info->size);
+    z3::expr e = info->op == __dfsan::SIToFP ? z3::sbv_to_fpa(base, sort)
+                                             : z3::ubv_to_fpa(base, sort);
+    return cache_expr(label, e.mk_to_ieee_bv(), deps);
+  } else if (info->op == __dfsan::FPToSI || info->op == __dfsan::FPToUI) {
+    z3::expr base = to_fp(serialize(info->l1, deps));
+    tsize_cache_[label] = tsize_cache_[info->l1]; // lazy init
+    // rounds toward zero, unlike the other fp ops
+    z3::expr rtz(context_, Z3_mk_fpa_rtz(context_));
+    Z3_ast e = info->op == __dfsan::FPToSI
+        ? Z3_mk_fpa_to_sbv(context_, rtz, base, info->size)
+        : Z3_mk_fpa_to_ubv(context_, rtz, base, info->size);
+    return cache_expr(label, z3::expr(context_, e), deps);
+  } //FIXME: other casting ops (PtrToInt)?
   // symsan-defined
   else if (info->op == __dfsan::Extract) {
     z3::expr base = serialize(info->l1, deps);
     tsize_cache_[label] = tsize_cache_[info->l1]; // lazy init
-    return cache_expr(label, base.extract((info->op2.i + info->size) - 1, info->op2.i), deps);
+    return cache_expr(label, base.extract((ops->op2.i + info->size) - 1, ops->op2.i), deps);
   } else if (info->op == __dfsan::Not) {
     if (info->l2 == 0 || info->size != 1) {
       throw z3::exception("invalid Not operation");
@@ -165,7 +299,9 @@ z3::expr Z3AstParser::serialize(dfsan_label label, input_dep_set_t &deps) {
     if (info->l2 < CONST_OFFSET) {
       throw z3::exception("invalid memcmp operand2");
     }
-    z3::expr op2 = serialize(info->l2, deps);
+    label_deps_t deps2;
+    z3::expr op2 = serialize(info->l2, deps2);
+    deps = merge_deps(deps, deps2);
     tsize_cache_[label] = 1; // lazy init
     z3::expr e = z3::ite(op1 == op2, context_.bv_val(0, 32),
                                      context_.bv_val(1, 32));
@@ -178,9 +314,9 @@ z3::expr Z3AstParser::serialize(dfsan_label label, input_dep_set_t &deps) {
     tsize_cache_[label] = 1; // lazy init
     has_fsize = true; // XXX: set a flag
     // don't cache because of deps
-    if (info->op1.i) {
+    if (ops->op1.i) {
       // minus the offset stored in op1
-      z3::expr offset = context_.bv_val((uint64_t)info->op1.i, info->size);
+      z3::expr offset = context_.bv_val((uint64_t)ops->op1.i, info->size);
       return base - offset;
     } else {
       return base;
@@ -190,9 +326,9 @@ z3::expr Z3AstParser::serialize(dfsan_label label, input_dep_set_t &deps) {
     assert(info->l1 == 0 && info->l2 >= CONST_OFFSET);
     dfsan_label_info *src = get_label_info(info->l2);
     assert(src->op == __dfsan::Load);
-    uint32_t offset = get_label_info(src->l1)->op1.i; // legacy: offset in op1
-    uint32_t input = get_label_info(src->l1)->op2.i;
-    int base = info->op1.i;
+    uint32_t offset = get_label_operands(src->l1)->op1.i; // legacy: offset in op1
+    uint32_t input = get_label_operands(src->l1)->op2.i;
+    int base = ops->op1.i;
     // FIXME: dependencies?
     tsize_cache_[label] = 1; // lazy init
     // XXX: hacky, avoid string theory
@@ -200,6 +336,58 @@ z3::expr Z3AstParser::serialize(dfsan_label label, input_dep_set_t &deps) {
     z3::symbol symbol = context_.str_symbol(name);
     z3::sort sort = context_.bv_sort(info->size);
     return context_.constant(symbol, sort);
+  } else if (info->op == __dfsan::fstrlen) {
+    // the first stop byte among the bytes scanned by strlen, strchr, ...
+    if (info->l2 < CONST_OFFSET) {
+      throw z3::exception("invalid strlen operand");
+    }
+    dfsan_label_info *src = get_label_info(info->l2);
+    dfsan_label first = src->op == __dfsan::Load ? src->l1 : info->l2;
+    uint32_t n = src->op == __dfsan::Load ? src->l2 : 1;
+    uint32_t offset = get_label_operands(first)->op1.i; // legacy: offset in op1
+    uint32_t input = get_label_operands(first)->op2.i;
+    uint64_t stops = ops->op1.i;
+    uint64_t base = ops->op2.i;
+    uint8_t num_stops = stops & (FSTRLEN_NO_NUL - 1);
+    bool nul_stops = !(stops & FSTRLEN_NO_NUL);
+    // with a base, a pointer that's null if no stop byte is found
+    z3::expr out = context_.bv_val(base ? 0 : n, info->size);
+    z3::sort sort = context_.bv_sort(8);
+    for (uint32_t i = n; i-- > 0;) {
+      snprintf(name, sizeof(name), input_name_format, input, offset + i);
+      z3::expr byte = context_.constant(context_.str_symbol(name), sort);
+      z3::expr found = context_.bv_val(base + i, info->size);
+      if (nul_stops) {
+        out = z3::ite(byte == 0, base ? context_.bv_val(0, info->size) : found, out);
+      }
+      for (uint8_t j = 0; j < num_stops; j++) {
+        uint8_t c = (stops >> (8 * (j + 1))) & 0xff;
+        out = z3::ite(byte == context_.bv_val(c, 8), found, out);
+      }
+    }
+    deps = rgd::DepSet::make_range(dep_key(input, offset), dep_key(input, offset) + n);
+    tsize_cache_[label] = 1; // lazy init
+    return cache_expr(label, out, deps);
+  } else if (info->op == __dfsan::fsum) {
+    // the input bytes a loop adds up
+    if (info->l2 < CONST_OFFSET) {
+      throw z3::exception("invalid sum operand");
+    }
+    dfsan_label_info *src = get_label_info(info->l2);
+    dfsan_label first = src->op == __dfsan::Load ? src->l1 : info->l2;
+    uint32_t n = src->op == __dfsan::Load ? src->l2 : 1;
+    uint32_t offset = get_label_operands(first)->op1.i; // legacy: offset in op1
+    uint32_t input = get_label_operands(first)->op2.i;
+    z3::expr out = context_.bv_val(0, info->size);
+    z3::sort sort = context_.bv_sort(8);
+    for (uint32_t i = 0; i < n; i++) {
+      snprintf(name, sizeof(name), input_name_format, input, offset + i);
+      z3::expr byte = context_.constant(context_.str_symbol(name), sort);
+      out = out + (info->size > 8 ? z3::zext(byte, info->size - 8) : byte);
+    }
+    deps = rgd::DepSet::make_range(dep_key(input, offset), dep_key(input, offset) + n);
+    tsize_cache_[label] = 1; // lazy init
+    return cache_expr(label, out, deps);
   }
 
   // common ops
@@ -209,23 +397,23 @@ z3::expr Z3AstParser::serialize(dfsan_label label, input_dep_set_t &deps) {
     assert(info->l2 >= CONST_OFFSET);
     size = info->size - get_label_info(info->l2)->size;
   }
-  z3::expr op1 = context_.bv_val((uint64_t)info->op1.i, size);
+  z3::expr op1 = context_.bv_val((uint64_t)ops->op1.i, size);
   if (info->l1 >= CONST_OFFSET) {
     op1 = serialize(info->l1, deps).simplify();
   } else if (info->size == 1) {
-    op1 = context_.bool_val(info->op1.i == 1);
+    op1 = context_.bool_val(ops->op1.i == 1);
   }
   if (info->op == __dfsan::Concat && info->l2 == 0) {
     assert(info->l1 >= CONST_OFFSET);
     size = info->size - get_label_info(info->l1)->size;
   }
-  z3::expr op2 = context_.bv_val((uint64_t)info->op2.i, size);
+  z3::expr op2 = context_.bv_val((uint64_t)ops->op2.i, size);
   if (info->l2 >= CONST_OFFSET) {
-    input_dep_set_t deps2;
+    label_deps_t deps2;
     op2 = serialize(info->l2, deps2).simplify();
-    deps.insert(deps2.begin(), deps2.end());
+    deps = merge_deps(deps, deps2);
   } else if (info->size == 1) {
-    op2 = context_.bool_val(info->op2.i == 1);
+    op2 = context_.bool_val(ops->op2.i == 1);
   }
   // update tree_size
   tsize_cache_[label] = tsize_cache_[info->l1] + tsize_cache_[info->l2];
@@ -247,6 +435,12 @@ z3::expr Z3AstParser::serialize(dfsan_label label, input_dep_set_t &deps) {
     case __dfsan::SRem:    return cache_expr(label, z3::srem(op1, op2), deps);
     // relational
     case __dfsan::ICmp:    return cache_expr(label, get_cmd(op1, op2, info->op >> 8), deps);
+    // floating point, frem (fmod) has no direct encoding
+    case __dfsan::FAdd:    return cache_expr(label, (to_fp(op1) + to_fp(op2)).mk_to_ieee_bv(), deps);
+    case __dfsan::FSub:    return cache_expr(label, (to_fp(op1) - to_fp(op2)).mk_to_ieee_bv(), deps);
+    case __dfsan::FMul:    return cache_expr(label, (to_fp(op1) * to_fp(op2)).mk_to_ieee_bv(), deps);
+    case __dfsan::FDiv:    return cache_expr(label, (to_fp(op1) / to_fp(op2)).mk_to_ieee_bv(), deps);
+    case __dfsan::FCmp:    return cache_expr(label, get_fcmp(to_fp(op1), to_fp(op2), info->op >> 8), deps);
     // concat
     case __dfsan::Concat:  return cache_expr(label, z3::concat(op2, op1), deps); // little endian
     default:
@@ -259,6 +453,9 @@ z3::expr Z3AstParser::serialize(dfsan_label label, input_dep_set_t &deps) {
 
 int Z3AstParser::parse_cond(dfsan_label label, bool result, bool add_nested, std::vector<uint64_t> &tasks) {
 
+  SYMSAN_PROBE3(parse_cond_begin, label, result, tasks.size());
+  SYMSAN_PROBE_ON_EXIT(SYMSAN_PROBE2(parse_cond_end, label, tasks.size()));
+
   // allocate a new task
   auto task = std::make_shared<z3_task_t>();
   try {
@@ -296,6 +493,59 @@ int Z3AstParser::parse_cond(dfsan_label label, bool result, bool add_nested, std
   return -1;
 }
 
+int Z3AstParser::parse_switch(dfsan_label label, uint64_t result,
+                              const std::vector<uint64_t> &cases,
+                              const std::vector<uint32_t> &targets,
+                              dfsan_label taken_label,
+                              std::vector<std::pair<uint32_t, uint64_t>> &tasks) {
+
+  if (label < CONST_OFFSET || label == __dfsan::kInitializingLabel) {
+    return 0;
+  }
+
+  try {
+    // reset has_fsize flag
+    has_fsize = false;
+
+    // the condition is parsed once for all the cases
+    input_dep_set_t inputs;
+    z3::expr cond = serialize(label, inputs);
+    unsigned size = cond.get_sort().bv_size();
+
+    // collect nested constraints
+    collect_more_deps(inputs);
+    z3_task_t nested_tasks;
+    add_nested_constraints(inputs, &nested_tasks);
+
+    for (auto target : targets) {
+      auto task = std::make_shared<z3_task_t>();
+      if (target < cases.size()) {
+        task->push_back(cond == context_.bv_val(cases[target], size));
+      } else {
+        // the default, none of the cases
+        z3::expr e = context_.bool_val(true);
+        for (auto c : cases)
+          e = e && (cond != context_.bv_val(c, size));
+        task->push_back(e);
+      }
+      task->insert(task->end(), nested_tasks.begin(), nested_tasks.end());
+      tasks.push_back({target, save_task(task)});
+    }
+
+    // save nested unless it's a fsize constraints
+    if (taken_label && !has_fsize) {
+      save_constraint(cond == context_.bv_val(result, size), inputs);
+    }
+
+    return 0; // success
+  } catch (z3::exception e) {
+    // logf("WARNING: solving error: %s\n", e.msg());
+  }
+
+  // exception happened, nothing added
+  return -1;
+}
+
 void Z3AstParser::construct_index_tasks(z3::expr &index, uint64_t curr,
                                         uint64_t lb, uint64_t ub, uint64_t step,
                                         z3_task_t &nested, bool enum_index,
@@ -303,20 +553,25 @@ void Z3AstParser::construct_index_tasks(z3::expr &index, uint64_t curr,
 
   std::shared_ptr<z3_task_t> task = nullptr;
 
-  // enumerate indices
-  if (enum_index) {
-    for (uint64_t i = lb; i < ub; i += step) {
-      if (i == curr) continue;
-      z3::expr idx = context_.bv_val(i, 64);
-      z3::expr e = (index == idx);
-      // allocate a new task
-      task = std::make_shared<z3_task_t>();
-      task->push_back(e);
-      // add nested constraints
-      task->insert(task->end(), nested.begin(), nested.end());
-      // save the task
-      tasks.push_back(save_task(task));
+  // a single task for all the other in-bounds indices, rather than one per
+  // index, which floods the solver on large arrays; solve_index_task picks
+  // the values to try from it
+  if (enum_index && ub > lb) {
+    z3::expr e = (index != context_.bv_val(curr, 64)) &&
+        z3::uge(index, context_.bv_val(lb, 64)) &&
+        z3::ult(index, context_.bv_val(ub, 64));
+    if (step > 1) {
+      e = e && (z3::urem(index - context_.bv_val(curr, 64),
+                         context_.bv_val(step, 64)) == 0);
     }
+    task = std::make_shared<z3_task_t>();
+    task->push_back(e);
+    // add nested constraints
+    task->insert(task->end(), nested.begin(), nested.end());
+    // save the task
+    uint64_t id = save_task(task);
+    index_ranges_.emplace(id, index_range{index, curr, lb, ub});
+    tasks.push_back(id);
   }
 
   // check feasibility for OOB
@@ -368,6 +623,7 @@ int Z3AstParser::parse_gep(dfsan_label ptr_label, uptr ptr, dfsan_label index_la
       construct_index_tasks(idx, index, 0, num_elems, 1, nested_tasks, enum_index, tasks);
     } else {
       dfsan_label_info *bounds = get_label_info(ptr_label);
+      dfsan_label_operands *bounds_ops = get_label_operands(ptr_label);
       // if the array is not with fixed size, check bound info
       if (bounds->op == __dfsan::Alloca) {
         z3::expr es = context_.bv_val(elem_size, 64);
@@ -377,8 +633,10 @@ int Z3AstParser::parse_gep(dfsan_label ptr_label, uptr ptr, dfsan_label index_la
           // when the size of the buffer is fixed
           z3::expr p = context_.bv_val(ptr, 64);
           z3::expr np = idx * es + co + p;
-          construct_index_tasks(np, index, (uint64_t)bounds->op1.i,
-              (uint64_t)bounds->op2.i, elem_size, nested_tasks, enum_index, tasks);
+          // the range is in bytes, so is the current value
+          uint64_t curr = index * elem_size + current_offset + ptr;
+          construct_index_tasks(np, curr, (uint64_t)bounds_ops->op1.i,
+              (uint64_t)bounds_ops->op2.i, elem_size, nested_tasks, enum_index, tasks);
         } else {
           // if the buffer size is input-dependent (not fixed)
           // check if over flow is possible
@@ -480,6 +738,71 @@ size_t Z3AstParser::add_nested_constraints(input_dep_set_t &inputs, z3_task_t *t
   return added.size();
 }
 
+Z3ParserSolver::Z3ParserSolver(void *base, size_t size, z3::context &context)
+    : Z3AstParser(base, size, context), solver_(context, "QF_BV") {}
+
+Z3ParserSolver::~Z3ParserSolver() {
+  // the pending tasks are finished first, they add to the unsat cores
+  workers_.reset();
+}
+
+int Z3ParserSolver::restart(std::vector<input_t> &inputs) {
+  // constraints of the previous trace won't be assumed again
+  solver_.reset();
+  tracked_.clear();
+  return Z3AstParser::restart(inputs);
+}
+
+z3::expr Z3ParserSolver::track_constraint(z3::expr const &e) {
+  auto itr = tracked_.find(e.id());
+  if (itr != tracked_.end()) {
+    return itr->second.guard;
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "nested-%zu", tracked_.size());
+  z3::expr guard = context_.bool_const(name);
+  solver_.add(z3::implies(guard, e));
+  tracked_.emplace(e.id(), tracked_constraint{e, guard});
+  return guard;
+}
+
+bool Z3ParserSolver::set_tactics(const char *chain) {
+  tactics_.clear();
+  tactic_solver_.reset();
+  try {
+    rgd::Z3Tactics tactics(context_, chain);
+    if (tactics.enabled()) {
+      tactic_solver_.reset(new z3::solver(tactics.make_solver()));
+      tactics_ = chain;
+    }
+  } catch (z3::exception &ze) {
+    return false;
+  }
+  return true;
+}
+
+// not incremental, so there's no scope to leave on an exception, the
+// solver is just emptied for the next one
+z3::check_result Z3ParserSolver::check_first(z3::expr const &e,
+                                             unsigned timeout, z3::model &m) {
+  z3::solver &solver = tactic_solver_ ? *tactic_solver_ : solver_;
+  if (tactic_solver_) {
+    solver.reset();
+    solver.set("timeout", timeout);
+    solver.add(e);
+  }
+  z3::check_result res = solver.check();
+  if (res == z3::sat) m = solver.get_model();
+  return res;
+}
+
+// the key of a constraint in the unsat core cache; z3's structural hash is
+// only 32 bits, the top-level operator makes collisions less likely
+static inline uint64_t constraint_fp(z3::expr const &e) {
+  return ((uint64_t)e.hash() << 32) |
+         ((uint64_t)e.decl().decl_kind() << 16) | e.num_args();
+}
+
 Z3ParserSolver::solving_status
 Z3ParserSolver::solve_task(uint64_t task_id, unsigned timeout, solution_t &solutions) {
   solving_status ret = unknown_error;
@@ -489,51 +812,312 @@ Z3ParserSolver::solve_task(uint64_t task_id, unsigned timeout, solution_t &solut
   }
 
   try {
-    // setup global solver
-    z3::solver solver(context_, "QF_BV");
-    solver.set("timeout", timeout);
-    // solve the first constraint (optimistic)
+    // long traces keep adding constraints, start over once there are too many
+    if (tracked_.size() + task->size() > kMaxTrackedConstraints) {
+      solver_.reset();
+      tracked_.clear();
+    }
+    // the budget is per task
+    solver_.set("timeout", timeout);
+    // guards are asserted outside of the task's scope, so they outlive it
+    z3::expr_vector assumptions(context_);
+    for (size_t i = 1; i < task->size(); i++) {
+      assumptions.push_back(track_constraint(task->at(i)));
+    }
+    // a task with a known unsat core isn't solved again
     z3::expr e = task->at(0);
-    solver.add(e);
-    z3::check_result res = solver.check();
+    rgd::UnsatCoreCache::fp_set_t fps{constraint_fp(e)};
+    if (unsat_cores_.covers(fps)) {
+      return opt_unsat;
+    }
+    for (size_t i = 1; i < task->size(); i++) {
+      fps.push_back(constraint_fp(task->at(i)));
+    }
+    std::sort(fps.begin(), fps.end());
+    bool known_unsat = task->size() > 1 && unsat_cores_.covers(fps);
+    // solve the first constraint (optimistic), the tracked constraints
+    // don't hold unless assumed
+    solver_.push();
+    solver_.add(e);
+    z3::model m(context_);
+    z3::check_result res = check_first(e, timeout, m);
     if (res == z3::sat) {
       ret = opt_sat;
-      // optimistic sat, save a model
-      z3::model m = solver.get_model();
+      // optimistic sat, the model is saved
       // check nested, if any
-      if (task->size() > 1) {
-        solver.push();
-        // add nested constraints
-        for (size_t i = 1; i < task->size(); i++) {
-          solver.add(task->at(i));
-        }
-        res = solver.check();
+      if (known_unsat) {
+        ret = opt_sat_nested_unsat;
+      } else if (task->size() > 1) {
+        res = solver_.check(assumptions);
         if (res == z3::sat) {
           ret = nested_sat;
-          m = solver.get_model();
+          m = solver_.get_model();
         } else if (res == z3::unsat) {
           ret = opt_sat_nested_unsat;
+          // the first constraint is asserted, it's in every core
+          rgd::UnsatCoreCache::fp_set_t core{constraint_fp(e)};
+          z3::expr_vector conflict = solver_.unsat_core();
+          for (unsigned i = 0; i < conflict.size(); i++) {
+            for (unsigned j = 0; j < assumptions.size(); j++) {
+              if (z3::eq(conflict[i], assumptions[j])) {
+                core.push_back(constraint_fp(task->at(j + 1)));
+                break;
+              }
+            }
+          }
+          unsat_cores_.add(std::move(core));
         } else {
           ret = opt_sat_nested_timeout;
         }
       } else {
         ret = nested_sat; // XXX: upgrade to nested_sat?
       }
+      solver_.pop();
       generate_solution(m, solutions);
-    } else if (res == z3::unsat) {
-      ret = opt_unsat;
-      //AOUT("\n%s\n", __z3_solver.to_smt2().c_str());
-      //AOUT("  tree_size = %d", __dfsan_label_info[label].tree_size);
     } else {
-      ret = opt_timeout;
+      solver_.pop();
+      if (res == z3::unsat) {
+        ret = opt_unsat;
+        unsat_cores_.add({constraint_fp(e)});
+        //AOUT("\n%s\n", __z3_solver.to_smt2().c_str());
+        //AOUT("  tree_size = %d", __dfsan_label_info[label].tree_size);
+      } else {
+        ret = opt_timeout;
+      }
     }
   } catch (z3::exception ze) {
+    // leave the scope of the task, if still in it
+    unsigned scopes = Z3_solver_get_num_scopes(context_, solver_);
+    if (scopes) solver_.pop(scopes);
     ret = unknown_error;
   }
 
   return ret;
 }
 
+Z3ParserSolver::solving_status
+Z3ParserSolver::solve_index_task(uint64_t task_id, unsigned timeout, size_t k,
+                                 std::vector<solution_t> &solutions) {
+  auto itr = index_ranges_.find(task_id);
+  if (itr == index_ranges_.end()) {
+    solution_t solution;
+    solving_status ret = solve_task(task_id, timeout, solution);
+    if (!solution.empty()) solutions.push_back(std::move(solution));
+    return ret;
+  }
+  auto task = retrieve_task(task_id);
+  if (task == nullptr) {
+    return invalid_task;
+  }
+
+  solving_status ret = opt_unsat;
+  try {
+    if (tracked_.size() + task->size() > kMaxTrackedConstraints) {
+      solver_.reset();
+      tracked_.clear();
+    }
+    solver_.set("timeout", timeout);
+    z3::expr_vector assumptions(context_);
+    for (size_t i = 1; i < task->size(); i++) {
+      assumptions.push_back(track_constraint(task->at(i)));
+    }
+
+    index_range const& range = itr->second;
+    z3::expr curr = context_.bv_val(range.curr, 64);
+    z3::expr dist = z3::ite(z3::uge(range.index, curr),
+                            range.index - curr, curr - range.index);
+    uint64_t far = 0;
+    if (range.curr >= range.lb) far = range.curr - range.lb;
+    if (range.curr < range.ub - 1) far = std::max(far, range.ub - 1 - range.curr);
+
+    solver_.push();
+    solver_.add(task->at(0));
+    while (solutions.size() < k) {
+      // the ends of the range first, as they're the likeliest to matter,
+      // then closer values; a few thresholds bound the queries per value
+      z3::check_result res = z3::unsat;
+      for (uint64_t t = far, n = 0; ; t /= 4, n++) {
+        if (n == 3) t = 0;
+        solver_.push();
+        if (t > 1) solver_.add(z3::uge(dist, context_.bv_val(t, 64)));
+        res = solver_.check(assumptions);
+        if (res == z3::sat) {
+          z3::model m = solver_.get_model();
+          uint64_t v = m.eval(range.index, true).get_numeral_uint64();
+          solution_t solution;
+          generate_solution(m, solution);
+          solver_.pop();
+          solutions.push_back(std::move(solution));
+          // block the value for the rest of the task
+          solver_.add(range.index != context_.bv_val(v, 64));
+          break;
+        }
+        solver_.pop();
+        if (res == z3::unknown || t <= 1) break;
+      }
+      if (res != z3::sat) {
+        if (solutions.empty()) ret = res == z3::unsat ? opt_unsat : opt_timeout;
+        break;
+      }
+    }
+    solver_.pop();
+    if (!solutions.empty()) ret = nested_sat;
+  } catch (z3::exception ze) {
+    unsigned scopes = Z3_solver_get_num_scopes(context_, solver_);
+    if (scopes) solver_.pop(scopes);
+    ret = solutions.empty() ? unknown_error : nested_sat;
+  }
+
+  return ret;
+}
+
+// a task as translated into the context of its own, with the fingerprints
+// of its constraints, which only the parser's context can compute
+struct Z3ParserSolver::async_job {
+  uint64_t task_id;
+  unsigned timeout;
+  z3::context context;
+  z3::expr_vector exprs;
+  rgd::UnsatCoreCache::fp_set_t fps;
+
+  async_job(uint64_t id, unsigned t, z3::expr_vector const& src)
+    : task_id(id), timeout(t), exprs(context, src) {}
+};
+
+void Z3ParserSolver::set_workers(unsigned n) {
+  if (n == num_workers_) return;
+  // the tasks of the old pool are still done, and their results polled
+  workers_.reset();
+  num_workers_ = n;
+  if (n) workers_ = std::make_unique<ThreadPool>(n);
+}
+
+bool Z3ParserSolver::submit_task(uint64_t task_id, unsigned timeout) {
+  if (!workers_) return false;
+  auto task = retrieve_task(task_id);
+  if (task == nullptr || task->empty()) return false;
+
+  std::shared_ptr<async_job> job;
+  try {
+    z3::expr_vector src(context_);
+    rgd::UnsatCoreCache::fp_set_t fps;
+    for (auto const& e : *task) {
+      src.push_back(e);
+      fps.push_back(constraint_fp(e));
+    }
+    job = std::make_shared<async_job>(task_id, timeout, src);
+    job->fps = std::move(fps);
+  } catch (z3::exception ze) {
+    return false;
+  }
+  pending_++;
+  workers_->enqueue([this, job]() { solve_async(*job); });
+  return true;
+}
+
+bool Z3ParserSolver::poll_result(uint64_t &task_id, solving_status &status,
+                                 solution_t &solutions, bool wait) {
+  if (pending_ == 0) return false;
+  std::unique_lock<std::mutex> lock(results_lock_);
+  if (wait) {
+    results_cv_.wait(lock, [this] { return !results_.empty(); });
+  } else if (results_.empty()) {
+    return false;
+  }
+  async_result &r = results_.front();
+  task_id = r.task_id;
+  status = r.status;
+  solutions = std::move(r.solutions);
+  results_.pop_front();
+  pending_--;
+  return true;
+}
+
+// solve_task on a worker: the nested constraints are only assumed through
+// guards, so the cores name them, but aren't kept past the task
+void Z3ParserSolver::solve_async(async_job &job) {
+  async_result r{job.task_id, unknown_error, {}};
+  z3::context &ctx = job.context;
+  try {
+    z3::expr e = job.exprs[0];
+    rgd::UnsatCoreCache::fp_set_t fps(job.fps);
+    std::sort(fps.begin(), fps.end());
+    if (unsat_cores_.covers({job.fps[0]})) {
+      r.status = opt_unsat;
+    } else {
+      bool known_unsat = job.exprs.size() > 1 && unsat_cores_.covers(fps);
+      z3::solver solver(ctx, "QF_BV");
+      solver.set("timeout", job.timeout);
+      z3::expr_vector assumptions(ctx);
+      for (unsigned i = 1; i < job.exprs.size(); i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "nested-%u", i - 1);
+        z3::expr guard = ctx.bool_const(name);
+        solver.add(z3::implies(guard, job.exprs[i]));
+        assumptions.push_back(guard);
+      }
+      solver.add(e);
+      // the chain is built in the job's context, once per job
+      z3::model m(ctx);
+      z3::check_result res;
+      rgd::Z3Tactics tactics(ctx, tactics_.c_str());
+      if (tactics.enabled()) {
+        z3::solver first = tactics.make_solver();
+        first.set("timeout", job.timeout);
+        first.add(e);
+        res = first.check();
+        if (res == z3::sat) m = first.get_model();
+      } else {
+        res = solver.check();
+        if (res == z3::sat) m = solver.get_model();
+      }
+      if (res == z3::sat) {
+        if (known_unsat) {
+          r.status = opt_sat_nested_unsat;
+        } else if (job.exprs.size() > 1) {
+          res = solver.check(assumptions);
+          if (res == z3::sat) {
+            r.status = nested_sat;
+            m = solver.get_model();
+          } else if (res == z3::unsat) {
+            r.status = opt_sat_nested_unsat;
+            rgd::UnsatCoreCache::fp_set_t core{job.fps[0]};
+            z3::expr_vector conflict = solver.unsat_core();
+            for (unsigned i = 0; i < conflict.size(); i++) {
+              for (unsigned j = 0; j < assumptions.size(); j++) {
+                if (z3::eq(conflict[i], assumptions[j])) {
+                  core.push_back(job.fps[j + 1]);
+                  break;
+                }
+              }
+            }
+            unsat_cores_.add(std::move(core));
+          } else {
+            r.status = opt_sat_nested_timeout;
+          }
+        } else {
+          r.status = nested_sat;
+        }
+        generate_solution(m, r.solutions);
+      } else if (res == z3::unsat) {
+        r.status = opt_unsat;
+        unsat_cores_.add({job.fps[0]});
+      } else {
+        r.status = opt_timeout;
+      }
+    }
+  } catch (z3::exception ze) {
+    r.status = unknown_error;
+    r.solutions.clear();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(results_lock_);
+    results_.push_back(std::move(r));
+  }
+  results_cv_.notify_one();
+}
+
 void Z3ParserSolver::generate_solution(z3::model &m, solution_t &solutions) {
   // from qsym
   unsigned num_constants = m.num_consts();
@@ -550,6 +1134,9 @@ void Z3ParserSolver::generate_solution(z3::model &m, solution_t &solutions) {
         sscanf(name.str().c_str(), input_name_format, &input, &offset);
         uint8_t value = (uint8_t)e.get_numeral_int();
         solutions.push_back({input, offset, value});
+      } else if (name.str().find("nested-") == 0) {
+        // guards of tracked constraints
+        continue;
       } else if (!name.str().compare("fsize")) {
         // FIXME:
         // off_t size = (off_t)e.get_numeral_int64();
@@ -566,23 +1153,16 @@ void Z3ParserSolver::generate_solution(z3::model &m, solution_t &solutions) {
         uint32_t input;
         uint32_t offset;
         int base;
-        char buf[64];
+        char buf[rgd::kMaxNumberLen];
         sscanf(name.str().c_str(), atoi_name_format, &input, &offset, &base);
-        const char *format = NULL;
-        switch (base) {
-          case 2: format = "%lb"; break;
-          case 8: format = "%lo"; break;
-          case 10: format = "%ld"; break;
-          case 16: format = "%lx"; break;
-          default: throw z3::exception("unsupported base");
-        }
         // XXX: assumed signed
-        int len = snprintf(buf, 64, format, (int)e.get_numeral_int());
-        // len excludes \0
-        for (int i = 0; i < len; ++i) {
-          solutions.push_back({input, offset + i, (uint8_t)buf[i]});
+        size_t len = rgd::encode_number((uint64_t)e.get_numeral_int(), base,
+                                        sizeof(int), 0, buf);
+        if (len == 0) throw z3::exception("unsupported base");
+        for (size_t i = 0; i < len; ++i) {
+          solutions.push_back({input, (uint32_t)(offset + i), (uint8_t)buf[i]});
         }
-        solutions.push_back({input, offset + len, 0});
+        solutions.push_back({input, (uint32_t)(offset + len), 0});
       } else {
         throw z3::exception("unknown symbol");
       }
@@ -7,7 +7,10 @@
 
 #include <z3++.h>
 
-#include <unordered_map>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <unordered_set>
 #include <utility>
 #include <vector>
@@ -28,18 +31,108 @@ static symsan::Z3ParserSolver *__z3_parser = nullptr;
 // filter?
 SANITIZER_INTERFACE_ATTRIBUTE THREADLOCAL uint32_t __taint_trace_callstack;
 
-static std::unordered_set<dfsan_label> __solved_labels;
-typedef std::pair<uint32_t, void*> trace_context;
+// an open-addressing table with linear probing, for the lookups on the
+// hooks' hot path; the empty key K() can't be stored, and the slots are
+// mmapped so the target's heap isn't touched
+template <typename K, typename V, typename Hash>
+class flat_table {
+  struct slot_t {
+    K key;
+    V value;
+  };
+  slot_t *slots_ = nullptr;
+  uptr mask_ = 0;
+  uptr size_ = 0;
+
+  slot_t *probe(const K &key) const {
+    uptr i = Hash()(key) & mask_;
+    while (!(slots_[i].key == key) && !(slots_[i].key == K()))
+      i = (i + 1) & mask_;
+    return &slots_[i];
+  }
+
+  void grow() {
+    slot_t *old = slots_;
+    uptr old_cap = slots_ ? mask_ + 1 : 0;
+    uptr cap = old_cap ? old_cap * 2 : 4096;
+    // MmapOrDie returns zeroed pages, i.e., all empty keys and zero values
+    slots_ = (slot_t*)MmapOrDie(cap * sizeof(slot_t), "flat table");
+    mask_ = cap - 1;
+    for (uptr i = 0; i < old_cap; i++) {
+      if (!(old[i].key == K()))
+        *probe(old[i].key) = old[i];
+    }
+    if (old)
+      UnmapOrDie(old, old_cap * sizeof(slot_t));
+  }
+
+ public:
+  V *find(const K &key) const {
+    if (!slots_)
+      return nullptr;
+    slot_t *s = probe(key);
+    return s->key == key ? &s->value : nullptr;
+  }
+
+  // the value of key, inserted as zero if absent
+  V &get(const K &key) {
+    // keep the load factor under 1/2
+    if ((size_ + 1) * 2 > (slots_ ? mask_ + 1 : 0))
+      grow();
+    slot_t *s = probe(key);
+    if (!(s->key == key)) {
+      s->key = key;
+      size_++;
+    }
+    return s->value;
+  }
+
+  bool contains(const K &key) const { return find(key) != nullptr; }
+  void insert(const K &key) { get(key) = 1; }
+};
+
+// finalizer of murmur3
+struct mix_hash {
+  uptr operator()(uint64_t k) const {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb3fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+  }
+};
+
+struct trace_context {
+  uint32_t callstack;
+  void *addr;
+  bool operator==(const trace_context &other) const {
+    return callstack == other.callstack && addr == other.addr;
+  }
+};
 struct context_hash {
-  std::size_t operator()(const trace_context &context) const {
-    return std::hash<uint32_t>{}(context.first) ^ std::hash<void*>{}(context.second);
+  uptr operator()(const trace_context &context) const {
+    return mix_hash()((uint64_t)(uptr)context.addr ^ ((uint64_t)context.callstack << 32));
   }
 };
-static std::unordered_map<trace_context, uint16_t, context_hash> __branches;
+
+static flat_table<dfsan_label, uint8_t, mix_hash> __solved_labels;
+static flat_table<trace_context, uint16_t, context_hash> __branches;
 static const uint16_t MAX_BRANCH_COUNT = 16;
-static const uint64_t MAX_GEP_INDEX = 0x10000;
-static std::unordered_set<uptr> __buffers;
+static flat_table<uptr, uint8_t, mix_hash> __buffers;
+
+// counts a visit of the branch at addr in the current context, returns
+// the count, or 0 once the branch is over its budget
+static inline uint16_t __visit_branch(void *addr) {
+  uint16_t &count = __branches.get({__taint_trace_callstack, addr});
+  if (count >= MAX_BRANCH_COUNT)
+    return 0;
+  return ++count;
+}
+
 
+// hashes of the inputs generated so far, with dedup_outputs
+static std::unordered_set<uint64_t> __generated;
 
 static void generate_input(symsan::Z3ParserSolver::solution_t &solutions) {
 
@@ -49,6 +142,23 @@ static void generate_input(symsan::Z3ParserSolver::solution_t &solutions) {
     return;
   }
 
+  // build the new input in one go, so it's written with a single write
+  std::vector<u8> buf((u8*)tainted.buf, (u8*)tainted.buf + tainted.size);
+  for (auto const& sol : solutions) {
+    if (sol.offset >= buf.size()) buf.resize(sol.offset + 1);
+    buf[sol.offset] = sol.val;
+  }
+
+  if (flags().dedup_outputs) {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (u8 b : buf) h = (h ^ b) * 0x100000001b3ULL;
+    if (!__generated.insert(h).second) {
+      AOUT("duplicate output, skipped\n");
+      return;
+    }
+  }
+
   char path[PATH_MAX];
   internal_snprintf(path, PATH_MAX, "%s/id-%d-%d-%d", __output_dir,
                     __instance_id, __session_id, __current_index++);
@@ -57,19 +167,14 @@ static void generate_input(symsan::Z3ParserSolver::solution_t &solutions) {
     AOUT("WARNING: failed to open new input file for write");
     return;
   }
-
-  if (!WriteToFile(fd, tainted.buf, tainted.size)) {
-    AOUT("WARNING: failed to copy original input\n");
-    CloseFile(fd);
-    return;
-  }
   AOUT("generate #%d output\n", __current_index - 1);
 
   for (auto const& sol : solutions) {
-    uint8_t value = sol.val;
-    AOUT("offset %d = %x\n", sol.offset, value);
-    internal_lseek(fd, sol.offset, SEEK_SET);
-    WriteToFile(fd, &value, sizeof(value));
+    AOUT("offset %d = %x\n", sol.offset, sol.val);
+  }
+
+  if (!WriteToFile(fd, buf.data(), buf.size())) {
+    AOUT("WARNING: failed to write new input\n");
   }
 
   // FIXME: fsize
@@ -79,7 +184,7 @@ static void generate_input(symsan::Z3ParserSolver::solution_t &solutions) {
 
 static inline bool __solve_task(uint64_t task_id) {
   symsan::Z3ParserSolver::solution_t solutions;
-  auto status = __z3_parser->solve_task(task_id, 5000U, solutions);
+  __z3_parser->solve_task(task_id, 5000U, solutions);
   if (solutions.size() != 0) {
     generate_input(solutions);
     return true;
@@ -88,6 +193,141 @@ static inline bool __solve_task(uint64_t task_id) {
   }
 }
 
+static inline bool __solve_index_task(uint64_t task_id) {
+  std::vector<symsan::Z3ParserSolver::solution_t> solutions;
+  __z3_parser->solve_index_task(task_id, 5000U, flags().gep_index_solutions,
+                                solutions);
+  for (auto & solution : solutions)
+    generate_input(solution);
+  return !solutions.empty();
+}
+
+// a branch, gep or offset snapshotted by the hooks; parsing and solving it
+// is left to the solver thread, so the target isn't stalled by z3
+struct solver_event {
+  enum kind_t { COND, SWITCH, GEP, OFFSET } kind;
+  // false if dropped because the queue is full, it's then only parsed for
+  // the nested constraints it adds
+  bool solve = true;
+  void *addr = nullptr;
+  dfsan_label label = 0;
+  // cond
+  uint8_t r = 0;
+  bool add_nested = false;
+  // switch
+  uint64_t cond = 0;
+  std::vector<uint64_t> cases;
+  std::vector<uint32_t> targets;
+  dfsan_label taken = 0;
+  // gep
+  dfsan_label ptr_label = 0;
+  uptr ptr = 0;
+  int64_t index = 0;
+  uint64_t num_elems = 0;
+  uint64_t elem_size = 0;
+  int64_t current_offset = 0;
+  // offset
+  int64_t offset = 0;
+};
+
+static void __process_event(solver_event &e) {
+  std::vector<uint64_t> tasks;
+  std::vector<std::pair<uint32_t, uint64_t>> case_tasks;
+  switch (e.kind) {
+    case solver_event::COND:
+      if (__z3_parser->parse_cond(e.label, e.r, e.add_nested, tasks)) {
+        AOUT("WARNING: failed to parse condition %d @%p\n", e.label, e.addr);
+        return;
+      }
+      break;
+    case solver_event::SWITCH:
+      if (__z3_parser->parse_switch(e.label, e.cond, e.cases, e.targets, e.taken,
+                                    case_tasks)) {
+        AOUT("WARNING: failed to parse switch %d @%p\n", e.label, e.addr);
+        return;
+      }
+      for (auto &task : case_tasks)
+        tasks.push_back(task.second);
+      break;
+    case solver_event::GEP:
+      if (__z3_parser->parse_gep(e.ptr_label, e.ptr, e.label, e.index, e.num_elems,
+                                 e.elem_size, e.current_offset, true, tasks)) {
+        AOUT("WARNING: failed to parse gep %d @%p\n", e.label, e.addr);
+        return;
+      }
+      break;
+    case solver_event::OFFSET:
+      if (__z3_parser->add_constraints(e.label, e.offset) != 0) {
+        Report("WARNING: adding constraints error\n");
+      }
+      return;
+  }
+
+  if (!e.solve)
+    return;
+
+  for (auto id : tasks) {
+    // solve
+    bool solved = e.kind == solver_event::GEP ? __solve_index_task(id)
+                                              : __solve_task(id);
+    if (solved) {
+      AOUT("branch solved\n");
+    } else {
+      AOUT("branch not solvable @%p\n", e.addr);
+    }
+  }
+}
+
+// the solver thread and its queue, started on the first event so it's
+// created in the traced process rather than a forkserver parent
+static std::mutex __queue_lock;
+static std::condition_variable __queue_cv;
+static std::deque<solver_event> __queue;
+static size_t __pending_solves = 0;
+static bool __stopping = false;
+static std::thread *__solver_thread = nullptr;
+
+static void __solver_loop() {
+  std::unique_lock<std::mutex> lock(__queue_lock);
+  while (true) {
+    __queue_cv.wait(lock, [] { return __stopping || !__queue.empty(); });
+    if (__queue.empty())
+      return;
+    solver_event e = std::move(__queue.front());
+    __queue.pop_front();
+    lock.unlock();
+    __process_event(e);
+    lock.lock();
+    if (e.solve)
+      __pending_solves -= 1;
+  }
+}
+
+// returns false if the event was dropped to constraint-only
+static bool __submit_event(solver_event &&e) {
+  uptr bound = flags().solver_queue_size;
+  if (bound == 0) {
+    __process_event(e);
+    return true;
+  }
+
+  std::lock_guard<std::mutex> lock(__queue_lock);
+  if (!__solver_thread)
+    __solver_thread = new std::thread(__solver_loop);
+  if (e.kind != solver_event::OFFSET) {
+    if (__pending_solves >= bound) {
+      AOUT("solver queue full, dropping %d @%p\n", e.label, e.addr);
+      e.solve = false;
+    } else {
+      __pending_solves += 1;
+    }
+  }
+  bool queued_solve = e.solve;
+  __queue.push_back(std::move(e));
+  __queue_cv.notify_one();
+  return queued_solve;
+}
+
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE void
 __taint_trace_cmp(dfsan_label op1, dfsan_label op2, uint32_t size, uint32_t predicate,
                   uint64_t c1, uint64_t c2, uint32_t cid) {
@@ -95,14 +335,9 @@ __taint_trace_cmp(dfsan_label op1, dfsan_label op2, uint32_t size, uint32_t pred
     return;
 
   void *addr = __builtin_return_address(0);
-  auto itr = __branches.find({__taint_trace_callstack, addr});
-  if (itr == __branches.end()) {
-    itr = __branches.insert({{__taint_trace_callstack, addr}, 1}).first;
-  } else if (itr->second < MAX_BRANCH_COUNT) {
-    itr->second += 1;
-  } else {
+  uint16_t count = __visit_branch(addr);
+  if (count == 0)
     return;
-  }
 
   AOUT("solving cmp: %u %u %u %d %llu %llu 0x%x @%p\n",
        op1, op2, size, predicate, c1, c2, cid, addr);
@@ -110,26 +345,18 @@ __taint_trace_cmp(dfsan_label op1, dfsan_label op2, uint32_t size, uint32_t pred
   dfsan_label temp = dfsan_union(op1, op2, (predicate << 8) | ICmp, size, c1, c2);
   uint8_t r = get_const_result(c1, c2, predicate);
 
-  if (__solved_labels.count(temp) != 0)
+  if (__solved_labels.contains(temp))
     return;
 
-  std::vector<uint64_t> tasks;
-  if (__z3_parser->parse_cond(temp, r, r, tasks)) {
-    AOUT("WARNING: failed to parse cmp %d @%p\n", temp, addr);
-    return;
-  }
-
-  for (auto id : tasks) {
-    // solve
-    if (__solve_task(id)) {
-      AOUT("cmp solved\n");
-    } else {
-      AOUT("cmp not solvable @%p\n", addr);
-    }
-  }
-
+  solver_event e;
+  e.kind = solver_event::COND;
+  e.addr = addr;
+  e.label = temp;
+  e.r = r;
+  e.add_nested = r;
   // mark as flipped
-  __solved_labels.insert(temp);
+  if (__submit_event(std::move(e)))
+    __solved_labels.insert(temp);
 }
 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE void
@@ -138,38 +365,64 @@ __taint_trace_cond(dfsan_label label, uint8_t r, uint32_t cid) {
     return;
 
   void *addr = __builtin_return_address(0);
-  auto itr = __branches.find({__taint_trace_callstack, addr});
-  if (itr == __branches.end()) {
-    itr = __branches.insert({{__taint_trace_callstack, addr}, 1}).first;
-  } else if (itr->second < MAX_BRANCH_COUNT) {
-    itr->second += 1;
-  } else {
+  uint16_t count = __visit_branch(addr);
+  if (count == 0)
     return;
-  }
 
   AOUT("solving cond: %u %u 0x%x 0x%x %p %u\n",
-       label, r, __taint_trace_callstack, cid, addr, itr->second);
+       label, r, __taint_trace_callstack, cid, addr, count);
 
-  if (__solved_labels.count(label) != 0)
+  if (__solved_labels.contains(label))
     return;
 
-  std::vector<uint64_t> tasks;
-  if (__z3_parser->parse_cond(label, r, true, tasks)) {
-    AOUT("WARNING: failed to parse condition %d @%p\n", label, addr);
+  solver_event e;
+  e.kind = solver_event::COND;
+  e.addr = addr;
+  e.label = label;
+  e.r = r;
+  e.add_nested = true;
+  // mark as flipped
+  if (__submit_event(std::move(e)))
+    __solved_labels.insert(label);
+}
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE void
+__taint_trace_switch(dfsan_label label, uint64_t cond, uint32_t size,
+                     const uint64_t *cases, uint32_t num_cases, uint32_t cid) {
+  if (label == 0)
     return;
-  }
 
-  for (auto id : tasks) {
-    // solve
-    if (__solve_task(id)) {
-      AOUT("branch solved\n");
-    } else {
-      AOUT("branch not solvable @%p\n", addr);
-    }
+  void *addr = __builtin_return_address(0);
+  uint16_t count = __visit_branch(addr);
+  if (count == 0)
+    return;
+
+  AOUT("solving switch: %u %llu %u %u 0x%x @%p\n",
+       label, cond, size, num_cases, cid, addr);
+
+  if (__solved_labels.contains(label))
+    return;
+
+  solver_event e;
+  e.kind = solver_event::SWITCH;
+  e.addr = addr;
+  e.label = label;
+  e.cond = cond;
+  e.cases.assign(cases, cases + num_cases);
+  // try every case but the taken one, and the default unless it's taken
+  for (uint32_t i = 0; i < num_cases; i++) {
+    if (cases[i] == cond && !e.taken)
+      e.taken = dfsan_union(CONST_LABEL, label, (bveq << 8) | ICmp, size,
+                            cond, cond);
+    else
+      e.targets.push_back(i);
   }
+  if (e.taken)
+    e.targets.push_back(num_cases);
 
   // mark as flipped
-  __solved_labels.insert(label);
+  if (__submit_event(std::move(e)))
+    __solved_labels.insert(label);
 }
 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE void
@@ -186,36 +439,32 @@ __taint_trace_gep(dfsan_label ptr_label, uint64_t ptr, dfsan_label index_label,
   if (index_label == 0)
     return;
 
-  if (__solved_labels.count(index_label) != 0)
+  if (__solved_labels.contains(index_label))
     return;
 
-  if (__buffers.count(ptr) != 0)
+  if (ptr && __buffers.contains(ptr))
     return;
 
   AOUT("tainted GEP index: %lld = %d, ne: %lld, es: %lld, offset: %lld\n",
       index, index_label, num_elems, elem_size, current_offset);
 
-  void *addr = __builtin_return_address(0);
-  std::vector<uint64_t> tasks;
-  if (__z3_parser->parse_gep(ptr_label, ptr, index_label, index, num_elems,
-                             elem_size, current_offset, true, tasks)) {
-    AOUT("WARNING: failed to parse gep %d @%p\n", index_label, addr);
-    return;
-  }
-
-  for (auto id : tasks) {
-    // solve
-    if (__solve_task(id)) {
-      AOUT("gep solved\n");
-    } else {
-      AOUT("gep not solvable @%p\n", addr);
-    }
-  }
+  solver_event e;
+  e.kind = solver_event::GEP;
+  e.addr = __builtin_return_address(0);
+  e.label = index_label;
+  e.ptr_label = ptr_label;
+  e.ptr = ptr;
+  e.index = index;
+  e.num_elems = num_elems;
+  e.elem_size = elem_size;
+  e.current_offset = current_offset;
 
   // mark as visited
-  __solved_labels.insert(index_label);
-  __buffers.insert(ptr);
-
+  if (__submit_event(std::move(e))) {
+    __solved_labels.insert(index_label);
+    if (ptr)
+      __buffers.insert(ptr);
+  }
 }
 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE void
@@ -223,12 +472,14 @@ __taint_trace_offset(dfsan_label offset_label, int64_t offset, unsigned size) {
   if (offset_label == 0)
     return;
 
-  if (__solved_labels.count(offset_label) != 0)
+  if (__solved_labels.contains(offset_label))
     return;
 
-  if (__z3_parser->add_constraints(offset_label, offset) != 0) {
-    Report("WARNING: adding constraints error\n");
-  }
+  solver_event e;
+  e.kind = solver_event::OFFSET;
+  e.label = offset_label;
+  e.offset = offset;
+  __submit_event(std::move(e));
 
   __solved_labels.insert(offset_label);
 }
@@ -237,8 +488,25 @@ extern "C" void InitializeSolver() {
   __output_dir = flags().output_dir;
   __instance_id = flags().instance_id;
   __session_id = flags().session_id;
-  __z3_parser = new symsan::Z3ParserSolver((void*)UnionTableAddr(), uniontable_size, __z3_context);
+  __z3_parser = new symsan::Z3ParserSolver((void*)UnionTableAddr(), union_table_size(), __z3_context);
+  if (!__z3_parser->set_tactics(flags().z3_tactics)) {
+    AOUT("WARNING: unknown z3 tactic in %s\n", flags().z3_tactics);
+  }
   std::vector<symsan::input_t> inputs;
   inputs.push_back({(u8*)tainted.buf, tainted.size});
   __z3_parser->restart(inputs);
 }
+
+// solves what's still queued, before the runtime unmaps the input
+extern "C" void FinalizeSolver() {
+  {
+    std::lock_guard<std::mutex> lock(__queue_lock);
+    if (!__solver_thread)
+      return;
+    __stopping = true;
+    __queue_cv.notify_one();
+  }
+  __solver_thread->join();
+  delete __solver_thread;
+  __solver_thread = nullptr;
+}
@@ -0,0 +1,98 @@
+#include "defs.h"
+#include "dfsan/dfsan.h"
+#include "launch.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+
+using namespace __dfsan;
+
+// traces program on input with a snapshot at its first symbolic branch,
+// then resumes the snapshot on resumed, an input that only differs from
+// input past the bytes read before the branch; the cond events of each
+// trace are printed with the site they come from
+
+// the branch the snapshot is taken at, the first one of the first trace
+static uint32_t __snapshot_id = 0;
+
+static const char *site(uint32_t id) {
+  return id == __snapshot_id ? "snapshot-site" : "other-site";
+}
+
+static void read_conds(symsan_session_t *s) {
+  pipe_msg msg;
+  while (symsan_session_read_event(s, &msg, sizeof(msg), 0) > 0) {
+    if (msg.msg_type != cond_type) {
+      printf("unexpected event %d\n", msg.msg_type);
+      continue;
+    }
+    if (!__snapshot_id) __snapshot_id = msg.id;
+    printf("cond %s result=%d tainted=%d\n", site(msg.id), (int)msg.result,
+           msg.label != 0);
+  }
+}
+
+static bool trace(symsan_session_t *s, const char *input, bool resume) {
+  int fd = open(input, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open input file: %s\n", strerror(errno));
+    return false;
+  }
+  int ret = resume ? symsan_session_resume(s, fd) : symsan_session_run(s, fd);
+  close(fd);
+  if (ret != 0) {
+    fprintf(stderr, "Failed to launch target: %d\n", ret);
+    return false;
+  }
+  read_conds(s);
+  return true;
+}
+
+int main(int argc, char* const argv[]) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s program input resumed\n", argv[0]);
+    exit(1);
+  }
+  char *program = argv[1];
+  char *input = argv[2];
+
+  symsan_session_t *s = symsan_session_new(program, uniontable_size);
+  if (!s) {
+    fprintf(stderr, "Failed to map shm: %s\n", strerror(errno));
+    exit(1);
+  }
+  char* args[3] = {program, input, NULL};
+  if (symsan_session_set_input(s, input) != 0 ||
+      symsan_session_set_args(s, 2, args) != 0 ||
+      symsan_session_set_branch_filter(s, 1) != 0 ||
+      symsan_session_set_snapshots(s, 1) != 0) {
+    fprintf(stderr, "Failed to set up the session\n");
+    exit(1);
+  }
+
+  printf("first run\n");
+  if (!trace(s, input, false)) exit(1);
+  if (symsan_session_mark_snapshot(s, __snapshot_id) != 0) {
+    fprintf(stderr, "Failed to mark the snapshot\n");
+    exit(1);
+  }
+
+  printf("snapshot run\n");
+  if (!trace(s, input, false)) exit(1);
+  uint32_t id;
+  uint64_t consumed, size;
+  int fresh = symsan_session_get_snapshot(s, &id, &consumed, &size);
+  printf("snapshot fresh=%d %s consumed=%llu size=%llu\n", fresh, site(id),
+         (unsigned long long)consumed, (unsigned long long)size);
+
+  printf("resumed run\n");
+  if (!trace(s, argv[3], true)) exit(1);
+
+  symsan_session_destroy(s);
+  exit(0);
+}
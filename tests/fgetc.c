@@ -0,0 +1,50 @@
+// RUN: rm -rf %t.out
+// RUN: mkdir -p %t.out
+// RUN: python -c'print("A"*20)' > %t.bin
+// RUN: clang -o %t.uninstrumented %s
+// RUN: %t.uninstrumented %t.bin | FileCheck --check-prefix=CHECK-ORIG %s
+// RUN: env KO_USE_FASTGEN=1 %ko-clang -o %t.fg %s
+// RUN: env TAINT_OPTIONS="taint_file=%t.bin output_dir=%t.out" %fgtest %t.fg %t.bin
+// RUN: cp %t.out/id-0-0-0 %t.bin
+// RUN: env TAINT_OPTIONS="taint_file=%t.bin output_dir=%t.out" %fgtest %t.fg %t.bin
+// RUN: cp %t.out/id-0-0-1 %t.bin
+// RUN: env TAINT_OPTIONS="taint_file=%t.bin output_dir=%t.out" %fgtest %t.fg %t.bin
+// RUN: %t.uninstrumented %t.out/id-0-0-2 | FileCheck --check-prefix=CHECK-GEN %s
+
+// the labels of bytes read one at a time through fgetc/getc, across an
+// ungetc and an fseek that move the stdio cursor
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lib.h"
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s [file]\n", argv[0]);
+    return -1;
+  }
+
+  char buf[20];
+  int c, n = 0;
+  FILE* fp = chk_fopen(argv[1], "rb");
+  while (n < 4 && (c = fgetc(fp)) != EOF)
+    buf[n++] = c;
+  // read again after an ungetc, as a tokenizer would
+  c = getc(fp);
+  ungetc(c, fp);
+  while (n < 8 && (c = getc(fp)) != EOF)
+    buf[n++] = c;
+  fseek(fp, 12, SEEK_SET);
+  c = fgetc(fp);
+  fclose(fp);
+
+  if (n == 8 && buf[1] == 'z' && buf[5] == 'a' && c == 'c') {
+    // CHECK-GEN: Good
+    printf("Good\n");
+  } else {
+    // CHECK-ORIG: Bad
+    printf("Bad\n");
+  }
+}
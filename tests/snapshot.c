@@ -0,0 +1,51 @@
+// RUN: python -c'print("A"*20)' > %t.bin
+// RUN: python -c'print("A"*6 + "Z" + "A"*13)' > %t.resumed
+// RUN: env KO_USE_FASTGEN=1 %ko-clang -o %t.fg %s
+// RUN: clang++ -std=c++14 %symsan-includes -o %t.driver %S/Inputs/snapshot_driver.cpp %symsan-launcher -lrt -lpthread
+// RUN: %t.driver %t.fg %t.bin %t.resumed | FileCheck %s
+
+// a snapshot taken at the first branch, after 4 bytes were read, resumed
+// on an input that takes the second branch the other way; the resumed run
+// starts with the cond of the snapshot branch and keeps its labels
+
+// CHECK: first run
+// CHECK-NEXT: cond snapshot-site result=1 tainted=1
+// CHECK-NEXT: cond other-site result=0 tainted=1
+// CHECK: snapshot run
+// CHECK-NEXT: cond snapshot-site result=1 tainted=1
+// CHECK-NEXT: cond other-site result=0 tainted=1
+// CHECK-NEXT: snapshot fresh=1 snapshot-site consumed=4 size=21
+// CHECK: resumed run
+// CHECK-NEXT: cond snapshot-site result=1 tainted=1
+// CHECK-NEXT: cond other-site result=1 tainted=1
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s [file]\n", argv[0]);
+    return -1;
+  }
+
+  char a[4], b[4];
+  int fd = open(argv[1], O_RDONLY);
+  if (fd < 0 || read(fd, a, sizeof(a)) != sizeof(a)) {
+    return 0;
+  }
+  if (a[0] == 'A') {
+    if (read(fd, b, sizeof(b)) != sizeof(b)) {
+      return 0;
+    }
+    if (b[2] == 'Z') {
+      printf("Good\n");
+    } else {
+      printf("Bad\n");
+    }
+  }
+  close(fd);
+}
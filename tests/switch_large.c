@@ -0,0 +1,71 @@
+// RUN: rm -rf %t.out
+// RUN: mkdir -p %t.out
+// RUN: python -c'print("A"*20)' > %t.bin
+// RUN: clang -o %t.uninstrumented %s
+// RUN: %t.uninstrumented %t.bin | FileCheck --check-prefix=CHECK-ORIG %s
+// RUN: env KO_USE_FASTGEN=1 %ko-clang -o %t.fg %s
+// RUN: env TAINT_OPTIONS="taint_file=%t.bin output_dir=%t.out" %fgtest %t.fg %t.bin
+// RUN: %t.uninstrumented %t.out/id-0-0-0 | FileCheck --check-prefix=CHECK-GEN1 %s
+// RUN: %t.uninstrumented %t.out/id-0-0-63 | FileCheck --check-prefix=CHECK-GEN2 %s
+// RUN: %t.uninstrumented %t.out/id-0-0-64 | FileCheck --check-prefix=CHECK-GEN3 %s
+// RUN: %t.uninstrumented %t.out/id-0-0-69 | FileCheck --check-prefix=CHECK-GEN4 %s
+// RUN: env KO_USE_Z3=1 %ko-clang -o %t.z3 %s
+// RUN: env TAINT_OPTIONS="taint_file=%t.bin output_dir=%t.out" %t.z3 %t.bin
+// RUN: %t.uninstrumented %t.out/id-0-0-0 | FileCheck --check-prefix=CHECK-GEN1 %s
+// RUN: %t.uninstrumented %t.out/id-0-0-63 | FileCheck --check-prefix=CHECK-GEN2 %s
+// RUN: %t.uninstrumented %t.out/id-0-0-64 | FileCheck --check-prefix=CHECK-GEN3 %s
+// RUN: %t.uninstrumented %t.out/id-0-0-69 | FileCheck --check-prefix=CHECK-GEN4 %s
+
+// a switch with more cases than fit the event on the stack, each case is
+// solved from the one switch event
+// CHECK-GEN1: Case 0
+// CHECK-GEN2: Case 63
+// CHECK-GEN3: Case 64
+// CHECK-GEN4: Case 69
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lib.h"
+
+#define CASE(n) \
+  case 1000 + n * 37: \
+    printf("Case " #n "\n"); \
+    break;
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s [file]\n", argv[0]);
+    return -1;
+  }
+
+  char buf[20];
+  FILE* fp = chk_fopen(argv[1], "rb");
+  chk_fread(buf, 1, sizeof(buf), fp);
+  fclose(fp);
+
+  int b = 0;
+  memcpy(&b, buf + 2, 4);
+
+  switch (b) {
+  CASE(0) CASE(1) CASE(2) CASE(3) CASE(4)
+  CASE(5) CASE(6) CASE(7) CASE(8) CASE(9)
+  CASE(10) CASE(11) CASE(12) CASE(13) CASE(14)
+  CASE(15) CASE(16) CASE(17) CASE(18) CASE(19)
+  CASE(20) CASE(21) CASE(22) CASE(23) CASE(24)
+  CASE(25) CASE(26) CASE(27) CASE(28) CASE(29)
+  CASE(30) CASE(31) CASE(32) CASE(33) CASE(34)
+  CASE(35) CASE(36) CASE(37) CASE(38) CASE(39)
+  CASE(40) CASE(41) CASE(42) CASE(43) CASE(44)
+  CASE(45) CASE(46) CASE(47) CASE(48) CASE(49)
+  CASE(50) CASE(51) CASE(52) CASE(53) CASE(54)
+  CASE(55) CASE(56) CASE(57) CASE(58) CASE(59)
+  CASE(60) CASE(61) CASE(62) CASE(63) CASE(64)
+  CASE(65) CASE(66) CASE(67) CASE(68) CASE(69)
+  default:
+    // CHECK-ORIG: Bad
+    printf("Bad\n");
+    break;
+  }
+}
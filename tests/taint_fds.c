@@ -0,0 +1,64 @@
+// RUN: rm -rf %t.out
+// RUN: mkdir -p %t.out
+// RUN: python -c'print("A"*20)' > %t.bin
+// RUN: clang -o %t.uninstrumented %s
+// RUN: %t.uninstrumented %t.bin | FileCheck --check-prefix=CHECK-ORIG %s
+// RUN: env KO_USE_FASTGEN=1 %ko-clang -o %t.fg %s
+// RUN: env TAINT_OPTIONS="taint_file=%t.bin output_dir=%t.out" %fgtest %t.fg %t.bin
+// RUN: cp %t.out/id-0-0-0 %t.bin
+// RUN: env TAINT_OPTIONS="taint_file=%t.bin output_dir=%t.out" %fgtest %t.fg %t.bin
+// RUN: cp %t.out/id-0-0-1 %t.bin
+// RUN: env TAINT_OPTIONS="taint_file=%t.bin output_dir=%t.out" %fgtest %t.fg %t.bin
+// RUN: %t.uninstrumented %t.out/id-0-0-2 | FileCheck --check-prefix=CHECK-GEN %s
+
+// two fds open on the taint file, each labels the bytes at its own offset,
+// and closing one leaves the other tainted
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int chk_open(const char *pathname) {
+  int fd = open(pathname, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open\n");
+    exit(0);
+  }
+  return fd;
+}
+
+static void chk_read(int fd, void *buf, size_t count) {
+  if (read(fd, buf, count) != (ssize_t)count) {
+    fprintf(stderr, "Failed to read");
+    exit(0);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s [file]\n", argv[0]);
+    return -1;
+  }
+
+  char a[8], b[4], c[4], d[4];
+  int fd1 = chk_open(argv[1]);
+  int fd2 = chk_open(argv[1]);
+  chk_read(fd1, a, sizeof(a));  // 0 - 7
+  chk_read(fd2, b, sizeof(b));  // 0 - 3
+  lseek(fd1, 12, SEEK_SET);
+  chk_read(fd1, c, sizeof(c));  // 12 - 15
+  close(fd1);
+  chk_read(fd2, d, sizeof(d));  // 4 - 7
+  close(fd2);
+
+  if (b[1] == 'k' && c[2] == 'm' && d[3] == 'n') {
+    // CHECK-GEN: Good
+    printf("Good\n");
+  } else {
+    // CHECK-ORIG: Bad
+    printf("Bad\n");
+  }
+}